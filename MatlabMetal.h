@@ -19,11 +19,43 @@ typedef uint64_t CommandQueueHandle;
 typedef uint64_t BufferHandle;
 typedef uint64_t CommandBufferHandle;
 typedef uint64_t CommandEncoderHandle;
+typedef uint64_t EventHandle;
+typedef uint64_t CommandListHandle;
 
 #define INVALID_HANDLE ( (uint64_t) 0 )
 #define MTL_SUCCESS 1
 #define MTL_ERROR 0
 
+#define MTL_MAP_READ 1
+#define MTL_MAP_WRITE 2
+#define MTL_MAP_READ_WRITE ( MTL_MAP_READ | MTL_MAP_WRITE )
+
+/** Modes of buffers mapped from files */
+#define MTL_FILE_READ_ONLY     0   // Shares the file's pages; writes to the buffer are rejected
+#define MTL_FILE_COPY_ON_WRITE 1   // Pages written are private copies; the file is never changed
+
+/** Element formats of float data held in buffers */
+#define MTL_FORMAT_FLOAT    0   // 32-bit IEEE float
+#define MTL_FORMAT_HALF     1   // 16-bit IEEE half (Metal half)
+#define MTL_FORMAT_BFLOAT16 2   // 16-bit brain float, the top half of a float
+
+
+
+/** Library compile options */
+#define MTL_COMPILE_FAST_MATH 1
+
+
+/** Command buffer execution status, matching the values of MTLCommandBufferStatus */
+#define MTL_COMMAND_BUFFER_NOT_ENQUEUED 0
+#define MTL_COMMAND_BUFFER_ENQUEUED 1
+#define MTL_COMMAND_BUFFER_COMMITTED 2
+#define MTL_COMMAND_BUFFER_SCHEDULED 3
+#define MTL_COMMAND_BUFFER_COMPLETED 4
+#define MTL_COMMAND_BUFFER_ERROR 5
+
+
+/** Timeout of mtlWaitForEvent that never expires */
+#define MTL_WAIT_FOREVER UINT64_MAX
 
 
 #define METALLIB_MAX_STRING_LENGTH 256
@@ -36,9 +68,232 @@ typedef struct {
     uint8_t IsHeadless;
     uint64_t recommendedMaxWorkingSetSize;
     uint64_t RegistryID;
+    uint32_t ComputeUnits;  // Worker threads of a CPU device, 0 where unknown (Metal)
+    uint32_t NumaNode;      // NUMA node a CPU device's memory and threads are on, 0 otherwise
 } mtlDeviceInfo;
 
 
+/**
+ * Library cache counters
+ **/
+typedef struct {
+    uint64_t memory_hits;
+    uint64_t disk_hits;
+    uint64_t misses;
+    uint64_t entries;
+} mtlLibraryCacheStats;
+
+
+/**
+ * Buffer pool counters of a device. Reserved bytes are held by the pool,
+ * whether handed out (in use) or idle.
+ **/
+typedef struct {
+    uint64_t reserved_bytes;
+    uint64_t in_use_bytes;
+    uint64_t hits;
+    uint64_t misses;
+} mtlBufferPoolStats;
+
+
+#define MTL_DISPATCH_MAX_BUFFERS 8
+
+/**
+ * One kernel dispatch of a batch. buffers[ i ] is bound at [[ buffer(i) ]]
+ * for i < num_buffers; an INVALID_HANDLE entry leaves the slot unbound. The
+ * grid is width x height x depth threads, in threadgroups of group_width x
+ * group_height x group_depth threads. Leave the group size zero to have it
+ * chosen as for mtlSetThreadsAndShape.
+ **/
+typedef struct {
+    ComputePipelineStateHandle compute_pipeline_state;
+    BufferHandle buffers[MTL_DISPATCH_MAX_BUFFERS];
+    uint32_t num_buffers;
+    uint32_t width;
+    uint32_t height;
+    uint32_t depth;
+    uint32_t group_width;
+    uint32_t group_height;
+    uint32_t group_depth;
+} mtlDispatch;
+
+
+/**
+ * The grid of an indirect dispatch, as a kernel writes it into a buffer: the
+ * number of threadgroups in each dimension. The layout matches Metal's
+ * MTLDispatchThreadgroupsIndirectArguments.
+ **/
+typedef struct {
+    uint32_t threadgroups[3];
+} mtlDispatchIndirectArguments;
+
+
+/**
+ * One argument of mtlStreamKernel, bound at [[ buffer(i) ]] for the i-th
+ * array. A streamed array holds element_size bytes per grid thread. Each
+ * chunk of the grid is dispatched over buffers holding only its own
+ * elements, so the kernel indexes them from 0 by thread_position_in_grid.
+ * The chunk of input is copied in before the chunk runs and the chunk of
+ * output is copied back after; input and output may be the same memory,
+ * and a streamed array with neither is per-chunk scratch. Setting buffer
+ * instead binds that buffer whole for every chunk.
+ **/
+typedef struct {
+    const void * input;       // Host data copied in for each chunk, or NULL
+    void * output;            // Host data each chunk is copied back to, or NULL
+    uint64_t element_size;    // Bytes per thread of a streamed array
+    BufferHandle buffer;      // A resident buffer, or INVALID_HANDLE to stream host data
+} mtlStreamArray;
+
+
+#define MTL_REDUCE_SUM    0
+#define MTL_REDUCE_MEAN   1
+#define MTL_REDUCE_MIN    2
+#define MTL_REDUCE_MAX    3
+#define MTL_REDUCE_ARGMIN 4
+#define MTL_REDUCE_ARGMAX 5
+#define MTL_REDUCE_NORM   6
+
+/** Reduce in a fixed order, so that repeated runs give bit-identical sums */
+#define MTL_REDUCE_DETERMINISTIC 1
+
+/**
+ * Result of a full buffer reduction. index is the zero-based element index of
+ * the minimum or maximum (NaNs are ignored, ties go to the lowest index; if
+ * every element is NaN the value is NaN at index zero) and is zero for the
+ * other operations.
+ **/
+typedef struct {
+    double value;
+    uint64_t index;
+} mtlReduction;
+
+
+#define MTL_ELEMENTWISE_MAX_PROGRAM   64
+#define MTL_ELEMENTWISE_MAX_INPUTS    16
+#define MTL_ELEMENTWISE_MAX_CONSTANTS 64
+#define MTL_ELEMENTWISE_MAX_STACK     16
+
+#define MTL_ELEMENTWISE_INPUT    0
+#define MTL_ELEMENTWISE_CONSTANT 1
+#define MTL_ELEMENTWISE_ADD      2
+#define MTL_ELEMENTWISE_SUBTRACT 3
+#define MTL_ELEMENTWISE_MULTIPLY 4
+#define MTL_ELEMENTWISE_DIVIDE   5
+#define MTL_ELEMENTWISE_MAX      6
+#define MTL_ELEMENTWISE_MIN      7
+#define MTL_ELEMENTWISE_NEGATE   8
+#define MTL_ELEMENTWISE_ABS      9
+
+/**
+ * One step of a fused element-wise program, evaluated on a stack for each
+ * element. MTL_ELEMENTWISE_INPUT pushes the element of input buffer operand
+ * and MTL_ELEMENTWISE_CONSTANT pushes constant operand; the other operations
+ * pop their arguments (the second from the top first) and push the result.
+ * MAX and MIN ignore a NaN argument, as maxval does. operand is unused by them.
+ **/
+typedef struct {
+    uint32_t opcode;
+    uint32_t operand;
+} mtlElementwiseOp;
+
+
+/**
+ * Timing of a command buffer committed while profiling was enabled. Times are
+ * in seconds on the clock of mtlProfileTime. start_time and end_time bound the
+ * execution: GPUStartTime and GPUEndTime on Metal, the command thread starting
+ * and finishing the command buffer on the CPU backend.
+ **/
+typedef struct {
+    double encode_start;    // First dispatch encoded, or zero if none were
+    double encode_end;      // Last dispatch encoded
+    double commit_time;
+    double start_time;
+    double end_time;
+    uint32_t num_dispatches;
+    uint32_t status;        // Final MTL_COMMAND_BUFFER_ status
+} mtlCommandBufferTiming;
+
+
+/**
+ * Timing of one dispatch of a profiled command buffer. Metal times whole
+ * command buffers only, so there start_time and end_time are those of the
+ * command buffer.
+ **/
+typedef struct {
+    char function_name[METALLIB_MAX_STRING_LENGTH];
+    double encode_time;
+    double start_time;
+    double end_time;
+    uint32_t width;
+    uint32_t height;
+    uint32_t depth;
+} mtlDispatchTiming;
+
+
+/**
+ * Totals of the host-side work recorded while profiling: copies into and out
+ * of buffers, commits and waits for completion. dropped_events counts events
+ * left out of the trace once it holds its maximum number.
+ **/
+typedef struct {
+    uint64_t copies_in;
+    uint64_t bytes_in;
+    double copy_in_seconds;
+    uint64_t copies_out;
+    uint64_t bytes_out;
+    double copy_out_seconds;
+    uint64_t commits;
+    double commit_seconds;
+    uint64_t waits;
+    double wait_seconds;
+    uint64_t dropped_events;
+} mtlProfileStats;
+
+
+/**
+ * Arguments handed to a host kernel by the CPU backend
+ *
+ * Buffers appear in the order of their [[ buffer(n) ]] index as set by
+ * mtlSetBuffer. Unbound slots are NULL with a length of zero. The grid is
+ * flattened so that a thread at (x, y, z) has the linear index
+ * x + width * ( y + height * z ).
+ **/
+typedef struct {
+    void * const * buffers;
+    const uint64_t * buffer_lengths;
+    uint32_t num_buffers;
+    uint32_t width;
+    uint32_t height;
+    uint32_t depth;
+} mtlHostKernelArgs;
+
+
+/**
+ * A host kernel processes the linear thread indices [ first_thread, last_thread )
+ * of a dispatch. It is called concurrently from several worker threads with
+ * disjoint ranges.
+ **/
+typedef void (*mtlHostKernel)( const mtlHostKernelArgs * args, uint64_t first_thread, uint64_t last_thread );
+
+
+/**
+ * Called once a committed command buffer has finished executing, with the
+ * handle it was registered through, its final status and the user data given
+ * at registration. Handlers run on a backend thread and must not block.
+ **/
+typedef void (*mtlCompletionHandler)( CommandBufferHandle command_buffer_handle, uint32_t status, void * user_data );
+
+
+/**
+ * Called once a buffer wrapping caller memory is released, which is after it
+ * has been freed and every command buffer using it has completed, with the
+ * wrapped memory and the user data given at creation. It may run on a
+ * backend thread.
+ **/
+typedef void (*mtlHostDeallocator)( void * pointer, uint64_t bytes, void * user_data );
+
+
 #ifdef  __cplusplus
 extern "C" {
 #endif
@@ -108,6 +363,7 @@ void mtlFreeDevice( DeviceHandle device_handle );
 
 #pragma mark Libraries
 /** Create a new library on a device from source code.
+ * Compiles with MTL_COMPILE_FAST_MATH, through the library cache.
  * @param device_handle Handle to a Device
  * @param source Null-terminated string of the source code to compile
  * @return LibraryHandle on success, INVALID_HANDLE on error.
@@ -115,6 +371,41 @@ void mtlFreeDevice( DeviceHandle device_handle );
 LibraryHandle mtlNewLibrary( DeviceHandle device_handle, const char * source );
 
 
+/** Create a new library on a device from source code with explicit compile options.
+ *
+ * Compiled libraries are cached by device, source and options. A repeated
+ * request returns a new handle to the cached library without compiling. If a
+ * cache directory is set, compiled artifacts are also stored there and
+ * reused by later processes.
+ * @param device_handle Handle to a Device
+ * @param source Null-terminated string of the source code to compile
+ * @param compile_options Zero or more MTL_COMPILE_ flags
+ * @return LibraryHandle on success, INVALID_HANDLE on error.
+ */
+LibraryHandle mtlNewLibraryWithOptions( DeviceHandle device_handle, const char * source, uint32_t compile_options );
+
+
+/** Set the directory for on-disk library cache artifacts
+ * The directory is created if needed. The MATLABMETAL_LIBRARY_CACHE
+ * environment variable sets the initial directory.
+ * @param directory Path of the directory, or NULL or an empty string to disable the on-disk cache
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlSetLibraryCacheDirectory( const char * directory );
+
+
+/** Retrieve the library cache counters
+ * @param stats Pointer to a struct to receive the counters
+ */
+void mtlGetLibraryCacheStats( mtlLibraryCacheStats * stats );
+
+
+/** Drop all in-memory library and pipeline state cache entries and reset the counters
+ * Handles to cached libraries and pipeline states stay valid. On-disk artifacts are kept.
+ */
+void mtlClearLibraryCache( void );
+
+
 /** Return the device on which the library was created.
  * @param library_handle Handle to a Library
  * @return DeviceHandle on success, INVALID_HANDLE on error.
@@ -152,6 +443,17 @@ void mtlFreeFunction( FunctionHandle function_handle );
 ComputePipelineStateHandle mtlNewComputePipelineState( DeviceHandle device_handle, FunctionHandle function_handle );
 
 
+/** Return a compute pipeline state for a function of a library, creating it on first use
+ * Pipeline states are cached per library and function name, so later calls
+ * return a new handle to the same pipeline state without creating a function.
+ * The pipeline state is on the library's device. Free the handle as usual.
+ * @param library_handle Handle to a Library
+ * @param function_name Name of the function defined in the library
+ * @return ComputePipelineStateHandle on success, INVALID_HANDLE on error.
+ */
+ComputePipelineStateHandle mtlComputePipelineStateForFunction( LibraryHandle library_handle, const char * function_name );
+
+
 /** Return the device on which the compute pipeline state was created
  * @param compute_pipeline_state_handle The handle of the compute pipeline state
  * @return DeviceHandle on succes, INVALID_HANDLE on error.
@@ -170,6 +472,13 @@ ComputePipelineStateHandle mtlCopyComputePipelineState( ComputePipelineStateHand
 uint32_t mtlThreadExecutionWidth( ComputePipelineStateHandle compute_pipeline_state_handle );
 
 
+/** Determine the largest number of threads in a threadgroup.
+ * On the CPU backend a threadgroup is the tile of threads a worker runs in one go.
+ * @param compute_pipeline_state_handle The handle of the compute pipeline state to query
+ */
+uint32_t mtlMaxTotalThreadsPerThreadgroup( ComputePipelineStateHandle compute_pipeline_state_handle );
+
+
 /** Free a pipeline state
  * @param compute_pipeline_state_handle The handle of the compute pipeline state to free
  */
@@ -206,6 +515,79 @@ void mtlFreeCommandQueue( CommandQueueHandle command_queue_handle );
 BufferHandle mtlNewBuffer( DeviceHandle device_handle, uint64_t bytes );
 
 
+/** Create a new buffer with storage from the device's buffer pool
+ * Freeing the buffer returns its storage to the pool, so buffers created and
+ * freed repeatedly reuse storage instead of allocating. Unlike mtlNewBuffer,
+ * the contents are not cleared. Free a pooled buffer only once work using it
+ * has been committed.
+ * @param device_handle The handle to the device on which the buffer will be created
+ * @param bytes Size of the buffer in bytes
+ * @return BufferHandle on success, INVALID_HANDLE on error.
+ */
+BufferHandle mtlNewPooledBuffer( DeviceHandle device_handle, uint64_t bytes );
+
+
+/** Create a new buffer over a range of a file
+ * The range is mapped into memory rather than read, so its pages are loaded
+ * as kernels first touch them and a dataset larger than RAM never needs to
+ * be held in full. The file must not be truncated while the buffer exists.
+ * A read-only buffer rejects copies into it, maps for writing and built-in
+ * operations writing to it, and is always bound as MTL_BUFFER_ACCESS_READ;
+ * a kernel must not write to it. On Metal, an offset or length that is not
+ * a multiple of the page size costs a read of the range into a new buffer
+ * instead of a mapping.
+ * @param device_handle The handle to the device on which the buffer will be created
+ * @param path Path of the file
+ * @param offset Byte offset of the range in the file
+ * @param length Size of the range in bytes; zero for the rest of the file
+ * @param mode MTL_FILE_READ_ONLY or MTL_FILE_COPY_ON_WRITE
+ * @return BufferHandle on success, INVALID_HANDLE on error.
+ */
+BufferHandle mtlNewBufferFromFile( DeviceHandle device_handle, const char * path, uint64_t offset, uint64_t length, uint32_t mode );
+
+
+/** Alignment of the memory mtlNewBufferWithHostPointer can wrap on a device
+ * @param device_handle The handle to the device
+ * @return The alignment in bytes (the page size on Metal), 0 on error
+ */
+uint64_t mtlHostPointerAlignment( DeviceHandle device_handle );
+
+
+/** Create a new buffer using caller memory as its storage, without a copy
+ * The buffer aliases the memory: kernels read and write it in place, and the
+ * caller sees their results once the command buffers complete. The caller
+ * keeps ownership. The memory must stay valid until the deallocator is
+ * called or, without one, until the buffer is freed and the command buffers
+ * using it have completed, and the caller must not touch it while they run.
+ * The pointer must be a multiple of mtlHostPointerAlignment; on Metal the
+ * size must be too, so allocate with posix_memalign or mmap rather than
+ * malloc.
+ * @param device_handle The handle to the device on which the buffer will be created
+ * @param pointer The memory to wrap
+ * @param bytes Size of the memory in bytes
+ * @param deallocator Called with pointer, bytes and user_data once the buffer is released, or NULL
+ * @param user_data Passed to the deallocator
+ * @return BufferHandle on success, INVALID_HANDLE on error.
+ */
+BufferHandle mtlNewBufferWithHostPointer( DeviceHandle device_handle, void * pointer, uint64_t bytes, mtlHostDeallocator deallocator, void * user_data );
+
+
+/** Retrieve the buffer pool counters of a device
+ * @param device_handle The handle to the device
+ * @param stats Pointer to a struct to receive the counters
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlGetBufferPoolStats( DeviceHandle device_handle, mtlBufferPoolStats * stats );
+
+
+/** Release idle buffer pool storage of a device
+ * @param device_handle The handle to the device
+ * @param max_idle_bytes Idle storage to keep for reuse; zero releases all of it
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlTrimBufferPool( DeviceHandle device_handle, uint64_t max_idle_bytes );
+
+
 /** Copy data into the GPU buffer
  * @param buffer_handle The handle to the buffer to copy data into
  * @param data A pointer to data to copy into the GPU buffer
@@ -224,6 +606,104 @@ uint32_t mtlCopyDataToBuffer( BufferHandle buffer_handle, const void * data, uin
 uint32_t mtlCopyDataFromBuffer( BufferHandle buffer_handle, void * data, uint64_t bytes );
 
 
+/** Copy data into part of a GPU buffer
+ * @param buffer_handle The handle to the buffer to copy data into
+ * @param offset Byte offset in the buffer at which to start writing
+ * @param data A pointer to data to copy into the GPU buffer
+ * @param bytes Number of bytes to copy
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCopyDataToBufferRange( BufferHandle buffer_handle, uint64_t offset, const void * data, uint64_t bytes );
+
+
+/** Copy data from part of a GPU buffer
+ * @param buffer_handle The handle to the buffer to copy data from
+ * @param offset Byte offset in the buffer at which to start reading
+ * @param data A pointer to copy the data into
+ * @param bytes Number of bytes to copy
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCopyDataFromBufferRange( BufferHandle buffer_handle, uint64_t offset, void * data, uint64_t bytes );
+
+
+/** Copy floats into a buffer, converting them to the buffer's element format
+ * Half and bfloat16 round to nearest even; half overflows to infinity.
+ * Large copies are converted in parallel by the CPU backend.
+ * @param buffer_handle The handle to the buffer to copy data into
+ * @param first_element Zero-based index of the first buffer element to write
+ * @param data The floats to copy
+ * @param count Number of elements to copy
+ * @param format One of the MTL_FORMAT_ element formats
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCopyFloatsToBuffer( BufferHandle buffer_handle, uint64_t first_element, const float * data, uint64_t count, uint32_t format );
+
+
+/** Copy elements of a buffer out as floats, converting them from the buffer's element format
+ * @param buffer_handle The handle to the buffer to copy data from
+ * @param first_element Zero-based index of the first buffer element to read
+ * @param data Receives count floats
+ * @param count Number of elements to copy
+ * @param format One of the MTL_FORMAT_ element formats
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCopyFloatsFromBuffer( BufferHandle buffer_handle, uint64_t first_element, float * data, uint64_t count, uint32_t format );
+
+
+/** Copy a block of elements into a sub-block of a three-dimensional array held in a GPU buffer
+ *
+ * The buffer holds a column-major array of buffer_dimensions elements. The
+ * data is a dense column-major array of region elements, which is written to
+ * the sub-block starting at origin. Two-dimensional arrays use a third
+ * dimension of one.
+ * @param buffer_handle The handle to the buffer to copy data into
+ * @param buffer_dimensions Dimensions of the array in the buffer, in elements
+ * @param origin Zero-based index of the first element of the sub-block in each dimension
+ * @param region Dimensions of the sub-block, in elements
+ * @param element_size Size of one element in bytes
+ * @param data A pointer to the region[0] * region[1] * region[2] elements to copy
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCopyRegionToBuffer( BufferHandle buffer_handle, const uint64_t buffer_dimensions[3], const uint64_t origin[3], const uint64_t region[3], uint32_t element_size, const void * data );
+
+
+/** Copy a sub-block of a three-dimensional array held in a GPU buffer into a dense array
+ * @param buffer_handle The handle to the buffer to copy data from
+ * @param buffer_dimensions Dimensions of the array in the buffer, in elements
+ * @param origin Zero-based index of the first element of the sub-block in each dimension
+ * @param region Dimensions of the sub-block, in elements
+ * @param element_size Size of one element in bytes
+ * @param data A pointer to room for region[0] * region[1] * region[2] elements
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCopyRegionFromBuffer( BufferHandle buffer_handle, const uint64_t buffer_dimensions[3], const uint64_t origin[3], const uint64_t region[3], uint32_t element_size, void * data );
+
+
+/** Map a buffer for direct host access to its storage
+ *
+ * The returned pointer addresses the buffer contents without any copy. With
+ * MTL_MAP_READ, results written by completed command buffers are made visible
+ * to the host first. Every successful map must be paired with mtlUnmapBuffer,
+ * and the pointer must not be used after unmapping or freeing the buffer.
+ * @param buffer_handle The handle to the buffer to map
+ * @param map_flags MTL_MAP_READ, MTL_MAP_WRITE or MTL_MAP_READ_WRITE
+ * @return A pointer to the buffer contents, NULL on error
+ */
+void * mtlMapBuffer( BufferHandle buffer_handle, uint32_t map_flags );
+
+
+/** Unmap a buffer previously mapped with mtlMapBuffer
+ *
+ * The host must report the byte range it modified so that the device sees the
+ * new contents. Pass a dirty_length of zero if nothing was written.
+ * @param buffer_handle The handle to the mapped buffer
+ * @param dirty_offset Offset in bytes of the first modified byte
+ * @param dirty_length Number of modified bytes
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlUnmapBuffer( BufferHandle buffer_handle, uint64_t dirty_offset, uint64_t dirty_length );
+
+
 /** Return the size of a buffer
  * @param buffer_handle The handle of the buffer to free
  * @return MTL_ERROR if the buffer is of zero size or does not exist, size of the allocated buffer otherwise.
@@ -273,6 +753,8 @@ void mtlFreeCommandBuffer( CommandBufferHandle command_buffer_handle );
 
 
 /** Commit a command buffer for execution
+ * Returns once the command buffer is queued. Use mtlCommandBufferStatus, a
+ * completion handler or one of the waits to find out when it has run.
  * @param command_buffer_handle The handle of the command buffer to free
  * @return MTL_SUCCESS or MTL_ERROR
  */
@@ -285,6 +767,113 @@ uint32_t mtlCommitCommandBuffer( CommandBufferHandle command_buffer_handle );
 uint32_t mtlWaitForCompletion( CommandBufferHandle command_buffer_handle );
 
 
+/** Query the execution status of a command buffer without blocking
+ * @param command_buffer_handle The handle of the command buffer
+ * @param status Receives one of the MTL_COMMAND_BUFFER_ status values
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCommandBufferStatus( CommandBufferHandle command_buffer_handle, uint32_t * status );
+
+
+/** Register a handler to call when a command buffer completes
+ * Handlers must be added before the command buffer is committed, and run in
+ * the order they were added.
+ * @param command_buffer_handle The handle of the command buffer
+ * @param handler The function to call on completion
+ * @param user_data Passed unchanged to the handler
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlAddCompletedHandler( CommandBufferHandle command_buffer_handle, mtlCompletionHandler handler, void * user_data );
+
+
+/** Wait until any one of several committed command buffers has completed
+ * @param command_buffer_handles Array of command buffer handles
+ * @param count Number of handles in the array
+ * @param completed_index Receives the zero-based index of a completed command buffer
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlWaitAnyCommandBuffer( const CommandBufferHandle * command_buffer_handles, uint32_t count, uint32_t * completed_index );
+
+
+/** Wait until all of several committed command buffers have completed
+ * @param command_buffer_handles Array of command buffer handles
+ * @param count Number of handles in the array
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlWaitAllCommandBuffers( const CommandBufferHandle * command_buffer_handles, uint32_t count );
+
+
+#pragma mark Events
+/**
+ * An event holds a 64-bit value, starting at zero, that command buffers and
+ * the host signal and wait for. A command buffer waiting for a value runs
+ * none of the commands encoded after the wait until the event reaches that
+ * value, so work on one queue can depend on work on another, or on the host,
+ * without the host waiting for completion in between. Signal increasing
+ * values, one per step of a pipeline.
+ */
+
+/** Create an event
+ * @param device_handle The device whose command buffers use the event
+ * @return A handle to an event or INVALID_HANDLE on error
+ */
+EventHandle mtlNewEvent( DeviceHandle device_handle );
+
+
+/** Free an event
+ * Command buffers already committed keep the event alive until they complete.
+ * @param event_handle The handle of the event to free
+ */
+void mtlFreeEvent( EventHandle event_handle );
+
+
+/** Return the value an event was last signalled with
+ * @param event_handle The handle of the event
+ * @param value Receives the value
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlEventSignaledValue( EventHandle event_handle, uint64_t * value );
+
+
+/** Signal an event from the host
+ * @param event_handle The handle of the event
+ * @param value The new value of the event
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlSignalEvent( EventHandle event_handle, uint64_t value );
+
+
+/** Wait on the host until an event reaches a value
+ * @param event_handle The handle of the event
+ * @param value The value to wait for; the wait ends once the event's value is at least this
+ * @param timeout_ms Milliseconds to wait at most, or MTL_WAIT_FOREVER
+ * @return MTL_SUCCESS once the value is reached, MTL_ERROR on timeout or error
+ */
+uint32_t mtlWaitForEvent( EventHandle event_handle, uint64_t value, uint64_t timeout_ms );
+
+
+/** Encode a signal of an event into a command buffer
+ * The event takes the value once all the commands encoded before the signal
+ * have completed. Encode it between command encoders.
+ * @param command_buffer_handle The handle of a command buffer not yet committed
+ * @param event_handle The handle of the event
+ * @param value The value to signal
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlEncodeSignalEvent( CommandBufferHandle command_buffer_handle, EventHandle event_handle, uint64_t value );
+
+
+/** Encode a wait for an event into a command buffer
+ * The commands encoded after the wait run once the event's value is at
+ * least the given one. Encode it between command encoders.
+ * @param command_buffer_handle The handle of a command buffer not yet committed
+ * @param event_handle The handle of the event
+ * @param value The value to wait for
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlEncodeWaitForEvent( CommandBufferHandle command_buffer_handle, EventHandle event_handle, uint64_t value );
+
+
 #pragma mark Command Encoders
 /** Create a command encoder
  * @param command_buffer_handle A handle to a command buffer on which to create the command encoder
@@ -293,6 +882,26 @@ uint32_t mtlWaitForCompletion( CommandBufferHandle command_buffer_handle );
 CommandEncoderHandle mtlNewCommandEncoder( CommandBufferHandle command_buffer_handle );
 
 
+/** Dispatch types of a command encoder */
+#define MTL_DISPATCH_SERIAL 0
+#define MTL_DISPATCH_CONCURRENT 1
+
+/** Create a command encoder whose dispatches run one after another or concurrently
+ * A serial encoder runs each dispatch after the previous one, as
+ * mtlNewCommandEncoder does. The dispatches of a concurrent encoder may
+ * overlap, except where one depends on another: a dispatch waits for the
+ * earlier dispatches of the encoder that write a buffer it binds, and, for
+ * each buffer it writes, for those that read it. Every buffer bound with
+ * mtlSetBuffer counts as written; bind buffers a kernel only reads with
+ * mtlSetBufferWithAccess and MTL_BUFFER_ACCESS_READ so they don't order
+ * dispatches. Dispatches of different encoders run in encoding order.
+ * @param command_buffer_handle A handle to a command buffer on which to create the command encoder
+ * @param dispatch_type MTL_DISPATCH_SERIAL or MTL_DISPATCH_CONCURRENT
+ * @return A handle to a command encoder or INVALID_HANDLE on error
+ */
+CommandEncoderHandle mtlNewCommandEncoderWithDispatchType( CommandBufferHandle command_buffer_handle, uint32_t dispatch_type );
+
+
 /** Free a command encoder
  * @param command_encoder_handle The handle of the command encoder to free
  */
@@ -309,12 +918,45 @@ uint32_t mtlSetComputePipelineState( CommandEncoderHandle command_encoder_handle
 /** Associate a GPU buffer with a command buffer via its command encoder
  * @param command_encoder_handle The handle of the command encoder to use
  * @param buffer_handle The handle of a buffer to associate with the command encoder
- * @param index The index of the association, zero-based.
+ * @param index The index of the association, zero-based, below MTL_DISPATCH_MAX_BUFFERS.
  * @return MTL_SUCCESS or MTL_ERROR
  */
 uint32_t mtlSetBuffer( CommandEncoderHandle command_encoder_handle, BufferHandle buffer_handle, uint32_t index );
 
 
+/** How a kernel uses a buffer bound to it */
+#define MTL_BUFFER_ACCESS_READ_WRITE 0
+#define MTL_BUFFER_ACCESS_READ 1
+
+/** Associate a buffer with the command encoder, saying whether the kernel writes it
+ * mtlSetBuffer binds with MTL_BUFFER_ACCESS_READ_WRITE. Dispatches that only
+ * read a buffer don't have to wait for each other, so this lets more of them
+ * overlap in a concurrent encoder. A kernel must not write a buffer bound
+ * with MTL_BUFFER_ACCESS_READ.
+ * @param command_encoder_handle The handle of the command encoder to use
+ * @param buffer_handle The handle of a buffer to associate with the command encoder
+ * @param index The index of the association, zero-based, below MTL_DISPATCH_MAX_BUFFERS.
+ * @param access MTL_BUFFER_ACCESS_READ_WRITE or MTL_BUFFER_ACCESS_READ
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlSetBufferWithAccess( CommandEncoderHandle command_encoder_handle, BufferHandle buffer_handle, uint32_t index, uint32_t access );
+
+
+#define MTL_MAX_INLINE_BYTES 4096
+
+/** Copy a small block of constant data into the command stream as a buffer argument
+ * The data is copied when called, so the caller's memory may be reused
+ * straight away. Use it instead of a buffer for scalars and small parameter
+ * blocks read through a constant pointer.
+ * @param command_encoder_handle The handle of the command encoder to use
+ * @param bytes Pointer to the data
+ * @param length Number of bytes, at most MTL_MAX_INLINE_BYTES
+ * @param index The index of the association, zero-based, below MTL_DISPATCH_MAX_BUFFERS.
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlSetBytes( CommandEncoderHandle command_encoder_handle, const void * bytes, uint64_t length, uint32_t index );
+
+
 /** Specify the thread count and organization
  * @param command_encoder_handle The handle of the command encoder to use
  * @param compute_pipeline_state_handle The handle of the compute pipeline state which will be executed
@@ -326,6 +968,59 @@ uint32_t mtlSetBuffer( CommandEncoderHandle command_encoder_handle, BufferHandle
 uint32_t mtlSetThreadsAndShape( CommandEncoderHandle command_encoder_handle, ComputePipelineStateHandle compute_pipeline_state_handle,  uint32_t width, uint32_t height, uint32_t depth );
 
 
+/** Specify the thread count with an explicit threadgroup size
+ * mtlSetThreadsAndShape uses the size found by mtlAutotuneThreadgroupSize
+ * for the pipeline and grid if there is one, otherwise a width of whole
+ * SIMD groups (see mtlThreadExecutionWidth). This sets the size directly.
+ * @param command_encoder_handle The handle of the command encoder to use
+ * @param compute_pipeline_state_handle The handle of the compute pipeline state which will be executed
+ * @param width The size of the first dimension
+ * @param height The size of the second dimension
+ * @param depth The size of the third dimension
+ * @param group_size Threadgroup width, height and depth, at most mtlMaxTotalThreadsPerThreadgroup threads
+ *        in total, or all zero to choose it as mtlSetThreadsAndShape does
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlSetThreadsAndThreadgroupShape( CommandEncoderHandle command_encoder_handle, ComputePipelineStateHandle compute_pipeline_state_handle,
+                                           uint32_t width, uint32_t height, uint32_t depth, const uint32_t group_size[3] );
+
+
+/** Dispatch a grid whose size is read from a buffer when the dispatch runs
+ * A kernel earlier in the command buffer (or any work that finished before
+ * it) can write the mtlDispatchIndirectArguments, so a kernel whose output
+ * size decides the next one's grid needs no readback and re-encode on the
+ * host. The grid is whole threadgroups of group_size, so kernels must check
+ * their thread position against the real element count. A zero count runs
+ * no threads. Profiling reports the grid an indirect dispatch ran on Linux,
+ * and zero on Metal, where it is never read back. On Linux, a grid dimension
+ * of more than UINT32_MAX threads fails the command buffer with
+ * MTL_COMMAND_BUFFER_ERROR, skipping the dispatches not yet run.
+ * @param command_encoder_handle The handle of the command encoder to use
+ * @param compute_pipeline_state_handle The handle of the compute pipeline state which will be executed
+ * @param indirect_buffer_handle The buffer holding the arguments, on the same device
+ * @param indirect_offset Byte offset of the arguments in the buffer, a multiple of 4
+ * @param group_size Threadgroup width, height and depth, at most mtlMaxTotalThreadsPerThreadgroup threads in total
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlDispatchThreadgroupsIndirect( CommandEncoderHandle command_encoder_handle, ComputePipelineStateHandle compute_pipeline_state_handle,
+                                          BufferHandle indirect_buffer_handle, uint64_t indirect_offset, const uint32_t group_size[3] );
+
+
+/** Find the fastest threadgroup size for a dispatch by timing candidate shapes
+ * Runs the dispatch on the queue (after any work already committed to it)
+ * several times for each candidate, then remembers the fastest size for its
+ * pipeline state and grid, so later dispatches of that grid without an
+ * explicit size use it. The kernel really runs, so give it scratch buffers
+ * unless it can safely run repeatedly. The group size of the dispatch is ignored.
+ * @param command_queue_handle A handle to the command queue to run on
+ * @param dispatch The dispatch to time
+ * @param repetitions Number of timed runs of each candidate
+ * @param group_size Receives the fastest threadgroup width, height and depth
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlAutotuneThreadgroupSize( CommandQueueHandle command_queue_handle, const mtlDispatch * dispatch, uint32_t repetitions, uint32_t group_size[3] );
+
+
 /** End encoding
  * @param command_encoder_handle The handle of the command encoder
  * @return MTL_SUCCESS or MTL_ERROR
@@ -333,6 +1028,251 @@ uint32_t mtlSetThreadsAndShape( CommandEncoderHandle command_encoder_handle, Com
 uint32_t mtlEndEncoding( CommandEncoderHandle command_encoder_handle );
 
 
+/** Encode a batch of dispatches into a command buffer
+ * The dispatches are checked before any is encoded, then encoded in order
+ * into a single compute command encoder, as if each had been set up with
+ * mtlSetComputePipelineState, mtlSetBuffer and mtlSetThreadsAndShape.
+ * @param command_buffer_handle The handle of a command buffer that has not been committed
+ * @param dispatches Array of dispatches, executed in order
+ * @param count Number of dispatches
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlEncodeDispatches( CommandBufferHandle command_buffer_handle, const mtlDispatch * dispatches, uint32_t count );
+
+
+/** Encode a batch of dispatches into a new command buffer and commit it
+ * Wait on the returned command buffer as usual, then free it.
+ * @param command_queue_handle A handle to the command queue to submit to
+ * @param dispatches Array of dispatches, executed in order
+ * @param count Number of dispatches
+ * @return A handle to the committed command buffer or INVALID_HANDLE on error
+ */
+CommandBufferHandle mtlSubmitDispatches( CommandQueueHandle command_queue_handle, const mtlDispatch * dispatches, uint32_t count );
+
+
+#pragma mark Command Lists
+/** Record a batch of dispatches once, to encode it any number of times
+ * The dispatches are checked and their objects and threadgroup sizes looked
+ * up now, so encoding the list is a single call that does neither. The list
+ * holds its pipeline states and buffers, which may be freed meanwhile. The
+ * CPU backend also plans here which dispatches run together and how their
+ * threads are split among the workers.
+ * @param device_handle The device the list runs on; its buffers must be on it
+ * @param dispatches Array of dispatches, executed in order
+ * @param count Number of dispatches
+ * @return CommandListHandle on success, INVALID_HANDLE on error.
+ */
+CommandListHandle mtlNewCommandList( DeviceHandle device_handle, const mtlDispatch * dispatches, uint32_t count );
+
+
+/** Change one buffer binding of a recorded command list
+ * Command buffers the list was already encoded into keep the bindings they
+ * were encoded with.
+ * @param command_list_handle The handle of the command list
+ * @param dispatch_index Zero-based index of the dispatch in the list
+ * @param buffer_index The [[ buffer(n) ]] index to bind, below MTL_DISPATCH_MAX_BUFFERS
+ * @param buffer_handle The buffer to bind, on the list's device
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCommandListSetBuffer( CommandListHandle command_list_handle, uint32_t dispatch_index, uint32_t buffer_index, BufferHandle buffer_handle );
+
+
+/** Encode a recorded command list into a command buffer
+ * @param command_buffer_handle The handle of a command buffer that has not been committed, on the list's device
+ * @param command_list_handle The handle of the command list
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlEncodeCommandList( CommandBufferHandle command_buffer_handle, CommandListHandle command_list_handle );
+
+
+/** Encode a recorded command list into a new command buffer and commit it
+ * Wait on the returned command buffer as usual, then free it.
+ * @param command_queue_handle A handle to the command queue to submit to
+ * @param command_list_handle The handle of the command list
+ * @return A handle to the committed command buffer or INVALID_HANDLE on error
+ */
+CommandBufferHandle mtlSubmitCommandList( CommandQueueHandle command_queue_handle, CommandListHandle command_list_handle );
+
+
+/** Free a command list
+ * @param command_list_handle The handle of the command list
+ */
+void mtlFreeCommandList( CommandListHandle command_list_handle );
+
+
+#pragma mark Reductions
+/** Reduce the first num_elements floats of a buffer to a single value
+ * Runs after the work already committed to the queue and waits for the result.
+ * Partial results are combined as a tree; sums are accumulated in double
+ * precision. NaNs propagate through sums but are skipped by min and max.
+ * @param command_queue_handle A handle to the command queue to run on
+ * @param buffer_handle Buffer of floats on the same device
+ * @param num_elements Number of floats to reduce, at least one
+ * @param operation One of the MTL_REDUCE_ operations
+ * @param flags Zero or MTL_REDUCE_DETERMINISTIC
+ * @param result Receives the value and, for min and max, the index
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlReduceBuffer( CommandQueueHandle command_queue_handle, BufferHandle buffer_handle, uint64_t num_elements,
+                          uint32_t operation, uint32_t flags, mtlReduction * result );
+
+
+/** Encode a reduction of a column-major float array along one dimension
+ * The destination has the shape of the source with that dimension set to one
+ * and receives floats, or zero-based uint32 indices for MTL_REDUCE_ARGMIN and
+ * MTL_REDUCE_ARGMAX. Each output is reduced in order, so results are deterministic.
+ * @param command_buffer_handle The handle of a command buffer that has not been committed
+ * @param source_handle Buffer holding the array
+ * @param dimensions Width, height and depth of the array in elements
+ * @param dimension Zero-based dimension to reduce along, 0 to 2
+ * @param operation One of the MTL_REDUCE_ operations
+ * @param destination_handle Buffer receiving the reduced array
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlEncodeReduceDimension( CommandBufferHandle command_buffer_handle, BufferHandle source_handle, const uint64_t dimensions[3],
+                                   uint32_t dimension, uint32_t operation, BufferHandle destination_handle );
+
+
+#pragma mark Element-wise Expressions
+/** Encode a fused element-wise program over float buffers
+ * Each of the num_elements outputs is computed in one pass from the same
+ * element of every input, so a chain of operations reads and writes memory
+ * once. The output may also be an input. On Metal, a kernel is generated for
+ * the program and compiled once per device and program shape; the constant
+ * values are passed with the dispatch, so changing them does not recompile.
+ * The CPU backend evaluates the program over tiles of elements on its workers.
+ * @param command_buffer_handle The handle of a command buffer that has not been committed
+ * @param program The operations, in postfix order, leaving one value and never
+ *                holding more than MTL_ELEMENTWISE_MAX_STACK values
+ * @param program_length Number of operations, at most MTL_ELEMENTWISE_MAX_PROGRAM
+ * @param input_handles Buffers read by MTL_ELEMENTWISE_INPUT
+ * @param num_inputs Number of inputs, at most MTL_ELEMENTWISE_MAX_INPUTS
+ * @param constants Values pushed by MTL_ELEMENTWISE_CONSTANT
+ * @param num_constants Number of constants, at most MTL_ELEMENTWISE_MAX_CONSTANTS
+ * @param output_handle Buffer receiving the results
+ * @param num_elements Number of elements to compute
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlEncodeElementwise( CommandBufferHandle command_buffer_handle, const mtlElementwiseOp * program, uint32_t program_length,
+                               const BufferHandle * input_handles, uint32_t num_inputs, const float * constants, uint32_t num_constants,
+                               BufferHandle output_handle, uint64_t num_elements );
+
+
+#pragma mark Streaming
+/** Run a kernel over host arrays larger than the device can hold
+ * The grid of num_threads threads is split into chunks that fit the memory
+ * budget three times over, and the chunks are pipelined: while the device
+ * runs one chunk, the host copies the results of the chunk before it out and
+ * the data of the chunk after it in. Each chunk is a one-dimensional
+ * dispatch on the command queue, so the kernel must handle each thread's
+ * elements independently (see mtlStreamArray). Returns once every chunk has
+ * been copied back.
+ * @param command_queue_handle The queue the chunks are committed to
+ * @param compute_pipeline_state_handle The kernel to run
+ * @param arrays The arguments, bound at buffer(0), buffer(1), ...
+ * @param num_arrays Number of arguments, at most MTL_DISPATCH_MAX_BUFFERS
+ * @param num_threads Threads of the whole grid
+ * @param memory_budget Bytes of device memory the stream may use, or 0 for
+ *                      half the device's recommendedMaxWorkingSetSize
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlStreamKernel( CommandQueueHandle command_queue_handle, ComputePipelineStateHandle compute_pipeline_state_handle,
+                          const mtlStreamArray * arrays, uint32_t num_arrays, uint64_t num_threads, uint64_t memory_budget );
+
+
+/** Stream one host input through a kernel into one host output
+ * As mtlStreamKernel with the input at buffer(0), the output at buffer(1)
+ * and the resident buffers from buffer(2) on.
+ * @param command_queue_handle The queue the chunks are committed to
+ * @param compute_pipeline_state_handle The kernel to run
+ * @param input Host data of num_threads * input_element_size bytes
+ * @param input_element_size Bytes of input per thread
+ * @param output Host memory receiving num_threads * output_element_size bytes
+ * @param output_element_size Bytes of output per thread
+ * @param resident_handles Buffers bound whole for every chunk
+ * @param num_resident Number of resident buffers, at most MTL_DISPATCH_MAX_BUFFERS - 2
+ * @param num_threads Threads of the whole grid
+ * @param memory_budget Bytes of device memory the stream may use, or 0 for the default
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlStreamKernelInOut( CommandQueueHandle command_queue_handle, ComputePipelineStateHandle compute_pipeline_state_handle,
+                               const void * input, uint64_t input_element_size, void * output, uint64_t output_element_size,
+                               const BufferHandle * resident_handles, uint32_t num_resident, uint64_t num_threads, uint64_t memory_budget );
+
+
+#pragma mark Profiling
+/** Turn profiling on or off
+ * While enabled, command buffers committed record their timing and every
+ * commit, wait, copy and command buffer is added to the trace, as is each
+ * dispatch on the CPU backend. Metal dispatches are not traced separately.
+ * Disabling keeps what was recorded. Profiling is off initially.
+ * @param enabled Nonzero to enable profiling
+ */
+void mtlSetProfilingEnabled( uint8_t enabled );
+
+
+/** Return nonzero if profiling is enabled */
+uint8_t mtlProfilingEnabled( void );
+
+
+/** Return the current time of the profile clock in seconds
+ * The clock is monotonic: mach absolute time on Metal, which GPUStartTime
+ * uses, and steady_clock on the CPU backend.
+ */
+double mtlProfileTime( void );
+
+
+/** Get the timing of a completed command buffer committed while profiling
+ * @param command_buffer_handle The handle of the command buffer
+ * @param timing Receives the timing
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlGetCommandBufferTiming( CommandBufferHandle command_buffer_handle, mtlCommandBufferTiming * timing );
+
+
+/** Get the timing of one dispatch of a completed, profiled command buffer
+ * @param command_buffer_handle The handle of the command buffer
+ * @param dispatch_index Zero-based index of the dispatch, in encoding order
+ * @param timing Receives the timing
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlGetDispatchTiming( CommandBufferHandle command_buffer_handle, uint32_t dispatch_index, mtlDispatchTiming * timing );
+
+
+/** Get the totals of the host-side work recorded since the profile was last cleared
+ * @param stats Receives the totals
+ */
+void mtlGetProfileStats( mtlProfileStats * stats );
+
+
+/** Write the recorded trace as a Chrome trace-event JSON file
+ * Load it in chrome://tracing or Perfetto. Timestamps are microseconds on
+ * the profile clock.
+ * @param path Name of the file to write
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlWriteProfileTrace( const char * path );
+
+
+/** Discard the recorded trace and totals
+ * Timing already recorded by command buffers is kept.
+ */
+void mtlClearProfile( void );
+
+
+#pragma mark Host Kernels
+/** Register a host implementation of a kernel function (CPU backend only)
+ * Functions declared in a library source with this name resolve to the host
+ * kernel when created with mtlNewFunction. Registering an existing name replaces it.
+ * Vectorized zerobuff, accumulate, maxval, scaleaccum (the kernels of
+ * MetalFunctionLibrary.mtl) and sqr are built in and need no registration.
+ * @param function_name Name of the kernel function as declared in the library source
+ * @param kernel The host kernel implementing the function
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlRegisterHostKernel( const char * function_name, mtlHostKernel kernel );
+
+
 
 #ifdef  __cplusplus
 }
@@ -6,6 +6,28 @@ classdef Metal < CoderAPI  %#codegen
     properties (Constant)
         HandleBaseType = 'uint64';
         InvalidHandle = uint64(0);
+        MaxDispatchBuffers = 8;     % MTL_DISPATCH_MAX_BUFFERS in MatlabMetal.h
+        FormatFloat = 0;            % MTL_FORMAT_ element formats in MatlabMetal.h
+        FormatHalf = 1;
+        FormatBFloat16 = 2;
+        ReduceSum = 0;              % MTL_REDUCE_ operations in MatlabMetal.h
+        ReduceMean = 1;
+        ReduceMin = 2;
+        ReduceMax = 3;
+        ReduceArgMin = 4;
+        ReduceArgMax = 5;
+        ReduceNorm = 6;
+        ReduceDeterministic = 1;    % MTL_REDUCE_DETERMINISTIC in MatlabMetal.h
+        ElementwiseMaxProgram = 64;     % MTL_ELEMENTWISE_MAX_PROGRAM in MatlabMetal.h
+        ElementwiseMaxInputs = 16;      % MTL_ELEMENTWISE_MAX_INPUTS in MatlabMetal.h
+        ElementwiseMaxConstants = 64;   % MTL_ELEMENTWISE_MAX_CONSTANTS in MatlabMetal.h
+        ElementwiseMaxStack = 16;       % MTL_ELEMENTWISE_MAX_STACK in MatlabMetal.h
+        DispatchSerial = 0;         % MTL_DISPATCH_ encoder types in MatlabMetal.h
+        DispatchConcurrent = 1;
+        BufferAccessReadWrite = 0;  % MTL_BUFFER_ACCESS_ hints in MatlabMetal.h
+        BufferAccessRead = 1;
+        FileReadOnly = 0;           % MTL_FILE_ modes in MatlabMetal.h
+        FileCopyOnWrite = 1;
     end
     
    
@@ -61,11 +83,12 @@ classdef Metal < CoderAPI  %#codegen
                     
                     buildInfo.addLinkObjects( libName, libPath, ...
                         libPriority, libPreCompiled, libLinkOnly, libGroup);
-                    buildInfo.addLinkFlags( '-framework Metal -framework Foundation');
+                    buildInfo.addLinkFlags( '-framework Metal -framework Foundation -lc++');
                     
                 case 'GLNXA64'
                     buildInfo.addLinkObjects( libName, libPath, ...
                         libPriority, libPreCompiled, libLinkOnly, libGroup);
+                    buildInfo.addLinkFlags( '-pthread' );
                     
             end
             
@@ -94,18 +117,23 @@ classdef Metal < CoderAPI  %#codegen
                     
                 case 'GLNXA64'
                     codepath = fullfile(rootdir, 'libMatlabMetal', 'MatlabMetal');
-                    sourcefile = fullfile(codepath, 'MatlabMetal.cpp');
+                    sourcefiles = dir(fullfile(codepath, '*.cpp'));
 
-                    objfile = fullfile(codepath, 'matlabmetal.o');
-
-                    
-                    % Compile the main CPP file
-                    command = ['g++ -std=c++11 -fPIC -c ', sourcefile, ' -o ', objfile ];
-                    system(command);
+                    objfiles = '';
+                    for i = 1:numel(sourcefiles)
+                        sourcefile = fullfile(codepath, sourcefiles(i).name);
+                        [~, basename] = fileparts(sourcefile);
+                        objfile = fullfile(codepath, [lower(basename), '.o']);
+                        
+                        % Compile the CPU backend sources
+                        command = ['g++ -std=c++11 -O3 -fPIC -pthread -c ', sourcefile, ' -o ', objfile ];
+                        system(command);
+                        objfiles = [objfiles, ' ', objfile]; %#ok<AGROW>
+                    end
 
                     
                     % Make an archive
-                    command = ['ar rs ', libfile, ' ', objfile];
+                    command = ['ar rs ', libfile, objfiles];
                     system(command);
                     
                     copyfile(fullfile(codepath, 'MatlabMetal.h'), rootdir, 'f');
@@ -170,6 +198,26 @@ classdef Metal < CoderAPI  %#codegen
                 coder.typeof(uint64(0)), ...
                 VarStringType );
             
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'NewLibraryWithOptions', ...
+                1, ...
+                coder.typeof(uint64(0)), ...
+                VarStringType, ...
+                coder.typeof(uint32(0)) );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'SetLibraryCacheDirectory', ...
+                1, ...
+                VarStringType );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'LibraryCacheStats', ...
+                1);
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'ClearLibraryCache', ...
+                0);
+            
             list = CoderAPI.AddMethodAndArgs( list, ...
                 'LibraryDevice', ...
                 1, ...
@@ -197,6 +245,12 @@ classdef Metal < CoderAPI  %#codegen
                 Metal.HandleBaseTypeClass , ...
                 Metal.HandleBaseTypeClass );
             
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'ComputePipelineStateForFunction', ...
+                1, ...
+                Metal.HandleBaseTypeClass , ...
+                VarStringType );
+            
             list = CoderAPI.AddMethodAndArgs( list, ...
                 'ComputePipelineStateDevice', ...
                 1, ...
@@ -212,6 +266,11 @@ classdef Metal < CoderAPI  %#codegen
                 1, ...
                 Metal.HandleBaseTypeClass );
             
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'MaxTotalThreadsPerThreadgroup', ...
+                1, ...
+                Metal.HandleBaseTypeClass );
+            
             list = CoderAPI.AddMethodAndArgs( list, ...
                 'FreeComputePipelineState', ...
                 0, ...
@@ -237,6 +296,32 @@ classdef Metal < CoderAPI  %#codegen
                 1, ...
                 Metal.HandleBaseTypeClass, ...
                 coder.typeof(0));
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'NewPooledBuffer', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof(0));
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'NewBufferFromFile', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                VarStringType, ...
+                coder.typeof(0), ...
+                coder.typeof(0), ...
+                coder.typeof(0));
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'BufferPoolStats', ...
+                2, ...
+                Metal.HandleBaseTypeClass );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'TrimBufferPool', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof(0));
                         
             list = CoderAPI.AddMethodAndArgs( list, ...
                 'CopyDataToBuffer', ...
@@ -273,6 +358,72 @@ classdef Metal < CoderAPI  %#codegen
                 Metal.HandleBaseTypeClass, ...
                 coder.typeof( double(0), [1 3]) );
             
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'CopyFloatsToBuffer', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof(single(0), [Inf Inf Inf] ), ...
+                coder.typeof(0) );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'CopyFloatsFromBuffer', ...
+                2, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof( double(0), [1 3]), ...
+                coder.typeof(0) );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'CopyDataToBufferRange', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof(0), ...
+                coder.typeof(uint8(0), [1 Inf] ));
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'CopyDataFromBufferRange', ...
+                2, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof(0), ...
+                coder.typeof(0) );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'CopyUInt16RegionToBuffer', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof( double(0), [1 3]), ...
+                coder.typeof( double(0), [1 3]), ...
+                coder.typeof(uint16(0), [Inf Inf Inf] ));
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'CopyUInt16RegionFromBuffer', ...
+                2, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof( double(0), [1 3]), ...
+                coder.typeof( double(0), [1 3]), ...
+                coder.typeof( double(0), [1 3]) );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'CopySingleRegionToBuffer', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof( double(0), [1 3]), ...
+                coder.typeof( double(0), [1 3]), ...
+                coder.typeof(single(0), [Inf Inf Inf] ));
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'CopySingleRegionFromBuffer', ...
+                2, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof( double(0), [1 3]), ...
+                coder.typeof( double(0), [1 3]), ...
+                coder.typeof( double(0), [1 3]) );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'CopyBufferToBuffer', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                Metal.HandleBaseTypeClass );
+            
             list = CoderAPI.AddMethodAndArgs( list, ...
                 'BufferSize', ...
                 1, ...
@@ -318,11 +469,74 @@ classdef Metal < CoderAPI  %#codegen
                 1, ...
                 Metal.HandleBaseTypeClass );
             
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'CommandBufferStatus', ...
+                2, ...
+                Metal.HandleBaseTypeClass );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'WaitAnyCommandBuffer', ...
+                2, ...
+                coder.typeof( cast( 0, Metal.HandleBaseType), [1 Inf] ) );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'WaitAllCommandBuffers', ...
+                1, ...
+                coder.typeof( cast( 0, Metal.HandleBaseType), [1 Inf] ) );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'NewEvent', ...
+                1, ...
+                Metal.HandleBaseTypeClass );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'FreeEvent', ...
+                0, ...
+                Metal.HandleBaseTypeClass );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'EventSignaledValue', ...
+                2, ...
+                Metal.HandleBaseTypeClass );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'SignalEvent', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof(0) );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'WaitForEvent', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof(0), ...
+                coder.typeof(0) );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'EncodeSignalEvent', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof(0) );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'EncodeWaitForEvent', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof(0) );
+            
             list = CoderAPI.AddMethodAndArgs( list, ...
                 'NewCommandEncoder', ...
                 1, ...
                 Metal.HandleBaseTypeClass );
             
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'NewCommandEncoderWithDispatchType', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof(0) );
+            
             list = CoderAPI.AddMethodAndArgs( list, ...
                 'FreeCommandEncoder', ...
                 0, ...
@@ -341,6 +555,21 @@ classdef Metal < CoderAPI  %#codegen
                 Metal.HandleBaseTypeClass, ...
                 coder.typeof(0) );
             
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'SetBufferWithAccess', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof(0), ...
+                coder.typeof(0) );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'SetBytes', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof(uint8(0), [1 Inf] ), ...
+                coder.typeof(0) );
+            
             list = CoderAPI.AddMethodAndArgs( list, ...
                 'SetThreadsAndShape', ...
                 1, ...
@@ -348,11 +577,162 @@ classdef Metal < CoderAPI  %#codegen
                 Metal.HandleBaseTypeClass, ...
                 coder.typeof(0, [1 3], [0 1] ) );
             
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'SetThreadsAndThreadgroupShape', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof(0, [1 3], [0 1] ), ...
+                coder.typeof(0, [1 3], [0 1] ) );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'DispatchThreadgroupsIndirect', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                Metal.HandleBaseTypeClass, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof(0), ...
+                coder.typeof(0, [1 3], [0 1] ) );
+            
             list = CoderAPI.AddMethodAndArgs( list, ...
                 'EndEncoding', ...
                 1, ...
                 Metal.HandleBaseTypeClass );
             
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'EncodeDispatches', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof( cast( 0, Metal.HandleBaseType), [Inf 1] ), ...
+                coder.typeof( cast( 0, Metal.HandleBaseType), [Inf Metal.MaxDispatchBuffers] ), ...
+                coder.typeof( 0, [Inf 3] ) );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'SubmitDispatches', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof( cast( 0, Metal.HandleBaseType), [Inf 1] ), ...
+                coder.typeof( cast( 0, Metal.HandleBaseType), [Inf Metal.MaxDispatchBuffers] ), ...
+                coder.typeof( 0, [Inf 3] ) );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'NewCommandList', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof( cast( 0, Metal.HandleBaseType), [Inf 1] ), ...
+                coder.typeof( cast( 0, Metal.HandleBaseType), [Inf Metal.MaxDispatchBuffers] ), ...
+                coder.typeof( 0, [Inf 3] ) );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'CommandListSetBuffer', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof(0), ...
+                coder.typeof(0), ...
+                Metal.HandleBaseTypeClass );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'EncodeCommandList', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                Metal.HandleBaseTypeClass );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'SubmitCommandList', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                Metal.HandleBaseTypeClass );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'FreeCommandList', ...
+                0, ...
+                Metal.HandleBaseTypeClass );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'AutotuneThreadgroupSize', ...
+                2, ...
+                Metal.HandleBaseTypeClass, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof( cast( 0, Metal.HandleBaseType), [1 Metal.MaxDispatchBuffers] ), ...
+                coder.typeof( 0, [1 3] ), ...
+                coder.typeof( 0 ) );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'ReduceBuffer', ...
+                3, ...
+                Metal.HandleBaseTypeClass, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof(0), ...
+                coder.typeof(0), ...
+                coder.typeof(0) );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'EncodeReduceDimension', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof(0, [1 3], [0 1] ), ...
+                coder.typeof(0), ...
+                coder.typeof(0), ...
+                Metal.HandleBaseTypeClass );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'EncodeElementwise', ...
+                1, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof( 0, [1 Metal.ElementwiseMaxProgram], [0 1] ), ...
+                coder.typeof( 0, [1 Metal.ElementwiseMaxProgram], [0 1] ), ...
+                coder.typeof( cast( 0, Metal.HandleBaseType), [1 Metal.ElementwiseMaxInputs], [0 1] ), ...
+                coder.typeof( single(0), [1 Metal.ElementwiseMaxConstants], [0 1] ), ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof(0) );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'StreamKernel', ...
+                2, ...
+                Metal.HandleBaseTypeClass, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof( single(0), [Inf Inf Inf] ), ...
+                coder.typeof( cast( 0, Metal.HandleBaseType), [1 Metal.MaxDispatchBuffers-2], [0 1] ), ...
+                coder.typeof(0) );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'SetProfilingEnabled', ...
+                0, ...
+                coder.typeof(0) );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'ProfilingEnabled', ...
+                1);
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'ProfileTime', ...
+                1);
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'CommandBufferTiming', ...
+                2, ...
+                Metal.HandleBaseTypeClass );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'DispatchTiming', ...
+                2, ...
+                Metal.HandleBaseTypeClass, ...
+                coder.typeof(0) );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'ProfileStats', ...
+                1);
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'WriteProfileTrace', ...
+                1, ...
+                VarStringType );
+            
+            list = CoderAPI.AddMethodAndArgs( list, ...
+                'ClearProfile', ...
+                0);
+            
         end
 
         
@@ -370,19 +750,163 @@ classdef Metal < CoderAPI  %#codegen
                 'IsLowPower', uint8(0), ...
                 'IsHeadless', uint8(0), ...
                 'recommendedMaxWorkingSetSize', uint64(0), ...
-                'RegistryID', uint64(0) ...
+                'RegistryID', uint64(0), ...
+                'ComputeUnits', uint32(0), ...
+                'NumaNode', uint32(0) ...
                 );
             coder.cstructname(devInfoStruct, 'mtlDeviceInfo','extern','HeaderFile', 'MatlabMetal.h');
         end
         
-        function devInfoStruct = ConvertRawDeviceInfoToMatlab( rawStruct )
-            %ConvertRawDeviceInfoToMatlab Returns a Matlab friendly device info struct
-            devInfoStruct = struct(...
-                'name', string( trimszString( rawStruct.name)), ...
-                'IsLowPower', logical( rawStruct.IsLowPower ), ...
-                'IsHeadless', logical( rawStruct.IsHeadless ), ...
+        function statsStruct = rawLibraryCacheStatsStruct
+            %rawLibraryCacheStatsStruct Returns an allocated mtlLibraryCacheStats
+            %struct associated with the header file.
+            
+            statsStruct = struct(...
+                'memory_hits', uint64(0), ...
+                'disk_hits', uint64(0), ...
+                'misses', uint64(0), ...
+                'entries', uint64(0) ...
+                );
+            coder.cstructname(statsStruct, 'mtlLibraryCacheStats','extern','HeaderFile', 'MatlabMetal.h');
+        end
+        
+        function statsStruct = rawBufferPoolStatsStruct
+            %rawBufferPoolStatsStruct Returns an allocated mtlBufferPoolStats
+            %struct associated with the header file.
+            
+            statsStruct = struct(...
+                'reserved_bytes', uint64(0), ...
+                'in_use_bytes', uint64(0), ...
+                'hits', uint64(0), ...
+                'misses', uint64(0) ...
+                );
+            coder.cstructname(statsStruct, 'mtlBufferPoolStats','extern','HeaderFile', 'MatlabMetal.h');
+        end
+        
+        function timingStruct = rawCommandBufferTimingStruct
+            %rawCommandBufferTimingStruct Returns an allocated
+            %mtlCommandBufferTiming struct associated with the header file.
+            
+            timingStruct = struct(...
+                'encode_start', double(0), ...
+                'encode_end', double(0), ...
+                'commit_time', double(0), ...
+                'start_time', double(0), ...
+                'end_time', double(0), ...
+                'num_dispatches', uint32(0), ...
+                'status', uint32(0) ...
+                );
+            coder.cstructname(timingStruct, 'mtlCommandBufferTiming','extern','HeaderFile', 'MatlabMetal.h');
+        end
+        
+        function timingStruct = rawDispatchTimingStruct
+            %rawDispatchTimingStruct Returns an allocated mtlDispatchTiming
+            %struct associated with the header file.
+            
+            timingStruct = struct(...
+                'function_name', char(zeros(1,256, 'uint8')), ...
+                'encode_time', double(0), ...
+                'start_time', double(0), ...
+                'end_time', double(0), ...
+                'width', uint32(0), ...
+                'height', uint32(0), ...
+                'depth', uint32(0) ...
+                );
+            coder.cstructname(timingStruct, 'mtlDispatchTiming','extern','HeaderFile', 'MatlabMetal.h');
+        end
+        
+        function statsStruct = rawProfileStatsStruct
+            %rawProfileStatsStruct Returns an allocated mtlProfileStats
+            %struct associated with the header file.
+            
+            statsStruct = struct(...
+                'copies_in', uint64(0), ...
+                'bytes_in', uint64(0), ...
+                'copy_in_seconds', double(0), ...
+                'copies_out', uint64(0), ...
+                'bytes_out', uint64(0), ...
+                'copy_out_seconds', double(0), ...
+                'commits', uint64(0), ...
+                'commit_seconds', double(0), ...
+                'waits', uint64(0), ...
+                'wait_seconds', double(0), ...
+                'dropped_events', uint64(0) ...
+                );
+            coder.cstructname(statsStruct, 'mtlProfileStats','extern','HeaderFile', 'MatlabMetal.h');
+        end
+        
+        function reductionStruct = rawReductionStruct
+            %rawReductionStruct Returns an allocated mtlReduction struct
+            %associated with the header file.
+            
+            reductionStruct = struct(...
+                'value', double(0), ...
+                'index', uint64(0) ...
+                );
+            coder.cstructname(reductionStruct, 'mtlReduction','extern','HeaderFile', 'MatlabMetal.h');
+        end
+        
+        function program = rawElementwiseProgram( opcodes, operands )
+            %rawElementwiseProgram Returns an array of mtlElementwiseOp
+            %structs associated with the header file, one per operation.
+            
+            op = struct(...
+                'opcode', uint32(0), ...
+                'operand', uint32(0) ...
+                );
+            coder.cstructname(op, 'mtlElementwiseOp','extern','HeaderFile', 'MatlabMetal.h');
+            
+            count = numel( opcodes );
+            program = repmat( op, 1, count );
+            for k = 1:count
+                program(k).opcode = uint32( opcodes(k) );
+                program(k).operand = uint32( operands(k) );
+            end
+        end
+        
+        function dispatches = rawDispatchArray( pipeline_handles, buffer_handles, shapes )
+            %rawDispatchArray Returns an array of mtlDispatch structs
+            %associated with the header file, one per row of the inputs.
+            %Each dispatch binds its buffers up to the last nonzero handle.
+            
+            dispatch = struct(...
+                'compute_pipeline_state', uint64(0), ...
+                'buffers', zeros(1, Metal.MaxDispatchBuffers, 'uint64'), ...
+                'num_buffers', uint32(0), ...
+                'width', uint32(0), ...
+                'height', uint32(0), ...
+                'depth', uint32(0), ...
+                'group_width', uint32(0), ...
+                'group_height', uint32(0), ...
+                'group_depth', uint32(0) ...
+                );
+            coder.cstructname(dispatch, 'mtlDispatch','extern','HeaderFile', 'MatlabMetal.h');
+            
+            count = numel( pipeline_handles );
+            dispatches = repmat( dispatch, 1, count );
+            for d = 1:count
+                dispatches(d).compute_pipeline_state = uint64( pipeline_handles(d) );
+                dispatches(d).buffers = uint64( buffer_handles(d, :) );
+                bound = find( buffer_handles(d, :), 1, 'last' );
+                if ~isempty( bound )
+                    dispatches(d).num_buffers = uint32( bound(1) );
+                end
+                dispatches(d).width = uint32( shapes(d, 1) );
+                dispatches(d).height = uint32( shapes(d, 2) );
+                dispatches(d).depth = uint32( shapes(d, 3) );
+            end
+        end
+        
+        function devInfoStruct = ConvertRawDeviceInfoToMatlab( rawStruct )
+            %ConvertRawDeviceInfoToMatlab Returns a Matlab friendly device info struct
+            devInfoStruct = struct(...
+                'name', string( trimszString( rawStruct.name)), ...
+                'IsLowPower', logical( rawStruct.IsLowPower ), ...
+                'IsHeadless', logical( rawStruct.IsHeadless ), ...
                 'recommendedMaxWorkingSetSize', rawStruct.recommendedMaxWorkingSetSize, ...
-                'RegistryID', rawStruct.RegistryID ...
+                'RegistryID', rawStruct.RegistryID, ...
+                'ComputeUnits', rawStruct.ComputeUnits, ...
+                'NumaNode', rawStruct.NumaNode ...
                 );
         end
         
@@ -440,12 +964,66 @@ classdef Metal < CoderAPI  %#codegen
         end
 
         
+        function handletypeval = UIntToEventHandle( inthandle )
+            coder.inline('always');
+            handletypeval = cast( inthandle, 'like', coder.opaque('EventHandle', '0', 'HeaderFile', 'MatlabMetal.h'));
+        end
+
+        
+        function handletypeval = UIntToCommandListHandle( inthandle )
+            coder.inline('always');
+            handletypeval = cast( inthandle, 'like', coder.opaque('CommandListHandle', '0', 'HeaderFile', 'MatlabMetal.h'));
+        end
+
+        
         function inthandle = HandleToUInt( handletypeval )
             coder.inline('always');
             inthandle = cast( handletypeval, Metal.HandleBaseType );
         end
 
 
+        function [ result ] = CopyRegionToBuffer( buffer_handle, buffer_dimensions, origin, data, element_size )
+            %CopyRegionToBuffer Generated-code body shared by the typed region copies
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            if any( origin < 1 )
+                return
+            end
+            
+            dimensions64 = uint64( buffer_dimensions );
+            origin64 = uint64( origin - 1 );
+            region64 = uint64( [ size( data, 1 ), size( data, 2 ), size( data, 3 ) ] );
+            result = coder.ceval('-layout:any', 'mtlCopyRegionToBuffer', ...
+                Metal.UIntToBufferHandle( buffer_handle ), ...
+                coder.rref( dimensions64 ), ...
+                coder.rref( origin64 ), ...
+                coder.rref( region64 ), ...
+                uint32( element_size ), ...
+                coder.rref( data ) );
+        end
+        
+        
+        function [ outdata, result ] = CopyRegionFromBuffer( buffer_handle, buffer_dimensions, origin, outdata, element_size )
+            %CopyRegionFromBuffer Generated-code body shared by the typed region copies
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            if any( origin < 1 )
+                return
+            end
+            
+            dimensions64 = uint64( buffer_dimensions );
+            origin64 = uint64( origin - 1 );
+            region64 = uint64( [ size( outdata, 1 ), size( outdata, 2 ), size( outdata, 3 ) ] );
+            result = coder.ceval('-layout:any', 'mtlCopyRegionFromBuffer', ...
+                Metal.UIntToBufferHandle( buffer_handle ), ...
+                coder.rref( dimensions64 ), ...
+                coder.rref( origin64 ), ...
+                coder.rref( region64 ), ...
+                uint32( element_size ), ...
+                coder.wref( outdata ) );
+        end
+
+
     end  % end private static methods
     
     
@@ -680,6 +1258,93 @@ classdef Metal < CoderAPI  %#codegen
         
         
         
+        function [ library_handle ] = NewLibraryWithOptions( device_handle, source, compile_options )
+            %NewLibraryWithOptions Create a new library with compile options
+            %  Accepts a device_handle, source as a string object and
+            %  compile_options, which is 1 to enable fast math or 0 to
+            %  compile with precise math. Returns a library_handle or
+            %  uint64(0) on error.
+            %
+            %  [ library_handle ] = Metal.NewLibraryWithOptions( device_handle, source, compile_options )
+            
+            if coder.target('MATLAB')
+                [ library_handle ] = CoderAPI.RunMex( device_handle, source, uint32( compile_options ) );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            raw_handle = Metal.UIntToLibraryHandle(0);
+            char_source = NullTerminateString( source );
+            raw_handle = coder.ceval( 'mtlNewLibraryWithOptions', Metal.UIntToDeviceHandle( device_handle ), ...
+                char_source, uint32( compile_options ) );
+            library_handle = Metal.HandleToUInt( raw_handle );
+        end
+        
+        
+        
+        function result = SetLibraryCacheDirectory( directory )
+            %SetLibraryCacheDirectory Set the folder for cached libraries
+            %   Compiled libraries are stored in and loaded from the
+            %   folder, which is created if needed. An empty string
+            %   disables the on-disk cache; the in-memory cache is always
+            %   used. The initial folder is taken from the
+            %   MATLABMETAL_LIBRARY_CACHE environment variable. Returns
+            %   uint32(1) on success, uint32(0) on error.
+            %
+            %  result = Metal.SetLibraryCacheDirectory( directory )
+            
+            if coder.target('MATLAB')
+                result = CoderAPI.RunMex( directory );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            char_directory = NullTerminateString( directory );
+            result = coder.ceval( 'mtlSetLibraryCacheDirectory', char_directory );
+        end
+        
+        
+        
+        function statsStruct = LibraryCacheStats
+            %LibraryCacheStats Return the library cache counters
+            %   Returns a struct with the number of libraries served from
+            %   memory (memory_hits) and from disk (disk_hits), the number
+            %   compiled (misses) and the number of cached libraries
+            %   (entries).
+            %
+            %  statsStruct = Metal.LibraryCacheStats
+            
+            if coder.target('MATLAB')
+                statsStruct = CoderAPI.RunMex( );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            statsStruct = Metal.rawLibraryCacheStatsStruct;
+            coder.ceval( 'mtlGetLibraryCacheStats', coder.wref( statsStruct ) );
+        end
+        
+        
+        
+        function ClearLibraryCache
+            %ClearLibraryCache Drop all libraries from the in-memory cache
+            %   Existing libraries stay valid and the counters are reset.
+            %   Files in the cache folder are kept.
+            %
+            %  Metal.ClearLibraryCache
+            
+            if coder.target('MATLAB')
+                CoderAPI.RunMex( );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            coder.ceval( 'mtlClearLibraryCache' );
+        end
+        
+        
+        
         function [ device_handle ] = LibraryDevice( library_handle )
             %LibraryDevice Return the device the library was created on
             %   Return a handle to the device the library was create on.
@@ -778,6 +1443,32 @@ classdef Metal < CoderAPI  %#codegen
         
         
         
+        function [ compute_pipeline_state_handle ] = ComputePipelineStateForFunction( library_handle, function_name )
+            %ComputePipelineStateForFunction Look up a compute pipeline state by function name
+            %  Accepts a library_handle and the function name as a string
+            %  object. The pipeline state is created on first use and
+            %  cached, so later lookups skip creating the function and the
+            %  pipeline state. The returned handle must still be freed.
+            %  Returns a compute_pipeline_state_handle or uint64(0) on error.
+            %
+            %  [ compute_pipeline_state_handle ] = Metal.ComputePipelineStateForFunction( library_handle, function_name )
+            
+            if coder.target('MATLAB')
+                [ compute_pipeline_state_handle ] = CoderAPI.RunMex( library_handle, function_name );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            raw_handle = Metal.UIntToComputePipelineStateHandle(0);
+            char_function = NullTerminateString( function_name );
+            raw_handle = coder.ceval( 'mtlComputePipelineStateForFunction', ...
+                Metal.UIntToLibraryHandle( library_handle ), ...
+                char_function );
+            compute_pipeline_state_handle = Metal.HandleToUInt( raw_handle );
+        end
+        
+        
+        
         function [ device_handle ] = ComputePipelineStateDevice( compute_pipeline_state_handle )
             %ComputePipelineStateDevice Return the device the compute pipeline state was created on
             %   Return a handle to the device the compute pipeline state
@@ -837,6 +1528,25 @@ classdef Metal < CoderAPI  %#codegen
         end
         
         
+        function [ num_threads ] = MaxTotalThreadsPerThreadgroup( compute_pipeline_state_handle )
+            %MaxTotalThreadsPerThreadgroup Return the largest threadgroup
+            %   Returns the largest number of threads in one threadgroup
+            %   of the compute pipeline state.
+            %
+            %  [ num_threads ] = Metal.MaxTotalThreadsPerThreadgroup( compute_pipeline_state_handle )
+            
+            if coder.target('MATLAB')
+                [ num_threads ] = CoderAPI.RunMex( compute_pipeline_state_handle );
+                return
+            end
+            
+            num_threads_raw = uint32(0);
+            coder.cinclude( 'MatlabMetal.h' );
+            [ num_threads_raw ] = coder.ceval( 'mtlMaxTotalThreadsPerThreadgroup', Metal.UIntToComputePipelineStateHandle( compute_pipeline_state_handle ) );
+            num_threads = double( num_threads_raw );
+        end
+        
+        
         
         function FreeComputePipelineState( compute_pipeline_state_handle )
             %FreeFunction Free the function
@@ -934,6 +1644,151 @@ classdef Metal < CoderAPI  %#codegen
                 uint64( numbytes ) );
             buffer_handle = Metal.HandleToUInt( raw_handle );
         end
+
+        
+        
+        function [ buffer_handle ] = NewPooledBuffer( device_handle, numbytes )
+            %NewPooledBuffer Create a new memory buffer from the device's pool
+            %  Accepts a handle to a device and the number of bytes to
+            %  allocate. Freeing the buffer returns its storage to the
+            %  pool for reuse by later buffers, so the contents of a new
+            %  pooled buffer are not cleared.
+            %  Returns a buffer_handle or uint64(0) on error.
+            %
+            %  [ buffer_handle ] = Metal.NewPooledBuffer( device_handle, numbytes )
+            
+            if coder.target('MATLAB')
+                [ buffer_handle ] = CoderAPI.RunMex( device_handle, numbytes );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            raw_handle = Metal.UIntToBufferHandle(0);
+            raw_handle = coder.ceval( 'mtlNewPooledBuffer', ...
+                Metal.UIntToDeviceHandle( device_handle ), ...
+                uint64( numbytes ) );
+            buffer_handle = Metal.HandleToUInt( raw_handle );
+        end
+        
+        
+        
+        function [ buffer_handle ] = NewBufferFromFile( device_handle, filename, offset, numbytes, mode )
+            %NewBufferFromFile Create a new memory buffer over part of a file
+            %  Accepts a handle to a device, a file name, the byte offset
+            %  and size of the range to use (0 for the rest of the file),
+            %  and Metal.FileReadOnly or Metal.FileCopyOnWrite. The file
+            %  is mapped rather than read, so its pages are loaded as
+            %  kernels reach them. A read-only buffer cannot be written;
+            %  writes to a copy-on-write buffer never reach the file.
+            %  Returns a buffer_handle or uint64(0) on error.
+            %
+            %  [ buffer_handle ] = Metal.NewBufferFromFile( device_handle, filename, offset, numbytes, mode )
+            
+            if coder.target('MATLAB')
+                [ buffer_handle ] = CoderAPI.RunMex( device_handle, filename, offset, numbytes, mode );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            raw_handle = Metal.UIntToBufferHandle(0);
+            char_filename = NullTerminateString( filename );
+            raw_handle = coder.ceval( 'mtlNewBufferFromFile', ...
+                Metal.UIntToDeviceHandle( device_handle ), ...
+                char_filename, ...
+                uint64( offset ), ...
+                uint64( numbytes ), ...
+                uint32( mode ) );
+            buffer_handle = Metal.HandleToUInt( raw_handle );
+        end
+
+        
+        
+        function [ buffer_handle ] = NewBufferWithHostPointer( device_handle, data )
+            %NewBufferWithHostPointer Create a buffer whose storage is a single or uint16 array
+            %  Accepts a handle to a device and an array that the buffer
+            %  uses in place, without a copy; kernels write to the array
+            %  itself. The array must stay in scope and unchanged while
+            %  the buffer exists, and its address must be a multiple of
+            %  mtlHostPointerAlignment (on Metal, its size too). Only
+            %  available in generated code, since MATLAB may move arrays.
+            %  Returns a buffer_handle or uint64(0) on error.
+            %
+            %  [ buffer_handle ] = Metal.NewBufferWithHostPointer( device_handle, data )
+            
+            if coder.target('MATLAB')
+                error( 'Metal:HostPointer', 'Host arrays can only be wrapped in generated code.' );
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            raw_handle = Metal.UIntToBufferHandle(0);
+            if isa( data, 'uint16' )
+                numbytes = uint64( numel( data ) * 2 );
+            else
+                numbytes = uint64( numel( data ) * 4 );
+            end
+            raw_handle = coder.ceval( '-layout:any', 'mtlNewBufferWithHostPointer', ...
+                Metal.UIntToDeviceHandle( device_handle ), ...
+                coder.ref( data ), ...
+                numbytes, ...
+                coder.opaque( 'mtlHostDeallocator', 'NULL', 'HeaderFile', 'MatlabMetal.h' ), ...
+                coder.opaque( 'void *', 'NULL' ) );
+            buffer_handle = Metal.HandleToUInt( raw_handle );
+        end
+        
+        
+        
+        function [ statsStruct, result ] = BufferPoolStats( device_handle )
+            %BufferPoolStats Return the buffer pool counters of a device
+            %   Returns a struct with the bytes held by the pool
+            %   (reserved_bytes), the bytes handed out to live buffers
+            %   (in_use_bytes), the number of allocations served from
+            %   (hits) and added to (misses) the pool, and the hit rate.
+            %   result is uint32(1) on success, uint32(0) on error.
+            %
+            %  [ statsStruct, result ] = Metal.BufferPoolStats( device_handle )
+            
+            if coder.target('MATLAB')
+                [ statsStruct, result ] = CoderAPI.RunMex( device_handle );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            raw_stats = Metal.rawBufferPoolStatsStruct;
+            result = coder.ceval( 'mtlGetBufferPoolStats', ...
+                Metal.UIntToDeviceHandle( device_handle ), ...
+                coder.wref( raw_stats ) );
+            requests = double( raw_stats.hits ) + double( raw_stats.misses );
+            statsStruct = struct(...
+                'reserved_bytes', double( raw_stats.reserved_bytes ), ...
+                'in_use_bytes', double( raw_stats.in_use_bytes ), ...
+                'hits', double( raw_stats.hits ), ...
+                'misses', double( raw_stats.misses ), ...
+                'hit_rate', double( raw_stats.hits ) / max( requests, 1 ) ...
+                );
+        end
+        
+        
+        
+        function result = TrimBufferPool( device_handle, max_idle_bytes )
+            %TrimBufferPool Release idle buffer pool storage of a device
+            %   Frees idle pooled storage until at most max_idle_bytes
+            %   remain idle; zero releases all of it. Returns uint32(1)
+            %   on success, uint32(0) on error.
+            %
+            %  result = Metal.TrimBufferPool( device_handle, max_idle_bytes )
+            
+            if coder.target('MATLAB')
+                result = CoderAPI.RunMex( device_handle, max_idle_bytes );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            result = coder.ceval( 'mtlTrimBufferPool', ...
+                Metal.UIntToDeviceHandle( device_handle ), ...
+                uint64( max_idle_bytes ) );
+        end
         
         
         
@@ -1082,63 +1937,291 @@ classdef Metal < CoderAPI  %#codegen
         
         
         
-        function numbytes = BufferSize( buffer_handle )
-            %BufferSize Determine the size of the buffer in bytes
-            %   Return the size of the buffer in bytes. Returns 0 bytes on
-            %   error.
+        function [ result ] = CopyFloatsToBuffer( buffer_handle, data, format )
+            %CopyFloatsToBuffer Copy a single three-dimensional array into a buffer of any float format
+            %  Given a handle to a buffer, an array of single data and one
+            %  of the Metal.Format* element formats, will convert the data
+            %  to the format (rounding to nearest even) while copying it
+            %  into the memory buffer.
             %
-            %  numbytes = Metal.BufferSize( buffer_handle )
+            %  Returns uint32(1) on succes, uint32(0) on failure.
+            %  [ result ] = Metal.CopyFloatsToBuffer( buffer_handle, data, format )
             
             if coder.target('MATLAB')
-                numbytes = CoderAPI.RunMex( buffer_handle );
+                [ result ] = CoderAPI.RunMex( buffer_handle, data, format );
                 return
             end
             
             coder.cinclude( 'MatlabMetal.h' );
-            returnval = uint64(0);
-            returnval = coder.ceval( 'mtlBufferSize', Metal.UIntToBufferHandle( buffer_handle ) );
-            numbytes = double( returnval );
+            result = uint32(0);
+            result = coder.ceval('-layout:any', 'mtlCopyFloatsToBuffer', ...
+                Metal.UIntToBufferHandle( buffer_handle ), ...
+                uint64( 0 ), ...
+                coder.rref( data ), ...
+                uint64( numel( data ) ), ...
+                uint32( format ) );
         end
         
         
         
-        function [ device_handle ] = BufferDevice( buffer_handle )
-            %BufferDevice Return the device the buffer was created on
-            %   Return a handle to the device the buffer was create on.
-            %   The handle will be newly created, so must be freed.
-            %   Returns a device_handle or uint64(0) on error.
+        function [ outdata, result ] = CopyFloatsFromBuffer( buffer_handle, dimensions, format )
+            %CopyFloatsFromBuffer Copy a three-dimensional array of any float format from a buffer as single
+            %  Given a handle to a buffer, the dimensions of the output
+            %  array and the Metal.Format* element format of the buffer,
+            %  will copy the data from the memory buffer, converting it to
+            %  single.
             %
-            %  [ device_handle ] = Metal.BufferDevice( buffer_handle )
+            %  Returns uint32(1) on succes, uint32(0) on failure.
+            %  [ outdata, result ] = Metal.CopyFloatsFromBuffer( buffer_handle, dimensions, format )
             
             if coder.target('MATLAB')
-                [ device_handle ] = CoderAPI.RunMex( buffer_handle );
+                [ outdata, result ] = CoderAPI.RunMex( buffer_handle, dimensions, format );
                 return
             end
             
             coder.cinclude( 'MatlabMetal.h' );
-            raw_handle = Metal.UIntToDeviceHandle(0);
-            raw_handle = coder.ceval( 'mtlBufferDevice', Metal.UIntToBufferHandle( buffer_handle ) );
-            device_handle = Metal.HandleToUInt( raw_handle );
+            result = uint32(0);
+            outdata = coder.nullcopy( zeros( dimensions, 'single'));
+            result = coder.ceval('-layout:any', 'mtlCopyFloatsFromBuffer', ...
+                Metal.UIntToBufferHandle( buffer_handle ), ...
+                uint64( 0 ), ...
+                coder.wref( outdata ), ...
+                uint64( prod( dimensions ) ), ...
+                uint32( format ) );
         end
         
-     
         
-        function FreeBuffer( buffer_handle )
-            %FreeBuffer Free the buffer
-            %   Free the buffer referred to by the handle.
+        
+        function [ result ] = CopyDataToBufferRange( buffer_handle, offset, data )
+            %CopyDataToBufferRange Copy a uint8 vector into part of a buffer
+            %  Given a handle to a buffer, a zero-based byte offset and a
+            %  vector of uint8 data, will copy the data into the memory
+            %  buffer starting at the offset.
             %
-            %  Metal.FreeBuffer( buffer_handle )
-            coder.cinclude( 'MatlabMetal.h' );
-            if buffer_handle == Metal.InvalidHandle
-                return
-            end
+            %  Returns uint32(1) on succes, uint32(0) on failure.
+            %  [ result ] = Metal.CopyDataToBufferRange( buffer_handle, offset, data )
             
             if coder.target('MATLAB')
-                CoderAPI.RunMex( buffer_handle );
+                [ result ] = CoderAPI.RunMex( buffer_handle, offset, data );
                 return
             end
             
-            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            numbytes = uint64( numel( data ) );
+            result = coder.ceval('-layout:any', 'mtlCopyDataToBufferRange', ...
+                Metal.UIntToBufferHandle( buffer_handle ), ...
+                uint64( offset ), ...
+                coder.rref( data ), ...
+                numbytes );
+        end
+        
+        
+        
+        function [ outdata, result ] = CopyDataFromBufferRange( buffer_handle, offset, numbytes )
+            %CopyDataFromBufferRange Copy a uint8 vector from part of a buffer
+            %  Given a handle to a buffer, a zero-based byte offset and a
+            %  number of bytes, will copy that range of uint8 data from the
+            %  memory buffer.
+            %
+            %  result is uint32(1) on succes, uint32(0) on failure.
+            %  [ outdata, result ] = Metal.CopyDataFromBufferRange( buffer_handle, offset, numbytes )
+            
+            if coder.target('MATLAB')
+                [ outdata, result ] = CoderAPI.RunMex( buffer_handle, offset, numbytes );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            outdata = coder.nullcopy( zeros( 1, numbytes, 'uint8'));
+            result = coder.ceval('-layout:any', 'mtlCopyDataFromBufferRange', ...
+                Metal.UIntToBufferHandle( buffer_handle ), ...
+                uint64( offset ), ...
+                coder.wref( outdata ), ...
+                uint64( numbytes ) );
+        end
+        
+        
+        
+        function [ result ] = CopyUInt16RegionToBuffer( buffer_handle, buffer_dimensions, origin, data )
+            %CopyUInt16RegionToBuffer Copy a uint16 array into a sub-block of a buffer
+            %  Given a handle to a buffer holding a uint16 array of
+            %  buffer_dimensions, the one-based origin of a sub-block and a
+            %  uint16 array, will copy the array into the sub-block
+            %  starting at origin.  Only the bytes of the sub-block are
+            %  transferred.
+            %
+            %  Returns uint32(1) on succes, uint32(0) on failure.
+            %  [ result ] = Metal.CopyUInt16RegionToBuffer( buffer_handle, buffer_dimensions, origin, data )
+            
+            if coder.target('MATLAB')
+                [ result ] = CoderAPI.RunMex( buffer_handle, buffer_dimensions, origin, data );
+                return
+            end
+            
+            result = Metal.CopyRegionToBuffer( buffer_handle, buffer_dimensions, origin, data, 2 );
+        end
+        
+        
+        
+        function [ outdata, result ] = CopyUInt16RegionFromBuffer( buffer_handle, buffer_dimensions, origin, region )
+            %CopyUInt16RegionFromBuffer Copy a sub-block of a uint16 array from a buffer
+            %  Given a handle to a buffer holding a uint16 array of
+            %  buffer_dimensions, the one-based origin and the dimensions
+            %  of a sub-block, will copy the sub-block out of the buffer.
+            %
+            %  result is uint32(1) on succes, uint32(0) on failure.
+            %  [ outdata, result ] = Metal.CopyUInt16RegionFromBuffer( buffer_handle, buffer_dimensions, origin, region )
+            
+            if coder.target('MATLAB')
+                [ outdata, result ] = CoderAPI.RunMex( buffer_handle, buffer_dimensions, origin, region );
+                return
+            end
+            
+            outdata = coder.nullcopy( zeros( region, 'uint16'));
+            [ outdata, result ] = Metal.CopyRegionFromBuffer( buffer_handle, buffer_dimensions, origin, outdata, 2 );
+        end
+        
+        
+        
+        function [ result ] = CopySingleRegionToBuffer( buffer_handle, buffer_dimensions, origin, data )
+            %CopySingleRegionToBuffer Copy a single array into a sub-block of a buffer
+            %  Given a handle to a buffer holding a single array of
+            %  buffer_dimensions, the one-based origin of a sub-block and a
+            %  single array, will copy the array into the sub-block
+            %  starting at origin.  Only the bytes of the sub-block are
+            %  transferred.
+            %
+            %  Returns uint32(1) on succes, uint32(0) on failure.
+            %  [ result ] = Metal.CopySingleRegionToBuffer( buffer_handle, buffer_dimensions, origin, data )
+            
+            if coder.target('MATLAB')
+                [ result ] = CoderAPI.RunMex( buffer_handle, buffer_dimensions, origin, data );
+                return
+            end
+            
+            result = Metal.CopyRegionToBuffer( buffer_handle, buffer_dimensions, origin, data, 4 );
+        end
+        
+        
+        
+        function [ outdata, result ] = CopySingleRegionFromBuffer( buffer_handle, buffer_dimensions, origin, region )
+            %CopySingleRegionFromBuffer Copy a sub-block of a single array from a buffer
+            %  Given a handle to a buffer holding a single array of
+            %  buffer_dimensions, the one-based origin and the dimensions
+            %  of a sub-block, will copy the sub-block out of the buffer.
+            %
+            %  result is uint32(1) on succes, uint32(0) on failure.
+            %  [ outdata, result ] = Metal.CopySingleRegionFromBuffer( buffer_handle, buffer_dimensions, origin, region )
+            
+            if coder.target('MATLAB')
+                [ outdata, result ] = CoderAPI.RunMex( buffer_handle, buffer_dimensions, origin, region );
+                return
+            end
+            
+            outdata = coder.nullcopy( zeros( region, 'single'));
+            [ outdata, result ] = Metal.CopyRegionFromBuffer( buffer_handle, buffer_dimensions, origin, outdata, 4 );
+        end
+        
+        
+        
+        function [ result ] = CopyBufferToBuffer( dest_buffer_handle, source_buffer_handle )
+            %CopyBufferToBuffer Copy the contents of one buffer into another
+            %  Given handles to a destination and a source buffer, will
+            %  copy all of the source data into the destination buffer.
+            %  The source is mapped rather than copied out first, so the
+            %  data is copied once and never passes through MATLAB.
+            %
+            %  Returns uint32(1) on succes, uint32(0) on failure.
+            %  [ result ] = Metal.CopyBufferToBuffer( dest_buffer_handle, source_buffer_handle )
+            
+            if coder.target('MATLAB')
+                [ result ] = CoderAPI.RunMex( dest_buffer_handle, source_buffer_handle );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            numbytes = uint64(0);
+            numbytes = coder.ceval( 'mtlBufferSize', Metal.UIntToBufferHandle( source_buffer_handle ) );
+            if numbytes == uint64(0)
+                return
+            end
+            
+            source = coder.opaque( 'void *', 'NULL' );
+            source = coder.ceval( 'mtlMapBuffer', ...
+                Metal.UIntToBufferHandle( source_buffer_handle ), ...
+                uint32(1) );  % MTL_MAP_READ
+            result = coder.ceval( 'mtlCopyDataToBuffer', ...
+                Metal.UIntToBufferHandle( dest_buffer_handle ), ...
+                source, ...
+                numbytes );
+            coder.ceval( 'mtlUnmapBuffer', ...
+                Metal.UIntToBufferHandle( source_buffer_handle ), ...
+                uint64(0), ...
+                uint64(0) );
+        end
+        
+        
+        
+        function numbytes = BufferSize( buffer_handle )
+            %BufferSize Determine the size of the buffer in bytes
+            %   Return the size of the buffer in bytes. Returns 0 bytes on
+            %   error.
+            %
+            %  numbytes = Metal.BufferSize( buffer_handle )
+            
+            if coder.target('MATLAB')
+                numbytes = CoderAPI.RunMex( buffer_handle );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            returnval = uint64(0);
+            returnval = coder.ceval( 'mtlBufferSize', Metal.UIntToBufferHandle( buffer_handle ) );
+            numbytes = double( returnval );
+        end
+        
+        
+        
+        function [ device_handle ] = BufferDevice( buffer_handle )
+            %BufferDevice Return the device the buffer was created on
+            %   Return a handle to the device the buffer was create on.
+            %   The handle will be newly created, so must be freed.
+            %   Returns a device_handle or uint64(0) on error.
+            %
+            %  [ device_handle ] = Metal.BufferDevice( buffer_handle )
+            
+            if coder.target('MATLAB')
+                [ device_handle ] = CoderAPI.RunMex( buffer_handle );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            raw_handle = Metal.UIntToDeviceHandle(0);
+            raw_handle = coder.ceval( 'mtlBufferDevice', Metal.UIntToBufferHandle( buffer_handle ) );
+            device_handle = Metal.HandleToUInt( raw_handle );
+        end
+        
+     
+        
+        function FreeBuffer( buffer_handle )
+            %FreeBuffer Free the buffer
+            %   Free the buffer referred to by the handle.
+            %
+            %  Metal.FreeBuffer( buffer_handle )
+            coder.cinclude( 'MatlabMetal.h' );
+            if buffer_handle == Metal.InvalidHandle
+                return
+            end
+            
+            if coder.target('MATLAB')
+                CoderAPI.RunMex( buffer_handle );
+                return
+            end
+            
+            
             coder.ceval( 'mtlFreeBuffer', Metal.UIntToBufferHandle( buffer_handle ) );
         end
         
@@ -1259,132 +2342,989 @@ classdef Metal < CoderAPI  %#codegen
         end
         
         
-        
-        function [ command_encoder_handle ] = NewCommandEncoder( command_buffer_handle )
-            %NewCommandEncoder Create a new command buffer for a command queue
-            %  Accepts a handle to a command queue.
-            %  Returns a command_buffer_handle or uint64(0) on error.
+        function [ status, result ] = CommandBufferStatus( command_buffer_handle )
+            %CommandBufferStatus Query the status of a command buffer
+            %   Returns the execution status of the command buffer
+            %   referred to by the handle without waiting: 0 not enqueued,
+            %   1 enqueued, 2 committed, 3 scheduled, 4 completed, 5 error.
+            %   result is uint32(1) on success, uint32(0) on error.
             %
-            %  [ command_encoder_handle ] = Metal.NewCommandEncoder( command_buffer_handle )
-            
+            %  [ status, result ] = Metal.CommandBufferStatus( command_buffer_handle )
             if coder.target('MATLAB')
-                [ command_encoder_handle ] = CoderAPI.RunMex( command_buffer_handle );
+                [ status, result ] = CoderAPI.RunMex( command_buffer_handle );
                 return
             end
             
             coder.cinclude( 'MatlabMetal.h' );
-            raw_handle = Metal.UIntToCommandEncoderHandle(0);
-            raw_handle = coder.ceval( 'mtlNewCommandEncoder', ...
-                Metal.UIntToCommandBufferHandle( command_buffer_handle ) );
-            command_encoder_handle = Metal.HandleToUInt( raw_handle );
+            result = uint32(0);
+            status = uint32(0);
+            result = coder.ceval( 'mtlCommandBufferStatus', ...
+                Metal.UIntToCommandBufferHandle( command_buffer_handle ), ...
+                coder.wref( status ) );
         end
-     
-     
         
-        function FreeCommandEncoder( command_encoder_handle )
-            %FreeCommandEncoder Free the command encoder
-            %   Free the command encoder referred to by the handle.
-            %
-            %  NOTE: It is essential that Metal.EndEncoding be called
-            %  exactly once prior to freeing the encoder otherwise a
-            %  segfault may occur.
+        
+        function [ index, result ] = WaitAnyCommandBuffer( command_buffer_handles )
+            %WaitAnyCommandBuffer Wait for one of several command buffers to finish
+            %   Given a vector of handles to committed command buffers,
+            %   waits until any one of them has finished processing and
+            %   returns its one-based index in the vector. result is
+            %   uint32(1) on success, uint32(0) on error.
             %
-            %  Metal.FreeCommandEncoder( command_encoder_handle )
-            coder.cinclude( 'MatlabMetal.h' );
-            if command_encoder_handle == Metal.InvalidHandle
+            %  [ index, result ] = Metal.WaitAnyCommandBuffer( command_buffer_handles )
+            if coder.target('MATLAB')
+                [ index, result ] = CoderAPI.RunMex( command_buffer_handles );
                 return
             end
             
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            raw_index = uint32(0);
+            handles = uint64( command_buffer_handles );
+            result = coder.ceval( 'mtlWaitAnyCommandBuffer', ...
+                coder.rref( handles ), ...
+                uint32( numel( handles ) ), ...
+                coder.wref( raw_index ) );
+            index = double( raw_index ) + 1;
+        end
+        
+        
+        function result = WaitAllCommandBuffers( command_buffer_handles )
+            %WaitAllCommandBuffers Wait for several command buffers to finish
+            %   Given a vector of handles to committed command buffers,
+            %   waits until all of them have finished processing. Returns
+            %   uint32(1) on success, uint32(0) on error.
+            %
+            %  result = Metal.WaitAllCommandBuffers( command_buffer_handles )
             if coder.target('MATLAB')
-                CoderAPI.RunMex( command_encoder_handle );
+                result = CoderAPI.RunMex( command_buffer_handles );
                 return
             end
             
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            handles = uint64( command_buffer_handles );
+            result = coder.ceval( 'mtlWaitAllCommandBuffers', ...
+                coder.rref( handles ), ...
+                uint32( numel( handles ) ) );
+        end
+        
+        
+        
+        function [ event_handle ] = NewEvent( device_handle )
+            %NewEvent Create an event for command buffers to signal and wait for
+            %  Accepts a handle to a device. The event's value starts at 0.
+            %  Returns an event_handle or uint64(0) on error.
+            %
+            %  [ event_handle ] = Metal.NewEvent( device_handle )
+            
+            if coder.target('MATLAB')
+                [ event_handle ] = CoderAPI.RunMex( device_handle );
+                return
+            end
             
-            coder.ceval( 'mtlFreeCommandEncoder', Metal.UIntToCommandEncoderHandle( command_encoder_handle ) );
+            coder.cinclude( 'MatlabMetal.h' );
+            raw_handle = Metal.UIntToEventHandle(0);
+            raw_handle = coder.ceval( 'mtlNewEvent', ...
+                Metal.UIntToDeviceHandle( device_handle ) );
+            event_handle = Metal.HandleToUInt( raw_handle );
         end
         
         
+        function FreeEvent( event_handle )
+            %FreeEvent Free the event
+            %   Free the event referred to by the handle.
+            %
+            %  Metal.FreeEvent( event_handle )
+            
+            if coder.target('MATLAB')
+                CoderAPI.RunMex( event_handle );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            coder.ceval( 'mtlFreeEvent', Metal.UIntToEventHandle( event_handle ) );
+        end
+        
         
-        function result = SetComputePipelineState( command_encoder_handle, compute_pipeline_state )
-            %SetComputePipelineState Set the compute pipeline state for the command buffer
-            %   Set the compute pipeline state to use for processing.
-            %   Returns uint32(1) on success, uint32(0) on error.
+        function [ value, result ] = EventSignaledValue( event_handle )
+            %EventSignaledValue Return the value an event was last signalled with
+            %   result is uint32(1) on success, uint32(0) on error.
             %
-            %  result = Metal.SetComputePipelineState( command_encoder_handle, compute_pipeline_state )
+            %  [ value, result ] = Metal.EventSignaledValue( event_handle )
             if coder.target('MATLAB')
-                result = CoderAPI.RunMex( command_encoder_handle, compute_pipeline_state );
+                [ value, result ] = CoderAPI.RunMex( event_handle );
                 return
             end
             
             coder.cinclude( 'MatlabMetal.h' );
             result = uint32(0);
-            result = coder.ceval( 'mtlSetComputePipelineState', ...
-                Metal.UIntToCommandEncoderHandle( command_encoder_handle ), ...
-                Metal.UIntToComputePipelineStateHandle( compute_pipeline_state ) );
+            value = uint64(0);
+            result = coder.ceval( 'mtlEventSignaledValue', ...
+                Metal.UIntToEventHandle( event_handle ), ...
+                coder.wref( value ) );
         end
         
         
-        function result = SetBuffer( command_encoder_handle, buffer_handle, index )
-            %SetBuffer Set a buffer for the command buffer to use
-            %   Set a buffer to be used by the command buffer as well as
-            %   its position in the call (one-based). Returns uint32(1) on success,
-            %   uint32(0) on error.
+        function result = SignalEvent( event_handle, value )
+            %SignalEvent Set the value of an event from MATLAB
+            %   Command buffers waiting for this value or a lower one go
+            %   on. Returns uint32(1) on success, uint32(0) on error.
             %
-            %  result = Metal.SetBuffer( command_encoder_handle, buffer_handle, index )
+            %  result = Metal.SignalEvent( event_handle, value )
             if coder.target('MATLAB')
-                result = CoderAPI.RunMex( command_encoder_handle, buffer_handle, index );
+                result = CoderAPI.RunMex( event_handle, value );
                 return
             end
             
             coder.cinclude( 'MatlabMetal.h' );
             result = uint32(0);
-            result = coder.ceval( 'mtlSetBuffer', ...
-                Metal.UIntToCommandEncoderHandle( command_encoder_handle ), ...
-                Metal.UIntToBufferHandle( buffer_handle ), ...
-                uint32(index-1) );
+            result = coder.ceval( 'mtlSignalEvent', ...
+                Metal.UIntToEventHandle( event_handle ), ...
+                uint64( value ) );
         end
         
-                
         
-        function result = SetThreadsAndShape( command_encoder_handle, compute_pipeline_state_handle, dims )
-            %SetThreadsAndShape Set the number of threads and the shape of the thread processing. 
-            %  Needs the dimensions of the buffers to be processed (as a
-            %  double vector). Returns uint32(1) on success, uint32(0) on
-            %  error.
+        function result = WaitForEvent( event_handle, value, timeout )
+            %WaitForEvent Wait until an event reaches a value
+            %   Waits at most timeout seconds (Inf to wait as long as it
+            %   takes). Returns uint32(1) once the value is reached,
+            %   uint32(0) on timeout or error.
             %
-            %  result = Metal.SetThreadsAndShape( command_encoder_handle, buffer_handle, dims )
+            %  result = Metal.WaitForEvent( event_handle, value, timeout )
             if coder.target('MATLAB')
-                result = CoderAPI.RunMex( command_encoder_handle, compute_pipeline_state_handle, dims );
+                result = CoderAPI.RunMex( event_handle, value, timeout );
                 return
             end
             
-            dims_pad = [ 1 1 1 ];
-            dims_pad( 1 : min(end, numel( dims )) ) = dims( 1 : min( end, 3 ));
-            
             coder.cinclude( 'MatlabMetal.h' );
             result = uint32(0);
-            result = coder.ceval( 'mtlSetThreadsAndShape', ...
-                Metal.UIntToCommandEncoderHandle( command_encoder_handle ), ...
-                Metal.UIntToComputePipelineStateHandle( compute_pipeline_state_handle ), ...
-                uint32(dims_pad(1)), uint32(dims_pad(2)), uint32(dims_pad(3)) );
+            result = coder.ceval( 'mtlWaitForEvent', ...
+                Metal.UIntToEventHandle( event_handle ), ...
+                uint64( value ), ...
+                uint64( timeout * 1000 ) );
         end
         
         
+        function result = EncodeSignalEvent( command_buffer_handle, event_handle, value )
+            %EncodeSignalEvent Signal an event once the commands encoded so far complete
+            %   Encode between command encoders. Returns uint32(1) on
+            %   success, uint32(0) on error.
+            %
+            %  result = Metal.EncodeSignalEvent( command_buffer_handle, event_handle, value )
+            if coder.target('MATLAB')
+                result = CoderAPI.RunMex( command_buffer_handle, event_handle, value );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            result = coder.ceval( 'mtlEncodeSignalEvent', ...
+                Metal.UIntToCommandBufferHandle( command_buffer_handle ), ...
+                Metal.UIntToEventHandle( event_handle ), ...
+                uint64( value ) );
+        end
+        
         
-        function result = EndEncoding( command_encoder_handle )
-            %EndEncoding End encoding the commands
-            %   End encoding of the command buffer
+        function result = EncodeWaitForEvent( command_buffer_handle, event_handle, value )
+            %EncodeWaitForEvent Hold the commands encoded next until an event reaches a value
+            %   Encode between command encoders. Returns uint32(1) on
+            %   success, uint32(0) on error.
             %
-            %  Metal.EndEncoding( command_encoder_handle )
+            %  result = Metal.EncodeWaitForEvent( command_buffer_handle, event_handle, value )
             if coder.target('MATLAB')
-                result = CoderAPI.RunMex( command_encoder_handle );
+                result = CoderAPI.RunMex( command_buffer_handle, event_handle, value );
                 return
             end
             
             coder.cinclude( 'MatlabMetal.h' );
             result = uint32(0);
-            result = coder.ceval( 'mtlEndEncoding', Metal.UIntToCommandEncoderHandle( command_encoder_handle ) );
+            result = coder.ceval( 'mtlEncodeWaitForEvent', ...
+                Metal.UIntToCommandBufferHandle( command_buffer_handle ), ...
+                Metal.UIntToEventHandle( event_handle ), ...
+                uint64( value ) );
+        end
+        
+        
+        
+        function [ command_encoder_handle ] = NewCommandEncoder( command_buffer_handle )
+            %NewCommandEncoder Create a new command buffer for a command queue
+            %  Accepts a handle to a command queue.
+            %  Returns a command_buffer_handle or uint64(0) on error.
+            %
+            %  [ command_encoder_handle ] = Metal.NewCommandEncoder( command_buffer_handle )
+            
+            if coder.target('MATLAB')
+                [ command_encoder_handle ] = CoderAPI.RunMex( command_buffer_handle );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            raw_handle = Metal.UIntToCommandEncoderHandle(0);
+            raw_handle = coder.ceval( 'mtlNewCommandEncoder', ...
+                Metal.UIntToCommandBufferHandle( command_buffer_handle ) );
+            command_encoder_handle = Metal.HandleToUInt( raw_handle );
+        end
+        
+        
+        function [ command_encoder_handle ] = NewCommandEncoderWithDispatchType( command_buffer_handle, dispatch_type )
+            %NewCommandEncoderWithDispatchType Create a serial or concurrent command encoder
+            %  dispatch_type is Metal.DispatchSerial or Metal.DispatchConcurrent.
+            %  Dispatches of a concurrent encoder only wait for earlier
+            %  ones they share a written buffer with (see
+            %  Metal.SetBufferWithAccess).
+            %  Returns a command_encoder_handle or uint64(0) on error.
+            %
+            %  [ command_encoder_handle ] = Metal.NewCommandEncoderWithDispatchType( command_buffer_handle, dispatch_type )
+            
+            if coder.target('MATLAB')
+                [ command_encoder_handle ] = CoderAPI.RunMex( command_buffer_handle, dispatch_type );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            raw_handle = Metal.UIntToCommandEncoderHandle(0);
+            raw_handle = coder.ceval( 'mtlNewCommandEncoderWithDispatchType', ...
+                Metal.UIntToCommandBufferHandle( command_buffer_handle ), ...
+                uint32( dispatch_type ) );
+            command_encoder_handle = Metal.HandleToUInt( raw_handle );
+        end
+     
+     
+        
+        function FreeCommandEncoder( command_encoder_handle )
+            %FreeCommandEncoder Free the command encoder
+            %   Free the command encoder referred to by the handle.
+            %
+            %  NOTE: It is essential that Metal.EndEncoding be called
+            %  exactly once prior to freeing the encoder otherwise a
+            %  segfault may occur.
+            %
+            %  Metal.FreeCommandEncoder( command_encoder_handle )
+            coder.cinclude( 'MatlabMetal.h' );
+            if command_encoder_handle == Metal.InvalidHandle
+                return
+            end
+            
+            if coder.target('MATLAB')
+                CoderAPI.RunMex( command_encoder_handle );
+                return
+            end
+            
+            
+            coder.ceval( 'mtlFreeCommandEncoder', Metal.UIntToCommandEncoderHandle( command_encoder_handle ) );
+        end
+        
+        
+        
+        function result = SetComputePipelineState( command_encoder_handle, compute_pipeline_state )
+            %SetComputePipelineState Set the compute pipeline state for the command buffer
+            %   Set the compute pipeline state to use for processing.
+            %   Returns uint32(1) on success, uint32(0) on error.
+            %
+            %  result = Metal.SetComputePipelineState( command_encoder_handle, compute_pipeline_state )
+            if coder.target('MATLAB')
+                result = CoderAPI.RunMex( command_encoder_handle, compute_pipeline_state );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            result = coder.ceval( 'mtlSetComputePipelineState', ...
+                Metal.UIntToCommandEncoderHandle( command_encoder_handle ), ...
+                Metal.UIntToComputePipelineStateHandle( compute_pipeline_state ) );
+        end
+        
+        
+        function result = SetBuffer( command_encoder_handle, buffer_handle, index )
+            %SetBuffer Set a buffer for the command buffer to use
+            %   Set a buffer to be used by the command buffer as well as
+            %   its position in the call (one-based). Returns uint32(1) on success,
+            %   uint32(0) on error.
+            %
+            %  result = Metal.SetBuffer( command_encoder_handle, buffer_handle, index )
+            if coder.target('MATLAB')
+                result = CoderAPI.RunMex( command_encoder_handle, buffer_handle, index );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            result = coder.ceval( 'mtlSetBuffer', ...
+                Metal.UIntToCommandEncoderHandle( command_encoder_handle ), ...
+                Metal.UIntToBufferHandle( buffer_handle ), ...
+                uint32(index-1) );
+        end
+        
+        
+        function result = SetBufferWithAccess( command_encoder_handle, buffer_handle, index, access )
+            %SetBufferWithAccess Set a buffer, saying whether the kernel writes it
+            %   As Metal.SetBuffer, with access Metal.BufferAccessRead for
+            %   a buffer the kernel only reads, or Metal.BufferAccessReadWrite.
+            %   Read-only buffers let dispatches of a concurrent encoder
+            %   that only read them run together. Returns uint32(1) on
+            %   success, uint32(0) on error.
+            %
+            %  result = Metal.SetBufferWithAccess( command_encoder_handle, buffer_handle, index, access )
+            if coder.target('MATLAB')
+                result = CoderAPI.RunMex( command_encoder_handle, buffer_handle, index, access );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            result = coder.ceval( 'mtlSetBufferWithAccess', ...
+                Metal.UIntToCommandEncoderHandle( command_encoder_handle ), ...
+                Metal.UIntToBufferHandle( buffer_handle ), ...
+                uint32(index-1), ...
+                uint32( access ) );
+        end
+        
+        
+        function result = SetBytes( command_encoder_handle, data, index )
+            %SetBytes Pass a small uint8 vector as an argument without a buffer
+            %   The data (at most 4096 bytes) is copied when the call is
+            %   made and bound at the given position (one-based). Intended
+            %   for scalars and small parameter structs. Returns uint32(1)
+            %   on success, uint32(0) on error.
+            %
+            %  result = Metal.SetBytes( command_encoder_handle, data, index )
+            if coder.target('MATLAB')
+                result = CoderAPI.RunMex( command_encoder_handle, data, index );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            result = coder.ceval('-layout:any', 'mtlSetBytes', ...
+                Metal.UIntToCommandEncoderHandle( command_encoder_handle ), ...
+                coder.rref( data ), ...
+                uint64( numel( data ) ), ...
+                uint32(index-1) );
+        end
+        
+                
+        
+        function result = SetThreadsAndShape( command_encoder_handle, compute_pipeline_state_handle, dims )
+            %SetThreadsAndShape Set the number of threads and the shape of the thread processing. 
+            %  Needs the dimensions of the buffers to be processed (as a
+            %  double vector). Returns uint32(1) on success, uint32(0) on
+            %  error.
+            %
+            %  result = Metal.SetThreadsAndShape( command_encoder_handle, buffer_handle, dims )
+            if coder.target('MATLAB')
+                result = CoderAPI.RunMex( command_encoder_handle, compute_pipeline_state_handle, dims );
+                return
+            end
+            
+            dims_pad = [ 1 1 1 ];
+            dims_pad( 1 : min(end, numel( dims )) ) = dims( 1 : min( end, 3 ));
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            result = coder.ceval( 'mtlSetThreadsAndShape', ...
+                Metal.UIntToCommandEncoderHandle( command_encoder_handle ), ...
+                Metal.UIntToComputePipelineStateHandle( compute_pipeline_state_handle ), ...
+                uint32(dims_pad(1)), uint32(dims_pad(2)), uint32(dims_pad(3)) );
+        end
+        
+        
+        function result = SetThreadsAndThreadgroupShape( command_encoder_handle, compute_pipeline_state_handle, dims, group_size )
+            %SetThreadsAndThreadgroupShape Set the number of threads and the threadgroup size
+            %  As SetThreadsAndShape, with an explicit [ width height
+            %  depth ] threadgroup size, or zeros to choose it
+            %  automatically. Returns uint32(1) on success, uint32(0) on
+            %  error.
+            %
+            %  result = Metal.SetThreadsAndThreadgroupShape( command_encoder_handle, compute_pipeline_state_handle, dims, group_size )
+            if coder.target('MATLAB')
+                result = CoderAPI.RunMex( command_encoder_handle, compute_pipeline_state_handle, dims, group_size );
+                return
+            end
+            
+            dims_pad = [ 1 1 1 ];
+            dims_pad( 1 : min(end, numel( dims )) ) = dims( 1 : min( end, 3 ));
+            group_pad = uint32( [ 1 1 1 ] );
+            group_pad( 1 : min(end, numel( group_size )) ) = uint32( group_size( 1 : min( end, 3 )) );
+            if all( group_size == 0 )
+                group_pad = uint32( [ 0 0 0 ] );
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            result = coder.ceval( 'mtlSetThreadsAndThreadgroupShape', ...
+                Metal.UIntToCommandEncoderHandle( command_encoder_handle ), ...
+                Metal.UIntToComputePipelineStateHandle( compute_pipeline_state_handle ), ...
+                uint32(dims_pad(1)), uint32(dims_pad(2)), uint32(dims_pad(3)), ...
+                coder.rref( group_pad ) );
+        end
+        
+        
+        function result = DispatchThreadgroupsIndirect( command_encoder_handle, compute_pipeline_state_handle, buffer_handle, offset, group_size )
+            %DispatchThreadgroupsIndirect Dispatch a grid read from a buffer when it runs
+            %  The buffer holds three uint32 threadgroup counts at the
+            %  byte offset (a multiple of 4), which an earlier kernel can
+            %  write, so a data-dependent size needs no readback.
+            %  group_size is the [ width height depth ] threadgroup size.
+            %  The grid is whole threadgroups, so the kernel must check
+            %  its thread position. Returns uint32(1) on success,
+            %  uint32(0) on error.
+            %
+            %  result = Metal.DispatchThreadgroupsIndirect( command_encoder_handle, compute_pipeline_state_handle, buffer_handle, offset, group_size )
+            if coder.target('MATLAB')
+                result = CoderAPI.RunMex( command_encoder_handle, compute_pipeline_state_handle, buffer_handle, offset, group_size );
+                return
+            end
+            
+            group_pad = uint32( [ 1 1 1 ] );
+            group_pad( 1 : min(end, numel( group_size )) ) = uint32( group_size( 1 : min( end, 3 )) );
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            result = coder.ceval( 'mtlDispatchThreadgroupsIndirect', ...
+                Metal.UIntToCommandEncoderHandle( command_encoder_handle ), ...
+                Metal.UIntToComputePipelineStateHandle( compute_pipeline_state_handle ), ...
+                Metal.UIntToBufferHandle( buffer_handle ), ...
+                uint64( offset ), ...
+                coder.rref( group_pad ) );
+        end
+        
+        
+        
+        function result = EndEncoding( command_encoder_handle )
+            %EndEncoding End encoding the commands
+            %   End encoding of the command buffer
+            %
+            %  Metal.EndEncoding( command_encoder_handle )
+            if coder.target('MATLAB')
+                result = CoderAPI.RunMex( command_encoder_handle );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            result = coder.ceval( 'mtlEndEncoding', Metal.UIntToCommandEncoderHandle( command_encoder_handle ) );
+        end
+        
+        
+        function result = EncodeDispatches( command_buffer_handle, pipeline_handles, buffer_handles, shapes )
+            %EncodeDispatches Encode a batch of kernel dispatches
+            %   Encodes several dispatches into one command buffer in a
+            %   single call. Row d of the inputs describes dispatch d: the
+            %   compute pipeline state handle, the buffer handles bound at
+            %   buffer indices 0, 1, ... (uint64(0) leaves a slot unbound)
+            %   and the [ width height depth ] grid. buffer_handles has
+            %   Metal.MaxDispatchBuffers columns. Returns uint32(1) on
+            %   success, uint32(0) on error.
+            %
+            %  result = Metal.EncodeDispatches( command_buffer_handle, pipeline_handles, buffer_handles, shapes )
+            if coder.target('MATLAB')
+                result = CoderAPI.RunMex( command_buffer_handle, pipeline_handles, buffer_handles, shapes );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            dispatches = Metal.rawDispatchArray( pipeline_handles, buffer_handles, shapes );
+            result = coder.ceval( 'mtlEncodeDispatches', ...
+                Metal.UIntToCommandBufferHandle( command_buffer_handle ), ...
+                coder.rref( dispatches ), ...
+                uint32( numel( dispatches ) ) );
+        end
+        
+        
+        function [ command_buffer_handle ] = SubmitDispatches( command_queue_handle, pipeline_handles, buffer_handles, shapes )
+            %SubmitDispatches Encode and commit a batch of kernel dispatches
+            %   Encodes the dispatches, described as for
+            %   Metal.EncodeDispatches, into a new command buffer and
+            %   commits it, all in one call. Wait for the returned command
+            %   buffer and free it as usual. Returns a
+            %   command_buffer_handle or uint64(0) on error.
+            %
+            %  [ command_buffer_handle ] = Metal.SubmitDispatches( command_queue_handle, pipeline_handles, buffer_handles, shapes )
+            if coder.target('MATLAB')
+                [ command_buffer_handle ] = CoderAPI.RunMex( command_queue_handle, pipeline_handles, buffer_handles, shapes );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            raw_handle = Metal.UIntToCommandBufferHandle(0);
+            dispatches = Metal.rawDispatchArray( pipeline_handles, buffer_handles, shapes );
+            raw_handle = coder.ceval( 'mtlSubmitDispatches', ...
+                Metal.UIntToCommandQueueHandle( command_queue_handle ), ...
+                coder.rref( dispatches ), ...
+                uint32( numel( dispatches ) ) );
+            command_buffer_handle = Metal.HandleToUInt( raw_handle );
+        end
+        
+        
+        function [ command_list_handle ] = NewCommandList( device_handle, pipeline_handles, buffer_handles, shapes )
+            %NewCommandList Record a batch of kernel dispatches to replay
+            %   The dispatches are described as for Metal.EncodeDispatches
+            %   and are checked and looked up once, here, so encoding the
+            %   list again and again costs a single call. Buffers must be
+            %   on the device. Returns a command_list_handle or uint64(0)
+            %   on error.
+            %
+            %  [ command_list_handle ] = Metal.NewCommandList( device_handle, pipeline_handles, buffer_handles, shapes )
+            if coder.target('MATLAB')
+                [ command_list_handle ] = CoderAPI.RunMex( device_handle, pipeline_handles, buffer_handles, shapes );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            raw_handle = Metal.UIntToCommandListHandle(0);
+            dispatches = Metal.rawDispatchArray( pipeline_handles, buffer_handles, shapes );
+            raw_handle = coder.ceval( 'mtlNewCommandList', ...
+                Metal.UIntToDeviceHandle( device_handle ), ...
+                coder.rref( dispatches ), ...
+                uint32( numel( dispatches ) ) );
+            command_list_handle = Metal.HandleToUInt( raw_handle );
+        end
+        
+        
+        function result = CommandListSetBuffer( command_list_handle, index, buffer_index, buffer_handle )
+            %CommandListSetBuffer Bind another buffer in a recorded command list
+            %   index is the one-based position of the dispatch in the
+            %   list and buffer_index the [[ buffer(n) ]] index to bind.
+            %   Command buffers the list was already encoded into keep
+            %   their bindings. Returns uint32(1) on success, uint32(0) on
+            %   error.
+            %
+            %  result = Metal.CommandListSetBuffer( command_list_handle, index, buffer_index, buffer_handle )
+            if coder.target('MATLAB')
+                result = CoderAPI.RunMex( command_list_handle, index, buffer_index, buffer_handle );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            if index < 1
+                return
+            end
+            result = coder.ceval( 'mtlCommandListSetBuffer', ...
+                Metal.UIntToCommandListHandle( command_list_handle ), ...
+                uint32( index - 1 ), ...
+                uint32( buffer_index ), ...
+                Metal.UIntToBufferHandle( buffer_handle ) );
+        end
+        
+        
+        function result = EncodeCommandList( command_buffer_handle, command_list_handle )
+            %EncodeCommandList Encode a recorded command list
+            %   The command buffer must be on the list's device and not
+            %   yet committed. Returns uint32(1) on success, uint32(0) on
+            %   error.
+            %
+            %  result = Metal.EncodeCommandList( command_buffer_handle, command_list_handle )
+            if coder.target('MATLAB')
+                result = CoderAPI.RunMex( command_buffer_handle, command_list_handle );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            result = coder.ceval( 'mtlEncodeCommandList', ...
+                Metal.UIntToCommandBufferHandle( command_buffer_handle ), ...
+                Metal.UIntToCommandListHandle( command_list_handle ) );
+        end
+        
+        
+        function [ command_buffer_handle ] = SubmitCommandList( command_queue_handle, command_list_handle )
+            %SubmitCommandList Encode and commit a recorded command list
+            %   Encodes the list into a new command buffer and commits it.
+            %   Wait for the returned command buffer and free it as usual.
+            %   Returns a command_buffer_handle or uint64(0) on error.
+            %
+            %  [ command_buffer_handle ] = Metal.SubmitCommandList( command_queue_handle, command_list_handle )
+            if coder.target('MATLAB')
+                [ command_buffer_handle ] = CoderAPI.RunMex( command_queue_handle, command_list_handle );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            raw_handle = Metal.UIntToCommandBufferHandle(0);
+            raw_handle = coder.ceval( 'mtlSubmitCommandList', ...
+                Metal.UIntToCommandQueueHandle( command_queue_handle ), ...
+                Metal.UIntToCommandListHandle( command_list_handle ) );
+            command_buffer_handle = Metal.HandleToUInt( raw_handle );
+        end
+        
+        
+        function FreeCommandList( command_list_handle )
+            %FreeCommandList Free the command list
+            %   Command buffers it was encoded into are not affected.
+            %
+            %  Metal.FreeCommandList( command_list_handle )
+            
+            if coder.target('MATLAB')
+                CoderAPI.RunMex( command_list_handle );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            coder.ceval( 'mtlFreeCommandList', Metal.UIntToCommandListHandle( command_list_handle ) );
+        end
+        
+        
+        function [ group_size, result ] = AutotuneThreadgroupSize( command_queue_handle, pipeline_handle, buffer_handles, shape, repetitions )
+            %AutotuneThreadgroupSize Find the fastest threadgroup size for a dispatch
+            %   Runs the dispatch (described as one row of
+            %   Metal.EncodeDispatches) repetitions times for each of a
+            %   set of candidate threadgroup sizes and returns the fastest
+            %   as [ width height depth ]. Later dispatches of the pipeline
+            %   state with the same grid and no explicit size use it. The
+            %   kernel really runs, so use scratch buffers unless it can
+            %   safely run repeatedly. Returns uint32(1) on success,
+            %   uint32(0) on error.
+            %
+            %  [ group_size, result ] = Metal.AutotuneThreadgroupSize( command_queue_handle, pipeline_handle, buffer_handles, shape, repetitions )
+            if coder.target('MATLAB')
+                [ group_size, result ] = CoderAPI.RunMex( command_queue_handle, pipeline_handle, buffer_handles, shape, repetitions );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            group_raw = zeros( 1, 3, 'uint32' );
+            dispatch = Metal.rawDispatchArray( pipeline_handle, buffer_handles, shape );
+            result = coder.ceval( 'mtlAutotuneThreadgroupSize', ...
+                Metal.UIntToCommandQueueHandle( command_queue_handle ), ...
+                coder.rref( dispatch ), ...
+                uint32( repetitions ), ...
+                coder.wref( group_raw ) );
+            group_size = double( group_raw );
+        end
+        
+        
+        function [ value, index, result ] = ReduceBuffer( command_queue_handle, buffer_handle, num_elements, operation, flags )
+            %ReduceBuffer Reduce the first num_elements singles of a buffer to one value
+            %   operation is one of the Metal.Reduce* constants and flags is
+            %   0 or Metal.ReduceDeterministic. Runs after the work already
+            %   committed to the queue and waits for the result, so only the
+            %   value crosses to the host. index is the one-based position
+            %   of the minimum or maximum (NaNs are ignored, ties go to the
+            %   first) and 1 for the other operations. Returns uint32(1) on
+            %   success, uint32(0) on error.
+            %
+            %  [ value, index, result ] = Metal.ReduceBuffer( command_queue_handle, buffer_handle, num_elements, operation, flags )
+            if coder.target('MATLAB')
+                [ value, index, result ] = CoderAPI.RunMex( command_queue_handle, buffer_handle, num_elements, operation, flags );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            raw_reduction = Metal.rawReductionStruct;
+            result = coder.ceval( 'mtlReduceBuffer', ...
+                Metal.UIntToCommandQueueHandle( command_queue_handle ), ...
+                Metal.UIntToBufferHandle( buffer_handle ), ...
+                uint64( num_elements ), ...
+                uint32( operation ), ...
+                uint32( flags ), ...
+                coder.wref( raw_reduction ) );
+            value = raw_reduction.value;
+            index = double( raw_reduction.index ) + 1;
+        end
+        
+        
+        function result = EncodeReduceDimension( command_buffer_handle, source_handle, dims, dimension, operation, destination_handle )
+            %EncodeReduceDimension Encode a reduction of a single array along one dimension
+            %   The source buffer holds an array of size dims; the
+            %   destination receives singles (or zero-based uint32 indices
+            %   for Metal.ReduceArgMin and Metal.ReduceArgMax) in the shape
+            %   of dims with the one-based dimension set to 1. Returns
+            %   uint32(1) on success, uint32(0) on error.
+            %
+            %  result = Metal.EncodeReduceDimension( command_buffer_handle, source_handle, dims, dimension, operation, destination_handle )
+            if coder.target('MATLAB')
+                result = CoderAPI.RunMex( command_buffer_handle, source_handle, dims, dimension, operation, destination_handle );
+                return
+            end
+            
+            dims_pad = uint64( [ 1 1 1 ] );
+            dims_pad( 1 : min(end, numel( dims )) ) = uint64( dims( 1 : min( end, 3 )) );
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            result = coder.ceval( 'mtlEncodeReduceDimension', ...
+                Metal.UIntToCommandBufferHandle( command_buffer_handle ), ...
+                Metal.UIntToBufferHandle( source_handle ), ...
+                coder.rref( dims_pad ), ...
+                uint32( dimension-1 ), ...
+                uint32( operation ), ...
+                Metal.UIntToBufferHandle( destination_handle ) );
+        end
+        
+        
+        function result = EncodeElementwise( command_buffer_handle, opcodes, operands, input_handles, constants, output_handle, num_elements )
+            %EncodeElementwise Encode a fused element-wise program over single buffers
+            %   opcodes and operands describe the program in postfix order
+            %   using the MTL_ELEMENTWISE_ opcodes of MatlabMetal.h; the
+            %   operand of an input or constant is its zero-based position
+            %   in input_handles or constants. The program runs as one
+            %   kernel per element, writing num_elements singles to the
+            %   output buffer. Returns uint32(1) on success, uint32(0) on
+            %   error.
+            %
+            %  result = Metal.EncodeElementwise( command_buffer_handle, opcodes, operands, input_handles, constants, output_handle, num_elements )
+            if coder.target('MATLAB')
+                result = CoderAPI.RunMex( command_buffer_handle, opcodes, operands, input_handles, constants, output_handle, num_elements );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            program = Metal.rawElementwiseProgram( opcodes, operands );
+            inputs = uint64( input_handles );
+            values = single( constants );
+            result = coder.ceval( 'mtlEncodeElementwise', ...
+                Metal.UIntToCommandBufferHandle( command_buffer_handle ), ...
+                coder.rref( program ), ...
+                uint32( numel( program ) ), ...
+                coder.rref( inputs ), ...
+                uint32( numel( inputs ) ), ...
+                coder.rref( values ), ...
+                uint32( numel( values ) ), ...
+                Metal.UIntToBufferHandle( output_handle ), ...
+                uint64( num_elements ) );
+        end
+        
+        
+        
+        function [ output, result ] = StreamKernel( command_queue_handle, compute_pipeline_state_handle, input, resident_handles, memory_budget )
+            %StreamKernel Run a kernel over a single array in chunks
+            %   Runs one thread per element of input, streaming the array
+            %   through pooled buffers in chunks that fit memory_budget
+            %   bytes (0 for half the device's recommended working set).
+            %   Each chunk's elements of input are bound at buffer(0), the
+            %   same elements of output at buffer(1) and the buffers of
+            %   resident_handles, whole, at buffer(2), buffer(3), ...
+            %   output has the size of input. Returns uint32(1) on
+            %   success, uint32(0) on error.
+            %
+            %  [ output, result ] = Metal.StreamKernel( command_queue_handle, compute_pipeline_state_handle, input, resident_handles, memory_budget )
+            if coder.target('MATLAB')
+                [ output, result ] = CoderAPI.RunMex( command_queue_handle, compute_pipeline_state_handle, input, resident_handles, memory_budget );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            output = coder.nullcopy( zeros( size( input ), 'single' ) );
+            residents = uint64( resident_handles );
+            element_size = uint64( 4 );
+            result = coder.ceval( '-layout:any', 'mtlStreamKernelInOut', ...
+                Metal.UIntToCommandQueueHandle( command_queue_handle ), ...
+                Metal.UIntToComputePipelineStateHandle( compute_pipeline_state_handle ), ...
+                coder.rref( input ), ...
+                element_size, ...
+                coder.wref( output ), ...
+                element_size, ...
+                coder.rref( residents ), ...
+                uint32( numel( residents ) ), ...
+                uint64( numel( input ) ), ...
+                uint64( memory_budget ) );
+        end
+        
+        
+        
+        function SetProfilingEnabled( enabled )
+            %SetProfilingEnabled Turn profiling on or off
+            %   While enabled, committed command buffers record their
+            %   timing and commits, waits, copies and command buffers are
+            %   added to the trace (see WriteProfileTrace). Disabling
+            %   keeps what was recorded.
+            %
+            %  Metal.SetProfilingEnabled( enabled )
+            
+            if coder.target('MATLAB')
+                CoderAPI.RunMex( enabled );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            coder.ceval( 'mtlSetProfilingEnabled', uint8( enabled ~= 0 ) );
+        end
+        
+        
+        
+        function enabled = ProfilingEnabled
+            %ProfilingEnabled Return true if profiling is enabled
+            %
+            %  enabled = Metal.ProfilingEnabled
+            
+            if coder.target('MATLAB')
+                enabled = CoderAPI.RunMex( );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            raw_enabled = uint8(0);
+            raw_enabled = coder.ceval( 'mtlProfilingEnabled' );
+            enabled = logical( raw_enabled );
+        end
+        
+        
+        
+        function time = ProfileTime
+            %ProfileTime Return the current time of the profile clock
+            %   In seconds, on the clock of the profiling timestamps.
+            %
+            %  time = Metal.ProfileTime
+            
+            if coder.target('MATLAB')
+                time = CoderAPI.RunMex( );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            time = double(0);
+            time = coder.ceval( 'mtlProfileTime' );
+        end
+        
+        
+        
+        function [ timingStruct, result ] = CommandBufferTiming( command_buffer_handle )
+            %CommandBufferTiming Return the timing of a profiled command buffer
+            %   The command buffer must have been committed while
+            %   profiling was enabled and have completed. Returns a struct
+            %   with the times, in seconds on the profile clock, of the
+            %   first and last dispatch encoded (encode_start, encode_end),
+            %   the commit (commit_time) and the start and end of its
+            %   execution, along with the number of dispatches and the
+            %   final status. result is uint32(1) on success, uint32(0) on
+            %   error.
+            %
+            %  [ timingStruct, result ] = Metal.CommandBufferTiming( command_buffer_handle )
+            
+            if coder.target('MATLAB')
+                [ timingStruct, result ] = CoderAPI.RunMex( command_buffer_handle );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            raw_timing = Metal.rawCommandBufferTimingStruct;
+            result = coder.ceval( 'mtlGetCommandBufferTiming', ...
+                Metal.UIntToCommandBufferHandle( command_buffer_handle ), ...
+                coder.wref( raw_timing ) );
+            timingStruct = struct(...
+                'encode_start', raw_timing.encode_start, ...
+                'encode_end', raw_timing.encode_end, ...
+                'commit_time', raw_timing.commit_time, ...
+                'start_time', raw_timing.start_time, ...
+                'end_time', raw_timing.end_time, ...
+                'num_dispatches', double( raw_timing.num_dispatches ), ...
+                'status', raw_timing.status ...
+                );
+        end
+        
+        
+        
+        function [ timingStruct, result ] = DispatchTiming( command_buffer_handle, index )
+            %DispatchTiming Return the timing of one dispatch of a profiled command buffer
+            %   index is the one-based position of the dispatch in
+            %   encoding order. Returns a struct with the function name,
+            %   the time it was encoded, the start and end of its
+            %   execution and its grid size. On Metal, the start and end
+            %   are those of the whole command buffer. result is uint32(1)
+            %   on success, uint32(0) on error.
+            %
+            %  [ timingStruct, result ] = Metal.DispatchTiming( command_buffer_handle, index )
+            
+            if coder.target('MATLAB')
+                [ timingStruct, result ] = CoderAPI.RunMex( command_buffer_handle, index );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            raw_timing = Metal.rawDispatchTimingStruct;
+            result = coder.ceval( 'mtlGetDispatchTiming', ...
+                Metal.UIntToCommandBufferHandle( command_buffer_handle ), ...
+                uint32( index - 1 ), ...
+                coder.wref( raw_timing ) );
+            timingStruct = struct(...
+                'function_name', string( trimszString( raw_timing.function_name ) ), ...
+                'encode_time', raw_timing.encode_time, ...
+                'start_time', raw_timing.start_time, ...
+                'end_time', raw_timing.end_time, ...
+                'shape', double( [ raw_timing.width raw_timing.height raw_timing.depth ] ) ...
+                );
+        end
+        
+        
+        
+        function statsStruct = ProfileStats
+            %ProfileStats Return the host-side totals recorded while profiling
+            %   Returns a struct with the number, bytes and seconds of
+            %   copies into (copies_in, bytes_in, copy_in_seconds) and out
+            %   of (copies_out, bytes_out, copy_out_seconds) buffers, the
+            %   number and seconds of commits and waits, and the number of
+            %   trace events dropped once the trace was full.
+            %
+            %  statsStruct = Metal.ProfileStats
+            
+            if coder.target('MATLAB')
+                statsStruct = CoderAPI.RunMex( );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            raw_stats = Metal.rawProfileStatsStruct;
+            coder.ceval( 'mtlGetProfileStats', coder.wref( raw_stats ) );
+            statsStruct = struct(...
+                'copies_in', double( raw_stats.copies_in ), ...
+                'bytes_in', double( raw_stats.bytes_in ), ...
+                'copy_in_seconds', raw_stats.copy_in_seconds, ...
+                'copies_out', double( raw_stats.copies_out ), ...
+                'bytes_out', double( raw_stats.bytes_out ), ...
+                'copy_out_seconds', raw_stats.copy_out_seconds, ...
+                'commits', double( raw_stats.commits ), ...
+                'commit_seconds', raw_stats.commit_seconds, ...
+                'waits', double( raw_stats.waits ), ...
+                'wait_seconds', raw_stats.wait_seconds, ...
+                'dropped_events', double( raw_stats.dropped_events ) ...
+                );
+        end
+        
+        
+        
+        function result = WriteProfileTrace( filename )
+            %WriteProfileTrace Write the recorded trace as a Chrome trace file
+            %   The JSON file opens in chrome://tracing or Perfetto, with
+            %   the host calls on one track per thread and the command
+            %   buffers of each device on their own tracks. Returns
+            %   uint32(1) on success, uint32(0) on error.
+            %
+            %  result = Metal.WriteProfileTrace( filename )
+            
+            if coder.target('MATLAB')
+                result = CoderAPI.RunMex( filename );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            result = uint32(0);
+            char_filename = NullTerminateString( filename );
+            result = coder.ceval( 'mtlWriteProfileTrace', char_filename );
+        end
+        
+        
+        
+        function ClearProfile
+            %ClearProfile Discard the recorded trace and totals
+            %
+            %  Metal.ClearProfile
+            
+            if coder.target('MATLAB')
+                CoderAPI.RunMex( );
+                return
+            end
+            
+            coder.cinclude( 'MatlabMetal.h' );
+            coder.ceval( 'mtlClearProfile' );
         end
         
     end
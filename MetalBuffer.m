@@ -37,14 +37,23 @@ classdef MetalBuffer < handle %codegen
             % If the second parameter is a vector of doubles up to three
             % elements long, and the third  an uninitialized buffer of that
             % size will be created.  If the third parameter is specified,
-            % it can be one of 'single' or 'uint16' (default is 'single' if
-            % unspecified).
+            % it can be one of 'single', 'uint16', 'half' or 'bfloat16'
+            % (default is 'single' if unspecified).
+            %
+            % A single array can also be stored as 'half' or 'bfloat16',
+            % taking two bytes per element. It is rounded to nearest even
+            % on the way in and read back as single. The built-in kernels
+            % have _half and _bfloat16 variants that read such a buffer
+            % and accumulate into a single one.
+            %
+            % Storage comes from the device's buffer pool and returns to
+            % it when the object is deleted (see MetalDevice.BufferPoolStats).
             %
             % Call the isValid method to determine if the object was
             % successuflly initialized.
             %
             % obj = MetalBuffer() 
-            % obj = MetalBuffer( device, single_array )
+            % obj = MetalBuffer( device, single_array, [char_class] )
             % obj = MetalBuffer( device, uint16_array )
             % obj = MetalBuffer( device, double_dimensions, [char_class] )
             % obj = MetalBuffer( device, <MetalBufferObject> )
@@ -68,14 +77,20 @@ classdef MetalBuffer < handle %codegen
             % If the second parameter is a vector of doubles up to three
             % elements long, and the third  an uninitialized buffer of that
             % size will be created.  If the third parameter is specified,
-            % it can be one of 'single' or 'uint16' (default is 'single' if
-            % unspecified).
+            % it can be one of 'single', 'uint16', 'half' or 'bfloat16'
+            % (default is 'single' if unspecified).
+            %
+            % A single array can also be stored as 'half' or 'bfloat16',
+            % taking two bytes per element. It is rounded to nearest even
+            % on the way in and read back as single. The built-in kernels
+            % have _half and _bfloat16 variants that read such a buffer
+            % and accumulate into a single one.
             %
             % Call the isValid method to determine if the object was
             % successuflly initialized.
             %
             % obj.Initialize()
-            % obj.Initialize( device, single_array )
+            % obj.Initialize( device, single_array, [char_class] )
             % obj.Initialize( device, uint16_array )
             % obj.Initialize( device, double_dimensions, [char_class] )
             % obj.Initialize( device, <MetalBufferObject> )
@@ -97,20 +112,13 @@ classdef MetalBuffer < handle %codegen
             
             switch class(input)
                 case 'MetalBuffer'
-                    obj.handle = Metal.NewBuffer( creationdevice.handle, input.numbytes );
+                    obj.handle = Metal.NewPooledBuffer( creationdevice.handle, input.numbytes );
                     if obj.handle == uint64(0)
                         obj.message = Metal.LastError;
                         return
                     end
                     
-                    [ data, result ] = Metal.CopyDataFromBuffer( input.handle );
-                    if result == uint32(0)
-                        obj.handle = uint64(0);
-                        obj.message = Metal.LastError;
-                        return
-                    end
-                    
-                    result = Metal.CopyDataToBuffer( obj.handle, data );
+                    result = Metal.CopyBufferToBuffer( obj.handle, input.handle );
                     if result == uint32(0)
                         obj.handle = uint64(0);
                         obj.message = Metal.LastError;
@@ -125,13 +133,13 @@ classdef MetalBuffer < handle %codegen
                     obj.data_class = new_class;
                     switch new_class
                         case 'single'
-                            obj.handle = Metal.NewBuffer( creationdevice.handle, prod(obj.dimensions) * 4 );
+                            obj.handle = Metal.NewPooledBuffer( creationdevice.handle, prod(obj.dimensions) * 4 );
                             if obj.handle == uint64(0)
                                 obj.message = Metal.LastError;
                                 return
                             end
-                        case 'uint16'
-                            obj.handle = Metal.NewBuffer( creationdevice.handle, prod(obj.dimensions) * 2 );
+                        case { 'uint16', 'half', 'bfloat16' }
+                            obj.handle = Metal.NewPooledBuffer( creationdevice.handle, prod(obj.dimensions) * 2 );
                             if obj.handle == uint64(0)
                                 obj.message = Metal.LastError;
                                 return
@@ -142,14 +150,22 @@ classdef MetalBuffer < handle %codegen
                             return
                     end
                     
-                case 'single'  %A single array of data was provided
-                    obj.handle = Metal.NewBuffer( creationdevice.handle, numel(input) * 4 );
+                case 'single'  %A single array of data was provided, stored as new_class
+                    switch new_class
+                        case 'single'
+                            obj.handle = Metal.NewPooledBuffer( creationdevice.handle, numel(input) * 4 );
+                        case { 'half', 'bfloat16' }
+                            obj.handle = Metal.NewPooledBuffer( creationdevice.handle, numel(input) * 2 );
+                        otherwise
+                            obj.message = "Unknown class type specified: " + string( new_class );
+                            return
+                    end
                     if obj.handle == uint64(0)
                         obj.message = Metal.LastError;
                         return
                     end
                     
-                    result = Metal.CopySingleDataToBuffer( obj.handle, input );
+                    result = Metal.CopyFloatsToBuffer( obj.handle, input, MetalBuffer.Format( new_class ) );
                     if result == uint32(0)
                         obj.handle = uint64(0);
                         obj.message = Metal.LastError;
@@ -157,10 +173,10 @@ classdef MetalBuffer < handle %codegen
                     end
                     
                     obj.dimensions = size( input );
-                    obj.data_class = 'single';
+                    obj.data_class = new_class;
                     
                 case 'uint16'  %A uint16 array of data was provided.
-                    obj.handle = Metal.NewBuffer( creationdevice.handle, numel(input) * 2 );
+                    obj.handle = Metal.NewPooledBuffer( creationdevice.handle, numel(input) * 2 );
                     if obj.handle == uint64(0)
                         obj.message = Metal.LastError;
                         return
@@ -208,8 +224,8 @@ classdef MetalBuffer < handle %codegen
                         obj.message = Metal.LastError;
                     end
                     
-                case 'single'
-                    [ outdata_single, result ] = Metal.CopySingleDataFromBuffer( obj.handle, obj.dimensions );
+                case { 'single', 'half', 'bfloat16' }
+                    [ outdata_single, result ] = Metal.CopyFloatsFromBuffer( obj.handle, obj.dimensions, MetalBuffer.Format( obj.data_class ) );
                     outdata = uint16( outdata_single );
                     if result == uint32(0)
                         obj.message = Metal.LastError;
@@ -239,6 +255,12 @@ classdef MetalBuffer < handle %codegen
                         obj.message = Metal.LastError;
                     end
                     
+                case { 'half', 'bfloat16' }
+                    [ outdata, result ] = Metal.CopyFloatsFromBuffer( obj.handle, obj.dimensions, MetalBuffer.Format( obj.data_class ) );
+                    if result == uint32(0)
+                        obj.message = Metal.LastError;
+                    end
+                    
                 otherwise
                     obj.message = "Unknown internal type";
                     outdata = zeros( obj.dimensions, 'single');
@@ -247,6 +269,273 @@ classdef MetalBuffer < handle %codegen
         
         
         
+        function result = WriteRegion( obj, origin, data )
+            %WriteRegion Copy an array into a sub-block of the buffer
+            % Copies data into the buffer's internal array starting at the
+            % one-based origin, transferring only the bytes of the
+            % sub-block.  The data is converted to the buffer's class.
+            % Missing trailing origin elements default to one.
+            %
+            % Returns true on success, false on failure.
+            %
+            % result = obj.WriteRegion( origin, data )
+            
+            full_origin = ones( 1, 3 );
+            full_origin( 1 : min( end, numel( origin ) ) ) = origin( 1 : min( 3, end ) );
+            
+            switch obj.data_class
+                case 'uint16'
+                    status = Metal.CopyUInt16RegionToBuffer( obj.handle, obj.dimensions, full_origin, uint16( data ) );
+                case 'single'
+                    status = Metal.CopySingleRegionToBuffer( obj.handle, obj.dimensions, full_origin, single( data ) );
+                case { 'half', 'bfloat16' }
+                    obj.message = "Regions of half and bfloat16 buffers are not supported";
+                    result = false;
+                    return
+                otherwise
+                    obj.message = "Unknown internal type";
+                    result = false;
+                    return
+            end
+            
+            result = status ~= uint32(0);
+            if ~result
+                obj.message = Metal.LastError;
+            end
+        end
+        
+        
+        
+        function outdata = ReadRegion( obj, origin, region )
+            %ReadRegion Copy a sub-block of the buffer into an array
+            % Returns the sub-block of the buffer's internal array with the
+            % dimensions region starting at the one-based origin,
+            % transferring only the bytes of the sub-block.  Missing
+            % trailing origin and region elements default to one.
+            %
+            % outdata = obj.ReadRegion( origin, region )
+            
+            full_origin = ones( 1, 3 );
+            full_origin( 1 : min( end, numel( origin ) ) ) = origin( 1 : min( 3, end ) );
+            full_region = ones( 1, 3 );
+            full_region( 1 : min( end, numel( region ) ) ) = region( 1 : min( 3, end ) );
+            
+            switch obj.data_class
+                case 'uint16'
+                    [ outdata, result ] = Metal.CopyUInt16RegionFromBuffer( obj.handle, obj.dimensions, full_origin, full_region );
+                case 'single'
+                    [ outdata, result ] = Metal.CopySingleRegionFromBuffer( obj.handle, obj.dimensions, full_origin, full_region );
+                case { 'half', 'bfloat16' }
+                    obj.message = "Regions of half and bfloat16 buffers are not supported";
+                    outdata = zeros( full_region, 'single');
+                    return
+                otherwise
+                    obj.message = "Unknown internal type";
+                    outdata = zeros( full_region, 'single');
+                    return
+            end
+            
+            if result == uint32(0)
+                obj.message = Metal.LastError;
+            end
+        end
+        
+        
+        
+        function [ value, index ] = Reduce( obj, operation, dim, deterministic )
+            %Reduce Reduce the buffer on its device
+            % operation is one of 'sum', 'mean', 'min', 'max' or 'norm'.
+            % Without dim (or with an empty dim), the whole array is
+            % reduced and value is a double scalar. With dim (1 to 3),
+            % value is a new single MetalBuffer with that dimension of the
+            % array reduced to 1, which stays on the device. For 'min' and
+            % 'max', index receives the one-based positions of the results
+            % (along dim, or in the whole array); NaNs are ignored and ties
+            % go to the first. Set deterministic to reduce the whole array
+            % in an order that does not depend on the number of threads.
+            % Only single buffers can be reduced.
+            %
+            % On error, value is NaN (or an invalid MetalBuffer) and the
+            % message is placed in the "message" property.
+            %
+            % [ value, index ] = obj.Reduce( operation, [dim], [deterministic] )
+            
+            if nargin < 3
+                dim = [];
+            end
+            if nargin < 4
+                deterministic = false;
+            end
+            index = [];
+            
+            switch lower( operation )
+                case 'sum'
+                    code = Metal.ReduceSum;
+                case 'mean'
+                    code = Metal.ReduceMean;
+                case 'min'
+                    code = Metal.ReduceMin;
+                case 'max'
+                    code = Metal.ReduceMax;
+                case 'norm'
+                    code = Metal.ReduceNorm;
+                otherwise
+                    obj.message = "Unknown reduction: " + string( operation );
+                    value = NaN;
+                    return
+            end
+            if ~strcmp( obj.data_class, 'single' )
+                obj.message = "Only single buffers can be reduced.";
+                value = NaN;
+                return
+            end
+            
+            command_queue = MetalCommandQueue( obj.device );
+            if isempty( dim )
+                flags = 0;
+                if deterministic
+                    flags = Metal.ReduceDeterministic;
+                end
+                [ value, index, result ] = Metal.ReduceBuffer( command_queue.handle, obj.handle, prod( obj.dimensions ), code, flags );
+                if result == uint32(0)
+                    obj.message = Metal.LastError;
+                    value = NaN;
+                end
+                return
+            end
+            
+            out_dims = obj.dimensions;
+            out_dims( dim ) = 1;
+            value = MetalBuffer( obj.device, out_dims );
+            command_buffer = MetalCommandBuffer( command_queue );
+            result = Metal.EncodeReduceDimension( command_buffer.handle, obj.handle, obj.dimensions, dim, code, value.handle );
+            want_index = nargout > 1 && ( code == Metal.ReduceMin || code == Metal.ReduceMax );
+            if want_index && result ~= uint32(0)
+                arg_code = Metal.ReduceArgMin;
+                if code == Metal.ReduceMax
+                    arg_code = Metal.ReduceArgMax;
+                end
+                index_buffer = MetalBuffer( obj.device, out_dims );
+                result = Metal.EncodeReduceDimension( command_buffer.handle, obj.handle, obj.dimensions, dim, arg_code, index_buffer.handle );
+            end
+            if result == uint32(0) || ~command_buffer.Commit || ~command_buffer.WaitForCompletion
+                obj.message = Metal.LastError;
+                value = MetalBuffer;
+                return
+            end
+            
+            if want_index
+                bytes = Metal.CopyDataFromBuffer( index_buffer.handle );
+                index = reshape( double( typecast( bytes( 1 : 4 * prod( out_dims ) ), 'uint32' ) ) + 1, out_dims );
+            end
+        end
+        
+        
+        
+        function value = Sum( obj, varargin )
+            %Sum Sum of the elements, as for Reduce with 'sum'
+            %
+            % value = obj.Sum( [dim], [deterministic] )
+            value = obj.Reduce( 'sum', varargin{:} );
+        end
+        
+        
+        
+        function value = Mean( obj, varargin )
+            %Mean Mean of the elements, as for Reduce with 'mean'
+            %
+            % value = obj.Mean( [dim], [deterministic] )
+            value = obj.Reduce( 'mean', varargin{:} );
+        end
+        
+        
+        
+        function [ value, index ] = Min( obj, varargin )
+            %Min Smallest element and its index, as for Reduce with 'min'
+            %
+            % [ value, index ] = obj.Min( [dim] )
+            [ value, index ] = obj.Reduce( 'min', varargin{:} );
+        end
+        
+        
+        
+        function [ value, index ] = Max( obj, varargin )
+            %Max Largest element and its index, as for Reduce with 'max'
+            %
+            % [ value, index ] = obj.Max( [dim] )
+            [ value, index ] = obj.Reduce( 'max', varargin{:} );
+        end
+        
+        
+        
+        function value = Norm( obj, varargin )
+            %Norm Euclidean norm of the elements, as for Reduce with 'norm'
+            %
+            % value = obj.Norm( [dim], [deterministic] )
+            value = obj.Reduce( 'norm', varargin{:} );
+        end
+        
+        
+        
+        % Element-wise arithmetic is deferred: each operator returns a
+        % MetalExpression, which runs as one fused kernel when evaluated
+        % (see MetalExpression).
+        
+        function expression = plus( a, b )
+            expression = MetalExpression( a ) + b;
+        end
+        
+        
+        function expression = minus( a, b )
+            expression = MetalExpression( a ) - b;
+        end
+        
+        
+        function expression = times( a, b )
+            expression = MetalExpression( a ) .* b;
+        end
+        
+        
+        function expression = mtimes( a, b )
+            expression = MetalExpression( a ) * b;
+        end
+        
+        
+        function expression = rdivide( a, b )
+            expression = MetalExpression( a ) ./ b;
+        end
+        
+        
+        function expression = mrdivide( a, b )
+            expression = MetalExpression( a ) / b;
+        end
+        
+        
+        function expression = uminus( a )
+            expression = -MetalExpression( a );
+        end
+        
+        
+        function expression = abs( a )
+            expression = abs( MetalExpression( a ) );
+        end
+        
+        
+        function expression = max( a, b )
+            %max Element-wise maximum with another buffer or a scalar, as a MetalExpression
+            % Use the Max method for the largest element of the buffer.
+            expression = max( MetalExpression( a ), b );
+        end
+        
+        
+        function expression = min( a, b )
+            %min Element-wise minimum with another buffer or a scalar, as a MetalExpression
+            % Use the Min method for the smallest element of the buffer.
+            expression = min( MetalExpression( a ), b );
+        end
+        
+        
+        
         function device = get.device( obj )
             device = MetalDevice( Metal.BufferDevice( obj.handle ) );
         end
@@ -257,21 +546,14 @@ classdef MetalBuffer < handle %codegen
             currentDevice = MetalDevice( Metal.BufferDevice( obj.handle ) );
             
             if ~currentDevice.isequal( device )
-                newhandle = Metal.NewBuffer( device.handle, obj.numbytes );
+                newhandle = Metal.NewPooledBuffer( device.handle, obj.numbytes );
                 if newhandle == uint64(0)
                     obj.deallocate;
                     obj.message = Metal.LastError;
                     return
                 end
                 
-                [ data, result ] = Metal.CopyDataFromBuffer( obj.handle );
-                if result == uint32(0)
-                    obj.deallocate;
-                    obj.message = Metal.LastError;
-                    return
-                end
-                
-                result = Metal.CopyDataToBuffer( newhandle, data );
+                result = Metal.CopyBufferToBuffer( newhandle, obj.handle );
                 if result == uint32(0)
                     obj.deallocate;
                     obj.message = Metal.LastError;
@@ -309,6 +591,104 @@ classdef MetalBuffer < handle %codegen
         function delete( obj )
             obj.deallocate;
         end
+        
+    end
+    
+    
+    methods (Static)
+        
+        function obj = FromFile( device, filename, dimensions, data_class, mode, offset )
+            %FromFile Create a MetalBuffer over an array stored in a file
+            % The file holds the array's elements in column-major order,
+            % starting offset bytes in (default 0). Its pages are mapped
+            % rather than read, so they are loaded as kernels reach them
+            % and an array larger than memory is never held in full.
+            % data_class is 'single' (default), 'uint16', 'half' or
+            % 'bfloat16'. mode is Metal.FileReadOnly (default), for a
+            % buffer that kernels may only read, or Metal.FileCopyOnWrite,
+            % for one whose writes never reach the file.
+            %
+            % obj = MetalBuffer.FromFile( device, filename, dimensions, [data_class], [mode], [offset] )
+            
+            if nargin < 4
+                data_class = 'single';
+            end
+            if nargin < 5
+                mode = Metal.FileReadOnly;
+            end
+            if nargin < 6
+                offset = 0;
+            end
+            
+            obj = MetalBuffer();
+            switch data_class
+                case 'single'
+                    element_size = 4;
+                case { 'uint16', 'half', 'bfloat16' }
+                    element_size = 2;
+                otherwise
+                    obj.message = "Unknown class type specified: " + string( data_class );
+                    return
+            end
+            
+            obj.handle = Metal.NewBufferFromFile( device.handle, filename, offset, prod( dimensions ) * element_size, mode );
+            if obj.handle == uint64(0)
+                obj.message = Metal.LastError;
+                return
+            end
+            obj.dimensions = dimensions;
+            obj.data_class = data_class;
+        end
+        
+        
+        function obj = WrapHostArray( device, data )
+            %WrapHostArray Create a MetalBuffer that uses a single or uint16 array as its storage
+            % In generated code the buffer aliases data, so kernels read
+            % and write the array in place with no copy and no second
+            % resident copy. data must stay in scope and must not be
+            % touched by other code while the buffer exists, and on Metal
+            % its address and size must be whole pages (see
+            % mtlHostPointerAlignment). In MATLAB, which may move or share
+            % arrays, the data is copied as by MetalBuffer( device, data ).
+            %
+            % obj = MetalBuffer.WrapHostArray( device, data )
+            
+            if coder.target('MATLAB')
+                obj = MetalBuffer( device, data );
+                return
+            end
+            
+            obj = MetalBuffer();
+            if ~isa( data, 'single' ) && ~isa( data, 'uint16' )
+                obj.message = "Unknown data type for input.";
+                return
+            end
+            
+            obj.handle = Metal.NewBufferWithHostPointer( device.handle, data );
+            if obj.handle == uint64(0)
+                obj.message = Metal.LastError;
+                return
+            end
+            obj.dimensions = size( data );
+            obj.data_class = class( data );
+        end
+    
+    end
+    
+    
+    methods (Static, Access = private)
+        
+        function format = Format( data_class )
+            %Format The Metal.Format* element format of a floating-point data class
+            switch data_class
+                case 'half'
+                    format = Metal.FormatHalf;
+                case 'bfloat16'
+                    format = Metal.FormatBFloat16;
+                otherwise
+                    format = Metal.FormatFloat;
+            end
+        end
     
     end
     
@@ -10,6 +10,8 @@ classdef MetalCommandBuffer < handle %codegen
     properties (Dependent, SetAccess = private)
         isValid   %True if the handle is valid
         device    %The device on which the command buffer exists
+        status    %Execution status (0 not enqueued, 2 committed, 3 scheduled, 4 completed, 5 error)
+        isCompleted  %True once the command buffer has finished processing
     end
 
     
@@ -90,6 +92,93 @@ classdef MetalCommandBuffer < handle %codegen
         end
         
         
+        function value = get.status( obj )
+            [ value, result ] = Metal.CommandBufferStatus( obj.handle );
+            if result == uint32(0)
+                value = uint32(5);
+            end
+        end
+        
+        
+        function result = get.isCompleted( obj )
+            result = obj.status >= uint32(4);
+        end
+        
+        
+        function result = EncodeDispatches( obj, pipelines, buffers, shapes )
+            %EncodeDispatches Encode several kernel dispatches in one call
+            % Encodes a chain of kernels into the command buffer with a
+            % single call into the library, instead of one
+            % MetalCommandEncoder per kernel. pipelines is a cell array of
+            % MetalComputePipelineState objects, buffers a cell array
+            % holding, for each dispatch, a cell array of the MetalBuffer
+            % objects bound at buffer indices 0, 1, ..., and shapes has one
+            % row per dispatch with the grid size (up to three columns).
+            % Dispatches run in order, as if encoded one at a time.
+            % Returns uint32(1) on success, uint32(0) on error (with
+            % message placed in the "message" property.)
+            %
+            %  result = obj.EncodeDispatches( { cps1, cps2 }, { { A, B }, { B, C } }, [ n; n ] )
+            
+            count = numel( pipelines );
+            pipeline_handles = zeros( count, 1, 'uint64' );
+            buffer_handles = zeros( count, Metal.MaxDispatchBuffers, 'uint64' );
+            grid = ones( count, 3 );
+            for d = 1:count
+                pipeline_handles(d) = pipelines{d}.handle;
+                dispatch_buffers = buffers{d};
+                for i = 1:min( numel( dispatch_buffers ), Metal.MaxDispatchBuffers )
+                    buffer_handles(d, i) = dispatch_buffers{i}.handle;
+                end
+                grid(d, 1:size( shapes, 2 )) = shapes(d, :);
+            end
+            
+            result = Metal.EncodeDispatches( obj.handle, pipeline_handles, buffer_handles, grid );
+            if result == uint32(0)
+                obj.message = Metal.LastError;
+            end
+        end
+        
+        
+        function result = EncodeCommandList( obj, command_list )
+            %EncodeCommandList Encode the dispatches of a MetalCommandList
+            % The list replays with one call into the library, whatever
+            % its length. Returns uint32(1) on success, uint32(0) on error
+            % (with message placed in the "message" property.)
+            
+            result = Metal.EncodeCommandList( obj.handle, command_list.handle );
+            if result == uint32(0)
+                obj.message = Metal.LastError;
+            end
+        end
+        
+        
+        function result = EncodeSignalEvent( obj, event, value )
+            %EncodeSignalEvent Signal a MetalEvent once the work encoded so far is done
+            % Encode it between command encoders. Returns uint32(1) on
+            % success, uint32(0) on error (with message placed in the
+            % "message" property.)
+            
+            result = Metal.EncodeSignalEvent( obj.handle, event.handle, value );
+            if result == uint32(0)
+                obj.message = Metal.LastError;
+            end
+        end
+        
+        
+        function result = EncodeWaitForEvent( obj, event, value )
+            %EncodeWaitForEvent Hold the work encoded next until a MetalEvent reaches a value
+            % Encode it between command encoders. Work on other queues
+            % goes on meanwhile. Returns uint32(1) on success, uint32(0)
+            % on error (with message placed in the "message" property.)
+            
+            result = Metal.EncodeWaitForEvent( obj.handle, event.handle, value );
+            if result == uint32(0)
+                obj.message = Metal.LastError;
+            end
+        end
+        
+        
         function result = Commit( obj )
             %Commit Commit the command buffer for processing
             % Returns uint32(1) on success, uint32(0) on error (with
@@ -114,10 +203,84 @@ classdef MetalCommandBuffer < handle %codegen
         end
         
         
+        function timing = Timing( obj )
+            %Timing Return the timing of the command buffer and its dispatches
+            % The command buffer must have been committed while profiling
+            % was enabled (see Metal.SetProfilingEnabled) and have
+            % completed. Returns the struct of Metal.CommandBufferTiming
+            % with a "dispatches" field holding the struct of
+            % Metal.DispatchTiming for each dispatch, in encoding order.
+            % Returns an empty array on error (with message placed in the
+            % "message" property.)
+            %
+            %  timing = obj.Timing
+            
+            [ timing, result ] = Metal.CommandBufferTiming( obj.handle );
+            if result == uint32(0)
+                obj.message = Metal.LastError;
+                timing = [];
+                return
+            end
+            
+            dispatches = struct( 'function_name', {}, 'encode_time', {}, 'start_time', {}, 'end_time', {}, 'shape', {} );
+            for d = 1:timing.num_dispatches
+                [ dispatch, result ] = Metal.DispatchTiming( obj.handle, d );
+                if result == uint32(0)
+                    obj.message = Metal.LastError;
+                    timing = [];
+                    return
+                end
+                dispatches(d) = dispatch;
+            end
+            timing.dispatches = dispatches;
+        end
+        
+        
         function delete( obj )
             Metal.FreeCommandBuffer( obj.handle );
         end
     
     end
     
+    
+    methods (Static)
+        
+        function index = WaitAny( varargin )
+            %WaitAny Wait for any of several command buffers to complete
+            % Given committed MetalCommandBuffer objects, waits until one
+            % of them has finished processing and returns its one-based
+            % position in the argument list, or 0 on error.
+            %
+            %  index = MetalCommandBuffer.WaitAny( command_buffer1, command_buffer2, ... )
+            
+            handles = zeros( 1, nargin, 'uint64' );
+            for i = 1:nargin
+                handles(i) = varargin{i}.handle;
+            end
+            
+            [ index, result ] = Metal.WaitAnyCommandBuffer( handles );
+            if result == uint32(0)
+                index = 0;
+            end
+        end
+        
+        
+        function result = WaitAll( varargin )
+            %WaitAll Wait for several command buffers to complete
+            % Given committed MetalCommandBuffer objects, waits until all
+            % of them have finished processing.
+            % Returns uint32(1) on success, uint32(0) on error.
+            %
+            %  result = MetalCommandBuffer.WaitAll( command_buffer1, command_buffer2, ... )
+            
+            handles = zeros( 1, nargin, 'uint64' );
+            for i = 1:nargin
+                handles(i) = varargin{i}.handle;
+            end
+            
+            result = Metal.WaitAllCommandBuffers( handles );
+        end
+        
+    end
+    
 end
\ No newline at end of file
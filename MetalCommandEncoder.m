@@ -16,17 +16,35 @@ classdef MetalCommandEncoder < handle %codegen
     
     methods
     
-        function obj = MetalCommandEncoder( command_buffer )
+        function obj = MetalCommandEncoder( command_buffer, dispatch_type )
             %MetalCommandEncoder Constructor for a MetalCommandEncoder object
             % Create a new MetalCommandEncoder object given a
             % MetalCommandBuffer object to associate it with.
             %
+            % dispatch_type is 'serial' (the default) or 'concurrent'.
+            % The dispatches of a concurrent encoder run together unless
+            % one writes a buffer another binds; pass 'read' to SetBuffer
+            % for buffers a kernel only reads.
+            %
             % Call the isValid method to determine if the object was
             % successuflly created.
             %
             %  obj = MetalCommandEncoder( command_buffer )
+            %  obj = MetalCommandEncoder( command_buffer, 'concurrent' )
             
-            obj.handle = Metal.NewCommandEncoder( command_buffer.handle );
+            if nargin < 2
+                obj.handle = Metal.NewCommandEncoder( command_buffer.handle );
+            else
+                switch dispatch_type
+                    case 'serial'
+                        type = Metal.DispatchSerial;
+                    case 'concurrent'
+                        type = Metal.DispatchConcurrent;
+                    otherwise
+                        type = uint32(intmax('uint32'));
+                end
+                obj.handle = Metal.NewCommandEncoderWithDispatchType( command_buffer.handle, type );
+            end
             if obj.handle == uint64(0)
                 obj.message = Metal.LastError;
             end
@@ -52,32 +70,89 @@ classdef MetalCommandEncoder < handle %codegen
         end
         
         
-        function result = SetBuffer( obj, buffer, index )
+        function result = SetBuffer( obj, buffer, index, access )
             %SetBuffer Set a buffer as an argument at index (one-based)
             %  Given a MetalBuffer object and an index of the argument
             %  position (one-based), will associate the buffer with the
-            %  function.
+            %  function. Pass access 'read' if the kernel only reads the
+            %  buffer, or 'readwrite' (the default).
+            %
+            %  Returns uint32(1) on success, uint32(0) on error (with
+            %  message placed in the "message" property.)
+            
+            if nargin < 4
+                result = Metal.SetBuffer( obj.handle, buffer.handle, index );
+            else
+                switch access
+                    case 'read'
+                        hint = Metal.BufferAccessRead;
+                    case 'readwrite'
+                        hint = Metal.BufferAccessReadWrite;
+                    otherwise
+                        hint = uint32(intmax('uint32'));
+                end
+                result = Metal.SetBufferWithAccess( obj.handle, buffer.handle, index, hint );
+            end
+            if result == uint32(0)
+                obj.message = Metal.LastError;
+            end
+        end
+        
+        
+        function result = SetBytes( obj, value, index )
+            %SetBytes Pass a numeric value as an argument at index (one-based)
+            %  The value (for example a single scalar, or a small array of
+            %  parameters) is copied into the command stream, so no
+            %  MetalBuffer is needed and it may be changed right after.
+            %  The kernel should declare it in the constant address space.
             %
             %  Returns uint32(1) on success, uint32(0) on error (with
             %  message placed in the "message" property.)
             
-            result = Metal.SetBuffer( obj.handle, buffer.handle, index );
+            result = Metal.SetBytes( obj.handle, typecast( value(:).', 'uint8' ), index );
             if result == uint32(0)
                 obj.message = Metal.LastError;
             end
         end
         
         
-        function result = SetThreadsAndShape( obj, compute_pipeline_state, dims )
+        function result = SetThreadsAndShape( obj, compute_pipeline_state, dims, group_size )
             %SetThreadsAndShape Set the shape of the data and thread setup
             %  Given a MetalComputePipelineState object and the dimensions
             %  of the buffer data (up to three dimensions), will set the
-            %  size and shape of processing.
+            %  size and shape of processing. The threadgroup size is the
+            %  autotuned one for these dims if there is one (see
+            %  MetalComputePipelineState.AutotuneThreadgroupSize), or a
+            %  default based on the thread execution width. Pass
+            %  group_size ([ width height depth ]) to set it explicitly.
+            %
+            %  Returns uint32(1) on success, uint32(0) on error (with
+            %  message placed in the "message" property.)
+            
+            if nargin < 4
+                result = Metal.SetThreadsAndShape( obj.handle, compute_pipeline_state.handle, dims );
+            else
+                result = Metal.SetThreadsAndThreadgroupShape( obj.handle, compute_pipeline_state.handle, dims, group_size );
+            end
+            if result == uint32(0)
+                obj.message = Metal.LastError;
+            end
+        end
+        
+        
+        function result = DispatchIndirect( obj, compute_pipeline_state, buffer, offset, group_size )
+            %DispatchIndirect Run a grid whose size a kernel wrote into a buffer
+            %  The MetalBuffer holds three uint32 threadgroup counts at the
+            %  byte offset, read when the dispatch runs, so a kernel can
+            %  size the next one without MATLAB reading anything back.
+            %  group_size is the [ width height depth ] threadgroup size;
+            %  the kernel must check its thread position against the real
+            %  element count.
             %
             %  Returns uint32(1) on success, uint32(0) on error (with
             %  message placed in the "message" property.)
             
-            result = Metal.SetThreadsAndShape( obj.handle, compute_pipeline_state.handle, dims );
+            result = Metal.DispatchThreadgroupsIndirect( obj.handle, compute_pipeline_state.handle, buffer.handle, offset, group_size );
             if result == uint32(0)
                 obj.message = Metal.LastError;
             end
@@ -0,0 +1,88 @@
+classdef MetalCommandList < handle %codegen
+    %MetalCommandList A batch of kernel dispatches recorded to replay
+    %   The dispatches are checked and looked up once, when the list is
+    %   recorded, so a loop that runs the same chain of kernels again and
+    %   again encodes it with MetalCommandBuffer.EncodeCommandList in a
+    %   single call. Bindings can be changed between replays with
+    %   SetBuffer, e.g. to swap ping-pong buffers.
+
+    %   Copyright 2023 Tessive LLC  See LICENSE file for full license information.
+    
+    properties (SetAccess = private)
+        handle = uint64(0)  %Internal library handle
+        message = ""        %Error message if invalid
+    end
+        
+    properties (Dependent, SetAccess = private)
+        isValid   %True if the handle is valid
+    end
+    
+    
+    methods
+    
+        function obj = MetalCommandList( device, pipelines, buffers, shapes )
+            %MetalCommandList Constructor for a MetalCommandList object
+            % Record the dispatches on a MetalDevice. pipelines, buffers
+            % and shapes are as for MetalCommandBuffer.EncodeDispatches,
+            % and the buffers must be on the device.
+            %
+            % Call the isValid method to determine if the object was
+            % successuflly created.
+            %
+            %  obj = MetalCommandList( device, { cps1, cps2 }, { { A, B }, { B, C } }, [ n; n ] )
+            
+            count = numel( pipelines );
+            pipeline_handles = zeros( count, 1, 'uint64' );
+            buffer_handles = zeros( count, Metal.MaxDispatchBuffers, 'uint64' );
+            grid = ones( count, 3 );
+            for d = 1:count
+                pipeline_handles(d) = pipelines{d}.handle;
+                dispatch_buffers = buffers{d};
+                for i = 1:min( numel( dispatch_buffers ), Metal.MaxDispatchBuffers )
+                    buffer_handles(d, i) = dispatch_buffers{i}.handle;
+                end
+                grid(d, 1:size( shapes, 2 )) = shapes(d, :);
+            end
+            
+            obj.handle = Metal.NewCommandList( device.handle, pipeline_handles, buffer_handles, grid );
+            if obj.handle == uint64(0)
+                obj.message = Metal.LastError;
+            end
+        end
+        
+        
+        function result = get.isValid( obj )
+            %isValid Returns true if the handle is valid
+            result = obj.handle ~= uint64(0);
+        end
+        
+        
+        function result = SetBuffer( obj, index, position, buffer )
+            %SetBuffer Bind another MetalBuffer in one of the dispatches
+            % index is the dispatch's position in the list and position
+            % the buffer's position in its cell array of buffers, both
+            % one-based. Command buffers the list was already encoded into
+            % keep their bindings. Returns uint32(1) on success, uint32(0)
+            % on error (with message placed in the "message" property.)
+            %
+            %  result = obj.SetBuffer( 2, 1, A )
+            
+            result = uint32(0);
+            if position < 1
+                obj.message = "Invalid buffer position.";
+                return
+            end
+            result = Metal.CommandListSetBuffer( obj.handle, index, position - 1, buffer.handle );
+            if result == uint32(0)
+                obj.message = Metal.LastError;
+            end
+        end
+        
+        
+        function delete( obj )
+            Metal.FreeCommandList( obj.handle );
+        end
+    
+    end
+    
+end
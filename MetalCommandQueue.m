@@ -51,6 +51,43 @@ classdef MetalCommandQueue < handle %codegen
         end
         
         
+        function [ output, result ] = Stream( obj, pipeline, input, resident, budget )
+            %Stream Run a kernel over a single array too large for the device
+            % Runs pipeline with one thread per element of input, passing
+            % the array through the device in chunks: while one chunk
+            % runs, the chunk before it is copied back and the chunk after
+            % it copied in. The kernel reads its element of input at
+            % buffer(0) and writes the same element of output at
+            % buffer(1), indexing both by thread_position_in_grid.
+            % resident is an optional cell array of MetalBuffer objects
+            % bound whole at buffer(2), buffer(3), ... for every chunk, and
+            % budget the bytes of device memory the chunks may use
+            % (default: half the device's recommended working set).
+            % output has the size of input. result is uint32(1) on
+            % success, uint32(0) on error (with message placed in the
+            % "message" property.)
+            %
+            %  [ output, result ] = obj.Stream( pipeline, input )
+            %  [ output, result ] = obj.Stream( pipeline, input, { lookup }, 2^30 )
+            
+            if nargin < 4
+                resident = {};
+            end
+            if nargin < 5
+                budget = 0;
+            end
+            resident_handles = zeros( 1, numel( resident ), 'uint64' );
+            for i = 1:numel( resident )
+                resident_handles(i) = resident{i}.handle;
+            end
+            
+            [ output, result ] = Metal.StreamKernel( obj.handle, pipeline.handle, single( input ), resident_handles, budget );
+            if result == uint32(0)
+                obj.message = Metal.LastError;
+            end
+        end
+        
+        
         function delete( obj )
             Metal.FreeCommandQueue( obj.handle );
         end
@@ -10,6 +10,7 @@ classdef MetalComputePipelineState < handle %codegen
     properties (Dependent, SetAccess = private)
         isValid              %True if the handle is valid
         threadExecutionWidth %The maximum number of simultaneous threads
+        maxTotalThreadsPerThreadgroup %The largest number of threads in a threadgroup
         device               %The device on which the compute pipeline state was created
     end
     
@@ -19,7 +20,9 @@ classdef MetalComputePipelineState < handle %codegen
         function obj = MetalComputePipelineState( varargin ) 
             %MetalComputePipelineState Constructor for a MetalComputePipelineState object
             % Create a new MetalComputePipelineState object given
-            % MetalDevice and MetalFunction objects.
+            % MetalDevice and MetalFunction objects, or given a
+            % MetalLibrary object and a function name, which uses the
+            % cached pipeline state for that function.
             %
             % With no arguments, will create an empty, invalid class.
             %
@@ -28,6 +31,7 @@ classdef MetalComputePipelineState < handle %codegen
             %
             %  obj = MetalComputePipelineState( )
             %  obj = MetalComputePipelineState( device, func )
+            %  obj = MetalComputePipelineState( library, function_name )
             
 
             
@@ -49,6 +53,8 @@ classdef MetalComputePipelineState < handle %codegen
             %  obj.Initialize( ComputePipelineObj ) %Copy initialize
             %  obj.Initialize( device, func )  %Initialize with device
             %  object and function object.
+            %  obj.Initialize( library, function_name ) %Cached pipeline
+            %  state for a function of a library object.
             
             Metal.FreeComputePipelineState( obj.handle );
             obj.handle = uint64(0);
@@ -60,9 +66,14 @@ classdef MetalComputePipelineState < handle %codegen
                     computepipelineobj = varargin{ 1 };
                     obj.handle = Metal.CopyComputePipelineState( computepipelineobj.handle );
                 case 3
-                    deviceobj = varargin{1};
-                    func = varargin{2};
-                    obj.handle = Metal.NewComputePipelineState( deviceobj.handle, func.handle );
+                    if isa( varargin{1}, 'MetalLibrary' )
+                        library = varargin{1};
+                        obj.handle = Metal.ComputePipelineStateForFunction( library.handle, varargin{2} );
+                    else
+                        deviceobj = varargin{1};
+                        func = varargin{2};
+                        obj.handle = Metal.NewComputePipelineState( deviceobj.handle, func.handle );
+                    end
                 otherwise
                     return
             end
@@ -85,6 +96,43 @@ classdef MetalComputePipelineState < handle %codegen
             result = Metal.ThreadExecutionWidth( obj.handle );
         end
         
+        function result = get.maxTotalThreadsPerThreadgroup( obj )
+            %maxTotalThreadsPerThreadgroup Returns the largest number of
+            %threads in a threadgroup
+            result = Metal.MaxTotalThreadsPerThreadgroup( obj.handle );
+        end
+        
+        
+        function [ group_size, result ] = AutotuneThreadgroupSize( obj, command_queue, buffers, dims, repetitions )
+            %AutotuneThreadgroupSize Find the fastest threadgroup size for a grid
+            %  Times the kernel on the MetalCommandQueue with the
+            %  MetalBuffer objects in the cell array buffers bound in
+            %  order, for a set of candidate threadgroup sizes, and returns
+            %  the fastest as [ width height depth ]. Later dispatches of
+            %  this pipeline state with the same dims that don't give a
+            %  threadgroup size use it. The kernel runs repeatedly, so pass
+            %  scratch buffers unless that is harmless. repetitions
+            %  defaults to 10.
+            %
+            %  Returns uint32(1) on success, uint32(0) on error (with
+            %  message placed in the "message" property.)
+            
+            if nargin < 5
+                repetitions = 10;
+            end
+            buffer_handles = zeros( 1, Metal.MaxDispatchBuffers, 'uint64' );
+            for i = 1:numel( buffers )
+                buffer_handles( i ) = buffers{ i }.handle;
+            end
+            shape = [ 1 1 1 ];
+            shape( 1 : min( end, numel( dims ) ) ) = dims( 1 : min( end, 3 ) );
+            
+            [ group_size, result ] = Metal.AutotuneThreadgroupSize( command_queue.handle, obj.handle, buffer_handles, shape, repetitions );
+            if result == uint32(0)
+                obj.message = Metal.LastError;
+            end
+        end
+        
         
         function device = get.device( obj )
             %Device Returns a MetalDevice object for the device on which
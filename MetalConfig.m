@@ -138,7 +138,9 @@ classdef MetalConfig < handle %#codegen
             %OPTIMALDEVICES Get the optimal GPU Devices for a system
             %  Returns the deviceid of the optimal GPU (if any) for processing.  The
             %  devices are returned in order of their preference.  If no suitable GPU
-            %  is found, the devid array is empty.
+            %  is found, the devid array is empty.  Devices of the same performance
+            %  level (such as the per-NUMA-node devices of the CPU backend) are
+            %  ordered by compute units, then working set size.
             %
             %  Example:
             %     devids = OpenCLConfig.OptimalDevices;
@@ -149,7 +151,10 @@ classdef MetalConfig < handle %#codegen
                 IsHeadless = [devinfo.IsHeadless];
                 IsLowPower = [devinfo.IsLowPower];
                 PerformanceLevel = double(IsHeadless) + double(~IsLowPower);
-                [~,Intdevids] = sort( PerformanceLevel, 'descend' );
+                ComputeUnits = double([devinfo.ComputeUnits]);
+                WorkingSetSize = double([devinfo.recommendedMaxWorkingSetSize]);
+                [~,Intdevids] = sortrows( [PerformanceLevel(:), ComputeUnits(:), WorkingSetSize(:)], 'descend' );
+                Intdevids = Intdevids.';
             end
 
             devids = Intdevids;
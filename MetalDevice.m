@@ -79,6 +79,39 @@ classdef MetalDevice < handle %codegen
         end
         
         
+        function stats = BufferPoolStats( obj )
+            %BufferPoolStats Return the counters of the device's buffer pool
+            % MetalBuffer objects take their storage from the pool and
+            % return it when deleted, so steady-state loops that create
+            % same-sized temporaries do not allocate.
+            %
+            % stats = obj.BufferPoolStats
+            
+            [ stats, result ] = Metal.BufferPoolStats( obj.handle );
+            if result == uint32(0)
+                obj.message = Metal.LastError;
+            end
+        end
+        
+        
+        function result = TrimBufferPool( obj, max_idle_bytes )
+            %TrimBufferPool Release idle storage of the device's buffer pool
+            % Keeps at most max_idle_bytes of idle storage for reuse
+            % (default 0, releasing all of it).
+            %
+            % result = obj.TrimBufferPool
+            % result = obj.TrimBufferPool( max_idle_bytes )
+            
+            if nargin < 2
+                max_idle_bytes = 0;
+            end
+            result = Metal.TrimBufferPool( obj.handle, max_idle_bytes );
+            if result == uint32(0)
+                obj.message = Metal.LastError;
+            end
+        end
+        
+        
         function result = isequal( self, other )
             result = Metal.IsSameDevice( self.handle, other.handle );
         end
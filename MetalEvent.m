@@ -0,0 +1,94 @@
+classdef MetalEvent < handle %codegen
+    %MetalEvent A value that command buffers and MATLAB signal and wait for
+    %   Command buffers on different queues can be ordered with an event
+    %   without MATLAB waiting in between: one signals a value once its
+    %   work is done (MetalCommandBuffer.EncodeSignalEvent) and the other
+    %   holds its later work until the event reaches it
+    %   (MetalCommandBuffer.EncodeWaitForEvent). The value starts at 0;
+    %   signal increasing values, one per step.
+
+    %   Copyright 2023 Tessive LLC  See LICENSE file for full license information.
+    
+    properties (SetAccess = private)
+        handle = uint64(0)  %Internal library handle
+        message = ""        %Error message if invalid
+    end
+        
+    properties (Dependent, SetAccess = private)
+        isValid   %True if the handle is valid
+        value     %The value the event was last signalled with
+    end
+    
+    
+    methods
+    
+        function obj = MetalEvent( device )
+            %MetalEvent Constructor for a MetalEvent object
+            % Create a new MetalEvent object given a MetalDevice object.
+            %
+            % Call the isValid method to determine if the object was
+            % successuflly created.
+            %
+            %  obj = MetalEvent( device )
+            
+            obj.handle = Metal.NewEvent( device.handle );
+            if obj.handle == uint64(0)
+                obj.message = Metal.LastError;
+            end
+        end
+        
+        
+        function result = get.isValid( obj )
+            %isValid Returns true if the handle is valid
+            result = obj.handle ~= uint64(0);
+        end
+        
+        
+        function value = get.value( obj )
+            [ value, result ] = Metal.EventSignaledValue( obj.handle );
+            if result == uint32(0)
+                value = uint64(0);
+            end
+        end
+        
+        
+        function result = Signal( obj, value )
+            %Signal Set the value of the event
+            %  Command buffers waiting for this value or a lower one go on.
+            %
+            %  Returns uint32(1) on success, uint32(0) on error (with
+            %  message placed in the "message" property.)
+            
+            result = Metal.SignalEvent( obj.handle, value );
+            if result == uint32(0)
+                obj.message = Metal.LastError;
+            end
+        end
+        
+        
+        function result = Wait( obj, value, timeout )
+            %Wait Wait until the event reaches a value
+            %  Waits at most timeout seconds, or as long as it takes if no
+            %  timeout is given.
+            %
+            %  Returns uint32(1) once the value is reached, uint32(0) on
+            %  timeout or error (with message placed in the "message"
+            %  property.)
+            
+            if nargin < 3
+                timeout = Inf;
+            end
+            result = Metal.WaitForEvent( obj.handle, value, timeout );
+            if result == uint32(0)
+                obj.message = Metal.LastError;
+            end
+        end
+        
+        
+        function delete( obj )
+            Metal.FreeEvent( obj.handle );
+        end
+    
+    end
+    
+end
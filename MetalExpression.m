@@ -0,0 +1,258 @@
+classdef MetalExpression %codegen
+    %MetalExpression Deferred element-wise arithmetic on single MetalBuffers
+    % Arithmetic on MetalBuffer objects (+, -, .*, ./, scalar *, unary
+    % minus, abs, max and min) returns a MetalExpression instead of
+    % running anything. Further operations extend the expression, and
+    % Evaluate (or single) runs the whole chain as one fused kernel that
+    % reads each input and writes the output once.
+    %
+    % Operands are single MetalBuffers of the same dimensions and numeric
+    % scalars. A buffer used several times is read once per element.
+    %
+    % expression = max( a + 0.5 * b, c );
+    % result = expression.Evaluate;       % a new MetalBuffer
+    % values = single( expression );      % evaluated and downloaded
+
+    %   Copyright 2023 Tessive LLC  See LICENSE file for full license information.
+
+    properties (SetAccess = private)
+        opcodes = zeros( 1, 0 )             %MTL_ELEMENTWISE_ opcodes, in postfix order
+        operands = zeros( 1, 0 )            %Zero-based input or constant index of each operation
+        inputs = {}                         %MetalBuffer objects read by the expression
+        constants = zeros( 1, 0, 'single' ) %Scalars used by the expression
+        dimensions = []                     %Dimensions of the result, empty for a scalar
+        depth = 0                           %Values the program needs on its stack
+    end
+
+    properties (Constant, Access = private)
+        OpInput = 0     % MTL_ELEMENTWISE_ opcodes in MatlabMetal.h
+        OpConstant = 1
+        OpAdd = 2
+        OpSubtract = 3
+        OpMultiply = 4
+        OpDivide = 5
+        OpMax = 6
+        OpMin = 7
+        OpNegate = 8
+        OpAbs = 9
+    end
+
+
+    methods
+
+        function obj = MetalExpression( operand )
+            %MetalExpression Constructor for a MetalExpression object
+            % Given a single MetalBuffer, creates an expression reading it.
+            % Given a numeric scalar, creates a constant expression. Given
+            % a MetalExpression, returns it.
+            %
+            % obj = MetalExpression( buffer )
+            % obj = MetalExpression( scalar )
+
+            if nargin == 0
+                return
+            end
+
+            if isa( operand, 'MetalExpression' )
+                obj = operand;
+
+            elseif isa( operand, 'MetalBuffer' )
+                if ~operand.isValid || ~strcmp( operand.data_class, 'single' )
+                    error( 'MetalExpression:Operand', 'Only valid single MetalBuffers can be used in expressions.' );
+                end
+                obj.opcodes = MetalExpression.OpInput;
+                obj.operands = 0;
+                obj.inputs = { operand };
+                obj.dimensions = operand.dimensions;
+                obj.depth = 1;
+
+            elseif isnumeric( operand ) && isscalar( operand ) && isreal( operand )
+                obj.opcodes = MetalExpression.OpConstant;
+                obj.operands = 0;
+                obj.constants = single( operand );
+                obj.depth = 1;
+
+            else
+                error( 'MetalExpression:Operand', 'Operands must be MetalBuffers, MetalExpressions or real scalars.' );
+            end
+        end
+
+
+        function obj = plus( a, b )
+            obj = MetalExpression.Binary( a, b, MetalExpression.OpAdd );
+        end
+
+
+        function obj = minus( a, b )
+            obj = MetalExpression.Binary( a, b, MetalExpression.OpSubtract );
+        end
+
+
+        function obj = times( a, b )
+            obj = MetalExpression.Binary( a, b, MetalExpression.OpMultiply );
+        end
+
+
+        function obj = mtimes( a, b )
+            %mtimes Scaling by a scalar; use .* for element-wise products
+            a = MetalExpression( a );
+            b = MetalExpression( b );
+            if ~isempty( a.dimensions ) && ~isempty( b.dimensions )
+                error( 'MetalExpression:Operand', 'Use .* to multiply buffers element by element.' );
+            end
+            obj = MetalExpression.Binary( a, b, MetalExpression.OpMultiply );
+        end
+
+
+        function obj = rdivide( a, b )
+            obj = MetalExpression.Binary( a, b, MetalExpression.OpDivide );
+        end
+
+
+        function obj = mrdivide( a, b )
+            %mrdivide Division by a scalar; use ./ for element-wise quotients
+            b = MetalExpression( b );
+            if ~isempty( b.dimensions )
+                error( 'MetalExpression:Operand', 'Use ./ to divide by a buffer element by element.' );
+            end
+            obj = MetalExpression.Binary( a, b, MetalExpression.OpDivide );
+        end
+
+
+        function obj = max( a, b )
+            %max Element-wise maximum of two operands, ignoring NaNs
+            obj = MetalExpression.Binary( a, b, MetalExpression.OpMax );
+        end
+
+
+        function obj = min( a, b )
+            %min Element-wise minimum of two operands, ignoring NaNs
+            obj = MetalExpression.Binary( a, b, MetalExpression.OpMin );
+        end
+
+
+        function obj = uminus( a )
+            obj = MetalExpression.Unary( a, MetalExpression.OpNegate );
+        end
+
+
+        function obj = abs( a )
+            obj = MetalExpression.Unary( a, MetalExpression.OpAbs );
+        end
+
+
+        function [ destination, result ] = Evaluate( obj, destination )
+            %Evaluate Run the expression as one fused kernel
+            % Writes the result to destination, which may be one of the
+            % inputs, or to a new single MetalBuffer on the device of the
+            % first input. Waits for the kernel to complete.
+            %
+            % On error, result is false, destination is an invalid
+            % MetalBuffer unless it was given, and Metal.LastError holds
+            % the message.
+            %
+            % [ destination, result ] = obj.Evaluate( [destination] )
+
+            if nargin < 2
+                if isempty( obj.inputs )
+                    error( 'MetalExpression:Evaluate', 'A destination is needed to evaluate a constant expression.' );
+                end
+                destination = MetalBuffer( obj.inputs{1}.device, obj.dimensions );
+            end
+
+            command_queue = MetalCommandQueue( destination.device );
+            command_buffer = MetalCommandBuffer( command_queue );
+            result = obj.Encode( command_buffer, destination ) && command_buffer.Commit && command_buffer.WaitForCompletion;
+            if ~result && nargin < 2
+                destination = MetalBuffer;
+            end
+        end
+
+
+        function result = Encode( obj, command_buffer, destination )
+            %Encode Encode the expression into a command buffer
+            % The fused kernel writes prod( dimensions ) elements of
+            % destination (all of it for a constant expression) when the
+            % command buffer runs. Returns true on success.
+            %
+            % result = obj.Encode( command_buffer, destination )
+
+            num_elements = prod( obj.dimensions );
+            if isempty( obj.dimensions )
+                num_elements = prod( destination.dimensions );
+            end
+
+            handles = zeros( 1, numel( obj.inputs ), 'uint64' );
+            for k = 1:numel( obj.inputs )
+                handles(k) = obj.inputs{k}.handle;
+            end
+
+            result = Metal.EncodeElementwise( command_buffer.handle, obj.opcodes, obj.operands, handles, ...
+                obj.constants, destination.handle, num_elements ) ~= uint32(0);
+        end
+
+
+        function outdata = single( obj )
+            %single Evaluate the expression and download the result
+            buffer = obj.Evaluate;
+            outdata = single( buffer );
+        end
+
+    end
+
+
+    methods (Static, Access = private)
+
+        function obj = Unary( a, opcode )
+            obj = MetalExpression( a );
+            obj.opcodes( end + 1 ) = opcode;
+            obj.operands( end + 1 ) = 0;
+        end
+
+
+        function obj = Binary( a, b, opcode )
+            %Binary Append b to a and then the operation, sharing inputs
+            a = MetalExpression( a );
+            b = MetalExpression( b );
+
+            if ~isempty( a.dimensions ) && ~isempty( b.dimensions ) && ~isequal( a.dimensions, b.dimensions )
+                error( 'MetalExpression:SizeMismatch', 'Buffers in an expression must have the same dimensions.' );
+            end
+
+            % Inputs of b already read by a refer to a's slot
+            input_map = zeros( 1, numel( b.inputs ) );
+            inputs = a.inputs;
+            for k = 1:numel( b.inputs )
+                slot = find( cellfun( @(buffer) buffer == b.inputs{k}, inputs ), 1 );
+                if isempty( slot )
+                    inputs{ end + 1 } = b.inputs{k}; %#ok<AGROW>
+                    slot = numel( inputs );
+                end
+                input_map(k) = slot - 1;
+            end
+
+            b_operands = b.operands;
+            is_input = b.opcodes == MetalExpression.OpInput;
+            b_operands( is_input ) = input_map( b_operands( is_input ) + 1 );
+            is_constant = b.opcodes == MetalExpression.OpConstant;
+            b_operands( is_constant ) = b_operands( is_constant ) + numel( a.constants );
+
+            obj = a;
+            obj.opcodes = [ a.opcodes, b.opcodes, opcode ];
+            obj.operands = [ a.operands, b_operands, 0 ];
+            obj.inputs = inputs;
+            obj.constants = [ a.constants, b.constants ];
+            obj.depth = max( a.depth, b.depth + 1 );
+            if isempty( obj.dimensions )
+                obj.dimensions = b.dimensions;
+            end
+
+            if numel( obj.opcodes ) > Metal.ElementwiseMaxProgram || numel( obj.inputs ) > Metal.ElementwiseMaxInputs || ...
+                    numel( obj.constants ) > Metal.ElementwiseMaxConstants || obj.depth > Metal.ElementwiseMaxStack
+                error( 'MetalExpression:TooLarge', 'Expression exceeds the limits of a fused kernel; evaluate part of it first.' );
+            end
+        end
+
+    end
+
+end
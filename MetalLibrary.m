@@ -21,12 +21,17 @@ classdef MetalLibrary < handle %codegen
             % on which to create it as well as a string of the source code
             % to use.
             %
+            % An optional third argument selects fast math (true, the
+            % default) or precise math (false). Libraries are cached, so
+            % building the same source again does not recompile it.
+            %
             % With no arguments, creates an empty MetalLibrary class.
             %
             % Call the isValid method to determine if the object was
             % successuflly created.
             %
             %  obj = MetalLibrary( device, source )
+            %  obj = MetalLibrary( device, source, fastmath )
             
             if nargin < 2
                 return
@@ -34,11 +39,15 @@ classdef MetalLibrary < handle %codegen
             
             device = varargin{ 1 };
             source = varargin{ 2 };
-            obj.Initialize( device, source );
+            if nargin > 2
+                obj.Initialize( device, source, varargin{ 3 } );
+            else
+                obj.Initialize( device, source );
+            end
         end
         
         
-        function Initialize(obj, device, source )
+        function Initialize(obj, device, source, fastmath )
             %Initialize (Re-)Initialize a MetalLibrary object
             % Re-Initialize the MetalLibrary object given a MetalDevice object
             % on which to create it as well as a string of the source code
@@ -48,11 +57,16 @@ classdef MetalLibrary < handle %codegen
             % successuflly created.
             %
             %  obj.Initialize( device, source )
+            %  obj.Initialize( device, source, fastmath )
+            
+            if nargin < 4
+                fastmath = true;
+            end
             
             Metal.FreeLibrary( obj.handle );
             obj.handle = uint64(0);
             obj.message = "";
-            obj.handle = Metal.NewLibrary( device.handle, source );
+            obj.handle = Metal.NewLibraryWithOptions( device.handle, source, uint32( logical( fastmath ) ) );
             if obj.handle == uint64(0)
                 obj.message = Metal.LastError;
             end
@@ -1,31 +1,61 @@
-function ScaleAccumulate( bufferA, bufferB, bufferScale)
+function command_buffer = ScaleAccumulate( bufferA, bufferB, bufferScale)
 % SCALEACCUMULATE Scale an array by a scalar and accumulate, using Metal
 % This is a Metal implementation of scaling and accumulating two buffers.
 % It implements A = A + B * scaleval, where A and B are Metal buffers containing three-dimensional
-% single precision float arrays, and scaleval is a single precision scalar
-% in a Metal buffer.
+% single precision float arrays, and scaleval is a single precision scalar,
+% either a plain number or in a Metal buffer. B may also be a 'half' or
+% 'bfloat16' buffer; it is then read at that precision and accumulated in
+% single. A plain number is passed inline
+% with SetBytes, so no buffer has to be created for it.
+%
+% Called with no output, waits for the work to finish. Called with an
+% output, returns the committed MetalCommandBuffer without waiting, so the
+% caller can prepare the next frame while this one runs and wait later:
+%
+%   command_buffer = ScaleAccumulate( bufferA, bufferB, bufferScale );
+%   % ... prepare the next frame ...
+%   command_buffer.WaitForCompletion;
 
 
 % First, make sure the buffers are on the same device.
 % The "isequal" method is helpful for this. It will return true if two
 % MetalDevice instances point to the same physical hardware.
 assert(bufferA.device.isequal(bufferB.device));
-assert(bufferA.device.isequal(bufferScale.device));
-
-% Next, we need to compile the kernel and get ready, but we only want to do
-% this once. We have a persistent struct holding all the relevant classes,
-% and we check if it is empty (first run) or if the device specified in the
-% buffers has moved. In either case, we compile the kernel and create the
-% necessary classes in the subroutine below.
-persistent MetalSetup;
-if isempty(MetalSetup)
-    MetalSetup = ConfigureMetalSetup;
-elseif ~MetalSetup.Device.isequal( bufferA.device )
-    MetalSetup = ConfigureMetalSetup(bufferA.device);
+if isa(bufferScale, 'MetalBuffer')
+    assert(bufferA.device.isequal(bufferScale.device));
 end
 
+% Next, we need the compiled kernel. Libraries and compute pipeline states
+% are cached by libMatlabMetal, so only the first call on a device compiles
+% the source; later calls get the cached pipeline state straight away. The
+% source text and the command queue are kept between calls, and the queue is
+% replaced if the buffers have moved to another device.
+persistent LibraryCode CommandQueue;
+if isempty(LibraryCode)
+    LibraryCode = string(fileread("MetalFunctionLibrary.mtl")); % Load the source code
+end
+if isempty(CommandQueue) || ~CommandQueue.device.isequal( bufferA.device )
+    CommandQueue = MetalCommandQueue( bufferA.device );
+    assert(CommandQueue.isValid);
+end
+
+library = MetalLibrary( bufferA.device, LibraryCode );  % Compiled once, then cached
+assert(library.isValid);
+
+% The kernel variant matches the storage of B
+switch bufferB.data_class
+    case 'half'
+        kernel_name = "scaleaccum_half";
+    case 'bfloat16'
+        kernel_name = "scaleaccum_bfloat16";
+    otherwise
+        kernel_name = "scaleaccum";
+end
+cps = MetalComputePipelineState( library, kernel_name ); % Cached pipeline state for the function
+assert(cps.isValid);
+
 
-command_buffer = MetalCommandBuffer( MetalSetup.CommandQueue );
+command_buffer = MetalCommandBuffer( CommandQueue );
 assert(command_buffer.isValid);
 command_encoder = MetalCommandEncoder( command_buffer );
 assert(command_encoder.isValid);
@@ -35,21 +65,26 @@ assert(command_encoder.isValid);
 
 % Tell the command encoder we want to run the scaleaccum function, using the
 % compute pipeline state created for the function.
-result = command_encoder.SetComputePipelineState( MetalSetup.Cps );
+result = command_encoder.SetComputePipelineState( cps );
 assert(result == uint32(1));
 
 % Set the first argument to bufferA, the second argument to bufferB,
-% and the third to bufferScale.
+% and the third to the scale. The kernel reads the scale from the constant
+% address space, so a plain number can be copied in with SetBytes.
 result = command_encoder.SetBuffer( bufferA, 1);
 assert(result == uint32(1));
 result = command_encoder.SetBuffer( bufferB, 2);
 assert(result == uint32(1));
-result = command_encoder.SetBuffer( bufferScale, 3);
+if isa(bufferScale, 'MetalBuffer')
+    result = command_encoder.SetBuffer( bufferScale, 3);
+else
+    result = command_encoder.SetBytes( single(bufferScale), 3);
+end
 assert(result == uint32(1));
 
 % Now we just need to tell the encoder how many elements are in the
 % buffers to be processed. This needs the compute pipeline state again.
-result = command_encoder.SetThreadsAndShape( MetalSetup.Cps, prod(bufferA.dimensions));
+result = command_encoder.SetThreadsAndShape( cps, prod(bufferA.dimensions));
 assert(result == uint32(1));
 
 % Once all the arguments and thread information has been set, tell the
@@ -59,37 +94,16 @@ assert(result == uint32(1));
 
 % Now we're ready to run the command. The command encoder is already
 % associate with a command buffer, which itself has a command queue to run
-% in. So all we need to do is commit it to run and wait for it to be done.
+% in. So all we need to do is commit it to run. Unless the caller takes the
+% command buffer to wait on later, wait for it to be done.
 
 result = command_buffer.Commit;
 assert(result == uint32(1));
-result = command_buffer.WaitForCompletion;
-assert(result == uint32(1));
-
-
+if nargout == 0
+    result = command_buffer.WaitForCompletion;
+    assert(result == uint32(1));
 end
 
 
+end
 
-function MetalSetup = ConfigureMetalSetup(varargin)
-
-    if nargin == 0
-        metalConfig = Metal.Config;
-        MetalSetup.Device = MetalDevice( metalConfig.gpudevice );
-    else
-        MetalSetup.Device = varargin{1};
-    end
-    
-    disp('Compiling library');
-    
-    libraryCode = string(fileread("MetalFunctionLibrary.mtl")); % Load the source code
-    MetalSetup.Library = MetalLibrary(MetalSetup.Device, libraryCode);  % Compile the library
-    assert(MetalSetup.Library.isValid);
-    MetalSetup.Function = MetalFunction( MetalSetup.Library, "scaleaccum"); % Create a Metal Function
-    assert(MetalSetup.Function.isValid);
-    MetalSetup.Cps = MetalComputePipelineState( MetalSetup.Device, MetalSetup.Function ); %Create the compute pipeline state
-    assert(MetalSetup.Cps.isValid);
-    MetalSetup.CommandQueue = MetalCommandQueue( MetalSetup.Device );
-    assert(MetalSetup.CommandQueue.isValid);
-    
-end
\ No newline at end of file
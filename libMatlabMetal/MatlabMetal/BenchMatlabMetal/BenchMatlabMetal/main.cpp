@@ -0,0 +1,656 @@
+//
+//  main.cpp
+//  BenchMatlabMetal
+//
+//  Benchmarks of the C API: handle create/lookup/free rates for each handle
+//  type, copy bandwidth into and out of buffers, empty-dispatch round-trip
+//  latency, the throughput of the MetalFunctionLibrary.mtl kernels and of
+//  streaming host arrays through them with mtlStreamKernel.
+//  Results are printed and optionally written as JSON; given a baseline
+//  written by an earlier run, any result worse than the baseline by more
+//  than the threshold is reported and the exit status is 1.
+//
+//  Usage: BenchMatlabMetal [--quick] [--device N] [--library FILE]
+//                          [--max-copy-bytes N] [--output FILE]
+//                          [--baseline FILE] [--threshold FRACTION]
+//
+
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "MatlabMetal.h"
+
+using namespace std;
+
+
+struct Options
+{
+    bool quick = false;
+    uint32_t device_index = 0;
+    string library_path = "MetalFunctionLibrary.mtl";
+    uint64_t max_copy_bytes = 4ull << 30;
+    string output_path;
+    string baseline_path;
+    double threshold = 0.1;
+};
+
+
+struct Result
+{
+    string name;
+    string unit;
+    double value;
+    bool higher_is_better;
+};
+
+
+static vector<Result> results;
+
+
+static void report( const string & name, const string & unit, double value, bool higher_is_better )
+{
+    results.push_back( { name, unit, value, higher_is_better } );
+    cout << "  " << left << setw( 44 ) << name << right << setw( 14 ) << fixed << setprecision( 3 ) << value << " " << unit << endl;
+}
+
+
+static void check( bool ok, const char * what )
+{
+    if ( ok )
+        return;
+    char error[ 1024 ];
+    mtlGetLastError( error, sizeof( error ) );
+    cerr << "Error: " << what << ": " << error << endl;
+    exit( 2 );
+}
+
+
+static double now()
+{
+    return chrono::duration<double>( chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+
+static double median( vector<double> samples )
+{
+    sort( samples.begin(), samples.end() );
+    size_t middle = samples.size() / 2;
+    return samples.size() % 2 ? samples[ middle ] : 0.5 * ( samples[ middle - 1 ] + samples[ middle ] );
+}
+
+
+static double percentile( vector<double> samples, double fraction )
+{
+    sort( samples.begin(), samples.end() );
+    size_t index = (size_t)ceil( fraction * samples.size() );
+    return samples[ min( max( index, (size_t)1 ), samples.size() ) - 1 ];
+}
+
+
+static string sizeName( uint64_t bytes )
+{
+    const char * units[] = { "B", "KB", "MB", "GB" };
+    int unit = 0;
+    while ( bytes >= 1024 && bytes % 1024 == 0 && unit < 3 )
+    {
+        bytes /= 1024;
+        unit++;
+    }
+    return to_string( bytes ) + units[ unit ];
+}
+
+
+#ifndef __APPLE__
+// Host implementation of the kernel timed by the dispatch latency benchmarks
+void benchEmpty( const mtlHostKernelArgs * args, uint64_t first_thread, uint64_t last_thread )
+{
+}
+#endif
+
+static const char empty_source[] = R"""(
+    #include <metal_stdlib>
+    using namespace metal;
+
+    kernel void bench_empty( uint id[[ thread_position_in_grid ]] )
+    {
+    }
+)""";
+
+
+#pragma mark Handles
+
+/**
+ * Time create, lookup and free of count handles of one type. Lookup is the
+ * cheapest call taking the handle; where that returns a device handle, it
+ * is freed as part of the lookup.
+ */
+template <typename Create, typename Lookup, typename Free>
+static void benchHandleType( const string & type, uint32_t count, Create create, Lookup lookup, Free free_handle )
+{
+    vector<uint64_t> handles( count );
+    double start = now();
+    for ( uint32_t i = 0; i < count; i++ )
+        handles[ i ] = create( i );
+    double created = now();
+    for ( uint64_t handle : handles )
+        check( handle != INVALID_HANDLE, ( "creating a " + type + " handle" ).c_str() );
+
+    bool has_lookup = false;
+    for ( uint64_t handle : handles )
+        has_lookup |= lookup( handle );
+    double looked_up = now();
+
+    for ( uint64_t handle : handles )
+        free_handle( handle );
+    double freed = now();
+
+    report( "handles." + type + ".create", "Mops/s", count / ( created - start ) * 1e-6, true );
+    if ( has_lookup )
+        report( "handles." + type + ".lookup", "Mops/s", count / ( looked_up - created ) * 1e-6, true );
+    report( "handles." + type + ".free", "Mops/s", count / ( freed - looked_up ) * 1e-6, true );
+}
+
+
+static void benchHandles( const Options & options, DeviceHandle device, CommandQueueHandle command_queue, ComputePipelineStateHandle empty )
+{
+    cout << "Handles" << endl;
+    const uint32_t count = options.quick ? 2000 : 50000;
+    const uint32_t library_count = options.quick ? 100 : 2000;
+
+    benchHandleType( "device", count,
+        [&]( uint32_t ) { return mtlGetDeviceAtIndex( options.device_index ); },
+        []( uint64_t handle ) { return mtlGetDeviceAllocatedMemory( handle ) >= 0; },
+        []( uint64_t handle ) { mtlFreeDevice( handle ); } );
+
+    // Repeats hit the library cache, so this times the handles rather than compiling
+    benchHandleType( "library", library_count,
+        [&]( uint32_t ) { return mtlNewLibrary( device, empty_source ); },
+        []( uint64_t handle ) { mtlFreeDevice( mtlLibraryDevice( handle ) ); return true; },
+        []( uint64_t handle ) { mtlFreeLibrary( handle ); } );
+
+    LibraryHandle library = mtlNewLibrary( device, empty_source );
+    check( library != INVALID_HANDLE, "building the benchmark library" );
+    benchHandleType( "function", library_count,
+        [&]( uint32_t ) { return mtlNewFunction( library, "bench_empty" ); },
+        []( uint64_t ) { return false; },
+        []( uint64_t handle ) { mtlFreeFunction( handle ); } );
+    mtlFreeLibrary( library );
+
+    benchHandleType( "compute_pipeline_state", count,
+        [&]( uint32_t ) { return mtlCopyComputePipelineState( empty ); },
+        []( uint64_t handle ) { return mtlThreadExecutionWidth( handle ) > 0; },
+        []( uint64_t handle ) { mtlFreeComputePipelineState( handle ); } );
+
+    benchHandleType( "command_queue", library_count,
+        [&]( uint32_t ) { return mtlNewCommandQueue( device ); },
+        []( uint64_t handle ) { mtlFreeDevice( mtlCommandQueueDevice( handle ) ); return true; },
+        []( uint64_t handle ) { mtlFreeCommandQueue( handle ); } );
+
+    benchHandleType( "buffer", count,
+        [&]( uint32_t ) { return mtlNewBuffer( device, 256 ); },
+        []( uint64_t handle ) { return mtlBufferSize( handle ) == 256; },
+        []( uint64_t handle ) { mtlFreeBuffer( handle ); } );
+
+    benchHandleType( "command_buffer", count,
+        [&]( uint32_t ) { return mtlNewCommandBuffer( command_queue ); },
+        []( uint64_t handle ) { uint32_t status; return mtlCommandBufferStatus( handle, &status ) == MTL_SUCCESS; },
+        []( uint64_t handle ) { mtlFreeCommandBuffer( handle ); } );
+
+    // Metal allows one open encoder per command buffer, so each gets its own; ending it is the lookup
+    vector<CommandBufferHandle> command_buffers( count );
+    for ( CommandBufferHandle & command_buffer : command_buffers )
+        command_buffer = mtlNewCommandBuffer( command_queue );
+    benchHandleType( "command_encoder", count,
+        [&]( uint32_t i ) { return mtlNewCommandEncoder( command_buffers[ i ] ); },
+        []( uint64_t handle ) { return mtlEndEncoding( handle ) == MTL_SUCCESS; },
+        []( uint64_t handle ) { mtlFreeCommandEncoder( handle ); } );
+    for ( CommandBufferHandle command_buffer : command_buffers )
+        mtlFreeCommandBuffer( command_buffer );
+}
+
+
+#pragma mark Copies
+
+static void benchCopies( const Options & options, DeviceHandle device )
+{
+    cout << "Copy bandwidth" << endl;
+    // Each size needs a buffer and a host copy; leave room for the rest of the machine
+    const uint64_t memory = (uint64_t)sysconf( _SC_PHYS_PAGES ) * (uint64_t)sysconf( _SC_PAGESIZE );
+    const uint64_t largest = options.quick ? ( 16ull << 20 ) : options.max_copy_bytes;
+
+    for ( uint64_t bytes = 4096; bytes <= largest; bytes *= 16 )
+    {
+        if ( 2 * bytes > memory / 2 )
+        {
+            cout << "  skipping " << sizeName( bytes ) << " copies: not enough memory" << endl;
+            break;
+        }
+        BufferHandle buffer = mtlNewBuffer( device, bytes );
+        check( buffer != INVALID_HANDLE, "allocating the copy buffer" );
+        vector<uint8_t> host( bytes, 1 );
+
+        // Move at least 1 GB per direction, and at least three times per size
+        const uint64_t repetitions = max<uint64_t>( 3, min<uint64_t>( options.quick ? 100 : 10000, ( 1ull << ( options.quick ? 26 : 30 ) ) / bytes ) );
+        check( mtlCopyDataToBuffer( buffer, host.data(), bytes ) == MTL_SUCCESS, "copying to the buffer" );
+        vector<double> to_times, from_times;
+        for ( uint64_t r = 0; r < repetitions; r++ )
+        {
+            double start = now();
+            mtlCopyDataToBuffer( buffer, host.data(), bytes );
+            double middle = now();
+            mtlCopyDataFromBuffer( buffer, host.data(), bytes );
+            to_times.push_back( middle - start );
+            from_times.push_back( now() - middle );
+        }
+        report( "copy.to_buffer." + sizeName( bytes ), "GB/s", bytes / median( to_times ) * 1e-9, true );
+        report( "copy.from_buffer." + sizeName( bytes ), "GB/s", bytes / median( from_times ) * 1e-9, true );
+        mtlFreeBuffer( buffer );
+    }
+}
+
+
+#pragma mark Dispatch Latency
+
+static void benchDispatchLatency( const Options & options, CommandQueueHandle command_queue, ComputePipelineStateHandle empty )
+{
+    cout << "Dispatch latency" << endl;
+    const uint32_t count = options.quick ? 200 : 5000;
+    mtlDispatch dispatch;
+    memset( &dispatch, 0, sizeof( dispatch ) );
+    dispatch.compute_pipeline_state = empty;
+    dispatch.width = dispatch.height = dispatch.depth = 1;
+
+    // Submit one empty dispatch and wait for it
+    vector<double> times;
+    for ( uint32_t i = 0; i < count + 10; i++ )
+    {
+        double start = now();
+        CommandBufferHandle command_buffer = mtlSubmitDispatches( command_queue, &dispatch, 1 );
+        mtlWaitForCompletion( command_buffer );
+        double end = now();
+        check( command_buffer != INVALID_HANDLE, "submitting the empty dispatch" );
+        mtlFreeCommandBuffer( command_buffer );
+        if ( i >= 10 )
+            times.push_back( ( end - start ) * 1e6 );
+    }
+    report( "dispatch.round_trip.median", "us", median( times ), false );
+    report( "dispatch.round_trip.p99", "us", percentile( times, 0.99 ), false );
+
+    // The same through a command encoder, one call per step
+    times.clear();
+    for ( uint32_t i = 0; i < count; i++ )
+    {
+        double start = now();
+        CommandBufferHandle command_buffer = mtlNewCommandBuffer( command_queue );
+        CommandEncoderHandle command_encoder = mtlNewCommandEncoder( command_buffer );
+        mtlSetComputePipelineState( command_encoder, empty );
+        mtlSetThreadsAndShape( command_encoder, empty, 1, 1, 1 );
+        mtlEndEncoding( command_encoder );
+        mtlCommitCommandBuffer( command_buffer );
+        mtlWaitForCompletion( command_buffer );
+        double end = now();
+        check( command_encoder != INVALID_HANDLE, "encoding the empty dispatch" );
+        mtlFreeCommandEncoder( command_encoder );
+        mtlFreeCommandBuffer( command_buffer );
+        times.push_back( ( end - start ) * 1e6 );
+    }
+    report( "dispatch.encoder_round_trip.median", "us", median( times ), false );
+
+    // The same with the grid read from a buffer when the dispatch runs
+    DeviceHandle device = mtlCommandQueueDevice( command_queue );
+    const mtlDispatchIndirectArguments arguments = { { 1, 1, 1 } };
+    const uint32_t group_size[3] = { 1, 1, 1 };
+    BufferHandle arguments_buffer = mtlNewBuffer( device, sizeof( arguments ) );
+    mtlCopyDataToBuffer( arguments_buffer, &arguments, sizeof( arguments ) );
+    times.clear();
+    for ( uint32_t i = 0; i < count; i++ )
+    {
+        double start = now();
+        CommandBufferHandle command_buffer = mtlNewCommandBuffer( command_queue );
+        CommandEncoderHandle command_encoder = mtlNewCommandEncoder( command_buffer );
+        mtlSetComputePipelineState( command_encoder, empty );
+        uint32_t result = mtlDispatchThreadgroupsIndirect( command_encoder, empty, arguments_buffer, 0, group_size );
+        mtlEndEncoding( command_encoder );
+        mtlCommitCommandBuffer( command_buffer );
+        mtlWaitForCompletion( command_buffer );
+        double end = now();
+        check( result == MTL_SUCCESS, "encoding the indirect dispatch" );
+        mtlFreeCommandEncoder( command_encoder );
+        mtlFreeCommandBuffer( command_buffer );
+        times.push_back( ( end - start ) * 1e6 );
+    }
+    report( "dispatch.indirect_round_trip.median", "us", median( times ), false );
+    mtlFreeBuffer( arguments_buffer );
+
+    // Per-dispatch cost within a batch
+    const uint32_t batch = 64;
+    vector<mtlDispatch> dispatches( batch, dispatch );
+    times.clear();
+    for ( uint32_t i = 0; i < count / 10; i++ )
+    {
+        double start = now();
+        CommandBufferHandle command_buffer = mtlSubmitDispatches( command_queue, dispatches.data(), batch );
+        mtlWaitForCompletion( command_buffer );
+        times.push_back( ( now() - start ) * 1e6 / batch );
+        mtlFreeCommandBuffer( command_buffer );
+    }
+    report( "dispatch.batched.per_dispatch", "us", median( times ), false );
+
+    // The same batch recorded once as a command list
+    CommandListHandle command_list = mtlNewCommandList( device, dispatches.data(), batch );
+    check( command_list != INVALID_HANDLE, "recording the command list" );
+    times.clear();
+    for ( uint32_t i = 0; i < count / 10; i++ )
+    {
+        double start = now();
+        CommandBufferHandle command_buffer = mtlSubmitCommandList( command_queue, command_list );
+        mtlWaitForCompletion( command_buffer );
+        times.push_back( ( now() - start ) * 1e6 / batch );
+        mtlFreeCommandBuffer( command_buffer );
+    }
+    report( "dispatch.command_list.per_dispatch", "us", median( times ), false );
+    mtlFreeCommandList( command_list );
+    mtlFreeDevice( device );
+}
+
+
+#pragma mark Kernels
+
+static void benchKernels( const Options & options, DeviceHandle device, CommandQueueHandle command_queue )
+{
+    cout << "Kernel throughput" << endl;
+    ifstream file( options.library_path );
+    if ( !file )
+    {
+        cout << "  skipping: cannot read " << options.library_path << " (see --library)" << endl;
+        return;
+    }
+    stringstream source;
+    source << file.rdbuf();
+    LibraryHandle library = mtlNewLibrary( device, source.str().c_str() );
+    check( library != INVALID_HANDLE, "building MetalFunctionLibrary.mtl" );
+
+    const uint32_t count = options.quick ? ( 1u << 20 ) : ( 1u << 24 );
+    const uint32_t repetitions = options.quick ? 5 : 20;
+    BufferHandle buffer_a = mtlNewBuffer( device, count * sizeof( float ) );
+    BufferHandle buffer_b = mtlNewBuffer( device, count * sizeof( float ) );
+    BufferHandle buffer_half = mtlNewBuffer( device, count * sizeof( uint16_t ) );
+    BufferHandle buffer_scale = mtlNewBuffer( device, sizeof( float ) );
+    check( buffer_a != INVALID_HANDLE && buffer_b != INVALID_HANDLE && buffer_half != INVALID_HANDLE && buffer_scale != INVALID_HANDLE,
+           "allocating the kernel buffers" );
+    vector<float> data( count, 0.5f );
+    mtlCopyFloatsToBuffer( buffer_a, 0, data.data(), count, MTL_FORMAT_FLOAT );
+    mtlCopyFloatsToBuffer( buffer_b, 0, data.data(), count, MTL_FORMAT_FLOAT );
+    mtlCopyFloatsToBuffer( buffer_half, 0, data.data(), count, MTL_FORMAT_HALF );
+    const float scale = 0.999f;
+    mtlCopyDataToBuffer( buffer_scale, &scale, sizeof( scale ) );
+
+    const char * kernels[] = { "zerobuff", "accumulate", "maxval", "scaleaccum",
+                               "accumulate_half", "maxval_half", "scaleaccum_half",
+                               "accumulate_bfloat16", "maxval_bfloat16", "scaleaccum_bfloat16" };
+    for ( const char * kernel : kernels )
+    {
+        ComputePipelineStateHandle pipeline = mtlComputePipelineStateForFunction( library, kernel );
+        check( pipeline != INVALID_HANDLE, "creating a library kernel" );
+        bool reduced = strchr( kernel, '_' ) != nullptr;
+        mtlDispatch dispatch;
+        memset( &dispatch, 0, sizeof( dispatch ) );
+        dispatch.compute_pipeline_state = pipeline;
+        dispatch.buffers[0] = buffer_a;
+        dispatch.buffers[1] = reduced ? buffer_half : buffer_b;
+        dispatch.buffers[2] = buffer_scale;
+        dispatch.num_buffers = strcmp( kernel, "zerobuff" ) == 0 ? 1 : ( strncmp( kernel, "scaleaccum", 10 ) == 0 ? 3 : 2 );
+        dispatch.width = count;
+        dispatch.height = dispatch.depth = 1;
+        // zerobuff writes vA; the others read and write vA and read vB
+        const double bytes_per_element = dispatch.num_buffers == 1 ? 4 : 8 + ( reduced ? 2 : 4 );
+
+        vector<double> times;
+        for ( uint32_t r = 0; r <= repetitions; r++ )
+        {
+            double start = now();
+            CommandBufferHandle command_buffer = mtlSubmitDispatches( command_queue, &dispatch, 1 );
+            mtlWaitForCompletion( command_buffer );
+            double end = now();
+            check( command_buffer != INVALID_HANDLE, "submitting a library kernel" );
+            mtlFreeCommandBuffer( command_buffer );
+            if ( r > 0 )
+                times.push_back( end - start );
+        }
+        double time = median( times );
+        report( string( "kernel." ) + kernel, "Gelem/s", count / time * 1e-9, true );
+        report( string( "kernel." ) + kernel + ".bandwidth", "GB/s", count * bytes_per_element / time * 1e-9, true );
+        mtlFreeComputePipelineState( pipeline );
+    }
+
+    mtlFreeBuffer( buffer_a );
+    mtlFreeBuffer( buffer_b );
+    mtlFreeBuffer( buffer_half );
+    mtlFreeBuffer( buffer_scale );
+    mtlFreeLibrary( library );
+}
+
+
+#pragma mark Streaming
+
+static void benchStreaming( const Options & options, DeviceHandle device, CommandQueueHandle command_queue )
+{
+    cout << "Streaming" << endl;
+    ifstream file( options.library_path );
+    if ( !file )
+    {
+        cout << "  skipping: cannot read " << options.library_path << " (see --library)" << endl;
+        return;
+    }
+    stringstream source;
+    source << file.rdbuf();
+    LibraryHandle library = mtlNewLibrary( device, source.str().c_str() );
+    check( library != INVALID_HANDLE, "building MetalFunctionLibrary.mtl" );
+    ComputePipelineStateHandle accumulate = mtlComputePipelineStateForFunction( library, "accumulate" );
+    check( accumulate != INVALID_HANDLE, "creating the accumulate kernel" );
+
+    // A += B over host arrays, in place, as one chunk and as about a dozen pipelined chunks
+    const uint64_t count = options.quick ? ( 1ull << 22 ) : ( 1ull << 26 );
+    const uint32_t repetitions = options.quick ? 3 : 10;
+    vector<float> a( count, 0.0f ), b( count, 1.0f );
+    mtlStreamArray arrays[ 2 ] = {};
+    arrays[ 0 ].input = a.data();
+    arrays[ 0 ].output = a.data();
+    arrays[ 0 ].element_size = sizeof( float );
+    arrays[ 1 ].input = b.data();
+    arrays[ 1 ].element_size = sizeof( float );
+    const double bytes_per_element = 3 * sizeof( float );
+
+    const struct { const char * name; uint64_t budget; } budgets[] = {
+        { "one_chunk", 3 * count * 2 * sizeof( float ) },
+        { "pipelined", count * 2 * sizeof( float ) / 4 },
+    };
+    for ( const auto & budget : budgets )
+    {
+        vector<double> times;
+        for ( uint32_t r = 0; r <= repetitions; r++ )
+        {
+            double start = now();
+            uint32_t result = mtlStreamKernel( command_queue, accumulate, arrays, 2, count, budget.budget );
+            double end = now();
+            check( result == MTL_SUCCESS, "streaming the accumulate kernel" );
+            if ( r > 0 )
+                times.push_back( end - start );
+        }
+        report( string( "stream.accumulate." ) + budget.name, "GB/s", count * bytes_per_element / median( times ) * 1e-9, true );
+    }
+    check( a[ count - 1 ] == (float)( 2 * ( repetitions + 1 ) ), "checking the streamed result" );
+
+    mtlFreeComputePipelineState( accumulate );
+    mtlFreeLibrary( library );
+}
+
+
+#pragma mark Results
+
+static string jsonString( const string & text )
+{
+    string quoted = "\"";
+    for ( char c : text )
+    {
+        if ( c == '"' || c == '\\' )
+            quoted += '\\';
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+
+static bool writeResults( const string & path, const mtlDeviceInfo & device_info )
+{
+    ofstream file( path );
+#ifdef __APPLE__
+    file << "{\n  \"backend\": \"metal\",\n";
+#else
+    file << "{\n  \"backend\": \"cpu\",\n";
+#endif
+    file << "  \"device\": " << jsonString( device_info.name ) << ",\n";
+    file << "  \"hardware_threads\": " << thread::hardware_concurrency() << ",\n";
+    file << "  \"results\": [\n";
+    for ( size_t i = 0; i < results.size(); i++ )
+    {
+        const Result & result = results[ i ];
+        file << "    { \"name\": " << jsonString( result.name ) << ", \"unit\": " << jsonString( result.unit )
+             << ", \"value\": " << setprecision( 9 ) << result.value
+             << ", \"higher_is_better\": " << ( result.higher_is_better ? "true" : "false" ) << " }"
+             << ( i + 1 < results.size() ? "," : "" ) << "\n";
+    }
+    file << "  ]\n}\n";
+    return file.good();
+}
+
+
+/** Read the name and value of each result of a file written by writeResults */
+static bool readResults( const string & path, map<string, double> & values )
+{
+    ifstream file( path );
+    if ( !file )
+        return false;
+    string line;
+    while ( getline( file, line ) )
+    {
+        size_t name = line.find( "\"name\": \"" );
+        size_t value = line.find( "\"value\": " );
+        if ( name == string::npos || value == string::npos )
+            continue;
+        name += 9;
+        values[ line.substr( name, line.find( '"', name ) - name ) ] = strtod( line.c_str() + value + 9, nullptr );
+    }
+    return true;
+}
+
+
+/** Compare the results with a baseline. Returns the number of regressions. */
+static int compareResults( const string & path, double threshold )
+{
+    map<string, double> baseline;
+    if ( !readResults( path, baseline ) )
+    {
+        cerr << "Error: cannot read baseline " << path << endl;
+        exit( 2 );
+    }
+
+    cout << "Comparison with " << path << " (threshold " << threshold * 100 << "%)" << endl;
+    int regressions = 0;
+    for ( const Result & result : results )
+    {
+        auto found = baseline.find( result.name );
+        if ( found == baseline.end() || found->second <= 0 )
+            continue;
+        // Positive change is an improvement either way
+        double change = ( result.higher_is_better ? result.value / found->second : found->second / result.value ) - 1;
+        bool regressed = change < -threshold;
+        regressions += regressed;
+        cout << "  " << left << setw( 44 ) << result.name << right << setw( 9 ) << fixed << setprecision( 1 ) << change * 100 << "%"
+             << ( regressed ? "  REGRESSION" : "" ) << endl;
+    }
+    return regressions;
+}
+
+
+static Options parseOptions( int argc, const char * argv[] )
+{
+    Options options;
+    for ( int i = 1; i < argc; i++ )
+    {
+        string arg = argv[ i ];
+        bool has_value = i + 1 < argc;
+        if ( arg == "--quick" )
+            options.quick = true;
+        else if ( arg == "--device" && has_value )
+            options.device_index = (uint32_t)atoi( argv[ ++i ] );
+        else if ( arg == "--library" && has_value )
+            options.library_path = argv[ ++i ];
+        else if ( arg == "--max-copy-bytes" && has_value )
+            options.max_copy_bytes = strtoull( argv[ ++i ], nullptr, 10 );
+        else if ( arg == "--output" && has_value )
+            options.output_path = argv[ ++i ];
+        else if ( arg == "--baseline" && has_value )
+            options.baseline_path = argv[ ++i ];
+        else if ( arg == "--threshold" && has_value )
+            options.threshold = atof( argv[ ++i ] );
+        else
+        {
+            cerr << "Usage: " << argv[0] << " [--quick] [--device N] [--library FILE] [--max-copy-bytes N]"
+                 << " [--output FILE] [--baseline FILE] [--threshold FRACTION]" << endl;
+            exit( 2 );
+        }
+    }
+    return options;
+}
+
+
+int main(int argc, const char * argv[]) {
+
+    Options options = parseOptions( argc, argv );
+
+#ifndef __APPLE__
+    check( mtlRegisterHostKernel( "bench_empty", benchEmpty ) == MTL_SUCCESS, "registering the empty kernel" );
+#endif
+    DeviceHandle device = mtlGetDeviceAtIndex( options.device_index );
+    check( device != INVALID_HANDLE, "opening the device" );
+    mtlDeviceInfo device_info;
+    mtlGetDeviceInfo( device, &device_info );
+    cout << "Device: " << device_info.name << endl;
+
+    CommandQueueHandle command_queue = mtlNewCommandQueue( device );
+    check( command_queue != INVALID_HANDLE, "creating the command queue" );
+    LibraryHandle library = mtlNewLibrary( device, empty_source );
+    check( library != INVALID_HANDLE, "building the benchmark library" );
+    ComputePipelineStateHandle empty = mtlComputePipelineStateForFunction( library, "bench_empty" );
+    check( empty != INVALID_HANDLE, "creating the empty kernel" );
+
+    benchHandles( options, device, command_queue, empty );
+    benchCopies( options, device );
+    benchDispatchLatency( options, command_queue, empty );
+    benchKernels( options, device, command_queue );
+    benchStreaming( options, device, command_queue );
+
+    mtlFreeComputePipelineState( empty );
+    mtlFreeLibrary( library );
+    mtlFreeCommandQueue( command_queue );
+    mtlFreeDevice( device );
+
+    if ( !options.output_path.empty() )
+        check( writeResults( options.output_path, device_info ), ( "writing " + options.output_path ).c_str() );
+    if ( !options.baseline_path.empty() && compareResults( options.baseline_path, options.threshold ) > 0 )
+        return 1;
+    return 0;
+}
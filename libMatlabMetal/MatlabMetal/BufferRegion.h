@@ -0,0 +1,81 @@
+//
+//  BufferRegion.h
+//  MatlabMetal
+//
+//  Layout of sub-block copies between a buffer holding a column-major array
+//  and dense host memory, shared by the Metal and CPU backends.
+//
+
+#ifndef BufferRegion_h
+#define BufferRegion_h
+
+#include <stdint.h>
+
+
+/**
+ * A sub-block copy expressed as a grid of runs_y * runs_z contiguous runs.
+ *
+ * Run ( j, k ) starts at byte first_byte + j * stride_y + k * stride_z of the
+ * buffer and at byte ( j + runs_y * k ) * run_bytes of the host data. Runs
+ * that are adjacent in the buffer are merged, so copying whole columns or
+ * whole planes needs fewer, longer runs.
+ */
+typedef struct {
+    uint64_t run_bytes;
+    uint64_t runs_y;
+    uint64_t runs_z;
+    uint64_t stride_y;
+    uint64_t stride_z;
+    uint64_t first_byte;
+    uint64_t end_byte;
+} mtlRegionLayout;
+
+
+/**
+ * Compute the layout of a sub-block copy and check that it fits the buffer
+ * @return 1 if the region lies inside the array and the array inside the buffer, 0 otherwise
+ */
+static inline int mtlMakeRegionLayout( const uint64_t dimensions[3], const uint64_t origin[3], const uint64_t region[3],
+                                       uint64_t element_size, uint64_t buffer_length, mtlRegionLayout * layout )
+{
+    uint64_t array_bytes = element_size;
+    for ( int d = 0; d < 3; d++ )
+    {
+        if ( origin[ d ] > dimensions[ d ] || region[ d ] > dimensions[ d ] - origin[ d ] )
+            return 0;
+        if ( dimensions[ d ] != 0 && array_bytes > buffer_length / dimensions[ d ] )
+            return 0;
+        array_bytes *= dimensions[ d ];
+    }
+    if ( element_size == 0 || array_bytes > buffer_length )
+        return 0;
+
+    layout->stride_y = element_size * dimensions[ 0 ];
+    layout->stride_z = layout->stride_y * dimensions[ 1 ];
+    layout->first_byte = element_size * origin[ 0 ] + layout->stride_y * origin[ 1 ] + layout->stride_z * origin[ 2 ];
+    layout->run_bytes = element_size * region[ 0 ];
+    layout->runs_y = region[ 1 ];
+    layout->runs_z = region[ 2 ];
+    if ( region[ 0 ] == dimensions[ 0 ] )
+    {
+        layout->run_bytes *= region[ 1 ];
+        layout->runs_y = 1;
+        if ( region[ 1 ] == dimensions[ 1 ] )
+        {
+            layout->run_bytes *= region[ 2 ];
+            layout->runs_z = 1;
+        }
+    }
+    if ( layout->run_bytes == 0 || layout->runs_y == 0 || layout->runs_z == 0 )
+    {
+        layout->run_bytes = layout->runs_y = layout->runs_z = 0;
+        layout->end_byte = layout->first_byte;
+        return 1;
+    }
+    layout->end_byte = layout->first_byte + ( layout->runs_y - 1 ) * layout->stride_y
+                     + ( layout->runs_z - 1 ) * layout->stride_z + layout->run_bytes;
+    return 1;
+}
+
+
+#endif /* BufferRegion_h */
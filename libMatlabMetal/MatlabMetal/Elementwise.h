@@ -0,0 +1,82 @@
+//
+//  Elementwise.h
+//  MatlabMetal
+//
+//  Checking of fused element-wise programs, shared by the Metal and CPU
+//  backends. The Metal backend generates a kernel from a program; the CPU
+//  backend interprets it over tiles of elements.
+//
+
+#ifndef Elementwise_h
+#define Elementwise_h
+
+#include <stdint.h>
+
+#include "MatlabMetal.h"
+
+
+/** A checked program with its constants, as handed to the CPU kernel */
+typedef struct {
+    uint32_t length;
+    uint32_t num_inputs;
+    uint32_t num_constants;
+    uint32_t padding;
+    mtlElementwiseOp ops[ MTL_ELEMENTWISE_MAX_PROGRAM ];
+    float constants[ MTL_ELEMENTWISE_MAX_CONSTANTS ];
+} mtlElementwiseProgram;
+
+
+/** Number of values an operation pops, or -1 for an unknown opcode */
+static inline int mtlElementwiseArity( uint32_t opcode )
+{
+    switch ( opcode )
+    {
+        case MTL_ELEMENTWISE_INPUT:
+        case MTL_ELEMENTWISE_CONSTANT:
+            return 0;
+        case MTL_ELEMENTWISE_NEGATE:
+        case MTL_ELEMENTWISE_ABS:
+            return 1;
+        case MTL_ELEMENTWISE_ADD:
+        case MTL_ELEMENTWISE_SUBTRACT:
+        case MTL_ELEMENTWISE_MULTIPLY:
+        case MTL_ELEMENTWISE_DIVIDE:
+        case MTL_ELEMENTWISE_MAX:
+        case MTL_ELEMENTWISE_MIN:
+            return 2;
+        default:
+            return -1;
+    }
+}
+
+
+/**
+ * Check that a program is within the limits, refers only to existing inputs
+ * and constants, never pops an empty stack, needs at most
+ * MTL_ELEMENTWISE_MAX_STACK values on it and leaves exactly one. Returns 1 if so.
+ */
+static inline int mtlElementwiseIsValid( const mtlElementwiseOp * program, uint32_t length, uint32_t num_inputs, uint32_t num_constants )
+{
+    if ( !program || length == 0 || length > MTL_ELEMENTWISE_MAX_PROGRAM ||
+         num_inputs > MTL_ELEMENTWISE_MAX_INPUTS || num_constants > MTL_ELEMENTWISE_MAX_CONSTANTS )
+        return 0;
+
+    uint32_t depth = 0;
+    for ( uint32_t i = 0; i < length; i++ )
+    {
+        int arity = mtlElementwiseArity( program[ i ].opcode );
+        if ( arity < 0 || depth < (uint32_t)arity )
+            return 0;
+        if ( program[ i ].opcode == MTL_ELEMENTWISE_INPUT && program[ i ].operand >= num_inputs )
+            return 0;
+        if ( program[ i ].opcode == MTL_ELEMENTWISE_CONSTANT && program[ i ].operand >= num_constants )
+            return 0;
+        depth = depth - arity + 1;
+        if ( depth > MTL_ELEMENTWISE_MAX_STACK )
+            return 0;
+    }
+    return depth == 1;
+}
+
+
+#endif /* Elementwise_h */
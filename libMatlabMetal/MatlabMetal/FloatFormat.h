@@ -0,0 +1,104 @@
+//
+//  FloatFormat.h
+//  MatlabMetal
+//
+//  Scalar conversions between float and the reduced-precision buffer
+//  formats, shared by the Metal and CPU backends. Narrowing rounds to
+//  nearest even and NaNs come out quiet, bit for bit as the F16C
+//  instructions the CPU backend vectorizes half conversions with.
+//
+
+#ifndef FloatFormat_h
+#define FloatFormat_h
+
+#include <stdint.h>
+#include <string.h>
+
+#include "MatlabMetal.h"
+
+
+/** Bytes per element of a buffer format, or 0 for an unknown format */
+static inline uint32_t mtlFormatSize( uint32_t format )
+{
+    switch ( format )
+    {
+        case MTL_FORMAT_FLOAT:
+            return 4;
+        case MTL_FORMAT_HALF:
+        case MTL_FORMAT_BFLOAT16:
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+
+static inline uint16_t mtlFloatToHalf( float value )
+{
+    uint32_t bits;
+    memcpy( &bits, &value, sizeof( bits ) );
+    uint16_t sign = (uint16_t)( ( bits >> 16 ) & 0x8000 );
+    uint32_t magnitude = bits & 0x7FFFFFFF;
+
+    if ( magnitude > 0x7F800000 )
+        return sign | 0x7E00 | (uint16_t)( ( magnitude >> 13 ) & 0x3FF );
+    if ( magnitude >= 0x477FF000 )
+        return sign | 0x7C00;
+    if ( magnitude < 0x38800000 )
+    {
+        // Below the smallest normal half: adding 0.5 rounds to a multiple of 2^-24, the half subnormal step
+        float rounded;
+        memcpy( &rounded, &magnitude, sizeof( rounded ) );
+        rounded += 0.5f;
+        memcpy( &magnitude, &rounded, sizeof( magnitude ) );
+        return sign | (uint16_t)( magnitude - 0x3F000000 );
+    }
+    // Rebias the exponent from 127 to 15 and round the 13 dropped mantissa bits to nearest even
+    magnitude += 0xC8000FFF + ( ( magnitude >> 13 ) & 1 );
+    return sign | (uint16_t)( magnitude >> 13 );
+}
+
+
+static inline float mtlHalfToFloat( uint16_t half )
+{
+    uint32_t sign = (uint32_t)( half & 0x8000 ) << 16;
+    uint32_t exponent = ( half >> 10 ) & 0x1F;
+    uint32_t mantissa = half & 0x3FF;
+    uint32_t bits;
+    if ( exponent == 0x1F )
+        bits = sign | 0x7F800000 | ( mantissa << 13 ) | ( mantissa ? 0x00400000 : 0 );
+    else if ( exponent == 0 )
+    {
+        float subnormal = (float)mantissa * 5.9604644775390625e-8f;
+        memcpy( &bits, &subnormal, sizeof( bits ) );
+        bits |= sign;
+    }
+    else
+        bits = sign | ( ( exponent + 112 ) << 23 ) | ( mantissa << 13 );
+    float value;
+    memcpy( &value, &bits, sizeof( value ) );
+    return value;
+}
+
+
+static inline uint16_t mtlFloatToBFloat16( float value )
+{
+    uint32_t bits;
+    memcpy( &bits, &value, sizeof( bits ) );
+    if ( ( bits & 0x7FFFFFFF ) > 0x7F800000 )
+        return (uint16_t)( ( bits >> 16 ) | 0x0040 );
+    bits += 0x7FFF + ( ( bits >> 16 ) & 1 );
+    return (uint16_t)( bits >> 16 );
+}
+
+
+static inline float mtlBFloat16ToFloat( uint16_t bfloat16 )
+{
+    uint32_t bits = (uint32_t)bfloat16 << 16;
+    float value;
+    memcpy( &value, &bits, sizeof( value ) );
+    return value;
+}
+
+
+#endif /* FloatFormat_h */
@@ -5,6 +5,8 @@
 #import "MatlabMetal.h"
 #import <Metal/Metal.h>
 
+@class CommandList;
+
 @interface HandleStore : NSObject
 
 
@@ -45,6 +47,14 @@
 -(CommandEncoderHandle) CommandEncoder2Handle:(id<MTLComputeCommandEncoder>) obj;
 -(void) FreeCommandEncoder:(CommandEncoderHandle) handle;
 
+-(id<MTLSharedEvent>) Handle2Event:(EventHandle) handle;
+-(EventHandle) Event2Handle:(id<MTLSharedEvent>) obj;
+-(void) FreeEvent:(EventHandle) handle;
+
+-(CommandList *) Handle2CommandList:(CommandListHandle) handle;
+-(CommandListHandle) CommandList2Handle:(CommandList *) obj;
+-(void) FreeCommandList:(CommandListHandle) handle;
+
 @end
 
 
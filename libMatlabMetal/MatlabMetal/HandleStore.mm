@@ -0,0 +1,255 @@
+//
+//  HandleStore.mm
+//  MatlabMetal
+//
+//  Created by Anthony Davis on 1/27/21.
+//
+
+#import <Foundation/Foundation.h>
+#import "HandleStore.h"
+#include "HandleTable.h"
+
+
+/**
+ * Handles to Metal objects. Each live handle holds a retain on its object,
+ * taken with CFBridgingRetain on insertion and dropped on removal.
+ */
+typedef HandleTable<void> ObjectTable;
+
+static uint64_t InsertObject( ObjectTable & table, id obj )
+{
+    if (obj == nil) {
+        return INVALID_HANDLE;
+    }
+    
+    void * retained = (void *)CFBridgingRetain( obj );
+    uint64_t handle = table.Insert( retained );
+    if ( handle == INVALID_HANDLE ) {
+        CFBridgingRelease( retained );
+    }
+    return handle;
+}
+
+
+static id LookupObject( const ObjectTable & table, uint64_t handle )
+{
+    return (__bridge id)table.Lookup( handle );
+}
+
+
+static void RemoveObject( ObjectTable & table, uint64_t handle )
+{
+    void * retained = table.Remove( handle );
+    if ( retained ) {
+        CFBridgingRelease( retained );
+    }
+}
+
+
+@implementation HandleStore
+
+static ObjectTable _devices;
+static ObjectTable _libraries;
+static ObjectTable _functions;
+static ObjectTable _compute_pipeline_states;
+static ObjectTable _command_queues;
+static ObjectTable _buffers;
+static ObjectTable _command_buffers;
+static ObjectTable _command_encoders;
+static ObjectTable _events;
+static ObjectTable _command_lists;
+
+#pragma mark Lifecycle
+
++(id) getInstance
+{
+    static HandleStore *_sharedInstance = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        _sharedInstance = [[self alloc] init];
+    });
+    return _sharedInstance;
+}
+
+#pragma mark Handle Methods
+
+-(id<MTLDevice>) Handle2Device:(DeviceHandle) handle
+{
+    return LookupObject( _devices, handle );
+}
+
+
+-(DeviceHandle) Device2Handle:(id<MTLDevice>) obj
+{
+    return ( DeviceHandle )InsertObject( _devices, obj );
+}
+
+
+-(void) FreeDevice:(DeviceHandle) handle
+{
+    RemoveObject( _devices, handle );
+}
+
+
+-(id<MTLLibrary>) Handle2Library:(LibraryHandle) handle
+{
+    return LookupObject( _libraries, handle );
+}
+
+
+-(LibraryHandle) Library2Handle:(id<MTLLibrary>) obj
+{
+    return ( LibraryHandle )InsertObject( _libraries, obj );
+}
+
+
+-(void) FreeLibrary:(LibraryHandle) handle
+{
+    RemoveObject( _libraries, handle );
+}
+
+
+-(id<MTLFunction>) Handle2Function:(FunctionHandle) handle
+{
+    return LookupObject( _functions, handle );
+}
+
+
+-(FunctionHandle) Function2Handle:(id<MTLFunction>) obj
+{
+    return ( FunctionHandle )InsertObject( _functions, obj );
+}
+
+
+-(void) FreeFunction:(FunctionHandle) handle
+{
+    RemoveObject( _functions, handle );
+}
+
+
+-(id<MTLComputePipelineState>) Handle2ComputePipelineState:(ComputePipelineStateHandle) handle
+{
+    return LookupObject( _compute_pipeline_states, handle );
+}
+
+
+-(ComputePipelineStateHandle) ComputePipelineState2Handle:(id<MTLComputePipelineState>) obj
+{
+    return ( ComputePipelineStateHandle )InsertObject( _compute_pipeline_states, obj );
+}
+
+
+-(void) FreeComputePipelineState:(ComputePipelineStateHandle) handle
+{
+    RemoveObject( _compute_pipeline_states, handle );
+}
+
+
+-(id<MTLCommandQueue>) Handle2CommandQueue:(CommandQueueHandle) handle
+{
+    return LookupObject( _command_queues, handle );
+}
+
+
+-(CommandQueueHandle) CommandQueue2Handle:(id<MTLCommandQueue>) obj
+{
+    return ( CommandQueueHandle )InsertObject( _command_queues, obj );
+}
+
+
+-(void) FreeCommandQueue:(CommandQueueHandle) handle
+{
+    RemoveObject( _command_queues, handle );
+}
+
+
+-(id<MTLBuffer>) Handle2Buffer:(BufferHandle) handle
+{
+    return LookupObject( _buffers, handle );
+}
+
+
+-(BufferHandle) Buffer2Handle:(id<MTLBuffer>) obj
+{
+    return ( BufferHandle )InsertObject( _buffers, obj );
+}
+
+
+-(void) FreeBuffer:(BufferHandle) handle
+{
+    RemoveObject( _buffers, handle );
+}
+
+
+-(id<MTLCommandBuffer>) Handle2CommandBuffer:(CommandBufferHandle) handle
+{
+    return LookupObject( _command_buffers, handle );
+}
+
+
+-(CommandBufferHandle) CommandBuffer2Handle:(id<MTLCommandBuffer>) obj
+{
+    return ( CommandBufferHandle )InsertObject( _command_buffers, obj );
+}
+
+
+-(void) FreeCommandBuffer:(CommandBufferHandle) handle
+{
+    RemoveObject( _command_buffers, handle );
+}
+
+
+-(id<MTLComputeCommandEncoder>) Handle2CommandEncoder:(CommandEncoderHandle) handle
+{
+    return LookupObject( _command_encoders, handle );
+}
+
+
+-(CommandEncoderHandle) CommandEncoder2Handle:(id<MTLComputeCommandEncoder>) obj
+{
+    return ( CommandEncoderHandle )InsertObject( _command_encoders, obj );
+}
+
+
+-(void) FreeCommandEncoder:(CommandEncoderHandle) handle
+{
+    RemoveObject( _command_encoders, handle );
+}
+
+
+-(id<MTLSharedEvent>) Handle2Event:(EventHandle) handle
+{
+    return LookupObject( _events, handle );
+}
+
+
+-(EventHandle) Event2Handle:(id<MTLSharedEvent>) obj
+{
+    return ( EventHandle )InsertObject( _events, obj );
+}
+
+
+-(void) FreeEvent:(EventHandle) handle
+{
+    RemoveObject( _events, handle );
+}
+
+
+-(CommandList *) Handle2CommandList:(CommandListHandle) handle
+{
+    return LookupObject( _command_lists, handle );
+}
+
+
+-(CommandListHandle) CommandList2Handle:(CommandList *) obj
+{
+    return ( CommandListHandle )InsertObject( _command_lists, obj );
+}
+
+
+-(void) FreeCommandList:(CommandListHandle) handle
+{
+    RemoveObject( _command_lists, handle );
+}
+
+@end
@@ -0,0 +1,208 @@
+//
+//  HandleTable.h
+//  MatlabMetal
+//
+//  Portable table mapping 64-bit handles to object pointers, shared by the
+//  Metal (HandleStore.mm) and CPU (MatlabMetal.cpp) backends.
+//
+
+#ifndef HandleTable_h
+#define HandleTable_h
+
+#include <stdint.h>
+#include <atomic>
+
+
+/**
+ * A table of object pointers addressed by 64-bit handles.
+ *
+ * A handle packs a slot index (low 32 bits, offset by one so that no handle
+ * equals INVALID_HANDLE) with the generation of the slot (high 32 bits).
+ * A slot is live while its generation is odd. Removing a handle advances the
+ * generation, so stale and double-freed handles never match a slot again.
+ *
+ * Lookups are wait-free. Insertions and removals are lock-free: freed slots
+ * are recycled through a tagged free list, and blocks of slots are allocated
+ * on demand and never move.
+ *
+ * The table stores pointers only; ownership stays with the caller. Removing a
+ * handle while another thread is still looking it up is a caller error, as
+ * with freeing any object that is in use.
+ */
+template <typename V>
+class HandleTable
+{
+public:
+    HandleTable() : free_head( 0 ), next_unused( 0 )
+    {
+        for ( uint32_t i = 0; i < MaxBlocks; i++ )
+            blocks[ i ].store( nullptr, std::memory_order_relaxed );
+    }
+
+    ~HandleTable()
+    {
+        for ( uint32_t i = 0; i < MaxBlocks; i++ )
+            delete blocks[ i ].load( std::memory_order_relaxed );
+    }
+
+    /**
+     * Store a pointer and return a new handle to it
+     * @return The handle, or 0 if value is null or the table is full
+     */
+    uint64_t Insert( V * value )
+    {
+        if ( !value )
+            return 0;
+
+        uint32_t index;
+        if ( !PopFree( index ) )
+        {
+            index = next_unused.fetch_add( 1, std::memory_order_relaxed );
+            if ( index >= MaxBlocks * SlotsPerBlock )
+            {
+                next_unused.fetch_sub( 1, std::memory_order_relaxed );
+                return 0;
+            }
+        }
+
+        Slot & slot = SlotAt( index, true );
+        slot.value.store( value, std::memory_order_relaxed );
+        uint32_t generation = slot.generation.load( std::memory_order_relaxed ) + 1;
+        slot.generation.store( generation, std::memory_order_release );
+        return MakeHandle( index, generation );
+    }
+
+    /**
+     * Return the pointer for a live handle
+     * @return The stored pointer, or null for invalid, stale or freed handles
+     */
+    V * Lookup( uint64_t handle ) const
+    {
+        const Slot * slot = LiveSlot( handle );
+        if ( !slot )
+            return nullptr;
+
+        uint32_t generation = HandleGeneration( handle );
+        if ( slot->generation.load( std::memory_order_acquire ) != generation )
+            return nullptr;
+        V * value = slot->value.load( std::memory_order_acquire );
+        if ( slot->generation.load( std::memory_order_acquire ) != generation )
+            return nullptr;
+        return value;
+    }
+
+    /**
+     * Invalidate a handle and return the pointer it referred to
+     * @return The stored pointer, or null if the handle was invalid, stale or already freed
+     */
+    V * Remove( uint64_t handle )
+    {
+        Slot * slot = const_cast<Slot *>( LiveSlot( handle ) );
+        if ( !slot )
+            return nullptr;
+
+        uint32_t generation = HandleGeneration( handle );
+        if ( !slot->generation.compare_exchange_strong( generation, generation + 1, std::memory_order_acq_rel ) )
+            return nullptr;
+
+        V * value = slot->value.exchange( nullptr, std::memory_order_acq_rel );
+        PushFree( HandleIndex( handle ) );
+        return value;
+    }
+
+private:
+    static const uint32_t SlotBits = 10;
+    static const uint32_t SlotsPerBlock = 1u << SlotBits;
+    static const uint32_t MaxBlocks = 4096;
+
+    struct Slot
+    {
+        std::atomic<uint32_t> generation;
+        std::atomic<uint32_t> next_free;
+        std::atomic<V *> value;
+
+        Slot() : generation( 0 ), next_free( 0 ), value( nullptr ) {}
+    };
+
+    struct Block
+    {
+        Slot slots[ SlotsPerBlock ];
+    };
+
+    static uint64_t MakeHandle( uint32_t index, uint32_t generation )
+    {
+        return ( (uint64_t)generation << 32 ) | ( (uint64_t)index + 1 );
+    }
+
+    static uint32_t HandleIndex( uint64_t handle )
+    {
+        return (uint32_t)( handle & 0xFFFFFFFFu ) - 1;
+    }
+
+    static uint32_t HandleGeneration( uint64_t handle )
+    {
+        return (uint32_t)( handle >> 32 );
+    }
+
+    /** The slot a handle points at, if the handle is well formed and its block exists */
+    const Slot * LiveSlot( uint64_t handle ) const
+    {
+        if ( ( handle & 0xFFFFFFFFu ) == 0 || ( HandleGeneration( handle ) & 1u ) == 0 )
+            return nullptr;
+        uint32_t index = HandleIndex( handle );
+        if ( ( index >> SlotBits ) >= MaxBlocks )
+            return nullptr;
+        const Block * block = blocks[ index >> SlotBits ].load( std::memory_order_acquire );
+        if ( !block )
+            return nullptr;
+        return &block->slots[ index & ( SlotsPerBlock - 1 ) ];
+    }
+
+    Slot & SlotAt( uint32_t index, bool allocate )
+    {
+        std::atomic<Block *> & entry = blocks[ index >> SlotBits ];
+        Block * block = entry.load( std::memory_order_acquire );
+        if ( !block && allocate )
+        {
+            Block * fresh = new Block;
+            if ( entry.compare_exchange_strong( block, fresh, std::memory_order_acq_rel ) )
+                block = fresh;
+            else
+                delete fresh;
+        }
+        return block->slots[ index & ( SlotsPerBlock - 1 ) ];
+    }
+
+    /** The free list head packs an ABA tag (high 32 bits) with the first free index plus one */
+    void PushFree( uint32_t index )
+    {
+        Slot & slot = SlotAt( index, false );
+        uint64_t head = free_head.load( std::memory_order_relaxed );
+        uint64_t new_head;
+        do {
+            slot.next_free.store( (uint32_t)head, std::memory_order_relaxed );
+            new_head = ( ( ( head >> 32 ) + 1 ) << 32 ) | ( (uint64_t)index + 1 );
+        } while ( !free_head.compare_exchange_weak( head, new_head, std::memory_order_release, std::memory_order_relaxed ) );
+    }
+
+    bool PopFree( uint32_t & index )
+    {
+        uint64_t head = free_head.load( std::memory_order_acquire );
+        uint64_t new_head;
+        do {
+            if ( (uint32_t)head == 0 )
+                return false;
+            index = (uint32_t)head - 1;
+            uint32_t next = SlotAt( index, false ).next_free.load( std::memory_order_relaxed );
+            new_head = ( ( ( head >> 32 ) + 1 ) << 32 ) | next;
+        } while ( !free_head.compare_exchange_weak( head, new_head, std::memory_order_acquire, std::memory_order_acquire ) );
+        return true;
+    }
+
+    std::atomic<Block *> blocks[ MaxBlocks ];
+    std::atomic<uint64_t> free_head;
+    std::atomic<uint32_t> next_unused;
+};
+
+
+#endif /* HandleTable_h */
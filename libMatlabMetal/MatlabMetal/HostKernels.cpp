@@ -0,0 +1,1006 @@
+//
+//  HostKernels.cpp
+//  MatlabMetal
+//
+//  Vectorized host implementations of the MetalFunctionLibrary.mtl kernels
+//  (zerobuff, accumulate, maxval, scaleaccum and their half and bfloat16
+//  variants), the test sqr kernel, the buffer reductions, fused element-wise
+//  programs and the float format conversions for the CPU backend. Each
+//  kernel has a scalar loop and, on x86, SSE2, AVX2 and AVX-512 versions
+//  compiled with target attributes, so the library needs no special
+//  compiler flags; the widest supported set is picked once at startup.
+//
+//  These are streaming kernels bound by memory bandwidth: the worker pool
+//  splits a dispatch into chunks, and each chunk runs a plain unaligned
+//  vector loop. None of them use FMA, so every instruction set gives
+//  results identical to the scalar loop. Reduction sums are the exception:
+//  they are accumulated in double precision lanes, so their rounding depends
+//  on the vector width.
+//
+
+#include "HostKernels.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Elements evaluated per step of an element-wise program; a stack of tiles stays in the L1 cache
+#define ELEMENTWISE_TILE 256
+
+// Half or bfloat16 operands are widened to floats this many elements at a time
+#define UNPACK_TILE 1024
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#define HOST_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+
+namespace {
+
+enum HostISA
+{
+    HOST_ISA_SCALAR,
+    HOST_ISA_SSE2,
+    HOST_ISA_AVX2,
+    HOST_ISA_AVX512
+};
+
+const char * const HostISANames[] = { "scalar", "sse2", "avx2", "avx512" };
+
+
+#pragma mark Scalar
+
+void AccumulateScalar( float * a, const float * b, uint64_t n )
+{
+    for ( uint64_t i = 0; i < n; i++ )
+        a[ i ] += b[ i ];
+}
+
+void MaxvalScalar( float * a, const float * b, uint64_t n )
+{
+    for ( uint64_t i = 0; i < n; i++ )
+        a[ i ] = fmaxf( a[ i ], b[ i ] );
+}
+
+void ScaleaccumScalar( float * a, const float * b, float scale, uint64_t n )
+{
+    for ( uint64_t i = 0; i < n; i++ )
+        a[ i ] += b[ i ] * scale;
+}
+
+void SqrScalar( float * out, const float * in, uint64_t n )
+{
+    for ( uint64_t i = 0; i < n; i++ )
+        out[ i ] = in[ i ] * in[ i ];
+}
+
+double SumScalar( const float * data, uint64_t n, bool squares )
+{
+    double sum = 0;
+    for ( uint64_t i = 0; i < n; i++ )
+        sum += squares ? (double)data[ i ] * data[ i ] : (double)data[ i ];
+    return sum;
+}
+
+// The largest or smallest number, skipping NaNs; an infinity of the other sign if there is none.
+float ExtremeScalar( const float * data, uint64_t n, bool maximum )
+{
+    float best = maximum ? -INFINITY : INFINITY;
+    for ( uint64_t i = 0; i < n; i++ )
+        best = maximum ? fmaxf( best, data[ i ] ) : fminf( best, data[ i ] );
+    return best;
+}
+
+void ToHalfScalar( uint16_t * out, const float * in, uint64_t n )
+{
+    for ( uint64_t i = 0; i < n; i++ )
+        out[ i ] = mtlFloatToHalf( in[ i ] );
+}
+
+void FromHalfScalar( float * out, const uint16_t * in, uint64_t n )
+{
+    for ( uint64_t i = 0; i < n; i++ )
+        out[ i ] = mtlHalfToFloat( in[ i ] );
+}
+
+void ToBFloat16Scalar( uint16_t * out, const float * in, uint64_t n )
+{
+    for ( uint64_t i = 0; i < n; i++ )
+        out[ i ] = mtlFloatToBFloat16( in[ i ] );
+}
+
+void FromBFloat16Scalar( float * out, const uint16_t * in, uint64_t n )
+{
+    for ( uint64_t i = 0; i < n; i++ )
+        out[ i ] = mtlBFloat16ToFloat( in[ i ] );
+}
+
+
+#ifdef HOST_KERNELS_X86
+
+#pragma mark SSE2
+
+__attribute__(( target( "sse2" ) ))
+void AccumulateSSE2( float * a, const float * b, uint64_t n )
+{
+    uint64_t i = 0;
+    for ( ; i + 4 <= n; i += 4 )
+        _mm_storeu_ps( a + i, _mm_add_ps( _mm_loadu_ps( a + i ), _mm_loadu_ps( b + i ) ) );
+    AccumulateScalar( a + i, b + i, n - i );
+}
+
+// max( b, a ) returns a when either is NaN; a NaN a is then replaced by b, as fmaxf does.
+__attribute__(( target( "sse2" ) ))
+void MaxvalSSE2( float * a, const float * b, uint64_t n )
+{
+    uint64_t i = 0;
+    for ( ; i + 4 <= n; i += 4 )
+    {
+        __m128 va = _mm_loadu_ps( a + i );
+        __m128 vb = _mm_loadu_ps( b + i );
+        __m128 a_nan = _mm_cmpunord_ps( va, va );
+        __m128 result = _mm_max_ps( vb, va );
+        _mm_storeu_ps( a + i, _mm_or_ps( _mm_and_ps( a_nan, vb ), _mm_andnot_ps( a_nan, result ) ) );
+    }
+    MaxvalScalar( a + i, b + i, n - i );
+}
+
+__attribute__(( target( "sse2" ) ))
+void ScaleaccumSSE2( float * a, const float * b, float scale, uint64_t n )
+{
+    __m128 vs = _mm_set1_ps( scale );
+    uint64_t i = 0;
+    for ( ; i + 4 <= n; i += 4 )
+        _mm_storeu_ps( a + i, _mm_add_ps( _mm_loadu_ps( a + i ), _mm_mul_ps( _mm_loadu_ps( b + i ), vs ) ) );
+    ScaleaccumScalar( a + i, b + i, scale, n - i );
+}
+
+__attribute__(( target( "sse2" ) ))
+void SqrSSE2( float * out, const float * in, uint64_t n )
+{
+    uint64_t i = 0;
+    for ( ; i + 4 <= n; i += 4 )
+    {
+        __m128 v = _mm_loadu_ps( in + i );
+        _mm_storeu_ps( out + i, _mm_mul_ps( v, v ) );
+    }
+    SqrScalar( out + i, in + i, n - i );
+}
+
+__attribute__(( target( "sse2" ) ))
+double SumSSE2( const float * data, uint64_t n, bool squares )
+{
+    __m128d sum_low = _mm_setzero_pd();
+    __m128d sum_high = _mm_setzero_pd();
+    uint64_t i = 0;
+    for ( ; i + 4 <= n; i += 4 )
+    {
+        __m128 v = _mm_loadu_ps( data + i );
+        __m128d low = _mm_cvtps_pd( v );
+        __m128d high = _mm_cvtps_pd( _mm_movehl_ps( v, v ) );
+        if ( squares )
+        {
+            low = _mm_mul_pd( low, low );
+            high = _mm_mul_pd( high, high );
+        }
+        sum_low = _mm_add_pd( sum_low, low );
+        sum_high = _mm_add_pd( sum_high, high );
+    }
+    double lanes[2];
+    _mm_storeu_pd( lanes, _mm_add_pd( sum_low, sum_high ) );
+    return lanes[0] + lanes[1] + SumScalar( data + i, n - i, squares );
+}
+
+// max( v, best ) returns best when v is NaN, so NaNs never enter the accumulator.
+__attribute__(( target( "sse2" ) ))
+float ExtremeSSE2( const float * data, uint64_t n, bool maximum )
+{
+    __m128 best = _mm_set1_ps( maximum ? -INFINITY : INFINITY );
+    uint64_t i = 0;
+    for ( ; i + 4 <= n; i += 4 )
+    {
+        __m128 v = _mm_loadu_ps( data + i );
+        best = maximum ? _mm_max_ps( v, best ) : _mm_min_ps( v, best );
+    }
+    float lanes[5];
+    _mm_storeu_ps( lanes, best );
+    lanes[4] = ExtremeScalar( data + i, n - i, maximum );
+    return ExtremeScalar( lanes, 5, maximum );
+}
+
+
+// Round the low 16 bits away to nearest even, or keep a NaN quiet, leaving the bfloat16 in the low half of each lane
+__attribute__(( target( "sse2" ) ))
+inline __m128i RoundToBFloat16SSE2( __m128 v )
+{
+    __m128i bits = _mm_castps_si128( v );
+    __m128i odd = _mm_and_si128( _mm_srli_epi32( bits, 16 ), _mm_set1_epi32( 1 ) );
+    __m128i rounded = _mm_srli_epi32( _mm_add_epi32( bits, _mm_add_epi32( odd, _mm_set1_epi32( 0x7FFF ) ) ), 16 );
+    __m128i quiet = _mm_or_si128( _mm_srli_epi32( bits, 16 ), _mm_set1_epi32( 0x0040 ) );
+    __m128i nan = _mm_castps_si128( _mm_cmpunord_ps( v, v ) );
+    return _mm_or_si128( _mm_and_si128( nan, quiet ), _mm_andnot_si128( nan, rounded ) );
+}
+
+// SSE2 has no unsigned 32 to 16-bit pack, so the values are offset into the signed range and back
+__attribute__(( target( "sse2" ) ))
+void ToBFloat16SSE2( uint16_t * out, const float * in, uint64_t n )
+{
+    const __m128i offset32 = _mm_set1_epi32( 0x8000 );
+    const __m128i offset16 = _mm_set1_epi16( (short)0x8000 );
+    uint64_t i = 0;
+    for ( ; i + 8 <= n; i += 8 )
+    {
+        __m128i low = _mm_sub_epi32( RoundToBFloat16SSE2( _mm_loadu_ps( in + i ) ), offset32 );
+        __m128i high = _mm_sub_epi32( RoundToBFloat16SSE2( _mm_loadu_ps( in + i + 4 ) ), offset32 );
+        _mm_storeu_si128( (__m128i *)( out + i ), _mm_xor_si128( _mm_packs_epi32( low, high ), offset16 ) );
+    }
+    ToBFloat16Scalar( out + i, in + i, n - i );
+}
+
+__attribute__(( target( "sse2" ) ))
+void FromBFloat16SSE2( float * out, const uint16_t * in, uint64_t n )
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t i = 0;
+    for ( ; i + 8 <= n; i += 8 )
+    {
+        __m128i v = _mm_loadu_si128( (const __m128i *)( in + i ) );
+        _mm_storeu_ps( out + i, _mm_castsi128_ps( _mm_unpacklo_epi16( zero, v ) ) );
+        _mm_storeu_ps( out + i + 4, _mm_castsi128_ps( _mm_unpackhi_epi16( zero, v ) ) );
+    }
+    FromBFloat16Scalar( out + i, in + i, n - i );
+}
+
+
+#pragma mark AVX2
+
+__attribute__(( target( "avx2" ) ))
+void AccumulateAVX2( float * a, const float * b, uint64_t n )
+{
+    uint64_t i = 0;
+    for ( ; i + 8 <= n; i += 8 )
+        _mm256_storeu_ps( a + i, _mm256_add_ps( _mm256_loadu_ps( a + i ), _mm256_loadu_ps( b + i ) ) );
+    AccumulateScalar( a + i, b + i, n - i );
+}
+
+__attribute__(( target( "avx2" ) ))
+void MaxvalAVX2( float * a, const float * b, uint64_t n )
+{
+    uint64_t i = 0;
+    for ( ; i + 8 <= n; i += 8 )
+    {
+        __m256 va = _mm256_loadu_ps( a + i );
+        __m256 vb = _mm256_loadu_ps( b + i );
+        __m256 a_nan = _mm256_cmp_ps( va, va, _CMP_UNORD_Q );
+        _mm256_storeu_ps( a + i, _mm256_blendv_ps( _mm256_max_ps( vb, va ), vb, a_nan ) );
+    }
+    MaxvalScalar( a + i, b + i, n - i );
+}
+
+__attribute__(( target( "avx2" ) ))
+void ScaleaccumAVX2( float * a, const float * b, float scale, uint64_t n )
+{
+    __m256 vs = _mm256_set1_ps( scale );
+    uint64_t i = 0;
+    for ( ; i + 8 <= n; i += 8 )
+        _mm256_storeu_ps( a + i, _mm256_add_ps( _mm256_loadu_ps( a + i ), _mm256_mul_ps( _mm256_loadu_ps( b + i ), vs ) ) );
+    ScaleaccumScalar( a + i, b + i, scale, n - i );
+}
+
+__attribute__(( target( "avx2" ) ))
+void SqrAVX2( float * out, const float * in, uint64_t n )
+{
+    uint64_t i = 0;
+    for ( ; i + 8 <= n; i += 8 )
+    {
+        __m256 v = _mm256_loadu_ps( in + i );
+        _mm256_storeu_ps( out + i, _mm256_mul_ps( v, v ) );
+    }
+    SqrScalar( out + i, in + i, n - i );
+}
+
+__attribute__(( target( "avx2" ) ))
+double SumAVX2( const float * data, uint64_t n, bool squares )
+{
+    __m256d sum_low = _mm256_setzero_pd();
+    __m256d sum_high = _mm256_setzero_pd();
+    uint64_t i = 0;
+    for ( ; i + 8 <= n; i += 8 )
+    {
+        __m256 v = _mm256_loadu_ps( data + i );
+        __m256d low = _mm256_cvtps_pd( _mm256_castps256_ps128( v ) );
+        __m256d high = _mm256_cvtps_pd( _mm256_extractf128_ps( v, 1 ) );
+        if ( squares )
+        {
+            low = _mm256_mul_pd( low, low );
+            high = _mm256_mul_pd( high, high );
+        }
+        sum_low = _mm256_add_pd( sum_low, low );
+        sum_high = _mm256_add_pd( sum_high, high );
+    }
+    double lanes[4];
+    _mm256_storeu_pd( lanes, _mm256_add_pd( sum_low, sum_high ) );
+    return ( lanes[0] + lanes[1] ) + ( lanes[2] + lanes[3] ) + SumScalar( data + i, n - i, squares );
+}
+
+__attribute__(( target( "avx2" ) ))
+float ExtremeAVX2( const float * data, uint64_t n, bool maximum )
+{
+    __m256 best = _mm256_set1_ps( maximum ? -INFINITY : INFINITY );
+    uint64_t i = 0;
+    for ( ; i + 8 <= n; i += 8 )
+    {
+        __m256 v = _mm256_loadu_ps( data + i );
+        best = maximum ? _mm256_max_ps( v, best ) : _mm256_min_ps( v, best );
+    }
+    float lanes[9];
+    _mm256_storeu_ps( lanes, best );
+    lanes[8] = ExtremeScalar( data + i, n - i, maximum );
+    return ExtremeScalar( lanes, 9, maximum );
+}
+
+
+// Half conversions use F16C, which every AVX2 processor has
+__attribute__(( target( "avx2,f16c" ) ))
+void ToHalfAVX2( uint16_t * out, const float * in, uint64_t n )
+{
+    uint64_t i = 0;
+    for ( ; i + 8 <= n; i += 8 )
+        _mm_storeu_si128( (__m128i *)( out + i ), _mm256_cvtps_ph( _mm256_loadu_ps( in + i ), _MM_FROUND_TO_NEAREST_INT ) );
+    ToHalfScalar( out + i, in + i, n - i );
+}
+
+__attribute__(( target( "avx2,f16c" ) ))
+void FromHalfAVX2( float * out, const uint16_t * in, uint64_t n )
+{
+    uint64_t i = 0;
+    for ( ; i + 8 <= n; i += 8 )
+        _mm256_storeu_ps( out + i, _mm256_cvtph_ps( _mm_loadu_si128( (const __m128i *)( in + i ) ) ) );
+    FromHalfScalar( out + i, in + i, n - i );
+}
+
+__attribute__(( target( "avx2" ) ))
+inline __m256i RoundToBFloat16AVX2( __m256 v )
+{
+    __m256i bits = _mm256_castps_si256( v );
+    __m256i odd = _mm256_and_si256( _mm256_srli_epi32( bits, 16 ), _mm256_set1_epi32( 1 ) );
+    __m256i rounded = _mm256_srli_epi32( _mm256_add_epi32( bits, _mm256_add_epi32( odd, _mm256_set1_epi32( 0x7FFF ) ) ), 16 );
+    __m256i quiet = _mm256_or_si256( _mm256_srli_epi32( bits, 16 ), _mm256_set1_epi32( 0x0040 ) );
+    return _mm256_blendv_epi8( rounded, quiet, _mm256_castps_si256( _mm256_cmp_ps( v, v, _CMP_UNORD_Q ) ) );
+}
+
+// The pack works within 128-bit lanes, so the 64-bit quarters are put back in order after it
+__attribute__(( target( "avx2" ) ))
+void ToBFloat16AVX2( uint16_t * out, const float * in, uint64_t n )
+{
+    uint64_t i = 0;
+    for ( ; i + 16 <= n; i += 16 )
+    {
+        __m256i packed = _mm256_packus_epi32( RoundToBFloat16AVX2( _mm256_loadu_ps( in + i ) ), RoundToBFloat16AVX2( _mm256_loadu_ps( in + i + 8 ) ) );
+        _mm256_storeu_si256( (__m256i *)( out + i ), _mm256_permute4x64_epi64( packed, 0xD8 ) );
+    }
+    ToBFloat16Scalar( out + i, in + i, n - i );
+}
+
+__attribute__(( target( "avx2" ) ))
+void FromBFloat16AVX2( float * out, const uint16_t * in, uint64_t n )
+{
+    uint64_t i = 0;
+    for ( ; i + 8 <= n; i += 8 )
+    {
+        __m256i wide = _mm256_cvtepu16_epi32( _mm_loadu_si128( (const __m128i *)( in + i ) ) );
+        _mm256_storeu_ps( out + i, _mm256_castsi256_ps( _mm256_slli_epi32( wide, 16 ) ) );
+    }
+    FromBFloat16Scalar( out + i, in + i, n - i );
+}
+
+
+#pragma mark AVX-512
+
+// The tail is handled with a masked load and store rather than a scalar loop.
+__attribute__(( target( "avx512f" ) ))
+inline __mmask16 TailMask( uint64_t remaining )
+{
+    return (__mmask16)( ( 1u << remaining ) - 1 );
+}
+
+__attribute__(( target( "avx512f" ) ))
+void AccumulateAVX512( float * a, const float * b, uint64_t n )
+{
+    uint64_t i = 0;
+    for ( ; i + 16 <= n; i += 16 )
+        _mm512_storeu_ps( a + i, _mm512_add_ps( _mm512_loadu_ps( a + i ), _mm512_loadu_ps( b + i ) ) );
+    if ( i < n )
+    {
+        __mmask16 mask = TailMask( n - i );
+        _mm512_mask_storeu_ps( a + i, mask, _mm512_add_ps( _mm512_maskz_loadu_ps( mask, a + i ), _mm512_maskz_loadu_ps( mask, b + i ) ) );
+    }
+}
+
+// Lanes where a is NaN keep b; the others take max( b, a ), which is a if b is NaN.
+__attribute__(( target( "avx512f" ) ))
+inline __m512 MaxvalAVX512Vector( __m512 va, __m512 vb )
+{
+    __mmask16 a_number = _mm512_cmp_ps_mask( va, va, _CMP_ORD_Q );
+    return _mm512_mask_max_ps( vb, a_number, vb, va );
+}
+
+__attribute__(( target( "avx512f" ) ))
+void MaxvalAVX512( float * a, const float * b, uint64_t n )
+{
+    uint64_t i = 0;
+    for ( ; i + 16 <= n; i += 16 )
+        _mm512_storeu_ps( a + i, MaxvalAVX512Vector( _mm512_loadu_ps( a + i ), _mm512_loadu_ps( b + i ) ) );
+    if ( i < n )
+    {
+        __mmask16 mask = TailMask( n - i );
+        _mm512_mask_storeu_ps( a + i, mask, MaxvalAVX512Vector( _mm512_maskz_loadu_ps( mask, a + i ), _mm512_maskz_loadu_ps( mask, b + i ) ) );
+    }
+}
+
+__attribute__(( target( "avx512f" ) ))
+void ScaleaccumAVX512( float * a, const float * b, float scale, uint64_t n )
+{
+    __m512 vs = _mm512_set1_ps( scale );
+    uint64_t i = 0;
+    for ( ; i + 16 <= n; i += 16 )
+        _mm512_storeu_ps( a + i, _mm512_add_ps( _mm512_loadu_ps( a + i ), _mm512_mul_ps( _mm512_loadu_ps( b + i ), vs ) ) );
+    if ( i < n )
+    {
+        __mmask16 mask = TailMask( n - i );
+        __m512 product = _mm512_mul_ps( _mm512_maskz_loadu_ps( mask, b + i ), vs );
+        _mm512_mask_storeu_ps( a + i, mask, _mm512_add_ps( _mm512_maskz_loadu_ps( mask, a + i ), product ) );
+    }
+}
+
+__attribute__(( target( "avx512f" ) ))
+void SqrAVX512( float * out, const float * in, uint64_t n )
+{
+    uint64_t i = 0;
+    for ( ; i + 16 <= n; i += 16 )
+    {
+        __m512 v = _mm512_loadu_ps( in + i );
+        _mm512_storeu_ps( out + i, _mm512_mul_ps( v, v ) );
+    }
+    if ( i < n )
+    {
+        __mmask16 mask = TailMask( n - i );
+        __m512 v = _mm512_maskz_loadu_ps( mask, in + i );
+        _mm512_mask_storeu_ps( out + i, mask, _mm512_mul_ps( v, v ) );
+    }
+}
+
+// Each half of sixteen floats widens to eight doubles; the tail is left to the scalar loop.
+__attribute__(( target( "avx512f" ) ))
+double SumAVX512( const float * data, uint64_t n, bool squares )
+{
+    __m512d sum_low = _mm512_setzero_pd();
+    __m512d sum_high = _mm512_setzero_pd();
+    uint64_t i = 0;
+    for ( ; i + 16 <= n; i += 16 )
+    {
+        __m512d low = _mm512_cvtps_pd( _mm256_loadu_ps( data + i ) );
+        __m512d high = _mm512_cvtps_pd( _mm256_loadu_ps( data + i + 8 ) );
+        if ( squares )
+        {
+            low = _mm512_mul_pd( low, low );
+            high = _mm512_mul_pd( high, high );
+        }
+        sum_low = _mm512_add_pd( sum_low, low );
+        sum_high = _mm512_add_pd( sum_high, high );
+    }
+    return _mm512_reduce_add_pd( _mm512_add_pd( sum_low, sum_high ) ) + SumScalar( data + i, n - i, squares );
+}
+
+__attribute__(( target( "avx512f" ) ))
+float ExtremeAVX512( const float * data, uint64_t n, bool maximum )
+{
+    __m512 best = _mm512_set1_ps( maximum ? -INFINITY : INFINITY );
+    uint64_t i = 0;
+    for ( ; i + 16 <= n; i += 16 )
+    {
+        __m512 v = _mm512_loadu_ps( data + i );
+        best = maximum ? _mm512_max_ps( v, best ) : _mm512_min_ps( v, best );
+    }
+    float tail = ExtremeScalar( data + i, n - i, maximum );
+    float lanes = maximum ? _mm512_reduce_max_ps( best ) : _mm512_reduce_min_ps( best );
+    return maximum ? fmaxf( lanes, tail ) : fminf( lanes, tail );
+}
+
+// Narrowing tails are stored with a masked vpmovdw; AVX-512F has no masked 16-bit load, so widening tails use the scalar loop.
+__attribute__(( target( "avx512f" ) ))
+void ToHalfAVX512( uint16_t * out, const float * in, uint64_t n )
+{
+    uint64_t i = 0;
+    for ( ; i + 16 <= n; i += 16 )
+        _mm256_storeu_si256( (__m256i *)( out + i ), _mm512_cvtps_ph( _mm512_loadu_ps( in + i ), _MM_FROUND_TO_NEAREST_INT ) );
+    if ( i < n )
+    {
+        __mmask16 mask = TailMask( n - i );
+        __m256i halves = _mm512_cvtps_ph( _mm512_maskz_loadu_ps( mask, in + i ), _MM_FROUND_TO_NEAREST_INT );
+        _mm512_mask_cvtepi32_storeu_epi16( out + i, mask, _mm512_cvtepu16_epi32( halves ) );
+    }
+}
+
+__attribute__(( target( "avx512f" ) ))
+void FromHalfAVX512( float * out, const uint16_t * in, uint64_t n )
+{
+    uint64_t i = 0;
+    for ( ; i + 16 <= n; i += 16 )
+        _mm512_storeu_ps( out + i, _mm512_cvtph_ps( _mm256_loadu_si256( (const __m256i *)( in + i ) ) ) );
+    FromHalfScalar( out + i, in + i, n - i );
+}
+
+__attribute__(( target( "avx512f" ) ))
+inline __m512i RoundToBFloat16AVX512( __m512 v )
+{
+    __m512i bits = _mm512_castps_si512( v );
+    __m512i odd = _mm512_and_si512( _mm512_srli_epi32( bits, 16 ), _mm512_set1_epi32( 1 ) );
+    __m512i rounded = _mm512_srli_epi32( _mm512_add_epi32( bits, _mm512_add_epi32( odd, _mm512_set1_epi32( 0x7FFF ) ) ), 16 );
+    __m512i quiet = _mm512_or_si512( _mm512_srli_epi32( bits, 16 ), _mm512_set1_epi32( 0x0040 ) );
+    return _mm512_mask_blend_epi32( _mm512_cmp_ps_mask( v, v, _CMP_UNORD_Q ), rounded, quiet );
+}
+
+__attribute__(( target( "avx512f" ) ))
+void ToBFloat16AVX512( uint16_t * out, const float * in, uint64_t n )
+{
+    uint64_t i = 0;
+    for ( ; i + 16 <= n; i += 16 )
+        _mm256_storeu_si256( (__m256i *)( out + i ), _mm512_cvtepi32_epi16( RoundToBFloat16AVX512( _mm512_loadu_ps( in + i ) ) ) );
+    if ( i < n )
+    {
+        __mmask16 mask = TailMask( n - i );
+        _mm512_mask_cvtepi32_storeu_epi16( out + i, mask, RoundToBFloat16AVX512( _mm512_maskz_loadu_ps( mask, in + i ) ) );
+    }
+}
+
+__attribute__(( target( "avx512f" ) ))
+void FromBFloat16AVX512( float * out, const uint16_t * in, uint64_t n )
+{
+    uint64_t i = 0;
+    for ( ; i + 16 <= n; i += 16 )
+    {
+        __m512i wide = _mm512_cvtepu16_epi32( _mm256_loadu_si256( (const __m256i *)( in + i ) ) );
+        _mm512_storeu_ps( out + i, _mm512_castsi512_ps( _mm512_slli_epi32( wide, 16 ) ) );
+    }
+    FromBFloat16Scalar( out + i, in + i, n - i );
+}
+
+#endif /* HOST_KERNELS_X86 */
+
+
+#pragma mark Dispatch
+
+struct KernelSet
+{
+    HostISA isa;
+    void ( *accumulate )( float * a, const float * b, uint64_t n );
+    void ( *maxval )( float * a, const float * b, uint64_t n );
+    void ( *scaleaccum )( float * a, const float * b, float scale, uint64_t n );
+    void ( *sqr )( float * out, const float * in, uint64_t n );
+    double ( *sum )( const float * data, uint64_t n, bool squares );
+    float ( *extreme )( const float * data, uint64_t n, bool maximum );
+    void ( *to_half )( uint16_t * out, const float * in, uint64_t n );
+    void ( *from_half )( float * out, const uint16_t * in, uint64_t n );
+    void ( *to_bfloat16 )( uint16_t * out, const float * in, uint64_t n );
+    void ( *from_bfloat16 )( float * out, const uint16_t * in, uint64_t n );
+};
+
+
+/** The widest supported instruction set, lowered by MATLABMETAL_HOST_ISA if set */
+HostISA DetectISA()
+{
+    HostISA isa = HOST_ISA_SCALAR;
+#ifdef HOST_KERNELS_X86
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports( "avx512f" ) )
+        isa = HOST_ISA_AVX512;
+    else if ( __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "f16c" ) )
+        isa = HOST_ISA_AVX2;
+    else if ( __builtin_cpu_supports( "sse2" ) )
+        isa = HOST_ISA_SSE2;
+#endif
+
+    const char * limit = getenv( HOST_ISA_ENV_VARIABLE );
+    if ( limit )
+    {
+        for ( int level = HOST_ISA_SCALAR; level <= HOST_ISA_AVX512; level++ )
+        {
+            if ( std::string( limit ) == HostISANames[ level ] )
+                isa = std::min( isa, (HostISA)level );
+        }
+    }
+    return isa;
+}
+
+
+KernelSet SelectKernels()
+{
+    KernelSet kernels = { HOST_ISA_SCALAR, AccumulateScalar, MaxvalScalar, ScaleaccumScalar, SqrScalar, SumScalar, ExtremeScalar,
+                          ToHalfScalar, FromHalfScalar, ToBFloat16Scalar, FromBFloat16Scalar };
+#ifdef HOST_KERNELS_X86
+    switch ( DetectISA() )
+    {
+        case HOST_ISA_AVX512:
+            kernels = { HOST_ISA_AVX512, AccumulateAVX512, MaxvalAVX512, ScaleaccumAVX512, SqrAVX512, SumAVX512, ExtremeAVX512,
+                        ToHalfAVX512, FromHalfAVX512, ToBFloat16AVX512, FromBFloat16AVX512 };
+            break;
+        case HOST_ISA_AVX2:
+            kernels = { HOST_ISA_AVX2, AccumulateAVX2, MaxvalAVX2, ScaleaccumAVX2, SqrAVX2, SumAVX2, ExtremeAVX2,
+                        ToHalfAVX2, FromHalfAVX2, ToBFloat16AVX2, FromBFloat16AVX2 };
+            break;
+        case HOST_ISA_SSE2:
+            kernels = { HOST_ISA_SSE2, AccumulateSSE2, MaxvalSSE2, ScaleaccumSSE2, SqrSSE2, SumSSE2, ExtremeSSE2,
+                        ToHalfScalar, FromHalfScalar, ToBFloat16SSE2, FromBFloat16SSE2 };
+            break;
+        case HOST_ISA_SCALAR:
+            break;
+    }
+#endif
+    return kernels;
+}
+
+
+const KernelSet & Kernels()
+{
+    static const KernelSet kernels = SelectKernels();
+    return kernels;
+}
+
+
+/** Number of elements of a size in a bound buffer, so a grid larger than a buffer stops at its end */
+uint64_t BufferElements( const mtlHostKernelArgs * args, uint32_t index, uint64_t element_size )
+{
+    if ( index >= args->num_buffers || !args->buffers[ index ] )
+        return 0;
+    return args->buffer_lengths[ index ] / element_size;
+}
+
+
+uint64_t BufferFloats( const mtlHostKernelArgs * args, uint32_t index )
+{
+    return BufferElements( args, index, sizeof( float ) );
+}
+
+
+void Unpack( uint32_t format, float * out, const uint16_t * in, uint64_t n )
+{
+    if ( format == MTL_FORMAT_HALF )
+        Kernels().from_half( out, in, n );
+    else
+        Kernels().from_bfloat16( out, in, n );
+}
+
+
+/** Widen n half or bfloat16 values a tile at a time, calling apply( offset, floats, count ) on each tile */
+template <typename Apply>
+void ForUnpacked( uint32_t format, const uint16_t * in, uint64_t n, Apply apply )
+{
+    float tile[ UNPACK_TILE ];
+    for ( uint64_t i = 0; i < n; i += UNPACK_TILE )
+    {
+        uint64_t count = std::min<uint64_t>( UNPACK_TILE, n - i );
+        Unpack( format, tile, in + i, count );
+        apply( i, tile, count );
+    }
+}
+
+
+#pragma mark Kernels
+
+void HostZerobuff( const mtlHostKernelArgs * args, uint64_t first_thread, uint64_t last_thread )
+{
+    // memset already picks the fastest stores for the processor
+    last_thread = std::min( last_thread, BufferFloats( args, 0 ) );
+    if ( first_thread < last_thread )
+        memset( (float *)args->buffers[0] + first_thread, 0, ( last_thread - first_thread ) * sizeof( float ) );
+}
+
+
+void HostAccumulate( const mtlHostKernelArgs * args, uint64_t first_thread, uint64_t last_thread )
+{
+    last_thread = std::min( { last_thread, BufferFloats( args, 0 ), BufferFloats( args, 1 ) } );
+    if ( first_thread < last_thread )
+        Kernels().accumulate( (float *)args->buffers[0] + first_thread, (const float *)args->buffers[1] + first_thread,
+                              last_thread - first_thread );
+}
+
+
+void HostMaxval( const mtlHostKernelArgs * args, uint64_t first_thread, uint64_t last_thread )
+{
+    last_thread = std::min( { last_thread, BufferFloats( args, 0 ), BufferFloats( args, 1 ) } );
+    if ( first_thread < last_thread )
+        Kernels().maxval( (float *)args->buffers[0] + first_thread, (const float *)args->buffers[1] + first_thread,
+                          last_thread - first_thread );
+}
+
+
+void HostScaleaccum( const mtlHostKernelArgs * args, uint64_t first_thread, uint64_t last_thread )
+{
+    if ( BufferFloats( args, 2 ) == 0 )
+        return;
+    last_thread = std::min( { last_thread, BufferFloats( args, 0 ), BufferFloats( args, 1 ) } );
+    if ( first_thread < last_thread )
+        Kernels().scaleaccum( (float *)args->buffers[0] + first_thread, (const float *)args->buffers[1] + first_thread,
+                              *(const float *)args->buffers[2], last_thread - first_thread );
+}
+
+
+void HostSqr( const mtlHostKernelArgs * args, uint64_t first_thread, uint64_t last_thread )
+{
+    last_thread = std::min( { last_thread, BufferFloats( args, 0 ), BufferFloats( args, 1 ) } );
+    if ( first_thread < last_thread )
+        Kernels().sqr( (float *)args->buffers[1] + first_thread, (const float *)args->buffers[0] + first_thread,
+                       last_thread - first_thread );
+}
+
+
+// The reduced-precision variants read buffer 1 as half or bfloat16 and accumulate into the floats of buffer 0.
+
+template <uint32_t format>
+void HostAccumulateReduced( const mtlHostKernelArgs * args, uint64_t first_thread, uint64_t last_thread )
+{
+    last_thread = std::min( { last_thread, BufferFloats( args, 0 ), BufferElements( args, 1, sizeof( uint16_t ) ) } );
+    if ( first_thread >= last_thread )
+        return;
+    float * a = (float *)args->buffers[0] + first_thread;
+    ForUnpacked( format, (const uint16_t *)args->buffers[1] + first_thread, last_thread - first_thread,
+                 [ a ]( uint64_t offset, const float * b, uint64_t n ) { Kernels().accumulate( a + offset, b, n ); } );
+}
+
+
+template <uint32_t format>
+void HostMaxvalReduced( const mtlHostKernelArgs * args, uint64_t first_thread, uint64_t last_thread )
+{
+    last_thread = std::min( { last_thread, BufferFloats( args, 0 ), BufferElements( args, 1, sizeof( uint16_t ) ) } );
+    if ( first_thread >= last_thread )
+        return;
+    float * a = (float *)args->buffers[0] + first_thread;
+    ForUnpacked( format, (const uint16_t *)args->buffers[1] + first_thread, last_thread - first_thread,
+                 [ a ]( uint64_t offset, const float * b, uint64_t n ) { Kernels().maxval( a + offset, b, n ); } );
+}
+
+
+template <uint32_t format>
+void HostScaleaccumReduced( const mtlHostKernelArgs * args, uint64_t first_thread, uint64_t last_thread )
+{
+    if ( BufferFloats( args, 2 ) == 0 )
+        return;
+    last_thread = std::min( { last_thread, BufferFloats( args, 0 ), BufferElements( args, 1, sizeof( uint16_t ) ) } );
+    if ( first_thread >= last_thread )
+        return;
+    float * a = (float *)args->buffers[0] + first_thread;
+    const float scale = *(const float *)args->buffers[2];
+    ForUnpacked( format, (const uint16_t *)args->buffers[1] + first_thread, last_thread - first_thread,
+                 [ a, scale ]( uint64_t offset, const float * b, uint64_t n ) { Kernels().scaleaccum( a + offset, b, scale, n ); } );
+}
+
+
+const mtlBuiltinHostKernel BuiltinKernels[] = {
+    { "zerobuff", HostZerobuff },
+    { "accumulate", HostAccumulate },
+    { "maxval", HostMaxval },
+    { "scaleaccum", HostScaleaccum },
+    { "accumulate_half", HostAccumulateReduced<MTL_FORMAT_HALF> },
+    { "maxval_half", HostMaxvalReduced<MTL_FORMAT_HALF> },
+    { "scaleaccum_half", HostScaleaccumReduced<MTL_FORMAT_HALF> },
+    { "accumulate_bfloat16", HostAccumulateReduced<MTL_FORMAT_BFLOAT16> },
+    { "maxval_bfloat16", HostMaxvalReduced<MTL_FORMAT_BFLOAT16> },
+    { "scaleaccum_bfloat16", HostScaleaccumReduced<MTL_FORMAT_BFLOAT16> },
+    { "sqr", HostSqr },
+};
+
+} // namespace
+
+
+const mtlBuiltinHostKernel * mtlBuiltinHostKernels( uint32_t * count )
+{
+    *count = (uint32_t)( sizeof( BuiltinKernels ) / sizeof( BuiltinKernels[0] ) );
+    return BuiltinKernels;
+}
+
+
+const char * mtlBuiltinHostKernelISA( void )
+{
+    return HostISANames[ Kernels().isa ];
+}
+
+
+void mtlHostPackFloats( uint32_t format, void * destination, const float * source, uint64_t count )
+{
+    switch ( format )
+    {
+        case MTL_FORMAT_HALF:
+            Kernels().to_half( (uint16_t *)destination, source, count );
+            break;
+        case MTL_FORMAT_BFLOAT16:
+            Kernels().to_bfloat16( (uint16_t *)destination, source, count );
+            break;
+        default:
+            memcpy( destination, source, count * sizeof( float ) );
+            break;
+    }
+}
+
+
+void mtlHostUnpackFloats( uint32_t format, float * destination, const void * source, uint64_t count )
+{
+    if ( format == MTL_FORMAT_HALF || format == MTL_FORMAT_BFLOAT16 )
+        Unpack( format, destination, (const uint16_t *)source, count );
+    else
+        memcpy( destination, source, count * sizeof( float ) );
+}
+
+
+void mtlHostReduceRange( uint32_t operation, const float * data, uint64_t count, uint64_t first_index, mtlReduction * reduction )
+{
+    if ( count == 0 )
+        return;
+    if ( mtlReduceIsSum( operation ) )
+    {
+        mtlReduceCombine( operation, reduction, Kernels().sum( data, count, operation == MTL_REDUCE_NORM ), first_index );
+        return;
+    }
+
+    // The extreme value first, then the first element holding it, which is absent if all are NaN
+    float best = Kernels().extreme( data, count, !mtlReduceIsMin( operation ) );
+    for ( uint64_t i = 0; i < count; i++ )
+    {
+        if ( data[ i ] == best )
+        {
+            mtlReduceCombine( operation, reduction, best, first_index + i );
+            return;
+        }
+    }
+}
+
+
+void mtlHostReduceDimension( const mtlHostKernelArgs * args, uint64_t first_thread, uint64_t last_thread )
+{
+    if ( args->num_buffers < 3 || !args->buffers[2] || args->buffer_lengths[2] < sizeof( mtlReduceParams ) )
+        return;
+    const mtlReduceParams params = *(const mtlReduceParams *)args->buffers[2];
+    uint64_t outputs = params.inner * params.outer;
+    if ( BufferFloats( args, 0 ) < outputs * params.length )
+        return;
+    last_thread = std::min( { last_thread, outputs, BufferFloats( args, 1 ) } );
+
+    const float * source = (const float *)args->buffers[0];
+    float * values = (float *)args->buffers[1];
+    uint32_t * indices = (uint32_t *)args->buffers[1];
+    std::vector<mtlReduction> results;
+    std::vector<double> sums;
+    for ( uint64_t first = first_thread; first < last_thread; )
+    {
+        // The outputs of one outer slice; the slice is length rows of inner contiguous floats
+        uint64_t outer = first / params.inner;
+        uint64_t last = std::min( last_thread, ( outer + 1 ) * params.inner );
+        uint64_t count = last - first;
+        const float * slice = source + outer * params.length * params.inner + ( first - outer * params.inner );
+
+        results.resize( count );
+        for ( mtlReduction & result : results )
+            mtlReduceInit( params.operation, &result );
+        if ( params.inner == 1 )
+            mtlHostReduceRange( params.operation, slice, params.length, 0, &results[0] );
+        else if ( mtlReduceIsSum( params.operation ) )
+        {
+            bool squares = params.operation == MTL_REDUCE_NORM;
+            sums.assign( count, 0.0 );
+            for ( uint64_t k = 0; k < params.length; k++ )
+            {
+                const float * row = slice + k * params.inner;
+                for ( uint64_t j = 0; j < count; j++ )
+                    sums[ j ] += squares ? (double)row[ j ] * row[ j ] : (double)row[ j ];
+            }
+            for ( uint64_t j = 0; j < count; j++ )
+                results[ j ].value = sums[ j ];
+        }
+        else
+        {
+            for ( uint64_t k = 0; k < params.length; k++ )
+            {
+                const float * row = slice + k * params.inner;
+                for ( uint64_t j = 0; j < count; j++ )
+                    mtlReduceCombine( params.operation, &results[ j ], row[ j ], k );
+            }
+        }
+
+        for ( uint64_t j = 0; j < count; j++ )
+        {
+            mtlReduceFinish( params.operation, &results[ j ], params.length );
+            if ( mtlReduceIsArg( params.operation ) )
+                indices[ first + j ] = (uint32_t)results[ j ].index;
+            else
+                values[ first + j ] = (float)results[ j ].value;
+        }
+        first = last;
+    }
+}
+
+
+void mtlHostElementwise( const mtlHostKernelArgs * args, uint64_t first_thread, uint64_t last_thread )
+{
+    if ( args->num_buffers < 2 )
+        return;
+    uint32_t program_index = args->num_buffers - 1;
+    if ( !args->buffers[ program_index ] || args->buffer_lengths[ program_index ] < sizeof( mtlElementwiseProgram ) )
+        return;
+    const mtlElementwiseProgram & program = *(const mtlElementwiseProgram *)args->buffers[ program_index ];
+    if ( program.num_inputs + 2 != args->num_buffers )
+        return;
+
+    last_thread = std::min( last_thread, BufferFloats( args, 0 ) );
+    for ( uint32_t i = 0; i < program.num_inputs; i++ )
+        last_thread = std::min( last_thread, BufferFloats( args, i + 1 ) );
+    float * output = (float *)args->buffers[0];
+
+    // Each operation runs over a whole tile, so the loops are plain vectorizable array arithmetic
+    float stack[ MTL_ELEMENTWISE_MAX_STACK ][ ELEMENTWISE_TILE ];
+    for ( uint64_t base = first_thread; base < last_thread; base += ELEMENTWISE_TILE )
+    {
+        uint64_t n = std::min<uint64_t>( ELEMENTWISE_TILE, last_thread - base );
+        int top = -1;
+        for ( uint32_t p = 0; p < program.length; p++ )
+        {
+            const mtlElementwiseOp & op = program.ops[ p ];
+            float * a = stack[ std::max( top - 1, 0 ) ];
+            const float * b = stack[ std::max( top, 0 ) ];
+            switch ( op.opcode )
+            {
+                case MTL_ELEMENTWISE_INPUT:
+                    top++;
+                    memcpy( stack[ top ], (const float *)args->buffers[ op.operand + 1 ] + base, n * sizeof( float ) );
+                    break;
+                case MTL_ELEMENTWISE_CONSTANT:
+                    top++;
+                    std::fill( stack[ top ], stack[ top ] + n, program.constants[ op.operand ] );
+                    break;
+                case MTL_ELEMENTWISE_ADD:
+                    for ( uint64_t i = 0; i < n; i++ )
+                        a[ i ] += b[ i ];
+                    top--;
+                    break;
+                case MTL_ELEMENTWISE_SUBTRACT:
+                    for ( uint64_t i = 0; i < n; i++ )
+                        a[ i ] -= b[ i ];
+                    top--;
+                    break;
+                case MTL_ELEMENTWISE_MULTIPLY:
+                    for ( uint64_t i = 0; i < n; i++ )
+                        a[ i ] *= b[ i ];
+                    top--;
+                    break;
+                case MTL_ELEMENTWISE_DIVIDE:
+                    for ( uint64_t i = 0; i < n; i++ )
+                        a[ i ] /= b[ i ];
+                    top--;
+                    break;
+                case MTL_ELEMENTWISE_MAX:
+                    for ( uint64_t i = 0; i < n; i++ )
+                        a[ i ] = fmaxf( a[ i ], b[ i ] );
+                    top--;
+                    break;
+                case MTL_ELEMENTWISE_MIN:
+                    for ( uint64_t i = 0; i < n; i++ )
+                        a[ i ] = fminf( a[ i ], b[ i ] );
+                    top--;
+                    break;
+                case MTL_ELEMENTWISE_NEGATE:
+                    for ( uint64_t i = 0; i < n; i++ )
+                        stack[ top ][ i ] = -stack[ top ][ i ];
+                    break;
+                case MTL_ELEMENTWISE_ABS:
+                    for ( uint64_t i = 0; i < n; i++ )
+                        stack[ top ][ i ] = fabsf( stack[ top ][ i ] );
+                    break;
+            }
+        }
+        memcpy( output + base, stack[0], n * sizeof( float ) );
+    }
+}
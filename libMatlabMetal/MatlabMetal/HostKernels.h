@@ -0,0 +1,77 @@
+//
+//  HostKernels.h
+//  MatlabMetal
+//
+//  Built-in host kernels of the CPU backend (MatlabMetal.cpp), implementing
+//  the kernels of MetalFunctionLibrary.mtl, the test sqr kernel, the
+//  buffer reductions, fused element-wise programs and float format
+//  conversions.
+//
+
+#ifndef HostKernels_h
+#define HostKernels_h
+
+#include "MatlabMetal.h"
+#include "Reduction.h"
+#include "Elementwise.h"
+#include "FloatFormat.h"
+
+#define HOST_ISA_ENV_VARIABLE "MATLABMETAL_HOST_ISA"
+
+
+typedef struct {
+    const char * name;
+    mtlHostKernel kernel;
+} mtlBuiltinHostKernel;
+
+
+/**
+ * The built-in host kernels, available without mtlRegisterHostKernel.
+ * They use the widest of SSE2, AVX2 and AVX-512 the processor supports,
+ * which the MATLABMETAL_HOST_ISA environment variable (scalar, sse2, avx2
+ * or avx512) can lower.
+ * @param count Receives the number of kernels
+ * @return The kernels, valid for the lifetime of the process
+ */
+const mtlBuiltinHostKernel * mtlBuiltinHostKernels( uint32_t * count );
+
+
+/** Name of the instruction set the built-in host kernels use */
+const char * mtlBuiltinHostKernelISA( void );
+
+
+/**
+ * Convert count floats to an MTL_FORMAT_ element format, with the instruction
+ * set of the built-in kernels. MTL_FORMAT_FLOAT copies.
+ */
+void mtlHostPackFloats( uint32_t format, void * destination, const float * source, uint64_t count );
+
+
+/** Convert count elements of an MTL_FORMAT_ element format to floats */
+void mtlHostUnpackFloats( uint32_t format, float * destination, const void * source, uint64_t count );
+
+
+/**
+ * Combine count floats into a reduction, with the instruction set of the
+ * built-in kernels. The first float has element index first_index.
+ */
+void mtlHostReduceRange( uint32_t operation, const float * data, uint64_t count, uint64_t first_index, mtlReduction * reduction );
+
+
+/**
+ * Host kernel of mtlEncodeReduceDimension, one thread per output. Buffer 0
+ * holds the source, buffer 1 receives the results and buffer 2 holds the
+ * mtlReduceParams.
+ */
+void mtlHostReduceDimension( const mtlHostKernelArgs * args, uint64_t first_thread, uint64_t last_thread );
+
+
+/**
+ * Host kernel of mtlEncodeElementwise, one thread per element. Buffer 0
+ * receives the results, the inputs follow and the last buffer holds the
+ * checked mtlElementwiseProgram.
+ */
+void mtlHostElementwise( const mtlHostKernelArgs * args, uint64_t first_thread, uint64_t last_thread );
+
+
+#endif /* HostKernels_h */
@@ -0,0 +1,45 @@
+//
+//  LibraryCache.h
+//  MatlabMetal
+//
+//  Keys for the compiled-library cache, shared by the Metal and CPU backends.
+//
+
+#ifndef LibraryCache_h
+#define LibraryCache_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LIBRARY_CACHE_ENV_VARIABLE "MATLABMETAL_LIBRARY_CACHE"
+#define LIBRARY_CACHE_KEY_LENGTH 64
+
+
+/** 64-bit FNV-1a hash of a library source */
+static inline uint64_t mtlHashLibrarySource( const char * source, size_t length )
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for ( size_t i = 0; i < length; i++ )
+    {
+        hash ^= (uint8_t)source[ i ];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+
+/**
+ * Device-independent part of a cache key, also used as the base name of the
+ * on-disk artifact. The source length guards against hash collisions.
+ */
+static inline void mtlLibraryCacheKey( char key[ LIBRARY_CACHE_KEY_LENGTH ], const char * source, uint32_t compile_options )
+{
+    size_t length = strlen( source );
+    snprintf( key, LIBRARY_CACHE_KEY_LENGTH, "%016llx-%llx-%x",
+              (unsigned long long)mtlHashLibrarySource( source, length ),
+              (unsigned long long)length, compile_options );
+}
+
+
+#endif /* LibraryCache_h */
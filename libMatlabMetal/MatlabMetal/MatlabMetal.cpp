@@ -1,376 +1,4396 @@
+//
+//  MatlabMetal.cpp
+//  MatlabMetal
+//
+//  CPU backend for Linux, which has no Metal support. The machine is exposed
+//  as a "CPU device" per NUMA node, buffers live in host memory on the node,
+//  and dispatches run registered host kernels (see mtlRegisterHostKernel)
+//  over a worker thread pool pinned to the node's cores. The kernels of
+//  MetalFunctionLibrary.mtl are built in (see HostKernels.cpp).
+//
+
 #include "MatlabMetal.h"
+#include "HandleTable.h"
+#include "BufferRegion.h"
+#include "LibraryCache.h"
+#include "ThreadgroupSize.h"
+#include "HostKernels.h"
+#include "Profiling.h"
+#include "Streaming.h"
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+#define HOST_BUFFER_ALIGNMENT 4096
+#define HOST_THREAD_EXECUTION_WIDTH 32
+// A threadgroup is the tile of threads a worker runs in one go, so it may be far larger than on a GPU
+#define HOST_MAX_THREADS_PER_THREADGROUP ( 1 << 16 )
+#define HOST_MIN_DISPATCH_CHUNK 4096
+// Floats per partial result of a deterministic reduction, whatever the number of threads
+#define HOST_REDUCE_BLOCK ( 1 << 16 )
+#define HOST_PARALLEL_COPY_THRESHOLD ( (uint64_t)4 << 20 )
+#define HOST_REGISTRY_ID_BASE ( (uint64_t)0x435055000000 )
+#define HOST_MAX_NUMA_NODES 1024
+#define HOST_MPOL_PREFERRED 1
+// Smaller buffers come from the heap, where binding them would split its mapping, so they stay where it puts them
+#define HOST_NUMA_BIND_MIN_BYTES ( (uint64_t)1 << 20 )
+// Wrapped caller memory only needs malloc's alignment, since host kernels load and store unaligned
+#define HOST_POINTER_ALIGNMENT 16
+// Start of a file buffer read ahead when it is mapped; the rest is read as kernels reach it
+#define HOST_FILE_PREFETCH_BYTES ( (uint64_t)64 << 20 )
+#define HOST_LIBRARY_ARTIFACT_HEADER "MatlabMetal CPU library 1"
+
+
+namespace {
+
+std::mutex ErrorMutex;
+std::string ErrorString;
+
+void mtlStoreError( const std::string & error_message )
+{
+    std::lock_guard<std::mutex> lock( ErrorMutex );
+    ErrorString = error_message;
+}
+
+
+#pragma mark Thread Pool
+
+/** Restrict the calling thread to the given CPUs, or leave it unrestricted if there are none */
+void PinCurrentThread( const std::vector<int> & cpus )
+{
+    if ( cpus.empty() )
+        return;
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    for ( int cpu : cpus )
+    {
+        if ( cpu >= 0 && cpu < CPU_SETSIZE )
+            CPU_SET( cpu, &set );
+    }
+    pthread_setaffinity_np( pthread_self(), sizeof( set ), &set );
+}
 
-/* This file is a stub for Linux, which has no Metal support.  */
 
-#pragma mark Error Handling
 /**
- * Return a pointer to the text of the most recent error.
- *  @param error Allocated char buffer to receive the error message
- *  @param buffer_length Size of the allocated error buffer
+ * A fixed set of worker threads executing queued tasks. Threads waiting in
+ * ParallelFor run queued tasks themselves, so nested use cannot deadlock.
  */
-void mtlGetLastError( char * error, int buffer_length ){}
+class ThreadPool
+{
+public:
+    /** Start num_threads workers, each pinned to cpus if any are given */
+    ThreadPool( unsigned int num_threads, const std::vector<int> & cpus ) : stopping( false )
+    {
+        for ( unsigned int i = 0; i < num_threads; i++ )
+        {
+            workers.emplace_back( [ this, cpus ]() {
+                PinCurrentThread( cpus );
+                WorkerLoop();
+            } );
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            stopping = true;
+        }
+        task_available.notify_all();
+        for ( auto & worker : workers )
+            worker.join();
+    }
+
+    unsigned int Size() const
+    {
+        return (unsigned int)workers.size();
+    }
+
+    /**
+     * Run body over [ 0, count ) in chunks of at most grain items, using the
+     * calling thread and the workers. Returns once every chunk has completed.
+     */
+    void ParallelFor( uint64_t count, uint64_t grain, const std::function<void( uint64_t, uint64_t )> & body )
+    {
+        if ( count == 0 )
+            return;
+        grain = std::max<uint64_t>( grain, 1 );
+        uint64_t num_chunks = ( count + grain - 1 ) / grain;
+        if ( num_chunks == 1 || workers.empty() )
+        {
+            body( 0, count );
+            return;
+        }
+
+        std::atomic<uint64_t> next_chunk( 0 );
+        auto run_chunks = [ & ]() {
+            for ( uint64_t chunk = next_chunk++; chunk < num_chunks; chunk = next_chunk++ )
+                body( chunk * grain, std::min( count, ( chunk + 1 ) * grain ) );
+        };
+
+        unsigned int num_helpers = (unsigned int)std::min<uint64_t>( num_chunks - 1, workers.size() );
+        unsigned int outstanding = num_helpers;
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            for ( unsigned int i = 0; i < num_helpers; i++ )
+            {
+                tasks.emplace_back( [ &, this ]() {
+                    run_chunks();
+                    std::lock_guard<std::mutex> done_lock( mutex );
+                    outstanding--;
+                    task_done.notify_all();
+                } );
+            }
+        }
+        task_available.notify_all();
+
+        run_chunks();
+
+        std::unique_lock<std::mutex> lock( mutex );
+        while ( outstanding > 0 )
+        {
+            if ( !RunQueuedTask( lock ) )
+                task_done.wait( lock );
+        }
+    }
+
+private:
+    /** Pop and run one queued task with the lock released. Returns false if the queue was empty. */
+    bool RunQueuedTask( std::unique_lock<std::mutex> & lock )
+    {
+        if ( tasks.empty() )
+            return false;
+        std::function<void()> task = std::move( tasks.front() );
+        tasks.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+        return true;
+    }
+
+    void WorkerLoop()
+    {
+        std::unique_lock<std::mutex> lock( mutex );
+        while ( true )
+        {
+            if ( RunQueuedTask( lock ) )
+                continue;
+            if ( stopping )
+                return;
+            task_available.wait( lock );
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable task_available;
+    std::condition_variable task_done;
+    bool stopping;
+};
 
 
-#pragma mark Devices
 /**
- * Get the number of installed Metal devices
- * @return The number of devices
- **/
-unsigned int mtlNumberOfDevices( void )
+ * A single thread running the work committed to a device. Each task belongs
+ * to a queue and runs once the tasks submitted before it on that queue have
+ * finished, so a queue stopped waiting for an event never holds up another.
+ * A task may stop partway by returning false, and is run again after the
+ * next Poke. Runnable tasks go in submission order, so tasks that never stop
+ * run exactly in that order. Tasks that can still make progress when the
+ * scheduler is destroyed are run first.
+ */
+class CommandScheduler
+{
+public:
+    explicit CommandScheduler( const std::vector<int> & cpus ) : stopping( false ), pokes( 0 ), thread( [ this, cpus ]() {
+        PinCurrentThread( cpus );
+        Loop();
+    } ) {}
+
+    ~CommandScheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            stopping = true;
+        }
+        task_available.notify_one();
+        // The last reference to the owner may be dropped by a task on this very thread.
+        if ( thread.get_id() == std::this_thread::get_id() )
+            thread.detach();
+        else
+            thread.join();
+    }
+
+    /** Queue a task, which returns true once it has finished */
+    void Submit( const void * queue, std::function<bool()> task )
+    {
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            tasks.push_back( { queue, std::move( task ) } );
+            pokes++;
+        }
+        task_available.notify_one();
+    }
+
+    /** Run stopped tasks again, as what they wait for may have changed */
+    void Poke()
+    {
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            pokes++;
+        }
+        task_available.notify_one();
+    }
+
+private:
+    struct Task
+    {
+        const void * queue;
+        std::function<bool()> run;
+    };
+
+    void Loop()
+    {
+        std::unique_lock<std::mutex> lock( mutex );
+        while ( true )
+        {
+            uint64_t seen = pokes;
+            std::function<bool()> finished;
+            std::set<const void *> busy_queues;
+            // Tasks are only removed here, and list iterators survive Submit, so the lock can be dropped while one runs.
+            for ( auto it = tasks.begin(); it != tasks.end(); ++it )
+            {
+                if ( !busy_queues.insert( it->queue ).second )
+                    continue;
+                lock.unlock();
+                bool done = it->run();
+                lock.lock();
+                if ( done )
+                {
+                    finished = std::move( it->run );
+                    tasks.erase( it );
+                    break;
+                }
+            }
+            if ( finished )
+            {
+                lock.unlock();
+                finished = nullptr;
+                lock.lock();
+                continue;
+            }
+            if ( stopping )
+                return;
+            if ( pokes == seen )
+                task_available.wait( lock );
+        }
+    }
+
+    std::list<Task> tasks;
+    std::mutex mutex;
+    std::condition_variable task_available;
+    bool stopping;
+    uint64_t pokes;
+    std::thread thread;
+};
+
+
+#pragma mark Backend Objects
+
+/**
+ * Recycled buffer storage of a device, kept in free lists by size class.
+ * Storage stays reserved (and counted as allocated on the device) until it
+ * is trimmed.
+ */
+struct BufferPool
+{
+    std::mutex mutex;
+    std::unordered_map<uint64_t, std::vector<void *>> free_lists;
+    uint64_t reserved_bytes;
+    uint64_t in_use_bytes;
+    uint64_t hits;
+    uint64_t misses;
+
+    BufferPool() : reserved_bytes( 0 ), in_use_bytes( 0 ), hits( 0 ), misses( 0 ) {}
+
+    ~BufferPool()
+    {
+        for ( auto & free_list : free_lists )
+            for ( void * contents : free_list.second )
+                free( contents );
+    }
+
+    /** Storage size for a request: four classes per power of two, so at most a quarter is unused */
+    static uint64_t SizeClass( uint64_t bytes )
+    {
+        uint64_t power = HOST_BUFFER_ALIGNMENT;
+        while ( power < bytes / 2 )
+            power *= 2;
+        uint64_t step = std::max<uint64_t>( power / 4, HOST_BUFFER_ALIGNMENT );
+        if ( bytes > UINT64_MAX - step )
+            return bytes;
+        return std::max<uint64_t>( ( bytes + step - 1 ) / step * step, HOST_BUFFER_ALIGNMENT );
+    }
+
+    /** Take idle storage of a size class, or return nullptr if there is none */
+    void * Acquire( uint64_t capacity )
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        auto free_list = free_lists.find( capacity );
+        if ( free_list == free_lists.end() || free_list->second.empty() )
+        {
+            misses++;
+            return nullptr;
+        }
+        void * contents = free_list->second.back();
+        free_list->second.pop_back();
+        hits++;
+        in_use_bytes += capacity;
+        return contents;
+    }
+
+    /** Account for newly allocated storage handed out by the pool */
+    void Reserve( uint64_t capacity )
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        reserved_bytes += capacity;
+        in_use_bytes += capacity;
+    }
+
+    void Release( void * contents, uint64_t capacity )
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        free_lists[ capacity ].push_back( contents );
+        in_use_bytes -= capacity;
+    }
+
+    /** Free idle storage until at most max_idle_bytes remain idle. Returns the number of bytes freed. */
+    uint64_t Trim( uint64_t max_idle_bytes )
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        uint64_t freed = 0;
+        for ( auto free_list = free_lists.begin(); free_list != free_lists.end(); )
+        {
+            while ( !free_list->second.empty() && reserved_bytes - in_use_bytes > max_idle_bytes )
+            {
+                free( free_list->second.back() );
+                free_list->second.pop_back();
+                reserved_bytes -= free_list->first;
+                freed += free_list->first;
+            }
+            if ( free_list->second.empty() )
+                free_list = free_lists.erase( free_list );
+            else
+                ++free_list;
+        }
+        return freed;
+    }
+};
+
+
+struct CPUDevice
+{
+    std::string name;
+    uint64_t registry_id;
+    uint64_t working_set_size;
+    uint32_t numa_node;
+    // The cores the device's threads are pinned to; empty if they may run anywhere
+    std::vector<int> cpus;
+    // Whether buffer memory is bound to numa_node, which only exists on a NUMA machine
+    bool bind_memory;
+    std::atomic<int64_t> allocated_bytes;
+    BufferPool buffer_pool;
+    std::unique_ptr<ThreadPool> pool;
+    // Committed command buffers run here, in commit order unless one waits for an event
+    std::unique_ptr<CommandScheduler> command_scheduler;
+
+    CPUDevice() : registry_id( 0 ), working_set_size( 0 ), numa_node( 0 ), bind_memory( false ), allocated_bytes( 0 ) {}
+};
+
+
+struct CPULibrary
+{
+    std::shared_ptr<CPUDevice> device;
+    std::set<std::string> kernel_names;
+};
+
+
+struct CPUFunction
+{
+    std::shared_ptr<CPULibrary> library;
+    std::string name;
+    mtlHostKernel kernel;
+};
+
+
+typedef std::array<uint32_t, 3> ThreadgroupShape;
+typedef std::array<uint32_t, 3> GridSize;
+
+struct CPUComputePipelineState
+{
+    std::shared_ptr<CPUDevice> device;
+    std::shared_ptr<CPUFunction> function;
+    // Threadgroup sizes found by mtlAutotuneThreadgroupSize, by grid shape
+    std::mutex tuned_mutex;
+    std::map<ThreadgroupShape, ThreadgroupShape> tuned_threadgroups;
+};
+
+
+struct CPUCommandQueue
+{
+    std::shared_ptr<CPUDevice> device;
+};
+
+
+struct CPUBuffer
+{
+    std::shared_ptr<CPUDevice> device;
+    void * contents;
+    uint64_t length;
+    // Size of the storage if it came from the device's buffer pool, zero otherwise
+    uint64_t pooled_capacity;
+    // Releases storage the buffer does not own (a file mapping or caller memory), empty otherwise
+    std::function<void()> release;
+    // Mapped from a file with MTL_FILE_READ_ONLY, so the host and kernels may only read it
+    bool read_only;
+    std::atomic<uint32_t> map_count;
+
+    CPUBuffer() : contents( nullptr ), length( 0 ), pooled_capacity( 0 ), read_only( false ), map_count( 0 ) {}
+
+    ~CPUBuffer()
+    {
+        if ( release )
+        {
+            release();
+            return;
+        }
+        if ( pooled_capacity )
+        {
+            device->buffer_pool.Release( contents, pooled_capacity );
+            return;
+        }
+        free( contents );
+        if ( device )
+            device->allocated_bytes -= (int64_t)length;
+    }
+};
+
+
+struct CPUDispatch
+{
+    std::shared_ptr<CPUComputePipelineState> compute_pipeline_state;
+    std::vector<std::shared_ptr<CPUBuffer>> buffers;
+    // Nonzero for each buffer the kernel only reads; buffers past the end are also written
+    std::vector<uint8_t> read_only;
+    // Consecutive dispatches of the same concurrent encoder share a nonzero group
+    uint64_t concurrent_group = 0;
+    // Zero for an indirect dispatch, whose grid is only known when it runs
+    uint32_t width, height, depth;
+    // Zero for the default chunking of the wave
+    ThreadgroupShape threadgroup = { { 0, 0, 0 } };
+    // For an indirect dispatch, the buffer holding its mtlDispatchIndirectArguments
+    std::shared_ptr<CPUBuffer> indirect_buffer;
+    uint64_t indirect_offset = 0;
+    // Profile time at which it was encoded, zero when not profiling
+    double encode_time = 0;
+
+    bool ReadsOnly( size_t i ) const
+    {
+        return ( i < read_only.size() && read_only[ i ] ) || ( buffers[ i ] && buffers[ i ]->read_only );
+    }
+
+    // The buffers it uses for scheduling: those bound, then the indirect arguments, which are only read
+    size_t NumUses() const
+    {
+        return buffers.size() + ( indirect_buffer ? 1 : 0 );
+    }
+
+    const CPUBuffer * Use( size_t i ) const
+    {
+        return i < buffers.size() ? buffers[ i ].get() : indirect_buffer.get();
+    }
+
+    bool UseReadsOnly( size_t i ) const
+    {
+        return i >= buffers.size() || ReadsOnly( i );
+    }
+
+    /**
+     * Get the grid in threads; an indirect dispatch reads its threadgroup counts now.
+     * Returns false if a dimension of an indirect grid exceeds UINT32_MAX threads.
+     */
+    bool Grid( GridSize & grid ) const
+    {
+        if ( !indirect_buffer )
+        {
+            grid = { { width, height, depth } };
+            return true;
+        }
+        mtlDispatchIndirectArguments arguments;
+        memcpy( &arguments, (const uint8_t *)indirect_buffer->contents + indirect_offset, sizeof( arguments ) );
+        for ( int d = 0; d < 3; d++ )
+        {
+            uint64_t threads = (uint64_t)arguments.threadgroups[ d ] * threadgroup[ d ];
+            if ( threads > UINT32_MAX )
+                return false;
+            grid[ d ] = (uint32_t)threads;
+        }
+        return true;
+    }
+};
+
+
+struct CPUEvent
+{
+    std::mutex mutex;
+    std::condition_variable signalled;
+    uint64_t value;
+
+    CPUEvent() : value( 0 ) {}
+};
+
+
+/** An event signal or wait encoded into a command buffer */
+struct CPUEventCommand
+{
+    std::shared_ptr<CPUEvent> event;
+    uint64_t value;
+    bool signal;
+    // Number of dispatches encoded before it
+    size_t position;
+};
+
+
+struct CPUCompletedHandler
+{
+    mtlCompletionHandler handler;
+    CommandBufferHandle command_buffer_handle;
+    void * user_data;
+};
+
+
+/** When a profiled dispatch ran, on which thread of its device's trace, and over what grid */
+struct DispatchSpan
+{
+    double start;
+    double end;
+    uint32_t lane;
+    GridSize grid;
+};
+
+
+/**
+ * How one wave of dispatches runs: their indices relative to the start of
+ * the planned range, the grid, threads per chunk and threads per kernel call
+ * (tile) of each, and the chunks, each a range of threads of one of them (an
+ * index into dispatches, and its first thread).
+ */
+struct WavePlan
+{
+    std::vector<size_t> dispatches;
+    std::vector<GridSize> grids;
+    std::vector<uint64_t> grains;
+    std::vector<uint64_t> tiles;
+    std::vector<std::pair<size_t, uint64_t>> chunks;
+};
+
+typedef std::vector<WavePlan> DispatchPlan;
+
+
+/** Dispatches [ first, last ) of a command buffer, encoded from a command list, with the list's plan */
+struct PlannedRange
+{
+    size_t first;
+    size_t last;
+    std::shared_ptr<const DispatchPlan> plan;
+};
+
+
+struct CPUCommandBuffer
+{
+    std::shared_ptr<CPUCommandQueue> command_queue;
+    std::mutex mutex;
+    std::vector<CPUDispatch> dispatches;
+    std::vector<CPUEventCommand> event_commands;
+    std::vector<PlannedRange> planned_ranges;
+    // How far execution has got, on the command thread
+    size_t next_dispatch;
+    size_t next_event_command;
+    std::vector<DispatchSpan> spans;
+    std::vector<CPUCompletedHandler> completed_handlers;
+    std::atomic<uint32_t> status;
+    // Set on the command thread when a dispatch cannot run; the rest are skipped
+    bool failed;
+    // Set when committed while profiling; the timing is complete once the command buffer has finished
+    bool profiled;
+    CommandBufferHandle committed_handle;
+    mtlCommandBufferTiming timing;
+    std::vector<mtlDispatchTiming> dispatch_timings;
+
+    CPUCommandBuffer() : next_dispatch( 0 ), next_event_command( 0 ), status( MTL_COMMAND_BUFFER_NOT_ENQUEUED ), failed( false ),
+                         profiled( false ), committed_handle( INVALID_HANDLE )
+    {
+        memset( &timing, 0, sizeof( timing ) );
+    }
+};
+
+
+/** Dispatches recorded once, with their plan, to be encoded any number of times */
+struct CPUCommandList
+{
+    std::shared_ptr<CPUDevice> device;
+    std::mutex mutex;
+    std::vector<CPUDispatch> dispatches;
+    // Replaced, never changed, when a binding changes, as command buffers may hold it
+    std::shared_ptr<const DispatchPlan> plan;
+};
+
+
+struct CPUCommandEncoder
+{
+    std::shared_ptr<CPUCommandBuffer> command_buffer;
+    std::shared_ptr<CPUComputePipelineState> compute_pipeline_state;
+    std::vector<std::shared_ptr<CPUBuffer>> buffers;
+    std::vector<uint8_t> read_only;
+    // Zero for a serial encoder
+    uint64_t concurrent_group;
+    bool encoding_ended;
+
+    CPUCommandEncoder() : concurrent_group( 0 ), encoding_ended( false ) {}
+};
+
+
+#pragma mark Handle Store
+
+/**
+ * Handles to backend objects of one type. Each live handle holds a reference,
+ * and encoded commands hold their own, so an object stays alive while any
+ * handle or pending command still refers to it. References still held by
+ * handles at exit are left to the process teardown.
+ */
+template <typename T>
+class HandleMap
+{
+public:
+    uint64_t Object2Handle( const std::shared_ptr<T> & obj )
+    {
+        if ( !obj )
+            return INVALID_HANDLE;
+        std::shared_ptr<T> * reference = new std::shared_ptr<T>( obj );
+        uint64_t handle = table.Insert( reference );
+        if ( handle == INVALID_HANDLE )
+        {
+            delete reference;
+            mtlStoreError( "Too many live handles." );
+        }
+        return handle;
+    }
+
+    std::shared_ptr<T> Handle2Object( uint64_t handle ) const
+    {
+        std::shared_ptr<T> * reference = table.Lookup( handle );
+        return reference ? *reference : std::shared_ptr<T>();
+    }
+
+    /** Release a handle. Returns false for invalid, stale or already freed handles. */
+    bool Free( uint64_t handle )
+    {
+        std::shared_ptr<T> * reference = table.Remove( handle );
+        delete reference;
+        return reference != nullptr;
+    }
+
+private:
+    HandleTable<std::shared_ptr<T>> table;
+};
+
+
+struct HandleStore
+{
+    HandleMap<CPUDevice> devices;
+    HandleMap<CPULibrary> libraries;
+    HandleMap<CPUFunction> functions;
+    HandleMap<CPUComputePipelineState> compute_pipeline_states;
+    HandleMap<CPUCommandQueue> command_queues;
+    HandleMap<CPUBuffer> buffers;
+    HandleMap<CPUCommandBuffer> command_buffers;
+    HandleMap<CPUCommandEncoder> command_encoders;
+    HandleMap<CPUEvent> events;
+    HandleMap<CPUCommandList> command_lists;
+
+    static HandleStore & getInstance()
+    {
+        static HandleStore instance;
+        return instance;
+    }
+};
+
+
+#pragma mark Profiling
+
+/** Trace events and totals recorded while profiling is enabled */
+struct Profile
+{
+    std::atomic<bool> enabled;
+    std::mutex mutex;
+    std::vector<mtlTraceEvent> events;
+    mtlProfileStats stats;
+
+    Profile() : enabled( false )
+    {
+        memset( &stats, 0, sizeof( stats ) );
+    }
+
+    static Profile & getInstance()
+    {
+        static Profile instance;
+        return instance;
+    }
+};
+
+
+bool Profiling()
+{
+    return Profile::getInstance().enabled.load( std::memory_order_relaxed );
+}
+
+
+double ProfileTime()
+{
+    return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+
+/** Small number identifying the calling thread on the host process of the trace */
+uint64_t HostThreadNumber()
+{
+    static std::atomic<uint64_t> next_number( 1 );
+    thread_local uint64_t number = next_number++;
+    return number;
+}
+
+
+void RecordTraceEvents( const mtlTraceEvent * events, size_t count )
+{
+    Profile & profile = Profile::getInstance();
+    std::lock_guard<std::mutex> lock( profile.mutex );
+    for ( size_t i = 0; i < count; i++ )
+    {
+        mtlProfileCount( &profile.stats, &events[ i ] );
+        if ( profile.events.size() < TRACE_MAX_EVENTS )
+            profile.events.push_back( events[ i ] );
+        else
+            profile.stats.dropped_events++;
+    }
+}
+
+
+/** Records a host operation spanning the scope on the calling thread, if profiling when it starts */
+class HostTraceScope
+{
+public:
+    HostTraceScope( uint32_t category, const char * name, uint64_t handle, uint64_t bytes ) : active( Profiling() )
+    {
+        if ( !active )
+            return;
+        double now = ProfileTime();
+        mtlTraceEventInit( &event, category, name, now, now );
+        event.thread = HostThreadNumber();
+        event.handle = handle;
+        event.bytes = bytes;
+    }
+
+    ~HostTraceScope()
+    {
+        if ( !active )
+            return;
+        event.duration = ProfileTime() - event.start;
+        RecordTraceEvents( &event, 1 );
+    }
+
+private:
+    bool active;
+    mtlTraceEvent event;
+};
+
+
+#pragma mark Helpers
+
+std::string CPUModelName()
+{
+    std::ifstream cpuinfo( "/proc/cpuinfo" );
+    std::string line;
+    while ( std::getline( cpuinfo, line ) )
+    {
+        if ( line.compare( 0, 10, "model name" ) != 0 )
+            continue;
+        size_t colon = line.find( ':' );
+        if ( colon == std::string::npos )
+            break;
+        size_t start = line.find_first_not_of( " \t", colon + 1 );
+        if ( start == std::string::npos )
+            break;
+        return line.substr( start );
+    }
+    return "Host CPU";
+}
+
+
+/** CPU numbers of a sysfs list such as "0-3,8-11" */
+std::vector<int> ParseCPUList( const std::string & list )
+{
+    std::vector<int> cpus;
+    std::istringstream ranges( list );
+    std::string range;
+    while ( std::getline( ranges, range, ',' ) )
+    {
+        int first, last;
+        int fields = sscanf( range.c_str(), "%d-%d", &first, &last );
+        if ( fields < 1 || first < 0 )
+            continue;
+        if ( fields == 1 )
+            last = first;
+        for ( int cpu = first; cpu <= last; cpu++ )
+            cpus.push_back( cpu );
+    }
+    return cpus;
+}
+
+
+/** The CPUs this process may run on */
+std::vector<int> AllowedCPUs()
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+    if ( sched_getaffinity( 0, sizeof( set ), &set ) == 0 )
+    {
+        for ( int cpu = 0; cpu < CPU_SETSIZE; cpu++ )
+        {
+            if ( CPU_ISSET( cpu, &set ) )
+                cpus.push_back( cpu );
+        }
+    }
+    if ( cpus.empty() )
+    {
+        for ( unsigned int cpu = 0; cpu < std::max( std::thread::hardware_concurrency(), 1u ); cpu++ )
+            cpus.push_back( (int)cpu );
+    }
+    return cpus;
+}
+
+
+struct NumaNode
+{
+    uint32_t node;
+    std::vector<int> cpus;
+    uint64_t memory_bytes;
+};
+
+
+/** The NUMA nodes with CPUs this process may run on, from sysfs; none if it does not describe them */
+std::vector<NumaNode> NumaNodes()
+{
+    std::vector<NumaNode> nodes;
+    const std::string root = "/sys/devices/system/node/";
+    DIR * directory = opendir( root.c_str() );
+    if ( !directory )
+        return nodes;
+
+    std::vector<int> allowed = AllowedCPUs();
+    while ( struct dirent * entry = readdir( directory ) )
+    {
+        unsigned int node;
+        char trailing;
+        if ( sscanf( entry->d_name, "node%u%c", &node, &trailing ) != 1 || node >= HOST_MAX_NUMA_NODES )
+            continue;
+        std::string path = root + entry->d_name;
+
+        std::ifstream cpulist( path + "/cpulist" );
+        std::string list;
+        std::getline( cpulist, list );
+        NumaNode numa_node = { node, {}, 0 };
+        for ( int cpu : ParseCPUList( list ) )
+        {
+            if ( std::binary_search( allowed.begin(), allowed.end(), cpu ) )
+                numa_node.cpus.push_back( cpu );
+        }
+        // Nodes of memory alone, or of CPUs the process may not use, make no device.
+        if ( numa_node.cpus.empty() )
+            continue;
+
+        std::ifstream meminfo( path + "/meminfo" );
+        std::string line;
+        while ( std::getline( meminfo, line ) )
+        {
+            unsigned int line_node;
+            unsigned long long kilobytes;
+            if ( sscanf( line.c_str(), "Node %u MemTotal: %llu kB", &line_node, &kilobytes ) == 2 )
+            {
+                numa_node.memory_bytes = (uint64_t)kilobytes * 1024;
+                break;
+            }
+        }
+        nodes.push_back( numa_node );
+    }
+    closedir( directory );
+
+    std::sort( nodes.begin(), nodes.end(), []( const NumaNode & a, const NumaNode & b ) { return a.node < b.node; } );
+    return nodes;
+}
+
+
+/**
+ * The devices of the system, created on first use: one per NUMA node, with
+ * its threads pinned to the node's cores and its buffers in the node's
+ * memory, or a single device for the whole machine if it has one node.
+ * MATLABMETAL_NUMA_NODES splits the cores into that many devices instead, as
+ * if the machine had that many nodes (without binding memory).
+ */
+const std::vector<std::shared_ptr<CPUDevice>> & AllDevices()
+{
+    static std::vector<std::shared_ptr<CPUDevice>> devices;
+    static std::once_flag once;
+    std::call_once( once, []() {
+        uint64_t physical_memory = 0;
+        long pages = sysconf( _SC_PHYS_PAGES );
+        long page_size = sysconf( _SC_PAGE_SIZE );
+        if ( pages > 0 && page_size > 0 )
+            physical_memory = (uint64_t)pages * (uint64_t)page_size;
+
+        std::vector<NumaNode> nodes = NumaNodes();
+        bool bind_memory = nodes.size() > 1;
+        const char * node_override = getenv( "MATLABMETAL_NUMA_NODES" );
+        if ( node_override && atoi( node_override ) > 0 )
+        {
+            unsigned int num_nodes = (unsigned int)atoi( node_override );
+            std::vector<int> allowed = AllowedCPUs();
+            nodes.assign( num_nodes, NumaNode() );
+            for ( unsigned int n = 0; n < num_nodes; n++ )
+            {
+                nodes[ n ].node = n;
+                nodes[ n ].memory_bytes = physical_memory / num_nodes;
+                // With fewer cores than nodes, nodes share cores.
+                size_t first = allowed.size() * n / num_nodes;
+                size_t last = std::max( allowed.size() * ( n + 1 ) / num_nodes, first + 1 );
+                for ( size_t i = first; i < last; i++ )
+                    nodes[ n ].cpus.push_back( allowed[ i % allowed.size() ] );
+            }
+            bind_memory = false;
+        }
+        if ( nodes.size() < 2 )
+        {
+            // A single device may run anywhere, so it is sized to the core count but not pinned.
+            NumaNode whole_machine = { nodes.empty() ? 0 : nodes[ 0 ].node, {}, physical_memory };
+            nodes.assign( 1, whole_machine );
+        }
+
+        const char * thread_override = getenv( "MATLABMETAL_NUM_THREADS" );
+        for ( size_t index = 0; index < nodes.size(); index++ )
+        {
+            const NumaNode & node = nodes[ index ];
+            unsigned int num_threads = node.cpus.empty() ? std::max( std::thread::hardware_concurrency(), 1u ) : (unsigned int)node.cpus.size();
+            if ( thread_override && atoi( thread_override ) > 0 )
+                num_threads = (unsigned int)atoi( thread_override );
+
+            std::shared_ptr<CPUDevice> device = std::make_shared<CPUDevice>();
+            device->name = CPUModelName();
+            if ( nodes.size() > 1 )
+                device->name += ", NUMA node " + std::to_string( node.node );
+            device->name += " (" + std::to_string( num_threads ) + " threads, " + mtlBuiltinHostKernelISA() + ")";
+            device->registry_id = HOST_REGISTRY_ID_BASE + index;
+            device->working_set_size = node.memory_bytes ? node.memory_bytes : physical_memory / nodes.size();
+            device->numa_node = node.node;
+            device->cpus = node.cpus;
+            device->bind_memory = bind_memory;
+            // The calling thread participates in every dispatch, so one fewer worker keeps all cores busy.
+            device->pool.reset( new ThreadPool( num_threads - 1, node.cpus ) );
+            device->command_scheduler.reset( new CommandScheduler( node.cpus ) );
+            devices.push_back( device );
+        }
+    } );
+    return devices;
+}
+
+
+/**
+ * Prefer the device's NUMA node for the pages of a new buffer, which are
+ * placed when first touched. Placement is only a hint, so if the node is
+ * full the pages come from another node, and failures are ignored.
+ */
+void PreferDeviceNode( const CPUDevice & device, void * contents, uint64_t bytes )
+{
+    if ( !device.bind_memory || bytes < HOST_NUMA_BIND_MIN_BYTES )
+        return;
+    const unsigned int bits = 8 * sizeof( unsigned long );
+    unsigned long mask[ HOST_MAX_NUMA_NODES / ( 8 * sizeof( unsigned long ) ) ] = {};
+    mask[ device.numa_node / bits ] |= 1UL << ( device.numa_node % bits );
+    syscall( SYS_mbind, contents, bytes, HOST_MPOL_PREFERRED, mask, (unsigned long)HOST_MAX_NUMA_NODES + 1, 0 );
+}
+
+
+std::mutex KernelRegistryMutex;
+
+std::unordered_map<std::string, mtlHostKernel> BuiltinKernelRegistry()
+{
+    std::unordered_map<std::string, mtlHostKernel> registry;
+    uint32_t count;
+    const mtlBuiltinHostKernel * kernels = mtlBuiltinHostKernels( &count );
+    for ( uint32_t i = 0; i < count; i++ )
+        registry[ kernels[ i ].name ] = kernels[ i ].kernel;
+    return registry;
+}
+
+
+/** Host kernels by name, starting with the built-in ones, which mtlRegisterHostKernel may replace */
+std::unordered_map<std::string, mtlHostKernel> & KernelRegistry()
+{
+    static std::unordered_map<std::string, mtlHostKernel> registry = BuiltinKernelRegistry();
+    return registry;
+}
+
+
+mtlHostKernel FindHostKernel( const std::string & name )
+{
+    std::lock_guard<std::mutex> lock( KernelRegistryMutex );
+    auto it = KernelRegistry().find( name );
+    return ( it == KernelRegistry().end() ) ? nullptr : it->second;
+}
+
+
+/** Store an error and return false if the buffer is mapped read-only from a file */
+bool CheckWritable( const CPUBuffer & buffer )
+{
+    if ( buffer.read_only )
+    {
+        mtlStoreError( "The buffer is read-only." );
+        return false;
+    }
+    return true;
+}
+
+
+/** Copy between host memory and a buffer, splitting large copies across the device workers */
+void ParallelCopy( CPUDevice & device, void * destination, const void * source, uint64_t bytes )
+{
+    if ( bytes < HOST_PARALLEL_COPY_THRESHOLD )
+    {
+        memcpy( destination, source, bytes );
+        return;
+    }
+    uint64_t grain = std::max<uint64_t>( bytes / ( device.pool->Size() + 1 ), HOST_PARALLEL_COPY_THRESHOLD / 4 );
+    grain = ( grain + HOST_BUFFER_ALIGNMENT - 1 ) & ~(uint64_t)( HOST_BUFFER_ALIGNMENT - 1 );
+    device.pool->ParallelFor( bytes, grain, [ & ]( uint64_t first, uint64_t last ) {
+        memcpy( (uint8_t *)destination + first, (const uint8_t *)source + first, last - first );
+    } );
+}
+
+
+/** Convert count floats to or from a buffer format, splitting large conversions across the device workers */
+void ParallelConvert( CPUDevice & device, uint32_t format, void * buffer_elements, float * floats, uint64_t count, bool to_buffer )
+{
+    const uint64_t element_size = mtlFormatSize( format );
+    auto convert = [ & ]( uint64_t first, uint64_t last ) {
+        void * elements = (uint8_t *)buffer_elements + first * element_size;
+        if ( to_buffer )
+            mtlHostPackFloats( format, elements, floats + first, last - first );
+        else
+            mtlHostUnpackFloats( format, floats + first, elements, last - first );
+    };
+    if ( count * sizeof( float ) < HOST_PARALLEL_COPY_THRESHOLD )
+    {
+        convert( 0, count );
+        return;
+    }
+    uint64_t grain = std::max<uint64_t>( count / ( device.pool->Size() + 1 ), HOST_PARALLEL_COPY_THRESHOLD / 4 / sizeof( float ) );
+    grain = ( grain + HOST_BUFFER_ALIGNMENT - 1 ) & ~(uint64_t)( HOST_BUFFER_ALIGNMENT - 1 );
+    device.pool->ParallelFor( count, grain, convert );
+}
+
+
+/** Copy a sub-block between a buffer and dense host memory, splitting large copies by run across the device workers */
+void CopyRegion( CPUDevice & device, const mtlRegionLayout & layout, uint8_t * contents, uint8_t * host, bool to_buffer )
+{
+    uint64_t runs = layout.runs_y * layout.runs_z;
+    if ( runs == 1 )
+    {
+        if ( to_buffer )
+            ParallelCopy( device, contents + layout.first_byte, host, layout.run_bytes );
+        else
+            ParallelCopy( device, host, contents + layout.first_byte, layout.run_bytes );
+        return;
+    }
+
+    auto copy_runs = [ & ]( uint64_t first, uint64_t last ) {
+        for ( uint64_t run = first; run < last; run++ )
+        {
+            uint8_t * buffer_run = contents + layout.first_byte + ( run % layout.runs_y ) * layout.stride_y + ( run / layout.runs_y ) * layout.stride_z;
+            uint8_t * host_run = host + run * layout.run_bytes;
+            if ( to_buffer )
+                memcpy( buffer_run, host_run, layout.run_bytes );
+            else
+                memcpy( host_run, buffer_run, layout.run_bytes );
+        }
+    };
+    if ( runs * layout.run_bytes < HOST_PARALLEL_COPY_THRESHOLD )
+    {
+        copy_runs( 0, runs );
+        return;
+    }
+    uint64_t grain = std::max<uint64_t>( runs / ( device.pool->Size() + 1 ), ( HOST_PARALLEL_COPY_THRESHOLD / 4 ) / layout.run_bytes );
+    device.pool->ParallelFor( runs, std::max<uint64_t>( grain, 1 ), copy_runs );
+}
+
+
+/**
+ * A private copy of constant data for a dispatch. It has no device, so it is
+ * not counted as device memory and has no handle. Returns null if out of memory.
+ */
+std::shared_ptr<CPUBuffer> NewInlineBuffer( const void * bytes, uint64_t length )
+{
+    std::shared_ptr<CPUBuffer> inline_buffer = std::make_shared<CPUBuffer>();
+    inline_buffer->contents = malloc( length );
+    if ( !inline_buffer->contents )
+        return nullptr;
+    memcpy( inline_buffer->contents, bytes, length );
+    inline_buffer->length = length;
+    return inline_buffer;
+}
+
+
+/** A dispatch's host kernel with the arguments it is called with */
+struct BoundDispatch
+{
+    std::vector<void *> contents;
+    std::vector<uint64_t> lengths;
+    mtlHostKernelArgs args;
+    mtlHostKernel kernel;
+    uint64_t num_threads;
+    uint64_t grain;
+    uint64_t tile;
+};
+
+
+/**
+ * Plan how independent dispatches run together, as one set of chunks spread
+ * over the device workers. wave holds their indices in dispatches, and the
+ * plan holds them relative to first. Returns false if an indirect grid is too large.
+ */
+bool PlanDispatchWave( const CPUDevice & device, const std::vector<CPUDispatch> & dispatches, size_t first, const std::vector<size_t> & wave,
+                       WavePlan & plan )
+{
+    uint64_t total_threads = 0;
+    plan.grids.resize( wave.size() );
+    for ( size_t d = 0; d < wave.size(); d++ )
+    {
+        if ( !dispatches[ wave[ d ] ].Grid( plan.grids[ d ] ) )
+        {
+            mtlStoreError( "Indirect dispatch grid exceeds UINT32_MAX threads." );
+            return false;
+        }
+        total_threads += (uint64_t)plan.grids[ d ][0] * plan.grids[ d ][1] * plan.grids[ d ][2];
+    }
+    uint64_t grain = std::max<uint64_t>( total_threads / ( 4 * ( device.pool->Size() + 1 ) ), HOST_MIN_DISPATCH_CHUNK );
+    grain = ( grain + HOST_THREAD_EXECUTION_WIDTH - 1 ) / HOST_THREAD_EXECUTION_WIDTH * HOST_THREAD_EXECUTION_WIDTH;
+
+    // Each chunk is a range of threads of one dispatch, so small dispatches share a single fork and join.
+    // A dispatch with a threadgroup size packs as many whole threadgroups into a chunk as fit the grain,
+    // and its kernel is still called one threadgroup at a time.
+    for ( size_t d = 0; d < wave.size(); d++ )
+    {
+        const CPUDispatch & dispatch = dispatches[ wave[ d ] ];
+        uint64_t num_threads = (uint64_t)plan.grids[ d ][0] * plan.grids[ d ][1] * plan.grids[ d ][2];
+        uint64_t group_threads = (uint64_t)dispatch.threadgroup[0] * dispatch.threadgroup[1] * dispatch.threadgroup[2];
+        uint64_t dispatch_grain = group_threads == 0 ? grain : group_threads * std::max<uint64_t>( grain / group_threads, 1 );
+        plan.dispatches.push_back( wave[ d ] - first );
+        plan.grains.push_back( dispatch_grain );
+        plan.tiles.push_back( group_threads == 0 ? dispatch_grain : group_threads );
+        for ( uint64_t thread = 0; thread < num_threads; thread += dispatch_grain )
+            plan.chunks.emplace_back( d, thread );
+    }
+    return true;
+}
+
+
+/**
+ * Run a wave of dispatches as planned by PlanDispatchWave for the range
+ * starting at first. If spans is given, the time from the first chunk of each
+ * dispatch starting to the last one finishing is stored at the dispatch's index,
+ * along with the grid it ran.
+ */
+void ExecuteDispatchWave( CPUDevice & device, const std::vector<CPUDispatch> & dispatches, size_t first, const WavePlan & plan,
+                          std::vector<DispatchSpan> * spans )
+{
+    const size_t count = plan.dispatches.size();
+    std::vector<BoundDispatch> bound( count );
+    for ( size_t d = 0; d < count; d++ )
+    {
+        const CPUDispatch & dispatch = dispatches[ first + plan.dispatches[ d ] ];
+        BoundDispatch & target = bound[ d ];
+        target.contents.assign( dispatch.buffers.size(), nullptr );
+        target.lengths.assign( dispatch.buffers.size(), 0 );
+        for ( size_t i = 0; i < dispatch.buffers.size(); i++ )
+        {
+            if ( !dispatch.buffers[ i ] )
+                continue;
+            target.contents[ i ] = dispatch.buffers[ i ]->contents;
+            target.lengths[ i ] = dispatch.buffers[ i ]->length;
+        }
+        target.args.buffers = target.contents.data();
+        target.args.buffer_lengths = target.lengths.data();
+        target.args.num_buffers = (uint32_t)target.contents.size();
+        target.args.width = plan.grids[ d ][0];
+        target.args.height = plan.grids[ d ][1];
+        target.args.depth = plan.grids[ d ][2];
+        target.kernel = dispatch.compute_pipeline_state->function->kernel;
+        target.num_threads = (uint64_t)target.args.width * target.args.height * target.args.depth;
+        target.grain = plan.grains[ d ];
+        target.tile = plan.tiles[ d ];
+    }
+
+    const std::vector<std::pair<size_t, uint64_t>> & chunks = plan.chunks;
+    std::vector<std::pair<double, double>> chunk_times( spans ? chunks.size() : 0 );
+    device.pool->ParallelFor( chunks.size(), 1, [ & ]( uint64_t first_chunk, uint64_t last_chunk ) {
+        for ( uint64_t c = first_chunk; c < last_chunk; c++ )
+        {
+            const BoundDispatch & target = bound[ chunks[ c ].first ];
+            uint64_t first_thread = chunks[ c ].second;
+            if ( spans )
+                chunk_times[ c ].first = ProfileTime();
+            uint64_t last_thread = std::min( first_thread + target.grain, target.num_threads );
+            for ( uint64_t tile = first_thread; tile < last_thread; tile += target.tile )
+                target.kernel( &target.args, tile, std::min( tile + target.tile, last_thread ) );
+            if ( spans )
+                chunk_times[ c ].second = ProfileTime();
+        }
+    } );
+
+    if ( !spans )
+        return;
+    for ( size_t d = 0; d < count; d++ )
+        ( *spans )[ first + plan.dispatches[ d ] ] = { 0, 0, (uint32_t)d + 1, plan.grids[ d ] };
+    for ( size_t c = 0; c < chunks.size(); c++ )
+    {
+        DispatchSpan & span = ( *spans )[ first + plan.dispatches[ chunks[ c ].first ] ];
+        if ( span.start == 0 || chunk_times[ c ].first < span.start )
+            span.start = chunk_times[ c ].first;
+        span.end = std::max( span.end, chunk_times[ c ].second );
+    }
+}
+
+
+/**
+ * Group dispatches into waves that run one after another, each dispatch in
+ * the first wave after every earlier dispatch it depends on: those writing a
+ * buffer it uses, and those reading a buffer it writes. A dispatch of a
+ * concurrent encoder may go into any wave from the one that was last when
+ * the encoder's first dispatch was scheduled. Any other dispatch goes into
+ * the last wave or a new one, so it never runs ahead of a dispatch encoded
+ * before it, and only alongside those it cannot observe.
+ */
+std::vector<std::vector<size_t>> ScheduleDispatches( const std::vector<CPUDispatch> & dispatches, size_t first, size_t last )
+{
+    std::vector<std::vector<size_t>> waves;
+    // One past the last wave reading and writing each buffer
+    std::unordered_map<const CPUBuffer *, std::pair<size_t, size_t>> last_use;
+    size_t group_floor = 0;
+    for ( size_t d = first; d < last; d++ )
+    {
+        const CPUDispatch & dispatch = dispatches[ d ];
+        size_t floor = waves.empty() ? 0 : waves.size() - 1;
+        if ( dispatch.concurrent_group != 0 && d > first && dispatches[ d - 1 ].concurrent_group == dispatch.concurrent_group )
+            floor = group_floor;
+        else
+            group_floor = floor;
+
+        size_t wave = floor;
+        for ( size_t i = 0; i < dispatch.NumUses(); i++ )
+        {
+            // Inline constants (no device) are never written, so sharing them does not order dispatches.
+            const CPUBuffer * buffer = dispatch.Use( i );
+            if ( !buffer || !buffer->device )
+                continue;
+            auto found = last_use.find( buffer );
+            if ( found == last_use.end() )
+                continue;
+            wave = std::max( wave, found->second.second );
+            if ( !dispatch.UseReadsOnly( i ) )
+                wave = std::max( wave, found->second.first );
+        }
+
+        if ( wave == waves.size() )
+            waves.emplace_back();
+        waves[ wave ].push_back( d );
+        for ( size_t i = 0; i < dispatch.NumUses(); i++ )
+        {
+            const CPUBuffer * buffer = dispatch.Use( i );
+            if ( !buffer || !buffer->device )
+                continue;
+            std::pair<size_t, size_t> & use = last_use[ buffer ];
+            size_t & last = dispatch.UseReadsOnly( i ) ? use.first : use.second;
+            last = std::max( last, wave + 1 );
+        }
+    }
+    return waves;
+}
+
+
+/**
+ * Plan dispatches first to last wave by wave, as scheduled by ScheduleDispatches.
+ * They must not be indirect, whose grids are only known when they run.
+ */
+DispatchPlan PlanDispatches( const CPUDevice & device, const std::vector<CPUDispatch> & dispatches, size_t first, size_t last )
+{
+    std::vector<std::vector<size_t>> waves = ScheduleDispatches( dispatches, first, last );
+    DispatchPlan plan( waves.size() );
+    for ( size_t w = 0; w < waves.size(); w++ )
+        PlanDispatchWave( device, dispatches, first, waves[ w ], plan[ w ] );
+    return plan;
+}
+
+
+/**
+ * Run dispatches first to last wave by wave, spans holding one per dispatch.
+ * Each wave is planned just before it runs, so an indirect dispatch reads the
+ * grid left by the waves before it. Returns false, with the waves from the
+ * failing one on not run, if an indirect grid is too large.
+ */
+bool ExecuteDispatchRange( CPUDevice & device, const std::vector<CPUDispatch> & dispatches, size_t first, size_t last,
+                           std::vector<DispatchSpan> * spans )
+{
+    for ( const std::vector<size_t> & wave : ScheduleDispatches( dispatches, first, last ) )
+    {
+        WavePlan plan;
+        if ( !PlanDispatchWave( device, dispatches, first, wave, plan ) )
+            return false;
+        ExecuteDispatchWave( device, dispatches, first, plan, spans );
+    }
+    return true;
+}
+
+
+/**
+ * Run dispatches first to last of a command buffer. Those encoded from a
+ * command list run as planned when it was recorded; the others are planned
+ * now. Event commands never fall inside a command list's dispatches.
+ * Returns false, having stopped, if a dispatch cannot run.
+ */
+bool ExecuteCommandBufferRange( CPUCommandBuffer & command_buffer, size_t first, size_t last, std::vector<DispatchSpan> * spans )
+{
+    CPUDevice & device = *command_buffer.command_queue->device;
+    for ( const PlannedRange & planned : command_buffer.planned_ranges )
+    {
+        if ( planned.last <= first || planned.first >= last )
+            continue;
+        if ( first < planned.first && !ExecuteDispatchRange( device, command_buffer.dispatches, first, planned.first, spans ) )
+            return false;
+        for ( const WavePlan & wave : *planned.plan )
+            ExecuteDispatchWave( device, command_buffer.dispatches, planned.first, wave, spans );
+        first = planned.last;
+    }
+    return first >= last || ExecuteDispatchRange( device, command_buffer.dispatches, first, last, spans );
+}
+
+
+void ExecuteDispatches( CPUDevice & device, const std::vector<CPUDispatch> & dispatches, std::vector<DispatchSpan> * spans = nullptr )
+{
+    if ( spans )
+        spans->assign( dispatches.size(), DispatchSpan() );
+    ExecuteDispatchRange( device, dispatches, 0, dispatches.size(), spans );
+}
+
+
+uint64_t EventValue( CPUEvent & event )
+{
+    std::lock_guard<std::mutex> lock( event.mutex );
+    return event.value;
+}
+
+
+/** Set an event's value, waking host waits and the command buffers of every device that may wait for it */
+void SignalEvent( CPUEvent & event, uint64_t value )
+{
+    {
+        std::lock_guard<std::mutex> lock( event.mutex );
+        event.value = value;
+    }
+    event.signalled.notify_all();
+    for ( const std::shared_ptr<CPUDevice> & device : AllDevices() )
+        device->command_scheduler->Poke();
+}
+
+
+/** Signalled whenever any command buffer completes */
+std::mutex CompletionMutex;
+std::condition_variable CompletionCondition;
+
+
+/** Keep the timing of a profiled command buffer's dispatches and add its execution to the trace */
+void RecordExecution( CPUCommandBuffer & command_buffer, const std::vector<DispatchSpan> & spans, uint32_t status )
+{
+    const CPUDevice & device = *command_buffer.command_queue->device;
+    const uint32_t process = (uint32_t)( device.registry_id - HOST_REGISTRY_ID_BASE ) + 1;
+    mtlCommandBufferTiming & timing = command_buffer.timing;
+    timing.num_dispatches = (uint32_t)command_buffer.dispatches.size();
+    timing.status = status;
+
+    mtlTraceEvent command_buffer_event;
+    mtlTraceEventInit( &command_buffer_event, TRACE_COMMAND_BUFFER, "Command buffer", timing.start_time, timing.end_time );
+    command_buffer_event.process = process;
+    command_buffer_event.handle = command_buffer.committed_handle;
+    std::vector<mtlTraceEvent> events( spans.size() + 1, command_buffer_event );
+
+    command_buffer.dispatch_timings.resize( spans.size() );
+    for ( size_t d = 0; d < spans.size(); d++ )
+    {
+        const CPUDispatch & dispatch = command_buffer.dispatches[ d ];
+        const std::string & name = dispatch.compute_pipeline_state->function->name;
+        mtlDispatchTiming & dispatch_timing = command_buffer.dispatch_timings[ d ];
+        memset( &dispatch_timing, 0, sizeof( dispatch_timing ) );
+        strncpy( dispatch_timing.function_name, name.c_str(), METALLIB_MAX_STRING_LENGTH - 1 );
+        dispatch_timing.encode_time = dispatch.encode_time;
+        dispatch_timing.start_time = spans[ d ].start;
+        dispatch_timing.end_time = spans[ d ].end;
+        dispatch_timing.width = spans[ d ].grid[0];
+        dispatch_timing.height = spans[ d ].grid[1];
+        dispatch_timing.depth = spans[ d ].grid[2];
+
+        mtlTraceEvent & event = events[ d + 1 ];
+        mtlTraceEventInit( &event, TRACE_DISPATCH, name.c_str(), spans[ d ].start, spans[ d ].end );
+        event.process = process;
+        event.thread = spans[ d ].lane;
+        event.handle = command_buffer.committed_handle;
+    }
+    RecordTraceEvents( events.data(), events.size() );
+}
+
+
+/**
+ * Run a committed command buffer on its device's command thread, up to the
+ * first encoded event wait whose value has not been reached. Returns true
+ * once it has completed, or false to be run again after an event changes.
+ * If a dispatch cannot run, the rest are skipped and it ends with an error.
+ */
+bool ExecuteCommandBuffer( CPUCommandBuffer & command_buffer )
+{
+    if ( command_buffer.status != MTL_COMMAND_BUFFER_SCHEDULED )
+    {
+        command_buffer.status = MTL_COMMAND_BUFFER_SCHEDULED;
+        if ( command_buffer.profiled )
+        {
+            command_buffer.timing.start_time = ProfileTime();
+            command_buffer.spans.assign( command_buffer.dispatches.size(), DispatchSpan() );
+        }
+    }
+
+    std::vector<DispatchSpan> * spans = command_buffer.profiled ? &command_buffer.spans : nullptr;
+    std::vector<CPUEventCommand> & event_commands = command_buffer.event_commands;
+    while ( true )
+    {
+        bool at_event = command_buffer.next_event_command < event_commands.size();
+        size_t end = at_event ? event_commands[ command_buffer.next_event_command ].position : command_buffer.dispatches.size();
+        if ( !command_buffer.failed && !ExecuteCommandBufferRange( command_buffer, command_buffer.next_dispatch, end, spans ) )
+            command_buffer.failed = true;
+        command_buffer.next_dispatch = end;
+        if ( !at_event )
+            break;
+
+        const CPUEventCommand & command = event_commands[ command_buffer.next_event_command ];
+        if ( command.signal )
+            SignalEvent( *command.event, command.value );
+        else if ( EventValue( *command.event ) < command.value )
+            return false;
+        command_buffer.next_event_command++;
+    }
+    event_commands.clear();
+
+    const uint32_t status = command_buffer.failed ? MTL_COMMAND_BUFFER_ERROR : MTL_COMMAND_BUFFER_COMPLETED;
+    if ( command_buffer.profiled )
+    {
+        command_buffer.timing.end_time = ProfileTime();
+        RecordExecution( command_buffer, command_buffer.spans, status );
+        command_buffer.spans.clear();
+    }
+    command_buffer.dispatches.clear();
+    command_buffer.planned_ranges.clear();
+
+    // Handlers run before the status changes, so they have finished by the time any wait returns.
+    for ( const CPUCompletedHandler & completed : command_buffer.completed_handlers )
+        completed.handler( completed.command_buffer_handle, status, completed.user_data );
+    command_buffer.completed_handlers.clear();
+
+    {
+        std::lock_guard<std::mutex> lock( CompletionMutex );
+        command_buffer.status = status;
+    }
+    CompletionCondition.notify_all();
+    return true;
+}
+
+
+/** Encode an event signal or wait at the end of a command buffer not yet committed */
+uint32_t EncodeEventCommand( CommandBufferHandle command_buffer_handle, EventHandle event_handle, uint64_t value, bool signal )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUCommandBuffer> command_buffer = HS.command_buffers.Handle2Object( command_buffer_handle );
+    if ( !command_buffer )
+    {
+        mtlStoreError( "Invalid command buffer handle." );
+        return MTL_ERROR;
+    }
+    std::shared_ptr<CPUEvent> event = HS.events.Handle2Object( event_handle );
+    if ( !event )
+    {
+        mtlStoreError( "Invalid event handle." );
+        return MTL_ERROR;
+    }
+
+    std::lock_guard<std::mutex> lock( command_buffer->mutex );
+    if ( command_buffer->status != MTL_COMMAND_BUFFER_NOT_ENQUEUED )
+    {
+        mtlStoreError( "Command buffer has already been committed." );
+        return MTL_ERROR;
+    }
+    command_buffer->event_commands.push_back( { event, value, signal, command_buffer->dispatches.size() } );
+    return MTL_SUCCESS;
+}
+
+
+/** Whether a command buffer has run, successfully or not */
+bool CommandBufferFinished( const CPUCommandBuffer & command_buffer )
+{
+    return command_buffer.status == MTL_COMMAND_BUFFER_COMPLETED || command_buffer.status == MTL_COMMAND_BUFFER_ERROR;
+}
+
+
+/** Look up command buffers to wait on, all of which must have been committed */
+bool CommittedCommandBuffers( const CommandBufferHandle * command_buffer_handles, uint32_t count,
+                              std::vector<std::shared_ptr<CPUCommandBuffer>> & command_buffers )
+{
+    if ( count == 0 || !command_buffer_handles )
+    {
+        mtlStoreError( "No command buffers to wait for." );
+        return false;
+    }
+
+    HandleStore & HS = HandleStore::getInstance();
+    for ( uint32_t i = 0; i < count; i++ )
+    {
+        std::shared_ptr<CPUCommandBuffer> command_buffer = HS.command_buffers.Handle2Object( command_buffer_handles[ i ] );
+        if ( !command_buffer )
+        {
+            mtlStoreError( "Invalid command buffer handle." );
+            return false;
+        }
+        if ( command_buffer->status == MTL_COMMAND_BUFFER_NOT_ENQUEUED )
+        {
+            mtlStoreError( "Command buffer has not been committed." );
+            return false;
+        }
+        command_buffers.push_back( command_buffer );
+    }
+    return true;
+}
+
+
+/** A pipeline state for a built-in operation, shared by all devices as it only names the host kernel */
+std::shared_ptr<CPUComputePipelineState> InternalPipelineState( const char * name, mtlHostKernel kernel )
+{
+    std::shared_ptr<CPUFunction> function = std::make_shared<CPUFunction>();
+    function->name = name;
+    function->kernel = kernel;
+    std::shared_ptr<CPUComputePipelineState> compute_pipeline_state = std::make_shared<CPUComputePipelineState>();
+    compute_pipeline_state->function = function;
+    return compute_pipeline_state;
+}
+
+
+/** Append encoded dispatches to a command buffer, failing once it has been committed. plan is that of a command list. */
+bool AppendDispatches( CPUCommandBuffer & command_buffer, CPUDispatch * dispatches, size_t count,
+                       const std::shared_ptr<const DispatchPlan> & plan = nullptr )
+{
+    double encode_time = Profiling() ? ProfileTime() : 0;
+    std::lock_guard<std::mutex> lock( command_buffer.mutex );
+    if ( command_buffer.status != MTL_COMMAND_BUFFER_NOT_ENQUEUED )
+    {
+        mtlStoreError( "Command buffer has already been committed." );
+        return false;
+    }
+    if ( plan )
+        command_buffer.planned_ranges.push_back( { command_buffer.dispatches.size(), command_buffer.dispatches.size() + count, plan } );
+    for ( size_t d = 0; d < count; d++ )
+    {
+        dispatches[ d ].encode_time = encode_time;
+        command_buffer.dispatches.push_back( std::move( dispatches[ d ] ) );
+    }
+    if ( encode_time != 0 )
+    {
+        if ( command_buffer.timing.encode_start == 0 )
+            command_buffer.timing.encode_start = encode_time;
+        command_buffer.timing.encode_end = encode_time;
+    }
+    return true;
+}
+
+
+/** Look up a command buffer whose timing can be read */
+std::shared_ptr<CPUCommandBuffer> ProfiledCommandBuffer( CommandBufferHandle command_buffer_handle )
+{
+    std::shared_ptr<CPUCommandBuffer> command_buffer = HandleStore::getInstance().command_buffers.Handle2Object( command_buffer_handle );
+    if ( !command_buffer )
+    {
+        mtlStoreError( "Invalid command buffer handle." );
+        return nullptr;
+    }
+    if ( !CommandBufferFinished( *command_buffer ) )
+    {
+        mtlStoreError( "Command buffer has not completed." );
+        return nullptr;
+    }
+    if ( !command_buffer->profiled )
+    {
+        mtlStoreError( "Command buffer was not committed while profiling." );
+        return nullptr;
+    }
+    return command_buffer;
+}
+
+
+/**
+ * Set the threadgroup size of a dispatch. An explicit size is checked;
+ * otherwise the size autotuned for the pipeline state and grid is used, if any.
+ */
+bool ResolveThreadgroup( CPUDispatch & dispatch, const uint32_t group_size[3] )
+{
+    if ( group_size[0] != 0 || group_size[1] != 0 || group_size[2] != 0 )
+    {
+        uint64_t threads = (uint64_t)group_size[0] * group_size[1] * group_size[2];
+        if ( threads == 0 || threads > HOST_MAX_THREADS_PER_THREADGROUP )
+        {
+            mtlStoreError( "Invalid threadgroup size." );
+            return false;
+        }
+        dispatch.threadgroup = { { group_size[0], group_size[1], group_size[2] } };
+        return true;
+    }
+
+    CPUComputePipelineState & compute_pipeline_state = *dispatch.compute_pipeline_state;
+    std::lock_guard<std::mutex> lock( compute_pipeline_state.tuned_mutex );
+    auto tuned = compute_pipeline_state.tuned_threadgroups.find( ThreadgroupShape{ { dispatch.width, dispatch.height, dispatch.depth } } );
+    if ( tuned != compute_pipeline_state.tuned_threadgroups.end() )
+        dispatch.threadgroup = tuned->second;
+    return true;
+}
+
+
+/** Look up the objects of a batch of dispatches, checking all of them before any is encoded */
+bool ResolveDispatches( const mtlDispatch * dispatches, uint32_t count, std::vector<CPUDispatch> & resolved )
+{
+    if ( count == 0 || !dispatches )
+    {
+        mtlStoreError( "No dispatches to encode." );
+        return false;
+    }
+
+    HandleStore & HS = HandleStore::getInstance();
+    resolved.resize( count );
+    for ( uint32_t d = 0; d < count; d++ )
+    {
+        const mtlDispatch & dispatch = dispatches[ d ];
+        if ( dispatch.width == 0 || dispatch.height == 0 || dispatch.depth == 0 )
+        {
+            mtlStoreError( "Invalid dispatch shape." );
+            return false;
+        }
+        if ( dispatch.num_buffers > MTL_DISPATCH_MAX_BUFFERS )
+        {
+            mtlStoreError( "Too many buffers in a dispatch." );
+            return false;
+        }
+
+        CPUDispatch & target = resolved[ d ];
+        target.compute_pipeline_state = HS.compute_pipeline_states.Handle2Object( dispatch.compute_pipeline_state );
+        if ( !target.compute_pipeline_state )
+        {
+            mtlStoreError( "Invalid compute pipeline state handle." );
+            return false;
+        }
+        target.buffers.resize( dispatch.num_buffers );
+        for ( uint32_t i = 0; i < dispatch.num_buffers; i++ )
+        {
+            if ( dispatch.buffers[ i ] == INVALID_HANDLE )
+                continue;
+            target.buffers[ i ] = HS.buffers.Handle2Object( dispatch.buffers[ i ] );
+            if ( !target.buffers[ i ] )
+            {
+                mtlStoreError( "Invalid buffer handle." );
+                return false;
+            }
+        }
+        target.width = dispatch.width;
+        target.height = dispatch.height;
+        target.depth = dispatch.depth;
+        const uint32_t group_size[3] = { dispatch.group_width, dispatch.group_height, dispatch.group_depth };
+        if ( !ResolveThreadgroup( target, group_size ) )
+            return false;
+    }
+    return true;
+}
+
+
+/** Find the kernel function names declared in a library source */
+std::set<std::string> DeclaredKernels( const std::string & source )
+{
+    static const std::regex kernel_declaration( "\\bkernel\\s+void\\s+([A-Za-z_][A-Za-z0-9_]*)\\s*\\(" );
+    std::set<std::string> names;
+    for ( std::sregex_iterator it( source.begin(), source.end(), kernel_declaration ), end; it != end; ++it )
+        names.insert( ( *it )[ 1 ].str() );
+    return names;
+}
+
+
+#pragma mark Library Cache
+
+/**
+ * Compiled libraries keyed by device, source and compile options. Entries hold
+ * a reference to their library, so repeated requests share one library object.
+ */
+struct LibraryCache
+{
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<CPULibrary>> entries;
+    std::string directory;
+    uint64_t memory_hits;
+    uint64_t disk_hits;
+    uint64_t misses;
+
+    LibraryCache() : memory_hits( 0 ), disk_hits( 0 ), misses( 0 )
+    {
+        const char * environment_directory = getenv( LIBRARY_CACHE_ENV_VARIABLE );
+        if ( environment_directory )
+            directory = environment_directory;
+    }
+
+    static LibraryCache & getInstance()
+    {
+        static LibraryCache instance;
+        return instance;
+    }
+};
+
+
+/**
+ * Compute pipeline states keyed by library and function name. Entries keep
+ * their library alive, so a key's library address is never reused.
+ */
+struct PipelineStateCache
+{
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<CPUComputePipelineState>> entries;
+
+    static std::string Key( const CPULibrary * library, const char * function_name )
+    {
+        return std::to_string( (uintptr_t)library ) + ":" + function_name;
+    }
+
+    static PipelineStateCache & getInstance()
+    {
+        static PipelineStateCache instance;
+        return instance;
+    }
+};
+
+
+/** Create a directory and any missing parents */
+bool MakeDirectories( const std::string & path )
+{
+    for ( size_t slash = path.find( '/', 1 ); ; slash = path.find( '/', slash + 1 ) )
+    {
+        std::string prefix = path.substr( 0, slash );
+        if ( !prefix.empty() && mkdir( prefix.c_str(), 0755 ) != 0 && errno != EEXIST )
+            return false;
+        if ( slash == std::string::npos )
+            break;
+    }
+    struct stat info;
+    return stat( path.c_str(), &info ) == 0 && S_ISDIR( info.st_mode );
+}
+
+
+/** Read the kernel names of a library artifact. Returns false if it is missing or unreadable. */
+bool LoadLibraryArtifact( const std::string & path, std::set<std::string> & kernel_names )
+{
+    std::ifstream artifact( path );
+    std::string line;
+    if ( !std::getline( artifact, line ) || line != HOST_LIBRARY_ARTIFACT_HEADER )
+        return false;
+    while ( std::getline( artifact, line ) )
+    {
+        if ( !line.empty() )
+            kernel_names.insert( line );
+    }
+    return !kernel_names.empty();
+}
+
+
+/** Write a library artifact. It is renamed into place so concurrent processes never read a partial file. */
+void StoreLibraryArtifact( const std::string & path, const std::set<std::string> & kernel_names )
+{
+    std::string temporary = path + "." + std::to_string( getpid() ) + ".tmp";
+    {
+        std::ofstream artifact( temporary );
+        artifact << HOST_LIBRARY_ARTIFACT_HEADER << '\n';
+        for ( const std::string & name : kernel_names )
+            artifact << name << '\n';
+        if ( !artifact )
+        {
+            artifact.close();
+            unlink( temporary.c_str() );
+            return;
+        }
+    }
+    if ( rename( temporary.c_str(), path.c_str() ) != 0 )
+        unlink( temporary.c_str() );
+}
+
+} // namespace
+
+
+#pragma mark Error Handling
+/**
+ * Return a pointer to the text of the most recent error.
+ *  @param error Allocated char buffer to receive the error message
+ *  @param buffer_length Size of the allocated error buffer
+ */
+void mtlGetLastError( char * error, int buffer_length )
+{
+    if ( buffer_length <= 0 )
+        return;
+    std::lock_guard<std::mutex> lock( ErrorMutex );
+    strncpy( error, ErrorString.c_str(), buffer_length );
+    error[ buffer_length - 1 ] = '\0';
+}
+
+
+#pragma mark Devices
+/**
+ * Get the number of installed Metal devices
+ * @return The number of devices
+ **/
+unsigned int mtlNumberOfDevices( void )
+{
+    return (unsigned int)AllDevices().size();
+}
+
+
+/**
+ * Get a DeviceHandle for the specified index
+ * @param index Index of the device (zero-based up to mtlNumberOfDevices -1)
+ * @return A DeviceHandle of the device at the index, INVALID_HANDLE on error
+ */
+DeviceHandle mtlGetDeviceAtIndex( uint32_t index )
+{
+    const std::vector<std::shared_ptr<CPUDevice>> & devices = AllDevices();
+    if ( index >= devices.size() )
+    {
+        mtlStoreError( "Index out of bounds" );
+        return (DeviceHandle)INVALID_HANDLE;
+    }
+    return HandleStore::getInstance().devices.Object2Handle( devices[ index ] );
+}
+
+
+/**
+ * Return a mtlDeviceInfo struct for a Metal device pointed by a handle
+ * @param device_handle Handle to a Device
+ * @param deviceInfo A pointer to a preallocated mtlDeviceInfo struct
+ * @return MTL_SUCCESS or MTL_ERROR
+ **/
+uint32_t mtlGetDeviceInfo(DeviceHandle device_handle, mtlDeviceInfo *deviceInfo)
+{
+    std::shared_ptr<CPUDevice> device = HandleStore::getInstance().devices.Handle2Object( device_handle );
+    if ( !device )
+    {
+        mtlStoreError( "Invalid device handle." );
+        return MTL_ERROR;
+    }
+
+    strncpy( deviceInfo->name, device->name.c_str(), METALLIB_MAX_STRING_LENGTH );
+    deviceInfo->name[ METALLIB_MAX_STRING_LENGTH - 1 ] = '\0';
+    deviceInfo->IsHeadless = 1;
+    deviceInfo->IsLowPower = 0;
+    deviceInfo->recommendedMaxWorkingSetSize = device->working_set_size;
+    deviceInfo->RegistryID = device->registry_id;
+    deviceInfo->ComputeUnits = device->pool->Size() + 1;
+    deviceInfo->NumaNode = device->numa_node;
+    return MTL_SUCCESS;
+}
+
+
+/**
+ * Determine if two device_handles refer to the same Device
+ * @param device_handle1 Handle to a Device object
+ * @param device_handle2 Handle to a Device object
+ * @return uint8(1) if the device handles refer to the same Metal device, uint8(0) if they do not match.
+ **/
+uint8_t mtlSameDevice( DeviceHandle device_handle1, DeviceHandle device_handle2 )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUDevice> device1 = HS.devices.Handle2Object( device_handle1 );
+    std::shared_ptr<CPUDevice> device2 = HS.devices.Handle2Object( device_handle2 );
+    return (uint8_t)( device1 && device1 == device2 );
+}
+
+
+/**
+ * Get allocated memory for a device
+ * @param device_handle Handle to a Device
+ * @return The currently allocated memory in bytes, -1 on error
+ */
+int64_t mtlGetDeviceAllocatedMemory( DeviceHandle device_handle )
+{
+    std::shared_ptr<CPUDevice> device = HandleStore::getInstance().devices.Handle2Object( device_handle );
+    if ( !device )
+    {
+        mtlStoreError( "Invalid device handle." );
+        return (int64_t)-1;
+    }
+    return device->allocated_bytes.load();
+}
+
+
+/** Copy a device
+ * @param device_handle The handle of the device to copy
+ */
+DeviceHandle mtlCopyDevice( DeviceHandle device_handle )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUDevice> device = HS.devices.Handle2Object( device_handle );
+    if ( !device )
+    {
+        mtlStoreError( "Invalid device handle." );
+        return (DeviceHandle)INVALID_HANDLE;
+    }
+    return HS.devices.Object2Handle( device );
+}
+
+
+/** Free a device
+ * @param device_handle The handle of the device to free
+ */
+void mtlFreeDevice( DeviceHandle device_handle )
+{
+    if ( device_handle != INVALID_HANDLE && !HandleStore::getInstance().devices.Free( device_handle ) )
+        mtlStoreError( "Invalid device handle." );
+}
+
+
+#pragma mark Libraries
+/** Create a new library on a device from source code.
+ * @param device_handle Handle to a Device
+ * @param source Null-terminated string of the source code to compile
+ * @return LibraryHandle on success, INVALID_HANDLE on error.
+ */
+LibraryHandle mtlNewLibrary( DeviceHandle device_handle, const char * source )
+{
+    return mtlNewLibraryWithOptions( device_handle, source, MTL_COMPILE_FAST_MATH );
+}
+
+
+/** Create a new library on a device from source code with explicit compile options.
+ * @param device_handle Handle to a Device
+ * @param source Null-terminated string of the source code to compile
+ * @param compile_options Zero or more MTL_COMPILE_ flags
+ * @return LibraryHandle on success, INVALID_HANDLE on error.
+ */
+LibraryHandle mtlNewLibraryWithOptions( DeviceHandle device_handle, const char * source, uint32_t compile_options )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUDevice> device = HS.devices.Handle2Object( device_handle );
+    if ( !device )
+    {
+        mtlStoreError( "Invalid device handle." );
+        return (LibraryHandle)INVALID_HANDLE;
+    }
+
+    if ( compile_options & ~(uint32_t)MTL_COMPILE_FAST_MATH )
+    {
+        mtlStoreError( "Invalid compile options." );
+        return (LibraryHandle)INVALID_HANDLE;
+    }
+
+    if ( !source )
+        source = "";
+    char source_key[ LIBRARY_CACHE_KEY_LENGTH ];
+    mtlLibraryCacheKey( source_key, source, compile_options );
+    std::string key = std::to_string( device->registry_id ) + ":" + source_key;
+
+    LibraryCache & cache = LibraryCache::getInstance();
+    std::string directory;
+    {
+        std::lock_guard<std::mutex> lock( cache.mutex );
+        auto entry = cache.entries.find( key );
+        if ( entry != cache.entries.end() )
+        {
+            cache.memory_hits++;
+            return HS.libraries.Object2Handle( entry->second );
+        }
+        directory = cache.directory;
+    }
+
+    // Host kernels are bound by name, so the compiled form of a library is its list of kernel names.
+    std::shared_ptr<CPULibrary> library = std::make_shared<CPULibrary>();
+    library->device = device;
+    std::string artifact_path = directory.empty() ? "" : directory + "/" + source_key + ".cpulib";
+    bool from_disk = !artifact_path.empty() && LoadLibraryArtifact( artifact_path, library->kernel_names );
+    if ( !from_disk )
+    {
+        library->kernel_names = DeclaredKernels( source );
+        if ( library->kernel_names.empty() )
+        {
+            mtlStoreError( "No kernel functions declared in the library source." );
+            return (LibraryHandle)INVALID_HANDLE;
+        }
+        if ( !artifact_path.empty() )
+            StoreLibraryArtifact( artifact_path, library->kernel_names );
+    }
+
+    {
+        std::lock_guard<std::mutex> lock( cache.mutex );
+        if ( from_disk )
+            cache.disk_hits++;
+        else
+            cache.misses++;
+        library = cache.entries.emplace( key, library ).first->second;
+    }
+    return HS.libraries.Object2Handle( library );
+}
+
+
+/** Set the directory for on-disk library cache artifacts
+ * @param directory Path of the directory, or NULL or an empty string to disable the on-disk cache
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlSetLibraryCacheDirectory( const char * directory )
+{
+    std::string path = directory ? directory : "";
+    if ( !path.empty() && !MakeDirectories( path ) )
+    {
+        mtlStoreError( "Could not create the library cache directory." );
+        return MTL_ERROR;
+    }
+
+    LibraryCache & cache = LibraryCache::getInstance();
+    std::lock_guard<std::mutex> lock( cache.mutex );
+    cache.directory = path;
+    return MTL_SUCCESS;
+}
+
+
+/** Retrieve the library cache counters
+ * @param stats Pointer to a struct to receive the counters
+ */
+void mtlGetLibraryCacheStats( mtlLibraryCacheStats * stats )
+{
+    LibraryCache & cache = LibraryCache::getInstance();
+    std::lock_guard<std::mutex> lock( cache.mutex );
+    stats->memory_hits = cache.memory_hits;
+    stats->disk_hits = cache.disk_hits;
+    stats->misses = cache.misses;
+    stats->entries = cache.entries.size();
+}
+
+
+/** Drop all in-memory library and pipeline state cache entries and reset the counters
+ */
+void mtlClearLibraryCache( void )
+{
+    {
+        LibraryCache & cache = LibraryCache::getInstance();
+        std::lock_guard<std::mutex> lock( cache.mutex );
+        cache.entries.clear();
+        cache.memory_hits = cache.disk_hits = cache.misses = 0;
+    }
+    PipelineStateCache & pipeline_states = PipelineStateCache::getInstance();
+    std::lock_guard<std::mutex> lock( pipeline_states.mutex );
+    pipeline_states.entries.clear();
+}
+
+
+/** Return the device on which the library was created.
+ * @param library_handle Handle to a Library
+ * @return DeviceHandle on success, INVALID_HANDLE on error.
+ */
+DeviceHandle mtlLibraryDevice( LibraryHandle library_handle )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPULibrary> library = HS.libraries.Handle2Object( library_handle );
+    if ( !library )
+    {
+        mtlStoreError( "Invalid library handle." );
+        return (DeviceHandle)INVALID_HANDLE;
+    }
+    return HS.devices.Object2Handle( library->device );
+}
+
+
+/** Free a library
+ * @param library_handle The handle of the library to free
+ */
+void mtlFreeLibrary( LibraryHandle library_handle )
+{
+    if ( library_handle != INVALID_HANDLE && !HandleStore::getInstance().libraries.Free( library_handle ) )
+        mtlStoreError( "Invalid library handle." );
+}
+
+
+#pragma mark Functions
+/** Create a new function in a library
+ * @param library_handle Handle to a Library
+ * @param function_name Name of the function defined in the library
+ * @return FunctionHandle on success, INVALID_HANDLE on error.
+ */
+FunctionHandle mtlNewFunction( LibraryHandle library_handle, const char * function_name )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPULibrary> library = HS.libraries.Handle2Object( library_handle );
+    if ( !library )
+    {
+        mtlStoreError( "Invalid library handle." );
+        return (FunctionHandle)INVALID_HANDLE;
+    }
+
+    if ( !function_name || !library->kernel_names.count( function_name ) )
+    {
+        mtlStoreError( "Library invalid or function name incorrect" );
+        return (FunctionHandle)INVALID_HANDLE;
+    }
+
+    mtlHostKernel kernel = FindHostKernel( function_name );
+    if ( !kernel )
+    {
+        mtlStoreError( std::string( "No host kernel registered for function " ) + function_name );
+        return (FunctionHandle)INVALID_HANDLE;
+    }
+
+    std::shared_ptr<CPUFunction> function = std::make_shared<CPUFunction>();
+    function->library = library;
+    function->name = function_name;
+    function->kernel = kernel;
+    return HS.functions.Object2Handle( function );
+}
+
+
+/** Free a function
+ * @param function_handle The handle of the function to free
+ */
+void mtlFreeFunction( FunctionHandle function_handle )
+{
+    if ( function_handle != INVALID_HANDLE && !HandleStore::getInstance().functions.Free( function_handle ) )
+        mtlStoreError( "Invalid function handle." );
+}
+
+
+#pragma mark Compute Pipeline States
+/** Create a new compute pipeline state
+ * @param device_handle The handle to the device on which the pipeline will be created
+ * @param function_handle  The function for which the pipeline will be created.
+ * @return ComputePipelineStateHandle on success, INVALID_HANDLE on error.
+ */
+ComputePipelineStateHandle mtlNewComputePipelineState( DeviceHandle device_handle, FunctionHandle function_handle )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUDevice> device = HS.devices.Handle2Object( device_handle );
+    if ( !device )
+    {
+        mtlStoreError( "Invalid device handle." );
+        return (ComputePipelineStateHandle)INVALID_HANDLE;
+    }
+    std::shared_ptr<CPUFunction> function = HS.functions.Handle2Object( function_handle );
+    if ( !function )
+    {
+        mtlStoreError( "Invalid function handle." );
+        return (ComputePipelineStateHandle)INVALID_HANDLE;
+    }
+    if ( function->library->device != device )
+    {
+        mtlStoreError( "Function was created on a different device." );
+        return (ComputePipelineStateHandle)INVALID_HANDLE;
+    }
+
+    std::shared_ptr<CPUComputePipelineState> compute_pipeline_state = std::make_shared<CPUComputePipelineState>();
+    compute_pipeline_state->device = device;
+    compute_pipeline_state->function = function;
+    return HS.compute_pipeline_states.Object2Handle( compute_pipeline_state );
+}
+
+
+/** Return a compute pipeline state for a function of a library, creating it on first use
+ * @param library_handle Handle to a Library
+ * @param function_name Name of the function defined in the library
+ * @return ComputePipelineStateHandle on success, INVALID_HANDLE on error.
+ */
+ComputePipelineStateHandle mtlComputePipelineStateForFunction( LibraryHandle library_handle, const char * function_name )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPULibrary> library = HS.libraries.Handle2Object( library_handle );
+    if ( !library )
+    {
+        mtlStoreError( "Invalid library handle." );
+        return (ComputePipelineStateHandle)INVALID_HANDLE;
+    }
+    if ( !function_name )
+    {
+        mtlStoreError( "Library invalid or function name incorrect" );
+        return (ComputePipelineStateHandle)INVALID_HANDLE;
+    }
+
+    PipelineStateCache & cache = PipelineStateCache::getInstance();
+    std::string key = PipelineStateCache::Key( library.get(), function_name );
+    {
+        std::lock_guard<std::mutex> lock( cache.mutex );
+        auto entry = cache.entries.find( key );
+        if ( entry != cache.entries.end() )
+            return HS.compute_pipeline_states.Object2Handle( entry->second );
+    }
+
+    FunctionHandle function_handle = mtlNewFunction( library_handle, function_name );
+    if ( function_handle == INVALID_HANDLE )
+        return (ComputePipelineStateHandle)INVALID_HANDLE;
+    std::shared_ptr<CPUComputePipelineState> compute_pipeline_state = std::make_shared<CPUComputePipelineState>();
+    compute_pipeline_state->device = library->device;
+    compute_pipeline_state->function = HS.functions.Handle2Object( function_handle );
+    mtlFreeFunction( function_handle );
+
+    {
+        std::lock_guard<std::mutex> lock( cache.mutex );
+        compute_pipeline_state = cache.entries.emplace( key, compute_pipeline_state ).first->second;
+    }
+    return HS.compute_pipeline_states.Object2Handle( compute_pipeline_state );
+}
+
+
+/** Return the device on which the compute pipeline state was created
+ * @param compute_pipeline_state_handle The handle of the compute pipeline state
+ * @return DeviceHandle on succes, INVALID_HANDLE on error.
+ */
+DeviceHandle mtlComputePipelineStateDevice( ComputePipelineStateHandle compute_pipeline_state_handle )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUComputePipelineState> compute_pipeline_state = HS.compute_pipeline_states.Handle2Object( compute_pipeline_state_handle );
+    if ( !compute_pipeline_state )
+    {
+        mtlStoreError( "Invalid compute pipeline state handle." );
+        return (DeviceHandle)INVALID_HANDLE;
+    }
+    return HS.devices.Object2Handle( compute_pipeline_state->device );
+}
+
+
+/** Copy a pipeline state
+ * @param compute_pipeline_state_handle The handle of the compute pipeline state to copy
+ */
+ComputePipelineStateHandle mtlCopyComputePipelineState( ComputePipelineStateHandle compute_pipeline_state_handle )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUComputePipelineState> compute_pipeline_state = HS.compute_pipeline_states.Handle2Object( compute_pipeline_state_handle );
+    if ( !compute_pipeline_state )
+    {
+        mtlStoreError( "Invalid compute pipeline state handle." );
+        return (ComputePipelineStateHandle)INVALID_HANDLE;
+    }
+    return HS.compute_pipeline_states.Object2Handle( compute_pipeline_state );
+}
+
+
+/** Determine the maximum number of simultaneous threads.
+ * @param compute_pipeline_state_handle The handle of the compute pipeline state to query
+ */
+uint32_t mtlThreadExecutionWidth( ComputePipelineStateHandle compute_pipeline_state_handle )
+{
+    std::shared_ptr<CPUComputePipelineState> compute_pipeline_state = HandleStore::getInstance().compute_pipeline_states.Handle2Object( compute_pipeline_state_handle );
+    if ( !compute_pipeline_state )
+    {
+        mtlStoreError( "Invalid compute pipeline state handle." );
+        return 0;
+    }
+    return HOST_THREAD_EXECUTION_WIDTH;
+}
+
+
+/** Determine the largest number of threads in a threadgroup.
+ * @param compute_pipeline_state_handle The handle of the compute pipeline state to query
+ */
+uint32_t mtlMaxTotalThreadsPerThreadgroup( ComputePipelineStateHandle compute_pipeline_state_handle )
+{
+    std::shared_ptr<CPUComputePipelineState> compute_pipeline_state = HandleStore::getInstance().compute_pipeline_states.Handle2Object( compute_pipeline_state_handle );
+    if ( !compute_pipeline_state )
+    {
+        mtlStoreError( "Invalid compute pipeline state handle." );
+        return 0;
+    }
+    return HOST_MAX_THREADS_PER_THREADGROUP;
+}
+
+
+/** Free a pipeline state
+ * @param compute_pipeline_state_handle The handle of the compute pipeline state to free
+ */
+void mtlFreeComputePipelineState( ComputePipelineStateHandle compute_pipeline_state_handle )
+{
+    if ( compute_pipeline_state_handle != INVALID_HANDLE && !HandleStore::getInstance().compute_pipeline_states.Free( compute_pipeline_state_handle ) )
+        mtlStoreError( "Invalid compute pipeline state handle." );
+}
+
+
+#pragma mark Command Queues
+/** Create a new command queue
+ * @param device_handle The handle to the device on which the queue will be created
+ * @return CommandQueueHandle on success, INVALID_HANDLE on error.
+ */
+CommandQueueHandle mtlNewCommandQueue( DeviceHandle device_handle )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUDevice> device = HS.devices.Handle2Object( device_handle );
+    if ( !device )
+    {
+        mtlStoreError( "Invalid device handle." );
+        return (CommandQueueHandle)INVALID_HANDLE;
+    }
+
+    std::shared_ptr<CPUCommandQueue> command_queue = std::make_shared<CPUCommandQueue>();
+    command_queue->device = device;
+    return HS.command_queues.Object2Handle( command_queue );
+}
+
+
+/** Return the device on which the command queue was created
+ * @param command_queue_handle The handle of the command queue
+ * @return DeviceHandle on succes, INVALID_HANDLE on error.
+ */
+DeviceHandle mtlCommandQueueDevice( CommandQueueHandle command_queue_handle )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUCommandQueue> command_queue = HS.command_queues.Handle2Object( command_queue_handle );
+    if ( !command_queue )
+    {
+        mtlStoreError( "Invalid command queue handle." );
+        return (DeviceHandle)INVALID_HANDLE;
+    }
+    return HS.devices.Object2Handle( command_queue->device );
+}
+
+
+/** Free a command queue
+ * @param command_queue_handle The handle of the command queue to free
+ */
+void mtlFreeCommandQueue( CommandQueueHandle command_queue_handle )
+{
+    if ( command_queue_handle != INVALID_HANDLE && !HandleStore::getInstance().command_queues.Free( command_queue_handle ) )
+        mtlStoreError( "Invalid command queue handle." );
+}
+
+
+#pragma mark Buffers
+/** Create a new buffer on the GPU
+ * @param device_handle The handle to the device on which the buffer will be created
+ * @param bytes Size of the buffer in bytes
+ * @return BufferHandle on success, INVALID_HANDLE on error.
+ */
+BufferHandle mtlNewBuffer( DeviceHandle device_handle, uint64_t bytes )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUDevice> device = HS.devices.Handle2Object( device_handle );
+    if ( !device )
+    {
+        mtlStoreError( "Invalid device handle." );
+        return (BufferHandle)INVALID_HANDLE;
+    }
+
+    void * contents = nullptr;
+    if ( bytes == 0 || posix_memalign( &contents, HOST_BUFFER_ALIGNMENT, bytes ) != 0 )
+    {
+        mtlStoreError( "Error creating buffer." );
+        return (BufferHandle)INVALID_HANDLE;
+    }
+    PreferDeviceNode( *device, contents, bytes );
+
+    // Metal buffers start zeroed; touching the pages from the workers also spreads them across the cores.
+    device->pool->ParallelFor( bytes, std::max<uint64_t>( bytes / ( device->pool->Size() + 1 ), HOST_PARALLEL_COPY_THRESHOLD / 4 ), [ & ]( uint64_t first, uint64_t last ) {
+        memset( (uint8_t *)contents + first, 0, last - first );
+    } );
+
+    std::shared_ptr<CPUBuffer> buffer = std::make_shared<CPUBuffer>();
+    buffer->device = device;
+    buffer->contents = contents;
+    buffer->length = bytes;
+    device->allocated_bytes += (int64_t)bytes;
+    return HS.buffers.Object2Handle( buffer );
+}
+
+
+/** Create a new buffer with storage from the device's buffer pool
+ * @param device_handle The handle to the device on which the buffer will be created
+ * @param bytes Size of the buffer in bytes
+ * @return BufferHandle on success, INVALID_HANDLE on error.
+ */
+BufferHandle mtlNewPooledBuffer( DeviceHandle device_handle, uint64_t bytes )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUDevice> device = HS.devices.Handle2Object( device_handle );
+    if ( !device )
+    {
+        mtlStoreError( "Invalid device handle." );
+        return (BufferHandle)INVALID_HANDLE;
+    }
+    if ( bytes == 0 )
+    {
+        mtlStoreError( "Error creating buffer." );
+        return (BufferHandle)INVALID_HANDLE;
+    }
+
+    uint64_t capacity = BufferPool::SizeClass( bytes );
+    void * contents = device->buffer_pool.Acquire( capacity );
+    if ( !contents )
+    {
+        if ( posix_memalign( &contents, HOST_BUFFER_ALIGNMENT, capacity ) != 0 )
+        {
+            mtlStoreError( "Error creating buffer." );
+            return (BufferHandle)INVALID_HANDLE;
+        }
+        PreferDeviceNode( *device, contents, capacity );
+        device->buffer_pool.Reserve( capacity );
+        device->allocated_bytes += (int64_t)capacity;
+    }
+
+    std::shared_ptr<CPUBuffer> buffer = std::make_shared<CPUBuffer>();
+    buffer->device = device;
+    buffer->contents = contents;
+    buffer->length = bytes;
+    buffer->pooled_capacity = capacity;
+    return HS.buffers.Object2Handle( buffer );
+}
+
+
+/** Create a new buffer over a range of a file
+ * @param device_handle The handle to the device on which the buffer will be created
+ * @param path Path of the file
+ * @param offset Byte offset of the range in the file
+ * @param length Size of the range in bytes; zero for the rest of the file
+ * @param mode MTL_FILE_READ_ONLY or MTL_FILE_COPY_ON_WRITE
+ * @return BufferHandle on success, INVALID_HANDLE on error.
+ */
+BufferHandle mtlNewBufferFromFile( DeviceHandle device_handle, const char * path, uint64_t offset, uint64_t length, uint32_t mode )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUDevice> device = HS.devices.Handle2Object( device_handle );
+    if ( !device )
+    {
+        mtlStoreError( "Invalid device handle." );
+        return (BufferHandle)INVALID_HANDLE;
+    }
+    if ( mode != MTL_FILE_READ_ONLY && mode != MTL_FILE_COPY_ON_WRITE )
+    {
+        mtlStoreError( "Invalid file mapping mode." );
+        return (BufferHandle)INVALID_HANDLE;
+    }
+    if ( !path )
+    {
+        mtlStoreError( "No file path." );
+        return (BufferHandle)INVALID_HANDLE;
+    }
+
+    int fd = open( path, O_RDONLY | O_CLOEXEC );
+    if ( fd < 0 )
+    {
+        mtlStoreError( std::string( "Error opening file: " ) + strerror( errno ) );
+        return (BufferHandle)INVALID_HANDLE;
+    }
+    struct stat info;
+    if ( fstat( fd, &info ) != 0 || !S_ISREG( info.st_mode ) )
+    {
+        close( fd );
+        mtlStoreError( "Not a regular file." );
+        return (BufferHandle)INVALID_HANDLE;
+    }
+    uint64_t file_size = (uint64_t)info.st_size;
+    if ( length == 0 && offset < file_size )
+        length = file_size - offset;
+    if ( length == 0 || offset > file_size || length > file_size - offset )
+    {
+        close( fd );
+        mtlStoreError( "Range exceeds the file size." );
+        return (BufferHandle)INVALID_HANDLE;
+    }
+
+    // mmap needs a page-aligned file offset, so the mapping starts up to a page before the range.
+    uint64_t page = (uint64_t)sysconf( _SC_PAGESIZE );
+    uint64_t lead = offset % page;
+    uint64_t mapping_length = lead + length;
+    int protection = mode == MTL_FILE_READ_ONLY ? PROT_READ : PROT_READ | PROT_WRITE;
+    int flags = mode == MTL_FILE_READ_ONLY ? MAP_SHARED : MAP_PRIVATE;
+    void * mapping = mmap( nullptr, mapping_length, protection, flags, fd, (off_t)( offset - lead ) );
+    close( fd );
+    if ( mapping == MAP_FAILED )
+    {
+        mtlStoreError( std::string( "Error mapping file: " ) + strerror( errno ) );
+        return (BufferHandle)INVALID_HANDLE;
+    }
+    // Kernels mostly sweep buffers from start to end, so read ahead aggressively and start on the first pages now.
+    madvise( mapping, mapping_length, MADV_SEQUENTIAL );
+    madvise( mapping, std::min( mapping_length, HOST_FILE_PREFETCH_BYTES ), MADV_WILLNEED );
+
+    std::shared_ptr<CPUBuffer> buffer = std::make_shared<CPUBuffer>();
+    buffer->device = device;
+    buffer->contents = (uint8_t *)mapping + lead;
+    buffer->length = length;
+    buffer->release = [ mapping, mapping_length ]() { munmap( mapping, mapping_length ); };
+    buffer->read_only = mode == MTL_FILE_READ_ONLY;
+    return HS.buffers.Object2Handle( buffer );
+}
+
+
+/** Alignment of the memory mtlNewBufferWithHostPointer can wrap on a device
+ * @param device_handle The handle to the device
+ * @return The alignment in bytes (the page size on Metal), 0 on error
+ */
+uint64_t mtlHostPointerAlignment( DeviceHandle device_handle )
+{
+    if ( !HandleStore::getInstance().devices.Handle2Object( device_handle ) )
+    {
+        mtlStoreError( "Invalid device handle." );
+        return 0;
+    }
+    return HOST_POINTER_ALIGNMENT;
+}
+
+
+/** Create a new buffer using caller memory as its storage, without a copy
+ * @param device_handle The handle to the device on which the buffer will be created
+ * @param pointer The memory to wrap
+ * @param bytes Size of the memory in bytes
+ * @param deallocator Called with pointer, bytes and user_data once the buffer is released, or NULL
+ * @param user_data Passed to the deallocator
+ * @return BufferHandle on success, INVALID_HANDLE on error.
+ */
+BufferHandle mtlNewBufferWithHostPointer( DeviceHandle device_handle, void * pointer, uint64_t bytes, mtlHostDeallocator deallocator, void * user_data )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUDevice> device = HS.devices.Handle2Object( device_handle );
+    if ( !device )
+    {
+        mtlStoreError( "Invalid device handle." );
+        return (BufferHandle)INVALID_HANDLE;
+    }
+    if ( !pointer || bytes == 0 )
+    {
+        mtlStoreError( "No memory to wrap." );
+        return (BufferHandle)INVALID_HANDLE;
+    }
+    if ( (uintptr_t)pointer % HOST_POINTER_ALIGNMENT != 0 )
+    {
+        mtlStoreError( "Host pointer is not aligned to mtlHostPointerAlignment." );
+        return (BufferHandle)INVALID_HANDLE;
+    }
+
+    // Commands hold the buffer until they complete, so the deallocator runs after the last of them.
+    std::shared_ptr<CPUBuffer> buffer = std::make_shared<CPUBuffer>();
+    buffer->device = device;
+    buffer->contents = pointer;
+    buffer->length = bytes;
+    buffer->release = [ pointer, bytes, deallocator, user_data ]() {
+        if ( deallocator )
+            deallocator( pointer, bytes, user_data );
+    };
+    return HS.buffers.Object2Handle( buffer );
+}
+
+
+/** Retrieve the buffer pool counters of a device
+ * @param device_handle The handle to the device
+ * @param stats Pointer to a struct to receive the counters
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlGetBufferPoolStats( DeviceHandle device_handle, mtlBufferPoolStats * stats )
+{
+    std::shared_ptr<CPUDevice> device = HandleStore::getInstance().devices.Handle2Object( device_handle );
+    if ( !device )
+    {
+        mtlStoreError( "Invalid device handle." );
+        return MTL_ERROR;
+    }
+
+    BufferPool & buffer_pool = device->buffer_pool;
+    std::lock_guard<std::mutex> lock( buffer_pool.mutex );
+    stats->reserved_bytes = buffer_pool.reserved_bytes;
+    stats->in_use_bytes = buffer_pool.in_use_bytes;
+    stats->hits = buffer_pool.hits;
+    stats->misses = buffer_pool.misses;
+    return MTL_SUCCESS;
+}
+
+
+/** Release idle buffer pool storage of a device
+ * @param device_handle The handle to the device
+ * @param max_idle_bytes Idle storage to keep for reuse; zero releases all of it
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlTrimBufferPool( DeviceHandle device_handle, uint64_t max_idle_bytes )
+{
+    std::shared_ptr<CPUDevice> device = HandleStore::getInstance().devices.Handle2Object( device_handle );
+    if ( !device )
+    {
+        mtlStoreError( "Invalid device handle." );
+        return MTL_ERROR;
+    }
+    device->allocated_bytes -= (int64_t)device->buffer_pool.Trim( max_idle_bytes );
+    return MTL_SUCCESS;
+}
+
+
+/** Copy data into the GPU buffer
+ * @param buffer_handle The handle to the buffer to copy data into
+ * @param data A pointer to data to copy into the GPU buffer
+ * @param bytes Number of bytes to copy
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCopyDataToBuffer( BufferHandle buffer_handle, const void * data, uint64_t bytes )
+{
+    return mtlCopyDataToBufferRange( buffer_handle, 0, data, bytes );
+}
+
+
+/** Copy data from the GPU buffer
+ * @param buffer_handle The handle to the buffer to copy data from
+ * @param data A pointer to copy the data into
+ * @param bytes Number of bytes to copy
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCopyDataFromBuffer( BufferHandle buffer_handle, void * data, uint64_t bytes )
+{
+    return mtlCopyDataFromBufferRange( buffer_handle, 0, data, bytes );
+}
+
+
+/** Copy data into part of a GPU buffer
+ * @param buffer_handle The handle to the buffer to copy data into
+ * @param offset Byte offset in the buffer at which to start writing
+ * @param data A pointer to data to copy into the GPU buffer
+ * @param bytes Number of bytes to copy
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCopyDataToBufferRange( BufferHandle buffer_handle, uint64_t offset, const void * data, uint64_t bytes )
+{
+    std::shared_ptr<CPUBuffer> buffer = HandleStore::getInstance().buffers.Handle2Object( buffer_handle );
+    if ( !buffer )
+    {
+        mtlStoreError( "Invalid buffer handle." );
+        return MTL_ERROR;
+    }
+
+    if ( !CheckWritable( *buffer ) )
+        return MTL_ERROR;
+    if ( offset > buffer->length || bytes > buffer->length - offset )
+    {
+        mtlStoreError( "Buffer too small to copy data." );
+        return MTL_ERROR;
+    }
+    HostTraceScope trace( TRACE_COPY_IN, "Copy to buffer", buffer_handle, bytes );
+    ParallelCopy( *buffer->device, (uint8_t *)buffer->contents + offset, data, bytes );
+    return MTL_SUCCESS;
+}
+
+
+/** Copy data from part of a GPU buffer
+ * @param buffer_handle The handle to the buffer to copy data from
+ * @param offset Byte offset in the buffer at which to start reading
+ * @param data A pointer to copy the data into
+ * @param bytes Number of bytes to copy
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCopyDataFromBufferRange( BufferHandle buffer_handle, uint64_t offset, void * data, uint64_t bytes )
+{
+    std::shared_ptr<CPUBuffer> buffer = HandleStore::getInstance().buffers.Handle2Object( buffer_handle );
+    if ( !buffer )
+    {
+        mtlStoreError( "Invalid buffer handle." );
+        return MTL_ERROR;
+    }
+
+    if ( offset > buffer->length || bytes > buffer->length - offset )
+    {
+        mtlStoreError( "Buffer smaller than specified number of bytes to copy." );
+        return MTL_ERROR;
+    }
+    HostTraceScope trace( TRACE_COPY_OUT, "Copy from buffer", buffer_handle, bytes );
+    ParallelCopy( *buffer->device, data, (const uint8_t *)buffer->contents + offset, bytes );
+    return MTL_SUCCESS;
+}
+
+
+/** Copy floats into a buffer, converting them to the buffer's element format
+ * @param buffer_handle The handle to the buffer to copy data into
+ * @param first_element Zero-based index of the first buffer element to write
+ * @param data The floats to copy
+ * @param count Number of elements to copy
+ * @param format One of the MTL_FORMAT_ element formats
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCopyFloatsToBuffer( BufferHandle buffer_handle, uint64_t first_element, const float * data, uint64_t count, uint32_t format )
+{
+    std::shared_ptr<CPUBuffer> buffer = HandleStore::getInstance().buffers.Handle2Object( buffer_handle );
+    if ( !buffer )
+    {
+        mtlStoreError( "Invalid buffer handle." );
+        return MTL_ERROR;
+    }
+    uint64_t element_size = mtlFormatSize( format );
+    if ( element_size == 0 )
+    {
+        mtlStoreError( "Unknown element format." );
+        return MTL_ERROR;
+    }
+
+    if ( !CheckWritable( *buffer ) )
+        return MTL_ERROR;
+
+    uint64_t elements = buffer->length / element_size;
+    if ( first_element > elements || count > elements - first_element )
+    {
+        mtlStoreError( "Buffer too small to copy data." );
+        return MTL_ERROR;
+    }
+    HostTraceScope trace( TRACE_COPY_IN, "Copy floats to buffer", buffer_handle, count * element_size );
+    ParallelConvert( *buffer->device, format, (uint8_t *)buffer->contents + first_element * element_size, const_cast<float *>( data ), count, true );
+    return MTL_SUCCESS;
+}
+
+
+/** Copy elements of a buffer out as floats, converting them from the buffer's element format
+ * @param buffer_handle The handle to the buffer to copy data from
+ * @param first_element Zero-based index of the first buffer element to read
+ * @param data Receives count floats
+ * @param count Number of elements to copy
+ * @param format One of the MTL_FORMAT_ element formats
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCopyFloatsFromBuffer( BufferHandle buffer_handle, uint64_t first_element, float * data, uint64_t count, uint32_t format )
+{
+    std::shared_ptr<CPUBuffer> buffer = HandleStore::getInstance().buffers.Handle2Object( buffer_handle );
+    if ( !buffer )
+    {
+        mtlStoreError( "Invalid buffer handle." );
+        return MTL_ERROR;
+    }
+    uint64_t element_size = mtlFormatSize( format );
+    if ( element_size == 0 )
+    {
+        mtlStoreError( "Unknown element format." );
+        return MTL_ERROR;
+    }
+
+    uint64_t elements = buffer->length / element_size;
+    if ( first_element > elements || count > elements - first_element )
+    {
+        mtlStoreError( "Buffer smaller than specified number of elements to copy." );
+        return MTL_ERROR;
+    }
+    HostTraceScope trace( TRACE_COPY_OUT, "Copy floats from buffer", buffer_handle, count * element_size );
+    ParallelConvert( *buffer->device, format, (uint8_t *)buffer->contents + first_element * element_size, data, count, false );
+    return MTL_SUCCESS;
+}
+
+
+/** Copy a block of elements into a sub-block of a three-dimensional array held in a GPU buffer
+ * @param buffer_handle The handle to the buffer to copy data into
+ * @param buffer_dimensions Dimensions of the array in the buffer, in elements
+ * @param origin Zero-based index of the first element of the sub-block in each dimension
+ * @param region Dimensions of the sub-block, in elements
+ * @param element_size Size of one element in bytes
+ * @param data A pointer to the region[0] * region[1] * region[2] elements to copy
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCopyRegionToBuffer( BufferHandle buffer_handle, const uint64_t buffer_dimensions[3], const uint64_t origin[3], const uint64_t region[3], uint32_t element_size, const void * data )
+{
+    std::shared_ptr<CPUBuffer> buffer = HandleStore::getInstance().buffers.Handle2Object( buffer_handle );
+    if ( !buffer )
+    {
+        mtlStoreError( "Invalid buffer handle." );
+        return MTL_ERROR;
+    }
+
+    if ( !CheckWritable( *buffer ) )
+        return MTL_ERROR;
+
+    mtlRegionLayout layout;
+    if ( !mtlMakeRegionLayout( buffer_dimensions, origin, region, element_size, buffer->length, &layout ) )
+    {
+        mtlStoreError( "Region does not fit the buffer dimensions." );
+        return MTL_ERROR;
+    }
+    HostTraceScope trace( TRACE_COPY_IN, "Copy region to buffer", buffer_handle, region[0] * region[1] * region[2] * element_size );
+    if ( layout.run_bytes > 0 )
+        CopyRegion( *buffer->device, layout, (uint8_t *)buffer->contents, (uint8_t *)const_cast<void *>( data ), true );
+    return MTL_SUCCESS;
+}
+
+
+/** Copy a sub-block of a three-dimensional array held in a GPU buffer into a dense array
+ * @param buffer_handle The handle to the buffer to copy data from
+ * @param buffer_dimensions Dimensions of the array in the buffer, in elements
+ * @param origin Zero-based index of the first element of the sub-block in each dimension
+ * @param region Dimensions of the sub-block, in elements
+ * @param element_size Size of one element in bytes
+ * @param data A pointer to room for region[0] * region[1] * region[2] elements
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCopyRegionFromBuffer( BufferHandle buffer_handle, const uint64_t buffer_dimensions[3], const uint64_t origin[3], const uint64_t region[3], uint32_t element_size, void * data )
+{
+    std::shared_ptr<CPUBuffer> buffer = HandleStore::getInstance().buffers.Handle2Object( buffer_handle );
+    if ( !buffer )
+    {
+        mtlStoreError( "Invalid buffer handle." );
+        return MTL_ERROR;
+    }
+
+    mtlRegionLayout layout;
+    if ( !mtlMakeRegionLayout( buffer_dimensions, origin, region, element_size, buffer->length, &layout ) )
+    {
+        mtlStoreError( "Region does not fit the buffer dimensions." );
+        return MTL_ERROR;
+    }
+    HostTraceScope trace( TRACE_COPY_OUT, "Copy region from buffer", buffer_handle, region[0] * region[1] * region[2] * element_size );
+    if ( layout.run_bytes > 0 )
+        CopyRegion( *buffer->device, layout, (uint8_t *)buffer->contents, (uint8_t *)data, false );
+    return MTL_SUCCESS;
+}
+
+
+/** Map a buffer for direct host access to its storage
+ * @param buffer_handle The handle to the buffer to map
+ * @param map_flags MTL_MAP_READ, MTL_MAP_WRITE or MTL_MAP_READ_WRITE
+ * @return A pointer to the buffer contents, NULL on error
+ */
+void * mtlMapBuffer( BufferHandle buffer_handle, uint32_t map_flags )
+{
+    std::shared_ptr<CPUBuffer> buffer = HandleStore::getInstance().buffers.Handle2Object( buffer_handle );
+    if ( !buffer )
+    {
+        mtlStoreError( "Invalid buffer handle." );
+        return nullptr;
+    }
+
+    if ( map_flags == 0 || ( map_flags & ~(uint32_t)MTL_MAP_READ_WRITE ) != 0 )
+    {
+        mtlStoreError( "Invalid buffer map flags." );
+        return nullptr;
+    }
+    if ( ( map_flags & MTL_MAP_WRITE ) && !CheckWritable( *buffer ) )
+        return nullptr;
+
+    // Host and device share the same memory, so commands that have completed
+    // are already visible and host writes need no flush.
+    buffer->map_count++;
+    return buffer->contents;
+}
+
+
+/** Unmap a buffer previously mapped with mtlMapBuffer
+ * @param buffer_handle The handle to the mapped buffer
+ * @param dirty_offset Offset in bytes of the first modified byte
+ * @param dirty_length Number of modified bytes
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlUnmapBuffer( BufferHandle buffer_handle, uint64_t dirty_offset, uint64_t dirty_length )
+{
+    std::shared_ptr<CPUBuffer> buffer = HandleStore::getInstance().buffers.Handle2Object( buffer_handle );
+    if ( !buffer )
+    {
+        mtlStoreError( "Invalid buffer handle." );
+        return MTL_ERROR;
+    }
+
+    if ( dirty_offset > buffer->length || dirty_length > buffer->length - dirty_offset )
+    {
+        mtlStoreError( "Dirty range exceeds the buffer size." );
+        return MTL_ERROR;
+    }
+
+    uint32_t count = buffer->map_count.load();
+    do {
+        if ( count == 0 )
+        {
+            mtlStoreError( "Buffer is not mapped." );
+            return MTL_ERROR;
+        }
+    } while ( !buffer->map_count.compare_exchange_weak( count, count - 1 ) );
+    return MTL_SUCCESS;
+}
+
+
+/** Return the size of a buffer
+ * @param buffer_handle The handle of the buffer to free
+ * @return MTL_ERROR if the buffer is of zero size or does not exist, size of the allocated buffer otherwise.
+ */
+uint64_t mtlBufferSize( BufferHandle buffer_handle )
+{
+    std::shared_ptr<CPUBuffer> buffer = HandleStore::getInstance().buffers.Handle2Object( buffer_handle );
+    if ( !buffer )
+    {
+        mtlStoreError( "Invalid buffer handle." );
+        return MTL_ERROR;
+    }
+    return buffer->length;
+}
+
+
+/** Return the device on which the buffer was created
+ * @param buffer_handle The handle of the buffer to free
+ * @return DeviceHandle on succes, INVALID_HANDLE on error.
+ */
+DeviceHandle mtlBufferDevice( BufferHandle buffer_handle )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUBuffer> buffer = HS.buffers.Handle2Object( buffer_handle );
+    if ( !buffer )
+    {
+        mtlStoreError( "Invalid buffer handle." );
+        return (DeviceHandle)INVALID_HANDLE;
+    }
+    return HS.devices.Object2Handle( buffer->device );
+}
+
+
+/** Free a GPU buffer
+ * @param buffer_handle The handle of the buffer to free
+ */
+void mtlFreeBuffer( BufferHandle buffer_handle )
+{
+    if ( !HandleStore::getInstance().buffers.Free( buffer_handle ) )
+        mtlStoreError( "Invalid buffer handle." );
+}
+
+
+#pragma mark Command Buffers
+/** Create a command buffer
+ * @param command_queue_handle A handle to a command queue on which to create the command buffer
+ * @return A handle to a command buffer or INVALID_HANDLE on error
+ */
+CommandBufferHandle mtlNewCommandBuffer( CommandQueueHandle command_queue_handle )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUCommandQueue> command_queue = HS.command_queues.Handle2Object( command_queue_handle );
+    if ( !command_queue )
+    {
+        mtlStoreError( "Invalid command queue handle." );
+        return (CommandBufferHandle)INVALID_HANDLE;
+    }
+
+    std::shared_ptr<CPUCommandBuffer> command_buffer = std::make_shared<CPUCommandBuffer>();
+    command_buffer->command_queue = command_queue;
+    return HS.command_buffers.Object2Handle( command_buffer );
+}
+
+
+/** Return the device on which the command buffer was created
+ * @param command_buffer_handle The handle of the command buffer
+ * @return DeviceHandle on succes, INVALID_HANDLE on error.
+ */
+DeviceHandle mtlCommandBufferDevice( CommandBufferHandle command_buffer_handle )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUCommandBuffer> command_buffer = HS.command_buffers.Handle2Object( command_buffer_handle );
+    if ( !command_buffer )
+    {
+        mtlStoreError( "Invalid command buffer handle." );
+        return (DeviceHandle)INVALID_HANDLE;
+    }
+    return HS.devices.Object2Handle( command_buffer->command_queue->device );
+}
+
+
+/** Copy a command buffer
+ * @param command_buffer_handle The handle of the command buffer to copy
+ */
+CommandBufferHandle mtlCopyCommandBuffer( CommandBufferHandle command_buffer_handle )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUCommandBuffer> command_buffer = HS.command_buffers.Handle2Object( command_buffer_handle );
+    if ( !command_buffer )
+    {
+        mtlStoreError( "Invalid command buffer handle." );
+        return (CommandBufferHandle)INVALID_HANDLE;
+    }
+    return HS.command_buffers.Object2Handle( command_buffer );
+}
+
+
+/** Free a command buffer
+ * @param command_buffer_handle The handle of the command buffer to free
+ */
+void mtlFreeCommandBuffer( CommandBufferHandle command_buffer_handle )
+{
+    if ( command_buffer_handle != INVALID_HANDLE && !HandleStore::getInstance().command_buffers.Free( command_buffer_handle ) )
+        mtlStoreError( "Invalid command buffer handle." );
+}
+
+
+/** Commit a command buffer for execution
+ * @param command_buffer_handle The handle of the command buffer to free
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCommitCommandBuffer( CommandBufferHandle command_buffer_handle )
+{
+    std::shared_ptr<CPUCommandBuffer> command_buffer = HandleStore::getInstance().command_buffers.Handle2Object( command_buffer_handle );
+    if ( !command_buffer )
+    {
+        mtlStoreError( "Invalid command buffer handle." );
+        return MTL_ERROR;
+    }
+
+    HostTraceScope trace( TRACE_COMMIT, "Commit", command_buffer_handle, 0 );
+    {
+        std::lock_guard<std::mutex> lock( command_buffer->mutex );
+        if ( command_buffer->status != MTL_COMMAND_BUFFER_NOT_ENQUEUED )
+        {
+            mtlStoreError( "Command buffer has already been committed." );
+            return MTL_ERROR;
+        }
+        if ( Profiling() )
+        {
+            command_buffer->profiled = true;
+            command_buffer->committed_handle = command_buffer_handle;
+            command_buffer->timing.commit_time = ProfileTime();
+            if ( command_buffer->timing.encode_start != 0 )
+            {
+                mtlTraceEvent encode;
+                mtlTraceEventInit( &encode, TRACE_ENCODE, "Encode", command_buffer->timing.encode_start, command_buffer->timing.encode_end );
+                encode.thread = HostThreadNumber();
+                encode.handle = command_buffer_handle;
+                RecordTraceEvents( &encode, 1 );
+            }
+        }
+        command_buffer->status = MTL_COMMAND_BUFFER_COMMITTED;
+    }
+
+    command_buffer->command_queue->device->command_scheduler->Submit( command_buffer->command_queue.get(), [ command_buffer ]() {
+        return ExecuteCommandBuffer( *command_buffer );
+    } );
+    return MTL_SUCCESS;
+}
+
+/** Wait for a command buffer to complete
+ * @param command_buffer_handle The handle of the command buffer to free
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlWaitForCompletion( CommandBufferHandle command_buffer_handle )
+{
+    return mtlWaitAllCommandBuffers( &command_buffer_handle, 1 );
+}
+
+
+/** Query the execution status of a command buffer without blocking
+ * @param command_buffer_handle The handle of the command buffer
+ * @param status Receives one of the MTL_COMMAND_BUFFER_ status values
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCommandBufferStatus( CommandBufferHandle command_buffer_handle, uint32_t * status )
+{
+    std::shared_ptr<CPUCommandBuffer> command_buffer = HandleStore::getInstance().command_buffers.Handle2Object( command_buffer_handle );
+    if ( !command_buffer )
+    {
+        mtlStoreError( "Invalid command buffer handle." );
+        return MTL_ERROR;
+    }
+
+    *status = command_buffer->status;
+    return MTL_SUCCESS;
+}
+
+
+/** Register a handler to call when a command buffer completes
+ * @param command_buffer_handle The handle of the command buffer
+ * @param handler The function to call on completion
+ * @param user_data Passed unchanged to the handler
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlAddCompletedHandler( CommandBufferHandle command_buffer_handle, mtlCompletionHandler handler, void * user_data )
+{
+    std::shared_ptr<CPUCommandBuffer> command_buffer = HandleStore::getInstance().command_buffers.Handle2Object( command_buffer_handle );
+    if ( !command_buffer )
+    {
+        mtlStoreError( "Invalid command buffer handle." );
+        return MTL_ERROR;
+    }
+
+    if ( !handler )
+    {
+        mtlStoreError( "Invalid completion handler." );
+        return MTL_ERROR;
+    }
+
+    std::lock_guard<std::mutex> lock( command_buffer->mutex );
+    if ( command_buffer->status != MTL_COMMAND_BUFFER_NOT_ENQUEUED )
+    {
+        mtlStoreError( "Command buffer has already been committed." );
+        return MTL_ERROR;
+    }
+    command_buffer->completed_handlers.push_back( { handler, command_buffer_handle, user_data } );
+    return MTL_SUCCESS;
+}
+
+
+/** Wait until any one of several committed command buffers has completed
+ * @param command_buffer_handles Array of command buffer handles
+ * @param count Number of handles in the array
+ * @param completed_index Receives the zero-based index of a completed command buffer
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlWaitAnyCommandBuffer( const CommandBufferHandle * command_buffer_handles, uint32_t count, uint32_t * completed_index )
+{
+    std::vector<std::shared_ptr<CPUCommandBuffer>> command_buffers;
+    if ( !CommittedCommandBuffers( command_buffer_handles, count, command_buffers ) )
+        return MTL_ERROR;
+
+    HostTraceScope trace( TRACE_WAIT, "Wait", count == 1 ? command_buffer_handles[0] : INVALID_HANDLE, 0 );
+    std::unique_lock<std::mutex> lock( CompletionMutex );
+    while ( true )
+    {
+        for ( uint32_t i = 0; i < count; i++ )
+        {
+            if ( CommandBufferFinished( *command_buffers[ i ] ) )
+            {
+                if ( completed_index )
+                    *completed_index = i;
+                return MTL_SUCCESS;
+            }
+        }
+        CompletionCondition.wait( lock );
+    }
+}
+
+
+/** Wait until all of several committed command buffers have completed
+ * @param command_buffer_handles Array of command buffer handles
+ * @param count Number of handles in the array
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlWaitAllCommandBuffers( const CommandBufferHandle * command_buffer_handles, uint32_t count )
+{
+    std::vector<std::shared_ptr<CPUCommandBuffer>> command_buffers;
+    if ( !CommittedCommandBuffers( command_buffer_handles, count, command_buffers ) )
+        return MTL_ERROR;
+
+    HostTraceScope trace( TRACE_WAIT, "Wait", count == 1 ? command_buffer_handles[0] : INVALID_HANDLE, 0 );
+    std::unique_lock<std::mutex> lock( CompletionMutex );
+    for ( const std::shared_ptr<CPUCommandBuffer> & command_buffer : command_buffers )
+    {
+        while ( !CommandBufferFinished( *command_buffer ) )
+            CompletionCondition.wait( lock );
+    }
+    return MTL_SUCCESS;
+}
+
+
+#pragma mark Events
+/** Create an event
+ * @param device_handle The device whose command buffers use the event
+ * @return A handle to an event or INVALID_HANDLE on error
+ */
+EventHandle mtlNewEvent( DeviceHandle device_handle )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    if ( !HS.devices.Handle2Object( device_handle ) )
+    {
+        mtlStoreError( "Invalid device handle." );
+        return (EventHandle)INVALID_HANDLE;
+    }
+    return HS.events.Object2Handle( std::make_shared<CPUEvent>() );
+}
+
+
+/** Free an event
+ * @param event_handle The handle of the event to free
+ */
+void mtlFreeEvent( EventHandle event_handle )
+{
+    if ( event_handle != INVALID_HANDLE && !HandleStore::getInstance().events.Free( event_handle ) )
+        mtlStoreError( "Invalid event handle." );
+}
+
+
+/** Return the value an event was last signalled with
+ * @param event_handle The handle of the event
+ * @param value Receives the value
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlEventSignaledValue( EventHandle event_handle, uint64_t * value )
+{
+    std::shared_ptr<CPUEvent> event = HandleStore::getInstance().events.Handle2Object( event_handle );
+    if ( !event )
+    {
+        mtlStoreError( "Invalid event handle." );
+        return MTL_ERROR;
+    }
+
+    *value = EventValue( *event );
+    return MTL_SUCCESS;
+}
+
+
+/** Signal an event from the host
+ * @param event_handle The handle of the event
+ * @param value The new value of the event
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlSignalEvent( EventHandle event_handle, uint64_t value )
+{
+    std::shared_ptr<CPUEvent> event = HandleStore::getInstance().events.Handle2Object( event_handle );
+    if ( !event )
+    {
+        mtlStoreError( "Invalid event handle." );
+        return MTL_ERROR;
+    }
+
+    SignalEvent( *event, value );
+    return MTL_SUCCESS;
+}
+
+
+/** Wait on the host until an event reaches a value
+ * @param event_handle The handle of the event
+ * @param value The value to wait for
+ * @param timeout_ms Milliseconds to wait at most, or MTL_WAIT_FOREVER
+ * @return MTL_SUCCESS once the value is reached, MTL_ERROR on timeout or error
+ */
+uint32_t mtlWaitForEvent( EventHandle event_handle, uint64_t value, uint64_t timeout_ms )
+{
+    std::shared_ptr<CPUEvent> event = HandleStore::getInstance().events.Handle2Object( event_handle );
+    if ( !event )
+    {
+        mtlStoreError( "Invalid event handle." );
+        return MTL_ERROR;
+    }
+
+    HostTraceScope trace( TRACE_WAIT, "Wait for event", event_handle, 0 );
+    std::unique_lock<std::mutex> lock( event->mutex );
+    auto reached = [ & ]() { return event->value >= value; };
+    // Timeouts beyond a year are treated as forever, so the deadline cannot overflow.
+    if ( timeout_ms >= 365ull * 24 * 3600 * 1000 )
+        event->signalled.wait( lock, reached );
+    else if ( !event->signalled.wait_for( lock, std::chrono::milliseconds( timeout_ms ), reached ) )
+    {
+        mtlStoreError( "Timed out waiting for the event." );
+        return MTL_ERROR;
+    }
+    return MTL_SUCCESS;
+}
+
+
+/** Encode a signal of an event into a command buffer
+ * @param command_buffer_handle The handle of a command buffer not yet committed
+ * @param event_handle The handle of the event
+ * @param value The value to signal
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlEncodeSignalEvent( CommandBufferHandle command_buffer_handle, EventHandle event_handle, uint64_t value )
+{
+    return EncodeEventCommand( command_buffer_handle, event_handle, value, true );
+}
+
+
+/** Encode a wait for an event into a command buffer
+ * @param command_buffer_handle The handle of a command buffer not yet committed
+ * @param event_handle The handle of the event
+ * @param value The value to wait for
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlEncodeWaitForEvent( CommandBufferHandle command_buffer_handle, EventHandle event_handle, uint64_t value )
+{
+    return EncodeEventCommand( command_buffer_handle, event_handle, value, false );
+}
+
+
+#pragma mark Command Encoders
+/** Create a command encoder
+ * @param command_buffer_handle A handle to a command buffer on which to create the command encoder
+ * @return A handle to a command encoder or INVALID_HANDLE on error
+ */
+CommandEncoderHandle mtlNewCommandEncoder( CommandBufferHandle command_buffer_handle )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUCommandBuffer> command_buffer = HS.command_buffers.Handle2Object( command_buffer_handle );
+    if ( !command_buffer )
+    {
+        mtlStoreError( "Invalid command buffer handle." );
+        return (CommandEncoderHandle)INVALID_HANDLE;
+    }
+
+    std::shared_ptr<CPUCommandEncoder> command_encoder = std::make_shared<CPUCommandEncoder>();
+    command_encoder->command_buffer = command_buffer;
+    return HS.command_encoders.Object2Handle( command_encoder );
+}
+
+
+/** Create a command encoder whose dispatches run one after another or concurrently
+ * @param command_buffer_handle A handle to a command buffer on which to create the command encoder
+ * @param dispatch_type MTL_DISPATCH_SERIAL or MTL_DISPATCH_CONCURRENT
+ * @return A handle to a command encoder or INVALID_HANDLE on error
+ */
+CommandEncoderHandle mtlNewCommandEncoderWithDispatchType( CommandBufferHandle command_buffer_handle, uint32_t dispatch_type )
+{
+    if ( dispatch_type != MTL_DISPATCH_SERIAL && dispatch_type != MTL_DISPATCH_CONCURRENT )
+    {
+        mtlStoreError( "Invalid dispatch type." );
+        return (CommandEncoderHandle)INVALID_HANDLE;
+    }
+
+    CommandEncoderHandle command_encoder_handle = mtlNewCommandEncoder( command_buffer_handle );
+    if ( command_encoder_handle == INVALID_HANDLE || dispatch_type == MTL_DISPATCH_SERIAL )
+        return command_encoder_handle;
+
+    static std::atomic<uint64_t> next_group( 1 );
+    HandleStore::getInstance().command_encoders.Handle2Object( command_encoder_handle )->concurrent_group = next_group++;
+    return command_encoder_handle;
+}
+
+
+/** Free a command encoder
+ * @param command_encoder_handle The handle of the command encoder to free
+ */
+void mtlFreeCommandEncoder( CommandEncoderHandle command_encoder_handle )
+{
+    if ( command_encoder_handle != INVALID_HANDLE && !HandleStore::getInstance().command_encoders.Free( command_encoder_handle ) )
+        mtlStoreError( "Invalid command encoder handle." );
+}
+
+
+/** Set a compute pipeline state (the function to execute) to a command buffer via its command encoder
+ * @param command_encoder_handle The handle of the command encoder to use
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlSetComputePipelineState( CommandEncoderHandle command_encoder_handle, ComputePipelineStateHandle compute_pipeline_state_handle )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUCommandEncoder> command_encoder = HS.command_encoders.Handle2Object( command_encoder_handle );
+    if ( !command_encoder )
+    {
+        mtlStoreError( "Invalid command encoder handle." );
+        return MTL_ERROR;
+    }
+
+    std::shared_ptr<CPUComputePipelineState> compute_pipeline_state = HS.compute_pipeline_states.Handle2Object( compute_pipeline_state_handle );
+    if ( !compute_pipeline_state )
+    {
+        mtlStoreError( "Invalid compute pipeline state handle." );
+        return MTL_ERROR;
+    }
+
+    command_encoder->compute_pipeline_state = compute_pipeline_state;
+    return MTL_SUCCESS;
+}
+
+
+/** Associate a GPU buffer with a command buffer via its command encoder
+ * @param command_encoder_handle The handle of the command encoder to use
+ * @param buffer_handle The handle of a buffer to associate with the command encoder
+ * @param index The index of the association, zero-based, below MTL_DISPATCH_MAX_BUFFERS.
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlSetBuffer( CommandEncoderHandle command_encoder_handle, BufferHandle buffer_handle, uint32_t index )
 {
-    return 0;
+    return mtlSetBufferWithAccess( command_encoder_handle, buffer_handle, index, MTL_BUFFER_ACCESS_READ_WRITE );
 }
 
 
-/**
- * Get a DeviceHandle for the specified index
- * @param index Index of the device (zero-based up to mtlNumberOfDevices -1)
- * @return A DeviceHandle of the device at the index, INVALID_HANDLE on error
+/** Associate a buffer with the command encoder, saying whether the kernel writes it
+ * @param command_encoder_handle The handle of the command encoder to use
+ * @param buffer_handle The handle of a buffer to associate with the command encoder
+ * @param index The index of the association, zero-based, below MTL_DISPATCH_MAX_BUFFERS.
+ * @param access MTL_BUFFER_ACCESS_READ_WRITE or MTL_BUFFER_ACCESS_READ
+ * @return MTL_SUCCESS or MTL_ERROR
  */
-DeviceHandle mtlGetDeviceAtIndex( uint32_t index )
+uint32_t mtlSetBufferWithAccess( CommandEncoderHandle command_encoder_handle, BufferHandle buffer_handle, uint32_t index, uint32_t access )
 {
-    return (DeviceHandle)INVALID_HANDLE;
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUCommandEncoder> command_encoder = HS.command_encoders.Handle2Object( command_encoder_handle );
+    if ( !command_encoder )
+    {
+        mtlStoreError( "Invalid command encoder handle." );
+        return MTL_ERROR;
+    }
+
+    std::shared_ptr<CPUBuffer> buffer = HS.buffers.Handle2Object( buffer_handle );
+    if ( !buffer )
+    {
+        mtlStoreError( "Invalid buffer handle." );
+        return MTL_ERROR;
+    }
+
+    if ( access != MTL_BUFFER_ACCESS_READ_WRITE && access != MTL_BUFFER_ACCESS_READ )
+    {
+        mtlStoreError( "Invalid buffer access." );
+        return MTL_ERROR;
+    }
+
+    if ( index >= MTL_DISPATCH_MAX_BUFFERS )
+    {
+        mtlStoreError( "Invalid buffer index." );
+        return MTL_ERROR;
+    }
+
+    if ( index >= command_encoder->buffers.size() )
+    {
+        command_encoder->buffers.resize( index + 1 );
+        command_encoder->read_only.resize( index + 1 );
+    }
+    command_encoder->buffers[ index ] = buffer;
+    command_encoder->read_only[ index ] = access == MTL_BUFFER_ACCESS_READ || buffer->read_only;
+    return MTL_SUCCESS;
 }
 
 
-/**
- * Return a mtlDeviceInfo struct for a Metal device pointed by a handle
- * @param device_handle Handle to a Device
- * @param deviceInfo A pointer to a preallocated mtlDeviceInfo struct
+/** Copy a small block of constant data into the command stream as a buffer argument
+ * @param command_encoder_handle The handle of the command encoder to use
+ * @param bytes Pointer to the data
+ * @param length Number of bytes, at most MTL_MAX_INLINE_BYTES
+ * @param index The index of the association, zero-based, below MTL_DISPATCH_MAX_BUFFERS.
  * @return MTL_SUCCESS or MTL_ERROR
- **/
-uint32_t mtlGetDeviceInfo(DeviceHandle device_handle, mtlDeviceInfo *deviceInfo)
+ */
+uint32_t mtlSetBytes( CommandEncoderHandle command_encoder_handle, const void * bytes, uint64_t length, uint32_t index )
 {
-    return MTL_ERROR;
-}
+    std::shared_ptr<CPUCommandEncoder> command_encoder = HandleStore::getInstance().command_encoders.Handle2Object( command_encoder_handle );
+    if ( !command_encoder )
+    {
+        mtlStoreError( "Invalid command encoder handle." );
+        return MTL_ERROR;
+    }
 
+    if ( !bytes || length == 0 || length > MTL_MAX_INLINE_BYTES )
+    {
+        mtlStoreError( "Inline data must be between 1 and 4096 bytes." );
+        return MTL_ERROR;
+    }
 
-/**
- * Determine if two device_handles refer to the same Device
- * @param device_handle1 Handle to a Device object
- * @param device_handle2 Handle to a Device object
- * @return uint8(1) if the device handles refer to the same Metal device, uint8(0) if they do not match.
- **/
-uint8_t mtlSameDevice( DeviceHandle device_handle1, DeviceHandle device_handle2 )
-{
-    return uint8_t(0);
+    if ( index >= MTL_DISPATCH_MAX_BUFFERS )
+    {
+        mtlStoreError( "Invalid buffer index." );
+        return MTL_ERROR;
+    }
+
+    std::shared_ptr<CPUBuffer> inline_buffer = NewInlineBuffer( bytes, length );
+    if ( !inline_buffer )
+    {
+        mtlStoreError( "Error creating buffer." );
+        return MTL_ERROR;
+    }
+
+    if ( index >= command_encoder->buffers.size() )
+    {
+        command_encoder->buffers.resize( index + 1 );
+        command_encoder->read_only.resize( index + 1 );
+    }
+    command_encoder->buffers[ index ] = inline_buffer;
+    command_encoder->read_only[ index ] = 1;
+    return MTL_SUCCESS;
 }
 
 
-/**
- * Get allocated memory for a device
- * @param device_handle Handle to a Device
- * @return The currently allocated memory in bytes, -1 on error
+/** Specify the thread count and organization
+ * @param command_encoder_handle The handle of the command encoder to use
+ * @param compute_pipeline_state_handle The handle of the compute pipeline state which will be executed
+ * @param width The size of the first dimension (usuall numelements for a one-dimensional array)
+ * @param height The size of the second dimension (usually 1 for a one-dimensional array)
+ * @param depth The size of the third dimension (usually 1 for a one-dimensional array)
+ * @return MTL_SUCCESS or MTL_ERROR
  */
-int64_t mtlGetDeviceAllocatedMemory( DeviceHandle device_handle )
+uint32_t mtlSetThreadsAndShape( CommandEncoderHandle command_encoder_handle, ComputePipelineStateHandle compute_pipeline_state_handle,  uint32_t width, uint32_t height, uint32_t depth )
 {
-    return (int64_t)-1;
+    const uint32_t automatic[3] = { 0, 0, 0 };
+    return mtlSetThreadsAndThreadgroupShape( command_encoder_handle, compute_pipeline_state_handle, width, height, depth, automatic );
 }
 
 
-/** Copy a device
- * @param device_handle The handle of the device to copy
+/** Specify the thread count with an explicit threadgroup size
+ * @param command_encoder_handle The handle of the command encoder to use
+ * @param compute_pipeline_state_handle The handle of the compute pipeline state which will be executed
+ * @param width The size of the first dimension
+ * @param height The size of the second dimension
+ * @param depth The size of the third dimension
+ * @param group_size Threadgroup width, height and depth, or all zero for the automatic size
+ * @return MTL_SUCCESS or MTL_ERROR
  */
-DeviceHandle mtlCopyDevice( DeviceHandle device_handle )
+uint32_t mtlSetThreadsAndThreadgroupShape( CommandEncoderHandle command_encoder_handle, ComputePipelineStateHandle compute_pipeline_state_handle,
+                                           uint32_t width, uint32_t height, uint32_t depth, const uint32_t group_size[3] )
 {
-    return (DeviceHandle)INVALID_HANDLE;
-}
+    HandleStore & HS = HandleStore::getInstance();
 
+    if ( ( width == 0 ) || ( height == 0 ) || ( depth == 0 ) || !group_size )
+        return MTL_ERROR;
 
-/** Free a device
- * @param device_handle The handle of the device to free
- */
-void mtlFreeDevice( DeviceHandle device_handle )
-{}
+    std::shared_ptr<CPUCommandEncoder> command_encoder = HS.command_encoders.Handle2Object( command_encoder_handle );
+    if ( !command_encoder )
+    {
+        mtlStoreError( "Invalid command encoder handle." );
+        return MTL_ERROR;
+    }
 
+    if ( !HS.compute_pipeline_states.Handle2Object( compute_pipeline_state_handle ) )
+    {
+        mtlStoreError( "Invalid compute pipeline state handle." );
+        return MTL_ERROR;
+    }
 
-#pragma mark Libraries
-/** Create a new library on a device from source code.
- * @param device_handle Handle to a Device
- * @param source Null-terminated string of the source code to compile
- * @return LibraryHandle on success, INVALID_HANDLE on error.
- */
-LibraryHandle mtlNewLibrary( DeviceHandle device_handle, const char * source )
-{
-    return (LibraryHandle)INVALID_HANDLE;
+    if ( !command_encoder->compute_pipeline_state )
+    {
+        mtlStoreError( "No compute pipeline state set on the command encoder." );
+        return MTL_ERROR;
+    }
+
+    if ( command_encoder->encoding_ended )
+    {
+        mtlStoreError( "Encoding has already ended." );
+        return MTL_ERROR;
+    }
+
+    CPUDispatch dispatch;
+    dispatch.compute_pipeline_state = command_encoder->compute_pipeline_state;
+    dispatch.buffers = command_encoder->buffers;
+    dispatch.read_only = command_encoder->read_only;
+    dispatch.concurrent_group = command_encoder->concurrent_group;
+    dispatch.width = width;
+    dispatch.height = height;
+    dispatch.depth = depth;
+    if ( !ResolveThreadgroup( dispatch, group_size ) )
+        return MTL_ERROR;
+
+    return AppendDispatches( *command_encoder->command_buffer, &dispatch, 1 ) ? MTL_SUCCESS : MTL_ERROR;
 }
 
 
-/** Return the device on which the library was created.
- * @param library_handle Handle to a Library
- * @return DeviceHandle on success, INVALID_HANDLE on error.
+/** Dispatch a grid whose size is read from a buffer when the dispatch runs
+ * @param command_encoder_handle The handle of the command encoder to use
+ * @param compute_pipeline_state_handle The handle of the compute pipeline state which will be executed
+ * @param indirect_buffer_handle The buffer holding the arguments, on the same device
+ * @param indirect_offset Byte offset of the arguments in the buffer, a multiple of 4
+ * @param group_size Threadgroup width, height and depth
+ * @return MTL_SUCCESS or MTL_ERROR
  */
-DeviceHandle mtlLibraryDevice( LibraryHandle library_handle )
+uint32_t mtlDispatchThreadgroupsIndirect( CommandEncoderHandle command_encoder_handle, ComputePipelineStateHandle compute_pipeline_state_handle,
+                                          BufferHandle indirect_buffer_handle, uint64_t indirect_offset, const uint32_t group_size[3] )
 {
-    return (DeviceHandle)INVALID_HANDLE;
-}
+    HandleStore & HS = HandleStore::getInstance();
 
+    std::shared_ptr<CPUCommandEncoder> command_encoder = HS.command_encoders.Handle2Object( command_encoder_handle );
+    if ( !command_encoder )
+    {
+        mtlStoreError( "Invalid command encoder handle." );
+        return MTL_ERROR;
+    }
 
-/** Free a library
- * @param library_handle The handle of the library to free
- */
-void mtlFreeLibrary( LibraryHandle library_handle ){}
+    if ( !HS.compute_pipeline_states.Handle2Object( compute_pipeline_state_handle ) )
+    {
+        mtlStoreError( "Invalid compute pipeline state handle." );
+        return MTL_ERROR;
+    }
 
+    if ( !command_encoder->compute_pipeline_state )
+    {
+        mtlStoreError( "No compute pipeline state set on the command encoder." );
+        return MTL_ERROR;
+    }
 
-#pragma mark Functions
-/** Create a new function in a library
- * @param library_handle Handle to a Library
- * @param function_name Name of the function defined in the library
- * @return FunctionHandle on success, INVALID_HANDLE on error.
- */
-FunctionHandle mtlNewFunction( LibraryHandle library_handle, const char * function_name )
-{
-    return (FunctionHandle)INVALID_HANDLE;
-}
+    if ( command_encoder->encoding_ended )
+    {
+        mtlStoreError( "Encoding has already ended." );
+        return MTL_ERROR;
+    }
 
+    std::shared_ptr<CPUBuffer> indirect_buffer = HS.buffers.Handle2Object( indirect_buffer_handle );
+    if ( !indirect_buffer )
+    {
+        mtlStoreError( "Invalid buffer handle." );
+        return MTL_ERROR;
+    }
+    if ( indirect_buffer->device != command_encoder->command_buffer->command_queue->device )
+    {
+        mtlStoreError( "Buffer was created on a different device." );
+        return MTL_ERROR;
+    }
+    if ( indirect_offset % sizeof( uint32_t ) != 0 || indirect_offset > indirect_buffer->length ||
+         indirect_buffer->length - indirect_offset < sizeof( mtlDispatchIndirectArguments ) )
+    {
+        mtlStoreError( "Invalid indirect arguments offset." );
+        return MTL_ERROR;
+    }
 
-/** Free a function
- * @param function_handle The handle of the function to free
- */
-void mtlFreeFunction( FunctionHandle function_handle ){}
+    if ( !group_size || group_size[0] == 0 || group_size[1] == 0 || group_size[2] == 0 )
+    {
+        mtlStoreError( "Invalid threadgroup size." );
+        return MTL_ERROR;
+    }
 
+    CPUDispatch dispatch;
+    dispatch.compute_pipeline_state = command_encoder->compute_pipeline_state;
+    dispatch.buffers = command_encoder->buffers;
+    dispatch.read_only = command_encoder->read_only;
+    dispatch.concurrent_group = command_encoder->concurrent_group;
+    dispatch.width = 0;
+    dispatch.height = 0;
+    dispatch.depth = 0;
+    dispatch.indirect_buffer = indirect_buffer;
+    dispatch.indirect_offset = indirect_offset;
+    if ( !ResolveThreadgroup( dispatch, group_size ) )
+        return MTL_ERROR;
 
-#pragma mark Compute Pipeline States
-/** Create a new compute pipeline state
- * @param device_handle The handle to the device on which the pipeline will be created
- * @param function_handle  The function for which the pipeline will be created.
- * @return ComputePipelineStateHandle on success, INVALID_HANDLE on error.
- */
-ComputePipelineStateHandle mtlNewComputePipelineState( DeviceHandle device_handle, FunctionHandle function_handle )
-{
-    return (ComputePipelineStateHandle)INVALID_HANDLE;
+    return AppendDispatches( *command_encoder->command_buffer, &dispatch, 1 ) ? MTL_SUCCESS : MTL_ERROR;
 }
 
 
-/** Return the device on which the compute pipeline state was created
- * @param compute_pipeline_state_handle The handle of the compute pipeline state
- * @return DeviceHandle on succes, INVALID_HANDLE on error.
+/** End encoding
+ * @param command_encoder_handle The handle of the command encoder
+ * @return MTL_SUCCESS or MTL_ERROR
  */
-DeviceHandle mtlComputePipelineStateDevice( ComputePipelineStateHandle compute_pipeline_state_handle )
+uint32_t mtlEndEncoding( CommandEncoderHandle command_encoder_handle )
 {
-    return (DeviceHandle)INVALID_HANDLE;
+    std::shared_ptr<CPUCommandEncoder> command_encoder = HandleStore::getInstance().command_encoders.Handle2Object( command_encoder_handle );
+    if ( !command_encoder )
+    {
+        mtlStoreError( "Invalid command encoder handle." );
+        return MTL_ERROR;
+    }
+
+    command_encoder->encoding_ended = true;
+    return MTL_SUCCESS;
 }
 
 
-/** Copy a pipeline state
- * @param compute_pipeline_state_handle The handle of the compute pipeline state to copy
+/** Encode a batch of dispatches into a command buffer
+ * @param command_buffer_handle The handle of a command buffer that has not been committed
+ * @param dispatches Array of dispatches, executed in order
+ * @param count Number of dispatches
+ * @return MTL_SUCCESS or MTL_ERROR
  */
-ComputePipelineStateHandle mtlCopyComputePipelineState( ComputePipelineStateHandle compute_pipeline_state_handle )
+uint32_t mtlEncodeDispatches( CommandBufferHandle command_buffer_handle, const mtlDispatch * dispatches, uint32_t count )
 {
-    return (ComputePipelineStateHandle)INVALID_HANDLE;
-}
+    std::shared_ptr<CPUCommandBuffer> command_buffer = HandleStore::getInstance().command_buffers.Handle2Object( command_buffer_handle );
+    if ( !command_buffer )
+    {
+        mtlStoreError( "Invalid command buffer handle." );
+        return MTL_ERROR;
+    }
 
+    std::vector<CPUDispatch> resolved;
+    if ( !ResolveDispatches( dispatches, count, resolved ) )
+        return MTL_ERROR;
 
-/** Free a pipeline state
- * @param compute_pipeline_state_handle The handle of the compute pipeline state to free
- */
-void mtlFreeComputePipelineState( ComputePipelineStateHandle compute_pipeline_state_handle ){}
+    return AppendDispatches( *command_buffer, resolved.data(), resolved.size() ) ? MTL_SUCCESS : MTL_ERROR;
+}
 
 
-#pragma mark Command Queues
-/** Create a new command queue
- * @param device_handle The handle to the device on which the queue will be created
- * @return CommandQueueHandle on success, INVALID_HANDLE on error.
+/** Encode a batch of dispatches into a new command buffer and commit it
+ * @param command_queue_handle A handle to the command queue to submit to
+ * @param dispatches Array of dispatches, executed in order
+ * @param count Number of dispatches
+ * @return A handle to the committed command buffer or INVALID_HANDLE on error
  */
-CommandQueueHandle mtlNewCommandQueue( DeviceHandle device_handle )
+CommandBufferHandle mtlSubmitDispatches( CommandQueueHandle command_queue_handle, const mtlDispatch * dispatches, uint32_t count )
 {
-    return (CommandQueueHandle)INVALID_HANDLE;
+    CommandBufferHandle command_buffer_handle = mtlNewCommandBuffer( command_queue_handle );
+    if ( command_buffer_handle == INVALID_HANDLE )
+        return (CommandBufferHandle)INVALID_HANDLE;
+
+    if ( mtlEncodeDispatches( command_buffer_handle, dispatches, count ) != MTL_SUCCESS ||
+         mtlCommitCommandBuffer( command_buffer_handle ) != MTL_SUCCESS )
+    {
+        mtlFreeCommandBuffer( command_buffer_handle );
+        return (CommandBufferHandle)INVALID_HANDLE;
+    }
+    return command_buffer_handle;
 }
 
 
-/** Return the device on which the command queue was created
- * @param command_queue_handle The handle of the command queue
- * @return DeviceHandle on succes, INVALID_HANDLE on error.
+/** Find the fastest threadgroup size for a dispatch by timing candidate shapes
+ * @param command_queue_handle A handle to the command queue to run on
+ * @param dispatch The dispatch to time
+ * @param repetitions Number of timed runs of each candidate
+ * @param group_size Receives the fastest threadgroup width, height and depth
+ * @return MTL_SUCCESS or MTL_ERROR
  */
-DeviceHandle mtlCommandQueueDevice( CommandQueueHandle command_queue_handle )
+uint32_t mtlAutotuneThreadgroupSize( CommandQueueHandle command_queue_handle, const mtlDispatch * dispatch, uint32_t repetitions, uint32_t group_size[3] )
 {
-    return (DeviceHandle)INVALID_HANDLE;
-}
+    std::shared_ptr<CPUCommandQueue> command_queue = HandleStore::getInstance().command_queues.Handle2Object( command_queue_handle );
+    if ( !command_queue )
+    {
+        mtlStoreError( "Invalid command queue handle." );
+        return MTL_ERROR;
+    }
+    if ( !dispatch || !group_size )
+    {
+        mtlStoreError( "No dispatch to autotune." );
+        return MTL_ERROR;
+    }
 
+    mtlDispatch automatic = *dispatch;
+    automatic.group_width = automatic.group_height = automatic.group_depth = 0;
+    std::vector<CPUDispatch> timed;
+    if ( !ResolveDispatches( &automatic, 1, timed ) )
+        return MTL_ERROR;
 
-/** Free a command queue
- * @param command_queue_handle The handle of the command queue to free
- */
-void mtlFreeCommandQueue( CommandQueueHandle command_queue_handle ){}
+    const uint32_t grid[3] = { dispatch->width, dispatch->height, dispatch->depth };
+    uint32_t candidates[ THREADGROUP_MAX_CANDIDATES ][3];
+    uint32_t count = mtlThreadgroupCandidates( grid, HOST_THREAD_EXECUTION_WIDTH, HOST_MAX_THREADS_PER_THREADGROUP, candidates );
+    repetitions = std::max<uint32_t>( repetitions, 1 );
 
+    // Timed on the command thread, so it runs after the work already committed to the queue
+    CPUDevice & device = *command_queue->device;
+    std::promise<uint32_t> fastest;
+    std::future<uint32_t> fastest_result = fastest.get_future();
+    device.command_scheduler->Submit( command_queue.get(), [ & ]() {
+        ExecuteDispatches( device, timed );
+        double best_time = 0;
+        uint32_t best = 0;
+        for ( uint32_t c = 0; c < count; c++ )
+        {
+            timed[0].threadgroup = { { candidates[ c ][0], candidates[ c ][1], candidates[ c ][2] } };
+            auto start = std::chrono::steady_clock::now();
+            for ( uint32_t r = 0; r < repetitions; r++ )
+                ExecuteDispatches( device, timed );
+            double time = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+            if ( c == 0 || time < best_time )
+            {
+                best_time = time;
+                best = c;
+            }
+        }
+        fastest.set_value( best );
+        return true;
+    } );
+    uint32_t best = fastest_result.get();
 
-#pragma mark Buffers
-/** Create a new buffer on the GPU
- * @param device_handle The handle to the device on which the buffer will be created
- * @param bytes Size of the buffer in bytes
- * @return BufferHandle on success, INVALID_HANDLE on error.
+    CPUComputePipelineState & compute_pipeline_state = *timed[0].compute_pipeline_state;
+    {
+        std::lock_guard<std::mutex> lock( compute_pipeline_state.tuned_mutex );
+        compute_pipeline_state.tuned_threadgroups[ ThreadgroupShape{ { grid[0], grid[1], grid[2] } } ] =
+            ThreadgroupShape{ { candidates[ best ][0], candidates[ best ][1], candidates[ best ][2] } };
+    }
+    for ( int d = 0; d < 3; d++ )
+        group_size[ d ] = candidates[ best ][ d ];
+    return MTL_SUCCESS;
+}
+
+
+#pragma mark Command Lists
+/** Record a batch of dispatches once, to encode it any number of times
+ * @param device_handle The device the list runs on; its buffers must be on it
+ * @param dispatches Array of dispatches, executed in order
+ * @param count Number of dispatches
+ * @return CommandListHandle on success, INVALID_HANDLE on error.
  */
-BufferHandle mtlNewBuffer( DeviceHandle device_handle, uint64_t bytes )
+CommandListHandle mtlNewCommandList( DeviceHandle device_handle, const mtlDispatch * dispatches, uint32_t count )
 {
-    return (BufferHandle)INVALID_HANDLE;
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUDevice> device = HS.devices.Handle2Object( device_handle );
+    if ( !device )
+    {
+        mtlStoreError( "Invalid device handle." );
+        return (CommandListHandle)INVALID_HANDLE;
+    }
+
+    std::shared_ptr<CPUCommandList> command_list = std::make_shared<CPUCommandList>();
+    if ( !ResolveDispatches( dispatches, count, command_list->dispatches ) )
+        return (CommandListHandle)INVALID_HANDLE;
+    for ( const CPUDispatch & dispatch : command_list->dispatches )
+    {
+        for ( const std::shared_ptr<CPUBuffer> & buffer : dispatch.buffers )
+        {
+            if ( buffer && buffer->device != device )
+            {
+                mtlStoreError( "Buffer was created on a different device." );
+                return (CommandListHandle)INVALID_HANDLE;
+            }
+        }
+    }
+    command_list->device = device;
+    command_list->plan = std::make_shared<DispatchPlan>( PlanDispatches( *device, command_list->dispatches, 0, count ) );
+    return HS.command_lists.Object2Handle( command_list );
 }
 
 
-/** Copy data into the GPU buffer
- * @param buffer_handle The handle to the buffer to copy data into
- * @param data A pointer to data to copy into the GPU buffer
- * @param bytes Number of bytes to copy
+/** Change one buffer binding of a recorded command list
+ * @param command_list_handle The handle of the command list
+ * @param dispatch_index Zero-based index of the dispatch in the list
+ * @param buffer_index The [[ buffer(n) ]] index to bind, below MTL_DISPATCH_MAX_BUFFERS
+ * @param buffer_handle The buffer to bind, on the list's device
  * @return MTL_SUCCESS or MTL_ERROR
  */
-uint32_t mtlCopyDataToBuffer( BufferHandle buffer_handle, const void * data, uint64_t bytes )
+uint32_t mtlCommandListSetBuffer( CommandListHandle command_list_handle, uint32_t dispatch_index, uint32_t buffer_index, BufferHandle buffer_handle )
 {
-    return MTL_ERROR;
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUCommandList> command_list = HS.command_lists.Handle2Object( command_list_handle );
+    if ( !command_list )
+    {
+        mtlStoreError( "Invalid command list handle." );
+        return MTL_ERROR;
+    }
+    std::shared_ptr<CPUBuffer> buffer = HS.buffers.Handle2Object( buffer_handle );
+    if ( !buffer )
+    {
+        mtlStoreError( "Invalid buffer handle." );
+        return MTL_ERROR;
+    }
+    if ( buffer->device != command_list->device )
+    {
+        mtlStoreError( "Buffer was created on a different device." );
+        return MTL_ERROR;
+    }
+    if ( buffer_index >= MTL_DISPATCH_MAX_BUFFERS )
+    {
+        mtlStoreError( "Too many buffers in a dispatch." );
+        return MTL_ERROR;
+    }
+
+    std::lock_guard<std::mutex> lock( command_list->mutex );
+    if ( dispatch_index >= command_list->dispatches.size() )
+    {
+        mtlStoreError( "Dispatch index exceeds the command list." );
+        return MTL_ERROR;
+    }
+    CPUDispatch & dispatch = command_list->dispatches[ dispatch_index ];
+    if ( buffer_index >= dispatch.buffers.size() )
+        dispatch.buffers.resize( buffer_index + 1 );
+    dispatch.buffers[ buffer_index ] = buffer;
+    // Bindings decide which dispatches may run together, so the list is planned again.
+    command_list->plan = std::make_shared<DispatchPlan>( PlanDispatches( *command_list->device, command_list->dispatches, 0, command_list->dispatches.size() ) );
+    return MTL_SUCCESS;
 }
 
 
-/** Copy data from the GPU buffer
- * @param buffer_handle The handle to the buffer to copy data from
- * @param data A pointer to copy the data into
- * @param bytes Number of bytes to copy
+/** Encode a recorded command list into a command buffer
+ * @param command_buffer_handle The handle of a command buffer that has not been committed, on the list's device
+ * @param command_list_handle The handle of the command list
  * @return MTL_SUCCESS or MTL_ERROR
  */
-uint32_t mtlCopyDataFromBuffer( BufferHandle buffer_handle, void * data, uint64_t bytes )
+uint32_t mtlEncodeCommandList( CommandBufferHandle command_buffer_handle, CommandListHandle command_list_handle )
 {
-    return MTL_ERROR;
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUCommandBuffer> command_buffer = HS.command_buffers.Handle2Object( command_buffer_handle );
+    if ( !command_buffer )
+    {
+        mtlStoreError( "Invalid command buffer handle." );
+        return MTL_ERROR;
+    }
+    std::shared_ptr<CPUCommandList> command_list = HS.command_lists.Handle2Object( command_list_handle );
+    if ( !command_list )
+    {
+        mtlStoreError( "Invalid command list handle." );
+        return MTL_ERROR;
+    }
+    if ( command_list->device != command_buffer->command_queue->device )
+    {
+        mtlStoreError( "Command list was recorded for a different device." );
+        return MTL_ERROR;
+    }
+
+    std::vector<CPUDispatch> dispatches;
+    std::shared_ptr<const DispatchPlan> plan;
+    {
+        std::lock_guard<std::mutex> lock( command_list->mutex );
+        dispatches = command_list->dispatches;
+        plan = command_list->plan;
+    }
+    return AppendDispatches( *command_buffer, dispatches.data(), dispatches.size(), plan ) ? MTL_SUCCESS : MTL_ERROR;
 }
 
 
-/** Return the size of a buffer
- * @param buffer_handle The handle of the buffer to free
- * @return MTL_ERROR if the buffer is of zero size or does not exist, size of the allocated buffer otherwise.
+/** Encode a recorded command list into a new command buffer and commit it
+ * @param command_queue_handle A handle to the command queue to submit to
+ * @param command_list_handle The handle of the command list
+ * @return A handle to the committed command buffer or INVALID_HANDLE on error
  */
-uint64_t mtlBufferSize( BufferHandle buffer_handle )
+CommandBufferHandle mtlSubmitCommandList( CommandQueueHandle command_queue_handle, CommandListHandle command_list_handle )
 {
-    return MTL_ERROR;
+    CommandBufferHandle command_buffer_handle = mtlNewCommandBuffer( command_queue_handle );
+    if ( command_buffer_handle == INVALID_HANDLE )
+        return (CommandBufferHandle)INVALID_HANDLE;
+
+    if ( mtlEncodeCommandList( command_buffer_handle, command_list_handle ) != MTL_SUCCESS ||
+         mtlCommitCommandBuffer( command_buffer_handle ) != MTL_SUCCESS )
+    {
+        mtlFreeCommandBuffer( command_buffer_handle );
+        return (CommandBufferHandle)INVALID_HANDLE;
+    }
+    return command_buffer_handle;
 }
 
 
-/** Return the device on which the buffer was created
- * @param buffer_handle The handle of the buffer to free
- * @return DeviceHandle on succes, INVALID_HANDLE on error.
+/** Free a command list
+ * @param command_list_handle The handle of the command list
  */
-DeviceHandle mtlBufferDevice( BufferHandle buffer_handle )
+void mtlFreeCommandList( CommandListHandle command_list_handle )
 {
-    return (DeviceHandle)INVALID_HANDLE;
+    if ( command_list_handle != INVALID_HANDLE && !HandleStore::getInstance().command_lists.Free( command_list_handle ) )
+        mtlStoreError( "Invalid command list handle." );
 }
 
 
-/** Free a GPU buffer
- * @param buffer_handle The handle of the buffer to free
+#pragma mark Reductions
+/** Reduce the first num_elements floats of a buffer to a single value
+ * @param command_queue_handle A handle to the command queue to run on
+ * @param buffer_handle Buffer of floats on the same device
+ * @param num_elements Number of floats to reduce, at least one
+ * @param operation One of the MTL_REDUCE_ operations
+ * @param flags Zero or MTL_REDUCE_DETERMINISTIC
+ * @param result Receives the value and, for min and max, the index
+ * @return MTL_SUCCESS or MTL_ERROR
  */
-void mtlFreeBuffer( BufferHandle buffer_handle ){}
+uint32_t mtlReduceBuffer( CommandQueueHandle command_queue_handle, BufferHandle buffer_handle, uint64_t num_elements,
+                          uint32_t operation, uint32_t flags, mtlReduction * result )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUCommandQueue> command_queue = HS.command_queues.Handle2Object( command_queue_handle );
+    if ( !command_queue )
+    {
+        mtlStoreError( "Invalid command queue handle." );
+        return MTL_ERROR;
+    }
 
+    std::shared_ptr<CPUBuffer> buffer = HS.buffers.Handle2Object( buffer_handle );
+    if ( !buffer )
+    {
+        mtlStoreError( "Invalid buffer handle." );
+        return MTL_ERROR;
+    }
+    if ( buffer->device != command_queue->device )
+    {
+        mtlStoreError( "Buffer was created on a different device." );
+        return MTL_ERROR;
+    }
 
-#pragma mark Command Buffers
-/** Create a command buffer
- * @param command_queue_handle A handle to a command queue on which to create the command buffer
- * @return A handle to a command buffer or INVALID_HANDLE on error
- */
-CommandBufferHandle mtlNewCommandBuffer( CommandQueueHandle command_queue_handle )
-{
-    return (CommandBufferHandle)INVALID_HANDLE;
-}
+    if ( !mtlReduceIsValid( operation ) || ( flags & ~MTL_REDUCE_DETERMINISTIC ) || !result )
+    {
+        mtlStoreError( "Invalid reduction." );
+        return MTL_ERROR;
+    }
+    if ( num_elements == 0 || num_elements > buffer->length / sizeof( float ) )
+    {
+        mtlStoreError( "Buffer smaller than specified number of elements to reduce." );
+        return MTL_ERROR;
+    }
 
+    // Blocks of a fixed size make the order of the sum independent of the thread count;
+    // otherwise there are enough blocks to keep every worker busy.
+    CPUDevice & device = *command_queue->device;
+    uint64_t block = HOST_REDUCE_BLOCK;
+    if ( !( flags & MTL_REDUCE_DETERMINISTIC ) )
+        block = std::max<uint64_t>( num_elements / ( 4 * ( device.pool->Size() + 1 ) ), HOST_MIN_DISPATCH_CHUNK );
+    uint64_t num_blocks = ( num_elements + block - 1 ) / block;
+    const float * data = (const float *)buffer->contents;
 
+    // Run on the command thread once the work already committed to the queue has completed, so it sees its results
+    std::promise<mtlReduction> reduced;
+    std::future<mtlReduction> reduced_result = reduced.get_future();
+    device.command_scheduler->Submit( command_queue.get(), [ & ]() {
+        std::vector<mtlReduction> partials( num_blocks );
+        device.pool->ParallelFor( num_blocks, 1, [ & ]( uint64_t first_block, uint64_t last_block ) {
+            for ( uint64_t b = first_block; b < last_block; b++ )
+            {
+                uint64_t first = b * block;
+                mtlReduceInit( operation, &partials[ b ] );
+                mtlHostReduceRange( operation, data + first, std::min( block, num_elements - first ), first, &partials[ b ] );
+            }
+        } );
 
-/** Return the device on which the command buffer was created
- * @param command_buffer_handle The handle of the command buffer
- * @return DeviceHandle on succes, INVALID_HANDLE on error.
- */
-DeviceHandle mtlCommandBufferDevice( CommandBufferHandle command_buffer_handle )
-{
-    return (DeviceHandle)INVALID_HANDLE;
+        // Pairwise tree over the blocks, so rounding errors grow with the log of their number
+        for ( uint64_t stride = 1; stride < num_blocks; stride *= 2 )
+        {
+            for ( uint64_t b = 0; b + stride < num_blocks; b += 2 * stride )
+                mtlReduceCombine( operation, &partials[ b ], partials[ b + stride ].value, partials[ b + stride ].index );
+        }
+        reduced.set_value( partials[0] );
+        return true;
+    } );
+
+    *result = reduced_result.get();
+    mtlReduceFinish( operation, result, num_elements );
+    return MTL_SUCCESS;
 }
 
 
-/** Copy a command buffer
- * @param command_buffer_handle The handle of the command buffer to copy
+/** Encode a reduction of a column-major float array along one dimension
+ * @param command_buffer_handle The handle of a command buffer that has not been committed
+ * @param source_handle Buffer holding the array
+ * @param dimensions Width, height and depth of the array in elements
+ * @param dimension Zero-based dimension to reduce along, 0 to 2
+ * @param operation One of the MTL_REDUCE_ operations
+ * @param destination_handle Buffer receiving the reduced array
+ * @return MTL_SUCCESS or MTL_ERROR
  */
-CommandBufferHandle mtlCopyCommandBuffer( CommandBufferHandle command_buffer_handle )
+uint32_t mtlEncodeReduceDimension( CommandBufferHandle command_buffer_handle, BufferHandle source_handle, const uint64_t dimensions[3],
+                                   uint32_t dimension, uint32_t operation, BufferHandle destination_handle )
 {
-    return (CommandBufferHandle)INVALID_HANDLE;
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUCommandBuffer> command_buffer = HS.command_buffers.Handle2Object( command_buffer_handle );
+    if ( !command_buffer )
+    {
+        mtlStoreError( "Invalid command buffer handle." );
+        return MTL_ERROR;
+    }
+
+    std::shared_ptr<CPUBuffer> source = HS.buffers.Handle2Object( source_handle );
+    std::shared_ptr<CPUBuffer> destination = HS.buffers.Handle2Object( destination_handle );
+    if ( !source || !destination )
+    {
+        mtlStoreError( "Invalid buffer handle." );
+        return MTL_ERROR;
+    }
+    if ( source->device != command_buffer->command_queue->device || destination->device != source->device )
+    {
+        mtlStoreError( "Buffer was created on a different device." );
+        return MTL_ERROR;
+    }
+    if ( !CheckWritable( *destination ) )
+        return MTL_ERROR;
+
+    if ( !dimensions || dimension > 2 || !mtlReduceIsValid( operation ) || dimensions[0] == 0 || dimensions[1] == 0 || dimensions[2] == 0 )
+    {
+        mtlStoreError( "Invalid reduction." );
+        return MTL_ERROR;
+    }
+
+    mtlReduceParams params = { 1, dimensions[ dimension ], 1, operation, 0 };
+    for ( uint32_t d = 0; d < dimension; d++ )
+        params.inner *= dimensions[ d ];
+    for ( uint32_t d = dimension + 1; d < 3; d++ )
+        params.outer *= dimensions[ d ];
+    uint64_t outputs = params.inner * params.outer;
+    if ( outputs > UINT32_MAX || params.length > UINT32_MAX )
+    {
+        mtlStoreError( "Too many elements to reduce." );
+        return MTL_ERROR;
+    }
+    if ( source->length / sizeof( float ) < outputs * params.length || destination->length / sizeof( float ) < outputs )
+    {
+        mtlStoreError( "Buffer too small for the reduction." );
+        return MTL_ERROR;
+    }
+
+    static const std::shared_ptr<CPUComputePipelineState> reduce_dimension = InternalPipelineState( "reduce_dimension", mtlHostReduceDimension );
+    CPUDispatch dispatch;
+    dispatch.compute_pipeline_state = reduce_dimension;
+    dispatch.buffers = { source, destination, NewInlineBuffer( &params, sizeof( params ) ) };
+    dispatch.read_only = { 1, 0, 1 };
+    if ( !dispatch.buffers[2] )
+    {
+        mtlStoreError( "Error creating buffer." );
+        return MTL_ERROR;
+    }
+    dispatch.width = (uint32_t)outputs;
+    dispatch.height = 1;
+    dispatch.depth = 1;
+
+    return AppendDispatches( *command_buffer, &dispatch, 1 ) ? MTL_SUCCESS : MTL_ERROR;
 }
 
 
-/** Free a command buffer
- * @param command_buffer_handle The handle of the command buffer to free
+#pragma mark Element-wise Expressions
+/** Encode a fused element-wise program over float buffers
+ * @param command_buffer_handle The handle of a command buffer that has not been committed
+ * @param program The operations, in postfix order, leaving one value and never
+ *                holding more than MTL_ELEMENTWISE_MAX_STACK values
+ * @param program_length Number of operations, at most MTL_ELEMENTWISE_MAX_PROGRAM
+ * @param input_handles Buffers read by MTL_ELEMENTWISE_INPUT
+ * @param num_inputs Number of inputs, at most MTL_ELEMENTWISE_MAX_INPUTS
+ * @param constants Values pushed by MTL_ELEMENTWISE_CONSTANT
+ * @param num_constants Number of constants, at most MTL_ELEMENTWISE_MAX_CONSTANTS
+ * @param output_handle Buffer receiving the results
+ * @param num_elements Number of elements to compute
+ * @return MTL_SUCCESS or MTL_ERROR
  */
-void mtlFreeCommandBuffer( CommandBufferHandle command_buffer_handle ) {}
+uint32_t mtlEncodeElementwise( CommandBufferHandle command_buffer_handle, const mtlElementwiseOp * program, uint32_t program_length,
+                               const BufferHandle * input_handles, uint32_t num_inputs, const float * constants, uint32_t num_constants,
+                               BufferHandle output_handle, uint64_t num_elements )
+{
+    HandleStore & HS = HandleStore::getInstance();
+    std::shared_ptr<CPUCommandBuffer> command_buffer = HS.command_buffers.Handle2Object( command_buffer_handle );
+    if ( !command_buffer )
+    {
+        mtlStoreError( "Invalid command buffer handle." );
+        return MTL_ERROR;
+    }
 
+    if ( !mtlElementwiseIsValid( program, program_length, num_inputs, num_constants ) ||
+         ( num_inputs > 0 && !input_handles ) || ( num_constants > 0 && !constants ) )
+    {
+        mtlStoreError( "Invalid element-wise program." );
+        return MTL_ERROR;
+    }
+    if ( num_elements == 0 || num_elements > UINT32_MAX )
+    {
+        mtlStoreError( "Invalid number of elements." );
+        return MTL_ERROR;
+    }
 
-/** Commit a command buffer for execution
- * @param command_buffer_handle The handle of the command buffer to free
+    // The output first, then the inputs, each holding num_elements floats on the command buffer's device
+    CPUDispatch dispatch;
+    dispatch.buffers.resize( num_inputs + 1 );
+    // The output is buffer 0 and only the inputs are read
+    dispatch.read_only.assign( num_inputs + 1, 1 );
+    dispatch.read_only[0] = 0;
+    for ( uint32_t i = 0; i <= num_inputs; i++ )
+    {
+        dispatch.buffers[ i ] = HS.buffers.Handle2Object( i == 0 ? output_handle : input_handles[ i - 1 ] );
+        if ( !dispatch.buffers[ i ] )
+        {
+            mtlStoreError( "Invalid buffer handle." );
+            return MTL_ERROR;
+        }
+        if ( dispatch.buffers[ i ]->device != command_buffer->command_queue->device )
+        {
+            mtlStoreError( "Buffer was created on a different device." );
+            return MTL_ERROR;
+        }
+        if ( dispatch.buffers[ i ]->length / sizeof( float ) < num_elements )
+        {
+            mtlStoreError( "Buffer smaller than specified number of elements." );
+            return MTL_ERROR;
+        }
+    }
+    if ( !CheckWritable( *dispatch.buffers[0] ) )
+        return MTL_ERROR;
+
+    mtlElementwiseProgram checked;
+    memset( &checked, 0, sizeof( checked ) );
+    checked.length = program_length;
+    checked.num_inputs = num_inputs;
+    checked.num_constants = num_constants;
+    memcpy( checked.ops, program, program_length * sizeof( mtlElementwiseOp ) );
+    if ( num_constants > 0 )
+        memcpy( checked.constants, constants, num_constants * sizeof( float ) );
+    dispatch.buffers.push_back( NewInlineBuffer( &checked, sizeof( checked ) ) );
+    if ( !dispatch.buffers.back() )
+    {
+        mtlStoreError( "Error creating buffer." );
+        return MTL_ERROR;
+    }
+
+    static const std::shared_ptr<CPUComputePipelineState> elementwise = InternalPipelineState( "elementwise", mtlHostElementwise );
+    dispatch.compute_pipeline_state = elementwise;
+    dispatch.width = (uint32_t)num_elements;
+    dispatch.height = 1;
+    dispatch.depth = 1;
+
+    return AppendDispatches( *command_buffer, &dispatch, 1 ) ? MTL_SUCCESS : MTL_ERROR;
+}
+
+
+#pragma mark Streaming
+/** Run a kernel over host arrays larger than the device can hold, in chunks pipelined through pooled buffers
+ * @param command_queue_handle The queue the chunks are committed to
+ * @param compute_pipeline_state_handle The kernel to run
+ * @param arrays The arguments, bound at buffer(0), buffer(1), ...
+ * @param num_arrays Number of arguments, at most MTL_DISPATCH_MAX_BUFFERS
+ * @param num_threads Threads of the whole grid
+ * @param memory_budget Bytes of device memory the stream may use, or 0 for the default
  * @return MTL_SUCCESS or MTL_ERROR
  */
-uint32_t mtlCommitCommandBuffer( CommandBufferHandle command_buffer_handle )
+uint32_t mtlStreamKernel( CommandQueueHandle command_queue_handle, ComputePipelineStateHandle compute_pipeline_state_handle,
+                          const mtlStreamArray * arrays, uint32_t num_arrays, uint64_t num_threads, uint64_t memory_budget )
 {
-    return MTL_ERROR;
+    const char * error = mtlStreamRun( command_queue_handle, compute_pipeline_state_handle, arrays, num_arrays, num_threads, memory_budget );
+    if ( error )
+    {
+        mtlStoreError( error );
+        return MTL_ERROR;
+    }
+    return MTL_SUCCESS;
 }
 
-/** Wait for a command buffer to complete
- * @param command_buffer_handle The handle of the command buffer to free
+
+/** Stream one host input through a kernel into one host output
+ * @param command_queue_handle The queue the chunks are committed to
+ * @param compute_pipeline_state_handle The kernel to run
+ * @param input Host data of num_threads * input_element_size bytes, bound at buffer(0)
+ * @param input_element_size Bytes of input per thread
+ * @param output Host memory receiving num_threads * output_element_size bytes, bound at buffer(1)
+ * @param output_element_size Bytes of output per thread
+ * @param resident_handles Buffers bound whole for every chunk, from buffer(2) on
+ * @param num_resident Number of resident buffers
+ * @param num_threads Threads of the whole grid
+ * @param memory_budget Bytes of device memory the stream may use, or 0 for the default
  * @return MTL_SUCCESS or MTL_ERROR
  */
-uint32_t mtlWaitForCompletion( CommandBufferHandle command_buffer_handle )
+uint32_t mtlStreamKernelInOut( CommandQueueHandle command_queue_handle, ComputePipelineStateHandle compute_pipeline_state_handle,
+                               const void * input, uint64_t input_element_size, void * output, uint64_t output_element_size,
+                               const BufferHandle * resident_handles, uint32_t num_resident, uint64_t num_threads, uint64_t memory_budget )
 {
-    return MTL_ERROR;
+    const char * error = mtlStreamRunInOut( command_queue_handle, compute_pipeline_state_handle, input, input_element_size, output, output_element_size,
+                                            resident_handles, num_resident, num_threads, memory_budget );
+    if ( error )
+    {
+        mtlStoreError( error );
+        return MTL_ERROR;
+    }
+    return MTL_SUCCESS;
 }
 
 
-#pragma mark Command Encoders
-/** Create a command encoder
- * @param command_buffer_handle A handle to a command buffer on which to create the command encoder
- * @return A handle to a command encoder or INVALID_HANDLE on error
+#pragma mark Profiling
+/** Turn profiling on or off
+ * @param enabled Nonzero to enable profiling
  */
-CommandEncoderHandle mtlNewCommandEncoder( CommandBufferHandle command_buffer_handle )
+void mtlSetProfilingEnabled( uint8_t enabled )
 {
-    return (CommandEncoderHandle)INVALID_HANDLE;
+    Profile::getInstance().enabled = enabled != 0;
 }
 
 
-/** Free a command encoder
- * @param command_encoder_handle The handle of the command encoder to free
- */
-void mtlFreeCommandEncoder( CommandEncoderHandle command_encoder_handle ) {}
+/** Return nonzero if profiling is enabled */
+uint8_t mtlProfilingEnabled( void )
+{
+    return Profiling() ? 1 : 0;
+}
 
 
-/** Set a compute pipeline state (the function to execute) to a command buffer via its command encoder
- * @param command_encoder_handle The handle of the command encoder to use
+/** Return the current time of the profile clock in seconds */
+double mtlProfileTime( void )
+{
+    return ProfileTime();
+}
+
+
+/** Get the timing of a completed command buffer committed while profiling
+ * @param command_buffer_handle The handle of the command buffer
+ * @param timing Receives the timing
  * @return MTL_SUCCESS or MTL_ERROR
  */
-uint32_t mtlSetComputePipelineState( CommandEncoderHandle command_encoder_handle, ComputePipelineStateHandle compute_pipeline_state_handle )
+uint32_t mtlGetCommandBufferTiming( CommandBufferHandle command_buffer_handle, mtlCommandBufferTiming * timing )
 {
-    return MTL_ERROR;
+    std::shared_ptr<CPUCommandBuffer> command_buffer = ProfiledCommandBuffer( command_buffer_handle );
+    if ( !command_buffer || !timing )
+        return MTL_ERROR;
+
+    *timing = command_buffer->timing;
+    return MTL_SUCCESS;
 }
 
 
-/** Associate a GPU buffer with a command buffer via its command encoder
- * @param command_encoder_handle The handle of the command encoder to use
- * @param buffer_handle The handle of a buffer to associate with the command encoder
- * @param index The index of the association, zero-based.
+/** Get the timing of one dispatch of a completed, profiled command buffer
+ * @param command_buffer_handle The handle of the command buffer
+ * @param dispatch_index Zero-based index of the dispatch, in encoding order
+ * @param timing Receives the timing
  * @return MTL_SUCCESS or MTL_ERROR
  */
-uint32_t mtlSetBuffer( CommandEncoderHandle command_encoder_handle, BufferHandle buffer_handle, uint32_t index )
+uint32_t mtlGetDispatchTiming( CommandBufferHandle command_buffer_handle, uint32_t dispatch_index, mtlDispatchTiming * timing )
 {
-    return MTL_ERROR;
+    std::shared_ptr<CPUCommandBuffer> command_buffer = ProfiledCommandBuffer( command_buffer_handle );
+    if ( !command_buffer || !timing )
+        return MTL_ERROR;
+
+    if ( dispatch_index >= command_buffer->dispatch_timings.size() )
+    {
+        mtlStoreError( "Dispatch index out of bounds." );
+        return MTL_ERROR;
+    }
+    *timing = command_buffer->dispatch_timings[ dispatch_index ];
+    return MTL_SUCCESS;
 }
 
 
-/** Specify the thread count and organization
- * @param command_encoder_handle The handle of the command encoder to use
- * @param compute_pipeline_state_handle The handle of the compute pipeline state which will be executed
- * @param width The size of the first dimension (usuall numelements for a one-dimensional array)
- * @param height The size of the second dimension (usually 1 for a one-dimensional array)
- * @param depth The size of the third dimension (usually 1 for a one-dimensional array)
+/** Get the totals of the host-side work recorded since the profile was last cleared
+ * @param stats Receives the totals
+ */
+void mtlGetProfileStats( mtlProfileStats * stats )
+{
+    Profile & profile = Profile::getInstance();
+    std::lock_guard<std::mutex> lock( profile.mutex );
+    *stats = profile.stats;
+}
+
+
+/** Write the recorded trace as a Chrome trace-event JSON file
+ * @param path Name of the file to write
  * @return MTL_SUCCESS or MTL_ERROR
  */
-uint32_t mtlSetThreadsAndShape( CommandEncoderHandle command_encoder_handle, ComputePipelineStateHandle compute_pipeline_state_handle,  uint32_t width, uint32_t height, uint32_t depth )
+uint32_t mtlWriteProfileTrace( const char * path )
 {
-    return MTL_ERROR;
+    if ( !path || !path[ 0 ] )
+    {
+        mtlStoreError( "No trace file name." );
+        return MTL_ERROR;
+    }
+
+    std::vector<const char *> device_names;
+    for ( const std::shared_ptr<CPUDevice> & device : AllDevices() )
+        device_names.push_back( device->name.c_str() );
+
+    Profile & profile = Profile::getInstance();
+    std::lock_guard<std::mutex> lock( profile.mutex );
+    if ( !mtlWriteTraceFile( path, profile.events.data(), profile.events.size(), device_names.data(), (uint32_t)device_names.size() ) )
+    {
+        mtlStoreError( std::string( "Error writing trace file: " ) + strerror( errno ) );
+        return MTL_ERROR;
+    }
+    return MTL_SUCCESS;
 }
 
 
-/** End encoding
- * @param command_encoder_handle The handle of the command encoder
+/** Discard the recorded trace and totals */
+void mtlClearProfile( void )
+{
+    Profile & profile = Profile::getInstance();
+    std::lock_guard<std::mutex> lock( profile.mutex );
+    profile.events.clear();
+    profile.events.shrink_to_fit();
+    memset( &profile.stats, 0, sizeof( profile.stats ) );
+}
+
+
+#pragma mark Host Kernels
+/** Register a host implementation of a kernel function (CPU backend only)
+ * @param function_name Name of the kernel function as declared in the library source
+ * @param kernel The host kernel implementing the function
  * @return MTL_SUCCESS or MTL_ERROR
  */
-uint32_t mtlEndEncoding( CommandEncoderHandle command_encoder_handle )
+uint32_t mtlRegisterHostKernel( const char * function_name, mtlHostKernel kernel )
 {
-    return MTL_ERROR;
-}
\ No newline at end of file
+    if ( !function_name || !function_name[ 0 ] || !kernel )
+    {
+        mtlStoreError( "Invalid host kernel registration." );
+        return MTL_ERROR;
+    }
+
+    std::lock_guard<std::mutex> lock( KernelRegistryMutex );
+    KernelRegistry()[ function_name ] = kernel;
+    return MTL_SUCCESS;
+}
@@ -9,6 +9,21 @@
 #import <Metal/Metal.h>
 #import "MatlabMetal.h"
 #import "HandleStore.h"
+#import "BufferRegion.h"
+#import "LibraryCache.h"
+#import "ThreadgroupSize.h"
+#import "Reduction.h"
+#import "Elementwise.h"
+#import "FloatFormat.h"
+#import "Profiling.h"
+#import "Streaming.h"
+#include <mach/mach_time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 NSString * ErrorString;
 
@@ -36,6 +51,209 @@ void mtlStoreError( NSString * error_message )
 }
 
 
+#pragma mark Profiling
+
+/**
+ * Trace events (an array of mtlTraceEvent) and host totals recorded while
+ * profiling is enabled, synchronized on ProfileLock().
+ */
+static atomic_bool ProfilingIsEnabled;
+static NSMutableData * TraceEvents;
+static mtlProfileStats ProfileCounters;
+
+static NSObject * ProfileLock( void )
+{
+    static NSObject * lock;
+    static dispatch_once_t once;
+    dispatch_once( &once, ^{
+        lock = [ [NSObject alloc] init ];
+    });
+    return lock;
+}
+
+
+/** Seconds of mach absolute time, the clock of GPUStartTime and GPUEndTime */
+static double ProfileTime( void )
+{
+    static mach_timebase_info_data_t timebase;
+    static dispatch_once_t once;
+    dispatch_once( &once, ^{
+        mach_timebase_info( &timebase );
+    });
+    return (double)mach_absolute_time() * timebase.numer / timebase.denom * 1e-9;
+}
+
+
+/** The devices as numbered in the trace, process 1 + index */
+static NSArray<id<MTLDevice>> * TraceDevices( void )
+{
+    static NSArray<id<MTLDevice>> * devices;
+    static dispatch_once_t once;
+    dispatch_once( &once, ^{
+        devices = MTLCopyAllDevices();
+    });
+    return devices;
+}
+
+
+static uint32_t DeviceTraceProcess( id<MTLDevice> device )
+{
+    NSArray<id<MTLDevice>> * devices = TraceDevices();
+    for ( NSUInteger i = 0; i < [ devices count ]; i++ )
+    {
+        if ( [ devices[ i ] registryID ] == [ device registryID ] )
+            return (uint32_t)i + 1;
+    }
+    return 0;
+}
+
+
+static void RecordTraceEvents( const mtlTraceEvent * events, size_t count )
+{
+    @synchronized ( ProfileLock() ) {
+        if ( !TraceEvents )
+            TraceEvents = [ [NSMutableData alloc] init ];
+        for ( size_t i = 0; i < count; i++ )
+        {
+            mtlProfileCount( &ProfileCounters, &events[ i ] );
+            if ( [ TraceEvents length ] / sizeof( mtlTraceEvent ) < TRACE_MAX_EVENTS )
+                [ TraceEvents appendBytes:&events[ i ] length:sizeof( mtlTraceEvent ) ];
+            else
+                ProfileCounters.dropped_events++;
+        }
+    }
+}
+
+
+/** Start timing a host operation on the calling thread. Returns NO, recording nothing, if not profiling. */
+static BOOL BeginHostEvent( mtlTraceEvent * event, uint32_t category, const char * name, uint64_t handle, uint64_t bytes )
+{
+    if ( !atomic_load( &ProfilingIsEnabled ) )
+        return NO;
+    double now = ProfileTime();
+    mtlTraceEventInit( event, category, name, now, now );
+    event->thread = pthread_mach_thread_np( pthread_self() );
+    event->handle = handle;
+    event->bytes = bytes;
+    return YES;
+}
+
+
+static void EndHostEvent( mtlTraceEvent * event )
+{
+    event->duration = ProfileTime() - event->start;
+    RecordTraceEvents( event, 1 );
+}
+
+
+/**
+ * Timing of a command buffer, kept in an NSMutableData followed by the
+ * mtlDispatchTiming of each dispatch encoded while profiling.
+ */
+typedef struct {
+    mtlCommandBufferTiming timing;
+    CommandBufferHandle committed_handle;
+    uint32_t profiled;      // Committed while profiling
+    uint32_t finished;      // Execution times filled in and traced
+} CommandBufferProfileHeader;
+
+
+/** Timing records of command buffers, synchronized on the table */
+static NSMapTable<id<MTLCommandBuffer>, NSMutableData *> * CommandBufferProfiles( void )
+{
+    static NSMapTable * table;
+    static dispatch_once_t once;
+    dispatch_once( &once, ^{
+        table = [ NSMapTable weakToStrongObjectsMapTable ];
+    });
+    return table;
+}
+
+
+/** The timing record of a command buffer, created if needed. Call while synchronized on CommandBufferProfiles(). */
+static NSMutableData * ProfileForCommandBuffer( id<MTLCommandBuffer> command_buffer )
+{
+    NSMapTable * profiles = CommandBufferProfiles();
+    NSMutableData * profile = [ profiles objectForKey:command_buffer ];
+    if ( !profile ) {
+        profile = [ NSMutableData dataWithLength:sizeof( CommandBufferProfileHeader ) ];
+        [ profiles setObject:profile forKey:command_buffer ];
+    }
+    return profile;
+}
+
+
+/** The command buffer each command encoder encodes into, synchronized on the table */
+static NSMapTable<id<MTLComputeCommandEncoder>, id<MTLCommandBuffer>> * EncoderCommandBuffers( void )
+{
+    static NSMapTable * table;
+    static dispatch_once_t once;
+    dispatch_once( &once, ^{
+        table = [ NSMapTable weakToWeakObjectsMapTable ];
+    });
+    return table;
+}
+
+
+/** Note a dispatch encoded into a command buffer, if profiling */
+static void RecordEncode( id<MTLCommandBuffer> command_buffer, id<MTLComputePipelineState> compute_pipeline_state, MTLSize grid )
+{
+    if ( !atomic_load( &ProfilingIsEnabled ) || !command_buffer )
+        return;
+    
+    mtlDispatchTiming dispatch;
+    memset( &dispatch, 0, sizeof( dispatch ) );
+    if ( [ compute_pipeline_state label ] )
+        strncpy( dispatch.function_name, [ compute_pipeline_state label ].UTF8String, METALLIB_MAX_STRING_LENGTH - 1 );
+    dispatch.encode_time = ProfileTime();
+    dispatch.width = (uint32_t)grid.width;
+    dispatch.height = (uint32_t)grid.height;
+    dispatch.depth = (uint32_t)grid.depth;
+    
+    NSMapTable * profiles = CommandBufferProfiles();
+    @synchronized ( profiles ) {
+        NSMutableData * profile = ProfileForCommandBuffer( command_buffer );
+        [ profile appendBytes:&dispatch length:sizeof( dispatch ) ];
+        CommandBufferProfileHeader * header = (CommandBufferProfileHeader *)[ profile mutableBytes ];
+        if ( header->timing.encode_start == 0 )
+            header->timing.encode_start = dispatch.encode_time;
+        header->timing.encode_end = dispatch.encode_time;
+        header->timing.num_dispatches++;
+    }
+}
+
+
+/**
+ * Fill in the execution times of a completed, profiled command buffer and
+ * add it to the trace, once. Metal times only whole command buffers, so its
+ * dispatches get its times and are not traced separately.
+ */
+static void FinishCommandBufferProfile( id<MTLCommandBuffer> command_buffer, NSMutableData * profile )
+{
+    mtlTraceEvent event;
+    NSMapTable * profiles = CommandBufferProfiles();
+    @synchronized ( profiles ) {
+        CommandBufferProfileHeader * header = (CommandBufferProfileHeader *)[ profile mutableBytes ];
+        if ( header->finished )
+            return;
+        header->finished = 1;
+        header->timing.start_time = [ command_buffer GPUStartTime ];
+        header->timing.end_time = [ command_buffer GPUEndTime ];
+        header->timing.status = (uint32_t)[ command_buffer status ];
+        mtlDispatchTiming * dispatches = (mtlDispatchTiming *)( header + 1 );
+        for ( uint32_t d = 0; d < header->timing.num_dispatches; d++ )
+        {
+            dispatches[ d ].start_time = header->timing.start_time;
+            dispatches[ d ].end_time = header->timing.end_time;
+        }
+        mtlTraceEventInit( &event, TRACE_COMMAND_BUFFER, "Command buffer", header->timing.start_time, header->timing.end_time );
+        event.process = DeviceTraceProcess( [ command_buffer device ] );
+        event.handle = header->committed_handle;
+    }
+    RecordTraceEvents( &event, 1 );
+}
+
+
 #pragma mark Devices
 
 /**
@@ -93,6 +311,8 @@ uint32_t mtlGetDeviceInfo(DeviceHandle device_handle, mtlDeviceInfo *deviceInfo)
         deviceInfo->IsLowPower = [ device isLowPower ];
         deviceInfo->recommendedMaxWorkingSetSize = [ device recommendedMaxWorkingSetSize ];
         deviceInfo->RegistryID = [ device registryID ];
+        deviceInfo->ComputeUnits = 0;
+        deviceInfo->NumaNode = 0;
         return MTL_SUCCESS;
     }
 }
@@ -169,12 +389,103 @@ void mtlFreeDevice( DeviceHandle device_handle )
 
 #pragma mark Libraries
 
+/**
+ * Compiled libraries keyed by device, source and compile options. Access is
+ * synchronized on the dictionary itself.
+ */
+static NSMutableDictionary<NSString *, id<MTLLibrary>> * LibraryCacheEntries( void )
+{
+    static NSMutableDictionary * entries;
+    static dispatch_once_t once;
+    dispatch_once( &once, ^{
+        entries = [ [NSMutableDictionary alloc] init ];
+    });
+    return entries;
+}
+
+/**
+ * Compute pipeline states by function name for each library. Libraries are
+ * held strongly so keys are never reused. Access is synchronized on the table.
+ */
+static NSMapTable<id<MTLLibrary>, NSMutableDictionary<NSString *, id<MTLComputePipelineState>> *> * PipelineStateCache( void )
+{
+    static NSMapTable * table;
+    static dispatch_once_t once;
+    dispatch_once( &once, ^{
+        table = [ NSMapTable mapTableWithKeyOptions:NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality
+                                      valueOptions:NSPointerFunctionsStrongMemory ];
+    });
+    return table;
+}
+
+
+static NSString * LibraryCacheDirectory;
+static BOOL LibraryCacheDirectoryInitialized;
+static mtlLibraryCacheStats LibraryCacheCounters;
+
+
+/** Directory for on-disk artifacts, or nil if disabled. Call while synchronized on LibraryCacheEntries(). */
+static NSString * CurrentLibraryCacheDirectory( void )
+{
+    if ( !LibraryCacheDirectoryInitialized ) {
+        const char * directory = getenv( LIBRARY_CACHE_ENV_VARIABLE );
+        if ( directory && directory[0] != '\0' )
+            LibraryCacheDirectory = [ NSString stringWithUTF8String:directory ];
+        LibraryCacheDirectoryInitialized = YES;
+    }
+    return LibraryCacheDirectory;
+}
+
+
+/**
+ * Build a .metallib artifact with the offline compiler. Libraries compiled from
+ * source cannot be serialized, so failures here only cost the disk cache.
+ */
+static void StoreLibraryArtifact( NSString * path, NSString * source, uint32_t compile_options )
+{
+    NSString * temporary = [ path stringByAppendingFormat:@".%d", [ [NSProcessInfo processInfo] processIdentifier ] ];
+    NSString * source_path = [ temporary stringByAppendingString:@".metal" ];
+    NSString * library_path = [ temporary stringByAppendingString:@".metallib" ];
+    NSFileManager * files = [ NSFileManager defaultManager ];
+    
+    if ( [ source writeToFile:source_path atomically:NO encoding:NSUTF8StringEncoding error:nil ] ) {
+        NSTask * task = [ [NSTask alloc] init ];
+        task.executableURL = [ NSURL fileURLWithPath:@"/usr/bin/xcrun" ];
+        task.arguments = @[ @"-sdk", @"macosx", @"metal",
+                            ( compile_options & MTL_COMPILE_FAST_MATH ) ? @"-ffast-math" : @"-fno-fast-math",
+                            @"-o", library_path, source_path ];
+        task.standardOutput = [ NSFileHandle fileHandleWithNullDevice ];
+        task.standardError = [ NSFileHandle fileHandleWithNullDevice ];
+        if ( [ task launchAndReturnError:nil ] ) {
+            [ task waitUntilExit ];
+            if ( task.terminationStatus == 0 && rename( library_path.fileSystemRepresentation, path.fileSystemRepresentation ) == 0 )
+                library_path = nil;
+        }
+    }
+    [ files removeItemAtPath:source_path error:nil ];
+    if ( library_path )
+        [ files removeItemAtPath:library_path error:nil ];
+}
+
+
 /** Create a new library on a device from source code.
  * @param device_handle Handle to a Device
  * @param source Null-terminated string of the source code to compile
  * @return LibraryHandle on success, INVALID_HANDLE on error.
  */
 LibraryHandle mtlNewLibrary( DeviceHandle device_handle, const char * source )
+{
+    return mtlNewLibraryWithOptions( device_handle, source, MTL_COMPILE_FAST_MATH );
+}
+
+
+/** Create a new library on a device from source code with explicit compile options.
+ * @param device_handle Handle to a Device
+ * @param source Null-terminated string of the source code to compile
+ * @param compile_options Zero or more MTL_COMPILE_ flags
+ * @return LibraryHandle on success, INVALID_HANDLE on error.
+ */
+LibraryHandle mtlNewLibraryWithOptions( DeviceHandle device_handle, const char * source, uint32_t compile_options )
 {
     @autoreleasepool {
         id HS = [ HandleStore getInstance ];
@@ -185,20 +496,117 @@ LibraryHandle mtlNewLibrary( DeviceHandle device_handle, const char * source )
             return (LibraryHandle) INVALID_HANDLE;
         }
         
-        NSError * error = nil;
-        NSString *nsSource = [ NSString stringWithUTF8String:source ];
-        MTLCompileOptions *options = [MTLCompileOptions new];
-        options.fastMathEnabled = YES;
-        id<MTLLibrary> library = [ device newLibraryWithSource:nsSource options:options error:&error ];
+        if ( compile_options & ~(uint32_t)MTL_COMPILE_FAST_MATH ) {
+            mtlStoreError( @"Invalid compile options." );
+            return (LibraryHandle) INVALID_HANDLE;
+        }
+        
+        if (!source)
+            source = "";
+        char source_key[ LIBRARY_CACHE_KEY_LENGTH ];
+        mtlLibraryCacheKey( source_key, source, compile_options );
+        NSString * key = [ NSString stringWithFormat:@"%llu:%s", (unsigned long long)[ device registryID ], source_key ];
+        
+        NSMutableDictionary<NSString *, id<MTLLibrary>> * entries = LibraryCacheEntries();
+        NSString * directory;
+        @synchronized ( entries ) {
+            id<MTLLibrary> cached = entries[ key ];
+            if ( cached ) {
+                LibraryCacheCounters.memory_hits++;
+                return [ HS Library2Handle:cached ];
+            }
+            directory = CurrentLibraryCacheDirectory();
+        }
+        
+        NSString * artifact_path = directory ? [ directory stringByAppendingPathComponent:
+                                                 [ NSString stringWithFormat:@"%s.metallib", source_key ] ] : nil;
+        id<MTLLibrary> library = nil;
+        if ( artifact_path && [ [NSFileManager defaultManager] fileExistsAtPath:artifact_path ] )
+            library = [ device newLibraryWithURL:[ NSURL fileURLWithPath:artifact_path ] error:nil ];
+        BOOL from_disk = library != nil;
         
         if ( !library ) {
-            mtlStoreError( [ error localizedDescription ] );
-            return (LibraryHandle) INVALID_HANDLE;
+            NSError * error = nil;
+            NSString *nsSource = [ NSString stringWithUTF8String:source ];
+            MTLCompileOptions *options = [MTLCompileOptions new];
+            options.fastMathEnabled = ( compile_options & MTL_COMPILE_FAST_MATH ) ? YES : NO;
+            library = [ device newLibraryWithSource:nsSource options:options error:&error ];
+            
+            if ( !library ) {
+                mtlStoreError( [ error localizedDescription ] );
+                return (LibraryHandle) INVALID_HANDLE;
+            }
+            if ( artifact_path )
+                StoreLibraryArtifact( artifact_path, nsSource, compile_options );
         }
         
+        @synchronized ( entries ) {
+            if ( from_disk )
+                LibraryCacheCounters.disk_hits++;
+            else
+                LibraryCacheCounters.misses++;
+            id<MTLLibrary> cached = entries[ key ];
+            if ( cached )
+                library = cached;
+            else
+                entries[ key ] = library;
+        }
         return [ HS Library2Handle:library ];
     }
-    
+}
+
+
+/** Set the directory for on-disk library cache artifacts
+ * @param directory Path of the directory, or NULL or an empty string to disable the on-disk cache
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlSetLibraryCacheDirectory( const char * directory )
+{
+    @autoreleasepool {
+        NSString * path = ( directory && directory[0] != '\0' ) ? [ NSString stringWithUTF8String:directory ] : nil;
+        if ( path && ![ [NSFileManager defaultManager] createDirectoryAtPath:path withIntermediateDirectories:YES
+                                                                 attributes:nil error:nil ] ) {
+            mtlStoreError( @"Could not create the library cache directory." );
+            return MTL_ERROR;
+        }
+        
+        @synchronized ( LibraryCacheEntries() ) {
+            LibraryCacheDirectory = path;
+            LibraryCacheDirectoryInitialized = YES;
+        }
+        return MTL_SUCCESS;
+    }
+}
+
+
+/** Retrieve the library cache counters
+ * @param stats Pointer to a struct to receive the counters
+ */
+void mtlGetLibraryCacheStats( mtlLibraryCacheStats * stats )
+{
+    NSMutableDictionary * entries = LibraryCacheEntries();
+    @synchronized ( entries ) {
+        *stats = LibraryCacheCounters;
+        stats->entries = [ entries count ];
+    }
+}
+
+
+/** Drop all in-memory library and pipeline state cache entries and reset the counters
+ */
+void mtlClearLibraryCache( void )
+{
+    @autoreleasepool {
+        NSMutableDictionary * entries = LibraryCacheEntries();
+        @synchronized ( entries ) {
+            [ entries removeAllObjects ];
+            LibraryCacheCounters = (mtlLibraryCacheStats){ 0, 0, 0, 0 };
+        }
+        NSMapTable * pipeline_states = PipelineStateCache();
+        @synchronized ( pipeline_states ) {
+            [ pipeline_states removeAllObjects ];
+        }
+    }
 }
 
 /** Return the device on which the library was created.
@@ -283,6 +691,15 @@ void mtlFreeFunction( FunctionHandle function_handle )
 
 #pragma mark Compute Pipeline States
 
+/** Create a compute pipeline state labelled with its function's name, which profiling reports */
+static id<MTLComputePipelineState> NewComputePipelineState( id<MTLDevice> device, id<MTLFunction> function, NSError ** error )
+{
+    MTLComputePipelineDescriptor * descriptor = [ [MTLComputePipelineDescriptor alloc] init ];
+    descriptor.computeFunction = function;
+    descriptor.label = [ function name ];
+    return [ device newComputePipelineStateWithDescriptor:descriptor options:MTLPipelineOptionNone reflection:nil error:error ];
+}
+
 /// Create a new compute pipeline state
 /// @param device_handle The handle to the device on which the pipeline will be created
 /// @param function_handle  The function for which the pipeline will be created.
@@ -303,7 +720,7 @@ ComputePipelineStateHandle mtlNewComputePipelineState( DeviceHandle device_handl
         }
         
         NSError * error = nil;
-        id<MTLComputePipelineState> compute_pipeline_state = [ device newComputePipelineStateWithFunction:function error:&error ];
+        id<MTLComputePipelineState> compute_pipeline_state = NewComputePipelineState( device, function, &error );
         
         if (!compute_pipeline_state) {
             mtlStoreError( [ error localizedDescription] );
@@ -316,6 +733,64 @@ ComputePipelineStateHandle mtlNewComputePipelineState( DeviceHandle device_handl
 }
 
 
+/** Return a compute pipeline state for a function of a library, creating it on first use
+ * @param library_handle Handle to a Library
+ * @param function_name Name of the function defined in the library
+ * @return ComputePipelineStateHandle on success, INVALID_HANDLE on error.
+ */
+ComputePipelineStateHandle mtlComputePipelineStateForFunction( LibraryHandle library_handle, const char * function_name )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLLibrary> library = [ HS Handle2Library:library_handle ];
+        if (!library){
+            mtlStoreError( @"Invalid library handle." );
+            return (ComputePipelineStateHandle) INVALID_HANDLE;
+        }
+        if (!function_name) {
+            mtlStoreError( @"Library invalid or function name incorrect" );
+            return (ComputePipelineStateHandle) INVALID_HANDLE;
+        }
+        
+        NSString *ns_function_name = [ NSString stringWithUTF8String:function_name ];
+        NSMapTable * cache = PipelineStateCache();
+        @synchronized ( cache ) {
+            id<MTLComputePipelineState> cached = [ [ cache objectForKey:library ] objectForKey:ns_function_name ];
+            if ( cached )
+                return [ HS ComputePipelineState2Handle:cached ];
+        }
+        
+        id<MTLFunction> function = [ library newFunctionWithName:ns_function_name ];
+        if ( !function ){
+            mtlStoreError( @"Library invalid or function name incorrect" );
+            return (ComputePipelineStateHandle) INVALID_HANDLE;
+        }
+        
+        NSError * error = nil;
+        id<MTLComputePipelineState> compute_pipeline_state = NewComputePipelineState( library.device, function, &error );
+        if (!compute_pipeline_state) {
+            mtlStoreError( [ error localizedDescription] );
+            return (ComputePipelineStateHandle) INVALID_HANDLE;
+        }
+        
+        @synchronized ( cache ) {
+            NSMutableDictionary * states = [ cache objectForKey:library ];
+            if ( !states ) {
+                states = [ NSMutableDictionary dictionary ];
+                [ cache setObject:states forKey:library ];
+            }
+            id<MTLComputePipelineState> cached = states[ ns_function_name ];
+            if ( cached )
+                compute_pipeline_state = cached;
+            else
+                states[ ns_function_name ] = compute_pipeline_state;
+        }
+        return [ HS ComputePipelineState2Handle:compute_pipeline_state ];
+    }
+}
+
+
 /** Return the device on which the compute pipeline state was created
  * @param compute_pipeline_state_handle The handle of the compute pipeline state
  * @return DeviceHandle on succes, INVALID_HANDLE on error.
@@ -379,6 +854,25 @@ uint32_t mtlThreadExecutionWidth( ComputePipelineStateHandle compute_pipeline_st
 }
 
 
+/** Determine the largest number of threads in a threadgroup.
+ * @param compute_pipeline_state_handle The handle of the compute pipeline state to query
+ */
+uint32_t mtlMaxTotalThreadsPerThreadgroup( ComputePipelineStateHandle compute_pipeline_state_handle )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLComputePipelineState> compute_pipeline_state = [ HS Handle2ComputePipelineState:compute_pipeline_state_handle ];
+        if (!compute_pipeline_state) {
+            mtlStoreError( @"Invalid compute pipeline state handle." );
+            return 0;
+        }
+        
+        return (uint32_t)[ compute_pipeline_state maxTotalThreadsPerThreadgroup ];
+    }
+}
+
+
 
 /** Free a pipeline state
  * @param compute_pipeline_state_handle The handle of the compute pipeline state to free
@@ -460,6 +954,153 @@ void mtlFreeCommandQueue( CommandQueueHandle command_queue_handle )
 
 
 #pragma mark Buffers
+
+/** Make the results of completed GPU work on a managed buffer visible to the host */
+static void SynchronizeManagedBuffer( id<MTLBuffer> buffer )
+{
+    if ( [ buffer storageMode ] != MTLStorageModeManaged )
+        return;
+    
+    id <MTLCommandQueue> commandQueue = [ [buffer device] newCommandQueue ];
+    id <MTLCommandBuffer> commandBuffer = [ commandQueue commandBuffer ];
+    // Synchronize the managed buffer.
+    id <MTLBlitCommandEncoder> blitCommandEncoder = [ commandBuffer blitCommandEncoder ];
+    [ blitCommandEncoder synchronizeResource: buffer ];
+    [ blitCommandEncoder endEncoding ];
+    [commandBuffer commit];
+    [ commandBuffer waitUntilCompleted ];
+}
+
+
+/** Buffers created from files with MTL_FILE_READ_ONLY, held weakly */
+static NSHashTable<id<MTLBuffer>> * ReadOnlyBuffers( void )
+{
+    static NSHashTable * buffers;
+    static dispatch_once_t once;
+    dispatch_once( &once, ^{
+        buffers = [ NSHashTable hashTableWithOptions:NSPointerFunctionsWeakMemory | NSPointerFunctionsObjectPointerPersonality ];
+    });
+    return buffers;
+}
+
+
+static BOOL IsReadOnlyBuffer( id<MTLBuffer> buffer )
+{
+    NSHashTable * buffers = ReadOnlyBuffers();
+    @synchronized ( buffers ) {
+        return [ buffers containsObject:buffer ];
+    }
+}
+
+
+/** Store an error and return NO if the buffer is mapped read-only from a file */
+static BOOL CheckWritable( id<MTLBuffer> buffer )
+{
+    if ( IsReadOnlyBuffer( buffer ) ) {
+        mtlStoreError( @"The buffer is read-only." );
+        return NO;
+    }
+    return YES;
+}
+
+
+/** Tell Metal about host writes to a managed buffer; shared buffers need no notice */
+static void DidModifyBuffer( id<MTLBuffer> buffer, NSRange range )
+{
+    if ( [ buffer storageMode ] == MTLStorageModeManaged )
+        [ buffer didModifyRange:range ];
+}
+
+
+/**
+ * Buffer pools. Idle buffers are kept per device registry ID and buffer
+ * length, so a pooled buffer's length is exactly what was requested. Each
+ * idle buffer is stored with the commit serial current when it was freed,
+ * and is only reused once every command buffer committed up to then has
+ * completed. All pool state is synchronized on BufferPools().
+ */
+static NSMutableDictionary<NSNumber *, NSMutableDictionary<NSNumber *, NSMutableArray *> *> * BufferPools( void )
+{
+    static NSMutableDictionary * pools;
+    static dispatch_once_t once;
+    dispatch_once( &once, ^{
+        pools = [ [NSMutableDictionary alloc] init ];
+    });
+    return pools;
+}
+
+static NSMutableDictionary<NSNumber *, NSMutableData *> * BufferPoolCounters;
+static NSHashTable<id<MTLBuffer>> * PooledBuffers;
+static uint64_t CommitSerial;
+static NSMutableIndexSet * InFlightSerials;
+
+
+/** Counters of a device's pool. Call while synchronized on BufferPools(). */
+static mtlBufferPoolStats * BufferPoolStatsForDevice( id<MTLDevice> device )
+{
+    if ( !BufferPoolCounters ) {
+        BufferPoolCounters = [ [NSMutableDictionary alloc] init ];
+        PooledBuffers = [ NSHashTable hashTableWithOptions:NSPointerFunctionsWeakMemory | NSPointerFunctionsObjectPointerPersonality ];
+    }
+    if ( !InFlightSerials )
+        InFlightSerials = [ [NSMutableIndexSet alloc] init ];
+    NSNumber * key = @( [ device registryID ] );
+    NSMutableData * counters = BufferPoolCounters[ key ];
+    if ( !counters ) {
+        counters = [ NSMutableData dataWithLength:sizeof( mtlBufferPoolStats ) ];
+        BufferPoolCounters[ key ] = counters;
+    }
+    return (mtlBufferPoolStats *)[ counters mutableBytes ];
+}
+
+
+/** Record a commit, returning its serial for EndCommitSerial */
+static uint64_t BeginCommitSerial( void )
+{
+    @synchronized ( BufferPools() ) {
+        if ( !InFlightSerials )
+            InFlightSerials = [ [NSMutableIndexSet alloc] init ];
+        [ InFlightSerials addIndex:(NSUInteger)++CommitSerial ];
+        return CommitSerial;
+    }
+}
+
+
+static void EndCommitSerial( uint64_t serial )
+{
+    @synchronized ( BufferPools() ) {
+        [ InFlightSerials removeIndex:(NSUInteger)serial ];
+    }
+}
+
+
+/** Return a freed buffer to its pool. Returns NO if the buffer is not pooled. */
+static BOOL ReturnPooledBuffer( id<MTLBuffer> buffer )
+{
+    NSMutableDictionary * pools = BufferPools();
+    @synchronized ( pools ) {
+        if ( ![ PooledBuffers containsObject:buffer ] )
+            return NO;
+        
+        NSNumber * device_key = @( [ [buffer device] registryID ] );
+        NSNumber * length_key = @( [ buffer length ] );
+        NSMutableDictionary * free_lists = pools[ device_key ];
+        if ( !free_lists ) {
+            free_lists = [ NSMutableDictionary dictionary ];
+            pools[ device_key ] = free_lists;
+        }
+        NSMutableArray * free_list = free_lists[ length_key ];
+        if ( !free_list ) {
+            free_list = [ NSMutableArray array ];
+            free_lists[ length_key ] = free_list;
+        }
+        [ free_list addObject:@[ buffer, @( CommitSerial ) ] ];
+        BufferPoolStatsForDevice( [buffer device] )->in_use_bytes -= [ buffer length ];
+        return YES;
+    }
+}
+
+
 /** Create a new buffer on the GPU
  * @param device_handle The handle to the device on which the buffer will be created
  * @param bytes Size of the buffer in bytes
@@ -488,13 +1129,301 @@ BufferHandle mtlNewBuffer( DeviceHandle device_handle, uint64_t bytes )
 }
 
 
-/** Copy data into the GPU buffer
- * @param buffer_handle The handle to the buffer to copy data into
- * @param data A pointer to data to copy into the GPU buffer
- * @param bytes Number of bytes to copy
+/** Create a new buffer with storage from the device's buffer pool
+ * @param device_handle The handle to the device on which the buffer will be created
+ * @param bytes Size of the buffer in bytes
+ * @return BufferHandle on success, INVALID_HANDLE on error.
+ */
+BufferHandle mtlNewPooledBuffer( DeviceHandle device_handle, uint64_t bytes )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLDevice> device = [ HS Handle2Device:device_handle ];
+        if (!device) {
+            mtlStoreError( @"Invalid device handle." );
+            return (BufferHandle) INVALID_HANDLE;
+        }
+        
+        NSMutableDictionary * pools = BufferPools();
+        @synchronized ( pools ) {
+            mtlBufferPoolStats * stats = BufferPoolStatsForDevice( device );
+            NSMutableArray * free_list = pools[ @( [ device registryID ] ) ][ @( bytes ) ];
+            uint64_t oldest_in_flight = (uint64_t)[ InFlightSerials firstIndex ];
+            for ( NSUInteger i = 0; i < [ free_list count ]; i++ ) {
+                NSArray * entry = free_list[ i ];
+                if ( [ entry[1] unsignedLongLongValue ] < oldest_in_flight ) {
+                    id<MTLBuffer> buffer = entry[0];
+                    [ free_list removeObjectAtIndex:i ];
+                    stats->hits++;
+                    stats->in_use_bytes += bytes;
+                    return [ HS Buffer2Handle:buffer ];
+                }
+            }
+            stats->misses++;
+        }
+        
+        id<MTLBuffer> buffer = [device newBufferWithLength:bytes options:MTLResourceStorageModeManaged];
+        if (!buffer) {
+            mtlStoreError( @"Error creating buffer." );
+            return (BufferHandle) INVALID_HANDLE;
+        }
+        
+        @synchronized ( pools ) {
+            mtlBufferPoolStats * stats = BufferPoolStatsForDevice( device );
+            stats->reserved_bytes += bytes;
+            stats->in_use_bytes += bytes;
+            [ PooledBuffers addObject:buffer ];
+        }
+        return [ HS Buffer2Handle:buffer ];
+    }
+}
+
+
+/** Create a new buffer over a range of a file
+ * @param device_handle The handle to the device on which the buffer will be created
+ * @param path Path of the file
+ * @param offset Byte offset of the range in the file
+ * @param length Size of the range in bytes; zero for the rest of the file
+ * @param mode MTL_FILE_READ_ONLY or MTL_FILE_COPY_ON_WRITE
+ * @return BufferHandle on success, INVALID_HANDLE on error.
+ */
+BufferHandle mtlNewBufferFromFile( DeviceHandle device_handle, const char * path, uint64_t offset, uint64_t length, uint32_t mode )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLDevice> device = [ HS Handle2Device:device_handle ];
+        if (!device) {
+            mtlStoreError( @"Invalid device handle." );
+            return (BufferHandle) INVALID_HANDLE;
+        }
+        if ( mode != MTL_FILE_READ_ONLY && mode != MTL_FILE_COPY_ON_WRITE ) {
+            mtlStoreError( @"Invalid file mapping mode." );
+            return (BufferHandle) INVALID_HANDLE;
+        }
+        if ( !path ) {
+            mtlStoreError( @"No file path." );
+            return (BufferHandle) INVALID_HANDLE;
+        }
+        
+        int fd = open( path, O_RDONLY | O_CLOEXEC );
+        if ( fd < 0 ) {
+            mtlStoreError( [ NSString stringWithFormat:@"Error opening file: %s", strerror( errno ) ] );
+            return (BufferHandle) INVALID_HANDLE;
+        }
+        struct stat info;
+        if ( fstat( fd, &info ) != 0 || !S_ISREG( info.st_mode ) ) {
+            close( fd );
+            mtlStoreError( @"Not a regular file." );
+            return (BufferHandle) INVALID_HANDLE;
+        }
+        uint64_t file_size = (uint64_t)info.st_size;
+        if ( length == 0 && offset < file_size )
+            length = file_size - offset;
+        if ( length == 0 || offset > file_size || length > file_size - offset ) {
+            close( fd );
+            mtlStoreError( @"Range exceeds the file size." );
+            return (BufferHandle) INVALID_HANDLE;
+        }
+        
+        // newBufferWithBytesNoCopy needs whole pages, and the buffer's length is the
+        // range's, so a range off page boundaries is read into a new buffer instead.
+        id<MTLBuffer> buffer = nil;
+        uint64_t page = (uint64_t)getpagesize();
+        if ( offset % page == 0 && length % page == 0 ) {
+            int protection = mode == MTL_FILE_READ_ONLY ? PROT_READ : PROT_READ | PROT_WRITE;
+            int flags = mode == MTL_FILE_READ_ONLY ? MAP_SHARED : MAP_PRIVATE;
+            void * mapping = mmap( NULL, length, protection, flags, fd, (off_t)offset );
+            if ( mapping == MAP_FAILED ) {
+                close( fd );
+                mtlStoreError( [ NSString stringWithFormat:@"Error mapping file: %s", strerror( errno ) ] );
+                return (BufferHandle) INVALID_HANDLE;
+            }
+            madvise( mapping, length, MADV_SEQUENTIAL );
+            buffer = [ device newBufferWithBytesNoCopy:mapping length:length options:MTLResourceStorageModeShared
+                                           deallocator:^( void * pointer, NSUInteger bytes ) { munmap( pointer, bytes ); } ];
+            if (!buffer)
+                munmap( mapping, length );
+        } else {
+            buffer = [ device newBufferWithLength:length options:MTLResourceStorageModeShared ];
+            uint8_t * contents = buffer ? (uint8_t *)[ buffer contents ] : NULL;
+            for ( uint64_t done = 0; buffer && done < length; ) {
+                ssize_t bytes = pread( fd, contents + done, (size_t)MIN( length - done, (uint64_t)1 << 30 ), (off_t)( offset + done ) );
+                if ( bytes <= 0 )
+                    buffer = nil;
+                else
+                    done += (uint64_t)bytes;
+            }
+        }
+        close( fd );
+        if (!buffer) {
+            mtlStoreError( @"Error creating buffer." );
+            return (BufferHandle) INVALID_HANDLE;
+        }
+        
+        if ( mode == MTL_FILE_READ_ONLY ) {
+            NSHashTable * read_only = ReadOnlyBuffers();
+            @synchronized ( read_only ) {
+                [ read_only addObject:buffer ];
+            }
+        }
+        return [ HS Buffer2Handle:buffer ];
+    }
+}
+
+
+/** Alignment of the memory mtlNewBufferWithHostPointer can wrap on a device
+ * @param device_handle The handle to the device
+ * @return The alignment in bytes (the page size on Metal), 0 on error
+ */
+uint64_t mtlHostPointerAlignment( DeviceHandle device_handle )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        if ( ![ HS Handle2Device:device_handle ] ) {
+            mtlStoreError( @"Invalid device handle." );
+            return 0;
+        }
+        return (uint64_t)getpagesize();
+    }
+}
+
+
+/** Create a new buffer using caller memory as its storage, without a copy
+ * @param device_handle The handle to the device on which the buffer will be created
+ * @param pointer The memory to wrap
+ * @param bytes Size of the memory in bytes
+ * @param deallocator Called with pointer, bytes and user_data once the buffer is released, or NULL
+ * @param user_data Passed to the deallocator
+ * @return BufferHandle on success, INVALID_HANDLE on error.
+ */
+BufferHandle mtlNewBufferWithHostPointer( DeviceHandle device_handle, void * pointer, uint64_t bytes, mtlHostDeallocator deallocator, void * user_data )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLDevice> device = [ HS Handle2Device:device_handle ];
+        if (!device) {
+            mtlStoreError( @"Invalid device handle." );
+            return (BufferHandle) INVALID_HANDLE;
+        }
+        if ( !pointer || bytes == 0 ) {
+            mtlStoreError( @"No memory to wrap." );
+            return (BufferHandle) INVALID_HANDLE;
+        }
+        // newBufferWithBytesNoCopy takes whole pages only
+        uint64_t page = (uint64_t)getpagesize();
+        if ( (uintptr_t)pointer % page != 0 || bytes % page != 0 ) {
+            mtlStoreError( @"Host pointer is not aligned to mtlHostPointerAlignment." );
+            return (BufferHandle) INVALID_HANDLE;
+        }
+        
+        // Command buffers retain the buffer until they complete, so the deallocator runs after the last of them.
+        id<MTLBuffer> buffer = [ device newBufferWithBytesNoCopy:pointer length:bytes options:MTLResourceStorageModeShared
+                                                     deallocator:^( void * memory, NSUInteger length ) {
+            if ( deallocator )
+                deallocator( memory, length, user_data );
+        } ];
+        if (!buffer) {
+            mtlStoreError( @"Error creating buffer." );
+            return (BufferHandle) INVALID_HANDLE;
+        }
+        return [ HS Buffer2Handle:buffer ];
+    }
+}
+
+
+/** Retrieve the buffer pool counters of a device
+ * @param device_handle The handle to the device
+ * @param stats Pointer to a struct to receive the counters
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlGetBufferPoolStats( DeviceHandle device_handle, mtlBufferPoolStats * stats )
+{
+    @autoreleasepool {
+        id<MTLDevice> device = [ [ HandleStore getInstance ] Handle2Device:device_handle ];
+        if (!device) {
+            mtlStoreError( @"Invalid device handle." );
+            return MTL_ERROR;
+        }
+        
+        @synchronized ( BufferPools() ) {
+            *stats = *BufferPoolStatsForDevice( device );
+        }
+        return MTL_SUCCESS;
+    }
+}
+
+
+/** Release idle buffer pool storage of a device
+ * @param device_handle The handle to the device
+ * @param max_idle_bytes Idle storage to keep for reuse; zero releases all of it
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlTrimBufferPool( DeviceHandle device_handle, uint64_t max_idle_bytes )
+{
+    @autoreleasepool {
+        id<MTLDevice> device = [ [ HandleStore getInstance ] Handle2Device:device_handle ];
+        if (!device) {
+            mtlStoreError( @"Invalid device handle." );
+            return MTL_ERROR;
+        }
+        
+        // Command buffers retain the buffers they use, so dropping idle buffers is always safe.
+        NSMutableDictionary * pools = BufferPools();
+        @synchronized ( pools ) {
+            mtlBufferPoolStats * stats = BufferPoolStatsForDevice( device );
+            NSMutableDictionary<NSNumber *, NSMutableArray *> * free_lists = pools[ @( [ device registryID ] ) ];
+            for ( NSNumber * length_key in [ free_lists allKeys ] ) {
+                NSMutableArray * free_list = free_lists[ length_key ];
+                uint64_t length = [ length_key unsignedLongLongValue ];
+                while ( [ free_list count ] > 0 && stats->reserved_bytes - stats->in_use_bytes > max_idle_bytes ) {
+                    [ free_list removeLastObject ];
+                    stats->reserved_bytes -= length;
+                }
+                if ( [ free_list count ] == 0 )
+                    [ free_lists removeObjectForKey:length_key ];
+            }
+        }
+        return MTL_SUCCESS;
+    }
+}
+
+
+/** Copy data into the GPU buffer
+ * @param buffer_handle The handle to the buffer to copy data into
+ * @param data A pointer to data to copy into the GPU buffer
+ * @param bytes Number of bytes to copy
  * @return MTL_SUCCESS or MTL_ERROR
  */
 uint32_t mtlCopyDataToBuffer( BufferHandle buffer_handle, const void * data, uint64_t bytes )
+{
+    return mtlCopyDataToBufferRange( buffer_handle, 0, data, bytes );
+}
+
+
+/** Copy data from the GPU buffer
+ * @param buffer_handle The handle to the buffer to copy data from
+ * @param data A pointer to copy the data into
+ * @param bytes Number of bytes to copy
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCopyDataFromBuffer( BufferHandle buffer_handle, void * data, uint64_t bytes )
+{
+    return mtlCopyDataFromBufferRange( buffer_handle, 0, data, bytes );
+}
+
+
+/** Copy data into part of a GPU buffer
+ * @param buffer_handle The handle to the buffer to copy data into
+ * @param offset Byte offset in the buffer at which to start writing
+ * @param data A pointer to data to copy into the GPU buffer
+ * @param bytes Number of bytes to copy
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCopyDataToBufferRange( BufferHandle buffer_handle, uint64_t offset, const void * data, uint64_t bytes )
 {
     @autoreleasepool {
         id HS = [ HandleStore getInstance ];
@@ -505,25 +1434,32 @@ uint32_t mtlCopyDataToBuffer( BufferHandle buffer_handle, const void * data, uin
             return MTL_ERROR;
         }
         
-        if ( bytes > [ buffer length ])
+        if ( !CheckWritable( buffer ) )
+            return MTL_ERROR;
+        if ( offset > [ buffer length ] || bytes > [ buffer length ] - offset )
         {
             mtlStoreError( @"Buffer too small to copy data." );
             return MTL_ERROR;
         }
-        memcpy( [ buffer contents ], data, bytes );
-        [ buffer didModifyRange:NSMakeRange(0 , bytes) ];
+        mtlTraceEvent trace;
+        BOOL traced = BeginHostEvent( &trace, TRACE_COPY_IN, "Copy to buffer", buffer_handle, bytes );
+        memcpy( (uint8_t *)[ buffer contents ] + offset, data, bytes );
+        DidModifyBuffer( buffer, NSMakeRange( offset, bytes ) );
+        if ( traced )
+            EndHostEvent( &trace );
         return MTL_SUCCESS;
     }
 }
 
 
-/** Copy data from the GPU buffer
+/** Copy data from part of a GPU buffer
  * @param buffer_handle The handle to the buffer to copy data from
+ * @param offset Byte offset in the buffer at which to start reading
  * @param data A pointer to copy the data into
  * @param bytes Number of bytes to copy
  * @return MTL_SUCCESS or MTL_ERROR
  */
-uint32_t mtlCopyDataFromBuffer( BufferHandle buffer_handle, void * data, uint64_t bytes )
+uint32_t mtlCopyDataFromBufferRange( BufferHandle buffer_handle, uint64_t offset, void * data, uint64_t bytes )
 {
     @autoreleasepool {
         id HS = [ HandleStore getInstance ];
@@ -534,32 +1470,32 @@ uint32_t mtlCopyDataFromBuffer( BufferHandle buffer_handle, void * data, uint64_
             return MTL_ERROR;
         }
         
-        if ( bytes > [ buffer length ])
+        if ( offset > [ buffer length ] || bytes > [ buffer length ] - offset )
         {
             mtlStoreError( @"Buffer smaller than specified number of bytes to copy." );
             return MTL_ERROR;
         }
         
-        id <MTLCommandQueue> commandQueue = [ [buffer device] newCommandQueue ];
-        id <MTLCommandBuffer> commandBuffer = [ commandQueue commandBuffer ];
-        // Synchronize the managed buffer.
-        id <MTLBlitCommandEncoder> blitCommandEncoder = [ commandBuffer blitCommandEncoder ];
-        [ blitCommandEncoder synchronizeResource: buffer ];
-        [ blitCommandEncoder endEncoding ];
-        [commandBuffer commit];
-        [ commandBuffer waitUntilCompleted ];
-        
-        memcpy( data, [ buffer contents ], bytes );
+        mtlTraceEvent trace;
+        BOOL traced = BeginHostEvent( &trace, TRACE_COPY_OUT, "Copy from buffer", buffer_handle, bytes );
+        SynchronizeManagedBuffer( buffer );
+        memcpy( data, (const uint8_t *)[ buffer contents ] + offset, bytes );
+        if ( traced )
+            EndHostEvent( &trace );
         return MTL_SUCCESS;
     }
 }
 
 
-/** Return the size of a buffer
- * @param buffer_handle The handle of the buffer to free
- * @return MTL_ERROR if the buffer is of zero size or does not exist, size of the allocated buffer otherwise.
+/** Copy floats into a buffer, converting them to the buffer's element format
+ * @param buffer_handle The handle to the buffer to copy data into
+ * @param first_element Zero-based index of the first buffer element to write
+ * @param data The floats to copy
+ * @param count Number of elements to copy
+ * @param format One of the MTL_FORMAT_ element formats
+ * @return MTL_SUCCESS or MTL_ERROR
  */
-uint64_t mtlBufferSize( BufferHandle buffer_handle )
+uint32_t mtlCopyFloatsToBuffer( BufferHandle buffer_handle, uint64_t first_element, const float * data, uint64_t count, uint32_t format )
 {
     @autoreleasepool {
         id HS = [ HandleStore getInstance ];
@@ -569,17 +1505,50 @@ uint64_t mtlBufferSize( BufferHandle buffer_handle )
             mtlStoreError( @"Invalid buffer handle." );
             return MTL_ERROR;
         }
-        return [ buffer length ];
+        uint64_t element_size = mtlFormatSize( format );
+        if ( element_size == 0 ) {
+            mtlStoreError( @"Unknown element format." );
+            return MTL_ERROR;
+        }
+        
+        if ( !CheckWritable( buffer ) )
+            return MTL_ERROR;
+        
+        uint64_t elements = [ buffer length ] / element_size;
+        if ( first_element > elements || count > elements - first_element )
+        {
+            mtlStoreError( @"Buffer too small to copy data." );
+            return MTL_ERROR;
+        }
+        
+        mtlTraceEvent trace;
+        BOOL traced = BeginHostEvent( &trace, TRACE_COPY_IN, "Copy floats to buffer", buffer_handle, count * element_size );
+        void * contents = (uint8_t *)[ buffer contents ] + first_element * element_size;
+        if ( format == MTL_FORMAT_FLOAT )
+            memcpy( contents, data, count * sizeof( float ) );
+        else if ( format == MTL_FORMAT_HALF )
+            for ( uint64_t i = 0; i < count; i++ )
+                ( (uint16_t *)contents )[ i ] = mtlFloatToHalf( data[ i ] );
+        else
+            for ( uint64_t i = 0; i < count; i++ )
+                ( (uint16_t *)contents )[ i ] = mtlFloatToBFloat16( data[ i ] );
+        DidModifyBuffer( buffer, NSMakeRange( first_element * element_size, count * element_size ) );
+        if ( traced )
+            EndHostEvent( &trace );
+        return MTL_SUCCESS;
     }
 }
 
 
-
-/** Return the device on which the buffer was created
- * @param buffer_handle The handle of the buffer to free
- * @return DeviceHandle on succes, INVALID_HANDLE on error.
+/** Copy elements of a buffer out as floats, converting them from the buffer's element format
+ * @param buffer_handle The handle to the buffer to copy data from
+ * @param first_element Zero-based index of the first buffer element to read
+ * @param data Receives count floats
+ * @param count Number of elements to copy
+ * @param format One of the MTL_FORMAT_ element formats
+ * @return MTL_SUCCESS or MTL_ERROR
  */
-DeviceHandle mtlBufferDevice( BufferHandle buffer_handle )
+uint32_t mtlCopyFloatsFromBuffer( BufferHandle buffer_handle, uint64_t first_element, float * data, uint64_t count, uint32_t format )
 {
     @autoreleasepool {
         id HS = [ HandleStore getInstance ];
@@ -587,74 +1556,1929 @@ DeviceHandle mtlBufferDevice( BufferHandle buffer_handle )
         id<MTLBuffer> buffer = [ HS Handle2Buffer:buffer_handle ];
         if (!buffer) {
             mtlStoreError( @"Invalid buffer handle." );
-            return (DeviceHandle)INVALID_HANDLE;
+            return MTL_ERROR;
+        }
+        uint64_t element_size = mtlFormatSize( format );
+        if ( element_size == 0 ) {
+            mtlStoreError( @"Unknown element format." );
+            return MTL_ERROR;
         }
         
-        id<MTLDevice> device = [ buffer device ];
-        if (!device) {
-            mtlStoreError( @"Error retrieving device for buffer." );
-            return (DeviceHandle)INVALID_HANDLE;
+        uint64_t elements = [ buffer length ] / element_size;
+        if ( first_element > elements || count > elements - first_element )
+        {
+            mtlStoreError( @"Buffer smaller than specified number of elements to copy." );
+            return MTL_ERROR;
         }
         
-        return [ HS Device2Handle:device ];
+        mtlTraceEvent trace;
+        BOOL traced = BeginHostEvent( &trace, TRACE_COPY_OUT, "Copy floats from buffer", buffer_handle, count * element_size );
+        SynchronizeManagedBuffer( buffer );
+        const void * contents = (const uint8_t *)[ buffer contents ] + first_element * element_size;
+        if ( format == MTL_FORMAT_FLOAT )
+            memcpy( data, contents, count * sizeof( float ) );
+        else if ( format == MTL_FORMAT_HALF )
+            for ( uint64_t i = 0; i < count; i++ )
+                data[ i ] = mtlHalfToFloat( ( (const uint16_t *)contents )[ i ] );
+        else
+            for ( uint64_t i = 0; i < count; i++ )
+                data[ i ] = mtlBFloat16ToFloat( ( (const uint16_t *)contents )[ i ] );
+        if ( traced )
+            EndHostEvent( &trace );
+        return MTL_SUCCESS;
     }
 }
 
 
-
-/** Free a GPU buffer
- * @param buffer_handle The handle of the buffer to free
+/** Copy a block of elements into a sub-block of a three-dimensional array held in a GPU buffer
+ * @param buffer_handle The handle to the buffer to copy data into
+ * @param buffer_dimensions Dimensions of the array in the buffer, in elements
+ * @param origin Zero-based index of the first element of the sub-block in each dimension
+ * @param region Dimensions of the sub-block, in elements
+ * @param element_size Size of one element in bytes
+ * @param data A pointer to the region[0] * region[1] * region[2] elements to copy
+ * @return MTL_SUCCESS or MTL_ERROR
  */
-void mtlFreeBuffer( BufferHandle buffer_handle )
+uint32_t mtlCopyRegionToBuffer( BufferHandle buffer_handle, const uint64_t buffer_dimensions[3], const uint64_t origin[3], const uint64_t region[3], uint32_t element_size, const void * data )
 {
     @autoreleasepool {
         id HS = [ HandleStore getInstance ];
+        
         id<MTLBuffer> buffer = [ HS Handle2Buffer:buffer_handle ];
         if (!buffer) {
             mtlStoreError( @"Invalid buffer handle." );
-            return;
+            return MTL_ERROR;
         }
-        [ HS FreeBuffer:buffer_handle ];
+        
+        if ( !CheckWritable( buffer ) )
+            return MTL_ERROR;
+        
+        mtlRegionLayout layout;
+        if ( !mtlMakeRegionLayout( buffer_dimensions, origin, region, element_size, [ buffer length ], &layout ) )
+        {
+            mtlStoreError( @"Region does not fit the buffer dimensions." );
+            return MTL_ERROR;
+        }
+        
+        mtlTraceEvent trace;
+        BOOL traced = BeginHostEvent( &trace, TRACE_COPY_IN, "Copy region to buffer", buffer_handle, region[0] * region[1] * region[2] * element_size );
+        uint8_t * contents = (uint8_t *)[ buffer contents ] + layout.first_byte;
+        const uint8_t * source = (const uint8_t *)data;
+        for ( uint64_t k = 0; k < layout.runs_z; k++ )
+            for ( uint64_t j = 0; j < layout.runs_y; j++ )
+            {
+                memcpy( contents + j * layout.stride_y + k * layout.stride_z, source, layout.run_bytes );
+                source += layout.run_bytes;
+            }
+        if ( layout.end_byte > layout.first_byte )
+            DidModifyBuffer( buffer, NSMakeRange( layout.first_byte, layout.end_byte - layout.first_byte ) );
+        if ( traced )
+            EndHostEvent( &trace );
+        return MTL_SUCCESS;
     }
 }
 
 
-#pragma mark Command Buffers
+/** Copy a sub-block of a three-dimensional array held in a GPU buffer into a dense array
+ * @param buffer_handle The handle to the buffer to copy data from
+ * @param buffer_dimensions Dimensions of the array in the buffer, in elements
+ * @param origin Zero-based index of the first element of the sub-block in each dimension
+ * @param region Dimensions of the sub-block, in elements
+ * @param element_size Size of one element in bytes
+ * @param data A pointer to room for region[0] * region[1] * region[2] elements
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCopyRegionFromBuffer( BufferHandle buffer_handle, const uint64_t buffer_dimensions[3], const uint64_t origin[3], const uint64_t region[3], uint32_t element_size, void * data )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLBuffer> buffer = [ HS Handle2Buffer:buffer_handle ];
+        if (!buffer) {
+            mtlStoreError( @"Invalid buffer handle." );
+            return MTL_ERROR;
+        }
+        
+        mtlRegionLayout layout;
+        if ( !mtlMakeRegionLayout( buffer_dimensions, origin, region, element_size, [ buffer length ], &layout ) )
+        {
+            mtlStoreError( @"Region does not fit the buffer dimensions." );
+            return MTL_ERROR;
+        }
+        if ( layout.end_byte == layout.first_byte )
+            return MTL_SUCCESS;
+        
+        mtlTraceEvent trace;
+        BOOL traced = BeginHostEvent( &trace, TRACE_COPY_OUT, "Copy region from buffer", buffer_handle, region[0] * region[1] * region[2] * element_size );
+        SynchronizeManagedBuffer( buffer );
+        const uint8_t * contents = (const uint8_t *)[ buffer contents ] + layout.first_byte;
+        uint8_t * destination = (uint8_t *)data;
+        for ( uint64_t k = 0; k < layout.runs_z; k++ )
+            for ( uint64_t j = 0; j < layout.runs_y; j++ )
+            {
+                memcpy( destination, contents + j * layout.stride_y + k * layout.stride_z, layout.run_bytes );
+                destination += layout.run_bytes;
+            }
+        if ( traced )
+            EndHostEvent( &trace );
+        return MTL_SUCCESS;
+    }
+}
 
-/** Create a command buffer
- * @param command_queue_handle A handle to a command queue on which to create the command buffer
- * @return A command buffer handle or INVALID_HANDLE
+
+/** Map a buffer for direct host access to its storage
+ * @param buffer_handle The handle to the buffer to map
+ * @param map_flags MTL_MAP_READ, MTL_MAP_WRITE or MTL_MAP_READ_WRITE
+ * @return A pointer to the buffer contents, NULL on error
  */
-CommandBufferHandle mtlNewCommandBuffer( CommandQueueHandle command_queue_handle )
+void * mtlMapBuffer( BufferHandle buffer_handle, uint32_t map_flags )
 {
     @autoreleasepool {
         id HS = [ HandleStore getInstance ];
         
-        id<MTLCommandQueue> command_queue = [ HS Handle2CommandQueue:command_queue_handle ];
-        if (!command_queue) {
-            mtlStoreError( @"Invalid command queue handle." );
-            return (CommandBufferHandle)INVALID_HANDLE;
+        id<MTLBuffer> buffer = [ HS Handle2Buffer:buffer_handle ];
+        if (!buffer) {
+            mtlStoreError( @"Invalid buffer handle." );
+            return NULL;
+        }
+        
+        if ( map_flags == 0 || ( map_flags & ~(uint32_t)MTL_MAP_READ_WRITE ) != 0 )
+        {
+            mtlStoreError( @"Invalid buffer map flags." );
+            return NULL;
+        }
+        if ( ( map_flags & MTL_MAP_WRITE ) && !CheckWritable( buffer ) )
+            return NULL;
+        
+        if ( map_flags & MTL_MAP_READ )
+            SynchronizeManagedBuffer( buffer );
+        return [ buffer contents ];
+    }
+}
+
+
+/** Unmap a buffer previously mapped with mtlMapBuffer
+ * @param buffer_handle The handle to the mapped buffer
+ * @param dirty_offset Offset in bytes of the first modified byte
+ * @param dirty_length Number of modified bytes
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlUnmapBuffer( BufferHandle buffer_handle, uint64_t dirty_offset, uint64_t dirty_length )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLBuffer> buffer = [ HS Handle2Buffer:buffer_handle ];
+        if (!buffer) {
+            mtlStoreError( @"Invalid buffer handle." );
+            return MTL_ERROR;
+        }
+        
+        if ( dirty_offset > [ buffer length ] || dirty_length > [ buffer length ] - dirty_offset )
+        {
+            mtlStoreError( @"Dirty range exceeds the buffer size." );
+            return MTL_ERROR;
+        }
+        
+        if ( dirty_length > 0 && [ buffer storageMode ] == MTLStorageModeManaged )
+            [ buffer didModifyRange:NSMakeRange( dirty_offset, dirty_length ) ];
+        return MTL_SUCCESS;
+    }
+}
+
+
+/** Return the size of a buffer
+ * @param buffer_handle The handle of the buffer to free
+ * @return MTL_ERROR if the buffer is of zero size or does not exist, size of the allocated buffer otherwise.
+ */
+uint64_t mtlBufferSize( BufferHandle buffer_handle )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLBuffer> buffer = [ HS Handle2Buffer:buffer_handle ];
+        if (!buffer) {
+            mtlStoreError( @"Invalid buffer handle." );
+            return MTL_ERROR;
+        }
+        return [ buffer length ];
+    }
+}
+
+
+
+/** Return the device on which the buffer was created
+ * @param buffer_handle The handle of the buffer to free
+ * @return DeviceHandle on succes, INVALID_HANDLE on error.
+ */
+DeviceHandle mtlBufferDevice( BufferHandle buffer_handle )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLBuffer> buffer = [ HS Handle2Buffer:buffer_handle ];
+        if (!buffer) {
+            mtlStoreError( @"Invalid buffer handle." );
+            return (DeviceHandle)INVALID_HANDLE;
+        }
+        
+        id<MTLDevice> device = [ buffer device ];
+        if (!device) {
+            mtlStoreError( @"Error retrieving device for buffer." );
+            return (DeviceHandle)INVALID_HANDLE;
+        }
+        
+        return [ HS Device2Handle:device ];
+    }
+}
+
+
+
+/** Free a GPU buffer
+ * @param buffer_handle The handle of the buffer to free
+ */
+void mtlFreeBuffer( BufferHandle buffer_handle )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        id<MTLBuffer> buffer = [ HS Handle2Buffer:buffer_handle ];
+        if (!buffer) {
+            mtlStoreError( @"Invalid buffer handle." );
+            return;
+        }
+        [ HS FreeBuffer:buffer_handle ];
+        ReturnPooledBuffer( buffer );
+    }
+}
+
+
+#pragma mark Command Buffers
+
+/** Broadcast whenever any committed command buffer completes */
+static NSCondition * CompletionCondition( void )
+{
+    static NSCondition * condition;
+    static dispatch_once_t once;
+    dispatch_once( &once, ^{
+        condition = [ [NSCondition alloc] init ];
+    });
+    return condition;
+}
+
+
+static BOOL CommandBufferFinished( id<MTLCommandBuffer> command_buffer )
+{
+    MTLCommandBufferStatus status = [ command_buffer status ];
+    return status == MTLCommandBufferStatusCompleted || status == MTLCommandBufferStatusError;
+}
+
+
+/** Look up command buffers to wait on, all of which must have been committed */
+static NSArray<id<MTLCommandBuffer>> * CommittedCommandBuffers( const CommandBufferHandle * command_buffer_handles, uint32_t count )
+{
+    if ( count == 0 || !command_buffer_handles ) {
+        mtlStoreError( @"No command buffers to wait for." );
+        return nil;
+    }
+    
+    id HS = [ HandleStore getInstance ];
+    NSMutableArray<id<MTLCommandBuffer>> * command_buffers = [ NSMutableArray arrayWithCapacity:count ];
+    for ( uint32_t i = 0; i < count; i++ )
+    {
+        id<MTLCommandBuffer> command_buffer = [ HS Handle2CommandBuffer:command_buffer_handles[ i ] ];
+        if (!command_buffer) {
+            mtlStoreError( @"Invalid command buffer handle." );
+            return nil;
+        }
+        if ( [ command_buffer status ] < MTLCommandBufferStatusCommitted ) {
+            mtlStoreError( @"Command buffer has not been committed." );
+            return nil;
+        }
+        [ command_buffers addObject:command_buffer ];
+    }
+    return command_buffers;
+}
+
+
+/** Create a command buffer
+ * @param command_queue_handle A handle to a command queue on which to create the command buffer
+ * @return A command buffer handle or INVALID_HANDLE
+ */
+CommandBufferHandle mtlNewCommandBuffer( CommandQueueHandle command_queue_handle )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLCommandQueue> command_queue = [ HS Handle2CommandQueue:command_queue_handle ];
+        if (!command_queue) {
+            mtlStoreError( @"Invalid command queue handle." );
+            return (CommandBufferHandle)INVALID_HANDLE;
+        }
+        
+        id<MTLCommandBuffer> command_buffer = [ command_queue commandBuffer ];
+        if (!command_buffer)
+        {
+            mtlStoreError( @"Error creating the command buffer." );
+            return (CommandBufferHandle)INVALID_HANDLE;
+        }
+        
+        return [ HS CommandBuffer2Handle:command_buffer ];
+    }
+    
+}
+
+
+
+/** Return the device on which the command buffer was created
+ * @param command_buffer_handle The handle of the command buffer
+ * @return DeviceHandle on succes, INVALID_HANDLE on error.
+ */
+DeviceHandle mtlCommandBufferDevice( CommandBufferHandle command_buffer_handle )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLCommandBuffer> command_buffer = [ HS Handle2CommandBuffer:command_buffer_handle ];
+        if (!command_buffer) {
+            mtlStoreError( @"Invalid command buffer handle." );
+            return (DeviceHandle)INVALID_HANDLE;
+        }
+        
+        id<MTLDevice> device = [ command_buffer device ];
+        if (!device) {
+            mtlStoreError( @"Error retrieving device for command buffer." );
+            return (DeviceHandle)INVALID_HANDLE;
+        }
+        
+        return [ HS Device2Handle:device ];
+    }
+}
+
+
+
+/** Copy a command buffer
+ * @param command_buffer_handle The handle of the command buffer to copy
+ */
+CommandBufferHandle mtlCopyCommandBuffer( CommandBufferHandle command_buffer_handle )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLCommandBuffer> command_buffer = [ HS Handle2CommandBuffer:command_buffer_handle ];
+        if (!command_buffer) {
+            mtlStoreError( @"Invalid command buffer handle." );
+            return (CommandBufferHandle)INVALID_HANDLE;
+        }
+        
+        return [ HS CommandBuffer2Handle:command_buffer ];
+    }
+}
+
+
+
+/** Free a command buffer
+ * @param command_buffer_handle The handle of the command buffer to free
+ */
+void mtlFreeCommandBuffer( CommandBufferHandle command_buffer_handle )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        [ HS FreeCommandBuffer:command_buffer_handle ];
+    }
+}
+
+
+/** Commit a command buffer for execution
+ * @param command_buffer_handle The handle of the command buffer to free
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCommitCommandBuffer( CommandBufferHandle command_buffer_handle )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLCommandBuffer> command_buffer = [ HS Handle2CommandBuffer:command_buffer_handle ];
+        if (!command_buffer) {
+            mtlStoreError( @"Invalid command buffer handle." );
+            return MTL_ERROR;
+        }
+        
+        if ( [ command_buffer status ] != MTLCommandBufferStatusNotEnqueued ) {
+            mtlStoreError( @"Command buffer has already been committed." );
+            return MTL_ERROR;
+        }
+        
+        mtlTraceEvent trace;
+        BOOL traced = BeginHostEvent( &trace, TRACE_COMMIT, "Commit", command_buffer_handle, 0 );
+        NSMutableData * profile = nil;
+        if ( traced ) {
+            mtlTraceEvent encode;
+            memset( &encode, 0, sizeof( encode ) );
+            NSMapTable * profiles = CommandBufferProfiles();
+            @synchronized ( profiles ) {
+                profile = ProfileForCommandBuffer( command_buffer );
+                CommandBufferProfileHeader * header = (CommandBufferProfileHeader *)[ profile mutableBytes ];
+                header->profiled = 1;
+                header->committed_handle = command_buffer_handle;
+                header->timing.commit_time = trace.start;
+                if ( header->timing.encode_start != 0 ) {
+                    mtlTraceEventInit( &encode, TRACE_ENCODE, "Encode", header->timing.encode_start, header->timing.encode_end );
+                    encode.thread = trace.thread;
+                    encode.handle = command_buffer_handle;
+                }
+            }
+            if ( encode.start != 0 )
+                RecordTraceEvents( &encode, 1 );
+        }
+        
+        NSCondition * condition = CompletionCondition();
+        uint64_t serial = BeginCommitSerial();
+        [ command_buffer addCompletedHandler:^(id<MTLCommandBuffer> completed) {
+            if ( profile )
+                FinishCommandBufferProfile( completed, profile );
+            EndCommitSerial( serial );
+            [ condition lock ];
+            [ condition broadcast ];
+            [ condition unlock ];
+        }];
+        [command_buffer commit];
+        if ( traced )
+            EndHostEvent( &trace );
+        return MTL_SUCCESS;
+    }
+    
+}
+
+
+/** Wait for a command buffer to complete
+ * @param command_buffer_handle The handle of the command buffer to free
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlWaitForCompletion( CommandBufferHandle command_buffer_handle )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLCommandBuffer> command_buffer = [ HS Handle2CommandBuffer:command_buffer_handle ];
+        if (!command_buffer) {
+            mtlStoreError( @"Invalid command buffer handle." );
+            return MTL_ERROR;
+        }
+        
+        mtlTraceEvent trace;
+        BOOL traced = BeginHostEvent( &trace, TRACE_WAIT, "Wait", command_buffer_handle, 0 );
+        [command_buffer waitUntilCompleted];
+        if ( traced )
+            EndHostEvent( &trace );
+        return MTL_SUCCESS;
+    }
+    
+}
+
+
+/** Query the execution status of a command buffer without blocking
+ * @param command_buffer_handle The handle of the command buffer
+ * @param status Receives one of the MTL_COMMAND_BUFFER_ status values
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCommandBufferStatus( CommandBufferHandle command_buffer_handle, uint32_t * status )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLCommandBuffer> command_buffer = [ HS Handle2CommandBuffer:command_buffer_handle ];
+        if (!command_buffer) {
+            mtlStoreError( @"Invalid command buffer handle." );
+            return MTL_ERROR;
+        }
+        
+        *status = (uint32_t)[ command_buffer status ];
+        return MTL_SUCCESS;
+    }
+}
+
+
+/** Register a handler to call when a command buffer completes
+ * @param command_buffer_handle The handle of the command buffer
+ * @param handler The function to call on completion
+ * @param user_data Passed unchanged to the handler
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlAddCompletedHandler( CommandBufferHandle command_buffer_handle, mtlCompletionHandler handler, void * user_data )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLCommandBuffer> command_buffer = [ HS Handle2CommandBuffer:command_buffer_handle ];
+        if (!command_buffer) {
+            mtlStoreError( @"Invalid command buffer handle." );
+            return MTL_ERROR;
+        }
+        
+        if (!handler) {
+            mtlStoreError( @"Invalid completion handler." );
+            return MTL_ERROR;
+        }
+        
+        if ( [ command_buffer status ] != MTLCommandBufferStatusNotEnqueued ) {
+            mtlStoreError( @"Command buffer has already been committed." );
+            return MTL_ERROR;
+        }
+        
+        [ command_buffer addCompletedHandler:^(id<MTLCommandBuffer> completed) {
+            handler( command_buffer_handle, (uint32_t)[ completed status ], user_data );
+        }];
+        return MTL_SUCCESS;
+    }
+}
+
+
+/** Wait until any one of several committed command buffers has completed
+ * @param command_buffer_handles Array of command buffer handles
+ * @param count Number of handles in the array
+ * @param completed_index Receives the zero-based index of a completed command buffer
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlWaitAnyCommandBuffer( const CommandBufferHandle * command_buffer_handles, uint32_t count, uint32_t * completed_index )
+{
+    @autoreleasepool {
+        NSArray<id<MTLCommandBuffer>> * command_buffers = CommittedCommandBuffers( command_buffer_handles, count );
+        if (!command_buffers)
+            return MTL_ERROR;
+        
+        mtlTraceEvent trace;
+        BOOL traced = BeginHostEvent( &trace, TRACE_WAIT, "Wait", count == 1 ? command_buffer_handles[0] : INVALID_HANDLE, 0 );
+        NSCondition * condition = CompletionCondition();
+        [ condition lock ];
+        while ( true )
+        {
+            for ( uint32_t i = 0; i < count; i++ )
+            {
+                if ( CommandBufferFinished( command_buffers[ i ] ) )
+                {
+                    [ condition unlock ];
+                    if ( traced )
+                        EndHostEvent( &trace );
+                    if ( completed_index )
+                        *completed_index = i;
+                    return MTL_SUCCESS;
+                }
+            }
+            [ condition wait ];
+        }
+    }
+}
+
+
+/** Wait until all of several committed command buffers have completed
+ * @param command_buffer_handles Array of command buffer handles
+ * @param count Number of handles in the array
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlWaitAllCommandBuffers( const CommandBufferHandle * command_buffer_handles, uint32_t count )
+{
+    @autoreleasepool {
+        NSArray<id<MTLCommandBuffer>> * command_buffers = CommittedCommandBuffers( command_buffer_handles, count );
+        if (!command_buffers)
+            return MTL_ERROR;
+        
+        mtlTraceEvent trace;
+        BOOL traced = BeginHostEvent( &trace, TRACE_WAIT, "Wait", count == 1 ? command_buffer_handles[0] : INVALID_HANDLE, 0 );
+        for ( id<MTLCommandBuffer> command_buffer in command_buffers )
+            [ command_buffer waitUntilCompleted ];
+        if ( traced )
+            EndHostEvent( &trace );
+        return MTL_SUCCESS;
+    }
+}
+
+
+#pragma mark Events
+
+/** Delivers event notifications for host waits, available before waitUntilSignaledValue:timeoutMS: */
+static MTLSharedEventListener * EventListener( void )
+{
+    static MTLSharedEventListener * listener;
+    static dispatch_once_t once;
+    dispatch_once( &once, ^{
+        listener = [ [MTLSharedEventListener alloc] initWithDispatchQueue:dispatch_queue_create( "MatlabMetal.events", DISPATCH_QUEUE_CONCURRENT ) ];
+    });
+    return listener;
+}
+
+
+/** Create an event
+ * @param device_handle The device whose command buffers use the event
+ * @return A handle to an event or INVALID_HANDLE on error
+ */
+EventHandle mtlNewEvent( DeviceHandle device_handle )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLDevice> device = [ HS Handle2Device:device_handle ];
+        if (!device) {
+            mtlStoreError( @"Invalid device handle." );
+            return (EventHandle)INVALID_HANDLE;
+        }
+        
+        id<MTLSharedEvent> event = [ device newSharedEvent ];
+        if (!event) {
+            mtlStoreError( @"Error creating the event." );
+            return (EventHandle)INVALID_HANDLE;
+        }
+        
+        return [ HS Event2Handle:event ];
+    }
+}
+
+
+/** Free an event
+ * @param event_handle The handle of the event to free
+ */
+void mtlFreeEvent( EventHandle event_handle )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        [ HS FreeEvent:event_handle ];
+    }
+}
+
+
+/** Return the value an event was last signalled with
+ * @param event_handle The handle of the event
+ * @param value Receives the value
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlEventSignaledValue( EventHandle event_handle, uint64_t * value )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLSharedEvent> event = [ HS Handle2Event:event_handle ];
+        if (!event) {
+            mtlStoreError( @"Invalid event handle." );
+            return MTL_ERROR;
+        }
+        
+        *value = event.signaledValue;
+        return MTL_SUCCESS;
+    }
+}
+
+
+/** Signal an event from the host
+ * @param event_handle The handle of the event
+ * @param value The new value of the event
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlSignalEvent( EventHandle event_handle, uint64_t value )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLSharedEvent> event = [ HS Handle2Event:event_handle ];
+        if (!event) {
+            mtlStoreError( @"Invalid event handle." );
+            return MTL_ERROR;
+        }
+        
+        event.signaledValue = value;
+        return MTL_SUCCESS;
+    }
+}
+
+
+/** Wait on the host until an event reaches a value
+ * @param event_handle The handle of the event
+ * @param value The value to wait for
+ * @param timeout_ms Milliseconds to wait at most, or MTL_WAIT_FOREVER
+ * @return MTL_SUCCESS once the value is reached, MTL_ERROR on timeout or error
+ */
+uint32_t mtlWaitForEvent( EventHandle event_handle, uint64_t value, uint64_t timeout_ms )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLSharedEvent> event = [ HS Handle2Event:event_handle ];
+        if (!event) {
+            mtlStoreError( @"Invalid event handle." );
+            return MTL_ERROR;
+        }
+        if ( event.signaledValue >= value )
+            return MTL_SUCCESS;
+        
+        mtlTraceEvent trace;
+        BOOL traced = BeginHostEvent( &trace, TRACE_WAIT, "Wait for event", event_handle, 0 );
+        // The listener is notified at once if the value was reached in the meantime
+        dispatch_semaphore_t reached = dispatch_semaphore_create( 0 );
+        [ event notifyListener:EventListener() atValue:value block:^( id<MTLSharedEvent> signalled_event, uint64_t signalled_value ) {
+            dispatch_semaphore_signal( reached );
+        }];
+        dispatch_time_t deadline = DISPATCH_TIME_FOREVER;
+        if ( timeout_ms < (uint64_t)INT64_MAX / NSEC_PER_MSEC )
+            deadline = dispatch_time( DISPATCH_TIME_NOW, (int64_t)( timeout_ms * NSEC_PER_MSEC ) );
+        long timed_out = dispatch_semaphore_wait( reached, deadline );
+        if ( traced )
+            EndHostEvent( &trace );
+        if ( timed_out ) {
+            mtlStoreError( @"Timed out waiting for the event." );
+            return MTL_ERROR;
+        }
+        return MTL_SUCCESS;
+    }
+}
+
+
+/** Encode an event signal or wait into a command buffer not yet committed */
+static uint32_t EncodeEventCommand( CommandBufferHandle command_buffer_handle, EventHandle event_handle, uint64_t value, BOOL signal )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLCommandBuffer> command_buffer = [ HS Handle2CommandBuffer:command_buffer_handle ];
+        if (!command_buffer) {
+            mtlStoreError( @"Invalid command buffer handle." );
+            return MTL_ERROR;
+        }
+        id<MTLSharedEvent> event = [ HS Handle2Event:event_handle ];
+        if (!event) {
+            mtlStoreError( @"Invalid event handle." );
+            return MTL_ERROR;
+        }
+        if ( command_buffer.status != MTLCommandBufferStatusNotEnqueued ) {
+            mtlStoreError( @"Command buffer has already been committed." );
+            return MTL_ERROR;
+        }
+        
+        if ( signal )
+            [ command_buffer encodeSignalEvent:event value:value ];
+        else
+            [ command_buffer encodeWaitForEvent:event value:value ];
+        return MTL_SUCCESS;
+    }
+}
+
+
+/** Encode a signal of an event into a command buffer
+ * @param command_buffer_handle The handle of a command buffer not yet committed
+ * @param event_handle The handle of the event
+ * @param value The value to signal
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlEncodeSignalEvent( CommandBufferHandle command_buffer_handle, EventHandle event_handle, uint64_t value )
+{
+    return EncodeEventCommand( command_buffer_handle, event_handle, value, YES );
+}
+
+
+/** Encode a wait for an event into a command buffer
+ * @param command_buffer_handle The handle of a command buffer not yet committed
+ * @param event_handle The handle of the event
+ * @param value The value to wait for
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlEncodeWaitForEvent( CommandBufferHandle command_buffer_handle, EventHandle event_handle, uint64_t value )
+{
+    return EncodeEventCommand( command_buffer_handle, event_handle, value, NO );
+}
+
+
+#pragma mark Command Encoders
+
+/**
+ * The buffers bound to a concurrent command encoder, and those read and
+ * written by its dispatches since the last barrier on them.
+ */
+@interface EncoderHazards : NSObject
+@property (nonatomic, strong) NSMutableDictionary<NSNumber *, id<MTLBuffer>> * bindings;
+@property (nonatomic, strong) NSMutableIndexSet * read_only_indices;
+@property (nonatomic, strong) NSHashTable<id<MTLBuffer>> * read;
+@property (nonatomic, strong) NSHashTable<id<MTLBuffer>> * written;
+@end
+
+@implementation EncoderHazards
+- (instancetype)init
+{
+    if ( ( self = [ super init ] ) ) {
+        _bindings = [ NSMutableDictionary dictionary ];
+        _read_only_indices = [ NSMutableIndexSet indexSet ];
+        _read = [ NSHashTable hashTableWithOptions:NSPointerFunctionsObjectPointerPersonality ];
+        _written = [ NSHashTable hashTableWithOptions:NSPointerFunctionsObjectPointerPersonality ];
+    }
+    return self;
+}
+@end
+
+
+/** Hazard tracking of each concurrent command encoder, synchronized on the table */
+static NSMapTable<id<MTLComputeCommandEncoder>, EncoderHazards *> * ConcurrentEncoders( void )
+{
+    static NSMapTable * table;
+    static dispatch_once_t once;
+    dispatch_once( &once, ^{
+        table = [ NSMapTable weakToStrongObjectsMapTable ];
+    });
+    return table;
+}
+
+
+/** Note a binding of a concurrent encoder; buffer is nil for inline data */
+static void RecordBinding( id<MTLComputeCommandEncoder> command_encoder, id<MTLBuffer> buffer, NSUInteger index, BOOL read_only )
+{
+    NSMapTable * encoders = ConcurrentEncoders();
+    @synchronized ( encoders ) {
+        EncoderHazards * hazards = [ encoders objectForKey:command_encoder ];
+        if ( !hazards )
+            return;
+        if ( buffer )
+            hazards.bindings[ @( index ) ] = buffer;
+        else
+            [ hazards.bindings removeObjectForKey:@( index ) ];
+        if ( read_only )
+            [ hazards.read_only_indices addIndex:index ];
+        else
+            [ hazards.read_only_indices removeIndex:index ];
+    }
+}
+
+
+/**
+ * Before a dispatch on a concurrent encoder, encode a barrier on the buffers
+ * it depends on: those it binds (or reads its indirect arguments from, if
+ * any) that an earlier dispatch wrote, and those it writes that an earlier
+ * dispatch read. Other buffers need no barrier, so independent dispatches
+ * still overlap.
+ */
+static void BarrierBeforeDispatch( id<MTLComputeCommandEncoder> command_encoder, id<MTLBuffer> indirect_buffer )
+{
+    NSMapTable * encoders = ConcurrentEncoders();
+    @synchronized ( encoders ) {
+        EncoderHazards * hazards = [ encoders objectForKey:command_encoder ];
+        if ( !hazards )
+            return;
+        
+        NSHashTable<id<MTLBuffer>> * dependencies = [ NSHashTable hashTableWithOptions:NSPointerFunctionsObjectPointerPersonality ];
+        [ hazards.bindings enumerateKeysAndObjectsUsingBlock:^( NSNumber * index, id<MTLBuffer> buffer, BOOL * stop ) {
+            BOOL read_only = [ hazards.read_only_indices containsIndex:index.unsignedIntegerValue ];
+            if ( [ hazards.written containsObject:buffer ] || ( !read_only && [ hazards.read containsObject:buffer ] ) )
+                [ dependencies addObject:buffer ];
+        }];
+        if ( indirect_buffer && [ hazards.written containsObject:indirect_buffer ] )
+            [ dependencies addObject:indirect_buffer ];
+        if ( [ dependencies count ] > 0 ) {
+            NSArray<id<MTLBuffer>> * resources = [ dependencies allObjects ];
+            __unsafe_unretained id<MTLResource> barrier_resources[ [ resources count ] ];
+            for ( NSUInteger i = 0; i < [ resources count ]; i++ ) {
+                barrier_resources[ i ] = resources[ i ];
+                [ hazards.read removeObject:resources[ i ] ];
+                [ hazards.written removeObject:resources[ i ] ];
+            }
+            [ command_encoder memoryBarrierWithResources:barrier_resources count:[ resources count ] ];
+        }
+        
+        [ hazards.bindings enumerateKeysAndObjectsUsingBlock:^( NSNumber * index, id<MTLBuffer> buffer, BOOL * stop ) {
+            if ( [ hazards.read_only_indices containsIndex:index.unsignedIntegerValue ] )
+                [ hazards.read addObject:buffer ];
+            else
+                [ hazards.written addObject:buffer ];
+        }];
+        if ( indirect_buffer )
+            [ hazards.read addObject:indirect_buffer ];
+    }
+}
+
+
+/** Create a command encoder
+ * @param command_buffer_handle A handle to a command buffer on which to create the command encoder
+ * @return A handle to a command encoder or INVALID_HANDLE on error
+ */
+CommandEncoderHandle mtlNewCommandEncoder( CommandBufferHandle command_buffer_handle )
+{
+    return mtlNewCommandEncoderWithDispatchType( command_buffer_handle, MTL_DISPATCH_SERIAL );
+}
+
+
+/** Create a command encoder whose dispatches run one after another or concurrently
+ * @param command_buffer_handle A handle to a command buffer on which to create the command encoder
+ * @param dispatch_type MTL_DISPATCH_SERIAL or MTL_DISPATCH_CONCURRENT
+ * @return A handle to a command encoder or INVALID_HANDLE on error
+ */
+CommandEncoderHandle mtlNewCommandEncoderWithDispatchType( CommandBufferHandle command_buffer_handle, uint32_t dispatch_type )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLCommandBuffer> command_buffer = [ HS Handle2CommandBuffer:command_buffer_handle ];
+        if (!command_buffer) {
+            mtlStoreError( @"Invalid command buffer handle." );
+            return (CommandEncoderHandle)INVALID_HANDLE;
+        }
+        if ( dispatch_type != MTL_DISPATCH_SERIAL && dispatch_type != MTL_DISPATCH_CONCURRENT ) {
+            mtlStoreError( @"Invalid dispatch type." );
+            return (CommandEncoderHandle)INVALID_HANDLE;
+        }
+        
+        BOOL concurrent = dispatch_type == MTL_DISPATCH_CONCURRENT;
+        id<MTLComputeCommandEncoder> command_encoder =
+            [ command_buffer computeCommandEncoderWithDispatchType:concurrent ? MTLDispatchTypeConcurrent : MTLDispatchTypeSerial ];
+        if (!command_encoder)
+        {
+            mtlStoreError( @"Error creating the command encoder." );
+            return (CommandEncoderHandle)INVALID_HANDLE;
+        }
+        
+        NSMapTable * encoders = EncoderCommandBuffers();
+        @synchronized ( encoders ) {
+            [ encoders setObject:command_buffer forKey:command_encoder ];
+        }
+        if ( concurrent ) {
+            NSMapTable * hazards = ConcurrentEncoders();
+            @synchronized ( hazards ) {
+                [ hazards setObject:[ [EncoderHazards alloc] init ] forKey:command_encoder ];
+            }
+        }
+        
+        return [ HS CommandEncoder2Handle:command_encoder ];
+    }
+}
+
+
+/** Free a command encoder
+ * @param command_encoder_handle The handle of the command encoder to free
+ */
+void mtlFreeCommandEncoder( CommandEncoderHandle command_encoder_handle )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        [ HS FreeCommandEncoder:command_encoder_handle ];
+    }
+}
+
+
+/** Set a compute pipeline state (the function to execute) to a command buffer via its command encoder
+ * @param command_encoder_handle The handle of the command encoder to use
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlSetComputePipelineState( CommandEncoderHandle command_encoder_handle, ComputePipelineStateHandle compute_pipeline_state_handle )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLComputeCommandEncoder> command_encoder = [ HS Handle2CommandEncoder:command_encoder_handle ];
+        if (!command_encoder) {
+            mtlStoreError( @"Invalid command encoder handle." );
+            return MTL_ERROR;
+        }
+        
+        id<MTLComputePipelineState> compute_pipeline_state = [ HS Handle2ComputePipelineState:compute_pipeline_state_handle ];
+        if (!compute_pipeline_state) {
+            mtlStoreError( @"Invalid compute pipeline state handle." );
+            return MTL_ERROR;
+        }
+        
+        [ command_encoder setComputePipelineState:compute_pipeline_state ];
+        
+        
+        return MTL_SUCCESS;
+    }
+}
+
+
+
+/** Associate a GPU buffer with a command buffer via its command encoder
+ * @param command_encoder_handle The handle of the command encoder to use
+ * @param buffer_handle The handle of a buffer to associate with the command encoder
+ * @param index The index of the association, zero-based.
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlSetBuffer( CommandEncoderHandle command_encoder_handle, BufferHandle buffer_handle, uint32_t index )
+{
+    return mtlSetBufferWithAccess( command_encoder_handle, buffer_handle, index, MTL_BUFFER_ACCESS_READ_WRITE );
+}
+
+
+/** Associate a buffer with the command encoder, saying whether the kernel writes it
+ * @param command_encoder_handle The handle of the command encoder to use
+ * @param buffer_handle The handle of a buffer to associate with the command encoder
+ * @param index The index of the association, zero-based.
+ * @param access MTL_BUFFER_ACCESS_READ_WRITE or MTL_BUFFER_ACCESS_READ
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlSetBufferWithAccess( CommandEncoderHandle command_encoder_handle, BufferHandle buffer_handle, uint32_t index, uint32_t access )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLComputeCommandEncoder> command_encoder = [ HS Handle2CommandEncoder:command_encoder_handle ];
+        if (!command_encoder) {
+            mtlStoreError( @"Invalid command encoder handle." );
+            return MTL_ERROR;
+        }
+        
+        id<MTLBuffer> buffer = [ HS Handle2Buffer:buffer_handle ];
+        if (!buffer) {
+            mtlStoreError( @"Invalid buffer handle." );
+            return MTL_ERROR;
+        }
+        
+        if ( access != MTL_BUFFER_ACCESS_READ_WRITE && access != MTL_BUFFER_ACCESS_READ ) {
+            mtlStoreError( @"Invalid buffer access." );
+            return MTL_ERROR;
+        }
+        
+        [ command_encoder setBuffer:buffer offset:0 atIndex:index ];
+        RecordBinding( command_encoder, buffer, index, access == MTL_BUFFER_ACCESS_READ || IsReadOnlyBuffer( buffer ) );
+        
+        return MTL_SUCCESS;
+    }
+}
+
+
+/** Copy a small block of constant data into the command stream as a buffer argument
+ * @param command_encoder_handle The handle of the command encoder to use
+ * @param bytes Pointer to the data
+ * @param length Number of bytes, at most MTL_MAX_INLINE_BYTES
+ * @param index The index of the association, zero-based.
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlSetBytes( CommandEncoderHandle command_encoder_handle, const void * bytes, uint64_t length, uint32_t index )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLComputeCommandEncoder> command_encoder = [ HS Handle2CommandEncoder:command_encoder_handle ];
+        if (!command_encoder) {
+            mtlStoreError( @"Invalid command encoder handle." );
+            return MTL_ERROR;
+        }
+        
+        if ( !bytes || length == 0 || length > MTL_MAX_INLINE_BYTES ) {
+            mtlStoreError( @"Inline data must be between 1 and 4096 bytes." );
+            return MTL_ERROR;
+        }
+        
+        [ command_encoder setBytes:bytes length:length atIndex:index ];
+        RecordBinding( command_encoder, nil, index, YES );
+        
+        return MTL_SUCCESS;
+    }
+}
+
+
+/**
+ * Threadgroup sizes found by mtlAutotuneThreadgroupSize, keyed by grid shape
+ * for each pipeline state. Pipeline states are held weakly, so entries go
+ * away with them. Access is synchronized on the table.
+ */
+static NSMapTable<id<MTLComputePipelineState>, NSMutableDictionary<NSString *, NSArray<NSNumber *> *> *> * TunedThreadgroups( void )
+{
+    static NSMapTable * table;
+    static dispatch_once_t once;
+    dispatch_once( &once, ^{
+        table = [ NSMapTable mapTableWithKeyOptions:NSPointerFunctionsWeakMemory | NSPointerFunctionsObjectPointerPersonality
+                                      valueOptions:NSPointerFunctionsStrongMemory ];
+    });
+    return table;
+}
+
+
+static NSString * GridKey( MTLSize gridSize )
+{
+    return [ NSString stringWithFormat:@"%lux%lux%lu", (unsigned long)gridSize.width, (unsigned long)gridSize.height, (unsigned long)gridSize.depth ];
+}
+
+
+/**
+ * Threadgroup size of a dispatch. An explicit size is checked against the
+ * pipeline state; otherwise the autotuned size for the grid is used if there
+ * is one, or else the default shape for the pipeline's SIMD width.
+ */
+BOOL ResolveThreadgroupSize( id<MTLComputePipelineState> compute_pipeline_state, MTLSize gridSize, const uint32_t group_size[3], MTLSize * threadgroupSize )
+{
+    if ( group_size[0] != 0 || group_size[1] != 0 || group_size[2] != 0 ) {
+        uint64_t threads = (uint64_t)group_size[0] * group_size[1] * group_size[2];
+        if ( threads == 0 || threads > compute_pipeline_state.maxTotalThreadsPerThreadgroup ) {
+            mtlStoreError( @"Invalid threadgroup size." );
+            return NO;
+        }
+        *threadgroupSize = MTLSizeMake( group_size[0], group_size[1], group_size[2] );
+        return YES;
+    }
+    
+    NSMapTable * table = TunedThreadgroups();
+    @synchronized ( table ) {
+        NSArray<NSNumber *> * tuned = [ [ table objectForKey:compute_pipeline_state ] objectForKey:GridKey( gridSize ) ];
+        if ( tuned ) {
+            *threadgroupSize = MTLSizeMake( [ tuned[0] unsignedIntegerValue ], [ tuned[1] unsignedIntegerValue ], [ tuned[2] unsignedIntegerValue ] );
+            return YES;
+        }
+    }
+    
+    const uint32_t grid[3] = { (uint32_t)gridSize.width, (uint32_t)gridSize.height, (uint32_t)gridSize.depth };
+    uint32_t group[3];
+    mtlDefaultThreadgroupSize( grid, (uint32_t)compute_pipeline_state.threadExecutionWidth,
+                               (uint32_t)compute_pipeline_state.maxTotalThreadsPerThreadgroup, group );
+    *threadgroupSize = MTLSizeMake( group[0], group[1], group[2] );
+    return YES;
+}
+
+
+/** Specify the thread count and organization
+ * @param command_encoder_handle The handle of the command encoder to use
+ * @param compute_pipeline_state_handle The handle of the compute pipeline state which will be executed
+ * @param width The size of the first dimension (usuall numelements for a one-dimensional array)
+ * @param height The size of the second dimension (usually 1 for a one-dimensional array)
+ * @param depth The size of the third dimension (usually 1 for a one-dimensional array)
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlSetThreadsAndShape( CommandEncoderHandle command_encoder_handle, ComputePipelineStateHandle compute_pipeline_state_handle,  uint32_t width, uint32_t height, uint32_t depth )
+{
+    const uint32_t automatic[3] = { 0, 0, 0 };
+    return mtlSetThreadsAndThreadgroupShape( command_encoder_handle, compute_pipeline_state_handle, width, height, depth, automatic );
+}
+
+
+/** Specify the thread count with an explicit threadgroup size
+ * @param command_encoder_handle The handle of the command encoder to use
+ * @param compute_pipeline_state_handle The handle of the compute pipeline state which will be executed
+ * @param width The size of the first dimension
+ * @param height The size of the second dimension
+ * @param depth The size of the third dimension
+ * @param group_size Threadgroup width, height and depth, or all zero for the automatic size
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlSetThreadsAndThreadgroupShape( CommandEncoderHandle command_encoder_handle, ComputePipelineStateHandle compute_pipeline_state_handle,
+                                           uint32_t width, uint32_t height, uint32_t depth, const uint32_t group_size[3] )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        if ( ( width == 0 ) || ( height == 0 ) || ( depth ==0 ) || !group_size )
+            return MTL_ERROR;
+        
+        id<MTLComputeCommandEncoder> command_encoder = [ HS Handle2CommandEncoder:command_encoder_handle ];
+        if (!command_encoder) {
+            mtlStoreError( @"Invalid command encoder handle." );
+            return MTL_ERROR;
+        }
+        
+        id<MTLComputePipelineState> compute_pipeline_state = [ HS Handle2ComputePipelineState:compute_pipeline_state_handle ];
+        if (!compute_pipeline_state) {
+            mtlStoreError( @"Invalid compute pipeline state handle." );
+            return MTL_ERROR;
+        }
+        
+        MTLSize gridSize = MTLSizeMake( width, height, depth );
+        MTLSize threadgroupSize;
+        if ( !ResolveThreadgroupSize( compute_pipeline_state, gridSize, group_size, &threadgroupSize ) )
+            return MTL_ERROR;
+        BarrierBeforeDispatch( command_encoder, nil );
+        [ command_encoder dispatchThreads:gridSize threadsPerThreadgroup:threadgroupSize ];
+        
+        if ( atomic_load( &ProfilingIsEnabled ) ) {
+            id<MTLCommandBuffer> command_buffer;
+            NSMapTable * encoders = EncoderCommandBuffers();
+            @synchronized ( encoders ) {
+                command_buffer = [ encoders objectForKey:command_encoder ];
+            }
+            RecordEncode( command_buffer, compute_pipeline_state, gridSize );
+        }
+        
+        return MTL_SUCCESS;
+    }
+}
+
+
+/** Dispatch a grid whose size is read from a buffer when the dispatch runs
+ * @param command_encoder_handle The handle of the command encoder to use
+ * @param compute_pipeline_state_handle The handle of the compute pipeline state which will be executed
+ * @param indirect_buffer_handle The buffer holding the arguments, on the same device
+ * @param indirect_offset Byte offset of the arguments in the buffer, a multiple of 4
+ * @param group_size Threadgroup width, height and depth
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlDispatchThreadgroupsIndirect( CommandEncoderHandle command_encoder_handle, ComputePipelineStateHandle compute_pipeline_state_handle,
+                                          BufferHandle indirect_buffer_handle, uint64_t indirect_offset, const uint32_t group_size[3] )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLComputeCommandEncoder> command_encoder = [ HS Handle2CommandEncoder:command_encoder_handle ];
+        if (!command_encoder) {
+            mtlStoreError( @"Invalid command encoder handle." );
+            return MTL_ERROR;
+        }
+        
+        id<MTLComputePipelineState> compute_pipeline_state = [ HS Handle2ComputePipelineState:compute_pipeline_state_handle ];
+        if (!compute_pipeline_state) {
+            mtlStoreError( @"Invalid compute pipeline state handle." );
+            return MTL_ERROR;
+        }
+        
+        id<MTLBuffer> indirect_buffer = [ HS Handle2Buffer:indirect_buffer_handle ];
+        if (!indirect_buffer) {
+            mtlStoreError( @"Invalid buffer handle." );
+            return MTL_ERROR;
+        }
+        if ( [ [ indirect_buffer device ] registryID ] != [ [ command_encoder device ] registryID ] ) {
+            mtlStoreError( @"Buffer was created on a different device." );
+            return MTL_ERROR;
+        }
+        if ( indirect_offset % sizeof( uint32_t ) != 0 || indirect_offset > [ indirect_buffer length ] ||
+             [ indirect_buffer length ] - indirect_offset < sizeof( mtlDispatchIndirectArguments ) ) {
+            mtlStoreError( @"Invalid indirect arguments offset." );
+            return MTL_ERROR;
+        }
+        
+        if ( !group_size || group_size[0] == 0 || group_size[1] == 0 || group_size[2] == 0 ) {
+            mtlStoreError( @"Invalid threadgroup size." );
+            return MTL_ERROR;
+        }
+        MTLSize threadgroupSize;
+        if ( !ResolveThreadgroupSize( compute_pipeline_state, MTLSizeMake( 0, 0, 0 ), group_size, &threadgroupSize ) )
+            return MTL_ERROR;
+        
+        BarrierBeforeDispatch( command_encoder, indirect_buffer );
+        [ command_encoder dispatchThreadgroupsWithIndirectBuffer:indirect_buffer indirectBufferOffset:indirect_offset
+                                           threadsPerThreadgroup:threadgroupSize ];
+        
+        if ( atomic_load( &ProfilingIsEnabled ) ) {
+            id<MTLCommandBuffer> command_buffer;
+            NSMapTable * encoders = EncoderCommandBuffers();
+            @synchronized ( encoders ) {
+                command_buffer = [ encoders objectForKey:command_encoder ];
+            }
+            RecordEncode( command_buffer, compute_pipeline_state, MTLSizeMake( 0, 0, 0 ) );
+        }
+        
+        return MTL_SUCCESS;
+    }
+}
+
+
+/** End encoding
+ * @param command_encoder_handle The handle of the command encoder
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlEndEncoding( CommandEncoderHandle command_encoder_handle )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLComputeCommandEncoder> command_encoder = [ HS Handle2CommandEncoder:command_encoder_handle ];
+        if (!command_encoder) {
+            mtlStoreError( @"Invalid command encoder handle." );
+            return MTL_ERROR;
+        }
+        
+        [ command_encoder endEncoding ];
+        
+        return MTL_SUCCESS;
+    }
+}
+
+
+/**
+ * Dispatches checked and looked up ahead of encoding: what mtlEncodeDispatches
+ * encodes at once and a command list keeps. Changes are synchronized on the
+ * object.
+ */
+@interface CommandList : NSObject
+@property (nonatomic, strong) id<MTLDevice> device;
+@property (nonatomic, strong) NSMutableArray<id<MTLComputePipelineState>> * compute_pipeline_states;
+@property (nonatomic, strong) NSMutableArray<NSMutableArray *> * buffers;
+@property (nonatomic, strong) NSMutableData * grid_sizes;
+@property (nonatomic, strong) NSMutableData * threadgroup_sizes;
+@end
+
+@implementation CommandList
+@end
+
+
+/** Check every dispatch and look up its objects and threadgroup size; nil on error */
+static CommandList * ResolveDispatches( const mtlDispatch * dispatches, uint32_t count )
+{
+    id HS = [ HandleStore getInstance ];
+    
+    if ( count == 0 || !dispatches ) {
+        mtlStoreError( @"No dispatches to encode." );
+        return nil;
+    }
+    
+    CommandList * list = [ [ CommandList alloc ] init ];
+    list.compute_pipeline_states = [ NSMutableArray arrayWithCapacity:count ];
+    list.buffers = [ NSMutableArray arrayWithCapacity:count ];
+    list.grid_sizes = [ NSMutableData dataWithLength:count * sizeof( MTLSize ) ];
+    list.threadgroup_sizes = [ NSMutableData dataWithLength:count * sizeof( MTLSize ) ];
+    for ( uint32_t d = 0; d < count; d++ ) {
+        const mtlDispatch * dispatch = &dispatches[ d ];
+        if ( dispatch->width == 0 || dispatch->height == 0 || dispatch->depth == 0 ) {
+            mtlStoreError( @"Invalid dispatch shape." );
+            return nil;
+        }
+        if ( dispatch->num_buffers > MTL_DISPATCH_MAX_BUFFERS ) {
+            mtlStoreError( @"Too many buffers in a dispatch." );
+            return nil;
+        }
+        id<MTLComputePipelineState> compute_pipeline_state = [ HS Handle2ComputePipelineState:dispatch->compute_pipeline_state ];
+        if (!compute_pipeline_state) {
+            mtlStoreError( @"Invalid compute pipeline state handle." );
+            return nil;
+        }
+        NSMutableArray * dispatch_buffers = [ NSMutableArray arrayWithCapacity:dispatch->num_buffers ];
+        for ( uint32_t i = 0; i < dispatch->num_buffers; i++ ) {
+            id buffer = [ NSNull null ];
+            if ( dispatch->buffers[ i ] != INVALID_HANDLE ) {
+                buffer = [ HS Handle2Buffer:dispatch->buffers[ i ] ];
+                if (!buffer) {
+                    mtlStoreError( @"Invalid buffer handle." );
+                    return nil;
+                }
+            }
+            [ dispatch_buffers addObject:buffer ];
+        }
+        const uint32_t group_size[3] = { dispatch->group_width, dispatch->group_height, dispatch->group_depth };
+        MTLSize gridSize = MTLSizeMake( dispatch->width, dispatch->height, dispatch->depth );
+        if ( !ResolveThreadgroupSize( compute_pipeline_state, gridSize, group_size, (MTLSize *)list.threadgroup_sizes.mutableBytes + d ) )
+            return nil;
+        ( (MTLSize *)list.grid_sizes.mutableBytes )[ d ] = gridSize;
+        [ list.compute_pipeline_states addObject:compute_pipeline_state ];
+        [ list.buffers addObject:dispatch_buffers ];
+    }
+    return list;
+}
+
+
+/** Encode resolved dispatches into a command buffer that has not been committed */
+static uint32_t EncodeResolvedDispatches( id<MTLCommandBuffer> command_buffer, CommandList * list )
+{
+    id<MTLComputeCommandEncoder> command_encoder = [ command_buffer computeCommandEncoderWithDispatchType:MTLDispatchTypeSerial ];
+    if (!command_encoder) {
+        mtlStoreError( @"Error creating the command encoder." );
+        return MTL_ERROR;
+    }
+    @synchronized ( list ) {
+        for ( NSUInteger d = 0; d < [ list.compute_pipeline_states count ]; d++ ) {
+            id<MTLComputePipelineState> compute_pipeline_state = list.compute_pipeline_states[ d ];
+            [ command_encoder setComputePipelineState:compute_pipeline_state ];
+            NSArray * dispatch_buffers = list.buffers[ d ];
+            for ( NSUInteger i = 0; i < [ dispatch_buffers count ]; i++ ) {
+                if ( dispatch_buffers[ i ] != [ NSNull null ] )
+                    [ command_encoder setBuffer:dispatch_buffers[ i ] offset:0 atIndex:i ];
+            }
+            MTLSize gridSize = ( (const MTLSize *)list.grid_sizes.bytes )[ d ];
+            [ command_encoder dispatchThreads:gridSize threadsPerThreadgroup:( (const MTLSize *)list.threadgroup_sizes.bytes )[ d ] ];
+            RecordEncode( command_buffer, compute_pipeline_state, gridSize );
+        }
+    }
+    [ command_encoder endEncoding ];
+    return MTL_SUCCESS;
+}
+
+
+/** Encode a batch of dispatches into a command buffer
+ * @param command_buffer_handle The handle of a command buffer that has not been committed
+ * @param dispatches Array of dispatches, executed in order
+ * @param count Number of dispatches
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlEncodeDispatches( CommandBufferHandle command_buffer_handle, const mtlDispatch * dispatches, uint32_t count )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLCommandBuffer> command_buffer = [ HS Handle2CommandBuffer:command_buffer_handle ];
+        if (!command_buffer) {
+            mtlStoreError( @"Invalid command buffer handle." );
+            return MTL_ERROR;
+        }
+        if ( [ command_buffer status ] != MTLCommandBufferStatusNotEnqueued ) {
+            mtlStoreError( @"Command buffer has already been committed." );
+            return MTL_ERROR;
+        }
+        
+        // Check every dispatch before encoding any of them
+        CommandList * list = ResolveDispatches( dispatches, count );
+        if (!list)
+            return MTL_ERROR;
+        return EncodeResolvedDispatches( command_buffer, list );
+    }
+}
+
+
+/** Encode a batch of dispatches into a new command buffer and commit it
+ * @param command_queue_handle A handle to the command queue to submit to
+ * @param dispatches Array of dispatches, executed in order
+ * @param count Number of dispatches
+ * @return A handle to the committed command buffer or INVALID_HANDLE on error
+ */
+CommandBufferHandle mtlSubmitDispatches( CommandQueueHandle command_queue_handle, const mtlDispatch * dispatches, uint32_t count )
+{
+    CommandBufferHandle command_buffer_handle = mtlNewCommandBuffer( command_queue_handle );
+    if ( command_buffer_handle == INVALID_HANDLE )
+        return (CommandBufferHandle) INVALID_HANDLE;
+    
+    if ( mtlEncodeDispatches( command_buffer_handle, dispatches, count ) != MTL_SUCCESS ||
+         mtlCommitCommandBuffer( command_buffer_handle ) != MTL_SUCCESS ) {
+        mtlFreeCommandBuffer( command_buffer_handle );
+        return (CommandBufferHandle) INVALID_HANDLE;
+    }
+    return command_buffer_handle;
+}
+
+
+/** Find the fastest threadgroup size for a dispatch by timing candidate shapes
+ * @param command_queue_handle A handle to the command queue to run on
+ * @param dispatch The dispatch to time
+ * @param repetitions Number of timed runs of each candidate
+ * @param group_size Receives the fastest threadgroup width, height and depth
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlAutotuneThreadgroupSize( CommandQueueHandle command_queue_handle, const mtlDispatch * dispatch, uint32_t repetitions, uint32_t group_size[3] )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLCommandQueue> command_queue = [ HS Handle2CommandQueue:command_queue_handle ];
+        if (!command_queue) {
+            mtlStoreError( @"Invalid command queue handle." );
+            return MTL_ERROR;
+        }
+        if ( !dispatch || !group_size ) {
+            mtlStoreError( @"No dispatch to autotune." );
+            return MTL_ERROR;
+        }
+        if ( dispatch->width == 0 || dispatch->height == 0 || dispatch->depth == 0 ) {
+            mtlStoreError( @"Invalid dispatch shape." );
+            return MTL_ERROR;
+        }
+        if ( dispatch->num_buffers > MTL_DISPATCH_MAX_BUFFERS ) {
+            mtlStoreError( @"Too many buffers in a dispatch." );
+            return MTL_ERROR;
+        }
+        id<MTLComputePipelineState> compute_pipeline_state = [ HS Handle2ComputePipelineState:dispatch->compute_pipeline_state ];
+        if (!compute_pipeline_state) {
+            mtlStoreError( @"Invalid compute pipeline state handle." );
+            return MTL_ERROR;
+        }
+        NSMutableArray * buffers = [ NSMutableArray arrayWithCapacity:dispatch->num_buffers ];
+        for ( uint32_t i = 0; i < dispatch->num_buffers; i++ ) {
+            id buffer = [ NSNull null ];
+            if ( dispatch->buffers[ i ] != INVALID_HANDLE ) {
+                buffer = [ HS Handle2Buffer:dispatch->buffers[ i ] ];
+                if (!buffer) {
+                    mtlStoreError( @"Invalid buffer handle." );
+                    return MTL_ERROR;
+                }
+            }
+            [ buffers addObject:buffer ];
+        }
+        
+        const uint32_t grid[3] = { dispatch->width, dispatch->height, dispatch->depth };
+        uint32_t candidates[ THREADGROUP_MAX_CANDIDATES ][3];
+        uint32_t count = mtlThreadgroupCandidates( grid, (uint32_t)compute_pipeline_state.threadExecutionWidth,
+                                                   (uint32_t)compute_pipeline_state.maxTotalThreadsPerThreadgroup, candidates );
+        repetitions = MAX( repetitions, 1 );
+        MTLSize gridSize = MTLSizeMake( grid[0], grid[1], grid[2] );
+        
+        // One untimed pass to warm up, then each candidate in its own command buffer, timed on the GPU
+        CFTimeInterval best_time = 0;
+        uint32_t best = 0;
+        for ( int64_t c = -1; c < (int64_t)count; c++ ) {
+            MTLSize threadgroupSize = MTLSizeMake( candidates[ MAX( c, 0 ) ][0], candidates[ MAX( c, 0 ) ][1], candidates[ MAX( c, 0 ) ][2] );
+            id<MTLCommandBuffer> command_buffer = [ command_queue commandBuffer ];
+            id<MTLComputeCommandEncoder> command_encoder = [ command_buffer computeCommandEncoder ];
+            if ( !command_encoder ) {
+                mtlStoreError( @"Error creating the command encoder." );
+                return MTL_ERROR;
+            }
+            [ command_encoder setComputePipelineState:compute_pipeline_state ];
+            for ( NSUInteger i = 0; i < [ buffers count ]; i++ ) {
+                if ( buffers[ i ] != [ NSNull null ] )
+                    [ command_encoder setBuffer:buffers[ i ] offset:0 atIndex:i ];
+            }
+            for ( uint32_t r = 0; r < ( c < 0 ? 1 : repetitions ); r++ )
+                [ command_encoder dispatchThreads:gridSize threadsPerThreadgroup:threadgroupSize ];
+            [ command_encoder endEncoding ];
+            [ command_buffer commit ];
+            [ command_buffer waitUntilCompleted ];
+            if ( [ command_buffer status ] != MTLCommandBufferStatusCompleted ) {
+                mtlStoreError( @"Error running the dispatch." );
+                return MTL_ERROR;
+            }
+            CFTimeInterval time = [ command_buffer GPUEndTime ] - [ command_buffer GPUStartTime ];
+            if ( c == 0 || ( c > 0 && time < best_time ) ) {
+                best_time = time;
+                best = (uint32_t)c;
+            }
+        }
+        
+        NSMapTable * table = TunedThreadgroups();
+        @synchronized ( table ) {
+            NSMutableDictionary * tuned = [ table objectForKey:compute_pipeline_state ];
+            if ( !tuned ) {
+                tuned = [ NSMutableDictionary dictionary ];
+                [ table setObject:tuned forKey:compute_pipeline_state ];
+            }
+            tuned[ GridKey( gridSize ) ] = @[ @( candidates[ best ][0] ), @( candidates[ best ][1] ), @( candidates[ best ][2] ) ];
+        }
+        for ( int d = 0; d < 3; d++ )
+            group_size[ d ] = candidates[ best ][ d ];
+        
+        return MTL_SUCCESS;
+    }
+}
+
+
+#pragma mark Command Lists
+
+/** Record a batch of dispatches once, to encode it any number of times
+ * @param device_handle The device the list runs on; its buffers must be on it
+ * @param dispatches Array of dispatches, executed in order
+ * @param count Number of dispatches
+ * @return CommandListHandle on success, INVALID_HANDLE on error.
+ */
+CommandListHandle mtlNewCommandList( DeviceHandle device_handle, const mtlDispatch * dispatches, uint32_t count )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLDevice> device = [ HS Handle2Device:device_handle ];
+        if (!device) {
+            mtlStoreError( @"Invalid device handle." );
+            return (CommandListHandle)INVALID_HANDLE;
+        }
+        
+        CommandList * list = ResolveDispatches( dispatches, count );
+        if (!list)
+            return (CommandListHandle)INVALID_HANDLE;
+        for ( NSArray * dispatch_buffers in list.buffers ) {
+            for ( id buffer in dispatch_buffers ) {
+                if ( buffer != [ NSNull null ] && [ [ buffer device ] registryID ] != [ device registryID ] ) {
+                    mtlStoreError( @"Buffer was created on a different device." );
+                    return (CommandListHandle)INVALID_HANDLE;
+                }
+            }
+        }
+        list.device = device;
+        
+        return [ HS CommandList2Handle:list ];
+    }
+}
+
+
+/** Change one buffer binding of a recorded command list
+ * @param command_list_handle The handle of the command list
+ * @param dispatch_index Zero-based index of the dispatch in the list
+ * @param buffer_index The [[ buffer(n) ]] index to bind, below MTL_DISPATCH_MAX_BUFFERS
+ * @param buffer_handle The buffer to bind, on the list's device
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlCommandListSetBuffer( CommandListHandle command_list_handle, uint32_t dispatch_index, uint32_t buffer_index, BufferHandle buffer_handle )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        CommandList * list = [ HS Handle2CommandList:command_list_handle ];
+        if (!list) {
+            mtlStoreError( @"Invalid command list handle." );
+            return MTL_ERROR;
+        }
+        id<MTLBuffer> buffer = [ HS Handle2Buffer:buffer_handle ];
+        if (!buffer) {
+            mtlStoreError( @"Invalid buffer handle." );
+            return MTL_ERROR;
+        }
+        if ( [ [ buffer device ] registryID ] != [ list.device registryID ] ) {
+            mtlStoreError( @"Buffer was created on a different device." );
+            return MTL_ERROR;
+        }
+        if ( buffer_index >= MTL_DISPATCH_MAX_BUFFERS ) {
+            mtlStoreError( @"Too many buffers in a dispatch." );
+            return MTL_ERROR;
+        }
+        
+        @synchronized ( list ) {
+            if ( dispatch_index >= [ list.buffers count ] ) {
+                mtlStoreError( @"Dispatch index exceeds the command list." );
+                return MTL_ERROR;
+            }
+            NSMutableArray * dispatch_buffers = list.buffers[ dispatch_index ];
+            while ( [ dispatch_buffers count ] <= buffer_index )
+                [ dispatch_buffers addObject:[ NSNull null ] ];
+            dispatch_buffers[ buffer_index ] = buffer;
+        }
+        
+        return MTL_SUCCESS;
+    }
+}
+
+
+/** Encode a recorded command list into a command buffer
+ * @param command_buffer_handle The handle of a command buffer that has not been committed, on the list's device
+ * @param command_list_handle The handle of the command list
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlEncodeCommandList( CommandBufferHandle command_buffer_handle, CommandListHandle command_list_handle )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLCommandBuffer> command_buffer = [ HS Handle2CommandBuffer:command_buffer_handle ];
+        if (!command_buffer) {
+            mtlStoreError( @"Invalid command buffer handle." );
+            return MTL_ERROR;
+        }
+        if ( [ command_buffer status ] != MTLCommandBufferStatusNotEnqueued ) {
+            mtlStoreError( @"Command buffer has already been committed." );
+            return MTL_ERROR;
+        }
+        CommandList * list = [ HS Handle2CommandList:command_list_handle ];
+        if (!list) {
+            mtlStoreError( @"Invalid command list handle." );
+            return MTL_ERROR;
+        }
+        if ( [ [ command_buffer device ] registryID ] != [ list.device registryID ] ) {
+            mtlStoreError( @"Command list was recorded for a different device." );
+            return MTL_ERROR;
+        }
+        
+        return EncodeResolvedDispatches( command_buffer, list );
+    }
+}
+
+
+/** Encode a recorded command list into a new command buffer and commit it
+ * @param command_queue_handle A handle to the command queue to submit to
+ * @param command_list_handle The handle of the command list
+ * @return A handle to the committed command buffer or INVALID_HANDLE on error
+ */
+CommandBufferHandle mtlSubmitCommandList( CommandQueueHandle command_queue_handle, CommandListHandle command_list_handle )
+{
+    CommandBufferHandle command_buffer_handle = mtlNewCommandBuffer( command_queue_handle );
+    if ( command_buffer_handle == INVALID_HANDLE )
+        return (CommandBufferHandle) INVALID_HANDLE;
+    
+    if ( mtlEncodeCommandList( command_buffer_handle, command_list_handle ) != MTL_SUCCESS ||
+         mtlCommitCommandBuffer( command_buffer_handle ) != MTL_SUCCESS ) {
+        mtlFreeCommandBuffer( command_buffer_handle );
+        return (CommandBufferHandle) INVALID_HANDLE;
+    }
+    return command_buffer_handle;
+}
+
+
+/** Free a command list
+ * @param command_list_handle The handle of the command list
+ */
+void mtlFreeCommandList( CommandListHandle command_list_handle )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        [ HS FreeCommandList:command_list_handle ];
+    }
+}
+
+
+#pragma mark Reductions
+
+#define REDUCE_THREADS 256
+#define REDUCE_MAX_GROUPS 1024
+
+/**
+ * Kernels of the reductions, following the rules of Reduction.h. Each
+ * threadgroup of reduce_partials strides over the array, then combines its
+ * threads as a tree in threadgroup memory; the host combines the partial
+ * results of the threadgroups. reduce_dimension runs one thread per output.
+ */
+static NSString * const ReductionSource = @
+    "#include <metal_stdlib>\n"
+    "using namespace metal;\n"
+    "\n"
+    "#define REDUCE_THREADS 256\n"
+    "\n"
+    "struct reduce_params { ulong inner; ulong length; ulong outer; uint operation; uint padding; };\n"
+    "struct reduce_partial { float value; uint index; };\n"
+    "\n"
+    "inline bool reduce_is_sum( uint operation ) { return operation == 0 || operation == 1 || operation == 6; }\n"
+    "\n"
+    "inline bool reduce_better( uint operation, float value, uint index, float best, uint best_index )\n"
+    "{\n"
+    "    if ( isnan( value ) ) return false;\n"
+    "    if ( isnan( best ) ) return true;\n"
+    "    bool minimum = operation == 2 || operation == 4;\n"
+    "    return ( minimum ? value < best : value > best ) || ( value == best && index < best_index );\n"
+    "}\n"
+    "\n"
+    "kernel void reduce_partials( device const float * data [[ buffer(0) ]],\n"
+    "                             device reduce_partial * partials [[ buffer(1) ]],\n"
+    "                             constant reduce_params & params [[ buffer(2) ]],\n"
+    "                             uint lane [[ thread_position_in_threadgroup ]],\n"
+    "                             uint group [[ threadgroup_position_in_grid ]],\n"
+    "                             uint threads [[ threads_per_grid ]] )\n"
+    "{\n"
+    "    threadgroup float values[ REDUCE_THREADS ];\n"
+    "    threadgroup uint indices[ REDUCE_THREADS ];\n"
+    "    bool sum = reduce_is_sum( params.operation );\n"
+    "    float value = sum ? 0.0f : NAN;\n"
+    "    uint index = UINT_MAX;\n"
+    "    for ( ulong i = group * REDUCE_THREADS + lane; i < params.length; i += threads ) {\n"
+    "        float x = data[ i ];\n"
+    "        if ( sum ) value += params.operation == 6 ? x * x : x;\n"
+    "        else if ( reduce_better( params.operation, x, (uint)i, value, index ) ) { value = x; index = (uint)i; }\n"
+    "    }\n"
+    "    values[ lane ] = value;\n"
+    "    indices[ lane ] = index;\n"
+    "    for ( uint stride = REDUCE_THREADS / 2; stride > 0; stride /= 2 ) {\n"
+    "        threadgroup_barrier( mem_flags::mem_threadgroup );\n"
+    "        if ( lane < stride ) {\n"
+    "            float other = values[ lane + stride ];\n"
+    "            uint other_index = indices[ lane + stride ];\n"
+    "            if ( sum ) values[ lane ] += other;\n"
+    "            else if ( reduce_better( params.operation, other, other_index, values[ lane ], indices[ lane ] ) ) {\n"
+    "                values[ lane ] = other;\n"
+    "                indices[ lane ] = other_index;\n"
+    "            }\n"
+    "        }\n"
+    "    }\n"
+    "    if ( lane == 0 ) {\n"
+    "        partials[ group ].value = values[ 0 ];\n"
+    "        partials[ group ].index = indices[ 0 ];\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "kernel void reduce_dimension( device const float * data [[ buffer(0) ]],\n"
+    "                              device float * output [[ buffer(1) ]],\n"
+    "                              constant reduce_params & params [[ buffer(2) ]],\n"
+    "                              uint t [[ thread_position_in_grid ]] )\n"
+    "{\n"
+    "    if ( t >= params.inner * params.outer ) return;\n"
+    "    ulong inner = t % params.inner;\n"
+    "    ulong outer = t / params.inner;\n"
+    "    device const float * first = data + outer * params.length * params.inner + inner;\n"
+    "    bool sum = reduce_is_sum( params.operation );\n"
+    "    float value = sum ? 0.0f : NAN;\n"
+    "    uint index = UINT_MAX;\n"
+    "    for ( ulong k = 0; k < params.length; k++ ) {\n"
+    "        float x = first[ k * params.inner ];\n"
+    "        if ( sum ) value += params.operation == 6 ? x * x : x;\n"
+    "        else if ( reduce_better( params.operation, x, (uint)k, value, index ) ) { value = x; index = (uint)k; }\n"
+    "    }\n"
+    "    if ( params.operation == 1 ) value /= float( params.length );\n"
+    "    if ( params.operation == 6 ) value = sqrt( value );\n"
+    "    if ( params.operation == 4 || params.operation == 5 ) ( (device uint *)output )[ t ] = index == UINT_MAX ? 0 : index;\n"
+    "    else output[ t ] = value;\n"
+    "}\n";
+
+
+/**
+ * Pipeline states of the reduction kernels, compiled once per device. Devices
+ * are held weakly, so entries go away with them. Access is synchronized on the table.
+ */
+static id<MTLComputePipelineState> ReductionPipelineState( id<MTLDevice> device, NSString * function_name )
+{
+    static NSMapTable<id<MTLDevice>, NSMutableDictionary<NSString *, id<MTLComputePipelineState>> *> * table;
+    static dispatch_once_t once;
+    dispatch_once( &once, ^{
+        table = [ NSMapTable mapTableWithKeyOptions:NSPointerFunctionsWeakMemory | NSPointerFunctionsObjectPointerPersonality
+                                      valueOptions:NSPointerFunctionsStrongMemory ];
+    });
+    
+    @synchronized ( table ) {
+        NSMutableDictionary * pipeline_states = [ table objectForKey:device ];
+        if ( !pipeline_states ) {
+            NSError * error = nil;
+            id<MTLLibrary> library = [ device newLibraryWithSource:ReductionSource options:nil error:&error ];
+            if ( !library ) {
+                mtlStoreError( [ NSString stringWithFormat:@"Error compiling the reduction kernels: %@", error.localizedDescription ] );
+                return nil;
+            }
+            pipeline_states = [ NSMutableDictionary dictionary ];
+            for ( NSString * name in @[ @"reduce_partials", @"reduce_dimension" ] ) {
+                id<MTLFunction> function = [ library newFunctionWithName:name ];
+                id<MTLComputePipelineState> pipeline_state = function ? NewComputePipelineState( device, function, &error ) : nil;
+                if ( !pipeline_state ) {
+                    mtlStoreError( @"Error creating the reduction pipeline states." );
+                    return nil;
+                }
+                pipeline_states[ name ] = pipeline_state;
+            }
+            [ table setObject:pipeline_states forKey:device ];
+        }
+        return pipeline_states[ function_name ];
+    }
+}
+
+
+/** Reduce the first num_elements floats of a buffer to a single value
+ * The threadgroup partials depend only on num_elements, so the result is
+ * always deterministic and MTL_REDUCE_DETERMINISTIC has no further effect.
+ * @param command_queue_handle A handle to the command queue to run on
+ * @param buffer_handle Buffer of floats on the same device
+ * @param num_elements Number of floats to reduce, at least one
+ * @param operation One of the MTL_REDUCE_ operations
+ * @param flags Zero or MTL_REDUCE_DETERMINISTIC
+ * @param result Receives the value and, for min and max, the index
+ * @return MTL_SUCCESS or MTL_ERROR
+ */
+uint32_t mtlReduceBuffer( CommandQueueHandle command_queue_handle, BufferHandle buffer_handle, uint64_t num_elements,
+                          uint32_t operation, uint32_t flags, mtlReduction * result )
+{
+    @autoreleasepool {
+        id HS = [ HandleStore getInstance ];
+        
+        id<MTLCommandQueue> command_queue = [ HS Handle2CommandQueue:command_queue_handle ];
+        if (!command_queue) {
+            mtlStoreError( @"Invalid command queue handle." );
+            return MTL_ERROR;
+        }
+        id<MTLBuffer> buffer = [ HS Handle2Buffer:buffer_handle ];
+        if (!buffer) {
+            mtlStoreError( @"Invalid buffer handle." );
+            return MTL_ERROR;
+        }
+        if ( [ [ buffer device ] registryID ] != [ [ command_queue device ] registryID ] ) {
+            mtlStoreError( @"Buffer was created on a different device." );
+            return MTL_ERROR;
+        }
+        if ( !mtlReduceIsValid( operation ) || ( flags & ~MTL_REDUCE_DETERMINISTIC ) || !result ) {
+            mtlStoreError( @"Invalid reduction." );
+            return MTL_ERROR;
+        }
+        if ( num_elements == 0 || num_elements > [ buffer length ] / sizeof( float ) || num_elements > UINT32_MAX ) {
+            mtlStoreError( @"Buffer smaller than specified number of elements to reduce." );
+            return MTL_ERROR;
+        }
+        
+        id<MTLComputePipelineState> pipeline_state = ReductionPipelineState( [ command_queue device ], @"reduce_partials" );
+        if ( !pipeline_state )
+            return MTL_ERROR;
+        if ( pipeline_state.maxTotalThreadsPerThreadgroup < REDUCE_THREADS ) {
+            mtlStoreError( @"Device does not support the reduction threadgroup size." );
+            return MTL_ERROR;
+        }
+        
+        // At least four elements per thread, in no more than REDUCE_MAX_GROUPS partial results
+        NSUInteger num_groups = (NSUInteger)MIN( ( num_elements + 4 * REDUCE_THREADS - 1 ) / ( 4 * REDUCE_THREADS ), (uint64_t)REDUCE_MAX_GROUPS );
+        typedef struct { float value; uint32_t index; } ReducePartial;
+        id<MTLBuffer> partials = [ [ command_queue device ] newBufferWithLength:num_groups * sizeof( ReducePartial ) options:MTLResourceStorageModeShared ];
+        if ( !partials ) {
+            mtlStoreError( @"Error creating buffer." );
+            return MTL_ERROR;
         }
+        mtlReduceParams params = { 1, num_elements, 1, operation, 0 };
         
         id<MTLCommandBuffer> command_buffer = [ command_queue commandBuffer ];
-        if (!command_buffer)
-        {
-            mtlStoreError( @"Error creating the command buffer." );
-            return (CommandBufferHandle)INVALID_HANDLE;
+        id<MTLComputeCommandEncoder> command_encoder = [ command_buffer computeCommandEncoder ];
+        if ( !command_encoder ) {
+            mtlStoreError( @"Error creating the command encoder." );
+            return MTL_ERROR;
+        }
+        [ command_encoder setComputePipelineState:pipeline_state ];
+        [ command_encoder setBuffer:buffer offset:0 atIndex:0 ];
+        [ command_encoder setBuffer:partials offset:0 atIndex:1 ];
+        [ command_encoder setBytes:&params length:sizeof( params ) atIndex:2 ];
+        [ command_encoder dispatchThreadgroups:MTLSizeMake( num_groups, 1, 1 ) threadsPerThreadgroup:MTLSizeMake( REDUCE_THREADS, 1, 1 ) ];
+        [ command_encoder endEncoding ];
+        [ command_buffer commit ];
+        [ command_buffer waitUntilCompleted ];
+        if ( [ command_buffer status ] != MTLCommandBufferStatusCompleted ) {
+            mtlStoreError( @"Error running the reduction." );
+            return MTL_ERROR;
         }
         
-        return [ HS CommandBuffer2Handle:command_buffer ];
+        // Pairwise tree over the partials in double precision, as on the CPU backend
+        const ReducePartial * partial = (const ReducePartial *)[ partials contents ];
+        NSMutableData * combined = [ NSMutableData dataWithLength:num_groups * sizeof( mtlReduction ) ];
+        mtlReduction * reductions = (mtlReduction *)combined.mutableBytes;
+        for ( NSUInteger g = 0; g < num_groups; g++ ) {
+            reductions[ g ].value = partial[ g ].value;
+            reductions[ g ].index = partial[ g ].index == UINT32_MAX ? REDUCTION_NO_INDEX : partial[ g ].index;
+        }
+        for ( NSUInteger stride = 1; stride < num_groups; stride *= 2 ) {
+            for ( NSUInteger g = 0; g + stride < num_groups; g += 2 * stride )
+                mtlReduceCombine( operation, &reductions[ g ], reductions[ g + stride ].value, reductions[ g + stride ].index );
+        }
+        *result = reductions[ 0 ];
+        mtlReduceFinish( operation, result, num_elements );
+        return MTL_SUCCESS;
     }
-    
 }
 
 
-
-/** Return the device on which the command buffer was created
- * @param command_buffer_handle The handle of the command buffer
- * @return DeviceHandle on succes, INVALID_HANDLE on error.
+/** Encode a reduction of a column-major float array along one dimension
+ * Encoding must have ended on any other command encoder of the command buffer.
+ * @param command_buffer_handle The handle of a command buffer that has not been committed
+ * @param source_handle Buffer holding the array
+ * @param dimensions Width, height and depth of the array in elements
+ * @param dimension Zero-based dimension to reduce along, 0 to 2
+ * @param operation One of the MTL_REDUCE_ operations
+ * @param destination_handle Buffer receiving the reduced array
+ * @return MTL_SUCCESS or MTL_ERROR
  */
-DeviceHandle mtlCommandBufferDevice( CommandBufferHandle command_buffer_handle )
+uint32_t mtlEncodeReduceDimension( CommandBufferHandle command_buffer_handle, BufferHandle source_handle, const uint64_t dimensions[3],
+                                   uint32_t dimension, uint32_t operation, BufferHandle destination_handle )
 {
     @autoreleasepool {
         id HS = [ HandleStore getInstance ];
@@ -662,58 +3486,174 @@ DeviceHandle mtlCommandBufferDevice( CommandBufferHandle command_buffer_handle )
         id<MTLCommandBuffer> command_buffer = [ HS Handle2CommandBuffer:command_buffer_handle ];
         if (!command_buffer) {
             mtlStoreError( @"Invalid command buffer handle." );
-            return (DeviceHandle)INVALID_HANDLE;
+            return MTL_ERROR;
+        }
+        if ( [ command_buffer status ] != MTLCommandBufferStatusNotEnqueued ) {
+            mtlStoreError( @"Command buffer has already been committed." );
+            return MTL_ERROR;
+        }
+        id<MTLBuffer> source = [ HS Handle2Buffer:source_handle ];
+        id<MTLBuffer> destination = [ HS Handle2Buffer:destination_handle ];
+        if ( !source || !destination ) {
+            mtlStoreError( @"Invalid buffer handle." );
+            return MTL_ERROR;
+        }
+        uint64_t registry_id = [ [ command_buffer device ] registryID ];
+        if ( [ [ source device ] registryID ] != registry_id || [ [ destination device ] registryID ] != registry_id ) {
+            mtlStoreError( @"Buffer was created on a different device." );
+            return MTL_ERROR;
+        }
+        if ( !CheckWritable( destination ) )
+            return MTL_ERROR;
+        if ( !dimensions || dimension > 2 || !mtlReduceIsValid( operation ) || dimensions[0] == 0 || dimensions[1] == 0 || dimensions[2] == 0 ) {
+            mtlStoreError( @"Invalid reduction." );
+            return MTL_ERROR;
         }
         
-        id<MTLDevice> device = [ command_buffer device ];
-        if (!device) {
-            mtlStoreError( @"Error retrieving device for command buffer." );
-            return (DeviceHandle)INVALID_HANDLE;
+        mtlReduceParams params = { 1, dimensions[ dimension ], 1, operation, 0 };
+        for ( uint32_t d = 0; d < dimension; d++ )
+            params.inner *= dimensions[ d ];
+        for ( uint32_t d = dimension + 1; d < 3; d++ )
+            params.outer *= dimensions[ d ];
+        uint64_t outputs = params.inner * params.outer;
+        if ( outputs > UINT32_MAX || params.length > UINT32_MAX ) {
+            mtlStoreError( @"Too many elements to reduce." );
+            return MTL_ERROR;
+        }
+        if ( [ source length ] / sizeof( float ) < outputs * params.length || [ destination length ] / sizeof( float ) < outputs ) {
+            mtlStoreError( @"Buffer too small for the reduction." );
+            return MTL_ERROR;
         }
         
-        return [ HS Device2Handle:device ];
+        id<MTLComputePipelineState> pipeline_state = ReductionPipelineState( [ command_buffer device ], @"reduce_dimension" );
+        if ( !pipeline_state )
+            return MTL_ERROR;
+        const uint32_t grid[3] = { (uint32_t)outputs, 1, 1 };
+        uint32_t group[3];
+        mtlDefaultThreadgroupSize( grid, (uint32_t)pipeline_state.threadExecutionWidth, (uint32_t)pipeline_state.maxTotalThreadsPerThreadgroup, group );
+        
+        id<MTLComputeCommandEncoder> command_encoder = [ command_buffer computeCommandEncoderWithDispatchType:MTLDispatchTypeSerial ];
+        if (!command_encoder) {
+            mtlStoreError( @"Error creating the command encoder." );
+            return MTL_ERROR;
+        }
+        [ command_encoder setComputePipelineState:pipeline_state ];
+        [ command_encoder setBuffer:source offset:0 atIndex:0 ];
+        [ command_encoder setBuffer:destination offset:0 atIndex:1 ];
+        [ command_encoder setBytes:&params length:sizeof( params ) atIndex:2 ];
+        [ command_encoder dispatchThreads:MTLSizeMake( grid[0], 1, 1 ) threadsPerThreadgroup:MTLSizeMake( group[0], group[1], group[2] ) ];
+        [ command_encoder endEncoding ];
+        RecordEncode( command_buffer, pipeline_state, MTLSizeMake( grid[0], 1, 1 ) );
+        return MTL_SUCCESS;
     }
 }
 
 
+#pragma mark Element-wise Expressions
 
-/** Copy a command buffer
- * @param command_buffer_handle The handle of the command buffer to copy
+/**
+ * Metal source of a fused element-wise program. The source depends only on the
+ * opcodes, operands and number of inputs, so programs of the same shape with
+ * different constants share a kernel. Constants are bound with setBytes.
  */
-CommandBufferHandle mtlCopyCommandBuffer( CommandBufferHandle command_buffer_handle )
+static NSString * ElementwiseSource( const mtlElementwiseOp * program, uint32_t program_length, uint32_t num_inputs, uint32_t num_constants )
 {
-    @autoreleasepool {
-        id HS = [ HandleStore getInstance ];
-        
-        id<MTLCommandBuffer> command_buffer = [ HS Handle2CommandBuffer:command_buffer_handle ];
-        if (!command_buffer) {
-            mtlStoreError( @"Invalid command buffer handle." );
-            return (CommandBufferHandle)INVALID_HANDLE;
+    NSMutableString * source = [ NSMutableString stringWithString:@"#include <metal_stdlib>\nusing namespace metal;\n\nkernel void elementwise(\n    device float * output [[buffer(0)]],\n" ];
+    for ( uint32_t i = 0; i < num_inputs; i++ )
+        [ source appendFormat:@"    device const float * input%u [[buffer(%u)]],\n", i, i + 1 ];
+    if ( num_constants > 0 )
+        [ source appendFormat:@"    constant float * constants [[buffer(%u)]],\n", num_inputs + 1 ];
+    [ source appendString:@"    uint id [[thread_position_in_grid]] )\n{\n" ];
+    
+    // Each operation names its result; the stack holds the names of pending values
+    uint32_t stack[ MTL_ELEMENTWISE_MAX_STACK ];
+    uint32_t depth = 0;
+    for ( uint32_t i = 0; i < program_length; i++ ) {
+        uint32_t b = depth > 0 ? stack[ depth - 1 ] : 0;
+        uint32_t a = depth > 1 ? stack[ depth - 2 ] : 0;
+        switch ( program[ i ].opcode ) {
+            case MTL_ELEMENTWISE_INPUT:    [ source appendFormat:@"    float v%u = input%u[id];\n", i, program[ i ].operand ]; break;
+            case MTL_ELEMENTWISE_CONSTANT: [ source appendFormat:@"    float v%u = constants[%u];\n", i, program[ i ].operand ]; break;
+            case MTL_ELEMENTWISE_ADD:      [ source appendFormat:@"    float v%u = v%u + v%u;\n", i, a, b ]; break;
+            case MTL_ELEMENTWISE_SUBTRACT: [ source appendFormat:@"    float v%u = v%u - v%u;\n", i, a, b ]; break;
+            case MTL_ELEMENTWISE_MULTIPLY: [ source appendFormat:@"    float v%u = v%u * v%u;\n", i, a, b ]; break;
+            case MTL_ELEMENTWISE_DIVIDE:   [ source appendFormat:@"    float v%u = v%u / v%u;\n", i, a, b ]; break;
+            case MTL_ELEMENTWISE_MAX:      [ source appendFormat:@"    float v%u = fmax( v%u, v%u );\n", i, a, b ]; break;
+            case MTL_ELEMENTWISE_MIN:      [ source appendFormat:@"    float v%u = fmin( v%u, v%u );\n", i, a, b ]; break;
+            case MTL_ELEMENTWISE_NEGATE:   [ source appendFormat:@"    float v%u = -v%u;\n", i, b ]; break;
+            case MTL_ELEMENTWISE_ABS:      [ source appendFormat:@"    float v%u = abs( v%u );\n", i, b ]; break;
         }
-        
-        return [ HS CommandBuffer2Handle:command_buffer ];
+        depth -= mtlElementwiseArity( program[ i ].opcode );
+        stack[ depth++ ] = i;
     }
+    [ source appendFormat:@"    output[id] = v%u;\n}\n", stack[ 0 ] ];
+    return source;
 }
 
 
-
-/** Free a command buffer
- * @param command_buffer_handle The handle of the command buffer to free
+/**
+ * Pipeline states of generated element-wise kernels, compiled once per device
+ * and source. Devices are held weakly, so entries go away with them. Access is
+ * synchronized on the table.
  */
-void mtlFreeCommandBuffer( CommandBufferHandle command_buffer_handle )
+static id<MTLComputePipelineState> ElementwisePipelineState( id<MTLDevice> device, NSString * source )
 {
-    @autoreleasepool {
-        id HS = [ HandleStore getInstance ];
-        [ HS FreeCommandBuffer:command_buffer_handle ];
+    static NSMapTable<id<MTLDevice>, NSMutableDictionary<NSString *, id<MTLComputePipelineState>> *> * table;
+    static dispatch_once_t once;
+    dispatch_once( &once, ^{
+        table = [ NSMapTable mapTableWithKeyOptions:NSPointerFunctionsWeakMemory | NSPointerFunctionsObjectPointerPersonality
+                                      valueOptions:NSPointerFunctionsStrongMemory ];
+    });
+    
+    @synchronized ( table ) {
+        NSMutableDictionary * pipeline_states = [ table objectForKey:device ];
+        if ( !pipeline_states ) {
+            pipeline_states = [ NSMutableDictionary dictionary ];
+            [ table setObject:pipeline_states forKey:device ];
+        }
+        id<MTLComputePipelineState> pipeline_state = pipeline_states[ source ];
+        if ( pipeline_state )
+            return pipeline_state;
+        
+        // IEEE semantics, so results match the CPU backend
+        MTLCompileOptions * options = [ MTLCompileOptions new ];
+        options.fastMathEnabled = NO;
+        NSError * error = nil;
+        id<MTLLibrary> library = [ device newLibraryWithSource:source options:options error:&error ];
+        if ( !library ) {
+            mtlStoreError( [ NSString stringWithFormat:@"Error compiling the element-wise kernel: %@", error.localizedDescription ] );
+            return nil;
+        }
+        id<MTLFunction> function = [ library newFunctionWithName:@"elementwise" ];
+        pipeline_state = function ? NewComputePipelineState( device, function, &error ) : nil;
+        if ( !pipeline_state ) {
+            mtlStoreError( @"Error creating the element-wise pipeline state." );
+            return nil;
+        }
+        pipeline_states[ source ] = pipeline_state;
+        return pipeline_state;
     }
 }
 
 
-/** Commit a command buffer for execution
- * @param command_buffer_handle The handle of the command buffer to free
+/** Encode a fused element-wise program over float buffers
+ * The program is compiled into one kernel on first use and cached by shape.
+ * Encoding must have ended on any other command encoder of the command buffer.
+ * @param command_buffer_handle The handle of a command buffer that has not been committed
+ * @param program The operations, in postfix order, leaving one value and never
+ *                holding more than MTL_ELEMENTWISE_MAX_STACK values
+ * @param program_length Number of operations, at most MTL_ELEMENTWISE_MAX_PROGRAM
+ * @param input_handles Buffers read by MTL_ELEMENTWISE_INPUT
+ * @param num_inputs Number of inputs, at most MTL_ELEMENTWISE_MAX_INPUTS
+ * @param constants Values pushed by MTL_ELEMENTWISE_CONSTANT
+ * @param num_constants Number of constants, at most MTL_ELEMENTWISE_MAX_CONSTANTS
+ * @param output_handle Buffer receiving the results
+ * @param num_elements Number of elements to compute
  * @return MTL_SUCCESS or MTL_ERROR
  */
-uint32_t mtlCommitCommandBuffer( CommandBufferHandle command_buffer_handle )
+uint32_t mtlEncodeElementwise( CommandBufferHandle command_buffer_handle, const mtlElementwiseOp * program, uint32_t program_length,
+                               const BufferHandle * input_handles, uint32_t num_inputs, const float * constants, uint32_t num_constants,
+                               BufferHandle output_handle, uint64_t num_elements )
 {
     @autoreleasepool {
         id HS = [ HandleStore getInstance ];
@@ -723,210 +3663,286 @@ uint32_t mtlCommitCommandBuffer( CommandBufferHandle command_buffer_handle )
             mtlStoreError( @"Invalid command buffer handle." );
             return MTL_ERROR;
         }
+        if ( [ command_buffer status ] != MTLCommandBufferStatusNotEnqueued ) {
+            mtlStoreError( @"Command buffer has already been committed." );
+            return MTL_ERROR;
+        }
+        if ( !mtlElementwiseIsValid( program, program_length, num_inputs, num_constants ) ||
+             ( num_inputs > 0 && !input_handles ) || ( num_constants > 0 && !constants ) ) {
+            mtlStoreError( @"Invalid element-wise program." );
+            return MTL_ERROR;
+        }
+        if ( num_elements == 0 || num_elements > UINT32_MAX ) {
+            mtlStoreError( @"Invalid number of elements." );
+            return MTL_ERROR;
+        }
         
-        [command_buffer commit];
+        // The output first, then the inputs, each holding num_elements floats on the command buffer's device
+        NSMutableArray<id<MTLBuffer>> * buffers = [ NSMutableArray arrayWithCapacity:num_inputs + 1 ];
+        uint64_t registry_id = [ [ command_buffer device ] registryID ];
+        for ( uint32_t i = 0; i <= num_inputs; i++ ) {
+            id<MTLBuffer> buffer = [ HS Handle2Buffer:( i == 0 ? output_handle : input_handles[ i - 1 ] ) ];
+            if (!buffer) {
+                mtlStoreError( @"Invalid buffer handle." );
+                return MTL_ERROR;
+            }
+            if ( [ [ buffer device ] registryID ] != registry_id ) {
+                mtlStoreError( @"Buffer was created on a different device." );
+                return MTL_ERROR;
+            }
+            if ( [ buffer length ] / sizeof( float ) < num_elements ) {
+                mtlStoreError( @"Buffer smaller than specified number of elements." );
+                return MTL_ERROR;
+            }
+            [ buffers addObject:buffer ];
+        }
+        if ( !CheckWritable( buffers[0] ) )
+            return MTL_ERROR;
+        
+        NSString * source = ElementwiseSource( program, program_length, num_inputs, num_constants );
+        id<MTLComputePipelineState> pipeline_state = ElementwisePipelineState( [ command_buffer device ], source );
+        if ( !pipeline_state )
+            return MTL_ERROR;
+        const uint32_t grid[3] = { (uint32_t)num_elements, 1, 1 };
+        uint32_t group[3];
+        mtlDefaultThreadgroupSize( grid, (uint32_t)pipeline_state.threadExecutionWidth, (uint32_t)pipeline_state.maxTotalThreadsPerThreadgroup, group );
+        
+        id<MTLComputeCommandEncoder> command_encoder = [ command_buffer computeCommandEncoderWithDispatchType:MTLDispatchTypeSerial ];
+        if (!command_encoder) {
+            mtlStoreError( @"Error creating the command encoder." );
+            return MTL_ERROR;
+        }
+        [ command_encoder setComputePipelineState:pipeline_state ];
+        for ( uint32_t i = 0; i <= num_inputs; i++ )
+            [ command_encoder setBuffer:buffers[ i ] offset:0 atIndex:i ];
+        if ( num_constants > 0 )
+            [ command_encoder setBytes:constants length:num_constants * sizeof( float ) atIndex:num_inputs + 1 ];
+        [ command_encoder dispatchThreads:MTLSizeMake( grid[0], 1, 1 ) threadsPerThreadgroup:MTLSizeMake( group[0], group[1], group[2] ) ];
+        [ command_encoder endEncoding ];
+        RecordEncode( command_buffer, pipeline_state, MTLSizeMake( grid[0], 1, 1 ) );
         return MTL_SUCCESS;
     }
-    
 }
 
 
-/** Wait for a command buffer to complete
- * @param command_buffer_handle The handle of the command buffer to free
+#pragma mark Streaming
+/** Run a kernel over host arrays larger than the device can hold, in chunks pipelined through pooled buffers
+ * @param command_queue_handle The queue the chunks are committed to
+ * @param compute_pipeline_state_handle The kernel to run
+ * @param arrays The arguments, bound at buffer(0), buffer(1), ...
+ * @param num_arrays Number of arguments, at most MTL_DISPATCH_MAX_BUFFERS
+ * @param num_threads Threads of the whole grid
+ * @param memory_budget Bytes of device memory the stream may use, or 0 for the default
  * @return MTL_SUCCESS or MTL_ERROR
  */
-uint32_t mtlWaitForCompletion( CommandBufferHandle command_buffer_handle )
+uint32_t mtlStreamKernel( CommandQueueHandle command_queue_handle, ComputePipelineStateHandle compute_pipeline_state_handle,
+                          const mtlStreamArray * arrays, uint32_t num_arrays, uint64_t num_threads, uint64_t memory_budget )
 {
     @autoreleasepool {
-        id HS = [ HandleStore getInstance ];
-        
-        id<MTLCommandBuffer> command_buffer = [ HS Handle2CommandBuffer:command_buffer_handle ];
-        if (!command_buffer) {
-            mtlStoreError( @"Invalid command buffer handle." );
+        const char * error = mtlStreamRun( command_queue_handle, compute_pipeline_state_handle, arrays, num_arrays, num_threads, memory_budget );
+        if ( error ) {
+            mtlStoreError( [ NSString stringWithUTF8String:error ] );
             return MTL_ERROR;
         }
-        
-        [command_buffer waitUntilCompleted];
         return MTL_SUCCESS;
     }
-    
 }
 
 
-#pragma mark Command Encoders
-/** Create a command encoder
- * @param command_buffer_handle A handle to a command buffer on which to create the command encoder
- * @return A handle to a command encoder or INVALID_HANDLE on error
+/** Stream one host input through a kernel into one host output
+ * @param command_queue_handle The queue the chunks are committed to
+ * @param compute_pipeline_state_handle The kernel to run
+ * @param input Host data of num_threads * input_element_size bytes, bound at buffer(0)
+ * @param input_element_size Bytes of input per thread
+ * @param output Host memory receiving num_threads * output_element_size bytes, bound at buffer(1)
+ * @param output_element_size Bytes of output per thread
+ * @param resident_handles Buffers bound whole for every chunk, from buffer(2) on
+ * @param num_resident Number of resident buffers
+ * @param num_threads Threads of the whole grid
+ * @param memory_budget Bytes of device memory the stream may use, or 0 for the default
+ * @return MTL_SUCCESS or MTL_ERROR
  */
-CommandEncoderHandle mtlNewCommandEncoder( CommandBufferHandle command_buffer_handle )
+uint32_t mtlStreamKernelInOut( CommandQueueHandle command_queue_handle, ComputePipelineStateHandle compute_pipeline_state_handle,
+                               const void * input, uint64_t input_element_size, void * output, uint64_t output_element_size,
+                               const BufferHandle * resident_handles, uint32_t num_resident, uint64_t num_threads, uint64_t memory_budget )
 {
     @autoreleasepool {
-        id HS = [ HandleStore getInstance ];
-        
-        id<MTLCommandBuffer> command_buffer = [ HS Handle2CommandBuffer:command_buffer_handle ];
-        if (!command_buffer) {
-            mtlStoreError( @"Invalid command buffer handle." );
-            return (CommandEncoderHandle)INVALID_HANDLE;
-        }
-        
-        id<MTLComputeCommandEncoder> command_encoder = [ command_buffer computeCommandEncoderWithDispatchType:MTLDispatchTypeSerial ];
-        if (!command_encoder)
-        {
-            mtlStoreError( @"Error creating the command encoder." );
-            return (CommandEncoderHandle)INVALID_HANDLE;
+        const char * error = mtlStreamRunInOut( command_queue_handle, compute_pipeline_state_handle, input, input_element_size, output, output_element_size,
+                                                resident_handles, num_resident, num_threads, memory_budget );
+        if ( error ) {
+            mtlStoreError( [ NSString stringWithUTF8String:error ] );
+            return MTL_ERROR;
         }
-        
-        return [ HS CommandEncoder2Handle:command_encoder ];
+        return MTL_SUCCESS;
     }
 }
 
 
-/** Free a command encoder
- * @param command_encoder_handle The handle of the command encoder to free
+#pragma mark Profiling
+/** Turn profiling on or off
+ * @param enabled Nonzero to enable profiling
  */
-void mtlFreeCommandEncoder( CommandEncoderHandle command_encoder_handle )
+void mtlSetProfilingEnabled( uint8_t enabled )
 {
-    @autoreleasepool {
-        id HS = [ HandleStore getInstance ];
-        [ HS FreeCommandEncoder:command_encoder_handle ];
+    atomic_store( &ProfilingIsEnabled, enabled != 0 );
+}
+
+
+/** Return nonzero if profiling is enabled */
+uint8_t mtlProfilingEnabled( void )
+{
+    return atomic_load( &ProfilingIsEnabled ) ? 1 : 0;
+}
+
+
+/** Return the current time of the profile clock in seconds */
+double mtlProfileTime( void )
+{
+    return ProfileTime();
+}
+
+
+/** The timing record of a completed command buffer committed while profiling, or nil after storing an error */
+static NSMutableData * ProfiledCommandBuffer( CommandBufferHandle command_buffer_handle )
+{
+    id HS = [ HandleStore getInstance ];
+    
+    id<MTLCommandBuffer> command_buffer = [ HS Handle2CommandBuffer:command_buffer_handle ];
+    if (!command_buffer) {
+        mtlStoreError( @"Invalid command buffer handle." );
+        return nil;
+    }
+    if ( !CommandBufferFinished( command_buffer ) ) {
+        mtlStoreError( @"Command buffer has not completed." );
+        return nil;
+    }
+    
+    NSMutableData * profile;
+    NSMapTable * profiles = CommandBufferProfiles();
+    @synchronized ( profiles ) {
+        profile = [ profiles objectForKey:command_buffer ];
+        if ( profile && !( (const CommandBufferProfileHeader *)[ profile bytes ] )->profiled )
+            profile = nil;
+    }
+    if ( !profile ) {
+        mtlStoreError( @"Command buffer was not committed while profiling." );
+        return nil;
     }
+    
+    // waitUntilCompleted can return before the completed handlers have run
+    FinishCommandBufferProfile( command_buffer, profile );
+    return profile;
 }
 
 
-/** Set a compute pipeline state (the function to execute) to a command buffer via its command encoder
- * @param command_encoder_handle The handle of the command encoder to use
+/** Get the timing of a completed command buffer committed while profiling
+ * @param command_buffer_handle The handle of the command buffer
+ * @param timing Receives the timing
  * @return MTL_SUCCESS or MTL_ERROR
  */
-uint32_t mtlSetComputePipelineState( CommandEncoderHandle command_encoder_handle, ComputePipelineStateHandle compute_pipeline_state_handle )
+uint32_t mtlGetCommandBufferTiming( CommandBufferHandle command_buffer_handle, mtlCommandBufferTiming * timing )
 {
     @autoreleasepool {
-        id HS = [ HandleStore getInstance ];
-        
-        id<MTLComputeCommandEncoder> command_encoder = [ HS Handle2CommandEncoder:command_encoder_handle ];
-        if (!command_encoder) {
-            mtlStoreError( @"Invalid command encoder handle." );
+        NSMutableData * profile = ProfiledCommandBuffer( command_buffer_handle );
+        if ( !profile || !timing )
             return MTL_ERROR;
-        }
         
-        id<MTLComputePipelineState> compute_pipeline_state = [ HS Handle2ComputePipelineState:compute_pipeline_state_handle ];
-        if (!compute_pipeline_state) {
-            mtlStoreError( @"Invalid compute pipeline state handle." );
-            return MTL_ERROR;
+        @synchronized ( CommandBufferProfiles() ) {
+            *timing = ( (const CommandBufferProfileHeader *)[ profile bytes ] )->timing;
         }
-        
-        [ command_encoder setComputePipelineState:compute_pipeline_state ];
-        
-        
         return MTL_SUCCESS;
     }
 }
 
 
-
-/** Associate a GPU buffer with a command buffer via its command encoder
- * @param command_encoder_handle The handle of the command encoder to use
- * @param buffer_handle The handle of a buffer to associate with the command encoder
- * @param index The index of the association, zero-based.
+/** Get the timing of one dispatch of a completed, profiled command buffer
+ * @param command_buffer_handle The handle of the command buffer
+ * @param dispatch_index Zero-based index of the dispatch, in encoding order
+ * @param timing Receives the timing
  * @return MTL_SUCCESS or MTL_ERROR
  */
-uint32_t mtlSetBuffer( CommandEncoderHandle command_encoder_handle, BufferHandle buffer_handle, uint32_t index )
+uint32_t mtlGetDispatchTiming( CommandBufferHandle command_buffer_handle, uint32_t dispatch_index, mtlDispatchTiming * timing )
 {
     @autoreleasepool {
-        id HS = [ HandleStore getInstance ];
-        
-        id<MTLComputeCommandEncoder> command_encoder = [ HS Handle2CommandEncoder:command_encoder_handle ];
-        if (!command_encoder) {
-            mtlStoreError( @"Invalid command encoder handle." );
+        NSMutableData * profile = ProfiledCommandBuffer( command_buffer_handle );
+        if ( !profile || !timing )
             return MTL_ERROR;
-        }
         
-        id<MTLBuffer> buffer = [ HS Handle2Buffer:buffer_handle ];
-        if (!buffer) {
-            mtlStoreError( @"Invalid buffer handle." );
-            return MTL_ERROR;
+        @synchronized ( CommandBufferProfiles() ) {
+            const CommandBufferProfileHeader * header = (const CommandBufferProfileHeader *)[ profile bytes ];
+            if ( dispatch_index >= header->timing.num_dispatches ) {
+                mtlStoreError( @"Dispatch index out of bounds." );
+                return MTL_ERROR;
+            }
+            *timing = ( (const mtlDispatchTiming *)( header + 1 ) )[ dispatch_index ];
         }
-        
-        [ command_encoder setBuffer:buffer offset:0 atIndex:index ];
-        
         return MTL_SUCCESS;
     }
 }
 
 
-MTLSize CalculateThreadgroupSize( MTLSize gridSize, NSUInteger max_threads )
+/** Get the totals of the host-side work recorded since the profile was last cleared
+ * @param stats Receives the totals
+ */
+void mtlGetProfileStats( mtlProfileStats * stats )
 {
-    @autoreleasepool {
-        MTLSize threadgroupSize;
-        threadgroupSize.width = gridSize.width;
-        threadgroupSize.depth = gridSize.depth;
-        threadgroupSize.height = gridSize.height;
-        while( ( threadgroupSize.width * threadgroupSize.depth * threadgroupSize.height ) > max_threads )
-        {
-            threadgroupSize.width = MAX( (int)((double)threadgroupSize.width / 1.01), 1 );
-            threadgroupSize.depth = MAX( (int)((double)threadgroupSize.depth / 1.01), 1 );
-            threadgroupSize.height = MAX( (int)((double)threadgroupSize.height / 1.01), 1 );
-        }
-        return threadgroupSize;
+    @synchronized ( ProfileLock() ) {
+        *stats = ProfileCounters;
     }
 }
 
 
-/** Specify the thread count and organization
- * @param command_encoder_handle The handle of the command encoder to use
- * @param compute_pipeline_state_handle The handle of the compute pipeline state which will be executed
- * @param width The size of the first dimension (usuall numelements for a one-dimensional array)
- * @param height The size of the second dimension (usually 1 for a one-dimensional array)
- * @param depth The size of the third dimension (usually 1 for a one-dimensional array)
+/** Write the recorded trace as a Chrome trace-event JSON file
+ * @param path Name of the file to write
  * @return MTL_SUCCESS or MTL_ERROR
  */
-uint32_t mtlSetThreadsAndShape( CommandEncoderHandle command_encoder_handle, ComputePipelineStateHandle compute_pipeline_state_handle,  uint32_t width, uint32_t height, uint32_t depth )
+uint32_t mtlWriteProfileTrace( const char * path )
 {
     @autoreleasepool {
-        id HS = [ HandleStore getInstance ];
-        
-        if ( ( width == 0 ) || ( height == 0 ) || ( depth ==0 ) )
-            return MTL_ERROR;
-        
-        id<MTLComputeCommandEncoder> command_encoder = [ HS Handle2CommandEncoder:command_encoder_handle ];
-        if (!command_encoder) {
-            mtlStoreError( @"Invalid command encoder handle." );
+        if ( !path || !path[ 0 ] ) {
+            mtlStoreError( @"No trace file name." );
             return MTL_ERROR;
         }
         
-        id<MTLComputePipelineState> compute_pipeline_state = [ HS Handle2ComputePipelineState:compute_pipeline_state_handle ];
-        if (!compute_pipeline_state) {
-            mtlStoreError( @"Invalid compute pipeline state handle." );
-            return MTL_ERROR;
+        NSArray<id<MTLDevice>> * devices = TraceDevices();
+        NSMutableData * device_names = [ NSMutableData dataWithLength:[ devices count ] * sizeof( const char * ) ];
+        for ( NSUInteger i = 0; i < [ devices count ]; i++ )
+            ( (const char **)[ device_names mutableBytes ] )[ i ] = [ devices[ i ] name ].UTF8String;
+        
+        @synchronized ( ProfileLock() ) {
+            if ( !mtlWriteTraceFile( path, (const mtlTraceEvent *)[ TraceEvents bytes ], [ TraceEvents length ] / sizeof( mtlTraceEvent ),
+                                     (const char * const *)[ device_names bytes ], (uint32_t)[ devices count ] ) ) {
+                mtlStoreError( [ NSString stringWithFormat:@"Error writing trace file: %s", strerror( errno ) ] );
+                return MTL_ERROR;
+            }
         }
-        
-        MTLSize gridSize = MTLSizeMake( width, height, depth );
-        NSUInteger max_threads_per_threadgroup = compute_pipeline_state.maxTotalThreadsPerThreadgroup;
-        MTLSize threadgroupSize = CalculateThreadgroupSize( gridSize, max_threads_per_threadgroup );
-        [ command_encoder dispatchThreads:gridSize threadsPerThreadgroup:threadgroupSize ];
-        
         return MTL_SUCCESS;
     }
 }
 
 
-/** End encoding
- * @param command_encoder_handle The handle of the command encoder
+/** Discard the recorded trace and totals */
+void mtlClearProfile( void )
+{
+    @synchronized ( ProfileLock() ) {
+        TraceEvents = nil;
+        memset( &ProfileCounters, 0, sizeof( ProfileCounters ) );
+    }
+}
+
+
+#pragma mark Host Kernels
+
+/** Register a host implementation of a kernel function (CPU backend only)
+ * @param function_name Name of the kernel function as declared in the library source
+ * @param kernel The host kernel implementing the function
  * @return MTL_SUCCESS or MTL_ERROR
  */
-uint32_t mtlEndEncoding( CommandEncoderHandle command_encoder_handle )
+uint32_t mtlRegisterHostKernel( const char * function_name, mtlHostKernel kernel )
 {
     @autoreleasepool {
-        id HS = [ HandleStore getInstance ];
-        
-        id<MTLComputeCommandEncoder> command_encoder = [ HS Handle2CommandEncoder:command_encoder_handle ];
-        if (!command_encoder) {
-            mtlStoreError( @"Invalid command encoder handle." );
-            return MTL_ERROR;
-        }
-        
-        [ command_encoder endEncoding ];
-        
-        return MTL_SUCCESS;
+        mtlStoreError( @"Host kernels are only supported by the CPU backend." );
+        return MTL_ERROR;
     }
 }
 
@@ -0,0 +1,149 @@
+//
+//  Profiling.h
+//  MatlabMetal
+//
+//  Trace events recorded while profiling is enabled, and their export as a
+//  Chrome trace-event JSON file (chrome://tracing, Perfetto), shared by the
+//  Metal and CPU backends. Each backend keeps its own event list and clock.
+//
+
+#ifndef Profiling_h
+#define Profiling_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "MatlabMetal.h"
+
+/** Events kept until the profile is cleared; later ones are only counted */
+#define TRACE_MAX_EVENTS ( 1 << 20 )
+#define TRACE_NAME_LENGTH 64
+
+#define TRACE_COMMAND_BUFFER 0
+#define TRACE_DISPATCH       1
+#define TRACE_ENCODE         2
+#define TRACE_COMMIT         3
+#define TRACE_WAIT           4
+#define TRACE_COPY_IN        5
+#define TRACE_COPY_OUT       6
+
+
+/**
+ * A span of time on a track of the trace. Host events are on process 0, one
+ * thread per calling thread. Device events are on process 1 + the device's
+ * index: command buffers on thread 0, dispatches that run together on
+ * threads 1, 2, ... Times are in seconds on the backend's profile clock.
+ */
+typedef struct {
+    char name[ TRACE_NAME_LENGTH ];
+    uint32_t category;
+    uint32_t process;
+    uint64_t thread;
+    double start;
+    double duration;
+    uint64_t handle;
+    uint64_t bytes;
+} mtlTraceEvent;
+
+
+static inline const char * mtlTraceCategoryName( uint32_t category )
+{
+    static const char * const names[] = { "command_buffer", "dispatch", "encode", "commit", "wait", "copy_in", "copy_out" };
+    return category < sizeof( names ) / sizeof( names[0] ) ? names[ category ] : "other";
+}
+
+
+static inline void mtlTraceEventInit( mtlTraceEvent * event, uint32_t category, const char * name, double start, double end )
+{
+    memset( event, 0, sizeof( *event ) );
+    event->category = category;
+    strncpy( event->name, name, TRACE_NAME_LENGTH - 1 );
+    event->start = start;
+    event->duration = end > start ? end - start : 0;
+}
+
+
+/** Add a host event to the profile totals */
+static inline void mtlProfileCount( mtlProfileStats * stats, const mtlTraceEvent * event )
+{
+    switch ( event->category )
+    {
+        case TRACE_COMMIT:
+            stats->commits++;
+            stats->commit_seconds += event->duration;
+            break;
+        case TRACE_WAIT:
+            stats->waits++;
+            stats->wait_seconds += event->duration;
+            break;
+        case TRACE_COPY_IN:
+            stats->copies_in++;
+            stats->bytes_in += event->bytes;
+            stats->copy_in_seconds += event->duration;
+            break;
+        case TRACE_COPY_OUT:
+            stats->copies_out++;
+            stats->bytes_out += event->bytes;
+            stats->copy_out_seconds += event->duration;
+            break;
+        default:
+            break;
+    }
+}
+
+
+static inline void mtlTraceWriteString( FILE * file, const char * text )
+{
+    fputc( '"', file );
+    for ( ; *text; text++ )
+    {
+        unsigned char c = (unsigned char)*text;
+        if ( c == '"' || c == '\\' )
+            fprintf( file, "\\%c", c );
+        else if ( c < 0x20 )
+            fprintf( file, "\\u%04x", c );
+        else
+            fputc( c, file );
+    }
+    fputc( '"', file );
+}
+
+
+/**
+ * Write events as a Chrome trace-event JSON file, naming process 0 "Host"
+ * and process 1 + i after device_names[ i ]. Returns 1 on success.
+ */
+static inline int mtlWriteTraceFile( const char * path, const mtlTraceEvent * events, size_t count,
+                                     const char * const * device_names, uint32_t num_devices )
+{
+    FILE * file = fopen( path, "w" );
+    if ( !file )
+        return 0;
+
+    fprintf( file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+    fprintf( file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,\"args\":{\"name\":\"Host\"}}" );
+    for ( uint32_t d = 0; d < num_devices; d++ )
+    {
+        fprintf( file, ",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":0,\"args\":{\"name\":", d + 1 );
+        mtlTraceWriteString( file, device_names[ d ] );
+        fprintf( file, "}},\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":0,\"args\":{\"name\":\"Command buffers\"}}", d + 1 );
+    }
+
+    for ( size_t i = 0; i < count; i++ )
+    {
+        const mtlTraceEvent * event = &events[ i ];
+        fprintf( file, ",\n{\"name\":" );
+        mtlTraceWriteString( file, event->name );
+        fprintf( file, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%u,\"tid\":%llu,\"args\":{\"handle\":%llu,\"bytes\":%llu}}",
+                 mtlTraceCategoryName( event->category ), event->start * 1e6, event->duration * 1e6, event->process,
+                 (unsigned long long)event->thread, (unsigned long long)event->handle, (unsigned long long)event->bytes );
+    }
+    fprintf( file, "\n]}\n" );
+
+    int failed = ferror( file );
+    return ( fclose( file ) == 0 && !failed ) ? 1 : 0;
+}
+
+
+#endif /* Profiling_h */
@@ -0,0 +1,100 @@
+//
+//  Reduction.h
+//  MatlabMetal
+//
+//  Combining rules of the buffer reductions, shared by the Metal and CPU
+//  backends. The Metal kernels in MatlabMetal.m follow the same rules.
+//
+
+#ifndef Reduction_h
+#define Reduction_h
+
+#include <math.h>
+#include <stdint.h>
+
+#include "MatlabMetal.h"
+
+#define REDUCTION_NO_INDEX UINT64_MAX
+
+
+/** Parameters of a reduction along one dimension, viewed as inner x length x outer */
+typedef struct {
+    uint64_t inner;
+    uint64_t length;
+    uint64_t outer;
+    uint32_t operation;
+    uint32_t padding;
+} mtlReduceParams;
+
+
+static inline int mtlReduceIsValid( uint32_t operation )
+{
+    return operation <= MTL_REDUCE_NORM;
+}
+
+
+/** True for the operations that add up (squared) values rather than compare them */
+static inline int mtlReduceIsSum( uint32_t operation )
+{
+    return operation == MTL_REDUCE_SUM || operation == MTL_REDUCE_MEAN || operation == MTL_REDUCE_NORM;
+}
+
+
+static inline int mtlReduceIsMin( uint32_t operation )
+{
+    return operation == MTL_REDUCE_MIN || operation == MTL_REDUCE_ARGMIN;
+}
+
+
+static inline int mtlReduceIsArg( uint32_t operation )
+{
+    return operation == MTL_REDUCE_ARGMIN || operation == MTL_REDUCE_ARGMAX;
+}
+
+
+/** Start value: zero for sums, NaN with no index for comparisons */
+static inline void mtlReduceInit( uint32_t operation, mtlReduction * reduction )
+{
+    reduction->value = mtlReduceIsSum( operation ) ? 0.0 : NAN;
+    reduction->index = REDUCTION_NO_INDEX;
+}
+
+
+/**
+ * Combine a value (an element, or the partial result of a block) into a
+ * reduction. Comparisons skip NaNs and keep the lower index on ties, so the
+ * result does not depend on the order partial results are combined in.
+ */
+static inline void mtlReduceCombine( uint32_t operation, mtlReduction * reduction, double value, uint64_t index )
+{
+    if ( mtlReduceIsSum( operation ) )
+    {
+        reduction->value += value;
+        return;
+    }
+    if ( value != value )
+        return;
+    int better = reduction->value != reduction->value
+              || ( mtlReduceIsMin( operation ) ? value < reduction->value : value > reduction->value )
+              || ( value == reduction->value && index < reduction->index );
+    if ( better )
+    {
+        reduction->value = value;
+        reduction->index = index;
+    }
+}
+
+
+/** Turn the combined value of count elements into the result. All-NaN input reports index zero. */
+static inline void mtlReduceFinish( uint32_t operation, mtlReduction * reduction, uint64_t count )
+{
+    if ( reduction->index == REDUCTION_NO_INDEX )
+        reduction->index = 0;
+    if ( operation == MTL_REDUCE_MEAN )
+        reduction->value = count > 0 ? reduction->value / (double)count : NAN;
+    else if ( operation == MTL_REDUCE_NORM )
+        reduction->value = sqrt( reduction->value );
+}
+
+
+#endif /* Reduction_h */
@@ -0,0 +1,253 @@
+//
+//  Streaming.h
+//  MatlabMetal
+//
+//  The out-of-core executor behind mtlStreamKernel, shared by the Metal and
+//  CPU backends. It is built on the public API alone: chunks of the host
+//  arrays go through pooled buffers, three chunks at a time, so the device
+//  computes one chunk while the host downloads the chunk before it and
+//  uploads the chunk after it.
+//
+
+#ifndef Streaming_h
+#define Streaming_h
+
+#include <stdint.h>
+#include <string.h>
+
+#include "MatlabMetal.h"
+
+/** Chunks in flight: one uploading, one computing, one downloading */
+#define STREAM_SLOTS 3
+/** Chunks other than the last hold a multiple of this many threads, so threadgroups stay full */
+#define STREAM_CHUNK_ALIGN 256
+
+
+/**
+ * Threads per chunk: as many as fit STREAM_SLOTS chunks of bytes_per_thread
+ * each in the budget, and at most what one dispatch can run. Returns 0 if
+ * not even a chunk of one thread fits.
+ */
+static inline uint64_t mtlStreamChunkThreads( uint64_t bytes_per_thread, uint64_t memory_budget, uint64_t num_threads )
+{
+    uint64_t chunk = num_threads;
+    if ( bytes_per_thread > 0 && memory_budget / ( STREAM_SLOTS * bytes_per_thread ) < chunk )
+        chunk = memory_budget / ( STREAM_SLOTS * bytes_per_thread );
+    if ( chunk > UINT32_MAX )
+        chunk = UINT32_MAX;
+    if ( chunk < num_threads && chunk >= STREAM_CHUNK_ALIGN )
+        chunk -= chunk % STREAM_CHUNK_ALIGN;
+    return chunk;
+}
+
+
+static inline int mtlStreamIsResident( const mtlStreamArray * array )
+{
+    return array->buffer != INVALID_HANDLE;
+}
+
+
+/** Copy the inputs of the chunk of threads [ first, first + count ) into a slot's buffers */
+static inline int mtlStreamUpload( const mtlStreamArray * arrays, uint32_t num_arrays, const BufferHandle * buffers, uint64_t first, uint64_t count )
+{
+    for ( uint32_t i = 0; i < num_arrays; i++ )
+    {
+        if ( mtlStreamIsResident( &arrays[ i ] ) || !arrays[ i ].input )
+            continue;
+        const uint8_t * data = (const uint8_t *)arrays[ i ].input + first * arrays[ i ].element_size;
+        if ( mtlCopyDataToBufferRange( buffers[ i ], 0, data, count * arrays[ i ].element_size ) != MTL_SUCCESS )
+            return 0;
+    }
+    return 1;
+}
+
+
+/** Copy the outputs of the chunk of threads [ first, first + count ) out of a slot's buffers */
+static inline int mtlStreamDownload( const mtlStreamArray * arrays, uint32_t num_arrays, const BufferHandle * buffers, uint64_t first, uint64_t count )
+{
+    for ( uint32_t i = 0; i < num_arrays; i++ )
+    {
+        if ( mtlStreamIsResident( &arrays[ i ] ) || !arrays[ i ].output )
+            continue;
+        uint8_t * data = (uint8_t *)arrays[ i ].output + first * arrays[ i ].element_size;
+        if ( mtlCopyDataFromBufferRange( buffers[ i ], 0, data, count * arrays[ i ].element_size ) != MTL_SUCCESS )
+            return 0;
+    }
+    return 1;
+}
+
+
+/** Commit a command buffer running count threads over a slot's buffers; INVALID_HANDLE on error */
+static inline CommandBufferHandle mtlStreamSubmit( CommandQueueHandle command_queue_handle, ComputePipelineStateHandle compute_pipeline_state_handle,
+                                                   const BufferHandle * buffers, uint32_t num_arrays, uint64_t count )
+{
+    mtlDispatch dispatch;
+    memset( &dispatch, 0, sizeof( dispatch ) );
+    dispatch.compute_pipeline_state = compute_pipeline_state_handle;
+    memcpy( dispatch.buffers, buffers, num_arrays * sizeof( BufferHandle ) );
+    dispatch.num_buffers = num_arrays;
+    dispatch.width = (uint32_t)count;
+    dispatch.height = 1;
+    dispatch.depth = 1;
+
+    CommandBufferHandle command_buffer = mtlNewCommandBuffer( command_queue_handle );
+    if ( command_buffer == INVALID_HANDLE )
+        return INVALID_HANDLE;
+    if ( mtlEncodeDispatches( command_buffer, &dispatch, 1 ) != MTL_SUCCESS || mtlCommitCommandBuffer( command_buffer ) != MTL_SUCCESS )
+    {
+        mtlFreeCommandBuffer( command_buffer );
+        return INVALID_HANDLE;
+    }
+    return command_buffer;
+}
+
+
+/** Wait for a chunk's command buffer and free it. Returns 0 if it failed. */
+static inline int mtlStreamComplete( CommandBufferHandle command_buffer )
+{
+    uint32_t status = MTL_COMMAND_BUFFER_ERROR;
+    int completed = mtlWaitForCompletion( command_buffer ) == MTL_SUCCESS &&
+                    mtlCommandBufferStatus( command_buffer, &status ) == MTL_SUCCESS &&
+                    status == MTL_COMMAND_BUFFER_COMPLETED;
+    mtlFreeCommandBuffer( command_buffer );
+    return completed;
+}
+
+
+/**
+ * Run mtlStreamKernel. Returns NULL on success, or the error message for the
+ * backend to store.
+ */
+static inline const char * mtlStreamRun( CommandQueueHandle command_queue_handle, ComputePipelineStateHandle compute_pipeline_state_handle,
+                                         const mtlStreamArray * arrays, uint32_t num_arrays, uint64_t num_threads, uint64_t memory_budget )
+{
+    if ( !arrays || num_arrays == 0 || num_arrays > MTL_DISPATCH_MAX_BUFFERS )
+        return "A stream needs 1 to MTL_DISPATCH_MAX_BUFFERS arrays.";
+    if ( num_threads == 0 )
+        return "A stream needs at least one thread.";
+
+    uint64_t bytes_per_thread = 0;
+    for ( uint32_t i = 0; i < num_arrays; i++ )
+    {
+        if ( mtlStreamIsResident( &arrays[ i ] ) )
+        {
+            if ( arrays[ i ].input || arrays[ i ].output )
+                return "A resident stream array cannot also have host data.";
+            continue;
+        }
+        if ( arrays[ i ].element_size == 0 || arrays[ i ].element_size > UINT64_MAX / num_threads )
+            return "Invalid stream array element size.";
+        bytes_per_thread += arrays[ i ].element_size;
+    }
+
+    DeviceHandle device = mtlCommandQueueDevice( command_queue_handle );
+    if ( device == INVALID_HANDLE )
+        return "Invalid command queue handle.";
+    if ( memory_budget == 0 )
+    {
+        mtlDeviceInfo info;
+        if ( mtlGetDeviceInfo( device, &info ) == MTL_SUCCESS )
+            memory_budget = info.recommendedMaxWorkingSetSize / 2;
+    }
+    uint64_t chunk = mtlStreamChunkThreads( bytes_per_thread, memory_budget, num_threads );
+    if ( chunk == 0 )
+    {
+        mtlFreeDevice( device );
+        return "The stream memory budget does not fit a chunk of one thread.";
+    }
+    uint64_t num_chunks = ( num_threads + chunk - 1 ) / chunk;
+    uint32_t num_slots = num_chunks < STREAM_SLOTS ? (uint32_t)num_chunks : STREAM_SLOTS;
+
+    const char * error = NULL;
+    BufferHandle buffers[ STREAM_SLOTS ][ MTL_DISPATCH_MAX_BUFFERS ];
+    CommandBufferHandle in_flight[ STREAM_SLOTS ];
+    for ( uint32_t slot = 0; slot < STREAM_SLOTS; slot++ )
+    {
+        in_flight[ slot ] = INVALID_HANDLE;
+        for ( uint32_t i = 0; i < num_arrays; i++ )
+        {
+            if ( mtlStreamIsResident( &arrays[ i ] ) )
+                buffers[ slot ][ i ] = arrays[ i ].buffer;
+            else if ( slot < num_slots )
+                buffers[ slot ][ i ] = mtlNewPooledBuffer( device, chunk * arrays[ i ].element_size );
+            else
+                buffers[ slot ][ i ] = INVALID_HANDLE;
+            if ( slot < num_slots && buffers[ slot ][ i ] == INVALID_HANDLE )
+                error = "Error creating the stream buffers.";
+        }
+    }
+
+    // Chunks are committed up to num_slots ahead, so while the host downloads chunk k
+    // and uploads chunk k + 2, the device is busy with chunks k + 1 and k + 2.
+    uint64_t next = 0;
+    for ( uint64_t k = 0; !error && k < num_chunks; k++ )
+    {
+        for ( ; next < num_chunks && next < k + num_slots; next++ )
+        {
+            uint32_t slot = (uint32_t)( next % STREAM_SLOTS );
+            uint64_t first = next * chunk;
+            uint64_t count = ( num_threads - first < chunk ) ? num_threads - first : chunk;
+            if ( !mtlStreamUpload( arrays, num_arrays, buffers[ slot ], first, count ) )
+                error = "Error copying a chunk to the stream buffers.";
+            else if ( ( in_flight[ slot ] = mtlStreamSubmit( command_queue_handle, compute_pipeline_state_handle, buffers[ slot ], num_arrays, count ) ) == INVALID_HANDLE )
+                error = "Error committing a chunk of the stream.";
+            if ( error )
+                break;
+        }
+        if ( error )
+            break;
+
+        uint32_t slot = (uint32_t)( k % STREAM_SLOTS );
+        uint64_t first = k * chunk;
+        uint64_t count = ( num_threads - first < chunk ) ? num_threads - first : chunk;
+        int completed = mtlStreamComplete( in_flight[ slot ] );
+        in_flight[ slot ] = INVALID_HANDLE;
+        if ( !completed )
+            error = "A chunk of the stream failed to run.";
+        else if ( !mtlStreamDownload( arrays, num_arrays, buffers[ slot ], first, count ) )
+            error = "Error copying a chunk from the stream buffers.";
+    }
+
+    // After an error, chunks still running hold the buffers until they finish.
+    for ( uint32_t slot = 0; slot < STREAM_SLOTS; slot++ )
+    {
+        if ( in_flight[ slot ] != INVALID_HANDLE )
+            mtlStreamComplete( in_flight[ slot ] );
+        for ( uint32_t i = 0; i < num_arrays; i++ )
+        {
+            if ( !mtlStreamIsResident( &arrays[ i ] ) && buffers[ slot ][ i ] != INVALID_HANDLE )
+                mtlFreeBuffer( buffers[ slot ][ i ] );
+        }
+    }
+    mtlFreeDevice( device );
+    return error;
+}
+
+
+/** Run mtlStreamKernelInOut: the input at buffer(0), the output at buffer(1), then the resident buffers */
+static inline const char * mtlStreamRunInOut( CommandQueueHandle command_queue_handle, ComputePipelineStateHandle compute_pipeline_state_handle,
+                                              const void * input, uint64_t input_element_size, void * output, uint64_t output_element_size,
+                                              const BufferHandle * resident_handles, uint32_t num_resident, uint64_t num_threads, uint64_t memory_budget )
+{
+    if ( num_resident > MTL_DISPATCH_MAX_BUFFERS - 2 || ( num_resident > 0 && !resident_handles ) )
+        return "Too many resident stream buffers.";
+    if ( !input || !output )
+        return "A stream needs input and output data.";
+
+    mtlStreamArray arrays[ MTL_DISPATCH_MAX_BUFFERS ];
+    memset( arrays, 0, sizeof( arrays ) );
+    arrays[ 0 ].input = input;
+    arrays[ 0 ].element_size = input_element_size;
+    arrays[ 1 ].output = output;
+    arrays[ 1 ].element_size = output_element_size;
+    for ( uint32_t i = 0; i < num_resident; i++ )
+    {
+        if ( resident_handles[ i ] == INVALID_HANDLE )
+            return "Invalid resident stream buffer handle.";
+        arrays[ 2 + i ].buffer = resident_handles[ i ];
+    }
+    return mtlStreamRun( command_queue_handle, compute_pipeline_state_handle, arrays, 2 + num_resident, num_threads, memory_budget );
+}
+
+
+#endif /* Streaming_h */
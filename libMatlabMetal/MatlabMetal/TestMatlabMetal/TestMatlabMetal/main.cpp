@@ -4,35 +4,2116 @@
 //
 
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
 #include "MatlabMetal.h"
 
 using namespace std;
 
+#ifndef __APPLE__
+// Host implementation of the scale kernel used by testSetBytes
+void hostScale( const mtlHostKernelArgs * args, uint64_t first_thread, uint64_t last_thread )
+{
+    float * v = (float *)args->buffers[0];
+    const float factor = *(const float *)args->buffers[1];
+    for (uint64_t id = first_thread; id < last_thread; id++)
+        v[id] *= factor;
+}
+
+// Host implementations of the kernels used by testIndirectDispatch
+void hostIndirectArguments( const mtlHostKernelArgs * args, uint64_t first_thread, uint64_t last_thread )
+{
+    const uint32_t count = *(const uint32_t *)args->buffers[0];
+    mtlDispatchIndirectArguments * arguments = (mtlDispatchIndirectArguments *)( (uint8_t *)args->buffers[1] + 16 );
+    arguments->threadgroups[0] = ( count + 63 ) / 64;
+    arguments->threadgroups[1] = 1;
+    arguments->threadgroups[2] = 1;
+}
+
+void hostDoubleFirst( const mtlHostKernelArgs * args, uint64_t first_thread, uint64_t last_thread )
+{
+    float * v = (float *)args->buffers[0];
+    const uint32_t count = *(const uint32_t *)args->buffers[1];
+    for (uint64_t id = first_thread; id < last_thread && id < count; id++)
+        v[id] *= 2.0f;
+}
+
+// Host kernel used by testThreadgroupSizes: each thread stores the number of threads of its call
+void hostCallSize( const mtlHostKernelArgs * args, uint64_t first_thread, uint64_t last_thread )
+{
+    uint32_t * sizes = (uint32_t *)args->buffers[0];
+    for (uint64_t id = first_thread; id < last_thread; id++)
+        sizes[id] = (uint32_t)( last_thread - first_thread );
+}
+#endif
+
 inline const char * const BoolToString(bool b)
 {
-  return b ? "TRUE" : "FALSE";
+  return b ? "TRUE" : "FALSE";
+}
+
+
+void printDevice( mtlDeviceInfo deviceStruct)
+{
+    cout << " Name:        " << deviceStruct.name << endl;
+    cout << " WorkSize:    " << deviceStruct.recommendedMaxWorkingSetSize << endl;
+    cout << " Registry ID: " << deviceStruct.RegistryID << endl;
+    cout << " Low Power:   " << BoolToString( deviceStruct.IsLowPower ) << endl;
+    cout << " Headless:    " << BoolToString( deviceStruct.IsHeadless ) << endl;
+    cout << " Compute:     " << deviceStruct.ComputeUnits << endl;
+    cout << " NUMA node:   " << deviceStruct.NumaNode << endl;
+}
+
+
+void printDevices( mtlDeviceInfo * devices, int numDevices)
+{
+    for (int i = 0; i < numDevices; i++)
+    {
+        cout << "[Device " << i << "]" << endl;
+        printDevice( devices[i] );
+        cout << endl;
+    }
+}
+
+
+// Create, look up and free buffers from several threads at once
+void testConcurrentHandles( DeviceHandle device )
+{
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+    {
+        threads.emplace_back( [device, t]() {
+            for (int i = 0; i < 1000; i++)
+            {
+                uint64_t bytes = 16 * ( t + 1 );
+                BufferHandle buffer = mtlNewBuffer( device, bytes );
+                assert( buffer != INVALID_HANDLE );
+                assert( mtlBufferSize( buffer ) == bytes );
+                mtlFreeBuffer( buffer );
+                assert( mtlBufferSize( buffer ) == 0 );
+            }
+        } );
+    }
+    for (auto & thread : threads)
+        thread.join();
+}
+
+
+// Partial transfers: byte ranges and strided sub-blocks of a column-major volume
+void testRegions( DeviceHandle device )
+{
+    const uint64_t dims[3] = { 1000, 1000, 3 };
+    const uint64_t count = dims[0] * dims[1] * dims[2];
+    std::vector<float> volume( count );
+    for (uint64_t i = 0; i < count; i++)
+        volume[i] = (float)i;
+    
+    BufferHandle buffer = mtlNewBuffer( device, count * sizeof(float) );
+    assert( buffer != INVALID_HANDLE );
+    assert( mtlCopyDataToBuffer( buffer, volume.data(), count * sizeof(float) ) == MTL_SUCCESS );
+    
+    // Byte ranges
+    float value = 0.0f;
+    assert( mtlCopyDataFromBufferRange( buffer, 7 * sizeof(float), &value, sizeof(float) ) == MTL_SUCCESS );
+    assert( value == 7.0f );
+    value = -7.0f;
+    assert( mtlCopyDataToBufferRange( buffer, 7 * sizeof(float), &value, sizeof(float) ) == MTL_SUCCESS );
+    assert( mtlCopyDataToBufferRange( buffer, count * sizeof(float), &value, sizeof(float) ) == MTL_ERROR );
+    volume[7] = -7.0f;
+    
+    // Read a strided sub-block, large enough to be split across workers
+    const uint64_t origin[3] = { 1, 0, 0 };
+    const uint64_t region[3] = { 999, 1000, 3 };
+    std::vector<float> block( region[0] * region[1] * region[2] );
+    assert( mtlCopyRegionFromBuffer( buffer, dims, origin, region, sizeof(float), block.data() ) == MTL_SUCCESS );
+    for (uint64_t k = 0, n = 0; k < region[2]; k++)
+        for (uint64_t j = 0; j < region[1]; j++)
+            for (uint64_t i = 0; i < region[0]; i++, n++)
+                assert( block[n] == volume[ ( i + origin[0] ) + dims[0] * ( ( j + origin[1] ) + dims[1] * ( k + origin[2] ) ) ] );
+    
+    // Write a small block and one whole plane
+    const uint64_t small_origin[3] = { 10, 20, 1 };
+    const uint64_t small_region[3] = { 3, 4, 2 };
+    std::vector<float> small( 24, -1.0f );
+    assert( mtlCopyRegionToBuffer( buffer, dims, small_origin, small_region, sizeof(float), small.data() ) == MTL_SUCCESS );
+    const uint64_t plane_origin[3] = { 0, 0, 0 };
+    const uint64_t plane_region[3] = { 1000, 1000, 1 };
+    std::vector<float> plane( dims[0] * dims[1], -2.0f );
+    assert( mtlCopyRegionToBuffer( buffer, dims, plane_origin, plane_region, sizeof(float), plane.data() ) == MTL_SUCCESS );
+    for (uint64_t k = 0; k < small_region[2]; k++)
+        for (uint64_t j = 0; j < small_region[1]; j++)
+            for (uint64_t i = 0; i < small_region[0]; i++)
+                volume[ ( i + small_origin[0] ) + dims[0] * ( ( j + small_origin[1] ) + dims[1] * ( k + small_origin[2] ) ) ] = -1.0f;
+    std::fill( volume.begin(), volume.begin() + dims[0] * dims[1], -2.0f );
+    
+    std::vector<float> result( count );
+    assert( mtlCopyDataFromBuffer( buffer, result.data(), count * sizeof(float) ) == MTL_SUCCESS );
+    assert( result == volume );
+    
+    // Regions outside the array, and arrays larger than the buffer, are rejected
+    const uint64_t bad_region[3] = { 2, 1, 1 };
+    const uint64_t last_origin[3] = { 999, 0, 0 };
+    assert( mtlCopyRegionToBuffer( buffer, dims, last_origin, bad_region, sizeof(float), small.data() ) == MTL_ERROR );
+    const uint64_t big_dims[3] = { 1000, 1000, 4 };
+    assert( mtlCopyRegionToBuffer( buffer, big_dims, origin, bad_region, sizeof(float), small.data() ) == MTL_ERROR );
+    
+    mtlFreeBuffer( buffer );
+}
+
+
+void countCompletion( CommandBufferHandle command_buffer_handle, uint32_t status, void * user_data )
+{
+    assert( status == MTL_COMMAND_BUFFER_COMPLETED );
+    ( *(std::atomic<int> *)user_data )++;
+}
+
+
+// Several command buffers in flight at once, tracked by status, handlers and waits
+void testAsyncCommandBuffers( DeviceHandle device, CommandQueueHandle command_queue, ComputePipelineStateHandle compute_pipeline_state )
+{
+    const int num_command_buffers = 3;
+    const uint32_t num_elements = 1 << 20;
+    std::vector<float> input( num_elements, 3.0f );
+    std::atomic<int> completions( 0 );
+    
+    CommandBufferHandle command_buffers[ num_command_buffers ];
+    BufferHandle buffers[ num_command_buffers ][ 2 ];
+    for (int i = 0; i < num_command_buffers; i++)
+    {
+        buffers[i][0] = mtlNewBuffer( device, num_elements * sizeof(float) );
+        buffers[i][1] = mtlNewBuffer( device, num_elements * sizeof(float) );
+        mtlCopyDataToBuffer( buffers[i][0], input.data(), num_elements * sizeof(float) );
+        
+        command_buffers[i] = mtlNewCommandBuffer( command_queue );
+        CommandEncoderHandle command_encoder = mtlNewCommandEncoder( command_buffers[i] );
+        assert( mtlSetComputePipelineState( command_encoder, compute_pipeline_state ) == MTL_SUCCESS );
+        assert( mtlSetBuffer( command_encoder, buffers[i][0], 0 ) == MTL_SUCCESS );
+        assert( mtlSetBuffer( command_encoder, buffers[i][1], 1 ) == MTL_SUCCESS );
+        assert( mtlSetThreadsAndShape( command_encoder, compute_pipeline_state, num_elements, 1, 1 ) == MTL_SUCCESS );
+        assert( mtlEndEncoding( command_encoder ) == MTL_SUCCESS );
+        mtlFreeCommandEncoder( command_encoder );
+        
+        uint32_t status = MTL_COMMAND_BUFFER_ERROR;
+        assert( mtlCommandBufferStatus( command_buffers[i], &status ) == MTL_SUCCESS );
+        assert( status == MTL_COMMAND_BUFFER_NOT_ENQUEUED );
+        assert( mtlAddCompletedHandler( command_buffers[i], countCompletion, &completions ) == MTL_SUCCESS );
+    }
+    
+    // Waiting on a command buffer that was never committed is an error
+    uint32_t index = 0;
+    assert( mtlWaitAnyCommandBuffer( command_buffers, num_command_buffers, &index ) == MTL_ERROR );
+    
+    for (int i = 0; i < num_command_buffers; i++)
+        assert( mtlCommitCommandBuffer( command_buffers[i] ) == MTL_SUCCESS );
+    assert( mtlAddCompletedHandler( command_buffers[0], countCompletion, &completions ) == MTL_ERROR );
+    
+    assert( mtlWaitAnyCommandBuffer( command_buffers, num_command_buffers, &index ) == MTL_SUCCESS );
+    assert( index < num_command_buffers );
+    uint32_t status = MTL_COMMAND_BUFFER_ERROR;
+    assert( mtlCommandBufferStatus( command_buffers[index], &status ) == MTL_SUCCESS );
+    assert( status == MTL_COMMAND_BUFFER_COMPLETED );
+    
+    assert( mtlWaitAllCommandBuffers( command_buffers, num_command_buffers ) == MTL_SUCCESS );
+    assert( completions == num_command_buffers );
+    
+    std::vector<float> output( num_elements );
+    for (int i = 0; i < num_command_buffers; i++)
+    {
+        assert( mtlCopyDataFromBuffer( buffers[i][1], output.data(), num_elements * sizeof(float) ) == MTL_SUCCESS );
+        assert( output[0] == 9.0f && output[num_elements - 1] == 9.0f );
+        mtlFreeBuffer( buffers[i][0] );
+        mtlFreeBuffer( buffers[i][1] );
+        mtlFreeCommandBuffer( command_buffers[i] );
+    }
+}
+
+
+void testLibraryCache( DeviceHandle device, const char * source )
+{
+    mtlLibraryCacheStats stats;
+    mtlClearLibraryCache();
+    
+    // Only the first of several identical requests compiles
+    LibraryHandle first = mtlNewLibrary( device, source );
+    LibraryHandle second = mtlNewLibrary( device, source );
+    assert( first != INVALID_HANDLE && second != INVALID_HANDLE && first != second );
+    mtlGetLibraryCacheStats( &stats );
+    assert( stats.misses == 1 && stats.memory_hits == 1 && stats.entries == 1 );
+    
+    // Compile options are part of the key
+    LibraryHandle precise = mtlNewLibraryWithOptions( device, source, 0 );
+    assert( precise != INVALID_HANDLE );
+    mtlGetLibraryCacheStats( &stats );
+    assert( stats.misses == 2 && stats.entries == 2 );
+    LibraryHandle invalid = mtlNewLibraryWithOptions( device, source, 0x80 );
+    assert( invalid == INVALID_HANDLE );
+    
+    // Freeing a handle leaves the cached library usable through the other one
+    mtlFreeLibrary( first );
+    FunctionHandle function = mtlNewFunction( second, "sqr" );
+    assert( function != INVALID_HANDLE );
+    mtlFreeFunction( function );
+    
+    // A cleared cache is refilled from the artifacts left on disk
+    char directory[] = "/tmp/MatlabMetalLibraryCacheXXXXXX";
+    char * created = mkdtemp( directory );
+    assert( created != nullptr );
+    std::string cache_directory = std::string( directory ) + "/nested";
+    uint32_t result = mtlSetLibraryCacheDirectory( cache_directory.c_str() );
+    assert( result == MTL_SUCCESS );
+    mtlClearLibraryCache();
+    LibraryHandle stored = mtlNewLibrary( device, source );
+    mtlClearLibraryCache();
+    LibraryHandle loaded = mtlNewLibrary( device, source );
+    assert( stored != INVALID_HANDLE && loaded != INVALID_HANDLE );
+    mtlGetLibraryCacheStats( &stats );
+    assert( stats.misses + stats.disk_hits == 1 );
+#ifndef __APPLE__
+    assert( stats.disk_hits == 1 );
+#endif
+    result = mtlSetLibraryCacheDirectory( nullptr );
+    assert( result == MTL_SUCCESS );
+    std::string remove_directory = std::string( "rm -rf " ) + directory;
+    int removed = system( remove_directory.c_str() );
+    assert( removed == 0 );
+    
+    mtlFreeLibrary( second );
+    mtlFreeLibrary( precise );
+    mtlFreeLibrary( stored );
+    mtlFreeLibrary( loaded );
+}
+
+
+void testPipelineStateCache( DeviceHandle device, LibraryHandle library )
+{
+    ComputePipelineStateHandle first = mtlComputePipelineStateForFunction( library, "sqr" );
+    ComputePipelineStateHandle second = mtlComputePipelineStateForFunction( library, "sqr" );
+    assert( first != INVALID_HANDLE && second != INVALID_HANDLE && first != second );
+    assert( mtlThreadExecutionWidth( second ) > 0 );
+    
+    DeviceHandle pipeline_device = mtlComputePipelineStateDevice( first );
+    assert( mtlSameDevice( device, pipeline_device ) );
+    mtlFreeDevice( pipeline_device );
+    
+    // Freeing one handle leaves the cached pipeline state for the next lookup
+    mtlFreeComputePipelineState( first );
+    ComputePipelineStateHandle third = mtlComputePipelineStateForFunction( library, "sqr" );
+    assert( third != INVALID_HANDLE );
+    
+    ComputePipelineStateHandle missing = mtlComputePipelineStateForFunction( library, "nonexist" );
+    assert( missing == INVALID_HANDLE );
+    
+    mtlFreeComputePipelineState( second );
+    mtlFreeComputePipelineState( third );
+}
+
+
+void testBufferPool( DeviceHandle device )
+{
+    mtlBufferPoolStats before, stats;
+    uint32_t result = mtlGetBufferPoolStats( device, &before );
+    assert( result == MTL_SUCCESS );
+    
+    // Same-sized temporaries reuse the storage of the previous one
+    const uint64_t bytes = 3 * 1000 * 1000;
+    BufferHandle first = mtlNewPooledBuffer( device, bytes );
+    assert( first != INVALID_HANDLE );
+    assert( mtlBufferSize( first ) == bytes );
+    mtlFreeBuffer( first );
+    int64_t steady_allocation = mtlGetDeviceAllocatedMemory( device );
+    for ( int i = 0; i < 10; i++ )
+    {
+        BufferHandle temporary = mtlNewPooledBuffer( device, bytes );
+        assert( temporary != INVALID_HANDLE );
+        std::vector<uint8_t> data( bytes, (uint8_t)i );
+        result = mtlCopyDataToBuffer( temporary, data.data(), bytes );
+        assert( result == MTL_SUCCESS );
+        mtlFreeBuffer( temporary );
+        assert( mtlGetDeviceAllocatedMemory( device ) == steady_allocation );
+    }
+    mtlGetBufferPoolStats( device, &stats );
+    assert( stats.misses - before.misses == 1 && stats.hits - before.hits == 10 );
+    assert( stats.in_use_bytes == before.in_use_bytes );
+    assert( stats.reserved_bytes > before.reserved_bytes );
+    
+    // Storage held by a live buffer is not handed out twice
+    BufferHandle held = mtlNewPooledBuffer( device, bytes );
+    BufferHandle other = mtlNewPooledBuffer( device, bytes );
+    assert( held != INVALID_HANDLE && other != INVALID_HANDLE );
+    assert( mtlMapBuffer( held, MTL_MAP_WRITE ) != mtlMapBuffer( other, MTL_MAP_WRITE ) );
+    mtlUnmapBuffer( held, 0, 0 );
+    mtlUnmapBuffer( other, 0, 0 );
+    mtlFreeBuffer( held );
+    mtlFreeBuffer( other );
+    
+    // Trimming releases the idle storage
+    result = mtlTrimBufferPool( device, 0 );
+    assert( result == MTL_SUCCESS );
+    mtlGetBufferPoolStats( device, &stats );
+    assert( stats.reserved_bytes == stats.in_use_bytes );
+    assert( mtlGetDeviceAllocatedMemory( device ) < steady_allocation );
+    
+    assert( mtlNewPooledBuffer( INVALID_HANDLE, bytes ) == INVALID_HANDLE );
+    result = mtlTrimBufferPool( INVALID_HANDLE, 0 );
+    assert( result == MTL_ERROR );
+}
+
+
+void testDispatchBatch( DeviceHandle device, CommandQueueHandle command_queue, ComputePipelineStateHandle compute_pipeline_state )
+{
+    const uint32_t count = 10000;
+    std::vector<float> input( count ), output( count );
+    for ( uint32_t i = 0; i < count; i++ )
+        input[ i ] = 1.0f + (float)( i % 7 ) / 8.0f;
+    
+    BufferHandle buffers[5];
+    for ( int i = 0; i < 5; i++ )
+        buffers[i] = mtlNewBuffer( device, count * sizeof( float ) );
+    mtlCopyDataToBuffer( buffers[0], input.data(), count * sizeof( float ) );
+    mtlCopyDataToBuffer( buffers[3], input.data(), count * sizeof( float ) );
+    
+    // 0 -> 1 -> 2 is a chain; 3 -> 4 is independent of it
+    mtlDispatch dispatches[3] = {};
+    const int bindings[3][2] = { { 0, 1 }, { 3, 4 }, { 1, 2 } };
+    for ( int d = 0; d < 3; d++ )
+    {
+        dispatches[d].compute_pipeline_state = compute_pipeline_state;
+        dispatches[d].buffers[0] = buffers[ bindings[d][0] ];
+        dispatches[d].buffers[1] = buffers[ bindings[d][1] ];
+        dispatches[d].num_buffers = 2;
+        dispatches[d].width = count;
+        dispatches[d].height = 1;
+        dispatches[d].depth = 1;
+    }
+    CommandBufferHandle command_buffer = mtlSubmitDispatches( command_queue, dispatches, 3 );
+    assert( command_buffer != INVALID_HANDLE );
+    uint32_t result = mtlWaitForCompletion( command_buffer );
+    assert( result == MTL_SUCCESS );
+    mtlFreeCommandBuffer( command_buffer );
+    
+    mtlCopyDataFromBuffer( buffers[2], output.data(), count * sizeof( float ) );
+    for ( uint32_t i = 0; i < count; i++ )
+        assert( output[ i ] == ( input[ i ] * input[ i ] ) * ( input[ i ] * input[ i ] ) );
+    mtlCopyDataFromBuffer( buffers[4], output.data(), count * sizeof( float ) );
+    for ( uint32_t i = 0; i < count; i++ )
+        assert( output[ i ] == input[ i ] * input[ i ] );
+    
+    // A bad entry rejects the whole batch before anything is encoded
+    command_buffer = mtlNewCommandBuffer( command_queue );
+    dispatches[2].buffers[1] = buffers[0] + 1000;
+    result = mtlEncodeDispatches( command_buffer, dispatches, 3 );
+    assert( result == MTL_ERROR );
+    dispatches[2].buffers[1] = buffers[2];
+    dispatches[2].num_buffers = MTL_DISPATCH_MAX_BUFFERS + 1;
+    result = mtlEncodeDispatches( command_buffer, dispatches, 3 );
+    assert( result == MTL_ERROR );
+    result = mtlEncodeDispatches( command_buffer, dispatches, 0 );
+    assert( result == MTL_ERROR );
+    mtlFreeCommandBuffer( command_buffer );
+    
+    for ( int i = 0; i < 5; i++ )
+        mtlFreeBuffer( buffers[i] );
+}
+
+
+void testThreadgroupSizes( DeviceHandle device, CommandQueueHandle command_queue, ComputePipelineStateHandle compute_pipeline_state )
+{
+    uint32_t max_threads = mtlMaxTotalThreadsPerThreadgroup( compute_pipeline_state );
+    assert( max_threads >= mtlThreadExecutionWidth( compute_pipeline_state ) );
+    assert( mtlMaxTotalThreadsPerThreadgroup( INVALID_HANDLE ) == 0 );
+    
+    const uint32_t width = 300, height = 70;
+    const uint32_t count = width * height;
+    std::vector<float> input( count ), output( count );
+    for ( uint32_t i = 0; i < count; i++ )
+        input[ i ] = (float)( i % 101 ) - 50.0f;
+    BufferHandle source = mtlNewBuffer( device, count * sizeof( float ) );
+    BufferHandle target = mtlNewBuffer( device, count * sizeof( float ) );
+    mtlCopyDataToBuffer( source, input.data(), count * sizeof( float ) );
+    
+    // An explicit two-dimensional threadgroup that does not divide the grid
+    CommandBufferHandle command_buffer = mtlNewCommandBuffer( command_queue );
+    CommandEncoderHandle command_encoder = mtlNewCommandEncoder( command_buffer );
+    mtlSetComputePipelineState( command_encoder, compute_pipeline_state );
+    mtlSetBuffer( command_encoder, source, 0 );
+    mtlSetBuffer( command_encoder, target, 1 );
+    const uint32_t too_large[3] = { max_threads, 2, 1 };
+    uint32_t result = mtlSetThreadsAndThreadgroupShape( command_encoder, compute_pipeline_state, width, height, 1, too_large );
+    assert( result == MTL_ERROR );
+    const uint32_t empty[3] = { 32, 0, 1 };
+    result = mtlSetThreadsAndThreadgroupShape( command_encoder, compute_pipeline_state, width, height, 1, empty );
+    assert( result == MTL_ERROR );
+    const uint32_t group[3] = { 32, 7, 1 };
+    result = mtlSetThreadsAndThreadgroupShape( command_encoder, compute_pipeline_state, width, height, 1, group );
+    assert( result == MTL_SUCCESS );
+    mtlEndEncoding( command_encoder );
+    mtlCommitCommandBuffer( command_buffer );
+    result = mtlWaitForCompletion( command_buffer );
+    assert( result == MTL_SUCCESS );
+    mtlFreeCommandEncoder( command_encoder );
+    mtlFreeCommandBuffer( command_buffer );
+    mtlCopyDataFromBuffer( target, output.data(), count * sizeof( float ) );
+    for ( uint32_t i = 0; i < count; i++ )
+        assert( output[ i ] == input[ i ] * input[ i ] );
+    
+#ifndef __APPLE__
+    // On Linux the kernel is called once per threadgroup, whatever the chunks of threads it is scheduled in
+    result = mtlRegisterHostKernel( "call_size", hostCallSize );
+    assert( result == MTL_SUCCESS );
+    LibraryHandle library = mtlNewLibrary( device, "kernel void call_size( device uint *sizes [[ buffer(0) ]] ) {}" );
+    ComputePipelineStateHandle call_size = mtlComputePipelineStateForFunction( library, "call_size" );
+    assert( call_size != INVALID_HANDLE );
+    mtlDispatch sized = {};
+    sized.compute_pipeline_state = call_size;
+    sized.buffers[0] = target;
+    sized.num_buffers = 1;
+    sized.width = width;
+    sized.height = height;
+    sized.depth = 1;
+    sized.group_width = group[0];
+    sized.group_height = group[1];
+    sized.group_depth = group[2];
+    command_buffer = mtlSubmitDispatches( command_queue, &sized, 1 );
+    assert( command_buffer != INVALID_HANDLE );
+    mtlWaitForCompletion( command_buffer );
+    mtlFreeCommandBuffer( command_buffer );
+    std::vector<uint32_t> sizes( count );
+    mtlCopyDataFromBuffer( target, sizes.data(), count * sizeof( uint32_t ) );
+    const uint32_t group_threads = group[0] * group[1] * group[2];
+    for ( uint32_t i = 0; i < count; i++ )
+        assert( sizes[ i ] == std::min( group_threads, count - i / group_threads * group_threads ) );
+    mtlFreeComputePipelineState( call_size );
+    mtlFreeLibrary( library );
+#endif
+    
+    // Autotuning reports a valid size, which later automatic dispatches of the grid use
+    mtlDispatch dispatch = {};
+    dispatch.compute_pipeline_state = compute_pipeline_state;
+    dispatch.buffers[0] = source;
+    dispatch.buffers[1] = target;
+    dispatch.num_buffers = 2;
+    dispatch.width = width;
+    dispatch.height = height;
+    dispatch.depth = 1;
+    uint32_t tuned[3] = { 0, 0, 0 };
+    result = mtlAutotuneThreadgroupSize( command_queue, &dispatch, 3, tuned );
+    assert( result == MTL_SUCCESS );
+    assert( tuned[0] > 0 && tuned[1] > 0 && tuned[2] > 0 );
+    assert( (uint64_t)tuned[0] * tuned[1] * tuned[2] <= max_threads );
+    assert( tuned[0] <= width && tuned[1] <= height && tuned[2] == 1 );
+    result = mtlAutotuneThreadgroupSize( INVALID_HANDLE, &dispatch, 3, tuned );
+    assert( result == MTL_ERROR );
+    
+    std::vector<float> zeros( count, 0.0f );
+    mtlCopyDataToBuffer( target, zeros.data(), count * sizeof( float ) );
+    CommandBufferHandle submitted = mtlSubmitDispatches( command_queue, &dispatch, 1 );
+    assert( submitted != INVALID_HANDLE );
+    result = mtlWaitForCompletion( submitted );
+    assert( result == MTL_SUCCESS );
+    mtlFreeCommandBuffer( submitted );
+    mtlCopyDataFromBuffer( target, output.data(), count * sizeof( float ) );
+    for ( uint32_t i = 0; i < count; i++ )
+        assert( output[ i ] == input[ i ] * input[ i ] );
+    
+    // An explicit size in a batch entry is checked like any other
+    dispatch.group_width = max_threads;
+    dispatch.group_height = 2;
+    dispatch.group_depth = 1;
+    command_buffer = mtlNewCommandBuffer( command_queue );
+    result = mtlEncodeDispatches( command_buffer, &dispatch, 1 );
+    assert( result == MTL_ERROR );
+    mtlFreeCommandBuffer( command_buffer );
+    
+    mtlFreeBuffer( source );
+    mtlFreeBuffer( target );
+}
+
+
+void testLibraryKernels( DeviceHandle device, CommandQueueHandle command_queue )
+{
+    // The kernels of MetalFunctionLibrary.mtl; built in on the CPU backend
+    const char source[] = R"""(
+        #include <metal_stdlib>
+        using namespace metal;
+
+        kernel void zerobuff( device float *buffer [[ buffer(0) ]], uint index[[ thread_position_in_grid ]] )
+        {
+            buffer[index] = 0.0f;
+        }
+
+        kernel void accumulate( device float *vA [[ buffer(0) ]], constant float *vB [[ buffer(1) ]], uint id[[ thread_position_in_grid ]] )
+        {
+            vA[id] += vB[id];
+        }
+
+        kernel void maxval( device float *vA [[ buffer(0) ]], constant float *vB [[ buffer(1) ]], uint id[[ thread_position_in_grid ]] )
+        {
+            vA[id] = max( vA[id], vB[id] );
+        }
+
+        kernel void scaleaccum( device float *vA [[ buffer(0) ]], constant float *vB [[ buffer(1) ]],
+                                constant float *scaleval[[ buffer(2) ]], uint id[[ thread_position_in_grid ]] )
+        {
+            vA[id] += vB[id] * scaleval[0];
+        }
+    )""";
+    LibraryHandle library = mtlNewLibrary( device, source );
+    assert( library != INVALID_HANDLE );
+    ComputePipelineStateHandle zerobuff = mtlComputePipelineStateForFunction( library, "zerobuff" );
+    ComputePipelineStateHandle accumulate = mtlComputePipelineStateForFunction( library, "accumulate" );
+    ComputePipelineStateHandle maxval = mtlComputePipelineStateForFunction( library, "maxval" );
+    ComputePipelineStateHandle scaleaccum = mtlComputePipelineStateForFunction( library, "scaleaccum" );
+    assert( zerobuff != INVALID_HANDLE && accumulate != INVALID_HANDLE && maxval != INVALID_HANDLE && scaleaccum != INVALID_HANDLE );
+    
+    // An odd length, so every vector width leaves a tail
+    const uint32_t count = 1000003;
+    const uint64_t bytes = count * sizeof( float );
+    std::vector<float> a( count ), b( count ), output( count );
+    for ( uint32_t i = 0; i < count; i++ )
+    {
+        a[ i ] = (float)( i % 97 ) * 0.25f - 10.0f;
+        b[ i ] = (float)( i % 89 ) * 0.5f - 20.0f;
+    }
+    BufferHandle buffer_a = mtlNewBuffer( device, bytes );
+    BufferHandle buffer_b = mtlNewBuffer( device, bytes );
+    BufferHandle buffer_scale = mtlNewBuffer( device, sizeof( float ) );
+    const float scale = 0.75f;
+    mtlCopyDataToBuffer( buffer_a, a.data(), bytes );
+    mtlCopyDataToBuffer( buffer_b, b.data(), bytes );
+    mtlCopyDataToBuffer( buffer_scale, &scale, sizeof( float ) );
+    
+    // a = max( a, b ); a += b; a += b * scale
+    mtlDispatch dispatches[3] = {};
+    ComputePipelineStateHandle chain[3] = { maxval, accumulate, scaleaccum };
+    for ( int d = 0; d < 3; d++ )
+    {
+        dispatches[d].compute_pipeline_state = chain[d];
+        dispatches[d].buffers[0] = buffer_a;
+        dispatches[d].buffers[1] = buffer_b;
+        dispatches[d].buffers[2] = buffer_scale;
+        dispatches[d].num_buffers = 3;
+        dispatches[d].width = count;
+        dispatches[d].height = 1;
+        dispatches[d].depth = 1;
+    }
+    CommandBufferHandle command_buffer = mtlSubmitDispatches( command_queue, dispatches, 3 );
+    assert( command_buffer != INVALID_HANDLE );
+    uint32_t result = mtlWaitForCompletion( command_buffer );
+    assert( result == MTL_SUCCESS );
+    mtlFreeCommandBuffer( command_buffer );
+    mtlCopyDataFromBuffer( buffer_a, output.data(), bytes );
+    for ( uint32_t i = 0; i < count; i++ )
+    {
+        float expected = std::max( a[ i ], b[ i ] ) + b[ i ];
+        expected += b[ i ] * scale;
+        assert( fabsf( output[ i ] - expected ) <= 1e-5f * fabsf( expected ) + 1e-6f );
+    }
+    
+#ifndef __APPLE__
+    // maxval keeps the number when one side is NaN, as fmax does
+    a[0] = NAN;
+    b[1] = NAN;
+    mtlCopyDataToBuffer( buffer_a, a.data(), bytes );
+    mtlCopyDataToBuffer( buffer_b, b.data(), bytes );
+    command_buffer = mtlSubmitDispatches( command_queue, dispatches, 1 );
+    result = mtlWaitForCompletion( command_buffer );
+    assert( result == MTL_SUCCESS );
+    mtlFreeCommandBuffer( command_buffer );
+    mtlCopyDataFromBuffer( buffer_a, output.data(), bytes );
+    assert( output[0] == b[0] && output[1] == a[1] );
+    for ( uint32_t i = 2; i < count; i++ )
+        assert( output[ i ] == std::max( a[ i ], b[ i ] ) );
+#endif
+    
+    dispatches[0].compute_pipeline_state = zerobuff;
+    command_buffer = mtlSubmitDispatches( command_queue, dispatches, 1 );
+    result = mtlWaitForCompletion( command_buffer );
+    assert( result == MTL_SUCCESS );
+    mtlFreeCommandBuffer( command_buffer );
+    mtlCopyDataFromBuffer( buffer_a, output.data(), bytes );
+    for ( uint32_t i = 0; i < count; i++ )
+        assert( output[ i ] == 0.0f );
+    
+    mtlFreeBuffer( buffer_a );
+    mtlFreeBuffer( buffer_b );
+    mtlFreeBuffer( buffer_scale );
+    mtlFreeComputePipelineState( zerobuff );
+    mtlFreeComputePipelineState( accumulate );
+    mtlFreeComputePipelineState( maxval );
+    mtlFreeComputePipelineState( scaleaccum );
+    mtlFreeLibrary( library );
+}
+
+
+void testSetBytes( DeviceHandle device, CommandQueueHandle command_queue )
+{
+    const char source[] = R"""(
+        #include <metal_stdlib>
+        using namespace metal;
+
+        kernel void scale(
+            device float *v [[ buffer(0) ]],
+            constant float &factor [[ buffer(1) ]],
+            uint id[[ thread_position_in_grid ]])
+        {
+            v[id] *= factor;
+        }
+    )""";
+#ifndef __APPLE__
+    uint32_t result = mtlRegisterHostKernel( "scale", hostScale );
+    assert( result == MTL_SUCCESS );
+#else
+    uint32_t result;
+#endif
+    LibraryHandle library = mtlNewLibrary( device, source );
+    assert( library != INVALID_HANDLE );
+    ComputePipelineStateHandle scale = mtlComputePipelineStateForFunction( library, "scale" );
+    assert( scale != INVALID_HANDLE );
+    
+    const uint32_t count = 1000;
+    std::vector<float> data( count, 2.0f );
+    BufferHandle buffer = mtlNewBuffer( device, count * sizeof( float ) );
+    mtlCopyDataToBuffer( buffer, data.data(), count * sizeof( float ) );
+    
+    // Two dispatches with different factors; each keeps the value it was given
+    CommandBufferHandle command_buffer = mtlNewCommandBuffer( command_queue );
+    float factor = 3.0f;
+    for ( int pass = 0; pass < 2; pass++ )
+    {
+        CommandEncoderHandle command_encoder = mtlNewCommandEncoder( command_buffer );
+        result = mtlSetComputePipelineState( command_encoder, scale );
+        assert( result == MTL_SUCCESS );
+        result = mtlSetBuffer( command_encoder, buffer, 0 );
+        assert( result == MTL_SUCCESS );
+        result = mtlSetBytes( command_encoder, &factor, sizeof( factor ), 1 );
+        assert( result == MTL_SUCCESS );
+        factor = 0.5f;
+        result = mtlSetThreadsAndShape( command_encoder, scale, count, 1, 1 );
+        assert( result == MTL_SUCCESS );
+        result = mtlEndEncoding( command_encoder );
+        assert( result == MTL_SUCCESS );
+        mtlFreeCommandEncoder( command_encoder );
+    }
+    result = mtlCommitCommandBuffer( command_buffer );
+    assert( result == MTL_SUCCESS );
+    result = mtlWaitForCompletion( command_buffer );
+    assert( result == MTL_SUCCESS );
+    mtlFreeCommandBuffer( command_buffer );
+    mtlCopyDataFromBuffer( buffer, data.data(), count * sizeof( float ) );
+    for ( uint32_t i = 0; i < count; i++ )
+        assert( data[ i ] == 3.0f );
+    
+    // Empty, oversized, out of range and unbound inline data is rejected
+    command_buffer = mtlNewCommandBuffer( command_queue );
+    CommandEncoderHandle command_encoder = mtlNewCommandEncoder( command_buffer );
+    std::vector<uint8_t> large( MTL_MAX_INLINE_BYTES + 1 );
+    result = mtlSetBytes( command_encoder, large.data(), MTL_MAX_INLINE_BYTES, 1 );
+    assert( result == MTL_SUCCESS );
+    result = mtlSetBytes( command_encoder, large.data(), large.size(), 1 );
+    assert( result == MTL_ERROR );
+    result = mtlSetBytes( command_encoder, large.data(), 0, 1 );
+    assert( result == MTL_ERROR );
+    result = mtlSetBytes( command_encoder, &factor, sizeof( factor ), MTL_DISPATCH_MAX_BUFFERS );
+    assert( result == MTL_ERROR );
+    result = mtlSetBytes( command_encoder, &factor, sizeof( factor ), UINT32_MAX );
+    assert( result == MTL_ERROR );
+    result = mtlSetBytes( INVALID_HANDLE, &factor, sizeof( factor ), 1 );
+    assert( result == MTL_ERROR );
+    mtlEndEncoding( command_encoder );
+    mtlFreeCommandEncoder( command_encoder );
+    mtlFreeCommandBuffer( command_buffer );
+    
+    mtlFreeBuffer( buffer );
+    mtlFreeComputePipelineState( scale );
+    mtlFreeLibrary( library );
+}
+
+
+void testConcurrentEncoder( DeviceHandle device, CommandQueueHandle command_queue, ComputePipelineStateHandle sqr )
+{
+    const char source[] = R"""(
+        #include <metal_stdlib>
+        using namespace metal;
+
+        kernel void scale(
+            device float *v [[ buffer(0) ]],
+            constant float &factor [[ buffer(1) ]],
+            uint id[[ thread_position_in_grid ]])
+        {
+            v[id] *= factor;
+        }
+    )""";
+#ifndef __APPLE__
+    uint32_t result = mtlRegisterHostKernel( "scale", hostScale );
+    assert( result == MTL_SUCCESS );
+#else
+    uint32_t result;
+#endif
+    LibraryHandle library = mtlNewLibrary( device, source );
+    assert( library != INVALID_HANDLE );
+    ComputePipelineStateHandle scale = mtlComputePipelineStateForFunction( library, "scale" );
+    assert( scale != INVALID_HANDLE );
+    
+    const uint32_t count = 100000;
+    BufferHandle a = mtlNewBuffer( device, count * sizeof( float ) );
+    BufferHandle b = mtlNewBuffer( device, count * sizeof( float ) );
+    BufferHandle c = mtlNewBuffer( device, count * sizeof( float ) );
+    BufferHandle d = mtlNewBuffer( device, count * sizeof( float ) );
+    std::vector<float> data( count, 2.0f );
+    mtlCopyDataToBuffer( a, data.data(), count * sizeof( float ) );
+    std::fill( data.begin(), data.end(), 3.0f );
+    mtlCopyDataToBuffer( c, data.data(), count * sizeof( float ) );
+    
+    CommandBufferHandle command_buffer = mtlNewCommandBuffer( command_queue );
+    CommandEncoderHandle command_encoder = mtlNewCommandEncoderWithDispatchType( command_buffer, MTL_DISPATCH_CONCURRENT );
+    assert( command_encoder != INVALID_HANDLE );
+    
+    // b = a^2 and d = c^2 are independent
+    const BufferHandle squares[][2] = { { a, b }, { c, d } };
+    for ( const auto & square : squares )
+    {
+        mtlSetComputePipelineState( command_encoder, sqr );
+        result = mtlSetBufferWithAccess( command_encoder, square[0], 0, MTL_BUFFER_ACCESS_READ );
+        assert( result == MTL_SUCCESS );
+        mtlSetBuffer( command_encoder, square[1], 1 );
+        result = mtlSetThreadsAndShape( command_encoder, sqr, count, 1, 1 );
+        assert( result == MTL_SUCCESS );
+    }
+    
+    // b *= 2 reads after b = a^2 writes, and d *= 3 writes after d = c^2 writes
+    const float factors[] = { 2.0f, 3.0f };
+    const BufferHandle scaled[] = { b, d };
+    for ( int i = 0; i < 2; i++ )
+    {
+        mtlSetComputePipelineState( command_encoder, scale );
+        mtlSetBuffer( command_encoder, scaled[ i ], 0 );
+        mtlSetBytes( command_encoder, &factors[ i ], sizeof( float ), 1 );
+        result = mtlSetThreadsAndShape( command_encoder, scale, count, 1, 1 );
+        assert( result == MTL_SUCCESS );
+    }
+    
+    // a = b^2 writes a after b = a^2 read it
+    mtlSetComputePipelineState( command_encoder, sqr );
+    mtlSetBufferWithAccess( command_encoder, b, 0, MTL_BUFFER_ACCESS_READ );
+    mtlSetBuffer( command_encoder, a, 1 );
+    result = mtlSetThreadsAndShape( command_encoder, sqr, count, 1, 1 );
+    assert( result == MTL_SUCCESS );
+    
+    // Unknown dispatch types, access hints and buffer indices are rejected
+    result = mtlSetBufferWithAccess( command_encoder, a, 0, 2 );
+    assert( result == MTL_ERROR );
+    result = mtlSetBufferWithAccess( command_encoder, a, MTL_DISPATCH_MAX_BUFFERS, MTL_BUFFER_ACCESS_READ );
+    assert( result == MTL_ERROR );
+    result = mtlSetBuffer( command_encoder, a, UINT32_MAX );
+    assert( result == MTL_ERROR );
+    assert( mtlNewCommandEncoderWithDispatchType( command_buffer, 2 ) == INVALID_HANDLE );
+    assert( mtlNewCommandEncoderWithDispatchType( INVALID_HANDLE, MTL_DISPATCH_SERIAL ) == INVALID_HANDLE );
+    
+    result = mtlEndEncoding( command_encoder );
+    assert( result == MTL_SUCCESS );
+    result = mtlCommitCommandBuffer( command_buffer );
+    assert( result == MTL_SUCCESS );
+    result = mtlWaitForCompletion( command_buffer );
+    assert( result == MTL_SUCCESS );
+    
+    const BufferHandle checked[] = { a, b, c, d };
+    const float expected[] = { 64.0f, 8.0f, 3.0f, 27.0f };
+    for ( int i = 0; i < 4; i++ )
+    {
+        mtlCopyDataFromBuffer( checked[ i ], data.data(), count * sizeof( float ) );
+        for ( uint32_t k = 0; k < count; k++ )
+            assert( data[ k ] == expected[ i ] );
+    }
+    
+    mtlFreeCommandEncoder( command_encoder );
+    mtlFreeCommandBuffer( command_buffer );
+    for ( BufferHandle buffer : checked )
+        mtlFreeBuffer( buffer );
+    mtlFreeComputePipelineState( scale );
+    mtlFreeLibrary( library );
+}
+
+
+// Encode y = x * x, then y *= factor, into command_buffer, each optional
+void encodeSquareAndScale( CommandBufferHandle command_buffer, ComputePipelineStateHandle sqr, ComputePipelineStateHandle scale,
+                           BufferHandle x, BufferHandle y, float factor, uint32_t count )
+{
+    CommandEncoderHandle command_encoder = mtlNewCommandEncoder( command_buffer );
+    if ( sqr != INVALID_HANDLE )
+    {
+        mtlSetComputePipelineState( command_encoder, sqr );
+        mtlSetBuffer( command_encoder, x, 0 );
+        mtlSetBuffer( command_encoder, y, 1 );
+        uint32_t result = mtlSetThreadsAndShape( command_encoder, sqr, count, 1, 1 );
+        assert( result == MTL_SUCCESS );
+    }
+    if ( scale != INVALID_HANDLE )
+    {
+        mtlSetComputePipelineState( command_encoder, scale );
+        mtlSetBuffer( command_encoder, y, 0 );
+        mtlSetBytes( command_encoder, &factor, sizeof( factor ), 1 );
+        uint32_t result = mtlSetThreadsAndShape( command_encoder, scale, count, 1, 1 );
+        assert( result == MTL_SUCCESS );
+    }
+    mtlEndEncoding( command_encoder );
+    mtlFreeCommandEncoder( command_encoder );
+}
+
+
+void testEvents( DeviceHandle device, ComputePipelineStateHandle sqr )
+{
+    const char source[] = R"""(
+        #include <metal_stdlib>
+        using namespace metal;
+
+        kernel void scale(
+            device float *v [[ buffer(0) ]],
+            constant float &factor [[ buffer(1) ]],
+            uint id[[ thread_position_in_grid ]])
+        {
+            v[id] *= factor;
+        }
+    )""";
+#ifndef __APPLE__
+    uint32_t result = mtlRegisterHostKernel( "scale", hostScale );
+    assert( result == MTL_SUCCESS );
+#else
+    uint32_t result;
+#endif
+    LibraryHandle library = mtlNewLibrary( device, source );
+    ComputePipelineStateHandle scale = mtlComputePipelineStateForFunction( library, "scale" );
+    assert( scale != INVALID_HANDLE );
+    
+    // Host signals and waits
+    EventHandle event = mtlNewEvent( device );
+    assert( event != INVALID_HANDLE );
+    uint64_t value = 1;
+    result = mtlEventSignaledValue( event, &value );
+    assert( result == MTL_SUCCESS && value == 0 );
+    result = mtlSignalEvent( event, 5 );
+    assert( result == MTL_SUCCESS );
+    mtlEventSignaledValue( event, &value );
+    assert( value == 5 );
+    assert( mtlWaitForEvent( event, 5, 0 ) == MTL_SUCCESS );
+    assert( mtlWaitForEvent( event, 6, 10 ) == MTL_ERROR );
+    assert( mtlNewEvent( INVALID_HANDLE ) == INVALID_HANDLE );
+    assert( mtlSignalEvent( INVALID_HANDLE, 1 ) == MTL_ERROR );
+    mtlFreeEvent( event );
+    
+    const uint32_t count = 10000;
+    std::vector<float> data( count, 3.0f );
+    BufferHandle x = mtlNewBuffer( device, count * sizeof( float ) );
+    BufferHandle y = mtlNewBuffer( device, count * sizeof( float ) );
+    mtlCopyDataToBuffer( x, data.data(), count * sizeof( float ) );
+    std::fill( data.begin(), data.end(), 1.0f );
+    mtlCopyDataToBuffer( y, data.data(), count * sizeof( float ) );
+    
+    // y = x^2 on one queue, then y *= 2 on another, committed first but waiting for the event
+    event = mtlNewEvent( device );
+    CommandQueueHandle upload_queue = mtlNewCommandQueue( device );
+    CommandQueueHandle compute_queue = mtlNewCommandQueue( device );
+    CommandBufferHandle scaled = mtlNewCommandBuffer( compute_queue );
+    result = mtlEncodeWaitForEvent( scaled, event, 1 );
+    assert( result == MTL_SUCCESS );
+    encodeSquareAndScale( scaled, INVALID_HANDLE, scale, x, y, 2.0f, count );
+    result = mtlEncodeSignalEvent( scaled, event, 2 );
+    assert( result == MTL_SUCCESS );
+    mtlCommitCommandBuffer( scaled );
+    
+    CommandBufferHandle squared = mtlNewCommandBuffer( upload_queue );
+    encodeSquareAndScale( squared, sqr, INVALID_HANDLE, x, y, 1.0f, count );
+    mtlEncodeSignalEvent( squared, event, 1 );
+    mtlCommitCommandBuffer( squared );
+    
+    result = mtlWaitForEvent( event, 2, MTL_WAIT_FOREVER );
+    assert( result == MTL_SUCCESS );
+    mtlWaitForCompletion( scaled );
+    mtlCopyDataFromBuffer( y, data.data(), count * sizeof( float ) );
+    for ( uint32_t i = 0; i < count; i++ )
+        assert( data[ i ] == 18.0f );
+    assert( mtlEncodeSignalEvent( scaled, event, 3 ) == MTL_ERROR );
+    assert( mtlEncodeWaitForEvent( scaled, INVALID_HANDLE, 3 ) == MTL_ERROR );
+    mtlFreeCommandBuffer( squared );
+    mtlFreeCommandBuffer( scaled );
+    
+    // A command buffer waiting for the host does not hold up other queues
+    CommandBufferHandle held = mtlNewCommandBuffer( compute_queue );
+    mtlEncodeWaitForEvent( held, event, 10 );
+    encodeSquareAndScale( held, INVALID_HANDLE, scale, x, y, 0.5f, count );
+    mtlCommitCommandBuffer( held );
+    CommandBufferHandle other = mtlNewCommandBuffer( upload_queue );
+    encodeSquareAndScale( other, INVALID_HANDLE, scale, x, x, 2.0f, count );
+    mtlCommitCommandBuffer( other );
+    result = mtlWaitForCompletion( other );
+    assert( result == MTL_SUCCESS );
+    uint32_t status;
+    mtlCommandBufferStatus( held, &status );
+    assert( status != MTL_COMMAND_BUFFER_COMPLETED );
+    
+    // Nor do reductions and autotuning on other queues, so the host can run them before it signals
+    mtlReduction sum;
+    result = mtlReduceBuffer( upload_queue, x, count, MTL_REDUCE_SUM, 0, &sum );
+    assert( result == MTL_SUCCESS && sum.value == 6.0 * count );
+    BufferHandle squares = mtlNewBuffer( device, count * sizeof( float ) );
+    mtlDispatch dispatch = {};
+    dispatch.compute_pipeline_state = sqr;
+    dispatch.buffers[0] = x;
+    dispatch.buffers[1] = squares;
+    dispatch.num_buffers = 2;
+    dispatch.width = count;
+    dispatch.height = dispatch.depth = 1;
+    uint32_t tuned[3];
+    result = mtlAutotuneThreadgroupSize( upload_queue, &dispatch, 1, tuned );
+    assert( result == MTL_SUCCESS );
+    mtlFreeBuffer( squares );
+    mtlCommandBufferStatus( held, &status );
+    assert( status != MTL_COMMAND_BUFFER_COMPLETED );
+    result = mtlSignalEvent( event, 10 );
+    assert( result == MTL_SUCCESS );
+    result = mtlWaitForCompletion( held );
+    assert( result == MTL_SUCCESS );
+    mtlCopyDataFromBuffer( y, data.data(), count * sizeof( float ) );
+    for ( uint32_t i = 0; i < count; i++ )
+        assert( data[ i ] == 9.0f );
+    mtlFreeCommandBuffer( other );
+    mtlFreeCommandBuffer( held );
+    
+    mtlFreeEvent( event );
+    mtlFreeCommandQueue( compute_queue );
+    mtlFreeCommandQueue( upload_queue );
+    mtlFreeBuffer( x );
+    mtlFreeBuffer( y );
+    mtlFreeComputePipelineState( scale );
+    mtlFreeLibrary( library );
+}
+
+
+// Host arrays several times the memory budget go through the device in chunks
+void testStreaming( DeviceHandle device, CommandQueueHandle command_queue, ComputePipelineStateHandle sqr )
+{
+    const uint64_t count = 1000003;
+    std::vector<float> input( count ), output( count, -1.0f );
+    for ( uint64_t i = 0; i < count; i++ )
+        input[ i ] = (float)( i % 1000 );
+    mtlBufferPoolStats before, after;
+    mtlGetBufferPoolStats( device, &before );
+    
+    // Three chunks of 100000 threads of 8 bytes fit the budget, so this takes 11 chunks
+    const uint64_t budget = 3 * 100000 * 2 * sizeof( float );
+    uint32_t result = mtlStreamKernelInOut( command_queue, sqr, input.data(), sizeof( float ), output.data(), sizeof( float ), NULL, 0, count, budget );
+    assert( result == MTL_SUCCESS );
+    for ( uint64_t i = 0; i < count; i++ )
+        assert( output[ i ] == input[ i ] * input[ i ] );
+    mtlGetBufferPoolStats( device, &after );
+    assert( after.in_use_bytes == before.in_use_bytes );
+    
+    // In place, with the scale factor in a resident buffer
+    const char source[] = R"""(
+        #include <metal_stdlib>
+        using namespace metal;
+
+        kernel void scale(
+            device float *v [[ buffer(0) ]],
+            constant float &factor [[ buffer(1) ]],
+            uint id[[ thread_position_in_grid ]])
+        {
+            v[id] *= factor;
+        }
+    )""";
+#ifndef __APPLE__
+    result = mtlRegisterHostKernel( "scale", hostScale );
+    assert( result == MTL_SUCCESS );
+#endif
+    LibraryHandle library = mtlNewLibrary( device, source );
+    ComputePipelineStateHandle scale = mtlComputePipelineStateForFunction( library, "scale" );
+    assert( scale != INVALID_HANDLE );
+    BufferHandle factor = mtlNewBuffer( device, sizeof( float ) );
+    const float three = 3.0f;
+    mtlCopyDataToBuffer( factor, &three, sizeof( three ) );
+    mtlStreamArray arrays[ 2 ] = {};
+    arrays[ 0 ].input = output.data();
+    arrays[ 0 ].output = output.data();
+    arrays[ 0 ].element_size = sizeof( float );
+    arrays[ 1 ].buffer = factor;
+    result = mtlStreamKernel( command_queue, scale, arrays, 2, count, budget / 2 );
+    assert( result == MTL_SUCCESS );
+    for ( uint64_t i = 0; i < count; i++ )
+        assert( output[ i ] == 3.0f * input[ i ] * input[ i ] );
+    
+    // The default budget holds this in one chunk
+    result = mtlStreamKernel( command_queue, scale, arrays, 2, count, 0 );
+    assert( result == MTL_SUCCESS );
+    assert( output[ count - 1 ] == 9.0f * input[ count - 1 ] * input[ count - 1 ] );
+    
+    // A budget that does not fit three single-thread chunks, and malformed arguments
+    result = mtlStreamKernel( command_queue, scale, arrays, 2, count, 3 * sizeof( float ) - 1 );
+    assert( result == MTL_ERROR );
+    arrays[ 1 ].input = input.data();
+    assert( mtlStreamKernel( command_queue, scale, arrays, 2, count, budget ) == MTL_ERROR );
+    assert( mtlStreamKernel( INVALID_HANDLE, scale, arrays, 1, count, budget ) == MTL_ERROR );
+    assert( mtlStreamKernel( command_queue, scale, arrays, 1, 0, budget ) == MTL_ERROR );
+    assert( mtlStreamKernelInOut( command_queue, sqr, input.data(), sizeof( float ), NULL, sizeof( float ), NULL, 0, count, budget ) == MTL_ERROR );
+    mtlGetBufferPoolStats( device, &after );
+    assert( after.in_use_bytes == before.in_use_bytes );
+    
+    mtlFreeBuffer( factor );
+    mtlFreeComputePipelineState( scale );
+    mtlFreeLibrary( library );
+}
+
+
+// Buffers mapped from a file read its contents, and writes never reach the file
+void testFileBuffers( DeviceHandle device, CommandQueueHandle command_queue, ComputePipelineStateHandle sqr )
+{
+    // 64 KiB is a whole number of pages on every system, so on Metal the whole file is mapped rather than read
+    const uint64_t count = 16384;
+    std::vector<float> data( count );
+    for ( uint64_t i = 0; i < count; i++ )
+        data[ i ] = (float)( i % 1000 );
+    char path[] = "/tmp/MatlabMetalFileBufferXXXXXX";
+    int descriptor = mkstemp( path );
+    assert( descriptor >= 0 );
+    assert( write( descriptor, data.data(), count * sizeof( float ) ) == (ssize_t)( count * sizeof( float ) ) );
+    close( descriptor );
+    
+    // The whole file, read-only: kernels read it, but nothing may write to it
+    BufferHandle input = mtlNewBufferFromFile( device, path, 0, 0, MTL_FILE_READ_ONLY );
+    assert( input != INVALID_HANDLE );
+    assert( mtlBufferSize( input ) == count * sizeof( float ) );
+    BufferHandle output = mtlNewBuffer( device, count * sizeof( float ) );
+    mtlDispatch dispatch = {};
+    dispatch.compute_pipeline_state = sqr;
+    dispatch.buffers[0] = input;
+    dispatch.buffers[1] = output;
+    dispatch.num_buffers = 2;
+    dispatch.width = (uint32_t)count;
+    dispatch.height = 1;
+    dispatch.depth = 1;
+    CommandBufferHandle command_buffer = mtlSubmitDispatches( command_queue, &dispatch, 1 );
+    assert( mtlWaitForCompletion( command_buffer ) == MTL_SUCCESS );
+    mtlFreeCommandBuffer( command_buffer );
+    std::vector<float> result( count );
+    mtlCopyDataFromBuffer( output, result.data(), count * sizeof( float ) );
+    for ( uint64_t i = 0; i < count; i++ )
+        assert( result[ i ] == data[ i ] * data[ i ] );
+    
+    const float one = 1.0f;
+    assert( mtlCopyDataToBuffer( input, &one, sizeof( one ) ) == MTL_ERROR );
+    char error[ 256 ];
+    mtlGetLastError( error, sizeof( error ) );
+    assert( strcmp( error, "The buffer is read-only." ) == 0 );
+    assert( mtlCopyFloatsToBuffer( input, 0, &one, 1, MTL_FORMAT_FLOAT ) == MTL_ERROR );
+    assert( mtlMapBuffer( input, MTL_MAP_WRITE ) == NULL );
+    const float * mapped = (const float *)mtlMapBuffer( input, MTL_MAP_READ );
+    assert( mapped && mapped[ count - 1 ] == data[ count - 1 ] );
+    mtlUnmapBuffer( input, 0, 0 );
+    const uint64_t dimensions[3] = { count, 1, 1 };
+    command_buffer = mtlNewCommandBuffer( command_queue );
+    assert( mtlEncodeReduceDimension( command_buffer, output, dimensions, 0, MTL_REDUCE_SUM, input ) == MTL_ERROR );
+    mtlFreeCommandBuffer( command_buffer );
+    mtlFreeBuffer( input );
+    
+    // Copy-on-write, starting part way into the file: writes stay in the buffer
+    const uint64_t first = 7;
+    BufferHandle copy = mtlNewBufferFromFile( device, path, first * sizeof( float ), 100 * sizeof( float ), MTL_FILE_COPY_ON_WRITE );
+    assert( copy != INVALID_HANDLE );
+    assert( mtlBufferSize( copy ) == 100 * sizeof( float ) );
+    float values[ 100 ];
+    mtlCopyDataFromBuffer( copy, values, sizeof( values ) );
+    for ( uint64_t i = 0; i < 100; i++ )
+        assert( values[ i ] == data[ first + i ] );
+    const float written = -5.0f;
+    assert( mtlCopyDataToBuffer( copy, &written, sizeof( written ) ) == MTL_SUCCESS );
+    mtlCopyDataFromBuffer( copy, values, sizeof( values ) );
+    assert( values[ 0 ] == written );
+    mtlFreeBuffer( copy );
+    std::ifstream file( path, std::ios::binary );
+    std::vector<float> on_disk( count );
+    file.read( (char *)on_disk.data(), count * sizeof( float ) );
+    assert( on_disk[ first ] == data[ first ] );
+    
+    // Ranges past the end, bad modes and missing files
+    assert( mtlNewBufferFromFile( device, path, 0, count * sizeof( float ) + 1, MTL_FILE_READ_ONLY ) == INVALID_HANDLE );
+    assert( mtlNewBufferFromFile( device, path, count * sizeof( float ), 0, MTL_FILE_READ_ONLY ) == INVALID_HANDLE );
+    assert( mtlNewBufferFromFile( device, path, 0, 0, 2 ) == INVALID_HANDLE );
+    assert( mtlNewBufferFromFile( device, "/nonexistent/MatlabMetal", 0, 0, MTL_FILE_READ_ONLY ) == INVALID_HANDLE );
+    assert( mtlNewBufferFromFile( INVALID_HANDLE, path, 0, 0, MTL_FILE_READ_ONLY ) == INVALID_HANDLE );
+    
+    mtlFreeBuffer( output );
+    unlink( path );
 }
 
 
-void printDevice( mtlDeviceInfo deviceStruct)
+void countRelease( void * pointer, uint64_t bytes, void * user_data )
 {
-    cout << " Name:        " << deviceStruct.name << endl;
-    cout << " WorkSize:    " << deviceStruct.recommendedMaxWorkingSetSize << endl;
-    cout << " Registry ID: " << deviceStruct.RegistryID << endl;
-    cout << " Low Power:   " << BoolToString( deviceStruct.IsLowPower ) << endl;
-    cout << " Headless:    " << BoolToString( deviceStruct.IsHeadless ) << endl;
+    assert( pointer && bytes > 0 );
+    ( *(std::atomic<int> *)user_data )++;
 }
 
 
-void printDevices( mtlDeviceInfo * devices, int numDevices)
+// Buffers wrapping caller memory are that memory: kernels write the caller's array directly
+void testHostPointerBuffers( DeviceHandle device, CommandQueueHandle command_queue, ComputePipelineStateHandle sqr )
 {
-    for (int i = 0; i < numDevices; i++)
+    const uint64_t alignment = std::max<uint64_t>( mtlHostPointerAlignment( device ), sizeof( void * ) );
+    assert( alignment > 0 );
+    const uint64_t count = 100000;
+    const uint64_t bytes = ( count * sizeof( float ) + alignment - 1 ) / alignment * alignment;
+    void * memory[2];
+    for ( int i = 0; i < 2; i++ )
+        assert( posix_memalign( &memory[i], alignment, bytes ) == 0 );
+    float * input = (float *)memory[0];
+    float * output = (float *)memory[1];
+    for ( uint64_t i = 0; i < count; i++ )
     {
-        cout << "[Device " << i << "]" << endl;
-        printDevice( devices[i] );
-        cout << endl;
+        input[ i ] = (float)( i % 1000 );
+        output[ i ] = -1.0f;
+    }
+    
+    std::atomic<int> released( 0 );
+    BufferHandle buffers[2];
+    for ( int i = 0; i < 2; i++ )
+    {
+        buffers[i] = mtlNewBufferWithHostPointer( device, memory[i], bytes, countRelease, &released );
+        assert( buffers[i] != INVALID_HANDLE );
+        assert( mtlBufferSize( buffers[i] ) == bytes );
+    }
+    mtlDispatch dispatch = {};
+    dispatch.compute_pipeline_state = sqr;
+    dispatch.buffers[0] = buffers[0];
+    dispatch.buffers[1] = buffers[1];
+    dispatch.num_buffers = 2;
+    dispatch.width = (uint32_t)count;
+    dispatch.height = 1;
+    dispatch.depth = 1;
+    CommandBufferHandle command_buffer = mtlSubmitDispatches( command_queue, &dispatch, 1 );
+    assert( mtlWaitForCompletion( command_buffer ) == MTL_SUCCESS );
+    mtlFreeCommandBuffer( command_buffer );
+    for ( uint64_t i = 0; i < count; i++ )
+        assert( output[ i ] == input[ i ] * input[ i ] );
+    
+    // Copies and maps reach the same memory
+    const float seven = 7.0f;
+    assert( mtlCopyDataToBufferRange( buffers[0], sizeof( float ), &seven, sizeof( seven ) ) == MTL_SUCCESS );
+    assert( input[ 1 ] == seven );
+    assert( mtlMapBuffer( buffers[1], MTL_MAP_READ ) == output );
+    mtlUnmapBuffer( buffers[1], 0, 0 );
+    
+    // The caller keeps the memory; the deallocator only reports its release
+    assert( released == 0 );
+    for ( int i = 0; i < 2; i++ )
+        mtlFreeBuffer( buffers[i] );
+    assert( released == 2 );
+    assert( output[ count - 1 ] == input[ count - 1 ] * input[ count - 1 ] );
+    
+    // Without a deallocator, and misaligned or missing memory
+    BufferHandle plain = mtlNewBufferWithHostPointer( device, memory[0], bytes, NULL, NULL );
+    assert( plain != INVALID_HANDLE );
+    mtlFreeBuffer( plain );
+    assert( mtlNewBufferWithHostPointer( device, (uint8_t *)memory[0] + 1, alignment, NULL, NULL ) == INVALID_HANDLE );
+    assert( mtlNewBufferWithHostPointer( device, NULL, bytes, NULL, NULL ) == INVALID_HANDLE );
+    assert( mtlNewBufferWithHostPointer( INVALID_HANDLE, memory[0], bytes, NULL, NULL ) == INVALID_HANDLE );
+    assert( mtlHostPointerAlignment( INVALID_HANDLE ) == 0 );
+    
+    for ( int i = 0; i < 2; i++ )
+        free( memory[i] );
+}
+
+
+// A recorded command list replays its dispatches, with bindings patched between replays
+void testCommandLists( DeviceHandle device, CommandQueueHandle command_queue, ComputePipelineStateHandle sqr )
+{
+    const uint32_t count = 50000;
+    std::vector<float> data( count );
+    for ( uint32_t i = 0; i < count; i++ )
+        data[ i ] = 1.0f + (float)( i % 7 );
+    BufferHandle buffers[4];
+    for ( int i = 0; i < 4; i++ )
+        buffers[i] = mtlNewBuffer( device, count * sizeof( float ) );
+    mtlCopyDataToBuffer( buffers[0], data.data(), count * sizeof( float ) );
+    
+    // 0 -> 1 -> 2, so the second dispatch has to wait for the first
+    mtlDispatch dispatches[2] = {};
+    for ( int d = 0; d < 2; d++ )
+    {
+        dispatches[d].compute_pipeline_state = sqr;
+        dispatches[d].buffers[0] = buffers[ d ];
+        dispatches[d].buffers[1] = buffers[ d + 1 ];
+        dispatches[d].num_buffers = 2;
+        dispatches[d].width = count;
+        dispatches[d].height = 1;
+        dispatches[d].depth = 1;
+    }
+    CommandListHandle command_list = mtlNewCommandList( device, dispatches, 2 );
+    assert( command_list != INVALID_HANDLE );
+    
+    std::vector<float> result( count );
+    for ( int replay = 0; replay < 3; replay++ )
+    {
+        mtlCopyDataToBuffer( buffers[2], data.data(), count * sizeof( float ) );
+        CommandBufferHandle command_buffer = mtlSubmitCommandList( command_queue, command_list );
+        assert( command_buffer != INVALID_HANDLE );
+        assert( mtlWaitForCompletion( command_buffer ) == MTL_SUCCESS );
+        mtlFreeCommandBuffer( command_buffer );
+        mtlCopyDataFromBuffer( buffers[2], result.data(), count * sizeof( float ) );
+        for ( uint32_t i = 0; i < count; i++ )
+            assert( result[ i ] == data[ i ] * data[ i ] * data[ i ] * data[ i ] );
+    }
+    
+    // A command buffer keeps the bindings the list had when it was encoded
+    std::vector<float> twos( count, 2.0f );
+    mtlCopyDataToBuffer( buffers[3], twos.data(), count * sizeof( float ) );
+    CommandBufferHandle before = mtlNewCommandBuffer( command_queue );
+    assert( mtlEncodeCommandList( before, command_list ) == MTL_SUCCESS );
+    assert( mtlCommandListSetBuffer( command_list, 0, 0, buffers[3] ) == MTL_SUCCESS );
+    mtlCommitCommandBuffer( before );
+    assert( mtlWaitForCompletion( before ) == MTL_SUCCESS );
+    mtlCopyDataFromBuffer( buffers[2], result.data(), count * sizeof( float ) );
+    assert( result[ 1 ] == data[ 1 ] * data[ 1 ] * data[ 1 ] * data[ 1 ] );
+    assert( mtlEncodeCommandList( before, command_list ) == MTL_ERROR );
+    mtlFreeCommandBuffer( before );
+    
+    // After the patch, and between other dispatches of the same command buffer. The
+    // list holds its buffers, so their handles may go.
+    mtlFreeBuffer( buffers[3] );
+    mtlDispatch copy_back = dispatches[0];
+    copy_back.buffers[0] = buffers[2];
+    copy_back.buffers[1] = buffers[0];
+    CommandBufferHandle command_buffer = mtlNewCommandBuffer( command_queue );
+    assert( mtlEncodeCommandList( command_buffer, command_list ) == MTL_SUCCESS );
+    assert( mtlEncodeDispatches( command_buffer, &copy_back, 1 ) == MTL_SUCCESS );
+    mtlCommitCommandBuffer( command_buffer );
+    assert( mtlWaitForCompletion( command_buffer ) == MTL_SUCCESS );
+    mtlFreeCommandBuffer( command_buffer );
+    mtlCopyDataFromBuffer( buffers[0], result.data(), count * sizeof( float ) );
+    for ( uint32_t i = 0; i < count; i++ )
+        assert( result[ i ] == 256.0f );
+    
+    // Bad indices and handles
+    assert( mtlCommandListSetBuffer( command_list, 2, 0, buffers[0] ) == MTL_ERROR );
+    assert( mtlCommandListSetBuffer( command_list, 0, MTL_DISPATCH_MAX_BUFFERS, buffers[0] ) == MTL_ERROR );
+    assert( mtlCommandListSetBuffer( command_list, 0, 0, INVALID_HANDLE ) == MTL_ERROR );
+    assert( mtlSubmitCommandList( command_queue, INVALID_HANDLE ) == INVALID_HANDLE );
+    assert( mtlNewCommandList( device, dispatches, 0 ) == INVALID_HANDLE );
+    dispatches[1].width = 0;
+    assert( mtlNewCommandList( device, dispatches, 2 ) == INVALID_HANDLE );
+    
+    mtlFreeCommandList( command_list );
+    for ( int i = 0; i < 3; i++ )
+        mtlFreeBuffer( buffers[i] );
+}
+
+
+// A kernel writes the grid of the next dispatch, which reads it when it runs
+void testIndirectDispatch( DeviceHandle device, CommandQueueHandle command_queue )
+{
+    const char source[] = R"""(
+        #include <metal_stdlib>
+        using namespace metal;
+
+        kernel void indirect_arguments(
+            device const uint *count [[ buffer(0) ]],
+            device uint *arguments [[ buffer(1) ]],
+            uint id[[ thread_position_in_grid ]])
+        {
+            arguments[4] = ( count[0] + 63 ) / 64;
+            arguments[5] = 1;
+            arguments[6] = 1;
+        }
+
+        kernel void double_first(
+            device float *v [[ buffer(0) ]],
+            device const uint *count [[ buffer(1) ]],
+            uint id[[ thread_position_in_grid ]])
+        {
+            if ( id < count[0] )
+                v[id] *= 2.0f;
+        }
+    )""";
+#ifndef __APPLE__
+    uint32_t result = mtlRegisterHostKernel( "indirect_arguments", hostIndirectArguments );
+    assert( result == MTL_SUCCESS );
+    result = mtlRegisterHostKernel( "double_first", hostDoubleFirst );
+    assert( result == MTL_SUCCESS );
+#else
+    uint32_t result;
+#endif
+    LibraryHandle library = mtlNewLibrary( device, source );
+    assert( library != INVALID_HANDLE );
+    ComputePipelineStateHandle indirect_arguments = mtlComputePipelineStateForFunction( library, "indirect_arguments" );
+    ComputePipelineStateHandle double_first = mtlComputePipelineStateForFunction( library, "double_first" );
+    assert( indirect_arguments != INVALID_HANDLE && double_first != INVALID_HANDLE );
+    
+    const uint32_t num_elements = 4096;
+    const uint32_t group_size[3] = { 64, 1, 1 };
+    std::vector<float> data( num_elements, 1.0f );
+    BufferHandle buffer = mtlNewBuffer( device, num_elements * sizeof( float ) );
+    BufferHandle count_buffer = mtlNewBuffer( device, sizeof( uint32_t ) );
+    // The arguments live at offset 16, past a grid that must not be used. They start
+    // as a single threadgroup, which is all that runs if they are read too early.
+    BufferHandle arguments_buffer = mtlNewBuffer( device, 32 );
+    const uint32_t stale[8] = { 1000, 1, 1, 0, 1, 1, 1, 0 };
+    mtlCopyDataToBuffer( arguments_buffer, stale, sizeof( stale ) );
+    mtlCopyDataToBuffer( buffer, data.data(), num_elements * sizeof( float ) );
+    
+    // Both dispatches in one concurrent encoder: the second may only start once the first has written its grid
+    mtlSetProfilingEnabled( 1 );
+    for ( uint32_t count : { 1000u, 0u } )
+    {
+        mtlCopyDataToBuffer( count_buffer, &count, sizeof( count ) );
+        CommandBufferHandle command_buffer = mtlNewCommandBuffer( command_queue );
+        CommandEncoderHandle command_encoder = mtlNewCommandEncoderWithDispatchType( command_buffer, MTL_DISPATCH_CONCURRENT );
+        assert( command_encoder != INVALID_HANDLE );
+        mtlSetComputePipelineState( command_encoder, indirect_arguments );
+        mtlSetBufferWithAccess( command_encoder, count_buffer, 0, MTL_BUFFER_ACCESS_READ );
+        mtlSetBuffer( command_encoder, arguments_buffer, 1 );
+        result = mtlSetThreadsAndShape( command_encoder, indirect_arguments, 1, 1, 1 );
+        assert( result == MTL_SUCCESS );
+        mtlSetComputePipelineState( command_encoder, double_first );
+        mtlSetBuffer( command_encoder, buffer, 0 );
+        mtlSetBufferWithAccess( command_encoder, count_buffer, 1, MTL_BUFFER_ACCESS_READ );
+        result = mtlDispatchThreadgroupsIndirect( command_encoder, double_first, arguments_buffer, 16, group_size );
+        assert( result == MTL_SUCCESS );
+        mtlEndEncoding( command_encoder );
+        mtlFreeCommandEncoder( command_encoder );
+        result = mtlCommitCommandBuffer( command_buffer );
+        assert( result == MTL_SUCCESS );
+        result = mtlWaitForCompletion( command_buffer );
+        assert( result == MTL_SUCCESS );
+#ifndef __APPLE__
+        // The profile has the grid the indirect dispatch ran, not the one it was encoded with
+        mtlDispatchTiming timing;
+        result = mtlGetDispatchTiming( command_buffer, 1, &timing );
+        assert( result == MTL_SUCCESS );
+        assert( timing.width == ( count + 63 ) / 64 * 64 && timing.height == 1 && timing.depth == 1 );
+#endif
+        mtlFreeCommandBuffer( command_buffer );
+    }
+    mtlSetProfilingEnabled( 0 );
+    mtlCopyDataFromBuffer( buffer, data.data(), num_elements * sizeof( float ) );
+    for ( uint32_t i = 0; i < num_elements; i++ )
+        assert( data[ i ] == ( i < 1000 ? 2.0f : 1.0f ) );
+    uint32_t arguments[8];
+    mtlCopyDataFromBuffer( arguments_buffer, arguments, sizeof( arguments ) );
+    assert( arguments[4] == 0 && arguments[0] == 1000 );
+    
+#ifndef __APPLE__
+    // A grid of more than UINT32_MAX threads fails the command buffer without running
+    const uint32_t too_many[3] = { UINT32_MAX / 64 + 1, 1, 1 };
+    mtlCopyDataToBuffer( arguments_buffer, too_many, sizeof( too_many ) );
+    CommandBufferHandle failing = mtlNewCommandBuffer( command_queue );
+    CommandEncoderHandle failing_encoder = mtlNewCommandEncoder( failing );
+    mtlSetComputePipelineState( failing_encoder, double_first );
+    mtlSetBuffer( failing_encoder, buffer, 0 );
+    mtlSetBufferWithAccess( failing_encoder, count_buffer, 1, MTL_BUFFER_ACCESS_READ );
+    result = mtlDispatchThreadgroupsIndirect( failing_encoder, double_first, arguments_buffer, 0, group_size );
+    assert( result == MTL_SUCCESS );
+    mtlEndEncoding( failing_encoder );
+    mtlFreeCommandEncoder( failing_encoder );
+    mtlCommitCommandBuffer( failing );
+    result = mtlWaitForCompletion( failing );
+    assert( result == MTL_SUCCESS );
+    uint32_t status;
+    mtlCommandBufferStatus( failing, &status );
+    assert( status == MTL_COMMAND_BUFFER_ERROR );
+    char error[ 256 ];
+    mtlGetLastError( error, sizeof( error ) );
+    assert( strcmp( error, "Indirect dispatch grid exceeds UINT32_MAX threads." ) == 0 );
+    mtlFreeCommandBuffer( failing );
+    mtlCopyDataFromBuffer( buffer, data.data(), num_elements * sizeof( float ) );
+    for ( uint32_t i = 0; i < num_elements; i++ )
+        assert( data[ i ] == ( i < 1000 ? 2.0f : 1.0f ) );
+#endif
+    
+    // Misaligned or short arguments, missing group sizes and bad handles
+    CommandBufferHandle command_buffer = mtlNewCommandBuffer( command_queue );
+    CommandEncoderHandle command_encoder = mtlNewCommandEncoder( command_buffer );
+    mtlSetComputePipelineState( command_encoder, double_first );
+    const uint32_t no_group[3] = { 0, 0, 0 };
+    assert( mtlDispatchThreadgroupsIndirect( command_encoder, double_first, arguments_buffer, 2, group_size ) == MTL_ERROR );
+    assert( mtlDispatchThreadgroupsIndirect( command_encoder, double_first, arguments_buffer, 24, group_size ) == MTL_ERROR );
+    assert( mtlDispatchThreadgroupsIndirect( command_encoder, double_first, arguments_buffer, UINT64_MAX - 3, group_size ) == MTL_ERROR );
+    assert( mtlDispatchThreadgroupsIndirect( command_encoder, double_first, arguments_buffer, 0, no_group ) == MTL_ERROR );
+    assert( mtlDispatchThreadgroupsIndirect( command_encoder, double_first, INVALID_HANDLE, 0, group_size ) == MTL_ERROR );
+    assert( mtlDispatchThreadgroupsIndirect( INVALID_HANDLE, double_first, arguments_buffer, 0, group_size ) == MTL_ERROR );
+    mtlEndEncoding( command_encoder );
+    mtlFreeCommandEncoder( command_encoder );
+    mtlFreeCommandBuffer( command_buffer );
+    
+    mtlFreeBuffer( arguments_buffer );
+    mtlFreeBuffer( count_buffer );
+    mtlFreeBuffer( buffer );
+    mtlFreeComputePipelineState( double_first );
+    mtlFreeComputePipelineState( indirect_arguments );
+    mtlFreeLibrary( library );
+}
+
+
+// Every device (one per NUMA node on a CPU backend) is distinct and runs work on buffers of its own
+void testDevices( const char * source )
+{
+    uint32_t num_devices = mtlNumberOfDevices();
+    std::set<uint64_t> registry_ids;
+    for ( uint32_t d = 0; d < num_devices; d++ )
+    {
+        DeviceHandle device = mtlGetDeviceAtIndex( d );
+        assert( device != INVALID_HANDLE );
+        mtlDeviceInfo info;
+        uint32_t result = mtlGetDeviceInfo( device, &info );
+        assert( result == MTL_SUCCESS );
+        assert( registry_ids.insert( info.RegistryID ).second );
+        if ( d > 0 )
+        {
+            DeviceHandle first = mtlGetDeviceAtIndex( 0 );
+            assert( !mtlSameDevice( device, first ) );
+            mtlFreeDevice( first );
+        }
+        
+        LibraryHandle library = mtlNewLibrary( device, source );
+        ComputePipelineStateHandle sqr = mtlComputePipelineStateForFunction( library, "sqr" );
+        assert( sqr != INVALID_HANDLE );
+        CommandQueueHandle command_queue = mtlNewCommandQueue( device );
+        
+        const uint32_t count = 2 << 20;
+        std::vector<float> data( count );
+        for ( uint32_t i = 0; i < count; i++ )
+            data[ i ] = (float)( i % 100 );
+        BufferHandle x = mtlNewBuffer( device, count * sizeof( float ) );
+        BufferHandle y = mtlNewPooledBuffer( device, count * sizeof( float ) );
+        assert( x != INVALID_HANDLE && y != INVALID_HANDLE );
+        mtlCopyDataToBuffer( x, data.data(), count * sizeof( float ) );
+        
+        CommandBufferHandle command_buffer = mtlNewCommandBuffer( command_queue );
+        encodeSquareAndScale( command_buffer, sqr, INVALID_HANDLE, x, y, 1.0f, count );
+        mtlCommitCommandBuffer( command_buffer );
+        result = mtlWaitForCompletion( command_buffer );
+        assert( result == MTL_SUCCESS );
+        mtlCopyDataFromBuffer( y, data.data(), count * sizeof( float ) );
+        for ( uint32_t i = 0; i < count; i++ )
+            assert( data[ i ] == (float)( ( i % 100 ) * ( i % 100 ) ) );
+        
+        mtlFreeCommandBuffer( command_buffer );
+        mtlFreeBuffer( x );
+        mtlFreeBuffer( y );
+        mtlFreeCommandQueue( command_queue );
+        mtlFreeComputePipelineState( sqr );
+        mtlFreeLibrary( library );
+        mtlFreeDevice( device );
+    }
+}
+
+
+// Reference reduction of count elements, first + k * stride, as mtlEncodeReduceDimension computes each output
+double referenceReduce( const std::vector<float> & data, uint64_t first, uint64_t stride, uint64_t count, uint32_t operation, uint32_t * index )
+{
+    double value = ( operation == MTL_REDUCE_SUM || operation == MTL_REDUCE_MEAN || operation == MTL_REDUCE_NORM ) ? 0.0 : NAN;
+    *index = 0;
+    for ( uint64_t k = 0; k < count; k++ )
+    {
+        double x = data[ first + k * stride ];
+        if ( operation == MTL_REDUCE_SUM || operation == MTL_REDUCE_MEAN )
+            value += x;
+        else if ( operation == MTL_REDUCE_NORM )
+            value += x * x;
+        else if ( !std::isnan( x ) )
+        {
+            bool minimum = operation == MTL_REDUCE_MIN || operation == MTL_REDUCE_ARGMIN;
+            if ( std::isnan( value ) || ( minimum ? x < value : x > value ) )
+            {
+                value = x;
+                *index = (uint32_t)k;
+            }
+        }
+    }
+    if ( operation == MTL_REDUCE_MEAN )
+        value /= count;
+    if ( operation == MTL_REDUCE_NORM )
+        value = sqrt( value );
+    return value;
+}
+
+
+void testReductions( DeviceHandle device, CommandQueueHandle command_queue )
+{
+    // Whole-number data, so sums in double precision are exact
+    const uint64_t count = 1000003;
+    std::vector<float> data( count );
+    for ( uint64_t i = 0; i < count; i++ )
+        data[ i ] = (float)( ( i * 7919 ) % 1000 ) - 500.0f;
+    BufferHandle buffer = mtlNewBuffer( device, count * sizeof( float ) );
+    uint32_t result = mtlCopyDataToBuffer( buffer, data.data(), count * sizeof( float ) );
+    assert( result == MTL_SUCCESS );
+    
+    for ( uint32_t operation = MTL_REDUCE_SUM; operation <= MTL_REDUCE_NORM; operation++ )
+    {
+        uint32_t expected_index;
+        double expected = referenceReduce( data, 0, 1, count, operation, &expected_index );
+        mtlReduction reduction;
+        result = mtlReduceBuffer( command_queue, buffer, count, operation, 0, &reduction );
+        assert( result == MTL_SUCCESS );
+        assert( fabs( reduction.value - expected ) <= 1e-6 * ( 1.0 + fabs( expected ) ) );
+        assert( reduction.index == ( operation == MTL_REDUCE_SUM || operation == MTL_REDUCE_MEAN || operation == MTL_REDUCE_NORM ? 0 : expected_index ) );
+        
+        // A fixed order gives the same bits on every run
+        mtlReduction first, second;
+        result = mtlReduceBuffer( command_queue, buffer, count, operation, MTL_REDUCE_DETERMINISTIC, &first );
+        assert( result == MTL_SUCCESS );
+        result = mtlReduceBuffer( command_queue, buffer, count, operation, MTL_REDUCE_DETERMINISTIC, &second );
+        assert( result == MTL_SUCCESS );
+        assert( first.value == second.value && first.index == second.index );
+        assert( fabs( first.value - expected ) <= 1e-6 * ( 1.0 + fabs( expected ) ) );
+    }
+    
+    // Only the first num_elements take part
+    mtlReduction reduction;
+    uint32_t prefix_index;
+    double prefix_max = referenceReduce( data, 0, 1, 10, MTL_REDUCE_MAX, &prefix_index );
+    result = mtlReduceBuffer( command_queue, buffer, 10, MTL_REDUCE_MAX, 0, &reduction );
+    assert( result == MTL_SUCCESS && reduction.value == prefix_max && reduction.index == prefix_index );
+    
+    // NaNs propagate through sums but are skipped by min and max
+    float nan_and_peak[2] = { NAN, 1000.0f };
+    result = mtlCopyDataToBufferRange( buffer, 5 * sizeof( float ), &nan_and_peak[0], sizeof( float ) );
+    assert( result == MTL_SUCCESS );
+    result = mtlCopyDataToBufferRange( buffer, ( count - 1 ) * sizeof( float ), &nan_and_peak[1], sizeof( float ) );
+    assert( result == MTL_SUCCESS );
+    result = mtlReduceBuffer( command_queue, buffer, count, MTL_REDUCE_MAX, 0, &reduction );
+    assert( result == MTL_SUCCESS && reduction.value == 1000.0 && reduction.index == count - 1 );
+    result = mtlReduceBuffer( command_queue, buffer, count, MTL_REDUCE_ARGMIN, 0, &reduction );
+    assert( result == MTL_SUCCESS && reduction.value == -500.0 && reduction.index == 0 );
+    result = mtlReduceBuffer( command_queue, buffer, count, MTL_REDUCE_SUM, 0, &reduction );
+    assert( result == MTL_SUCCESS && std::isnan( reduction.value ) );
+    result = mtlReduceBuffer( command_queue, buffer, 5, MTL_REDUCE_MIN, 0, &reduction );
+    assert( result == MTL_SUCCESS && reduction.value == -500.0 );
+    
+    // All NaN: the result is NaN at index zero
+    float all_nan[3] = { NAN, NAN, NAN };
+    result = mtlCopyDataToBufferRange( buffer, 0, all_nan, sizeof( all_nan ) );
+    assert( result == MTL_SUCCESS );
+    result = mtlReduceBuffer( command_queue, buffer, 3, MTL_REDUCE_MAX, 0, &reduction );
+    assert( result == MTL_SUCCESS && std::isnan( reduction.value ) && reduction.index == 0 );
+    
+    // Invalid reductions are rejected
+    result = mtlReduceBuffer( command_queue, buffer, 0, MTL_REDUCE_SUM, 0, &reduction );
+    assert( result == MTL_ERROR );
+    result = mtlReduceBuffer( command_queue, buffer, count + 1, MTL_REDUCE_SUM, 0, &reduction );
+    assert( result == MTL_ERROR );
+    result = mtlReduceBuffer( command_queue, buffer, count, MTL_REDUCE_NORM + 1, 0, &reduction );
+    assert( result == MTL_ERROR );
+    result = mtlReduceBuffer( command_queue, buffer, count, MTL_REDUCE_SUM, 2, &reduction );
+    assert( result == MTL_ERROR );
+    result = mtlReduceBuffer( command_queue, buffer, count, MTL_REDUCE_SUM, 0, NULL );
+    assert( result == MTL_ERROR );
+    result = mtlReduceBuffer( INVALID_HANDLE, buffer, count, MTL_REDUCE_SUM, 0, &reduction );
+    assert( result == MTL_ERROR );
+    mtlFreeBuffer( buffer );
+    
+    // Along each dimension of an array large enough to be split between threads, with ties in every output
+    const uint64_t dimensions[3] = { 600, 20, 40 };
+    const uint64_t elements = dimensions[0] * dimensions[1] * dimensions[2];
+    std::vector<float> array( elements );
+    for ( uint64_t i = 0; i < elements; i++ )
+        array[ i ] = (float)( ( i * 37 ) % 11 );
+    BufferHandle source = mtlNewBuffer( device, elements * sizeof( float ) );
+    result = mtlCopyDataToBuffer( source, array.data(), elements * sizeof( float ) );
+    assert( result == MTL_SUCCESS );
+    BufferHandle destination = mtlNewBuffer( device, elements * sizeof( float ) );
+    std::vector<float> values( elements );
+    for ( uint32_t dimension = 0; dimension < 3; dimension++ )
+    {
+        uint64_t inner = 1;
+        for ( uint32_t d = 0; d < dimension; d++ )
+            inner *= dimensions[ d ];
+        uint64_t outputs = elements / dimensions[ dimension ];
+        for ( uint32_t operation = MTL_REDUCE_SUM; operation <= MTL_REDUCE_NORM; operation++ )
+        {
+            CommandBufferHandle command_buffer = mtlNewCommandBuffer( command_queue );
+            result = mtlEncodeReduceDimension( command_buffer, source, dimensions, dimension, operation, destination );
+            assert( result == MTL_SUCCESS );
+            result = mtlCommitCommandBuffer( command_buffer );
+            assert( result == MTL_SUCCESS );
+            result = mtlWaitForCompletion( command_buffer );
+            assert( result == MTL_SUCCESS );
+            mtlFreeCommandBuffer( command_buffer );
+            result = mtlCopyDataFromBuffer( destination, values.data(), outputs * sizeof( float ) );
+            assert( result == MTL_SUCCESS );
+            
+            for ( uint64_t t = 0; t < outputs; t++ )
+            {
+                uint64_t first = ( t / inner ) * inner * dimensions[ dimension ] + t % inner;
+                uint32_t expected_index;
+                double expected = referenceReduce( array, first, inner, dimensions[ dimension ], operation, &expected_index );
+                if ( operation == MTL_REDUCE_ARGMIN || operation == MTL_REDUCE_ARGMAX )
+                    assert( ( (const uint32_t *)values.data() )[ t ] == expected_index );
+                else
+                    assert( fabs( values[ t ] - expected ) <= 1e-5 * ( 1.0 + fabs( expected ) ) );
+            }
+        }
+    }
+    
+    // Invalid dimensions, operations and a destination too small are rejected
+    CommandBufferHandle command_buffer = mtlNewCommandBuffer( command_queue );
+    result = mtlEncodeReduceDimension( command_buffer, source, dimensions, 3, MTL_REDUCE_SUM, destination );
+    assert( result == MTL_ERROR );
+    result = mtlEncodeReduceDimension( command_buffer, source, dimensions, 0, MTL_REDUCE_NORM + 1, destination );
+    assert( result == MTL_ERROR );
+    const uint64_t too_large[3] = { 600, 20, 41 };
+    result = mtlEncodeReduceDimension( command_buffer, source, too_large, 0, MTL_REDUCE_SUM, destination );
+    assert( result == MTL_ERROR );
+    BufferHandle small = mtlNewBuffer( device, sizeof( float ) );
+    result = mtlEncodeReduceDimension( command_buffer, source, dimensions, 0, MTL_REDUCE_SUM, small );
+    assert( result == MTL_ERROR );
+    mtlFreeBuffer( small );
+    mtlFreeCommandBuffer( command_buffer );
+    
+    mtlFreeBuffer( destination );
+    mtlFreeBuffer( source );
+}
+
+
+// Run an element-wise program to completion
+uint32_t runElementwise( CommandQueueHandle command_queue, const mtlElementwiseOp * program, uint32_t program_length,
+                         const BufferHandle * inputs, uint32_t num_inputs, const float * constants, uint32_t num_constants,
+                         BufferHandle output, uint64_t num_elements )
+{
+    CommandBufferHandle command_buffer = mtlNewCommandBuffer( command_queue );
+    uint32_t result = mtlEncodeElementwise( command_buffer, program, program_length, inputs, num_inputs, constants, num_constants, output, num_elements );
+    if ( result == MTL_SUCCESS )
+        result = mtlCommitCommandBuffer( command_buffer );
+    if ( result == MTL_SUCCESS )
+        result = mtlWaitForCompletion( command_buffer );
+    mtlFreeCommandBuffer( command_buffer );
+    return result;
+}
+
+
+void testElementwise( DeviceHandle device, CommandQueueHandle command_queue )
+{
+    // Not a multiple of the tile or SIMD width
+    const uint64_t count = 100003;
+    std::vector<float> a( count ), b( count ), c( count );
+    for ( uint64_t i = 0; i < count; i++ )
+    {
+        a[ i ] = (float)( ( i * 7919 ) % 1000 ) / 100.0f - 5.0f;
+        b[ i ] = (float)( ( i * 104729 ) % 997 ) / 50.0f;
+        c[ i ] = (float)( i % 13 );
+    }
+    c[ 17 ] = NAN;
+    BufferHandle inputs[3];
+    const std::vector<float> * data[3] = { &a, &b, &c };
+    for ( int k = 0; k < 3; k++ )
+    {
+        inputs[ k ] = mtlNewBuffer( device, count * sizeof( float ) );
+        uint32_t result = mtlCopyDataToBuffer( inputs[ k ], data[ k ]->data(), count * sizeof( float ) );
+        assert( result == MTL_SUCCESS );
+    }
+    BufferHandle output = mtlNewBuffer( device, count * sizeof( float ) );
+    std::vector<float> values( count );
+    
+    // max( a + 0.5 * b, c ) - abs( a ) / 2 in one pass; max ignores the NaN
+    const mtlElementwiseOp fused[] = {
+        { MTL_ELEMENTWISE_INPUT, 0 }, { MTL_ELEMENTWISE_CONSTANT, 0 }, { MTL_ELEMENTWISE_INPUT, 1 }, { MTL_ELEMENTWISE_MULTIPLY, 0 },
+        { MTL_ELEMENTWISE_ADD, 0 }, { MTL_ELEMENTWISE_INPUT, 2 }, { MTL_ELEMENTWISE_MAX, 0 },
+        { MTL_ELEMENTWISE_INPUT, 0 }, { MTL_ELEMENTWISE_ABS, 0 }, { MTL_ELEMENTWISE_CONSTANT, 1 }, { MTL_ELEMENTWISE_DIVIDE, 0 },
+        { MTL_ELEMENTWISE_SUBTRACT, 0 } };
+    const uint32_t fused_length = sizeof( fused ) / sizeof( fused[0] );
+    const float constants[2] = { 0.5f, 2.0f };
+    uint32_t result = runElementwise( command_queue, fused, fused_length, inputs, 3, constants, 2, output, count );
+    assert( result == MTL_SUCCESS );
+    result = mtlCopyDataFromBuffer( output, values.data(), count * sizeof( float ) );
+    assert( result == MTL_SUCCESS );
+    for ( uint64_t i = 0; i < count; i++ )
+    {
+        float expected = fmaxf( a[ i ] + 0.5f * b[ i ], c[ i ] ) - fabsf( a[ i ] ) / 2.0f;
+        assert( fabsf( values[ i ] - expected ) <= 1e-6f * ( 1.0f + fabsf( expected ) ) );
+    }
+    
+    // Only the first num_elements are written, and the output may be an input: a = -( a * a ) + c on a prefix
+    const mtlElementwiseOp in_place[] = {
+        { MTL_ELEMENTWISE_INPUT, 0 }, { MTL_ELEMENTWISE_INPUT, 0 }, { MTL_ELEMENTWISE_MULTIPLY, 0 },
+        { MTL_ELEMENTWISE_NEGATE, 0 }, { MTL_ELEMENTWISE_INPUT, 1 }, { MTL_ELEMENTWISE_ADD, 0 } };
+    const BufferHandle in_place_inputs[2] = { inputs[0], inputs[2] };
+    const uint64_t prefix = 1000;
+    result = runElementwise( command_queue, in_place, 6, in_place_inputs, 2, NULL, 0, inputs[0], prefix );
+    assert( result == MTL_SUCCESS );
+    result = mtlCopyDataFromBuffer( inputs[0], values.data(), count * sizeof( float ) );
+    assert( result == MTL_SUCCESS );
+    for ( uint64_t i = 0; i < count; i++ )
+    {
+        if ( i == 17 )
+            assert( std::isnan( values[ i ] ) );
+        else
+            assert( values[ i ] == ( i < prefix ? -( a[ i ] * a[ i ] ) + c[ i ] : a[ i ] ) );
+    }
+    
+    // A constant alone fills the output
+    const mtlElementwiseOp fill[] = { { MTL_ELEMENTWISE_CONSTANT, 0 }, { MTL_ELEMENTWISE_MIN, 0 } };
+    result = runElementwise( command_queue, fill, 1, NULL, 0, &constants[1], 1, output, count );
+    assert( result == MTL_SUCCESS );
+    result = mtlCopyDataFromBuffer( output, values.data(), count * sizeof( float ) );
+    assert( result == MTL_SUCCESS );
+    assert( std::count( values.begin(), values.end(), 2.0f ) == (long)count );
+    
+    // Malformed programs and buffers are rejected when encoding
+    CommandBufferHandle command_buffer = mtlNewCommandBuffer( command_queue );
+    result = mtlEncodeElementwise( command_buffer, fill, 2, NULL, 0, constants, 1, output, count );
+    assert( result == MTL_ERROR );
+    const mtlElementwiseOp leftover[] = { { MTL_ELEMENTWISE_INPUT, 0 }, { MTL_ELEMENTWISE_INPUT, 1 } };
+    result = mtlEncodeElementwise( command_buffer, leftover, 2, inputs, 2, NULL, 0, output, count );
+    assert( result == MTL_ERROR );
+    result = mtlEncodeElementwise( command_buffer, leftover, 2, inputs, 1, NULL, 0, output, count );
+    assert( result == MTL_ERROR );
+    const mtlElementwiseOp unknown[] = { { MTL_ELEMENTWISE_INPUT, 0 }, { MTL_ELEMENTWISE_ABS + 1, 0 } };
+    result = mtlEncodeElementwise( command_buffer, unknown, 2, inputs, 1, NULL, 0, output, count );
+    assert( result == MTL_ERROR );
+    std::vector<mtlElementwiseOp> deep( 2 * MTL_ELEMENTWISE_MAX_STACK + 1, mtlElementwiseOp{ MTL_ELEMENTWISE_INPUT, 0 } );
+    for ( uint32_t i = MTL_ELEMENTWISE_MAX_STACK + 1; i < deep.size(); i++ )
+        deep[ i ].opcode = MTL_ELEMENTWISE_ADD;
+    result = mtlEncodeElementwise( command_buffer, deep.data(), (uint32_t)deep.size(), inputs, 1, NULL, 0, output, count );
+    assert( result == MTL_ERROR );
+    deep.erase( deep.begin() );
+    deep.pop_back();
+    result = mtlEncodeElementwise( command_buffer, deep.data(), (uint32_t)deep.size(), inputs, 1, NULL, 0, output, count );
+    assert( result == MTL_SUCCESS );
+    result = mtlEncodeElementwise( command_buffer, fused, fused_length, inputs, 3, constants, 2, output, count + 1 );
+    assert( result == MTL_ERROR );
+    result = mtlEncodeElementwise( command_buffer, fused, fused_length, inputs, 3, constants, 2, output, 0 );
+    assert( result == MTL_ERROR );
+    result = mtlEncodeElementwise( command_buffer, fused, fused_length, inputs, 3, NULL, 2, output, count );
+    assert( result == MTL_ERROR );
+    result = mtlEncodeElementwise( command_buffer, fused, fused_length, inputs, 3, constants, 2, INVALID_HANDLE, count );
+    assert( result == MTL_ERROR );
+    result = mtlEncodeElementwise( INVALID_HANDLE, fused, fused_length, inputs, 3, constants, 2, output, count );
+    assert( result == MTL_ERROR );
+    mtlFreeCommandBuffer( command_buffer );
+    
+    mtlFreeBuffer( output );
+    for ( int k = 0; k < 3; k++ )
+        mtlFreeBuffer( inputs[ k ] );
+}
+
+
+// Expected bits of a value converted back to a 16-bit format: NaNs come back quiet
+uint16_t quietened( uint16_t bits, uint32_t format )
+{
+    if ( format == MTL_FORMAT_HALF )
+        return ( ( bits & 0x7C00 ) == 0x7C00 && ( bits & 0x3FF ) ) ? bits | 0x0200 : bits;
+    return ( ( bits & 0x7F80 ) == 0x7F80 && ( bits & 0x7F ) ) ? bits | 0x0040 : bits;
+}
+
+
+void testFloatFormats( DeviceHandle device, CommandQueueHandle command_queue )
+{
+    // Rounding to nearest even, overflow, subnormals and NaN
+    const float values[] = { 1.0f, -0.0f, 65504.0f, 65520.0f, 65519.0f, ldexpf( 1.0f, -24 ), ldexpf( 1.0f, -25 ), ldexpf( 3.0f, -25 ),
+                             1.0f + ldexpf( 1.0f, -8 ), 1.0f + ldexpf( 3.0f, -8 ), INFINITY, NAN };
+    const uint16_t halves[] = { 0x3C00, 0x8000, 0x7BFF, 0x7C00, 0x7BFF, 0x0001, 0x0000, 0x0002, 0x3C04, 0x3C0C, 0x7C00, 0x7E00 };
+    const uint16_t bfloats[] = { 0x3F80, 0x8000, 0x4780, 0x4780, 0x4780, 0x3380, 0x3300, 0x33C0, 0x3F80, 0x3F82, 0x7F80, 0x7FC0 };
+    const uint32_t num_values = sizeof( values ) / sizeof( values[0] );
+    BufferHandle small = mtlNewBuffer( device, sizeof( values ) );
+    uint16_t bits[ num_values ];
+    uint32_t result = mtlCopyFloatsToBuffer( small, 0, values, num_values, MTL_FORMAT_HALF );
+    assert( result == MTL_SUCCESS );
+    result = mtlCopyDataFromBuffer( small, bits, sizeof( bits ) );
+    assert( result == MTL_SUCCESS );
+    for ( uint32_t i = 0; i < num_values; i++ )
+        assert( bits[ i ] == halves[ i ] );
+    result = mtlCopyFloatsToBuffer( small, 0, values, num_values, MTL_FORMAT_BFLOAT16 );
+    assert( result == MTL_SUCCESS );
+    result = mtlCopyDataFromBuffer( small, bits, sizeof( bits ) );
+    assert( result == MTL_SUCCESS );
+    for ( uint32_t i = 0; i < num_values; i++ )
+        assert( bits[ i ] == bfloats[ i ] );
+    
+    // Elements are counted in the format, so a buffer holds twice as many halves as floats
+    float back[ 2 * num_values ];
+    result = mtlCopyFloatsToBuffer( small, num_values, values, num_values, MTL_FORMAT_HALF );
+    assert( result == MTL_SUCCESS );
+    result = mtlCopyFloatsFromBuffer( small, num_values, back, num_values, MTL_FORMAT_HALF );
+    assert( result == MTL_SUCCESS );
+    assert( back[0] == 1.0f && back[3] == INFINITY && back[5] == ldexpf( 1.0f, -24 ) && std::isnan( back[ num_values - 1 ] ) );
+    result = mtlCopyFloatsFromBuffer( small, 0, back, 2 * num_values, MTL_FORMAT_FLOAT );
+    assert( result == MTL_ERROR );
+    result = mtlCopyFloatsToBuffer( small, num_values + 1, values, num_values, MTL_FORMAT_HALF );
+    assert( result == MTL_ERROR );
+    result = mtlCopyFloatsToBuffer( small, 0, values, num_values, MTL_FORMAT_BFLOAT16 + 1 );
+    assert( result == MTL_ERROR );
+    result = mtlCopyFloatsFromBuffer( INVALID_HANDLE, 0, back, 1, MTL_FORMAT_HALF );
+    assert( result == MTL_ERROR );
+    mtlFreeBuffer( small );
+    
+    // Every 16-bit pattern, repeated past the size copies are split between threads at, widens and narrows back unchanged
+    const uint64_t count = 20 * 65536 + 7;
+    std::vector<uint16_t> patterns( count ), round_trip( count );
+    for ( uint64_t i = 0; i < count; i++ )
+        patterns[ i ] = (uint16_t)( i * 40503 );
+    std::vector<float> floats( count );
+    BufferHandle buffer = mtlNewBuffer( device, count * sizeof( uint16_t ) );
+    const uint32_t formats[2] = { MTL_FORMAT_HALF, MTL_FORMAT_BFLOAT16 };
+    for ( uint32_t format : formats )
+    {
+        result = mtlCopyDataToBuffer( buffer, patterns.data(), count * sizeof( uint16_t ) );
+        assert( result == MTL_SUCCESS );
+        result = mtlCopyFloatsFromBuffer( buffer, 0, floats.data(), count, format );
+        assert( result == MTL_SUCCESS );
+        result = mtlCopyFloatsToBuffer( buffer, 0, floats.data(), count, format );
+        assert( result == MTL_SUCCESS );
+        result = mtlCopyDataFromBuffer( buffer, round_trip.data(), count * sizeof( uint16_t ) );
+        assert( result == MTL_SUCCESS );
+        for ( uint64_t i = 0; i < count; i++ )
+            assert( round_trip[ i ] == quietened( patterns[ i ], format ) );
+        
+        // bfloat16 widens by a shift; halves are checked at the powers of two and the subnormal step
+        if ( format == MTL_FORMAT_BFLOAT16 )
+        {
+            for ( uint64_t i = 0; i < count; i += 997 )
+            {
+                uint32_t expected = (uint32_t)patterns[ i ] << 16, actual;
+                memcpy( &actual, &floats[ i ], sizeof( actual ) );
+                assert( actual == expected || std::isnan( floats[ i ] ) );
+            }
+        }
+        else
+        {
+            for ( uint64_t i = 0; i < 65536; i++ )
+            {
+                uint16_t h = patterns[ i ];
+                if ( ( h & 0x7FFF ) == 0x3C00 )
+                    assert( floats[ i ] == ( h & 0x8000 ? -1.0f : 1.0f ) );
+                if ( h == 0x0001 )
+                    assert( floats[ i ] == ldexpf( 1.0f, -24 ) );
+                if ( h == 0x03FF )
+                    assert( floats[ i ] == ldexpf( 1023.0f, -24 ) );
+            }
+        }
     }
+    
+    // Narrowing arbitrary floats: the result is one of the two neighbours, and the nearer one
+    std::vector<float> wide( count );
+    uint32_t state = 12345;
+    for ( uint64_t i = 0; i < count; i++ )
+    {
+        state = state * 1664525u + 1013904223u;
+        uint32_t pattern = ( state & 0x8FFFFFFF ) | ( ( state >> 4 ) & 0x70000000 );
+        memcpy( &wide[ i ], &pattern, sizeof( float ) );
+        if ( std::isnan( wide[ i ] ) || fabsf( wide[ i ] ) >= 65504.0f )
+            wide[ i ] = (float)i;
+    }
+    for ( uint32_t format : formats )
+    {
+        result = mtlCopyFloatsToBuffer( buffer, 0, wide.data(), count, format );
+        assert( result == MTL_SUCCESS );
+        result = mtlCopyFloatsFromBuffer( buffer, 0, floats.data(), count, format );
+        assert( result == MTL_SUCCESS );
+        double relative = format == MTL_FORMAT_HALF ? ldexp( 1.0, -11 ) : ldexp( 1.0, -8 );
+        double absolute = format == MTL_FORMAT_HALF ? ldexp( 1.0, -25 ) : ldexp( 1.0, -134 );
+        for ( uint64_t i = 0; i < count; i++ )
+            assert( fabs( (double)floats[ i ] - wide[ i ] ) <= relative * fabs( (double)wide[ i ] ) + absolute );
+    }
+    mtlFreeBuffer( buffer );
+    
+    // The reduced-precision kernel variants of MetalFunctionLibrary.mtl widen b and accumulate in float
+    const char source[] = R"""(
+        #include <metal_stdlib>
+        using namespace metal;
+
+        kernel void accumulate_half( device float *vA [[ buffer(0) ]], constant half *vB [[ buffer(1) ]], uint id[[ thread_position_in_grid ]] )
+        {
+            vA[id] += float( vB[id] );
+        }
+
+        kernel void maxval_half( device float *vA [[ buffer(0) ]], constant half *vB [[ buffer(1) ]], uint id[[ thread_position_in_grid ]] )
+        {
+            vA[id] = max( vA[id], float( vB[id] ) );
+        }
+
+        kernel void scaleaccum_bfloat16( device float *vA [[ buffer(0) ]], constant ushort *vB [[ buffer(1) ]],
+                                         constant float *scaleval[[ buffer(2) ]], uint id[[ thread_position_in_grid ]] )
+        {
+            vA[id] += as_type<float>( uint( vB[id] ) << 16 ) * scaleval[0];
+        }
+    )""";
+    LibraryHandle library = mtlNewLibrary( device, source );
+    assert( library != INVALID_HANDLE );
+    const char * names[3] = { "accumulate_half", "maxval_half", "scaleaccum_bfloat16" };
+    const uint32_t kernel_formats[3] = { MTL_FORMAT_HALF, MTL_FORMAT_HALF, MTL_FORMAT_BFLOAT16 };
+    const uint32_t elements = 300007;
+    std::vector<float> a( elements ), b( elements ), widened( elements ), output( elements );
+    for ( uint32_t i = 0; i < elements; i++ )
+    {
+        a[ i ] = (float)( i % 101 ) * 0.125f - 6.0f;
+        b[ i ] = (float)( i % 89 ) * 0.3f - 13.0f;
+    }
+    BufferHandle buffer_a = mtlNewBuffer( device, elements * sizeof( float ) );
+    BufferHandle buffer_b = mtlNewBuffer( device, elements * sizeof( uint16_t ) );
+    const float scale = 0.75f;
+    for ( int k = 0; k < 3; k++ )
+    {
+        ComputePipelineStateHandle pipeline = mtlComputePipelineStateForFunction( library, names[ k ] );
+        assert( pipeline != INVALID_HANDLE );
+        result = mtlCopyDataToBuffer( buffer_a, a.data(), elements * sizeof( float ) );
+        assert( result == MTL_SUCCESS );
+        result = mtlCopyFloatsToBuffer( buffer_b, 0, b.data(), elements, kernel_formats[ k ] );
+        assert( result == MTL_SUCCESS );
+        result = mtlCopyFloatsFromBuffer( buffer_b, 0, widened.data(), elements, kernel_formats[ k ] );
+        assert( result == MTL_SUCCESS );
+        
+        CommandBufferHandle command_buffer = mtlNewCommandBuffer( command_queue );
+        CommandEncoderHandle command_encoder = mtlNewCommandEncoder( command_buffer );
+        mtlSetComputePipelineState( command_encoder, pipeline );
+        mtlSetBuffer( command_encoder, buffer_a, 0 );
+        mtlSetBuffer( command_encoder, buffer_b, 1 );
+        mtlSetBytes( command_encoder, &scale, sizeof( scale ), 2 );
+        result = mtlSetThreadsAndShape( command_encoder, pipeline, elements, 1, 1 );
+        assert( result == MTL_SUCCESS );
+        mtlEndEncoding( command_encoder );
+        result = mtlCommitCommandBuffer( command_buffer );
+        assert( result == MTL_SUCCESS );
+        result = mtlWaitForCompletion( command_buffer );
+        assert( result == MTL_SUCCESS );
+        mtlFreeCommandEncoder( command_encoder );
+        mtlFreeCommandBuffer( command_buffer );
+        
+        result = mtlCopyDataFromBuffer( buffer_a, output.data(), elements * sizeof( float ) );
+        assert( result == MTL_SUCCESS );
+        for ( uint32_t i = 0; i < elements; i++ )
+        {
+            float expected = k == 0 ? a[ i ] + widened[ i ] : k == 1 ? std::max( a[ i ], widened[ i ] ) : a[ i ] + widened[ i ] * scale;
+            assert( fabsf( output[ i ] - expected ) <= 1e-6f * ( 1.0f + fabsf( expected ) ) );
+        }
+        mtlFreeComputePipelineState( pipeline );
+    }
+    mtlFreeBuffer( buffer_a );
+    mtlFreeBuffer( buffer_b );
+    mtlFreeLibrary( library );
+}
+
+
+void testProfiling( DeviceHandle device, CommandQueueHandle command_queue, ComputePipelineStateHandle compute_pipeline_state )
+{
+    const uint32_t count = 100000;
+    std::vector<float> data( count, 1.5f );
+    BufferHandle buffers[3];
+    for ( int i = 0; i < 3; i++ )
+        buffers[i] = mtlNewBuffer( device, count * sizeof( float ) );
+    
+    // 0 -> 1 and 0 -> 2 run together, then 1 -> 0 once they are done
+    mtlDispatch dispatches[3] = {};
+    const int bindings[3][2] = { { 0, 1 }, { 0, 2 }, { 1, 0 } };
+    for ( int d = 0; d < 3; d++ )
+    {
+        dispatches[d].compute_pipeline_state = compute_pipeline_state;
+        dispatches[d].buffers[0] = buffers[ bindings[d][0] ];
+        dispatches[d].buffers[1] = buffers[ bindings[d][1] ];
+        dispatches[d].num_buffers = 2;
+        dispatches[d].width = count;
+        dispatches[d].height = 1;
+        dispatches[d].depth = 1;
+    }
+    
+    // Nothing is recorded while profiling is off
+    mtlClearProfile();
+    assert( mtlProfilingEnabled() == 0 );
+    CommandBufferHandle command_buffer = mtlSubmitDispatches( command_queue, dispatches, 3 );
+    assert( mtlWaitForCompletion( command_buffer ) == MTL_SUCCESS );
+    mtlCommandBufferTiming timing;
+    assert( mtlGetCommandBufferTiming( command_buffer, &timing ) == MTL_ERROR );
+    mtlFreeCommandBuffer( command_buffer );
+    mtlProfileStats stats;
+    mtlGetProfileStats( &stats );
+    assert( stats.commits == 0 && stats.waits == 0 );
+    
+    mtlSetProfilingEnabled( 1 );
+    assert( mtlProfilingEnabled() == 1 );
+    double before = mtlProfileTime();
+    uint32_t result = mtlCopyDataToBuffer( buffers[0], data.data(), count * sizeof( float ) );
+    assert( result == MTL_SUCCESS );
+    command_buffer = mtlNewCommandBuffer( command_queue );
+    result = mtlEncodeDispatches( command_buffer, dispatches, 3 );
+    assert( result == MTL_SUCCESS );
+    assert( mtlGetCommandBufferTiming( command_buffer, &timing ) == MTL_ERROR );
+    result = mtlCommitCommandBuffer( command_buffer );
+    assert( result == MTL_SUCCESS );
+    result = mtlWaitForCompletion( command_buffer );
+    assert( result == MTL_SUCCESS );
+    result = mtlCopyDataFromBuffer( buffers[0], data.data(), count * sizeof( float ) );
+    assert( result == MTL_SUCCESS && data[0] == 1.5f * 1.5f * 1.5f * 1.5f );
+    double after = mtlProfileTime();
+    
+    result = mtlGetCommandBufferTiming( command_buffer, &timing );
+    assert( result == MTL_SUCCESS );
+    assert( timing.num_dispatches == 3 && timing.status == MTL_COMMAND_BUFFER_COMPLETED );
+    assert( before <= timing.encode_start && timing.encode_start <= timing.encode_end );
+    assert( timing.encode_end <= timing.commit_time && timing.commit_time <= timing.start_time );
+    assert( timing.start_time <= timing.end_time && timing.end_time <= after );
+    
+    mtlDispatchTiming dispatch_timing[3];
+    for ( uint32_t d = 0; d < 3; d++ )
+    {
+        result = mtlGetDispatchTiming( command_buffer, d, &dispatch_timing[d] );
+        assert( result == MTL_SUCCESS );
+        assert( strcmp( dispatch_timing[d].function_name, "sqr" ) == 0 );
+        assert( dispatch_timing[d].width == count && dispatch_timing[d].height == 1 && dispatch_timing[d].depth == 1 );
+        assert( dispatch_timing[d].encode_time == timing.encode_start );
+        assert( timing.start_time <= dispatch_timing[d].start_time && dispatch_timing[d].start_time <= dispatch_timing[d].end_time );
+        assert( dispatch_timing[d].end_time <= timing.end_time );
+    }
+#ifndef __APPLE__
+    assert( dispatch_timing[2].start_time >= std::max( dispatch_timing[0].end_time, dispatch_timing[1].end_time ) );
+#endif
+    assert( mtlGetDispatchTiming( command_buffer, 3, &dispatch_timing[0] ) == MTL_ERROR );
+    
+    mtlGetProfileStats( &stats );
+    assert( stats.copies_in == 1 && stats.bytes_in == count * sizeof( float ) );
+    assert( stats.copies_out == 1 && stats.bytes_out == count * sizeof( float ) );
+    assert( stats.commits == 1 && stats.waits == 1 && stats.dropped_events == 0 );
+    assert( stats.copy_in_seconds >= 0 && stats.wait_seconds >= 0 );
+    
+    // The trace holds the host work, the command buffer and its dispatches
+    char path[] = "/tmp/MatlabMetalTraceXXXXXX";
+    int descriptor = mkstemp( path );
+    assert( descriptor >= 0 );
+    close( descriptor );
+    result = mtlWriteProfileTrace( path );
+    assert( result == MTL_SUCCESS );
+    std::ifstream file( path );
+    std::stringstream contents;
+    contents << file.rdbuf();
+    std::string trace = contents.str();
+    unlink( path );
+    auto occurrences = [ & ]( const std::string & text ) {
+        size_t found = 0;
+        for ( size_t at = trace.find( text ); at != std::string::npos; at = trace.find( text, at + 1 ) )
+            found++;
+        return found;
+    };
+    assert( trace.compare( 0, 17, "{\"displayTimeUnit" ) == 0 && trace.find( "\n]}" ) != std::string::npos );
+    assert( occurrences( "\"cat\":\"dispatch\"" ) == 3 && occurrences( "\"name\":\"sqr\"" ) == 3 );
+    assert( occurrences( "\"cat\":\"command_buffer\"" ) == 1 && occurrences( "\"cat\":\"encode\"" ) == 1 );
+    assert( occurrences( "\"cat\":\"copy_in\"" ) == 1 && occurrences( "\"cat\":\"copy_out\"" ) == 1 );
+    assert( mtlWriteProfileTrace( "/nonexistent/trace.json" ) == MTL_ERROR );
+    
+    // Timing outlives clearing and disabling; the trace does not
+    mtlSetProfilingEnabled( 0 );
+    mtlClearProfile();
+    mtlGetProfileStats( &stats );
+    assert( stats.commits == 0 && stats.copies_in == 0 && stats.bytes_out == 0 );
+    assert( mtlGetCommandBufferTiming( command_buffer, &timing ) == MTL_SUCCESS );
+    mtlFreeCommandBuffer( command_buffer );
+    
+    for ( int i = 0; i < 3; i++ )
+        mtlFreeBuffer( buffers[i] );
 }
 
 
@@ -85,13 +2166,19 @@ int main(int argc, const char * argv[]) {
         }
     )""";
     
+    // On the CPU backend sqr is a built-in host kernel
     LibraryHandle library = mtlNewLibrary( device, source );
     assert( library != INVALID_HANDLE );
     device2 = mtlLibraryDevice( library );
     assert( mtlSameDevice( device, device2 ) );
     mtlFreeDevice( device2 );
+    testLibraryCache( device, source );
+    testDevices( source );
+    testPipelineStateCache( device, library );
            
-    // *****   Build an invalid library
+    char error[1024];
+#ifdef __APPLE__
+    // *****   Build an invalid library (the CPU backend does not compile Metal source)
     const char invalidsource[] = R"""(
         #include <metal_stdlib>
         using namespace metal // Missing a semicolon here
@@ -107,10 +2194,10 @@ int main(int argc, const char * argv[]) {
     
     LibraryHandle invalidlibrary = mtlNewLibrary( device, invalidsource );
     assert( invalidlibrary == INVALID_HANDLE );
-    char error[1024];
     cout << "Expecting a failed compilation message -> ";
     mtlGetLastError(error, 1024);
     cout << error << endl ;
+#endif
     
     // Create a valid function
     FunctionHandle function = mtlNewFunction(library, "sqr");
@@ -188,10 +2275,34 @@ int main(int argc, const char * argv[]) {
     // Verify the data
     for (int i = 0; i < num_elements; i++ )
         assert( test_data[i] == return_data[i] );
-    
+
+    // Map the buffer, read it in place and write one element back
+    assert( mtlMapBuffer( buffer, 0 ) == NULL );
+    float * mapped = (float *)mtlMapBuffer( buffer, MTL_MAP_READ_WRITE );
+    assert( mapped != NULL );
+    for (int i = 0; i < num_elements; i++ )
+        assert( mapped[i] == test_data[i] );
+    mapped[1] = -1.0f;
+    assert( mtlUnmapBuffer( buffer, 0, buffer_length + 1 ) == MTL_ERROR );
+    result = mtlUnmapBuffer( buffer, sizeof(float), sizeof(float) );
+    assert( result == MTL_SUCCESS );
+    result = mtlCopyDataFromBuffer(buffer, (uint8_t *)return_data, buffer_length);
+    assert( result == MTL_SUCCESS );
+    assert( return_data[0] == test_data[0] && return_data[1] == -1.0f );
+
     // Check that deallocation works (this test may be a bit flaky depending on the device's lazy free of memory.)
     mtlFreeBuffer(buffer);
     assert( mtlBufferSize(buffer) == 0);
+    
+    // A recycled handle slot must not revive the freed handle
+    BufferHandle recycled = mtlNewBuffer( device, 16 );
+    assert( recycled != buffer );
+    assert( mtlBufferSize(buffer) == 0 );
+    mtlFreeBuffer(recycled);
+    
+    testConcurrentHandles( device );
+    testRegions( device );
+    testBufferPool( device );
     int64_t StartingAllocation = mtlGetDeviceAllocatedMemory( device );
     for (int i = 0; i < 10; i++)
     {
@@ -232,6 +2343,23 @@ int main(int argc, const char * argv[]) {
     result = mtlWaitForCompletion( command_buffer );
     assert( result == MTL_SUCCESS );
     
+    testAsyncCommandBuffers( device, command_queue, compute_pipeline_state );
+    testDispatchBatch( device, command_queue, compute_pipeline_state );
+    testThreadgroupSizes( device, command_queue, compute_pipeline_state );
+    testSetBytes( device, command_queue );
+    testConcurrentEncoder( device, command_queue, compute_pipeline_state );
+    testEvents( device, compute_pipeline_state );
+    testStreaming( device, command_queue, compute_pipeline_state );
+    testFileBuffers( device, command_queue, compute_pipeline_state );
+    testHostPointerBuffers( device, command_queue, compute_pipeline_state );
+    testCommandLists( device, command_queue, compute_pipeline_state );
+    testIndirectDispatch( device, command_queue );
+    testLibraryKernels( device, command_queue );
+    testReductions( device, command_queue );
+    testElementwise( device, command_queue );
+    testFloatFormats( device, command_queue );
+    testProfiling( device, command_queue, compute_pipeline_state );
+    
     // Check the results
     result = mtlCopyDataFromBuffer(return_buffer, (uint8_t *)return_data, buffer_length);
     assert( result == MTL_SUCCESS );
@@ -0,0 +1,99 @@
+//
+//  ThreadgroupSize.h
+//  MatlabMetal
+//
+//  Threadgroup shapes for a dispatch grid, shared by the Metal and CPU backends.
+//
+
+#ifndef ThreadgroupSize_h
+#define ThreadgroupSize_h
+
+#include <stdint.h>
+
+#define THREADGROUP_MAX_CANDIDATES 32
+
+
+static inline uint32_t mtlThreadgroupMin( uint32_t a, uint32_t b )
+{
+    return a < b ? a : b;
+}
+
+
+/**
+ * Fill the remaining dimensions of a threadgroup whose width is already set,
+ * without exceeding the grid or max_threads in total.
+ */
+static inline void mtlFillThreadgroup( const uint32_t grid[3], uint32_t max_threads, uint32_t group[3] )
+{
+    uint32_t height = max_threads / group[0];
+    group[1] = height > 0 ? mtlThreadgroupMin( grid[1], height ) : 1;
+    uint32_t depth = max_threads / ( group[0] * group[1] );
+    group[2] = depth > 0 ? mtlThreadgroupMin( grid[2], depth ) : 1;
+}
+
+
+/**
+ * Default threadgroup shape for a grid. The width is a whole number of SIMD
+ * groups (execution_width threads): as wide as allowed for a one-dimensional
+ * grid, otherwise one SIMD group wide with the rest of the threads stacked
+ * along the height and then the depth.
+ */
+static inline void mtlDefaultThreadgroupSize( const uint32_t grid[3], uint32_t execution_width, uint32_t max_threads, uint32_t group[3] )
+{
+    if ( execution_width == 0 )
+        execution_width = 1;
+    if ( max_threads >= execution_width )
+        max_threads -= max_threads % execution_width;
+    if ( max_threads == 0 )
+        max_threads = 1;
+
+    uint32_t width = ( grid[1] == 1 && grid[2] == 1 ) ? max_threads : mtlThreadgroupMin( execution_width, max_threads );
+    group[0] = mtlThreadgroupMin( width, grid[0] );
+    mtlFillThreadgroup( grid, max_threads, group );
+}
+
+
+/**
+ * Threadgroup shapes worth timing for a grid: widths of one, two, four...
+ * SIMD groups, each with heights of successive powers of two, starting with
+ * the default shape. Returns the number of candidates written.
+ */
+static inline uint32_t mtlThreadgroupCandidates( const uint32_t grid[3], uint32_t execution_width, uint32_t max_threads,
+                                                 uint32_t candidates[ THREADGROUP_MAX_CANDIDATES ][3] )
+{
+    uint32_t count = 0;
+    mtlDefaultThreadgroupSize( grid, execution_width, max_threads, candidates[ count++ ] );
+    if ( execution_width == 0 )
+        execution_width = 1;
+
+    for ( uint64_t width = execution_width; width <= max_threads && count < THREADGROUP_MAX_CANDIDATES; width *= 2 )
+    {
+        uint32_t group_width = mtlThreadgroupMin( (uint32_t)width, grid[0] );
+        for ( uint64_t height = 1; group_width * height <= max_threads && count < THREADGROUP_MAX_CANDIDATES; height *= 2 )
+        {
+            uint32_t candidate[3] = { group_width, mtlThreadgroupMin( (uint32_t)height, grid[1] ), 1 };
+            uint32_t depth = max_threads / ( candidate[0] * candidate[1] );
+            candidate[2] = mtlThreadgroupMin( grid[2], depth > 0 ? depth : 1 );
+
+            uint32_t seen = 0;
+            for ( uint32_t c = 0; c < count; c++ )
+                if ( candidates[ c ][0] == candidate[0] && candidates[ c ][1] == candidate[1] && candidates[ c ][2] == candidate[2] )
+                    seen = 1;
+            if ( !seen )
+            {
+                candidates[ count ][0] = candidate[0];
+                candidates[ count ][1] = candidate[1];
+                candidates[ count ][2] = candidate[2];
+                count++;
+            }
+            if ( height >= grid[1] )
+                break;
+        }
+        if ( width >= grid[0] )
+            break;
+    }
+    return count;
+}
+
+
+#endif /* ThreadgroupSize_h */
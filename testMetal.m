@@ -104,6 +104,45 @@ classdef testMetal < matlab.unittest.TestCase
         end
         
         
+        function testLibraryCache( testCase, TestSource )
+            
+            if ~TestSource.isValid
+                return
+            end
+            
+            device = Metal.GetDeviceAtIndex( 1 );
+            testCase.verifyGreaterThan( device, 0, Metal.LastError );
+            
+            Metal.ClearLibraryCache;
+            library = Metal.NewLibrary( device, TestSource.source );
+            library2 = Metal.NewLibrary( device, TestSource.source );
+            precise = Metal.NewLibraryWithOptions( device, TestSource.source, 0 );
+            testCase.verifyGreaterThan( library, 0, Metal.LastError );
+            testCase.verifyGreaterThan( precise, 0, Metal.LastError );
+            testCase.verifyNotEqual( library, library2 );
+            
+            stats = Metal.LibraryCacheStats;
+            testCase.verifyEqual( stats.memory_hits, uint64(1) );
+            testCase.verifyEqual( stats.misses + stats.disk_hits, uint64(2) );
+            testCase.verifyEqual( stats.entries, uint64(2) );
+            
+            cps = Metal.ComputePipelineStateForFunction( library, TestSource.functionName );
+            cps2 = Metal.ComputePipelineStateForFunction( library2, TestSource.functionName );
+            testCase.verifyGreaterThan( cps, 0, Metal.LastError );
+            testCase.verifyGreaterThan( cps2, 0, Metal.LastError );
+            testCase.verifyGreaterThan( Metal.ThreadExecutionWidth( cps2 ), 0 );
+            invalid_cps = Metal.ComputePipelineStateForFunction( library, TestSource.functionName + "z" );
+            testCase.verifyEqual( invalid_cps, uint64(0) );
+            Metal.FreeComputePipelineState( cps );
+            Metal.FreeComputePipelineState( cps2 );
+            
+            Metal.FreeLibrary( library );
+            Metal.FreeLibrary( library2 );
+            Metal.FreeLibrary( precise );
+            Metal.FreeDevice( device );
+        end
+        
+        
         function testFunctionCreation( testCase, TestSource )
             
             if ~TestSource.isValid
@@ -193,6 +232,14 @@ classdef testMetal < matlab.unittest.TestCase
             testCase.verifyEqual( result, uint32(1), Metal.LastError);
             testCase.verifyEqual( testdata, returndata );
             
+            buffer2 = Metal.NewBuffer( device, numel(testdata) );
+            result = Metal.CopyBufferToBuffer( buffer2, buffer );
+            testCase.verifyEqual( result, uint32(1), Metal.LastError);
+            [ returndata, result ] = Metal.CopyDataFromBuffer( buffer2 );
+            testCase.verifyEqual( result, uint32(1), Metal.LastError);
+            testCase.verifyEqual( testdata, returndata );
+            Metal.FreeBuffer( buffer2 );
+            
             Metal.FreeBuffer( buffer  );
             testCase.verifyEqual( Metal.BufferSize( buffer ), 0);
             Metal.FreeDevice( device );
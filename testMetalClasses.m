@@ -194,6 +194,25 @@ classdef testMetalClasses < matlab.unittest.TestCase
         end
         
         
+        function testBufferRegion( testCase )
+            device = MetalDevice( 1 );
+            testdata = rand(100, 80, 6, 'single');
+            
+            buffer = MetalBuffer( device, testdata );
+            testCase.verifyTrue( buffer.isValid );
+            
+            outdata = buffer.ReadRegion( [ 11 21 2 ], [ 30 40 3 ] );
+            testCase.verifyEqual( outdata, testdata( 11:40, 21:60, 2:4 ) );
+            
+            slice = rand( 100, 80, 'single' );
+            testCase.verifyTrue( buffer.WriteRegion( [ 1 1 5 ], slice ) );
+            testdata( :, :, 5 ) = slice;
+            testCase.verifyEqual( single( buffer ), testdata );
+            
+            testCase.verifyFalse( buffer.WriteRegion( [ 90 1 1 ], slice ) );
+        end
+        
+        
         function testBufferMove( testCase )
             device = MetalDevice( 1 );
             testdata = rand(1000, 1000, 3, 'single');
@@ -224,6 +243,33 @@ classdef testMetalClasses < matlab.unittest.TestCase
         end
         
         
+        function testBufferPool( testCase )
+            device = MetalDevice( 1 );
+            dimensions = [1000, 1000, 2];
+            
+            buffer = MetalBuffer( device, dimensions );
+            testCase.verifyTrue( buffer.isValid );
+            delete( buffer );
+            before = device.BufferPoolStats;
+            
+            for i = 1:5
+                buffer = MetalBuffer( device, dimensions );
+                testCase.verifyTrue( buffer.isValid );
+                testCase.verifyEqual( buffer.numbytes, prod( dimensions ) * 4 );
+                delete( buffer );
+            end
+            
+            stats = device.BufferPoolStats;
+            testCase.verifyEqual( stats.hits - before.hits, 5 );
+            testCase.verifyEqual( stats.misses, before.misses );
+            testCase.verifyGreaterThan( stats.hit_rate, 0 );
+            
+            testCase.verifyEqual( device.TrimBufferPool, uint32(1) );
+            stats = device.BufferPoolStats;
+            testCase.verifyEqual( stats.reserved_bytes, stats.in_use_bytes );
+        end
+        
+        
         function testBufferEmpty( testCase )
             device = MetalDevice( 1 );
             
@@ -310,9 +356,12 @@ classdef testMetalClasses < matlab.unittest.TestCase
             testCase.verifyEqual( result, uint32(1));
             result = command_encoder.EndEncoding;
             testCase.verifyEqual( result, uint32(1));
+            testCase.verifyEqual( command_buffer.status, uint32(0));
             
             result = command_buffer.Commit;
             testCase.verifyEqual( result, uint32(1));
+            testCase.verifyEqual( MetalCommandBuffer.WaitAny( command_buffer ), 1);
+            testCase.verifyTrue( command_buffer.isCompleted );
             result = command_buffer.WaitForCompletion;
             testCase.verifyEqual( result, uint32(1));
             
@@ -321,5 +370,440 @@ classdef testMetalClasses < matlab.unittest.TestCase
             
         end
         
+        
+        function testStream( testCase, TestSource )
+            if ~TestSource.isValid
+                return
+            end
+            
+            device = MetalDevice( 1 );
+            library = MetalLibrary( device, TestSource.source );
+            sqr = MetalComputePipelineState( library, TestSource.functionName );
+            queue = MetalCommandQueue( device );
+            A = rand( [ 1000, 300 ], 'single' );
+            
+            % Three chunks of 10000 elements in and out fill the budget, so A takes 30 chunks
+            [ B, result ] = queue.Stream( sqr, A, {}, 3 * 10000 * 8 );
+            testCase.verifyEqual( result, uint32(1) );
+            testCase.verifyEqual( B, A .* A );
+            
+            [ B, result ] = queue.Stream( sqr, A );
+            testCase.verifyEqual( result, uint32(1) );
+            testCase.verifyEqual( B, A .* A );
+            
+            [ ~, result ] = queue.Stream( sqr, A, {}, 1 );
+            testCase.verifyEqual( result, uint32(0) );
+            testCase.verifyNotEmpty( queue.message );
+        end
+        
+        
+        function testFileBuffer( testCase )
+            device = MetalDevice( 1 );
+            A = rand( [ 100, 30 ], 'single' );
+            filename = [ tempname, '.bin' ];
+            fid = fopen( filename, 'w' );
+            fwrite( fid, single( 7 ), 'single' );
+            fwrite( fid, A, 'single' );
+            fclose( fid );
+            cleanup = onCleanup( @() delete( filename ) );
+            
+            % Read-only, past the one-element header
+            buffer = MetalBuffer.FromFile( device, filename, size( A ), 'single', Metal.FileReadOnly, 4 );
+            testCase.verifyTrue( buffer.isValid, buffer.message );
+            testCase.verifyEqual( single( buffer ), A );
+            testCase.verifyEqual( buffer.Sum(), sum( A, 'all' ), 'RelTol', 1e-5 );
+            testCase.verifyFalse( buffer.WriteRegion( [ 1 1 1 ], single( 0 ) ) );
+            
+            % Copy-on-write: the buffer changes, the file does not
+            copy = MetalBuffer.FromFile( device, filename, size( A ), 'single', Metal.FileCopyOnWrite, 4 );
+            testCase.verifyTrue( copy.WriteRegion( [ 1 1 1 ], single( -1 ) ) );
+            B = single( copy );
+            testCase.verifyEqual( B( 1, 1 ), single( -1 ) );
+            fid = fopen( filename, 'r' );
+            stored = fread( fid, [ 1, 2 ], 'single=>single' );
+            fclose( fid );
+            testCase.verifyEqual( stored( 2 ), A( 1, 1 ) );
+            
+            missing = MetalBuffer.FromFile( device, [ filename, '.missing' ], size( A ) );
+            testCase.verifyFalse( missing.isValid );
+            testCase.verifyNotEmpty( missing.message );
+        end
+        
+        
+        function testWrapHostArray( testCase )
+            device = MetalDevice( 1 );
+            A = rand( [ 64, 32 ], 'single' );
+            
+            % In MATLAB the array is copied, so the buffer behaves as any other
+            buffer = MetalBuffer.WrapHostArray( device, A );
+            testCase.verifyTrue( buffer.isValid, buffer.message );
+            testCase.verifyEqual( buffer.dimensions, size( A ) );
+            testCase.verifyEqual( single( buffer ), A );
+            
+            B = uint16( 1 : 100 );
+            buffer = MetalBuffer.WrapHostArray( device, B );
+            testCase.verifyEqual( uint16( buffer ), B );
+        end
+        
+        
+        function testDispatchChain( testCase )
+            device = MetalDevice( 1 );
+            library = MetalLibrary( device, string( fileread( "MetalFunctionLibrary.mtl" ) ) );
+            testCase.verifyTrue( library.isValid );
+            zerobuff = MetalComputePipelineState( library, "zerobuff" );
+            accumulate = MetalComputePipelineState( library, "accumulate" );
+            scaleaccum = MetalComputePipelineState( library, "scaleaccum" );
+            
+            A = rand( [ 200, 300 ], 'single' );
+            B = rand( [ 200, 300 ], 'single' );
+            bufferA = MetalBuffer( device, A );
+            bufferB = MetalBuffer( device, B );
+            bufferScale = MetalBuffer( device, single( 0.5 ) );
+            n = numel( A );
+            
+            % A = 0; A = A + B; A = A + B * 0.5, in one command buffer
+            command_buffer = MetalCommandBuffer( MetalCommandQueue( device ) );
+            result = command_buffer.EncodeDispatches( { zerobuff, accumulate, scaleaccum }, ...
+                { { bufferA }, { bufferA, bufferB }, { bufferA, bufferB, bufferScale } }, [ n; n; n ] );
+            testCase.verifyEqual( result, uint32(1), command_buffer.message );
+            testCase.verifyEqual( command_buffer.Commit, uint32(1) );
+            testCase.verifyEqual( command_buffer.WaitForCompletion, uint32(1) );
+            
+            testCase.verifyEqual( single( bufferA ), B + B * single( 0.5 ), 'AbsTol', single( 1e-6 ) );
+        end
+        
+        
+        function testCommandList( testCase )
+            device = MetalDevice( 1 );
+            library = MetalLibrary( device, string( fileread( "MetalFunctionLibrary.mtl" ) ) );
+            accumulate = MetalComputePipelineState( library, "accumulate" );
+            
+            B = rand( [ 100, 100 ], 'single' );
+            C = rand( [ 100, 100 ], 'single' );
+            bufferA = MetalBuffer( device, zeros( [ 100, 100 ], 'single' ) );
+            bufferB = MetalBuffer( device, B );
+            bufferC = MetalBuffer( device, C );
+            n = numel( B );
+            
+            command_list = MetalCommandList( device, { accumulate, accumulate }, { { bufferA, bufferB }, { bufferA, bufferB } }, [ n; n ] );
+            testCase.verifyTrue( command_list.isValid, command_list.message );
+            command_queue = MetalCommandQueue( device );
+            for replay = 1:3
+                command_buffer = MetalCommandBuffer( command_queue );
+                testCase.verifyEqual( command_buffer.EncodeCommandList( command_list ), uint32(1), command_buffer.message );
+                testCase.verifyEqual( command_buffer.Commit, uint32(1) );
+                testCase.verifyEqual( command_buffer.WaitForCompletion, uint32(1) );
+            end
+            testCase.verifyEqual( single( bufferA ), 6 * B, 'RelTol', single( 1e-5 ) );
+            
+            % A = A + B + C
+            testCase.verifyEqual( command_list.SetBuffer( 2, 2, bufferC ), uint32(1), command_list.message );
+            command_buffer = MetalCommandBuffer( command_queue );
+            command_buffer.EncodeCommandList( command_list );
+            testCase.verifyEqual( command_buffer.Commit, uint32(1) );
+            testCase.verifyEqual( command_buffer.WaitForCompletion, uint32(1) );
+            testCase.verifyEqual( single( bufferA ), 7 * B + C, 'RelTol', single( 1e-5 ) );
+            
+            testCase.verifyEqual( command_list.SetBuffer( 3, 1, bufferC ), uint32(0) );
+        end
+        
+        
+        function testThreadgroupSize( testCase )
+            device = MetalDevice( 1 );
+            library = MetalLibrary( device, string( fileread( "MetalFunctionLibrary.mtl" ) ) );
+            accumulate = MetalComputePipelineState( library, "accumulate" );
+            testCase.verifyGreaterThanOrEqual( accumulate.maxTotalThreadsPerThreadgroup, accumulate.threadExecutionWidth );
+            
+            A = rand( [ 300, 70 ], 'single' );
+            B = rand( [ 300, 70 ], 'single' );
+            bufferA = MetalBuffer( device, A );
+            bufferB = MetalBuffer( device, B );
+            scratch = MetalBuffer( device, A );
+            queue = MetalCommandQueue( device );
+            
+            % Tune on a scratch buffer, as the kernel accumulates
+            [ group_size, result ] = accumulate.AutotuneThreadgroupSize( queue, { scratch, bufferB }, numel( A ), 3 );
+            testCase.verifyEqual( result, uint32(1), accumulate.message );
+            testCase.verifyLessThanOrEqual( prod( group_size ), accumulate.maxTotalThreadsPerThreadgroup );
+            
+            % The tuned size is used without asking; an explicit one can still be given
+            for group = { [], [ 64 1 1 ] }
+                command_buffer = MetalCommandBuffer( queue );
+                command_encoder = MetalCommandEncoder( command_buffer );
+                command_encoder.SetComputePipelineState( accumulate );
+                command_encoder.SetBuffer( bufferA, 1 );
+                command_encoder.SetBuffer( bufferB, 2 );
+                if isempty( group{1} )
+                    result = command_encoder.SetThreadsAndShape( accumulate, numel( A ) );
+                else
+                    result = command_encoder.SetThreadsAndShape( accumulate, numel( A ), group{1} );
+                end
+                testCase.verifyEqual( result, uint32(1), command_encoder.message );
+                command_encoder.EndEncoding;
+                command_buffer.Commit;
+                command_buffer.WaitForCompletion;
+            end
+            testCase.verifyEqual( single( bufferA ), A + 2 * B, 'AbsTol', single( 1e-5 ) );
+        end
+        
+        
+        function testConcurrentEncoder( testCase )
+            device = MetalDevice( 1 );
+            library = MetalLibrary( device, string( fileread( "MetalFunctionLibrary.mtl" ) ) );
+            accumulate = MetalComputePipelineState( library, "accumulate" );
+            
+            A = rand( [ 300, 70 ], 'single' );
+            B = rand( [ 300, 70 ], 'single' );
+            C = rand( [ 300, 70 ], 'single' );
+            bufferA = MetalBuffer( device, A );
+            bufferB = MetalBuffer( device, B );
+            bufferC = MetalBuffer( device, C );
+            
+            % A += B and C += B only read B, so they may run together;
+            % B += A has to wait for the first and C += A for the last
+            command_buffer = MetalCommandBuffer( MetalCommandQueue( device ) );
+            command_encoder = MetalCommandEncoder( command_buffer, 'concurrent' );
+            testCase.verifyTrue( command_encoder.isValid, command_encoder.message );
+            for pair = { { bufferA, bufferB }, { bufferC, bufferB }, { bufferB, bufferA }, { bufferC, bufferA } }
+                command_encoder.SetComputePipelineState( accumulate );
+                command_encoder.SetBuffer( pair{1}{1}, 1 );
+                testCase.verifyEqual( command_encoder.SetBuffer( pair{1}{2}, 2, 'read' ), uint32(1) );
+                testCase.verifyEqual( command_encoder.SetThreadsAndShape( accumulate, numel( A ) ), uint32(1) );
+            end
+            testCase.verifyEqual( command_encoder.SetBuffer( bufferA, 1, 'write' ), uint32(0) );
+            command_encoder.EndEncoding;
+            command_buffer.Commit;
+            command_buffer.WaitForCompletion;
+            
+            testCase.verifyEqual( single( bufferA ), A + B, 'AbsTol', single( 1e-5 ) );
+            testCase.verifyEqual( single( bufferB ), A + 2 * B, 'AbsTol', single( 1e-5 ) );
+            testCase.verifyEqual( single( bufferC ), A + 2 * B + C, 'AbsTol', single( 1e-5 ) );
+            
+            command_encoder = MetalCommandEncoder( command_buffer, 'parallel' );
+            testCase.verifyFalse( command_encoder.isValid );
+        end
+        
+        
+        function testIndirectDispatch( testCase )
+            device = MetalDevice( 1 );
+            library = MetalLibrary( device, string( fileread( "MetalFunctionLibrary.mtl" ) ) );
+            accumulate = MetalComputePipelineState( library, "accumulate" );
+            
+            A = rand( [ 1000, 1 ], 'single' );
+            B = rand( [ 1000, 1 ], 'single' );
+            bufferA = MetalBuffer( device, A );
+            bufferB = MetalBuffer( device, B );
+            % Two threadgroups of 64 threads, after a grid that is not used
+            bufferArguments = MetalBuffer( device, uint32( [ 9 9 9 0 2 1 1 0 ] ) );
+            
+            command_buffer = MetalCommandBuffer( MetalCommandQueue( device ) );
+            command_encoder = MetalCommandEncoder( command_buffer );
+            command_encoder.SetComputePipelineState( accumulate );
+            command_encoder.SetBuffer( bufferA, 1 );
+            command_encoder.SetBuffer( bufferB, 2, 'read' );
+            result = command_encoder.DispatchIndirect( accumulate, bufferArguments, 16, [ 64 1 1 ] );
+            testCase.verifyEqual( result, uint32(1), command_encoder.message );
+            testCase.verifyEqual( command_encoder.DispatchIndirect( accumulate, bufferArguments, 30, [ 64 1 1 ] ), uint32(0) );
+            command_encoder.EndEncoding;
+            command_buffer.Commit;
+            command_buffer.WaitForCompletion;
+            
+            expected = A;
+            expected( 1:128 ) = A( 1:128 ) + B( 1:128 );
+            testCase.verifyEqual( single( bufferA ), expected, 'AbsTol', single( 1e-6 ) );
+        end
+        
+        
+        function testEvents( testCase )
+            device = MetalDevice( 1 );
+            library = MetalLibrary( device, string( fileread( "MetalFunctionLibrary.mtl" ) ) );
+            accumulate = MetalComputePipelineState( library, "accumulate" );
+            
+            A = rand( [ 300, 70 ], 'single' );
+            B = rand( [ 300, 70 ], 'single' );
+            bufferA = MetalBuffer( device, A );
+            bufferB = MetalBuffer( device, B );
+            event = MetalEvent( device );
+            testCase.verifyTrue( event.isValid );
+            testCase.verifyEqual( event.value, uint64(0) );
+            
+            % B += A waits on one queue for A += B on another, committed after it
+            queues = { MetalCommandQueue( device ), MetalCommandQueue( device ) };
+            pairs = { { bufferB, bufferA }, { bufferA, bufferB } };
+            command_buffers = cell( 1, 2 );
+            for q = 1:2
+                command_buffers{q} = MetalCommandBuffer( queues{q} );
+                if q == 1
+                    testCase.verifyEqual( command_buffers{q}.EncodeWaitForEvent( event, 1 ), uint32(1) );
+                end
+                command_encoder = MetalCommandEncoder( command_buffers{q} );
+                command_encoder.SetComputePipelineState( accumulate );
+                command_encoder.SetBuffer( pairs{q}{1}, 1 );
+                command_encoder.SetBuffer( pairs{q}{2}, 2 );
+                command_encoder.SetThreadsAndShape( accumulate, numel( A ) );
+                command_encoder.EndEncoding;
+                if q == 2
+                    testCase.verifyEqual( command_buffers{q}.EncodeSignalEvent( event, 1 ), uint32(1) );
+                end
+                command_buffers{q}.Commit;
+            end
+            testCase.verifyEqual( MetalCommandBuffer.WaitAll( command_buffers{:} ), uint32(1) );
+            testCase.verifyEqual( single( bufferA ), A + B, 'AbsTol', single( 1e-5 ) );
+            testCase.verifyEqual( single( bufferB ), A + 2 * B, 'AbsTol', single( 1e-5 ) );
+            
+            testCase.verifyEqual( event.Signal( 5 ), uint32(1) );
+            testCase.verifyEqual( event.value, uint64(5) );
+            testCase.verifyEqual( event.Wait( 5 ), uint32(1) );
+            testCase.verifyEqual( event.Wait( 6, 0.01 ), uint32(0) );
+            testCase.verifyNotEmpty( event.message );
+        end
+        
+        
+        function testInlineScale( testCase )
+            device = MetalDevice( 1 );
+            A = rand( [ 200, 300 ], 'single' );
+            B = rand( [ 200, 300 ], 'single' );
+            bufferA = MetalBuffer( device, A );
+            bufferB = MetalBuffer( device, B );
+            
+            % The scale is passed with SetBytes rather than in a buffer
+            ScaleAccumulate( bufferA, bufferB, 0.25 );
+            testCase.verifyEqual( single( bufferA ), A + B * single( 0.25 ), 'AbsTol', single( 1e-6 ) );
+            
+            command_encoder = MetalCommandEncoder( MetalCommandBuffer( MetalCommandQueue( device ) ) );
+            testCase.verifyEqual( command_encoder.SetBytes( zeros( 1, 4097, 'uint8' ), 3 ), uint32(0) );
+            testCase.verifyNotEmpty( command_encoder.message );
+        end
+        
+        
+        function testReductions( testCase )
+            device = MetalDevice( 1 );
+            A = single( randi( [ -100 100 ], [ 40, 30, 5 ] ) );
+            buffer = MetalBuffer( device, A );
+            
+            testCase.verifyEqual( buffer.Sum, sum( double( A(:) ) ) );
+            testCase.verifyEqual( buffer.Sum( [], true ), sum( double( A(:) ) ) );
+            testCase.verifyEqual( buffer.Mean, mean( double( A(:) ) ), 'AbsTol', 1e-9 );
+            testCase.verifyEqual( buffer.Norm, norm( double( A(:) ) ), 'RelTol', 1e-9 );
+            [ value, index ] = buffer.Max;
+            [ expected, expected_index ] = max( A(:) );
+            testCase.verifyEqual( [ value, index ], double( [ expected, expected_index ] ) );
+            [ value, index ] = buffer.Min;
+            [ expected, expected_index ] = min( A(:) );
+            testCase.verifyEqual( [ value, index ], double( [ expected, expected_index ] ) );
+            
+            % Along each dimension the result stays on the device
+            for dim = 1:3
+                reduced = buffer.Sum( dim );
+                testCase.verifyEqual( single( reduced ), sum( A, dim ), 'AbsTol', single( 1e-3 ) );
+                [ reduced, index ] = buffer.Max( dim );
+                [ expected, expected_index ] = max( A, [], dim );
+                testCase.verifyEqual( single( reduced ), expected );
+                testCase.verifyEqual( index, expected_index );
+            end
+            
+            testCase.verifyTrue( isnan( MetalBuffer( device, [ 4 4 ], 'uint16' ).Sum ) );
+        end
+        
+        
+        function testElementwise( testCase )
+            device = MetalDevice( 1 );
+            A = rand( [ 60, 50, 2 ], 'single' ) - 0.5;
+            B = rand( [ 60, 50, 2 ], 'single' );
+            C = rand( [ 60, 50, 2 ], 'single' );
+            bufferA = MetalBuffer( device, A );
+            bufferB = MetalBuffer( device, B );
+            bufferC = MetalBuffer( device, C );
+            
+            % The whole chain builds one expression and runs as one kernel
+            expression = max( bufferA + 0.5 * bufferB, bufferC ) - abs( bufferA ) ./ 2;
+            testCase.verifyClass( expression, 'MetalExpression' );
+            testCase.verifyEqual( numel( expression.inputs ), 3 );
+            testCase.verifyEqual( single( expression ), max( A + 0.5 * B, C ) - abs( A ) ./ 2, 'AbsTol', single( 1e-6 ) );
+            
+            % Evaluating into an input updates it in place
+            [ ~, result ] = Evaluate( -bufferA .* bufferB, bufferA );
+            testCase.verifyTrue( result );
+            testCase.verifyEqual( single( bufferA ), -A .* B );
+            
+            testCase.verifyError( @() bufferA + MetalBuffer( device, [ 3 3 ] ), 'MetalExpression:SizeMismatch' );
+            testCase.verifyError( @() bufferA * bufferB, 'MetalExpression:Operand' );
+        end
+        
+        
+        function testBufferReducedPrecision( testCase )
+            device = MetalDevice( 1 );
+            A = rand( [ 120, 80, 3 ], 'single' ) * 100 - 50;
+            B = rand( [ 120, 80, 3 ], 'single' );
+            
+            bufferHalf = MetalBuffer( device, A, 'half' );
+            testCase.verifyEqual( bufferHalf.data_class, 'half' );
+            testCase.verifyEqual( bufferHalf.numbytes, numel( A ) * 2 );
+            testCase.verifyEqual( single( bufferHalf ), A, 'RelTol', single( 2^-11 ) );
+            
+            bufferBFloat16 = MetalBuffer( device, A, 'bfloat16' );
+            testCase.verifyEqual( bufferBFloat16.numbytes, numel( A ) * 2 );
+            testCase.verifyEqual( single( bufferBFloat16 ), A, 'RelTol', single( 2^-8 ) );
+            % bfloat16 keeps the top half of each single
+            low_bits = bitand( typecast( reshape( single( bufferBFloat16 ), 1, [] ), 'uint32' ), uint32( 65535 ) );
+            testCase.verifyFalse( any( low_bits ) );
+            
+            % The kernels read the reduced-precision operand and accumulate in single
+            widened = single( bufferHalf );
+            bufferB = MetalBuffer( device, B );
+            ScaleAccumulate( bufferB, bufferHalf, 0.5 );
+            testCase.verifyEqual( single( bufferB ), B + widened * single( 0.5 ), 'AbsTol', single( 1e-5 ) );
+            
+            empty = MetalBuffer( device, [ 4 4 ], 'bfloat16' );
+            testCase.verifyEqual( empty.numbytes, 32 );
+            testCase.verifyFalse( bufferHalf.WriteRegion( [ 1 1 1 ], single( 1 ) ) );
+        end
+        
+        
+        function testProfiling( testCase )
+            device = MetalDevice( 1 );
+            library = MetalLibrary( device, string( fileread( "MetalFunctionLibrary.mtl" ) ) );
+            zerobuff = MetalComputePipelineState( library, "zerobuff" );
+            accumulate = MetalComputePipelineState( library, "accumulate" );
+            bufferA = MetalBuffer( device, rand( [ 100, 100 ], 'single' ) );
+            bufferB = MetalBuffer( device, rand( [ 100, 100 ], 'single' ) );
+            n = 100 * 100;
+            
+            Metal.ClearProfile;
+            Metal.SetProfilingEnabled( true );
+            testCase.addTeardown( @() Metal.SetProfilingEnabled( false ) );
+            testCase.verifyTrue( Metal.ProfilingEnabled );
+            
+            command_buffer = MetalCommandBuffer( MetalCommandQueue( device ) );
+            command_buffer.EncodeDispatches( { zerobuff, accumulate }, { { bufferA }, { bufferA, bufferB } }, [ n; n ] );
+            testCase.verifyEqual( command_buffer.Commit, uint32(1) );
+            testCase.verifyEqual( command_buffer.WaitForCompletion, uint32(1) );
+            single( bufferA );
+            
+            timing = command_buffer.Timing;
+            testCase.verifyEqual( timing.num_dispatches, 2 );
+            testCase.verifyEqual( timing.status, uint32(4) );
+            testCase.verifyLessThanOrEqual( timing.encode_start, timing.commit_time );
+            testCase.verifyLessThanOrEqual( timing.start_time, timing.end_time );
+            testCase.verifyLessThanOrEqual( timing.end_time, Metal.ProfileTime );
+            testCase.verifyEqual( [ timing.dispatches.function_name ], [ "zerobuff", "accumulate" ] );
+            testCase.verifyEqual( timing.dispatches(2).shape, [ n 1 1 ] );
+            
+            stats = Metal.ProfileStats;
+            testCase.verifyEqual( stats.commits, 1 );
+            testCase.verifyGreaterThanOrEqual( stats.waits, 1 );
+            testCase.verifyEqual( stats.bytes_out, n * 4 );
+            
+            filename = [ tempname '.json' ];
+            testCase.addTeardown( @() delete( filename ) );
+            testCase.verifyEqual( Metal.WriteProfileTrace( filename ), uint32(1) );
+            trace = fileread( filename );
+            jsondecode( trace );
+            testCase.verifyTrue( contains( trace, '"name":"Command buffer"' ) );
+            
+            Metal.ClearProfile;
+            testCase.verifyEqual( Metal.ProfileStats.commits, 0 );
+        end
+        
     end
 end
\ No newline at end of file